@@ -0,0 +1,518 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Replay a workload recorded by nbd_record_start.
+ *
+ * The commands in the file are issued again, in the order they were
+ * submitted, from a single thread using the AIO API over one or more
+ * connections in turn.  A command is not issued before the command
+ * which had completed when it was recorded has completed again, nor
+ * (unless --speed=0) before the time it was submitted, scaled by the
+ * speed.  When every command has completed this prints, for each
+ * type of command, the mean and 99th percentile latency recorded and
+ * replayed, so that a change to the server or to libnbd can be
+ * judged with the I/O pattern of a real program.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "nbd-record.h"
+
+#define NR_TYPES (LIBNBD_CMD_BLOCK_STATUS + 1)
+
+static const char *type_names[NR_TYPES] = {
+  "read", "write", "disc", "flush", "trim", "cache", "zero", "block_status",
+};
+
+/* A recorded command, in host byte order, and how it went when it
+ * was replayed.
+ */
+struct entry {
+  uint64_t time, latency, offset, count;
+  uint32_t seq, after;
+  uint16_t type, flags;
+  uint32_t error;
+
+  uint64_t start_us, replay_latency;
+  bool done, skipped;
+  int replay_error;
+};
+
+static double speed = 1.0;
+static unsigned depth = 64;
+static unsigned nr_connections = 1;
+static unsigned in_flight;
+
+static void __attribute__((noreturn))
+usage (FILE *fp, int exitcode)
+{
+  fprintf (fp,
+"\n"
+"Replay commands recorded with nbd_record_start:\n"
+"\n"
+"    replay [--speed=F] [--depth=N] [--connections=N] FILE URI\n"
+"    replay [--speed=F] [--depth=N] [--connections=N] FILE -- CMD [ARGS...]\n"
+"\n"
+"The server is reached by the NBD URI, or by running CMD which must\n"
+"serve NBD on stdin and stdout (for example nbdkit -s), once for each\n"
+"connection.  --speed=2 replays twice as fast as recorded, and\n"
+"--speed=0 as fast as the order of the commands allows.  --depth is\n"
+"the most commands in flight on each connection.\n"
+"\n"
+);
+  exit (exitcode);
+}
+
+static uint64_t
+now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000) + ts.tv_nsec / 1000;
+}
+
+static int
+compare_seq (const void *a, const void *b)
+{
+  const struct entry *ea = a, *eb = b;
+
+  return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  const uint64_t *ua = a, *ub = b;
+
+  return *ua < *ub ? -1 : *ua > *ub;
+}
+
+/* Read the records, and return them sorted by submission order. */
+static struct entry *
+read_records (const char *filename, size_t *nr)
+{
+  FILE *fp;
+  char magic[8];
+  struct nbd_record rec;
+  struct entry *entries = NULL, *e;
+  size_t n = 0, size = 0;
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  if (fread (magic, sizeof magic, 1, fp) != 1 ||
+      memcmp (magic, NBD_RECORD_MAGIC, sizeof magic) != 0) {
+    fprintf (stderr, "replay: %s: not a libnbd record file\n", filename);
+    exit (EXIT_FAILURE);
+  }
+
+  while (fread (&rec, sizeof rec, 1, fp) == 1) {
+    if (n == size) {
+      size = size ? size * 2 : 1024;
+      entries = realloc (entries, size * sizeof *entries);
+      if (entries == NULL) {
+        perror ("realloc");
+        exit (EXIT_FAILURE);
+      }
+    }
+    e = &entries[n++];
+    memset (e, 0, sizeof *e);
+    e->time = be64toh (rec.time);
+    e->latency = be64toh (rec.latency);
+    e->offset = be64toh (rec.offset);
+    e->count = be64toh (rec.count);
+    e->seq = be32toh (rec.seq);
+    e->after = be32toh (rec.after);
+    e->type = be16toh (rec.type);
+    e->flags = be16toh (rec.flags);
+    e->error = be32toh (rec.error);
+    if (e->type >= NR_TYPES || e->type == LIBNBD_CMD_DISC) {
+      fprintf (stderr, "replay: %s: unknown command type %u\n",
+               filename, e->type);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (ferror (fp)) {
+    perror (filename);
+    exit (EXIT_FAILURE);
+  }
+  fclose (fp);
+
+  qsort (entries, n, sizeof *entries, compare_seq);
+  *nr = n;
+  return entries;
+}
+
+/* Return the command numbered seq, or NULL if it was not recorded. */
+static struct entry *
+find_seq (struct entry *entries, size_t n, uint32_t seq)
+{
+  struct entry key = { .seq = seq };
+
+  return bsearch (&key, entries, n, sizeof *entries, compare_seq);
+}
+
+static int
+command_completed (void *vp, int *error)
+{
+  struct entry *e = vp;
+
+  e->replay_latency = now_us () - e->start_us;
+  e->replay_error = *error;
+  e->done = true;
+  in_flight--;
+  return 1;
+}
+
+static int
+extent (void *vp, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  return 0;
+}
+
+/* Issue one command, dropping the flags the server does not support.
+ * Commands the server cannot do at all, or which lie beyond the end
+ * of its export, are skipped.
+ */
+static void
+issue (struct nbd_handle *nbd, struct entry *e, char *buf)
+{
+  nbd_completion_callback cb = { .callback = command_completed,
+                                 .user_data = e };
+  uint32_t flags = e->flags;
+  int64_t size, r;
+  int can;
+
+  if (nbd_can_fua (nbd) != 1)
+    flags &= ~LIBNBD_CMD_FLAG_FUA;
+  if (nbd_can_fast_zero (nbd) != 1)
+    flags &= ~LIBNBD_CMD_FLAG_FAST_ZERO;
+
+  size = nbd_get_size (nbd);
+  switch (e->type) {
+  case LIBNBD_CMD_FLUSH: can = nbd_can_flush (nbd); break;
+  case LIBNBD_CMD_TRIM: can = nbd_can_trim (nbd); break;
+  case LIBNBD_CMD_CACHE: can = nbd_can_cache (nbd); break;
+  case LIBNBD_CMD_WRITE_ZEROES: can = nbd_can_zero (nbd); break;
+  case LIBNBD_CMD_BLOCK_STATUS:
+    can = nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+    break;
+  default: can = 1;
+  }
+  if (can != 1 || size == -1 ||
+      e->offset > (uint64_t) size || e->count > (uint64_t) size - e->offset) {
+    e->skipped = e->done = true;
+    return;
+  }
+
+  e->start_us = now_us ();
+  switch (e->type) {
+  case LIBNBD_CMD_READ:
+    r = nbd_aio_pread (nbd, buf, e->count, e->offset, cb, 0);
+    break;
+  case LIBNBD_CMD_WRITE:
+    r = nbd_aio_pwrite (nbd, buf, e->count, e->offset, cb,
+                        flags & LIBNBD_CMD_FLAG_FUA);
+    break;
+  case LIBNBD_CMD_FLUSH:
+    r = nbd_aio_flush (nbd, cb, 0);
+    break;
+  case LIBNBD_CMD_TRIM:
+    r = nbd_aio_trim (nbd, e->count, e->offset, cb,
+                      flags & LIBNBD_CMD_FLAG_FUA);
+    break;
+  case LIBNBD_CMD_CACHE:
+    r = nbd_aio_cache (nbd, e->count, e->offset, cb, 0);
+    break;
+  case LIBNBD_CMD_WRITE_ZEROES:
+    r = nbd_aio_zero (nbd, e->count, e->offset, cb,
+                      flags & (LIBNBD_CMD_FLAG_FUA |
+                               LIBNBD_CMD_FLAG_NO_HOLE |
+                               LIBNBD_CMD_FLAG_FAST_ZERO));
+    break;
+  case LIBNBD_CMD_BLOCK_STATUS:
+    r = nbd_aio_block_status (nbd, e->count, e->offset,
+                              (nbd_extent_callback) { .callback = extent },
+                              cb, flags & LIBNBD_CMD_FLAG_REQ_ONE);
+    break;
+  default:
+    abort ();
+  }
+  if (r == -1) {
+    fprintf (stderr, "replay: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  in_flight++;
+}
+
+/* Run the state machine of every connection until something happens
+ * or timeout milliseconds have passed.
+ */
+static void
+poll_connections (struct nbd_handle **conns, int timeout)
+{
+  struct pollfd fds[nr_connections];
+  unsigned i, dir;
+
+  for (i = 0; i < nr_connections; ++i) {
+    fds[i].fd = nbd_aio_get_fd (conns[i]);
+    dir = nbd_aio_get_direction (conns[i]);
+    fds[i].events = 0;
+    if (dir & LIBNBD_AIO_DIRECTION_READ)
+      fds[i].events |= POLLIN;
+    if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+      fds[i].events |= POLLOUT;
+    fds[i].revents = 0;
+  }
+  if (poll (fds, nr_connections, timeout) == -1) {
+    if (errno == EINTR)
+      return;
+    perror ("poll");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_connections; ++i) {
+    if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+        nbd_aio_notify_read (conns[i]) == -1) {
+      fprintf (stderr, "replay: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if ((fds[i].revents & POLLOUT) && nbd_aio_notify_write (conns[i]) == -1) {
+      fprintf (stderr, "replay: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+replay (struct entry *entries, size_t n, struct nbd_handle **conns,
+        char *buf)
+{
+  uint64_t start, now, due;
+  struct entry *e, *after;
+  size_t next = 0;
+  int timeout;
+
+  start = now_us ();
+  while (next < n || in_flight > 0) {
+    timeout = -1;
+    while (next < n) {
+      e = &entries[next];
+      after = e->after ? find_seq (entries, n, e->after) : NULL;
+      if (after && !after->done)
+        break;
+      if (speed > 0) {
+        now = now_us ();
+        due = start + (uint64_t) (e->time / speed);
+        if (now < due) {
+          timeout = (due - now + 999) / 1000;
+          break;
+        }
+      }
+      if (nbd_aio_in_flight (conns[next % nr_connections]) >= (int) depth)
+        break;
+      issue (conns[next % nr_connections], e, buf);
+      next++;
+    }
+    if (next == n && in_flight == 0)
+      break;
+    poll_connections (conns, timeout);
+  }
+}
+
+/* Print one line of the report for the commands of type (or of all
+ * types if type is -1).
+ */
+static void
+report (const char *name, const struct entry *entries, size_t n, int type)
+{
+  uint64_t *recorded, *replayed;
+  uint64_t recorded_sum = 0, replayed_sum = 0;
+  size_t i, nr = 0, errors = 0, p99;
+  double recorded_mean, replayed_mean;
+
+  recorded = malloc (n * sizeof *recorded);
+  replayed = malloc (n * sizeof *replayed);
+  if (recorded == NULL || replayed == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; ++i) {
+    if ((type != -1 && entries[i].type != type) || entries[i].skipped)
+      continue;
+    recorded[nr] = entries[i].latency;
+    replayed[nr] = entries[i].replay_latency;
+    recorded_sum += recorded[nr];
+    replayed_sum += replayed[nr];
+    if (entries[i].replay_error)
+      errors++;
+    nr++;
+  }
+  if (nr > 0) {
+    qsort (recorded, nr, sizeof *recorded, compare_u64);
+    qsort (replayed, nr, sizeof *replayed, compare_u64);
+    p99 = (nr * 99 + 99) / 100 - 1;
+    recorded_mean = (double) recorded_sum / nr;
+    replayed_mean = (double) replayed_sum / nr;
+    printf ("%s,%zu,%zu,%.1f,%.1f,%.1f,%" PRIu64 ",%" PRIu64 "\n",
+            name, nr, errors, recorded_mean, replayed_mean,
+            recorded_mean > 0 ?
+            (replayed_mean - recorded_mean) * 100 / recorded_mean : 0,
+            recorded[p99], replayed[p99]);
+  }
+  free (recorded);
+  free (replayed);
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum {
+    HELP_OPTION = CHAR_MAX + 1,
+    CONNECTIONS_OPTION,
+    DEPTH_OPTION,
+    SPEED_OPTION,
+  };
+  const char *short_options = "";
+  const struct option long_options[] = {
+    { "connections", required_argument, NULL, CONNECTIONS_OPTION },
+    { "depth",       required_argument, NULL, DEPTH_OPTION },
+    { "help",        no_argument,       NULL, HELP_OPTION },
+    { "speed",       required_argument, NULL, SPEED_OPTION },
+    { NULL }
+  };
+  struct nbd_handle **conns;
+  struct entry *entries;
+  uint64_t max_count = 1, start, recorded_end = 0;
+  size_t n, i, skipped = 0;
+  char *buf, *end;
+  int c;
+
+  for (;;) {
+    c = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case HELP_OPTION:
+      usage (stdout, EXIT_SUCCESS);
+
+    case CONNECTIONS_OPTION:
+      nr_connections = strtoul (optarg, &end, 0);
+      if (*end != '\0' || nr_connections < 1 || nr_connections > 64) {
+        fprintf (stderr, "replay: invalid connections: %s\n", optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case DEPTH_OPTION:
+      depth = strtoul (optarg, &end, 0);
+      if (*end != '\0' || depth < 1 || depth > INT_MAX) {
+        fprintf (stderr, "replay: invalid depth: %s\n", optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case SPEED_OPTION:
+      speed = strtod (optarg, &end);
+      if (*end != '\0' || !(speed >= 0)) {
+        fprintf (stderr, "replay: invalid speed: %s\n", optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    default:
+      usage (stderr, EXIT_FAILURE);
+    }
+  }
+  if (argc - optind < 2)
+    usage (stderr, EXIT_FAILURE);
+
+  entries = read_records (argv[optind], &n);
+  for (i = 0; i < n; ++i) {
+    if ((entries[i].type == LIBNBD_CMD_READ ||
+         entries[i].type == LIBNBD_CMD_WRITE) &&
+        entries[i].count > max_count)
+      max_count = entries[i].count;
+    if (entries[i].time + entries[i].latency > recorded_end)
+      recorded_end = entries[i].time + entries[i].latency;
+  }
+  buf = calloc (1, max_count);
+  if (buf == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+
+  conns = calloc (nr_connections, sizeof *conns);
+  if (conns == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_connections; ++i) {
+    conns[i] = nbd_create ();
+    if (conns[i] == NULL ||
+        nbd_add_meta_context (conns[i],
+                              LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+        (argc - optind == 2 ?
+         nbd_connect_uri (conns[i], argv[optind + 1]) :
+         nbd_connect_command (conns[i], &argv[optind + 1])) == -1) {
+      fprintf (stderr, "replay: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  start = now_us ();
+  replay (entries, n, conns, buf);
+  for (i = 0; i < n; ++i)
+    if (entries[i].skipped)
+      skipped++;
+  fprintf (stderr, "replay: %zu commands (%zu skipped) in %.3f seconds, "
+           "recorded in %.3f seconds\n",
+           n, skipped, (now_us () - start) / 1e6, recorded_end / 1e6);
+
+  for (i = 0; i < NR_TYPES; ++i)
+    report (type_names[i], entries, n, i);
+  report ("all", entries, n, -1);
+
+  for (i = 0; i < nr_connections; ++i) {
+    nbd_shutdown (conns[i], 0);
+    nbd_close (conns[i]);
+  }
+  free (conns);
+  free (buf);
+  free (entries);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,551 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Microbenchmark of the receive path.
+ *
+ * A server thread in this process answers every request with a
+ * reply recorded before the benchmark starts (only the cookie is
+ * copied in), and writes all the replies for the requests it has
+ * read with a single system call.  The client issues batches of
+ * commands and runs the state machine until they have completed, so
+ * that the time spent is mostly in the state machine and the reply
+ * parsing and not in the socket.  This prints the time per simple
+ * reply (to NBD_CMD_FLUSH), per NBD_REPLY_TYPE_OFFSET_DATA chunk (of
+ * a structured reply to NBD_CMD_READ) and per extent (of a
+ * NBD_REPLY_TYPE_BLOCK_STATUS reply), both as elapsed time and as
+ * CPU time of the client thread.  The times include issuing the
+ * commands.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "nbd-protocol.h"
+#include "byte-swapping.h"
+
+#define EXPORT_SIZE (64 * 1024 * 1024)
+#define CONTEXT_ID 1
+#define MAX_CHUNKS 64
+
+static unsigned run_time = 1;
+static unsigned batch = 64;
+static unsigned chunks = 16;
+static unsigned chunk_size = 512;
+static unsigned extents = 64;
+
+/* A recorded reply, and where the cookie goes in it. */
+struct recording {
+  char *reply;
+  size_t len;
+  size_t cookie_offset[MAX_CHUNKS];
+  size_t nr_cookies;
+};
+
+static struct recording simple_reply, read_reply, block_status_reply;
+
+static void __attribute__((noreturn))
+usage (FILE *fp, int exitcode)
+{
+  fprintf (fp,
+"\n"
+"Measure the cost of receiving replies in libnbd:\n"
+"\n"
+"    replies [--time=SECS] [--batch=N] [--chunks=N] [--chunk-size=N]\n"
+"            [--extents=N]\n"
+"\n"
+"Each benchmark runs for SECS seconds keeping N commands in flight.\n"
+"\n"
+);
+  exit (exitcode);
+}
+
+static unsigned
+parse_unsigned (const char *option, const char *arg)
+{
+  unsigned long v;
+  char *end;
+
+  errno = 0;
+  v = strtoul (arg, &end, 0);
+  if (errno != 0 || end == arg || *end != '\0' || v == 0 || v > UINT_MAX) {
+    fprintf (stderr, "replies: could not parse %s: %s\n", option, arg);
+    exit (EXIT_FAILURE);
+  }
+  return v;
+}
+
+static void
+read_full (int fd, void *buf, size_t len)
+{
+  char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (fd, p, len);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0) {
+      fprintf (stderr, "replies: server: unexpected end of handshake\n");
+      exit (EXIT_FAILURE);
+    }
+    p += r;
+    len -= r;
+  }
+}
+
+static void
+write_full (int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (fd, p, len);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1) {
+      perror ("replies: server: write");
+      exit (EXIT_FAILURE);
+    }
+    p += r;
+    len -= r;
+  }
+}
+
+static void
+option_reply (int fd, uint32_t option, uint32_t reply,
+              const void *payload, uint32_t len)
+{
+  struct nbd_fixed_new_option_reply h = {
+    .magic = htobe64 (NBD_REP_MAGIC),
+    .option = htobe32 (option),
+    .reply = htobe32 (reply),
+    .replylen = htobe32 (len),
+  };
+
+  write_full (fd, &h, sizeof h);
+  write_full (fd, payload, len);
+}
+
+/* The fixed newstyle handshake, offering structured replies and the
+ * base:allocation meta context.
+ */
+static void
+handshake (int fd)
+{
+  struct nbd_new_handshake hs = {
+    .nbdmagic = htobe64 (NBD_MAGIC),
+    .version = htobe64 (NBD_NEW_VERSION),
+    .gflags = htobe16 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+  };
+  struct nbd_new_option opt;
+  uint32_t cflags, option, len;
+  char *data;
+
+  write_full (fd, &hs, sizeof hs);
+  read_full (fd, &cflags, sizeof cflags);
+
+  for (;;) {
+    read_full (fd, &opt, sizeof opt);
+    option = be32toh (opt.option);
+    len = be32toh (opt.optlen);
+    data = malloc (len);
+    if (data == NULL && len > 0) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    read_full (fd, data, len);
+    free (data);
+
+    switch (option) {
+    case NBD_OPT_STRUCTURED_REPLY:
+      option_reply (fd, option, NBD_REP_ACK, NULL, 0);
+      break;
+
+    case NBD_OPT_SET_META_CONTEXT: {
+      char reply[sizeof (uint32_t) + sizeof LIBNBD_CONTEXT_BASE_ALLOCATION];
+      uint32_t id = htobe32 (CONTEXT_ID);
+
+      memcpy (reply, &id, sizeof id);
+      memcpy (reply + sizeof id, LIBNBD_CONTEXT_BASE_ALLOCATION,
+              strlen (LIBNBD_CONTEXT_BASE_ALLOCATION));
+      option_reply (fd, option, NBD_REP_META_CONTEXT,
+                    reply, sizeof reply - 1);
+      option_reply (fd, option, NBD_REP_ACK, NULL, 0);
+      break;
+    }
+
+    case NBD_OPT_GO: {
+      struct nbd_fixed_new_option_reply_info_export info = {
+        .info = htobe16 (NBD_INFO_EXPORT),
+        .exportsize = htobe64 (EXPORT_SIZE),
+        .eflags = htobe16 (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY |
+                           NBD_FLAG_SEND_FLUSH),
+      };
+
+      option_reply (fd, option, NBD_REP_INFO, &info, sizeof info);
+      option_reply (fd, option, NBD_REP_ACK, NULL, 0);
+      return;
+    }
+
+    default:
+      option_reply (fd, option, NBD_REP_ERR_UNSUP, NULL, 0);
+    }
+  }
+}
+
+/* Append len bytes to a recording. */
+static void *
+record (struct recording *r, size_t len)
+{
+  char *p;
+
+  p = realloc (r->reply, r->len + len);
+  if (p == NULL) {
+    perror ("realloc");
+    exit (EXIT_FAILURE);
+  }
+  r->reply = p;
+  p += r->len;
+  r->len += len;
+  memset (p, 0, len);
+  return p;
+}
+
+static void
+record_structured (struct recording *r, uint16_t flags, uint16_t type,
+                   uint32_t len)
+{
+  struct nbd_structured_reply *h;
+
+  r->cookie_offset[r->nr_cookies++] =
+    r->len + offsetof (struct nbd_structured_reply, handle);
+  h = record (r, sizeof *h);
+  h->magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+  h->flags = htobe16 (flags);
+  h->type = htobe16 (type);
+  h->length = htobe32 (len);
+}
+
+static void
+record_replies (void)
+{
+  struct nbd_simple_reply *simple;
+  struct nbd_structured_reply_offset_data *data;
+  struct nbd_block_descriptor *bd;
+  uint32_t *id;
+  unsigned i;
+
+  simple_reply.cookie_offset[simple_reply.nr_cookies++] =
+    offsetof (struct nbd_simple_reply, handle);
+  simple = record (&simple_reply, sizeof *simple);
+  simple->magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+  simple->error = htobe32 (NBD_SUCCESS);
+
+  for (i = 0; i < chunks; ++i) {
+    record_structured (&read_reply,
+                       i == chunks - 1 ? NBD_REPLY_FLAG_DONE : 0,
+                       NBD_REPLY_TYPE_OFFSET_DATA,
+                       sizeof *data + chunk_size);
+    data = record (&read_reply, sizeof *data + chunk_size);
+    data->offset = htobe64 ((uint64_t) i * chunk_size);
+  }
+
+  record_structured (&block_status_reply, NBD_REPLY_FLAG_DONE,
+                     NBD_REPLY_TYPE_BLOCK_STATUS,
+                     sizeof *id + extents * sizeof *bd);
+  id = record (&block_status_reply, sizeof *id);
+  *id = htobe32 (CONTEXT_ID);
+  bd = record (&block_status_reply, extents * sizeof *bd);
+  for (i = 0; i < extents; ++i) {
+    bd[i].length = htobe32 (512);
+    bd[i].status_flags = htobe32 (i & 1 ? LIBNBD_STATE_HOLE : 0);
+  }
+}
+
+static void *
+server_thread (void *vp)
+{
+  int fd = *(int *) vp;
+  static char in[65536];
+  size_t in_len = 0, out_len, out_alloc = 0, i;
+  char *out = NULL, *p;
+  const struct nbd_request *req;
+  const struct recording *r;
+  ssize_t n;
+
+  handshake (fd);
+
+  for (;;) {
+    n = read (fd, in + in_len, sizeof in - in_len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    in_len += n;
+
+    /* Answer every complete request that has been read. */
+    out_len = 0;
+    for (p = in; in + in_len - p >= (ptrdiff_t) sizeof *req;
+         p += sizeof *req) {
+      req = (const struct nbd_request *) p;
+      switch (be16toh (req->type)) {
+      case NBD_CMD_FLUSH: r = &simple_reply; break;
+      case NBD_CMD_READ: r = &read_reply; break;
+      case NBD_CMD_BLOCK_STATUS: r = &block_status_reply; break;
+      case NBD_CMD_DISC: goto out;
+      default:
+        fprintf (stderr, "replies: server: unexpected command %d\n",
+                 be16toh (req->type));
+        exit (EXIT_FAILURE);
+      }
+      if (out_len + r->len > out_alloc) {
+        out_alloc = (out_len + r->len) * 2;
+        out = realloc (out, out_alloc);
+        if (out == NULL) {
+          perror ("realloc");
+          exit (EXIT_FAILURE);
+        }
+      }
+      memcpy (out + out_len, r->reply, r->len);
+      for (i = 0; i < r->nr_cookies; ++i)
+        memcpy (out + out_len + r->cookie_offset[i], &req->handle,
+                sizeof req->handle);
+      out_len += r->len;
+    }
+    in_len = in + in_len - p;
+    memmove (in, p, in_len);
+    write_full (fd, out, out_len);
+  }
+
+ out:
+  free (out);
+  close (fd);
+  return NULL;
+}
+
+static int
+completed (void *vp, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "replies: command failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  return 1;
+}
+
+static int
+extent (void *vp, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  uint64_t *units = vp;
+
+  *units += nr_entries / 2;
+  return 0;
+}
+
+enum benchmark { SIMPLE, OFFSET_DATA, BLOCK_STATUS };
+
+static double
+elapsed_ns (const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 +
+    (end->tv_nsec - start->tv_nsec);
+}
+
+static void
+run_benchmark (struct nbd_handle *nbd, enum benchmark b, const char *name,
+               const char *unit)
+{
+  static char buf[65536];
+  struct timespec start, now, cpu_start, cpu_end;
+  uint64_t units = 0;
+  unsigned i;
+  int64_t r;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  do {
+    for (i = 0; i < batch; ++i) {
+      switch (b) {
+      case SIMPLE:
+        r = nbd_aio_flush (nbd,
+                           (nbd_completion_callback) {
+                             .callback = completed },
+                           0);
+        units++;
+        break;
+      case OFFSET_DATA:
+        r = nbd_aio_pread (nbd, buf, (uint64_t) chunks * chunk_size, 0,
+                           (nbd_completion_callback) {
+                             .callback = completed },
+                           0);
+        units += chunks;
+        break;
+      case BLOCK_STATUS:
+        r = nbd_aio_block_status (nbd, (uint64_t) extents * 512, 0,
+                                  (nbd_extent_callback) {
+                                    .callback = extent,
+                                    .user_data = &units },
+                                  (nbd_completion_callback) {
+                                    .callback = completed },
+                                  0);
+        break;
+      }
+      if (r == -1)
+        goto error;
+    }
+    while (nbd_aio_in_flight (nbd) > 0) {
+      if (nbd_poll (nbd, -1) == -1)
+        goto error;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &now);
+  } while (elapsed_ns (&start, &now) < run_time * 1e9);
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+
+  printf ("%s,%s,%" PRIu64 ",%.3f,%.1f,%.1f\n",
+          name, unit, units, elapsed_ns (&start, &now) / 1e9,
+          elapsed_ns (&start, &now) / units,
+          elapsed_ns (&cpu_start, &cpu_end) / units);
+  fflush (stdout);
+  return;
+
+ error:
+  fprintf (stderr, "replies: %s\n", nbd_get_error ());
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum {
+    HELP_OPTION = CHAR_MAX + 1,
+    BATCH_OPTION,
+    CHUNKS_OPTION,
+    CHUNK_SIZE_OPTION,
+    EXTENTS_OPTION,
+    TIME_OPTION,
+  };
+  const char *short_options = "";
+  const struct option long_options[] = {
+    { "batch",      required_argument, NULL, BATCH_OPTION },
+    { "chunks",     required_argument, NULL, CHUNKS_OPTION },
+    { "chunk-size", required_argument, NULL, CHUNK_SIZE_OPTION },
+    { "extents",    required_argument, NULL, EXTENTS_OPTION },
+    { "help",       no_argument,       NULL, HELP_OPTION },
+    { "time",       required_argument, NULL, TIME_OPTION },
+    { NULL }
+  };
+  struct nbd_handle *nbd;
+  pthread_t thread;
+  int sv[2], c, err;
+
+  for (;;) {
+    c = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case HELP_OPTION:
+      usage (stdout, EXIT_SUCCESS);
+
+    case BATCH_OPTION:
+      batch = parse_unsigned ("batch", optarg);
+      break;
+
+    case CHUNKS_OPTION:
+      chunks = parse_unsigned ("chunks", optarg);
+      break;
+
+    case CHUNK_SIZE_OPTION:
+      chunk_size = parse_unsigned ("chunk size", optarg);
+      break;
+
+    case EXTENTS_OPTION:
+      extents = parse_unsigned ("extents", optarg);
+      break;
+
+    case TIME_OPTION:
+      run_time = parse_unsigned ("time", optarg);
+      break;
+
+    default:
+      usage (stderr, EXIT_FAILURE);
+    }
+  }
+  if (optind != argc)
+    usage (stderr, EXIT_FAILURE);
+  if (chunks > MAX_CHUNKS || (uint64_t) chunks * chunk_size > 65536 ||
+      (uint64_t) extents * 512 > EXPORT_SIZE) {
+    fprintf (stderr, "replies: the reads or block status requests "
+             "would be too large\n");
+    exit (EXIT_FAILURE);
+  }
+
+  record_replies ();
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  err = pthread_create (&thread, NULL, server_thread, &sv[1]);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+      nbd_connect_socket (nbd, sv[0]) == -1) {
+    fprintf (stderr, "replies: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  printf ("benchmark,unit,units,seconds,ns_per_unit,cpu_ns_per_unit\n");
+  run_benchmark (nbd, SIMPLE, "simple-reply", "reply");
+  run_benchmark (nbd, OFFSET_DATA, "offset-data", "chunk");
+  run_benchmark (nbd, BLOCK_STATUS, "block-status", "extent");
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "replies: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  pthread_join (thread, NULL);
+
+  exit (EXIT_SUCCESS);
+}
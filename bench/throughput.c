@@ -0,0 +1,562 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Throughput benchmark.
+ *
+ * For every combination of plugin, TLS, number of connections, queue
+ * depth, request size and read/write mix, this starts nbdkit, drives
+ * it with random aligned requests from one thread per connection for
+ * a fixed time, and prints one line of CSV (or one JSON object) with
+ * the requests per second, the throughput and the latency
+ * percentiles, so that results can be charted and compared between
+ * releases.  Run it with "make bench", or see --help.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+/* The library keeps this many latency buckets, see
+ * nbd_get_stats_latency.
+ */
+#define NR_BUCKETS 32
+
+/* Combinations whose buffers would need more memory than this are
+ * skipped.
+ */
+#define MAX_BUFFERS (1024 * 1024 * 1024)
+
+/* A list of values of one parameter to sweep. */
+struct list {
+  size_t len;
+  uint64_t v[32];
+};
+
+static struct list sizes = {
+  6, { 512, 4096, 65536, 1024 * 1024, 4 * 1024 * 1024, 32 * 1024 * 1024 }
+};
+static struct list depths = { 4, { 1, 4, 16, 64 } };
+static struct list connections = { 3, { 1, 2, 4 } };
+static struct list read_pcts = { 3, { 100, 50, 0 } };
+static const char *default_plugins[] = { "memory", "null", NULL };
+static const char **plugins = default_plugins;
+static const char *tls_psk = NULL;
+static uint64_t export_size = UINT64_C (1024) * 1024 * 1024;
+static unsigned run_time = 2;
+static bool json = false;
+
+/* One combination of the parameters. */
+struct config {
+  const char *plugin;
+  bool tls;
+  unsigned connections;
+  unsigned depth;
+  uint64_t size;
+  unsigned read_pct;
+};
+
+struct thread_data {
+  pthread_t thread;
+  const struct config *cfg;
+  struct nbd_handle *nbd;
+  char *buf;
+  struct timespec end;
+  uint64_t requests, bytes;
+  uint64_t rand_state;
+  int error;
+};
+
+static void __attribute__((noreturn))
+usage (FILE *fp, int exitcode)
+{
+  fprintf (fp,
+"\n"
+"Benchmark libnbd against nbdkit:\n"
+"\n"
+"    throughput [--json] [--time=SECS] [--sizes=N,...] [--depths=N,...]\n"
+"               [--connections=N,...] [--read-percent=N,...]\n"
+"               [--plugins=memory,null] [--export-size=N]\n"
+"               [--tls-psk=FILE]\n"
+"\n"
+"Each list is swept and every combination is run for SECS seconds.\n"
+"Without --tls-psk only plain connections are measured, with it each\n"
+"combination is also run over TLS using the given PSK file.\n"
+"\n"
+);
+  exit (exitcode);
+}
+
+static void
+parse_list (const char *option, const char *arg, struct list *list)
+{
+  char *end;
+
+  list->len = 0;
+  for (;;) {
+    if (list->len >= sizeof list->v / sizeof list->v[0]) {
+      fprintf (stderr, "throughput: too many values for %s\n", option);
+      exit (EXIT_FAILURE);
+    }
+    errno = 0;
+    list->v[list->len++] = strtoull (arg, &end, 0);
+    if (errno != 0 || end == arg || (*end != '\0' && *end != ',')) {
+      fprintf (stderr, "throughput: could not parse %s: %s\n", option, arg);
+      exit (EXIT_FAILURE);
+    }
+    if (*end == '\0')
+      break;
+    arg = end + 1;
+  }
+}
+
+static double
+elapsed (const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) +
+    (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int
+request_completed (void *vp, int *error)
+{
+  struct thread_data *t = vp;
+
+  if (*error && t->error == 0)
+    t->error = *error;
+  return 1;
+}
+
+/* xorshift64, one generator per thread. */
+static uint64_t
+next_rand (struct thread_data *t)
+{
+  t->rand_state ^= t->rand_state << 13;
+  t->rand_state ^= t->rand_state >> 7;
+  t->rand_state ^= t->rand_state << 17;
+  return t->rand_state;
+}
+
+static void *
+run_thread (void *vp)
+{
+  struct thread_data *t = vp;
+  const struct config *cfg = t->cfg;
+  uint64_t slots = export_size / cfg->size;
+  unsigned slot = 0;
+  struct timespec now;
+  uint64_t offset;
+  char *buf;
+  int64_t r;
+
+  for (;;) {
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    if (elapsed (&now, &t->end) <= 0 || t->error)
+      break;
+
+    while (nbd_aio_in_flight (t->nbd) < (int) cfg->depth) {
+      offset = (next_rand (t) % slots) * cfg->size;
+      buf = t->buf + slot * cfg->size;
+      slot = (slot + 1) % cfg->depth;
+      if (next_rand (t) % 100 < cfg->read_pct)
+        r = nbd_aio_pread (t->nbd, buf, cfg->size, offset,
+                           (nbd_completion_callback) {
+                             .callback = request_completed,
+                             .user_data = t },
+                           0);
+      else
+        r = nbd_aio_pwrite (t->nbd, buf, cfg->size, offset,
+                            (nbd_completion_callback) {
+                              .callback = request_completed,
+                              .user_data = t },
+                            0);
+      if (r == -1)
+        goto error;
+      t->requests++;
+      t->bytes += cfg->size;
+    }
+
+    if (nbd_poll (t->nbd, -1) == -1)
+      goto error;
+  }
+
+  /* Wait for the requests which are still in flight. */
+  while (nbd_aio_in_flight (t->nbd) > 0) {
+    if (nbd_poll (t->nbd, -1) == -1)
+      goto error;
+  }
+  return NULL;
+
+ error:
+  fprintf (stderr, "throughput: %s\n", nbd_get_error ());
+  t->error = nbd_get_errno () ? nbd_get_errno () : EIO;
+  return NULL;
+}
+
+/* Start nbdkit listening on sock, and return its pid. */
+static pid_t
+start_server (const struct config *cfg, const char *sock,
+              const char *pidfile)
+{
+  char size_arg[64], psk_arg[PATH_MAX + 16];
+  const char *argv[16];
+  size_t i = 0;
+  pid_t pid;
+
+  snprintf (size_arg, sizeof size_arg, "size=%" PRIu64, export_size);
+  argv[i++] = "nbdkit";
+  argv[i++] = "-f";
+  argv[i++] = "--exit-with-parent";
+  argv[i++] = "-U";
+  argv[i++] = sock;
+  argv[i++] = "-P";
+  argv[i++] = pidfile;
+  if (cfg->tls) {
+    snprintf (psk_arg, sizeof psk_arg, "--tls-psk=%s", tls_psk);
+    argv[i++] = "--tls=require";
+    argv[i++] = psk_arg;
+  }
+  argv[i++] = cfg->plugin;
+  argv[i++] = size_arg;
+  argv[i] = NULL;
+
+  unlink (pidfile);
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execvp ("nbdkit", (char **) argv);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 600; ++i) {
+    if (access (pidfile, F_OK) == 0)
+      return pid;
+    usleep (100000);
+  }
+  fprintf (stderr, "throughput: nbdkit did not start\n");
+  exit (EXIT_FAILURE);
+}
+
+/* Return an upper bound of the latency percentile pct (in 1/10ths
+ * of a percent) in microseconds, as nbd_get_stats_latency_percentile
+ * does, from a histogram merged from all the connections.
+ */
+static uint64_t
+percentile (const uint64_t *hist, unsigned pct)
+{
+  uint64_t total = 0, seen = 0, want;
+  unsigned i;
+
+  for (i = 0; i < NR_BUCKETS; ++i)
+    total += hist[i];
+  if (total == 0)
+    return 0;
+  want = (total * pct + 999) / 1000;
+  if (want == 0)
+    want = 1;
+  for (i = 0; i < NR_BUCKETS - 1; ++i) {
+    seen += hist[i];
+    if (seen >= want)
+      break;
+  }
+  return UINT64_C (1) << (i + 1);
+}
+
+static void
+run_config (const struct config *cfg, const char *dir)
+{
+  char sock[PATH_MAX], pidfile[PATH_MAX];
+  struct thread_data *threads;
+  uint64_t hist[NR_BUCKETS] = { 0 };
+  uint64_t requests = 0, bytes = 0;
+  struct timespec start, end;
+  double secs;
+  unsigned i, j;
+  pid_t pid;
+  int err, error = 0;
+
+  snprintf (sock, sizeof sock, "%s/sock", dir);
+  snprintf (pidfile, sizeof pidfile, "%s/pid", dir);
+  pid = start_server (cfg, sock, pidfile);
+
+  threads = calloc (cfg->connections, sizeof *threads);
+  if (threads == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < cfg->connections; ++i) {
+    threads[i].cfg = cfg;
+    threads[i].rand_state = 0x9e3779b97f4a7c15 * (i + 1);
+    threads[i].buf = malloc (cfg->depth * cfg->size);
+    if (threads[i].buf == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+    memset (threads[i].buf, 0xaa, cfg->depth * cfg->size);
+    threads[i].nbd = nbd_create ();
+    if (threads[i].nbd == NULL ||
+        (cfg->tls &&
+         (nbd_set_tls (threads[i].nbd, LIBNBD_TLS_REQUIRE) == -1 ||
+          nbd_set_tls_psk_file (threads[i].nbd, tls_psk) == -1)) ||
+        nbd_connect_unix (threads[i].nbd, sock) == -1) {
+      fprintf (stderr, "throughput: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < cfg->connections; ++i) {
+    threads[i].end = start;
+    threads[i].end.tv_sec += run_time;
+    err = pthread_create (&threads[i].thread, NULL, run_thread, &threads[i]);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < cfg->connections; ++i) {
+    err = pthread_join (threads[i].thread, NULL);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_join");
+      exit (EXIT_FAILURE);
+    }
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  secs = elapsed (&start, &end);
+
+  for (i = 0; i < cfg->connections; ++i) {
+    struct nbd_handle *nbd = threads[i].nbd;
+
+    if (threads[i].error && error == 0)
+      error = threads[i].error;
+    requests += threads[i].requests;
+    bytes += threads[i].bytes;
+    if (nbd_stats_snapshot (nbd) == -1) {
+      fprintf (stderr, "throughput: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    for (j = 0; j < NR_BUCKETS; ++j)
+      hist[j] += nbd_get_stats_latency (nbd, LIBNBD_CMD_READ, j) +
+        nbd_get_stats_latency (nbd, LIBNBD_CMD_WRITE, j);
+    nbd_shutdown (nbd, 0);
+    nbd_close (nbd);
+    free (threads[i].buf);
+  }
+  free (threads);
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+
+  if (error) {
+    fprintf (stderr, "throughput: %s tls=%d connections=%u depth=%u "
+             "size=%" PRIu64 " read=%u%%: %s\n",
+             cfg->plugin, cfg->tls, cfg->connections, cfg->depth,
+             cfg->size, cfg->read_pct, strerror (error));
+    exit (EXIT_FAILURE);
+  }
+
+  if (json)
+    printf ("{\"plugin\": \"%s\", \"tls\": %s, \"connections\": %u, "
+            "\"depth\": %u, \"size\": %" PRIu64 ", \"read_percent\": %u, "
+            "\"seconds\": %.3f, \"requests\": %" PRIu64 ", "
+            "\"iops\": %.1f, \"mb_per_s\": %.1f, "
+            "\"p50_us\": %" PRIu64 ", \"p90_us\": %" PRIu64 ", "
+            "\"p99_us\": %" PRIu64 ", \"p999_us\": %" PRIu64 "}\n",
+            cfg->plugin, cfg->tls ? "true" : "false", cfg->connections,
+            cfg->depth, cfg->size, cfg->read_pct, secs, requests,
+            requests / secs, bytes / secs / 1e6,
+            percentile (hist, 500), percentile (hist, 900),
+            percentile (hist, 990), percentile (hist, 999));
+  else
+    printf ("%s,%d,%u,%u,%" PRIu64 ",%u,%.3f,%" PRIu64 ",%.1f,%.1f,"
+            "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+            cfg->plugin, cfg->tls, cfg->connections, cfg->depth,
+            cfg->size, cfg->read_pct, secs, requests,
+            requests / secs, bytes / secs / 1e6,
+            percentile (hist, 500), percentile (hist, 900),
+            percentile (hist, 990), percentile (hist, 999));
+  fflush (stdout);
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum {
+    HELP_OPTION = CHAR_MAX + 1,
+    CONNECTIONS_OPTION,
+    DEPTHS_OPTION,
+    EXPORT_SIZE_OPTION,
+    JSON_OPTION,
+    PLUGINS_OPTION,
+    READ_PERCENT_OPTION,
+    SIZES_OPTION,
+    TIME_OPTION,
+    TLS_PSK_OPTION,
+  };
+  const char *short_options = "";
+  const struct option long_options[] = {
+    { "connections",  required_argument, NULL, CONNECTIONS_OPTION },
+    { "depths",       required_argument, NULL, DEPTHS_OPTION },
+    { "export-size",  required_argument, NULL, EXPORT_SIZE_OPTION },
+    { "help",         no_argument,       NULL, HELP_OPTION },
+    { "json",         no_argument,       NULL, JSON_OPTION },
+    { "plugins",      required_argument, NULL, PLUGINS_OPTION },
+    { "read-percent", required_argument, NULL, READ_PERCENT_OPTION },
+    { "sizes",        required_argument, NULL, SIZES_OPTION },
+    { "time",         required_argument, NULL, TIME_OPTION },
+    { "tls-psk",      required_argument, NULL, TLS_PSK_OPTION },
+    { NULL }
+  };
+  static const char *plugin_list[8];
+  char template[] = "/tmp/throughputXXXXXX";
+  struct list export_sizes, times;
+  struct config cfg;
+  size_t p, c, d, s, m, i;
+  char *str, *tok;
+  int tls, c_;
+
+  for (;;) {
+    c_ = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c_ == -1)
+      break;
+
+    switch (c_) {
+    case HELP_OPTION:
+      usage (stdout, EXIT_SUCCESS);
+
+    case CONNECTIONS_OPTION:
+      parse_list ("connections", optarg, &connections);
+      break;
+
+    case DEPTHS_OPTION:
+      parse_list ("depths", optarg, &depths);
+      break;
+
+    case EXPORT_SIZE_OPTION:
+      parse_list ("export size", optarg, &export_sizes);
+      export_size = export_sizes.v[0];
+      break;
+
+    case JSON_OPTION:
+      json = true;
+      break;
+
+    case PLUGINS_OPTION:
+      str = strdup (optarg);
+      if (str == NULL) {
+        perror ("strdup");
+        exit (EXIT_FAILURE);
+      }
+      for (i = 0, tok = strtok (str, ",");
+           tok != NULL && i < sizeof plugin_list / sizeof plugin_list[0] - 1;
+           tok = strtok (NULL, ","))
+        plugin_list[i++] = tok;
+      plugin_list[i] = NULL;
+      plugins = plugin_list;
+      break;
+
+    case READ_PERCENT_OPTION:
+      parse_list ("read percent", optarg, &read_pcts);
+      break;
+
+    case SIZES_OPTION:
+      parse_list ("sizes", optarg, &sizes);
+      break;
+
+    case TIME_OPTION:
+      parse_list ("time", optarg, &times);
+      run_time = times.v[0];
+      break;
+
+    case TLS_PSK_OPTION:
+      tls_psk = optarg;
+      break;
+
+    default:
+      usage (stderr, EXIT_FAILURE);
+    }
+  }
+  if (optind != argc)
+    usage (stderr, EXIT_FAILURE);
+
+  for (i = 0; i < sizes.len; ++i) {
+    if (sizes.v[i] == 0 || sizes.v[i] > export_size) {
+      fprintf (stderr, "throughput: invalid request size: %" PRIu64 "\n",
+               sizes.v[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < read_pcts.len; ++i) {
+    if (read_pcts.v[i] > 100) {
+      fprintf (stderr, "throughput: invalid read percentage: %" PRIu64 "\n",
+               read_pcts.v[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (mkdtemp (template) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+
+  if (!json)
+    printf ("plugin,tls,connections,depth,size,read_percent,seconds,"
+            "requests,iops,mb_per_s,p50_us,p90_us,p99_us,p999_us\n");
+
+  for (p = 0; plugins[p] != NULL; ++p)
+    for (tls = 0; tls <= (tls_psk != NULL); ++tls)
+      for (c = 0; c < connections.len; ++c)
+        for (d = 0; d < depths.len; ++d)
+          for (s = 0; s < sizes.len; ++s)
+            for (m = 0; m < read_pcts.len; ++m) {
+              cfg.plugin = plugins[p];
+              cfg.tls = tls;
+              cfg.connections = connections.v[c];
+              cfg.depth = depths.v[d];
+              cfg.size = sizes.v[s];
+              cfg.read_pct = read_pcts.v[m];
+              if (cfg.connections == 0 || cfg.depth == 0 ||
+                  cfg.connections * cfg.depth * cfg.size > MAX_BUFFERS)
+                continue;
+              run_config (&cfg, template);
+            }
+
+  rmdir (template);
+  exit (EXIT_SUCCESS);
+}
@@ -46,6 +46,9 @@
 #define _BSD_SOURCE
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef HAVE_BYTESWAP_H
 #include <byteswap.h>
 #endif
@@ -93,4 +96,17 @@
 # endif
 #endif
 
+/* Convert an array of big endian 32 bit integers to host byte order
+ * in place.  The loop is kept simple so that the compiler can turn it
+ * into vector byte shuffles, or remove it on big endian hosts.
+ */
+static inline void
+be32toh_array (uint32_t *a, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    a[i] = be32toh (a[i]);
+}
+
 #endif /* NBDKIT_BYTE_SWAPPING_H */
@@ -0,0 +1,276 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Copy to and from NBD servers, using nbd_copy_run. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static int connections = 4;
+
+static void __attribute__((noreturn))
+usage (FILE *fp, int exitcode)
+{
+  fprintf (fp,
+"\n"
+"Copy to and from an NBD server:\n"
+"\n"
+"    nbdcopy [-C N|--connections=N] [-R N|--requests=N]\n"
+"            [--request-size=N] [--destination-is-zero] [--stats]\n"
+"            SOURCE DESTINATION\n"
+"\n"
+"SOURCE and DESTINATION are NBD URIs or local files, for example:\n"
+"\n"
+"    nbdcopy nbd://example.com disk.img\n"
+"    nbdcopy disk.img nbd+unix:///?socket=/tmp/sock\n"
+"\n"
+"Please read the nbdcopy(1) manual page for full usage.\n"
+"\n"
+);
+  exit (exitcode);
+}
+
+static void
+display_version (void)
+{
+  printf ("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
+}
+
+static bool
+is_uri (const char *s)
+{
+  return strncmp (s, "nbd:", 4) == 0 ||
+    strncmp (s, "nbds:", 5) == 0 ||
+    strncmp (s, "nbd+", 4) == 0 ||
+    strncmp (s, "nbds+", 5) == 0;
+}
+
+/* Connect a group to uri, using a single connection if the server
+ * does not support multi-conn.
+ */
+static struct nbd_group *
+connect_group (const char *uri, bool source)
+{
+  struct nbd_group *g;
+  int i, n = connections;
+
+ again:
+  g = nbd_group_create (n);
+  if (g == NULL) {
+    fprintf (stderr, "nbdcopy: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  /* Ask the source which parts are holes, so they can be skipped. */
+  if (source) {
+    for (i = 0; i < n; ++i) {
+      if (nbd_add_meta_context (nbd_group_get_handle (g, i),
+                                LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+        fprintf (stderr, "nbdcopy: %s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  if (nbd_group_connect_uri (g, uri) == -1) {
+    if (n > 1 && nbd_get_errno () == ENOTSUP) {
+      nbd_group_close (g);
+      n = 1;
+      goto again;
+    }
+    fprintf (stderr, "nbdcopy: %s: %s\n", uri, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return g;
+}
+
+static unsigned
+parse_unsigned (const char *option, const char *arg)
+{
+  unsigned long v;
+  char *end;
+
+  errno = 0;
+  v = strtoul (arg, &end, 0);
+  if (errno != 0 || end == arg || *end != '\0' || v > UINT_MAX) {
+    fprintf (stderr, "nbdcopy: could not parse %s: %s\n", option, arg);
+    exit (EXIT_FAILURE);
+  }
+  return v;
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum {
+    HELP_OPTION = CHAR_MAX + 1,
+    DESTINATION_IS_ZERO_OPTION,
+    REQUEST_SIZE_OPTION,
+    STATS_OPTION,
+  };
+  const char *short_options = "C:R:V";
+  const struct option long_options[] = {
+    { "connections",         required_argument, NULL, 'C' },
+    { "destination-is-zero", no_argument,       NULL,
+      DESTINATION_IS_ZERO_OPTION },
+    { "help",                no_argument,       NULL, HELP_OPTION },
+    { "requests",            required_argument, NULL, 'R' },
+    { "request-size",        required_argument, NULL, REQUEST_SIZE_OPTION },
+    { "stats",               no_argument,       NULL, STATS_OPTION },
+    { "version",             no_argument,       NULL, 'V' },
+    { NULL }
+  };
+  int c;
+  unsigned requests = 0, request_size = 0;
+  bool destination_is_zero = false, stats = false;
+  const char *src_name, *dst_name;
+  struct nbd_group *src = NULL, *dst = NULL;
+  int src_fd = -1, dst_fd = -1;
+  struct nbd_copy *copy;
+  uint64_t copied, zeroed, elapsed_ns;
+
+  for (;;) {
+    c = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case HELP_OPTION:
+      usage (stdout, EXIT_SUCCESS);
+
+    case 'C':
+      connections = parse_unsigned ("connections", optarg);
+      if (connections < 1) {
+        fprintf (stderr, "nbdcopy: there must be at least 1 connection\n");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case DESTINATION_IS_ZERO_OPTION:
+      destination_is_zero = true;
+      break;
+
+    case 'R':
+      requests = parse_unsigned ("requests", optarg);
+      break;
+
+    case REQUEST_SIZE_OPTION:
+      request_size = parse_unsigned ("request size", optarg);
+      break;
+
+    case STATS_OPTION:
+      stats = true;
+      break;
+
+    case 'V':
+      display_version ();
+      exit (EXIT_SUCCESS);
+
+    default:
+      usage (stderr, EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != 2)
+    usage (stderr, EXIT_FAILURE);
+  src_name = argv[optind];
+  dst_name = argv[optind+1];
+
+  if (is_uri (src_name))
+    src = connect_group (src_name, true);
+  else {
+    src_fd = open (src_name, O_RDONLY|O_CLOEXEC);
+    if (src_fd == -1) {
+      perror (src_name);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (is_uri (dst_name))
+    dst = connect_group (dst_name, false);
+  else {
+    dst_fd = open (dst_name, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+    if (dst_fd == -1) {
+      perror (dst_name);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  copy = nbd_copy_create ();
+  if (copy == NULL) {
+    fprintf (stderr, "nbdcopy: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if ((src && nbd_copy_set_source (copy, src) == -1) ||
+      (src_fd >= 0 && nbd_copy_set_source_fd (copy, src_fd) == -1) ||
+      (dst && nbd_copy_set_destination (copy, dst) == -1) ||
+      (dst_fd >= 0 && nbd_copy_set_destination_fd (copy, dst_fd) == -1) ||
+      (requests && nbd_copy_set_requests (copy, requests) == -1) ||
+      (request_size &&
+       nbd_copy_set_request_size (copy, request_size) == -1) ||
+      nbd_copy_set_destination_is_zero (copy, destination_is_zero) == -1 ||
+      nbd_copy_run (copy) == -1) {
+    fprintf (stderr, "nbdcopy: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  copied = nbd_copy_get_bytes_copied (copy);
+  zeroed = nbd_copy_get_bytes_zeroed (copy);
+  elapsed_ns = nbd_copy_get_elapsed_ns (copy);
+  nbd_copy_close (copy);
+
+  if (stats) {
+    double secs = elapsed_ns / 1e9;
+
+    printf ("copied %" PRIu64 " bytes and zeroed %" PRIu64 " bytes "
+            "in %.3f seconds", copied, zeroed, secs);
+    if (secs > 0)
+      printf (" (%.1f MB/s)", (copied + zeroed) / secs / 1e6);
+    printf ("\n");
+  }
+
+  if (src) {
+    nbd_group_shutdown (src, 0);
+    nbd_group_close (src);
+  }
+  if (dst) {
+    if (nbd_group_shutdown (dst, 0) == -1) {
+      fprintf (stderr, "nbdcopy: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    nbd_group_close (dst);
+  }
+  if (src_fd >= 0)
+    close (src_fd);
+  if (dst_fd >= 0 && close (dst_fd) == -1) {
+    perror (dst_name);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+# nbd client library in userspace
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Test nbdcopy + nbdkit: copy a sparse file to a RAM disk and back.
+
+. ../tests/functions.sh
+
+set -e
+set -x
+
+requires nbdkit --exit-with-parent --version
+requires nbdsh -c 'exit (not h.supports_uri ())'
+requires cmp --version
+requires dd --version
+requires truncate --version
+
+if ! test -r /dev/urandom; then
+    echo "$0: test skipped: /dev/urandom not readable"
+    exit 77
+fi
+
+data=test-nbdcopy.data
+out=test-nbdcopy.out
+cleanup_fn rm -f $data $out
+
+# Data at the start and the end, with a hole in the middle.
+rm -f $data $out
+dd if=/dev/urandom of=$data bs=1M count=1
+truncate -s 9M $data
+dd if=/dev/urandom of=$data bs=1M count=1 seek=9 conv=notrunc
+
+nbdkit -U - --exit-with-parent memory size=10M \
+       --run "$VG nbdcopy --stats $data \$uri &&
+              $VG nbdcopy -C 2 -R 8 --request-size=65536 \$uri $out"
+cmp $data $out
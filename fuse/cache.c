@@ -0,0 +1,631 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Block cache, enabled with --cache-size.
+ *
+ * The export is divided into aligned blocks of BLOCK_SIZE bytes, and
+ * up to cache_size bytes of them are kept in memory, evicting the
+ * least recently used.  A read which misses fetches every missing
+ * block it covers in one request, together with a read-ahead window
+ * which grows while the reads are sequential.
+ *
+ * Writes go to the server and update the cached blocks (write
+ * through), unless --writeback is used.  Then writes only change the
+ * cache, and the dirty blocks are written to the server, with
+ * adjacent blocks joined into one request, by cache_flush (called on
+ * fsync and release) or when half the cache is dirty.  A write which
+ * covers part of a block that is not cached is still written through,
+ * since otherwise the rest of the block would have to be read first.
+ *
+ * All the state is protected by lock, which is not held while talking
+ * to the server.  Instead a block with I/O in progress is marked busy.
+ * Busy blocks are not evicted, and writers wait for them, so block
+ * data does not change while it is being written back.  Readers only
+ * wait for blocks which are being loaded.  A write through creates a
+ * placeholder (a busy block with no data) for each block which is not
+ * cached, so that no read can load the old contents of the block
+ * while the write is in flight.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "nbdfuse.h"
+
+#define BLOCK_SIZE 65536
+
+/* Largest request used to write back dirty blocks. */
+#define MAX_WRITEBACK_SIZE (4 * 1024 * 1024)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+struct block {
+  uint64_t blknum;
+  char *data;                   /* NULL for a placeholder */
+  bool valid;                   /* data has been loaded */
+  bool dirty;                   /* data is newer than the server */
+  bool busy;                    /* I/O in progress */
+  struct block *hash_next;
+  struct block *lru_prev, *lru_next; /* only blocks with data */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static struct block **hash;
+static size_t hash_size;        /* power of 2 */
+
+/* Most recently used at the head. */
+static struct block *lru_head, *lru_tail;
+
+static size_t nr_blocks;        /* blocks with data */
+static size_t max_blocks;
+static size_t nr_dirty;
+static size_t max_readahead;    /* in blocks */
+static bool writeback;
+
+/* Read-ahead state.  Reads are sequential if they start close to where
+ * the last one ended, and then the window doubles up to max_readahead.
+ */
+static uint64_t readahead_next;
+static size_t readahead_window;
+
+int
+cache_init (uint64_t cache_size, uint64_t readahead, bool wb)
+{
+  max_blocks = MAX (cache_size / BLOCK_SIZE, 2);
+  max_readahead = MIN (readahead / BLOCK_SIZE, max_blocks / 2);
+  writeback = wb;
+
+  for (hash_size = 64; hash_size < max_blocks; hash_size *= 2)
+    ;
+  hash = calloc (hash_size, sizeof *hash);
+  if (hash == NULL)
+    return -ENOMEM;
+  return 0;
+}
+
+static inline uint64_t
+block_offset (uint64_t blknum)
+{
+  return blknum * BLOCK_SIZE;
+}
+
+/* The last block of the export may be short. */
+static inline size_t
+block_len (uint64_t blknum)
+{
+  return MIN (BLOCK_SIZE, size - block_offset (blknum));
+}
+
+static inline size_t
+hash_bucket (uint64_t blknum)
+{
+  return (blknum * 0x9e3779b97f4a7c15ULL >> 32) & (hash_size - 1);
+}
+
+static struct block *
+lookup (uint64_t blknum)
+{
+  struct block *b;
+
+  for (b = hash[hash_bucket (blknum)]; b != NULL; b = b->hash_next)
+    if (b->blknum == blknum)
+      return b;
+  return NULL;
+}
+
+static void
+lru_unlink (struct block *b)
+{
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    lru_tail = b->lru_prev;
+  b->lru_prev = b->lru_next = NULL;
+}
+
+static void
+lru_push (struct block *b)
+{
+  b->lru_prev = NULL;
+  b->lru_next = lru_head;
+  if (lru_head)
+    lru_head->lru_prev = b;
+  else
+    lru_tail = b;
+  lru_head = b;
+}
+
+static void
+touch (struct block *b)
+{
+  if (lru_head != b) {
+    lru_unlink (b);
+    lru_push (b);
+  }
+}
+
+static void
+free_block (struct block *b)
+{
+  struct block **bp;
+
+  for (bp = &hash[hash_bucket (b->blknum)]; *bp != b; bp = &(*bp)->hash_next)
+    ;
+  *bp = b->hash_next;
+
+  if (b->data) {
+    lru_unlink (b);
+    nr_blocks--;
+    if (b->dirty)
+      nr_dirty--;
+    free (b->data);
+  }
+  free (b);
+}
+
+/* Evict the least recently used block which can be dropped. */
+static bool
+evict_one (void)
+{
+  struct block *b;
+
+  for (b = lru_tail; b != NULL; b = b->lru_prev) {
+    if (b->valid && !b->dirty && !b->busy) {
+      free_block (b);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Add a block to the cache.  If there is no block which can be
+ * evicted the cache grows past max_blocks for a while, rather than
+ * waiting, since the caller may itself be holding busy blocks.
+ */
+static struct block *
+new_block (uint64_t blknum, bool placeholder)
+{
+  struct block *b;
+  size_t h;
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL)
+    return NULL;
+  b->blknum = blknum;
+  if (!placeholder) {
+    while (nr_blocks >= max_blocks && evict_one ())
+      ;
+    b->data = malloc (BLOCK_SIZE);
+    if (b->data == NULL) {
+      free (b);
+      return NULL;
+    }
+    nr_blocks++;
+    lru_push (b);
+  }
+  h = hash_bucket (blknum);
+  b->hash_next = hash[h];
+  hash[h] = b;
+  return b;
+}
+
+static void
+mark_dirty (struct block *b)
+{
+  if (!b->dirty) {
+    b->dirty = true;
+    nr_dirty++;
+  }
+}
+
+/* Copy the part of [offset, offset+count) which lies in block b from
+ * buf, or zero it if buf is NULL.
+ */
+static void
+update_block (struct block *b, const char *buf, size_t count,
+              uint64_t offset)
+{
+  uint64_t start = MAX (offset, block_offset (b->blknum));
+  uint64_t end = MIN (offset + count,
+                      block_offset (b->blknum) + block_len (b->blknum));
+  char *p = b->data + (start - block_offset (b->blknum));
+
+  if (buf)
+    memcpy (p, buf + (start - offset), end - start);
+  else
+    memset (p, 0, end - start);
+}
+
+/* Fetch block blknum from the server together with the following
+ * blocks up to last which are not cached, in a single request.  Called
+ * and returns with lock held.
+ */
+static int
+load (uint64_t blknum, uint64_t last)
+{
+  uint64_t i, n, offset = block_offset (blknum);
+  size_t count;
+  struct block *b;
+  char *buf;
+  int r = 0;
+
+  for (n = 0; blknum + n <= last && n < max_blocks; ++n) {
+    if (n > 0 && lookup (blknum + n) != NULL)
+      break;
+    b = new_block (blknum + n, false);
+    if (b == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+    b->busy = true;
+  }
+  if (n == 0)
+    return r;
+  count = block_offset (blknum + n - 1) + block_len (blknum + n - 1) - offset;
+
+  /* A single block is read straight into the cache. */
+  if (n == 1)
+    buf = lookup (blknum)->data;
+  else
+    buf = malloc (count);
+
+  pthread_mutex_unlock (&lock);
+  if (buf == NULL)
+    r = -ENOMEM;
+  else if (nbd_pread (nbd_group_select (group, offset),
+                      buf, count, offset, 0) == -1)
+    r = check_nbd_error ();
+  else
+    r = 0;
+  pthread_mutex_lock (&lock);
+
+  for (i = 0; i < n; ++i) {
+    b = lookup (blknum + i);
+    if (r == 0) {
+      if (n > 1)
+        memcpy (b->data, buf + i * BLOCK_SIZE, block_len (blknum + i));
+      b->valid = true;
+      b->busy = false;
+    }
+    else
+      free_block (b);
+  }
+  if (n > 1)
+    free (buf);
+  pthread_cond_broadcast (&cond);
+  return r;
+}
+
+int
+cache_pread (char *buf, size_t count, uint64_t offset)
+{
+  uint64_t end = offset + count, last = (end - 1) / BLOCK_SIZE;
+  uint64_t blknum;
+  size_t n;
+  struct block *b;
+  int r;
+
+  if (count == 0)
+    return 0;
+
+  pthread_mutex_lock (&lock);
+
+  if (offset + BLOCK_SIZE >= readahead_next &&
+      offset <= readahead_next + BLOCK_SIZE)
+    readahead_window = MIN (MAX (readahead_window * 2, 1), max_readahead);
+  else
+    readahead_window = 0;
+  readahead_next = end;
+  last = MIN (last + readahead_window, (size - 1) / BLOCK_SIZE);
+
+  while (offset < end) {
+    blknum = offset / BLOCK_SIZE;
+    n = MIN (end - offset, block_offset (blknum) + BLOCK_SIZE - offset);
+    b = lookup (blknum);
+    if (b == NULL) {
+      r = load (blknum, last);
+      if (r < 0) {
+        pthread_mutex_unlock (&lock);
+        return r;
+      }
+      continue;
+    }
+    if (!b->valid) {
+      pthread_cond_wait (&cond, &lock);
+      continue;
+    }
+    memcpy (buf, b->data + (offset - block_offset (blknum)), n);
+    touch (b);
+    buf += n;
+    offset += n;
+  }
+
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+/* Finish a write through of blocks first to last. */
+static void
+end_write (uint64_t first, uint64_t last, bool ok)
+{
+  uint64_t blknum;
+  struct block *b;
+
+  for (blknum = first; blknum <= last; ++blknum) {
+    b = lookup (blknum);
+    if (b == NULL)
+      continue;
+    b->busy = false;
+    /* If the write failed the server may not have the new data. */
+    if (!b->valid || (!ok && !b->dirty))
+      free_block (b);
+  }
+  pthread_cond_broadcast (&cond);
+}
+
+/* Write [offset, offset+count) to the server, or zero it if buf is
+ * NULL, and update the cached blocks.  Called and returns with lock
+ * held.
+ */
+static int
+write_through (const char *buf, size_t count, uint64_t offset,
+               uint32_t flags)
+{
+  uint64_t first = offset / BLOCK_SIZE;
+  uint64_t last = (offset + count - 1) / BLOCK_SIZE;
+  uint64_t blknum;
+  struct block *b;
+  int r;
+
+  /* Overlapping writes wait for each other in block order. */
+  for (blknum = first; blknum <= last; ++blknum) {
+    while ((b = lookup (blknum)) != NULL && b->busy)
+      pthread_cond_wait (&cond, &lock);
+    if (b) {
+      update_block (b, buf, count, offset);
+      touch (b);
+    }
+    else {
+      b = new_block (blknum, true);
+      if (b == NULL) {
+        if (blknum > first)
+          end_write (first, blknum - 1, false);
+        return -ENOMEM;
+      }
+    }
+    b->busy = true;
+  }
+
+  pthread_mutex_unlock (&lock);
+  if (buf)
+    r = nbd_pwrite (nbd_group_select (group, offset), buf, count, offset, 0);
+  else
+    r = nbd_zero (nbd_group_select (group, offset), count, offset, flags);
+  if (r == -1)
+    r = check_nbd_error ();
+  pthread_mutex_lock (&lock);
+
+  end_write (first, last, r == 0);
+  return r;
+}
+
+int
+cache_pwrite (const char *buf, size_t count, uint64_t offset)
+{
+  uint64_t end = offset + count, blknum;
+  size_t n;
+  struct block *b;
+  int r = 0;
+
+  pthread_mutex_lock (&lock);
+
+  if (!writeback) {
+    r = write_through (buf, count, offset, 0);
+    pthread_mutex_unlock (&lock);
+    return r;
+  }
+
+  while (offset < end) {
+    blknum = offset / BLOCK_SIZE;
+    n = MIN (end - offset, block_offset (blknum) + BLOCK_SIZE - offset);
+    b = lookup (blknum);
+    if (b && b->busy) {
+      pthread_cond_wait (&cond, &lock);
+      continue;
+    }
+    if (b == NULL && n == block_len (blknum)) {
+      b = new_block (blknum, false);
+      if (b)
+        b->valid = true;
+    }
+    if (b) {
+      update_block (b, buf, n, offset);
+      mark_dirty (b);
+      touch (b);
+    }
+    else {
+      r = write_through (buf, n, offset, 0);
+      if (r < 0)
+        break;
+    }
+    buf += n;
+    offset += n;
+  }
+
+  if (r == 0 && nr_dirty > max_blocks / 2) {
+    pthread_mutex_unlock (&lock);
+    return cache_flush ();
+  }
+  pthread_mutex_unlock (&lock);
+  return r;
+}
+
+int
+cache_zero (size_t count, uint64_t offset, uint32_t flags)
+{
+  int r;
+
+  pthread_mutex_lock (&lock);
+  r = write_through (NULL, count, offset, flags);
+  pthread_mutex_unlock (&lock);
+  return r;
+}
+
+static int
+compare_blknum (const void *v1, const void *v2)
+{
+  const struct block *b1 = *(struct block * const *) v1;
+  const struct block *b2 = *(struct block * const *) v2;
+
+  return b1->blknum < b2->blknum ? -1 : b1->blknum > b2->blknum;
+}
+
+/* Write back the n dirty blocks in blocks, which are busy and in
+ * order, joining runs of adjacent blocks.  Called and returns with
+ * lock held.
+ */
+static int
+write_back (struct block **blocks, size_t n)
+{
+  size_t i, j, k, count;
+  uint64_t offset;
+  char *buf, *p;
+  int r = 0;
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1;
+         j < n && blocks[j]->blknum == blocks[j-1]->blknum + 1 &&
+           (j - i + 1) * BLOCK_SIZE <= MAX_WRITEBACK_SIZE;
+         ++j)
+      ;
+    offset = block_offset (blocks[i]->blknum);
+    count = block_offset (blocks[j-1]->blknum) +
+      block_len (blocks[j-1]->blknum) - offset;
+
+    /* The data of busy blocks does not change, so it can be read
+     * without the lock.
+     */
+    pthread_mutex_unlock (&lock);
+    if (j - i == 1)
+      buf = blocks[i]->data;
+    else {
+      buf = malloc (count);
+      if (buf != NULL) {
+        for (k = i, p = buf; k < j; ++k, p += BLOCK_SIZE)
+          memcpy (p, blocks[k]->data, block_len (blocks[k]->blknum));
+      }
+    }
+    if (buf == NULL)
+      r = -ENOMEM;
+    else if (nbd_pwrite (nbd_group_select (group, offset),
+                         buf, count, offset, 0) == -1)
+      r = check_nbd_error ();
+    if (j - i > 1)
+      free (buf);
+    pthread_mutex_lock (&lock);
+
+    if (r < 0)
+      break;
+    for (k = i; k < j; ++k) {
+      blocks[k]->dirty = false;
+      blocks[k]->busy = false;
+      nr_dirty--;
+    }
+    pthread_cond_broadcast (&cond);
+  }
+
+  /* After an error the remaining blocks stay dirty. */
+  for (; i < n; ++i)
+    blocks[i]->busy = false;
+  pthread_cond_broadcast (&cond);
+  return r;
+}
+
+int
+cache_flush (void)
+{
+  struct block **blocks = NULL, **p, *b;
+  size_t n;
+  int r = 0;
+
+  pthread_mutex_lock (&lock);
+  while (nr_dirty > 0) {
+    p = realloc (blocks, nr_dirty * sizeof *blocks);
+    if (p == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+    blocks = p;
+
+    n = 0;
+    for (b = lru_head; b != NULL; b = b->lru_next) {
+      if (b->dirty && !b->busy) {
+        b->busy = true;
+        blocks[n++] = b;
+      }
+    }
+
+    /* Dirty blocks which are busy are being written back by another
+     * thread.
+     */
+    if (n == 0) {
+      pthread_cond_wait (&cond, &lock);
+      continue;
+    }
+
+    qsort (blocks, n, sizeof *blocks, compare_blknum);
+    r = write_back (blocks, n);
+    if (r < 0)
+      break;
+  }
+  pthread_mutex_unlock (&lock);
+
+  free (blocks);
+  return r;
+}
+
+void
+cache_free (void)
+{
+  size_t i;
+
+  if (hash == NULL)
+    return;
+  for (i = 0; i < hash_size; ++i) {
+    while (hash[i] != NULL)
+      free_block (hash[i]);
+  }
+  free (hash);
+  hash = NULL;
+}
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -43,17 +44,40 @@
 
 #include <libnbd.h>
 
+#include "nbdfuse.h"
+
 #define MAX_REQUEST_SIZE (32 * 1024 * 1024)
 
-static struct nbd_handle *nbd;
+/* Largest zero request used to implement fallocate. */
+#define MAX_ZERO_SIZE (32 * 1024 * 1024)
+
+/* FUSE runs several threads, which share the connections in group.
+ * Every handle in the group allows commands to be issued from many
+ * threads at once, so requests from the threads are in flight on the
+ * connection together, and with multi-conn they are spread over
+ * several connections.
+ */
+struct nbd_group *group;
+static int connections = 4;
 static bool readonly;
+static uint64_t cache_size, readahead_size = 4 * 1024 * 1024;
+static bool writeback;
 static char *mountpoint, *filename;
 static const char *pidfile;
 static char *fuse_options;
 static struct fuse_chan *ch;
 static struct fuse *fuse;
 static struct timespec start_t;
-static uint64_t size;
+uint64_t size;
+
+/* Each FUSE thread keeps a buffer for the data of writes which are
+ * not already in memory, see nbdfuse_write_buf.
+ */
+struct write_buffer {
+  char *data;
+  size_t size;
+};
+static pthread_key_t write_buffer_key;
 
 static int nbdfuse_getattr (const char *path, struct stat *stbuf);
 static int nbdfuse_readdir (const char *path, void *buf,
@@ -63,21 +87,24 @@ static int nbdfuse_open (const char *path, struct fuse_file_info *fi);
 static int nbdfuse_read (const char *path, char *buf,
                          size_t count, off_t offset,
                          struct fuse_file_info *fi);
-static int nbdfuse_write (const char *path, const char *buf,
-                          size_t count, off_t offset,
-                          struct fuse_file_info *fi);
+static int nbdfuse_write_buf (const char *path, struct fuse_bufvec *buf,
+                              off_t offset, struct fuse_file_info *fi);
 static int nbdfuse_fsync (const char *path, int datasync,
                           struct fuse_file_info *fi);
 static int nbdfuse_release (const char *path, struct fuse_file_info *fi);
+static int nbdfuse_fallocate (const char *path, int mode,
+                              off_t offset, off_t len,
+                              struct fuse_file_info *fi);
 
 static struct fuse_operations fuse_operations = {
   .getattr           = nbdfuse_getattr,
   .readdir           = nbdfuse_readdir,
   .open              = nbdfuse_open,
   .read              = nbdfuse_read,
-  .write             = nbdfuse_write,
+  .write_buf         = nbdfuse_write_buf,
   .fsync             = nbdfuse_fsync,
   .release           = nbdfuse_release,
+  .fallocate         = nbdfuse_fallocate,
 };
 
 static void __attribute__((noreturn))
@@ -88,7 +115,9 @@ usage (FILE *fp, int exitcode)
 "Mount NBD server as a virtual file:\n"
 "\n"
 #ifdef HAVE_LIBXML2
-"    nbdfuse [-o FUSE-OPTION] [-P PIDFILE] [-r] MOUNTPOINT[/FILENAME] URI\n"
+"    nbdfuse [-C N] [--cache-size=SIZE [--readahead=SIZE] [--writeback]]\n"
+"            [-o FUSE-OPTION] [-P PIDFILE] [-r]\n"
+"            MOUNTPOINT[/FILENAME] URI\n"
 "\n"
 "Other modes:\n"
 "\n"
@@ -121,6 +150,39 @@ fuse_help (const char *prog)
   exit (EXIT_SUCCESS);
 }
 
+/* Parse a size such as 64M. */
+static uint64_t
+parse_size (const char *prog, const char *option, const char *arg)
+{
+  unsigned long long v;
+  char *end;
+
+  errno = 0;
+  v = strtoull (arg, &end, 10);
+  if (errno != 0 || end == arg)
+    goto error;
+  switch (*end) {
+  case 'k': case 'K': v <<= 10; end++; break;
+  case 'm': case 'M': v <<= 20; end++; break;
+  case 'g': case 'G': v <<= 30; end++; break;
+  }
+  if (*end != '\0') {
+  error:
+    fprintf (stderr, "%s: could not parse %s: %s\n", prog, option, arg);
+    exit (EXIT_FAILURE);
+  }
+  return v;
+}
+
+static void
+free_write_buffer (void *vp)
+{
+  struct write_buffer *wb = vp;
+
+  free (wb->data);
+  free (wb);
+}
+
 static bool
 is_directory (const char *path)
 {
@@ -145,24 +207,32 @@ main (int argc, char *argv[])
   } mode = MODE_URI;
   enum {
     HELP_OPTION = CHAR_MAX + 1,
+    CACHE_SIZE_OPTION,
     FUSE_HELP_OPTION,
+    READAHEAD_OPTION,
+    WRITEBACK_OPTION,
   };
   /* Note the "+" means we stop processing as soon as we get to the
    * first non-option argument (the mountpoint) and then we parse the
    * rest of the command line without getopt.
    */
-  const char *short_options = "+o:P:rV";
+  const char *short_options = "+C:o:P:rV";
   const struct option long_options[] = {
+    { "cache-size",         required_argument, NULL, CACHE_SIZE_OPTION },
+    { "connections",        required_argument, NULL, 'C' },
     { "fuse-help",          no_argument,       NULL, FUSE_HELP_OPTION },
     { "help",               no_argument,       NULL, HELP_OPTION },
     { "pidfile",            required_argument, NULL, 'P' },
     { "pid-file",           required_argument, NULL, 'P' },
     { "readonly",           no_argument,       NULL, 'r' },
     { "read-only",          no_argument,       NULL, 'r' },
+    { "readahead",          required_argument, NULL, READAHEAD_OPTION },
     { "version",            no_argument,       NULL, 'V' },
+    { "writeback",          no_argument,       NULL, WRITEBACK_OPTION },
 
     { NULL }
   };
+  struct nbd_handle *nbd;
   int c, fd, r;
   uint32_t cid, port;
   int64_t ssize;
@@ -184,6 +254,18 @@ main (int argc, char *argv[])
       fuse_help (argv[0]);
       exit (EXIT_SUCCESS);
 
+    case CACHE_SIZE_OPTION:
+      cache_size = parse_size (argv[0], "cache size", optarg);
+      break;
+
+    case 'C':
+      if (sscanf (optarg, "%d", &connections) != 1 || connections < 1) {
+        fprintf (stderr, "%s: could not parse number of connections: %s\n",
+                 argv[0], optarg);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case 'o':
       fuse_opt_add_opt_escaped (&fuse_options, optarg);
       break;
@@ -196,6 +278,14 @@ main (int argc, char *argv[])
       readonly = true;
       break;
 
+    case READAHEAD_OPTION:
+      readahead_size = parse_size (argv[0], "readahead", optarg);
+      break;
+
+    case WRITEBACK_OPTION:
+      writeback = true;
+      break;
+
     case 'V':
       display_version ();
       exit (EXIT_SUCCESS);
@@ -311,17 +401,34 @@ main (int argc, char *argv[])
    * opening FUSE and libnbd.
    */
 
-  /* Create the libnbd handle. */
-  nbd = nbd_create ();
-  if (nbd == NULL) {
+  /* Only URIs can be connected to more than once.  The other modes
+   * would start a new server for each connection, or cannot be
+   * repeated.
+   */
+  if (mode != MODE_URI)
+    connections = 1;
+
+ again:
+  /* Create the libnbd handles. */
+  group = nbd_group_create (connections);
+  if (group == NULL) {
     fprintf (stderr, "%s\n", nbd_get_error ());
     exit (EXIT_FAILURE);
   }
+  nbd = nbd_group_get_handle (group, 0);
 
   /* Connect to the NBD server synchronously. */
   switch (mode) {
   case MODE_URI:
-    if (nbd_connect_uri (nbd, argv[optind]) == -1) {
+    if (nbd_group_connect_uri (group, argv[optind]) == -1) {
+      /* Fall back to one connection if the server does not support
+       * multi-conn.
+       */
+      if (connections > 1 && nbd_get_errno () == ENOTSUP) {
+        nbd_group_close (group);
+        connections = 1;
+        goto again;
+      }
       fprintf (stderr, "%s\n", nbd_get_error ());
       exit (EXIT_FAILURE);
     }
@@ -392,6 +499,15 @@ main (int argc, char *argv[])
   }
   size = (uint64_t) ssize;
 
+  if (cache_size > 0) {
+    r = cache_init (cache_size, readahead_size, writeback);
+    if (r < 0) {
+      errno = -r;
+      perror ("cache_init");
+      exit (EXIT_FAILURE);
+    }
+  }
+
   /* This is just used to give an unchanging time when they stat in
    * the mountpoint.
    */
@@ -458,17 +574,31 @@ main (int argc, char *argv[])
     }
   }
 
+  r = pthread_key_create (&write_buffer_key, free_write_buffer);
+  if (r != 0) {
+    errno = r;
+    perror ("pthread_key_create");
+    exit (EXIT_FAILURE);
+  }
+
   /* Enter the main loop. */
-  r = fuse_loop (fuse);
+  r = fuse_loop_mt (fuse);
   if (r != 0)
-    perror ("fuse_loop");
+    perror ("fuse_loop_mt");
 
   /* Close FUSE. */
   fuse_unmount (mountpoint, ch);
   fuse_destroy (fuse);
 
-  /* Close NBD handle. */
-  nbd_close (nbd);
+  /* Write back anything still dirty in the cache. */
+  if (cache_size > 0) {
+    if (!readonly && cache_flush () < 0)
+      r = -1;
+    cache_free ();
+  }
+
+  /* Close NBD handles. */
+  nbd_group_close (group);
 
   free (mountpoint);
   free (filename);
@@ -483,7 +613,7 @@ main (int argc, char *argv[])
  */
 #define CHECK_NBD_ERROR(CALL)                                   \
   do { if ((CALL) == -1) return check_nbd_error (); } while (0)
-static int
+int
 check_nbd_error (void)
 {
   int err;
@@ -566,6 +696,8 @@ nbdfuse_read (const char *path, char *buf,
               size_t count, off_t offset,
               struct fuse_file_info *fi)
 {
+  int r;
+
   if (path[0] != '/' || strcmp (path+1, filename) != 0)
     return -ENOENT;
 
@@ -578,16 +710,58 @@ nbdfuse_read (const char *path, char *buf,
   if (offset + count > size)
     count = size - offset;
 
-  CHECK_NBD_ERROR (nbd_pread (nbd, buf, count, offset, 0));
+  if (cache_size > 0) {
+    r = cache_pread (buf, count, offset);
+    return r < 0 ? r : (int) count;
+  }
+
+  CHECK_NBD_ERROR (nbd_pread (nbd_group_select (group, offset),
+                              buf, count, offset, 0));
 
   return (int) count;
 }
 
+/* Return this thread's write buffer, grown to at least count bytes. */
+static char *
+get_write_buffer (size_t count)
+{
+  struct write_buffer *wb = pthread_getspecific (write_buffer_key);
+  char *p;
+
+  if (wb == NULL) {
+    wb = calloc (1, sizeof *wb);
+    if (wb == NULL)
+      return NULL;
+    if (pthread_setspecific (write_buffer_key, wb) != 0) {
+      free (wb);
+      return NULL;
+    }
+  }
+  if (wb->size < count) {
+    p = realloc (wb->data, count);
+    if (p == NULL)
+      return NULL;
+    wb->data = p;
+    wb->size = count;
+  }
+  return wb->data;
+}
+
+/* If FUSE has the data in a single memory buffer it is written from
+ * there.  Otherwise, for example when FUSE was told to splice the data
+ * into a pipe, it is copied straight into this thread's write buffer,
+ * which is reused, where FUSE would allocate a new buffer for each
+ * write.
+ */
 static int
-nbdfuse_write (const char *path, const char *buf,
-               size_t count, off_t offset,
-               struct fuse_file_info *fi)
+nbdfuse_write_buf (const char *path, struct fuse_bufvec *buf,
+                   off_t offset, struct fuse_file_info *fi)
 {
+  const struct fuse_buf *b = &buf->buf[buf->idx];
+  size_t count;
+  const char *data;
+  ssize_t r;
+
   /* Probably shouldn't happen because of nbdfuse_open check. */
   if (readonly)
     return -EACCES;
@@ -598,13 +772,37 @@ nbdfuse_write (const char *path, const char *buf,
   if (offset >= size)
     return 0;
 
+  count = fuse_buf_size (buf);
+
   if (count > MAX_REQUEST_SIZE)
     count = MAX_REQUEST_SIZE;
 
   if (offset + count > size)
     count = size - offset;
 
-  CHECK_NBD_ERROR (nbd_pwrite (nbd, buf, count, offset, 0));
+  if (buf->count - buf->idx == 1 && (b->flags & FUSE_BUF_IS_FD) == 0 &&
+      b->size - buf->off >= count)
+    data = (const char *) b->mem + buf->off;
+  else {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT (count);
+
+    dst.buf[0].mem = get_write_buffer (count);
+    if (dst.buf[0].mem == NULL)
+      return -ENOMEM;
+    r = fuse_buf_copy (&dst, buf, 0);
+    if (r < 0)
+      return r;
+    count = r;
+    data = dst.buf[0].mem;
+  }
+
+  if (cache_size > 0) {
+    r = cache_pwrite (data, count, offset);
+    return r < 0 ? r : (int) count;
+  }
+
+  CHECK_NBD_ERROR (nbd_pwrite (nbd_group_select (group, offset),
+                               data, count, offset, 0));
 
   return (int) count;
 }
@@ -612,14 +810,22 @@ nbdfuse_write (const char *path, const char *buf,
 static int
 nbdfuse_fsync (const char *path, int datasync, struct fuse_file_info *fi)
 {
+  int r;
+
   if (readonly)
     return 0;
 
-  /* If the server doesn't support flush then the operation is
-   * silently ignored.
+  if (cache_size > 0) {
+    r = cache_flush ();
+    if (r < 0)
+      return r;
+  }
+
+  /* Flush every connection, so that writes which completed on any of
+   * them are persistent.  If the server doesn't support flush then
+   * the operation is silently ignored.
    */
-  if (nbd_can_flush (nbd))
-    CHECK_NBD_ERROR (nbd_flush (nbd, 0));
+  CHECK_NBD_ERROR (nbd_group_flush (group, 0));
 
   return 0;
 }
@@ -635,3 +841,65 @@ nbdfuse_release (const char *path, struct fuse_file_info *fi)
 
   return nbdfuse_fsync (path, 0, fi);
 }
+
+/* Punching a hole must leave the range reading as zeroes, which NBD
+ * trim does not promise, so both modes use zero.  Zeroing a range
+ * asks the server to keep it allocated.  Plain allocation is not
+ * supported, as the server cannot be asked to reserve space.
+ */
+static int
+nbdfuse_fallocate (const char *path, int mode, off_t offset, off_t len,
+                   struct fuse_file_info *fi)
+{
+  uint32_t flags = 0;
+  uint64_t end, n;
+  int r;
+
+  if (readonly)
+    return -EACCES;
+
+  if (path[0] != '/' || strcmp (path+1, filename) != 0)
+    return -ENOENT;
+
+  if (offset < 0 || len <= 0)
+    return -EINVAL;
+
+  switch (mode & ~FALLOC_FL_KEEP_SIZE) {
+  case FALLOC_FL_PUNCH_HOLE:
+    if ((mode & FALLOC_FL_KEEP_SIZE) == 0)
+      return -EINVAL;
+    break;
+  case FALLOC_FL_ZERO_RANGE:
+    flags = LIBNBD_CMD_FLAG_NO_HOLE;
+    break;
+  default:
+    return -EOPNOTSUPP;
+  }
+
+  if (nbd_can_zero (nbd_group_get_handle (group, 0)) != 1)
+    return -EOPNOTSUPP;
+
+  /* The size of the file cannot change. */
+  end = (uint64_t) offset + len;
+  if (end > size) {
+    if ((mode & FALLOC_FL_KEEP_SIZE) == 0)
+      return -EOPNOTSUPP;
+    end = size;
+  }
+
+  for (; (uint64_t) offset < end; offset += n) {
+    n = end - offset;
+    if (n > MAX_ZERO_SIZE)
+      n = MAX_ZERO_SIZE;
+    if (cache_size > 0) {
+      r = cache_zero (n, offset, flags);
+      if (r < 0)
+        return r;
+    }
+    else
+      CHECK_NBD_ERROR (nbd_zero (nbd_group_select (group, offset),
+                                 n, offset, flags));
+  }
+
+  return 0;
+}
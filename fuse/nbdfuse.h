@@ -0,0 +1,45 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef NBDFUSE_H
+#define NBDFUSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <libnbd.h>
+
+extern struct nbd_group *group;
+extern uint64_t size;
+
+/* Print the libnbd error and return it as a negative errno. */
+extern int check_nbd_error (void);
+
+/* cache.c.  The functions return 0 or a negative errno, as FUSE
+ * expects.
+ */
+extern int cache_init (uint64_t cache_size, uint64_t readahead,
+                       bool writeback);
+extern void cache_free (void);
+extern int cache_pread (char *buf, size_t count, uint64_t offset);
+extern int cache_pwrite (const char *buf, size_t count, uint64_t offset);
+extern int cache_zero (size_t count, uint64_t offset, uint32_t flags);
+extern int cache_flush (void);
+
+#endif /* NBDFUSE_H */
@@ -61,3 +61,12 @@ dd if=/dev/urandom of=$data bs=1M count=10
 # writes.
 dd if=$data of=$mp/nbd bs=65519 conv=nocreat,notrunc
 cmp $data $mp/nbd
+
+# Punch a hole and zero a range in both files.
+if fallocate --help >/dev/null 2>&1; then
+    for f in $data $mp/nbd; do
+        fallocate -p -o 1M -l 1M $f
+        fallocate -z -o 5M -l 65536 -n $f
+    done
+    cmp $data $mp/nbd
+fi
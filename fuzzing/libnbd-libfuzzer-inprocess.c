@@ -0,0 +1,110 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* This is a libFuzzer test case for libnbd which runs entirely in
+ * this process.  Unlike libnbd-libfuzzer-test it does not fork a
+ * phony server for each test case.  Instead the handle is connected
+ * to a fake socket inside libnbd (see lib/fuzz.c) which hands the
+ * test case to the state machine straight from memory, so many more
+ * test cases can be run each second.
+ *
+ * The settings are made once on a template handle, and each test
+ * case uses a new handle copied from it, since a handle cannot be
+ * connected again once its connection has died.
+ *
+ * nbd_internal_fuzz_connect is not exported by the shared library,
+ * so this must be linked with the static library (see README).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+/* From lib/internal.h. */
+extern int nbd_internal_fuzz_connect (struct nbd_handle *h,
+                                      const void *data, size_t size);
+
+static struct nbd_handle *template;
+
+static int
+chunk (void *user_data, const void *subbuf, size_t count,
+       uint64_t offset, unsigned status, int *error)
+{
+  return 0;
+}
+
+static int
+extent (void *user_data, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  return 0;
+}
+
+int
+LLVMFuzzerInitialize (int *argc, char ***argv)
+{
+  template = nbd_create ();
+  if (template == NULL ||
+      nbd_add_meta_context (template, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return 0;
+}
+
+/* This is the entry point called by libFuzzer. */
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  struct nbd_handle *nbd;
+  char buf[512];
+
+  nbd = nbd_create_from (template);
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Note we ignore errors in these calls because we are only
+   * interested in whether the process crashes.  None of them wait,
+   * since the whole reply is available at once, and once the test
+   * case has been used up the handle is dead and they fail at once.
+   */
+  /* This tests the handshake phase. */
+  nbd_internal_fuzz_connect (nbd, data, size);
+
+  nbd_pread (nbd, buf, sizeof buf, 0, 0);
+  nbd_pread_structured (nbd, buf, sizeof buf, 0,
+                        (nbd_chunk_callback) { .callback = chunk }, 0);
+  nbd_block_status (nbd, sizeof buf, 0,
+                    (nbd_extent_callback) { .callback = extent }, 0);
+  nbd_pwrite (nbd, buf, sizeof buf, 0, 0);
+  nbd_flush (nbd, 0);
+  nbd_trim (nbd, 512, 0, 0);
+  nbd_zero (nbd, 512, 0, 0);
+  nbd_cache (nbd, 512, 0, 0);
+
+  nbd_shutdown (nbd, 0);
+  nbd_close (nbd);
+  return 0;
+}
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -94,6 +95,30 @@ prepare_socket_activation_environment (void)
   return NULL;
 }
 
+/* The child of vfork shares the memory of the caller until it execs,
+ * so none of the caller's signal handlers may run in it.  All signals
+ * are blocked around vfork, and the child resets the handled ones to
+ * the default (which exec would do anyway) before restoring the
+ * signal mask.  SIGPIPE is reset even if it is ignored.
+ */
+static void
+reset_signals_in_child (const sigset_t *mask)
+{
+  struct sigaction sa;
+  int sig;
+
+  for (sig = 1; sig < NSIG; ++sig) {
+    if (sigaction (sig, NULL, &sa) == -1 || sa.sa_handler == SIG_DFL)
+      continue;
+    if (sa.sa_handler == SIG_IGN && sig != SIGPIPE)
+      continue;
+    memset (&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_DFL;
+    sigaction (sig, &sa, NULL);
+  }
+  sigprocmask (SIG_SETMASK, mask, NULL);
+}
+
 STATE_MACHINE {
  CONNECT_SA.START:
 #ifdef HAVE_EXECVPE
@@ -102,6 +127,7 @@ STATE_MACHINE {
   char **env;
   pid_t pid;
   int flags;
+  sigset_t all, mask;
 
   assert (!h->sock);
   assert (h->argv);
@@ -162,8 +188,21 @@ STATE_MACHINE {
     return 0;
   }
 
+  /* LISTEN_PID must be the pid of the child, which only the child
+   * knows, so posix_spawn cannot be used here.  vfork still avoids
+   * copying the page tables of a large caller.  The child only makes
+   * system calls and writes the pid into env, which it shares with
+   * the parent.
+   */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &mask);
+#ifdef HAVE_VFORK
+  pid = vfork ();
+#else
   pid = fork ();
+#endif
   if (pid == -1) {
+    pthread_sigmask (SIG_SETMASK, &mask, NULL);
     SET_NEXT_STATE (%.DEAD);
     set_error (errno, "fork");
     close (s);
@@ -196,8 +235,8 @@ STATE_MACHINE {
       nbd_internal_fork_safe_itoa ((long) getpid (), buf, sizeof buf);
     strcpy (&env[0][PREFIX_LENGTH], v);
 
-    /* Restore SIGPIPE back to SIG_DFL. */
-    signal (SIGPIPE, SIG_DFL);
+    /* Restore SIGPIPE back to SIG_DFL, and unblock the signals. */
+    reset_signals_in_child (&mask);
 
     execvpe (h->argv[0], h->argv, env);
     nbd_internal_fork_safe_perror (h->argv[0]);
@@ -208,6 +247,7 @@ STATE_MACHINE {
   }
 
   /* Parent. */
+  pthread_sigmask (SIG_SETMASK, &mask, NULL);
   close (s);
   nbd_internal_free_string_list (env);
   h->pid = pid;
@@ -30,21 +30,314 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <spawn.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
-/* Disable Nagle's algorithm on the socket, but don't fail. */
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define HAVE_TCP_RACE 1
+#endif
+
+/* How long to wait for a TCP connection attempt before starting the
+ * next one as well, from RFC 8305 section 5.
+ */
+#define CONNECTION_ATTEMPT_DELAY 250 /* milliseconds */
+
+/* Apply one option from nbd_set_socket_option, but don't fail. */
+static void
+set_socket_option (struct nbd_handle *h, int fd, const char *name,
+                   int level, int optname, int option)
+{
+  int value = h->socket_options[option];
+
+  if (value == 0)
+    return;
+  if (setsockopt (fd, level, optname, &value, sizeof value) == -1)
+    debug (h, "setsockopt: %s: %s", name, strerror (errno));
+}
+
+/* Apply the options from nbd_set_socket_option to a new socket of
+ * the given family.
+ */
+static void
+set_socket_options (struct nbd_handle *h, int fd, int family)
+{
+  set_socket_option (h, fd, "SO_SNDBUF", SOL_SOCKET, SO_SNDBUF,
+                     LIBNBD_SOCKET_OPTION_SNDBUF);
+  set_socket_option (h, fd, "SO_RCVBUF", SOL_SOCKET, SO_RCVBUF,
+                     LIBNBD_SOCKET_OPTION_RCVBUF);
+#ifdef SO_BUSY_POLL
+  set_socket_option (h, fd, "SO_BUSY_POLL", SOL_SOCKET, SO_BUSY_POLL,
+                     LIBNBD_SOCKET_OPTION_BUSY_POLL);
+#endif
+#ifdef SO_PRIORITY
+  set_socket_option (h, fd, "SO_PRIORITY", SOL_SOCKET, SO_PRIORITY,
+                     LIBNBD_SOCKET_OPTION_PRIORITY);
+#endif
+
+  if (family != AF_INET && family != AF_INET6)
+    return;
+  set_socket_option (h, fd, "TCP_NODELAY", IPPROTO_TCP, TCP_NODELAY,
+                     LIBNBD_SOCKET_OPTION_NODELAY);
+#ifdef TCP_QUICKACK
+  set_socket_option (h, fd, "TCP_QUICKACK", IPPROTO_TCP, TCP_QUICKACK,
+                     LIBNBD_SOCKET_OPTION_QUICKACK);
+#endif
+
+  /* The keepalive idle time also turns keepalives on. */
+  if (h->socket_options[LIBNBD_SOCKET_OPTION_KEEPALIVE] > 0) {
+    int one = 1;
+
+    if (setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one) == -1)
+      debug (h, "setsockopt: SO_KEEPALIVE: %s", strerror (errno));
+#ifdef TCP_KEEPIDLE
+    set_socket_option (h, fd, "TCP_KEEPIDLE", IPPROTO_TCP, TCP_KEEPIDLE,
+                       LIBNBD_SOCKET_OPTION_KEEPALIVE);
+#endif
+#ifdef TCP_KEEPINTVL
+    set_socket_option (h, fd, "TCP_KEEPINTVL", IPPROTO_TCP, TCP_KEEPINTVL,
+                       LIBNBD_SOCKET_OPTION_KEEPALIVE_INTERVAL);
+#endif
+#ifdef TCP_KEEPCNT
+    set_socket_option (h, fd, "TCP_KEEPCNT", IPPROTO_TCP, TCP_KEEPCNT,
+                       LIBNBD_SOCKET_OPTION_KEEPALIVE_COUNT);
+#endif
+  }
+#ifdef TCP_USER_TIMEOUT
+  set_socket_option (h, fd, "TCP_USER_TIMEOUT", IPPROTO_TCP, TCP_USER_TIMEOUT,
+                     LIBNBD_SOCKET_OPTION_USER_TIMEOUT);
+#endif
+}
+
+/* Put the results from getaddrinfo in h->addrs in the order they
+ * are tried.  As RFC 8305 section 4 recommends, the address families
+ * are interleaved, starting with the family of the first result, so
+ * that a host which cannot be reached over one of them (usually
+ * IPv6) is not tried over that family alone first.
+ */
+static int
+sort_addresses (struct nbd_handle *h)
+{
+  struct addrinfo **addrs, *a, *b;
+  size_t i, n = 0;
+  int family;
+
+  for (a = h->result; a != NULL; a = a->ai_next)
+    n++;
+  addrs = realloc (h->addrs, n * sizeof *addrs);
+  if (addrs == NULL) {
+    set_error (errno, "realloc");
+    return -1;
+  }
+  h->addrs = addrs;
+  h->nr_addrs = n;
+  h->next_addr = 0;
+
+  /* a walks the results of the first family, b the others. */
+  family = h->result->ai_family;
+  a = b = h->result;
+  for (i = 0; i < n; ++i) {
+    while (a && a->ai_family != family)
+      a = a->ai_next;
+    while (b && b->ai_family == family)
+      b = b->ai_next;
+    if (a && (b == NULL || i % 2 == 0)) {
+      addrs[i] = a;
+      a = a->ai_next;
+    }
+    else {
+      addrs[i] = b;
+      b = b->ai_next;
+    }
+  }
+  return 0;
+}
+
+static struct addrinfo *
+next_address (struct nbd_handle *h)
+{
+  if (h->next_addr >= h->nr_addrs)
+    return NULL;
+  return h->addrs[h->next_addr++];
+}
+
+#ifdef HAVE_TCP_RACE
+
+/* Set up the epoll file descriptor and the timer for racing. */
+static int
+race_start (struct nbd_handle *h)
+{
+  int epfd, tfd;
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1)
+    return -1;
+  tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (tfd == -1) {
+    close (epfd);
+    return -1;
+  }
+  ev.data.fd = tfd;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+    close (tfd);
+    close (epfd);
+    return -1;
+  }
+  h->sock = nbd_internal_socket_create (epfd);
+  if (!h->sock) {
+    close (tfd);
+    close (epfd);
+    return -1;
+  }
+  h->race_timerfd = tfd;
+  return 0;
+}
+
+/* Start connecting to rp, and add the socket to the race.  On
+ * failure the error is saved in h->connect_errno.
+ */
+static int
+race_add (struct nbd_handle *h, struct addrinfo *rp)
+{
+  struct epoll_event ev = { .events = EPOLLOUT };
+  int *fds;
+  int fd;
+
+  fd = socket (rp->ai_family, rp->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+               rp->ai_protocol);
+  if (fd == -1)
+    goto error;
+  set_socket_options (h, fd, rp->ai_family);
+  if (connect (fd, rp->ai_addr, rp->ai_addrlen) == -1 &&
+      errno != EINPROGRESS)
+    goto error;
+  fds = realloc (h->race_fds, (h->nr_race_fds + 1) * sizeof *fds);
+  if (fds == NULL)
+    goto error;
+  h->race_fds = fds;
+  ev.data.fd = fd;
+  if (epoll_ctl (h->sock->ops->get_fd (h->sock), EPOLL_CTL_ADD,
+                 fd, &ev) == -1)
+    goto error;
+  h->race_fds[h->nr_race_fds++] = fd;
+  return 0;
+
+ error:
+  if (h->connect_errno == 0)
+    h->connect_errno = errno;
+  if (fd >= 0)
+    close (fd);
+  return -1;
+}
+
+/* Start the timer for the next attempt. */
+static int
+race_arm_timer (struct nbd_handle *h)
+{
+  struct itimerspec its = {
+    .it_value.tv_sec = CONNECTION_ATTEMPT_DELAY / 1000,
+    .it_value.tv_nsec = (CONNECTION_ATTEMPT_DELAY % 1000) * 1000000,
+  };
+
+  if (timerfd_settime (h->race_timerfd, 0, &its, NULL) == -1) {
+    set_error (errno, "timerfd_settime");
+    return -1;
+  }
+  return 0;
+}
+
+/* Remove fd from the race without closing it. */
 static void
-disable_nagle (int sock)
+race_remove (struct nbd_handle *h, int fd)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_race_fds; ++i) {
+    if (h->race_fds[i] == fd) {
+      h->race_fds[i] = h->race_fds[--h->nr_race_fds];
+      break;
+    }
+  }
+  epoll_ctl (h->sock->ops->get_fd (h->sock), EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Look at what has happened since the last check.  Returns the
+ * socket which connected, -1 to keep waiting, -2 if another attempt
+ * should be started, or -3 on error.
+ */
+static int
+race_check (struct nbd_handle *h)
 {
-  const int flag = 1;
+  struct epoll_event events[16];
+  uint64_t expirations;
+  bool next = false;
+  int fd, i, n, status;
+  socklen_t len;
+
+  n = epoll_wait (h->sock->ops->get_fd (h->sock), events, 16, 0);
+  if (n == -1) {
+    set_error (errno, "epoll_wait");
+    return -3;
+  }
+  for (i = 0; i < n; ++i) {
+    fd = events[i].data.fd;
+    if (fd == h->race_timerfd) {
+      if (read (fd, &expirations, sizeof expirations) > 0)
+        next = true;
+      continue;
+    }
+    len = sizeof status;
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &status, &len) == -1) {
+      set_error (errno, "getsockopt: SO_ERROR");
+      return -3;
+    }
+    race_remove (h, fd);
+    if (status == 0)
+      return fd;
+    /* This attempt failed, so start the next one straight away. */
+    if (h->connect_errno == 0)
+      h->connect_errno = status;
+    close (fd);
+    next = true;
+  }
+  return next || h->nr_race_fds == 0 ? -2 : -1;
+}
+
+#else /* !HAVE_TCP_RACE */
 
-  setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+static int
+race_start (struct nbd_handle *h)
+{
+  errno = ENOTSUP;
+  return -1;
 }
 
+static int
+race_add (struct nbd_handle *h, struct addrinfo *rp)
+{
+  abort ();
+}
+
+static int
+race_arm_timer (struct nbd_handle *h)
+{
+  abort ();
+}
+
+static int
+race_check (struct nbd_handle *h)
+{
+  abort ();
+}
+
+#endif /* !HAVE_TCP_RACE */
+
 STATE_MACHINE {
  CONNECT.START:
   int fd;
@@ -63,7 +356,7 @@ STATE_MACHINE {
     return 0;
   }
 
-  disable_nagle (fd);
+  set_socket_options (h, fd, h->connaddr.ss_family);
 
   if (connect (fd, (struct sockaddr *) &h->connaddr,
                h->connaddrlen) == -1) {
@@ -97,38 +390,59 @@ STATE_MACHINE {
   }
 
  CONNECT_TCP.START:
-  int r;
-
   assert (h->hostname != NULL);
   assert (h->port != NULL);
 
-  if (h->result) {
-    freeaddrinfo (h->result);
-    h->result = NULL;
-  }
+  nbd_internal_free_addrinfo (h->result);
+  h->result = NULL;
 
   h->connect_errno = 0;
 
   memset (&h->hints, 0, sizeof h->hints);
-  h->hints.ai_family = AF_UNSPEC;
+  switch (h->tcp_family) {
+  case LIBNBD_TCP_FAMILY_IPV4: h->hints.ai_family = AF_INET; break;
+  case LIBNBD_TCP_FAMILY_IPV6: h->hints.ai_family = AF_INET6; break;
+  default: h->hints.ai_family = AF_UNSPEC;
+  }
   h->hints.ai_socktype = SOCK_STREAM;
   h->hints.ai_flags = 0;
   h->hints.ai_protocol = 0;
 
-  /* XXX Unfortunately getaddrinfo blocks.  getaddrinfo_a isn't
-   * portable and in any case isn't an alternative because it can't be
-   * integrated into a main loop.
+  /* getaddrinfo may block, so unless the answer is already known
+   * this starts a thread to call it, see lib/resolve.c.
    */
-  r = getaddrinfo (h->hostname, h->port, &h->hints, &h->result);
-  if (r != 0) {
+  if (nbd_internal_resolve_start (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  SET_NEXT_STATE (%RESOLVING);
+  return 0;
+
+ CONNECT_TCP.RESOLVING:
+  switch (nbd_internal_resolve_finish (h)) {
+  case 0:                       /* Keep waiting. */
+    return 0;
+  case -1:
+    /* When reconnecting, the commands are waiting, so give up. */
+    if (h->reconnecting) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
     SET_NEXT_STATE (%^START);
-    set_error (0, "getaddrinfo: %s:%s: %s",
-               h->hostname, h->port, gai_strerror (r));
     return -1;
   }
 
-  h->rp = h->result;
-  SET_NEXT_STATE (%CONNECT);
+  if (sort_addresses (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+
+  if (h->nr_addrs > 1)
+    SET_NEXT_STATE (%RACE_START);
+  else {
+    h->rp = next_address (h);
+    SET_NEXT_STATE (%CONNECT);
+  }
   return 0;
 
  CONNECT_TCP.CONNECT:
@@ -140,10 +454,14 @@ STATE_MACHINE {
     /* We tried all the results from getaddrinfo without success.
      * Save errno from most recent connect(2) call. XXX
      */
-    SET_NEXT_STATE (%^START);
     set_error (h->connect_errno,
                "connect: %s:%s: could not connect to remote host",
                h->hostname, h->port);
+    if (h->reconnecting) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    SET_NEXT_STATE (%^START);
     return -1;
   }
 
@@ -160,7 +478,7 @@ STATE_MACHINE {
     return 0;
   }
 
-  disable_nagle (fd);
+  set_socket_options (h, fd, h->rp->ai_family);
 
   if (connect (fd, h->rp->ai_addr, h->rp->ai_addrlen) == -1) {
     if (errno != EINPROGRESS) {
@@ -195,19 +513,94 @@ STATE_MACHINE {
   return 0;
 
  CONNECT_TCP.NEXT_ADDRESS:
-  if (h->sock) {
-    h->sock->ops->close (h->sock);
-    h->sock = NULL;
-  }
-  if (h->rp)
-    h->rp = h->rp->ai_next;
+  if (h->sock)
+    nbd_internal_close_socket (h);
+  h->rp = next_address (h);
   SET_NEXT_STATE (%CONNECT);
   return 0;
 
+ CONNECT_TCP.RACE_START:
+  assert (!h->sock);
+
+  /* Without epoll and timerfd, try the addresses one at a time. */
+  if (race_start (h) == -1) {
+    debug (h, "cannot race connections, trying addresses in turn: %s",
+           strerror (errno));
+    h->rp = next_address (h);
+    SET_NEXT_STATE (%CONNECT);
+    return 0;
+  }
+  SET_NEXT_STATE (%RACE_ATTEMPT);
+  return 0;
+
+ CONNECT_TCP.RACE_ATTEMPT:
+  struct addrinfo *rp;
+
+  rp = next_address (h);
+  if (rp == NULL) {
+    if (h->nr_race_fds > 0) {
+      SET_NEXT_STATE (%RACE_CHECK);
+      return 0;
+    }
+    nbd_internal_close_socket (h);
+    nbd_internal_free_tcp_race (h);
+    set_error (h->connect_errno,
+               "connect: %s:%s: could not connect to remote host",
+               h->hostname, h->port);
+    if (h->reconnecting) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    SET_NEXT_STATE (%^START);
+    return -1;
+  }
+
+  if (race_add (h, rp) == -1) {
+    SET_NEXT_STATE (%RACE_ATTEMPT);
+    return 0;
+  }
+  if (h->next_addr < h->nr_addrs && race_arm_timer (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  SET_NEXT_STATE (%RACE_CHECK);
+  return 0;
+
+ CONNECT_TCP.RACE_CHECK:
+  int fd;
+
+  fd = race_check (h);
+  switch (fd) {
+  case -1:                      /* Keep waiting. */
+    return 0;
+  case -2:
+    SET_NEXT_STATE (%RACE_ATTEMPT);
+    return 0;
+  case -3:
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+
+  /* fd has won, replace the epoll file descriptor with it. */
+  nbd_internal_free_tcp_race (h);
+  nbd_internal_close_socket (h);
+  h->sock = nbd_internal_socket_create (fd);
+  if (!h->sock) {
+    close (fd);
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  SET_NEXT_STATE (%^MAGIC.START);
+  return 0;
+
  CONNECT_COMMAND.START:
   int sv[2];
   pid_t pid;
   int flags;
+  int fd, err;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t sigpipe;
 
   assert (!h->sock);
   assert (h->argv);
@@ -218,31 +611,65 @@ STATE_MACHINE {
     return 0;
   }
 
-  pid = fork ();
-  if (pid == -1) {
+  /* dup2 onto the same fd would leave it close-on-exec, so move the
+   * child end out of the way if stdin or stdout was closed.
+   */
+  if (sv[1] <= STDOUT_FILENO) {
+    fd = fcntl (sv[1], F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    if (fd == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      set_error (errno, "fcntl: F_DUPFD_CLOEXEC");
+      close (sv[0]);
+      close (sv[1]);
+      return 0;
+    }
+    close (sv[1]);
+    sv[1] = fd;
+  }
+
+  /* Use posix_spawn rather than fork, so that starting the command
+   * does not have to copy the page tables of a large caller.  Both
+   * ends of the socketpair are close-on-exec, so the child only gets
+   * the copies on stdin and stdout.
+   */
+  err = posix_spawn_file_actions_init (&actions);
+  if (err != 0) {
     SET_NEXT_STATE (%.DEAD);
-    set_error (errno, "fork");
+    set_error (err, "posix_spawn_file_actions_init");
     close (sv[0]);
     close (sv[1]);
     return 0;
   }
-  if (pid == 0) {         /* child - run command */
-    close (0);
-    close (1);
+  err = posix_spawnattr_init (&attr);
+  if (err != 0) {
+    SET_NEXT_STATE (%.DEAD);
+    set_error (err, "posix_spawnattr_init");
+    posix_spawn_file_actions_destroy (&actions);
     close (sv[0]);
-    dup2 (sv[1], 0);
-    dup2 (sv[1], 1);
     close (sv[1]);
+    return 0;
+  }
 
-    /* Restore SIGPIPE back to SIG_DFL. */
-    signal (SIGPIPE, SIG_DFL);
-
-    execvp (h->argv[0], h->argv);
-    nbd_internal_fork_safe_perror (h->argv[0]);
-    if (errno == ENOENT)
-      _exit (127);
-    else
-      _exit (126);
+  /* Restore SIGPIPE back to SIG_DFL. */
+  sigemptyset (&sigpipe);
+  sigaddset (&sigpipe, SIGPIPE);
+  if ((err = posix_spawn_file_actions_adddup2 (&actions, sv[1], 0)) != 0 ||
+      (err = posix_spawn_file_actions_adddup2 (&actions, sv[1], 1)) != 0 ||
+      (err = posix_spawnattr_setsigdefault (&attr, &sigpipe)) != 0 ||
+      (err = posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF)) != 0)
+    set_error (err, "posix_spawn_file_actions");
+  else {
+    err = posix_spawnp (&pid, h->argv[0], &actions, &attr, h->argv, environ);
+    if (err != 0)
+      set_error (err, "%s", h->argv[0]);
+  }
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+  if (err != 0) {
+    SET_NEXT_STATE (%.DEAD);
+    close (sv[0]);
+    close (sv[1]);
+    return 0;
   }
 
   /* Parent. */
@@ -261,6 +688,7 @@ STATE_MACHINE {
     return 0;
   }
 
+  set_socket_options (h, sv[0], AF_UNIX);
   h->sock = nbd_internal_socket_create (sv[0]);
   if (!h->sock) {
     SET_NEXT_STATE (%.DEAD);
@@ -18,9 +18,37 @@
 
 /* State machine for issuing commands (requests) to the server. */
 
+/* Fill in the request header for cmd, using the extended form with
+ * its 64 bit count if extended headers were negotiated.  Returns the
+ * length of the header.
+ */
+static size_t
+prepare_request (struct nbd_handle *h, union request_header *req,
+                 const struct command *cmd)
+{
+  if (h->extended_headers) {
+    req->extended.magic = htobe32 (NBD_EXTENDED_REQUEST_MAGIC);
+    req->extended.flags = htobe16 (cmd->flags);
+    req->extended.type = htobe16 (cmd->type);
+    req->extended.handle = htobe64 (cmd->cookie);
+    req->extended.offset = htobe64 (cmd->offset);
+    req->extended.count = htobe64 (cmd->count);
+    return sizeof req->extended;
+  }
+
+  req->compact.magic = htobe32 (NBD_REQUEST_MAGIC);
+  req->compact.flags = htobe16 (cmd->flags);
+  req->compact.type = htobe16 (cmd->type);
+  req->compact.handle = htobe64 (cmd->cookie);
+  req->compact.offset = htobe64 (cmd->offset);
+  req->compact.count = htobe32 ((uint32_t) cmd->count);
+  return sizeof req->compact;
+}
+
 STATE_MACHINE {
  ISSUE_COMMAND.START:
   struct command *cmd;
+  int slots;
 
   assert (h->cmds_to_issue != NULL);
   cmd = h->cmds_to_issue;
@@ -39,24 +67,105 @@ STATE_MACHINE {
     return 0;
   }
 
-  h->request.magic = htobe32 (NBD_REQUEST_MAGIC);
-  h->request.flags = htobe16 (cmd->flags);
-  h->request.type = htobe16 (cmd->type);
-  h->request.handle = htobe64 (cmd->cookie);
-  h->request.offset = htobe64 (cmd->offset);
-  h->request.count = htobe32 ((uint32_t) cmd->count);
+  /* See nbd_set_adaptive_depth. */
+  slots = nbd_internal_depth_slots (h);
+  if (slots == 0) {
+    SET_NEXT_STATE (%.READY);
+    return 0;
+  }
+
+  /* See nbd_set_elevator. */
+  nbd_internal_elevator_sort (h);
+  cmd = h->cmds_to_issue;
+
+  if (h->coalesce_writes) {
+    coalesce_writes (h);
+    cmd = h->cmds_to_issue;
+  }
+
+  /* See nbd_set_rate_limit. */
+  if (!nbd_internal_rate_admit (h, cmd)) {
+    SET_NEXT_STATE (%.READY);
+    return 0;
+  }
+
+  /* If the socket supports it, gather the requests and write
+   * payloads of as many queued commands as possible into a single
+   * send.
+   */
+  if (h->sock->ops->send_iov) {
+    size_t len;
+    bool payload = false, held = false;
+    int i;
+
+    h->wiov_next = h->wiov_cnt = 0;
+    h->wcmds_sent = 0;
+    h->wzerocopy = false;
+    h->wlen = 0;
+    for (i = 0; cmd != NULL && i < MAX_SEND_BATCH && i < slots;
+         cmd = cmd->next, ++i) {
+      if (i > 0 && !nbd_internal_rate_admit (h, cmd)) {
+        held = true;
+        break;
+      }
+      len = prepare_request (h, &h->wreqs[i], cmd);
+      h->wiov[h->wiov_cnt].iov_base = &h->wreqs[i];
+      h->wiov[h->wiov_cnt].iov_len = len;
+      h->wiov_cnt++;
+      h->wlen += len;
+      /* A zero-copy payload ends the batch, since the requests
+       * before it must be copied while it must not.
+       */
+      if (use_zerocopy (h, cmd)) {
+        h->wiov_cmd_end[i++] = h->wiov_cnt;
+        h->wzerocopy = payload = true;
+        break;
+      }
+      /* Likewise a payload read from a file descriptor or gathered
+       * from several buffers, which is sent by itself.
+       */
+      if (separate_write_payload (cmd)) {
+        h->wiov_cmd_end[i++] = h->wiov_cnt;
+        payload = true;
+        break;
+      }
+      if (cmd->type == NBD_CMD_WRITE) {
+        h->wiov[h->wiov_cnt].iov_base = cmd->data;
+        h->wiov[h->wiov_cnt].iov_len = cmd->count;
+        h->wiov_cnt++;
+        h->wlen += cmd->count;
+      }
+      h->wiov_cmd_end[i] = h->wiov_cnt;
+    }
+    h->wcmds = i;
+    /* Only hint that more data follows if there are commands which
+     * didn't fit in this batch and may be sent straight after it, or
+     * a payload to send by itself.
+     */
+    if (payload || (cmd != NULL && i < slots && !held))
+      h->wflags = MSG_MORE;
+    SET_NEXT_STATE (%SEND_REQUEST);
+    return 0;
+  }
+
+  h->wlen = prepare_request (h, &h->request, cmd);
   h->wbuf = &h->request;
-  h->wlen = sizeof (h->request);
-  if (cmd->type == NBD_CMD_WRITE || cmd->next)
+  if (cmd->type == NBD_CMD_WRITE ||
+      (cmd->next && slots > 1 && !h->rate_limited))
     h->wflags = MSG_MORE;
   SET_NEXT_STATE (%SEND_REQUEST);
   return 0;
 
  ISSUE_COMMAND.SEND_REQUEST:
-  switch (send_from_wbuf (h)) {
+  switch (h->wcmds ? send_from_wiov (h) : send_from_wbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:  SET_NEXT_STATE (%PREPARE_WRITE_PAYLOAD);
+  case 0:  SET_NEXT_STATE (%PREPARE_WRITE_PAYLOAD); return 0;
   }
+  /* Poll may not wake up for replies which the transport has already
+   * received (see lib/shm.c), so read them before waiting.
+   */
+  if (h->sock->ops->pending && h->sock->ops->pending (h->sock))
+    SET_NEXT_STATE (%PAUSE_SEND_REQUEST);
   return 0;
 
  ISSUE_COMMAND.PAUSE_SEND_REQUEST:
@@ -71,10 +180,28 @@ STATE_MACHINE {
 
   assert (h->cmds_to_issue != NULL);
   cmd = h->cmds_to_issue;
-  assert (cmd->cookie == be64toh (h->request.handle));
+  /* Write payloads were already sent as part of a vectored send,
+   * except for a zero-copy or separate payload at the end.
+   */
+  if (h->wcmds) {
+    if (h->wzerocopy) {
+      set_write_payload (h, cmd);
+      h->wflags = MSG_ZEROCOPY;
+      SET_NEXT_STATE (%SEND_WRITE_PAYLOAD);
+    }
+    else if (separate_write_payload (cmd)) {
+      set_write_payload (h, cmd);
+      if (cmd->next && cmd->count < 64 * 1024)
+        h->wflags = MSG_MORE;
+      SET_NEXT_STATE (%SEND_WRITE_PAYLOAD);
+    }
+    else
+      SET_NEXT_STATE (%FINISH);
+    return 0;
+  }
+  assert (cmd->cookie == be64toh (h->request.compact.handle));
   if (cmd->type == NBD_CMD_WRITE) {
-    h->wbuf = cmd->data;
-    h->wlen = cmd->count;
+    set_write_payload (h, cmd);
     if (cmd->next && cmd->count < 64 * 1024)
       h->wflags = MSG_MORE;
     SET_NEXT_STATE (%SEND_WRITE_PAYLOAD);
@@ -84,10 +211,12 @@ STATE_MACHINE {
   return 0;
 
  ISSUE_COMMAND.SEND_WRITE_PAYLOAD:
-  switch (send_from_wbuf (h)) {
+  switch (send_write_payload (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:  SET_NEXT_STATE (%FINISH);
+  case 0:  SET_NEXT_STATE (%FINISH); return 0;
   }
+  if (h->sock->ops->pending && h->sock->ops->pending (h->sock))
+    SET_NEXT_STATE (%PAUSE_WRITE_PAYLOAD);
   return 0;
 
  ISSUE_COMMAND.PAUSE_WRITE_PAYLOAD:
@@ -103,12 +232,15 @@ STATE_MACHINE {
   assert (!h->wlen);
   assert (h->cmds_to_issue != NULL);
   cmd = h->cmds_to_issue;
-  assert (cmd->cookie == be64toh (h->request.handle));
-  h->cmds_to_issue = cmd->next;
-  if (h->cmds_to_issue_tail == cmd)
-    h->cmds_to_issue_tail = NULL;
-  cmd->next = h->cmds_in_flight;
-  h->cmds_in_flight = cmd;
+  if (h->wcmds) {
+    assert (h->wcmds_sent == h->wcmds - 1);
+    assert (cmd->cookie == be64toh (h->wreqs[h->wcmds - 1].compact.handle));
+    h->wcmds = 0;
+    h->wzerocopy = false;
+  }
+  else
+    assert (cmd->cookie == be64toh (h->request.compact.handle));
+  finish_issued_command (h);
   SET_NEXT_STATE (%.READY);
   return 0;
 
@@ -16,14 +16,26 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-/* State machine for ending fixed newstyle handshake with NBD_OPT_GO. */
+/* State machine for ending fixed newstyle handshake with NBD_OPT_GO,
+ * or for querying the export with NBD_OPT_INFO in probe mode.
+ */
 
 STATE_MACHINE {
  NEWSTYLE.OPT_GO.START:
+  /* The option was sent by OPT_PIPELINE, go straight to the reply. */
+  if (h->pipelined & PIPELINED_GO) {
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+    return 0;
+  }
+
   h->sbuf.option.version = htobe64 (NBD_NEW_VERSION);
-  h->sbuf.option.option = htobe32 (NBD_OPT_GO);
+  h->sbuf.option.option =
+    htobe32 (h->probe_only ? NBD_OPT_INFO : NBD_OPT_GO);
   h->sbuf.option.optlen =
-    htobe32 (/* exportnamelen */ 4 + strlen (h->export_name) + /* nrinfos */ 2);
+    htobe32 (/* exportnamelen */ 4 + strlen (h->export_name) +
+             /* nrinfos */ 2 + /* NBD_INFO_BLOCK_SIZE */ 2);
   h->wbuf = &h->sbuf;
   h->wlen = sizeof h->sbuf.option;
   h->wflags = MSG_MORE;
@@ -59,9 +71,11 @@ STATE_MACHINE {
   switch (send_from_wbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
   case 0:
-    h->sbuf.nrinfos = 0;
+    /* Ask the server for its block size constraints. */
+    h->sbuf.infos[0] = htobe16 (1);
+    h->sbuf.infos[1] = htobe16 (NBD_INFO_BLOCK_SIZE);
     h->wbuf = &h->sbuf;
-    h->wlen = 2;
+    h->wlen = sizeof h->sbuf.infos;
     SET_NEXT_STATE (%SEND_NRINFOS);
   }
   return 0;
@@ -80,7 +94,8 @@ STATE_MACHINE {
   switch (recv_into_rbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
   case 0:
-    if (prepare_for_reply_payload (h, NBD_OPT_GO) == -1) {
+    if (prepare_for_reply_payload (h, h->probe_only ? NBD_OPT_INFO
+                                                    : NBD_OPT_GO) == -1) {
       SET_NEXT_STATE (%.DEAD);
       return 0;
     }
@@ -102,13 +117,18 @@ STATE_MACHINE {
   uint16_t info;
   uint64_t exportsize;
   uint16_t eflags;
+  const char *opt = h->probe_only ? "NBD_OPT_INFO" : "NBD_OPT_GO";
 
+  h->pipelined &= ~PIPELINED_GO;
   reply = be32toh (h->sbuf.or.option_reply.reply);
   len = be32toh (h->sbuf.or.option_reply.replylen);
 
   switch (reply) {
   case NBD_REP_ACK:
-    SET_NEXT_STATE (%^FINISHED);
+    if (h->probe_only)
+      SET_NEXT_STATE (%^OPT_ABORT.START);
+    else
+      SET_NEXT_STATE (%^FINISHED);
     return 0;
   case NBD_REP_INFO:
     if (len > maxpayload /* see RECV_NEWSTYLE_OPT_GO_REPLY */)
@@ -130,8 +150,23 @@ STATE_MACHINE {
           return 0;
         }
         break;
+      case NBD_INFO_BLOCK_SIZE:
+        if (len != sizeof h->sbuf.or.payload.block_size) {
+          SET_NEXT_STATE (%.DEAD);
+          set_error (0, "handshake: incorrect NBD_INFO_BLOCK_SIZE option reply length");
+          return 0;
+        }
+        if (nbd_internal_set_block_size
+            (h,
+             be32toh (h->sbuf.or.payload.block_size.minimum),
+             be32toh (h->sbuf.or.payload.block_size.preferred),
+             be32toh (h->sbuf.or.payload.block_size.maximum)) == -1) {
+          SET_NEXT_STATE (%.DEAD);
+          return 0;
+        }
+        break;
       default:
-        /* XXX Handle other info types, like NBD_INFO_BLOCK_SIZE */
+        /* XXX Handle other info types, like NBD_INFO_NAME */
         debug (h, "skipping unknown NBD_REP_INFO type %d",
                be16toh (h->sbuf.or.payload.export.info));
         break;
@@ -143,7 +178,7 @@ STATE_MACHINE {
     SET_NEXT_STATE (%RECV_REPLY);
     return 0;
   case NBD_REP_ERR_UNSUP:
-    debug (h, "server is confused by NBD_OPT_GO, continuing anyway");
+    debug (h, "server is confused by %s, continuing anyway", opt);
     SET_NEXT_STATE (%^OPT_EXPORT_NAME.START);
     return 0;
   default:
@@ -152,11 +187,11 @@ STATE_MACHINE {
       switch (reply) {
       case NBD_REP_ERR_POLICY:
       case NBD_REP_ERR_PLATFORM:
-        set_error (0, "handshake: server policy prevents NBD_OPT_GO");
+        set_error (0, "handshake: server policy prevents %s", opt);
         break;
       case NBD_REP_ERR_INVALID:
       case NBD_REP_ERR_TOO_BIG:
-        set_error (EINVAL, "handshake: server rejected NBD_OPT_GO as invalid");
+        set_error (EINVAL, "handshake: server rejected %s as invalid", opt);
         break;
       case NBD_REP_ERR_TLS_REQD:
         set_error (ENOTSUP, "handshake: server requires TLS encryption first");
@@ -172,8 +207,8 @@ STATE_MACHINE {
         set_error (EINVAL, "handshake: server requires specific block sizes");
         break;
       default:
-        set_error (0, "handshake: unknown reply from NBD_OPT_GO: 0x%" PRIx32,
-                   reply);
+        set_error (0, "handshake: unknown reply from %s: 0x%" PRIx32,
+                   opt, reply);
       }
     }
     SET_NEXT_STATE (%.DEAD);
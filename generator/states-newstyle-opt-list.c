@@ -0,0 +1,135 @@
+/* nbd client library in userspace: state machine
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* State machine for listing exports with NBD_OPT_LIST. */
+
+STATE_MACHINE {
+ NEWSTYLE.OPT_LIST.START:
+  if (!h->list_exports) {
+    SET_NEXT_STATE (%^OPT_GO.START);
+    return 0;
+  }
+
+  h->sbuf.option.version = htobe64 (NBD_NEW_VERSION);
+  h->sbuf.option.option = htobe32 (NBD_OPT_LIST);
+  h->sbuf.option.optlen = htobe32 (0);
+  h->wbuf = &h->sbuf;
+  h->wlen = sizeof h->sbuf.option;
+  SET_NEXT_STATE (%SEND);
+  return 0;
+
+ NEWSTYLE.OPT_LIST.SEND:
+  switch (send_from_wbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_LIST.RECV_REPLY:
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    if (prepare_for_reply_payload (h, NBD_OPT_LIST) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    SET_NEXT_STATE (%RECV_REPLY_PAYLOAD);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_LIST.RECV_REPLY_PAYLOAD:
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:  SET_NEXT_STATE (%CHECK_REPLY);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_LIST.CHECK_REPLY:
+  uint32_t reply;
+  uint32_t len;
+  const size_t maxpayload = sizeof h->sbuf.or.payload.server;
+  uint32_t namelen;
+  struct listed_export *exports;
+  char *name, *description;
+
+  reply = be32toh (h->sbuf.or.option_reply.reply);
+  len = be32toh (h->sbuf.or.option_reply.replylen);
+  switch (reply) {
+  case NBD_REP_ACK:           /* End of list of replies. */
+    debug (h, "server listed %zu exports", h->nr_exports);
+    SET_NEXT_STATE (%^OPT_GO.START);
+    return 0;
+  case NBD_REP_SERVER:        /* An export. */
+    if (len > maxpayload)
+      debug (h, "skipping too large export name and description");
+    else {
+      assert (len >= sizeof h->sbuf.or.payload.server.server);
+      len -= sizeof h->sbuf.or.payload.server.server;
+      namelen = be32toh (h->sbuf.or.payload.server.server.export_name_len);
+      if (namelen > len) {
+        SET_NEXT_STATE (%.DEAD);
+        set_error (0, "handshake: invalid NBD_REP_SERVER export name length");
+        return 0;
+      }
+      exports = realloc (h->exports,
+                         (h->nr_exports + 1) * sizeof *exports);
+      if (exports == NULL) {
+        SET_NEXT_STATE (%.DEAD);
+        set_error (errno, "realloc");
+        return 0;
+      }
+      h->exports = exports;
+      /* Strings in the payload are not NUL-terminated. */
+      name = strndup (h->sbuf.or.payload.server.str, namelen);
+      description = strndup (h->sbuf.or.payload.server.str + namelen,
+                             len - namelen);
+      if (name == NULL || description == NULL) {
+        SET_NEXT_STATE (%.DEAD);
+        set_error (errno, "strdup");
+        free (name);
+        free (description);
+        return 0;
+      }
+      exports[h->nr_exports].name = name;
+      exports[h->nr_exports].description = description;
+      h->nr_exports++;
+    }
+    /* Read the next reply. */
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+    return 0;
+  default:
+    /* The server may refuse to list its exports, which is not an
+     * error unless the export cannot be opened either.
+     */
+    if (handle_reply_error (h) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+
+    debug (h, "handshake: unexpected error from "
+           "NBD_OPT_LIST (%" PRIu32 ")", reply);
+    SET_NEXT_STATE (%^OPT_GO.START);
+    return 0;
+  }
+
+} /* END STATE MACHINE */
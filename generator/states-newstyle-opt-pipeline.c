@@ -0,0 +1,139 @@
+/* nbd client library in userspace: state machine
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+/* State machine for sending NBD_OPT_EXTENDED_HEADERS,
+ * NBD_OPT_STRUCTURED_REPLY, NBD_OPT_SET_META_CONTEXT and NBD_OPT_GO
+ * together, see
+ * nbd_set_pipeline_options.  The options are appended to one buffer
+ * and sent at once.  Each of the following groups then reads the
+ * reply to its option in turn, skipping the sending states for the
+ * options which are set in h->pipelined.
+ */
+
+static char *
+append_option (char *p, uint32_t option, uint32_t optlen)
+{
+  struct nbd_new_option opt;
+
+  opt.version = htobe64 (NBD_NEW_VERSION);
+  opt.option = htobe32 (option);
+  opt.optlen = htobe32 (optlen);
+  memcpy (p, &opt, sizeof opt);
+  return p + sizeof opt;
+}
+
+static char *
+append_string (char *p, const char *str)
+{
+  uint32_t len = strlen (str);
+  uint32_t belen = htobe32 (len);
+
+  memcpy (p, &belen, sizeof belen);
+  memcpy (p + sizeof belen, str, len);
+  return p + sizeof belen + len;
+}
+
+STATE_MACHINE {
+ NEWSTYLE.OPT_PIPELINE.START:
+  const uint32_t exportnamelen = strlen (h->export_name);
+  size_t i, nr_queries = 0;
+  uint32_t metalen = 0, golen;
+  size_t len = 0;
+  uint16_t infos[2];
+  char *p;
+
+  assert (h->pipelined == 0);
+  if (!h->pipeline_options || h->pipeline_refused || h->list_exports) {
+    SET_NEXT_STATE (%^OPT_EXTENDED_HEADERS.START);
+    return 0;
+  }
+
+  /* NBD_OPT_STRUCTURED_REPLY is sent as well as
+   * NBD_OPT_EXTENDED_HEADERS, in case the server does not support
+   * extended headers.
+   */
+  if (h->request_sr && h->request_eh)
+    len += sizeof (struct nbd_new_option);
+  if (h->request_sr) {
+    len += sizeof (struct nbd_new_option);
+    if (h->request_meta_contexts != NULL)
+      nr_queries = nbd_internal_string_list_length (h->request_meta_contexts);
+    if (nr_queries > 0) {
+      metalen = 4 + exportnamelen + 4;
+      for (i = 0; i < nr_queries; ++i)
+        metalen += 4 + strlen (h->request_meta_contexts[i]);
+      len += sizeof (struct nbd_new_option) + metalen;
+    }
+  }
+  golen = 4 + exportnamelen + sizeof infos;
+  len += sizeof (struct nbd_new_option) + golen;
+
+  free (h->pipeline_buf);
+  h->pipeline_buf = malloc (len);
+  if (h->pipeline_buf == NULL) {
+    SET_NEXT_STATE (%.DEAD);
+    set_error (errno, "malloc");
+    return 0;
+  }
+
+  p = h->pipeline_buf;
+  if (h->request_sr && h->request_eh) {
+    p = append_option (p, NBD_OPT_EXTENDED_HEADERS, 0);
+    h->pipelined |= PIPELINED_EXTENDED_HEADERS;
+  }
+  if (h->request_sr) {
+    p = append_option (p, NBD_OPT_STRUCTURED_REPLY, 0);
+    h->pipelined |= PIPELINED_STRUCTURED_REPLY;
+    if (nr_queries > 0) {
+      uint32_t benr = htobe32 (nr_queries);
+
+      p = append_option (p, NBD_OPT_SET_META_CONTEXT, metalen);
+      p = append_string (p, h->export_name);
+      memcpy (p, &benr, sizeof benr);
+      p += sizeof benr;
+      for (i = 0; i < nr_queries; ++i)
+        p = append_string (p, h->request_meta_contexts[i]);
+      h->pipelined |= PIPELINED_SET_META_CONTEXT;
+    }
+  }
+  p = append_option (p, h->probe_only ? NBD_OPT_INFO : NBD_OPT_GO, golen);
+  p = append_string (p, h->export_name);
+  /* Ask the server for its block size constraints. */
+  infos[0] = htobe16 (1);
+  infos[1] = htobe16 (NBD_INFO_BLOCK_SIZE);
+  memcpy (p, infos, sizeof infos);
+  p += sizeof infos;
+  h->pipelined |= PIPELINED_GO;
+  assert ((size_t) (p - h->pipeline_buf) == len);
+
+  debug (h, "pipelining %zu bytes of handshake options", len);
+  h->wbuf = h->pipeline_buf;
+  h->wlen = len;
+  SET_NEXT_STATE (%SEND);
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.SEND:
+  switch (send_from_wbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    free (h->pipeline_buf);
+    h->pipeline_buf = NULL;
+    SET_NEXT_STATE (%^OPT_EXTENDED_HEADERS.START);
+  }
+  return 0;
+
+} /* END STATE MACHINE */
@@ -23,6 +23,15 @@ STATE_MACHINE {
   size_t i, nr_queries;
   uint32_t len;
 
+  /* If the option was sent by OPT_PIPELINE then its reply must be
+   * read, even if the server has just refused structured replies.
+   */
+  if (h->pipelined & PIPELINED_SET_META_CONTEXT) {
+    assert (h->meta_contexts == NULL);
+    SET_NEXT_STATE (%PREPARE_FOR_REPLY);
+    return 0;
+  }
+
   /* If the server doesn't support SRs then we must skip this group.
    * Also we skip the group if the client didn't request any metadata
    * contexts.
@@ -30,7 +39,7 @@ STATE_MACHINE {
   if (!h->structured_replies ||
       h->request_meta_contexts == NULL ||
       nbd_internal_string_list_length (h->request_meta_contexts) == 0) {
-    SET_NEXT_STATE (%^OPT_GO.START);
+    SET_NEXT_STATE (%^OPT_LIST.START);
     return 0;
   }
 
@@ -163,20 +172,26 @@ STATE_MACHINE {
   const size_t maxpayload = sizeof h->sbuf.or.payload.context;
   struct meta_context *meta_context;
 
+  h->pipelined &= ~PIPELINED_SET_META_CONTEXT;
   reply = be32toh (h->sbuf.or.option_reply.reply);
   len = be32toh (h->sbuf.or.option_reply.replylen);
   switch (reply) {
   case NBD_REP_ACK:           /* End of list of replies. */
-    SET_NEXT_STATE (%^OPT_GO.START);
+    if (!h->structured_replies && h->meta_contexts != NULL) {
+      /* Only possible if the option was pipelined. */
+      debug (h, "ignoring meta contexts without structured replies");
+      nbd_internal_free_meta_contexts (h);
+    }
+    SET_NEXT_STATE (%^OPT_LIST.START);
     break;
   case NBD_REP_META_CONTEXT:  /* A context. */
     if (len > maxpayload)
       debug (h, "skipping too large meta context");
     else {
       assert (len > sizeof h->sbuf.or.payload.context.context.context_id);
-      meta_context = malloc (sizeof *meta_context);
+      meta_context = calloc (1, sizeof *meta_context);
       if (meta_context == NULL) {
-        set_error (errno, "malloc");
+        set_error (errno, "calloc");
         SET_NEXT_STATE (%.DEAD);
         return 0;
       }
@@ -207,7 +222,7 @@ STATE_MACHINE {
 
     debug (h, "handshake: unexpected error from "
            "NBD_OPT_SET_META_CONTEXT (%" PRIu32 ")", reply);
-    SET_NEXT_STATE (%^OPT_GO.START);
+    SET_NEXT_STATE (%^OPT_LIST.START);
     break;
   }
   return 0;
@@ -0,0 +1,106 @@
+/* nbd client library in userspace: state machine
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* State machine for offering the shared memory transport with
+ * NBD_OPT_SHARED_MEMORY, see lib/shm.c.  This is a libnbd extension,
+ * so any error from the server just means carrying on over the
+ * socket.
+ */
+
+STATE_MACHINE {
+ NEWSTYLE.OPT_SHARED_MEMORY.START:
+  if (h->shm_size == 0 || h->tls_negotiated ||
+      !nbd_internal_shm_prepare (h)) {
+    SET_NEXT_STATE (%^OPT_PIPELINE.START);
+    return 0;
+  }
+
+  h->sbuf.shm_option.option.version = htobe64 (NBD_NEW_VERSION);
+  h->sbuf.shm_option.option.option = htobe32 (NBD_OPT_SHARED_MEMORY);
+  h->sbuf.shm_option.option.optlen =
+    htobe32 (sizeof h->sbuf.shm_option.payload);
+  h->sbuf.shm_option.payload.ring_size = htobe64 (h->shm_size);
+  h->wbuf = &h->sbuf;
+  h->wlen = sizeof h->sbuf.shm_option;
+  SET_NEXT_STATE (%SEND);
+  return 0;
+
+ NEWSTYLE.OPT_SHARED_MEMORY.SEND:
+  /* The memfd goes with the first part of the option sent. */
+  if (h->shm_fd >= 0) {
+    switch (nbd_internal_shm_send_fd (h)) {
+    case -1: SET_NEXT_STATE (%.DEAD); return 0;
+    case 1:  return 0;
+    }
+  }
+  switch (send_from_wbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_SHARED_MEMORY.RECV_REPLY:
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    if (prepare_for_reply_payload (h, NBD_OPT_SHARED_MEMORY) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    SET_NEXT_STATE (%RECV_REPLY_PAYLOAD);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_SHARED_MEMORY.RECV_REPLY_PAYLOAD:
+  switch (recv_into_rbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:  SET_NEXT_STATE (%CHECK_REPLY);
+  }
+  return 0;
+
+ NEWSTYLE.OPT_SHARED_MEMORY.CHECK_REPLY:
+  uint32_t reply;
+
+  reply = be32toh (h->sbuf.or.option_reply.reply);
+  switch (reply) {
+  case NBD_REP_ACK:
+    if (nbd_internal_shm_start (h) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    debug (h, "negotiated shared memory transport on this connection");
+    break;
+  default:
+    if (handle_reply_error (h) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+
+    debug (h, "shared memory transport is not supported by this server");
+    nbd_internal_shm_discard (h);
+    break;
+  }
+
+  /* Next option. */
+  SET_NEXT_STATE (%^OPT_PIPELINE.START);
+  return 0;
+
+} /* END STATE MACHINE */
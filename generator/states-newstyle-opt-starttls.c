@@ -22,7 +22,7 @@ STATE_MACHINE {
  NEWSTYLE.OPT_STARTTLS.START:
   /* If TLS was not requested we skip this option and go to the next one. */
   if (h->tls == LIBNBD_TLS_DISABLE) {
-    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.START);
+    SET_NEXT_STATE (%^OPT_SHARED_MEMORY.START);
     return 0;
   }
 
@@ -101,7 +101,7 @@ STATE_MACHINE {
     debug (h,
            "server refused TLS (%s), continuing with unencrypted connection",
            reply == NBD_REP_ERR_POLICY ? "policy" : "not supported");
-    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.START);
+    SET_NEXT_STATE (%^OPT_SHARED_MEMORY.START);
     return 0;
   }
   return 0;
@@ -120,7 +120,7 @@ STATE_MACHINE {
     nbd_internal_crypto_debug_tls_enabled (h);
 
     /* Continue with option negotiation. */
-    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.START);
+    SET_NEXT_STATE (%^OPT_SHARED_MEMORY.START);
     return 0;
   }
   /* Continue handshake. */
@@ -143,7 +143,7 @@ STATE_MACHINE {
     debug (h, "connection is using TLS");
 
     /* Continue with option negotiation. */
-    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.START);
+    SET_NEXT_STATE (%^OPT_SHARED_MEMORY.START);
     return 0;
   }
   /* Continue handshake. */
@@ -25,6 +25,22 @@ STATE_MACHINE {
     return 0;
   }
 
+  /* The option was sent by OPT_PIPELINE, go straight to the reply,
+   * even if extended headers made it unnecessary.
+   */
+  if (h->pipelined & PIPELINED_STRUCTURED_REPLY) {
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+    return 0;
+  }
+
+  /* Extended headers already imply structured replies. */
+  if (h->extended_headers) {
+    SET_NEXT_STATE (%^OPT_SET_META_CONTEXT.START);
+    return 0;
+  }
+
   h->sbuf.option.version = htobe64 (NBD_NEW_VERSION);
   h->sbuf.option.option = htobe32 (NBD_OPT_STRUCTURED_REPLY);
   h->sbuf.option.optlen = htobe32 (0);
@@ -65,6 +81,7 @@ STATE_MACHINE {
  NEWSTYLE.OPT_STRUCTURED_REPLY.CHECK_REPLY:
   uint32_t reply;
 
+  h->pipelined &= ~PIPELINED_STRUCTURED_REPLY;
   reply = be32toh (h->sbuf.or.option_reply.reply);
   switch (reply) {
   case NBD_REP_ACK:
@@ -77,6 +94,12 @@ STATE_MACHINE {
       return 0;
     }
 
+    /* A server may refuse the pipelined option once it has agreed to
+     * extended headers.
+     */
+    if (h->extended_headers)
+      break;
+
     debug (h, "structured replies are not supported by this server");
     h->structured_replies = false;
     break;
@@ -54,6 +54,12 @@ prepare_for_reply_payload (struct nbd_handle *h, uint32_t opt)
       return -1;
     }
     break;
+  case NBD_REP_SERVER:
+    if (len < sizeof h->sbuf.or.payload.server.server) {
+      set_error (0, "handshake: NBD_REP_SERVER reply length too small");
+      return -1;
+    }
+    break;
   case NBD_REP_META_CONTEXT:
     if (len <= sizeof h->sbuf.or.payload.context.context ||
         len > sizeof h->sbuf.or.payload.context) {
@@ -161,6 +167,15 @@ STATE_MACHINE {
   else
     h->protocol = "newstyle-fixed";
 
+  if (h->tls_resumption)
+    nbd_internal_crypto_save_session (h);
+  if (h->tls_kernel_offload && nbd_internal_crypto_kernel_offload (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+
+  h->reconnecting = false;
+  h->reconnect_tries = 0;
   SET_NEXT_STATE (%.READY);
   return 0;
 
@@ -70,6 +70,8 @@ STATE_MACHINE {
   }
 
   h->protocol = "oldstyle";
+  h->reconnecting = false;
+  h->reconnect_tries = 0;
 
   SET_NEXT_STATE (%.READY);
 
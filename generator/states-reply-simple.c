@@ -38,9 +38,14 @@ STATE_MACHINE {
 
   cmd->error = nbd_internal_errno_of_nbd_error (error);
   if (cmd->error == 0 && cmd->type == NBD_CMD_READ) {
-    h->rbuf = cmd->data;
-    h->rlen = cmd->count;
-    cmd->data_seen = true;
+    /* See nbd_aio_pread_lend. */
+    if (cmd->data == NULL && CALLBACK_IS_NOT_NULL (cmd->cb.lend) &&
+        nbd_internal_lend_alloc (h, cmd) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    set_read_payload (h, cmd, 0, cmd->count);
+    cmd->data_seen = cmd->count;
     SET_NEXT_STATE (%RECV_READ_PAYLOAD);
   }
   else {
@@ -51,7 +56,7 @@ STATE_MACHINE {
  REPLY.SIMPLE_REPLY.RECV_READ_PAYLOAD:
   struct command *cmd = h->reply_cmd;
 
-  switch (recv_into_rbuf (h)) {
+  switch (recv_read_payload (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
   case 1:
     save_reply_state (h);
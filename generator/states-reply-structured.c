@@ -34,7 +34,7 @@ structured_reply_in_bounds (uint64_t offset, uint32_t length,
       offset + length > cmd->offset + cmd->count) {
     set_error (0, "range of structured reply is out of bounds, "
                "offset=%" PRIu64 ", cmd->offset=%" PRIu64 ", "
-               "length=%" PRIu32 ", cmd->count=%" PRIu32 ": "
+               "length=%" PRIu32 ", cmd->count=%" PRIu64 ": "
                "this is likely to be a bug in the NBD server",
                offset, cmd->offset, length, cmd->count);
     return false;
@@ -43,16 +43,197 @@ structured_reply_in_bounds (uint64_t offset, uint32_t length,
   return true;
 }
 
+/* Account for a data or hole chunk covering length bytes at offset
+ * (in the export) of a read.  If the buffer was not zeroed when the
+ * read was issued, the ranges covered so far are kept so that a
+ * server sending overlapping chunks, which the spec forbids, cannot
+ * make a partly covered buffer look complete.  While the chunks
+ * arrive in order the covered range is just the first data_seen
+ * bytes, and nothing is allocated.  Returns -1 with errno set to
+ * EPROTO if the chunk overlaps one already received, or ENOMEM.
+ */
+static int
+add_data_seen (struct command *cmd, uint64_t offset, uint32_t length)
+{
+  struct read_hole *seen;
+  size_t i, n;
+
+  if (cmd->initialized) {
+    if (length > cmd->count - cmd->data_seen)
+      cmd->data_seen = cmd->count;
+    else
+      cmd->data_seen += length;
+    return 0;
+  }
+  if (length == 0)
+    return 0;
+  if (cmd->nr_seen == 0 && offset == cmd->offset + cmd->data_seen) {
+    cmd->data_seen += length;
+    return 0;
+  }
+
+  /* Out of order, so switch to a sorted list of covered ranges,
+   * starting with the ranges covered so far, plus the new chunk.
+   */
+  if (cmd->nr_seen + 2 > cmd->seen_size) {
+    n = cmd->seen_size == 0 ? 8 : cmd->seen_size * 2;
+    seen = realloc (cmd->seen, n * sizeof *seen);
+    if (seen == NULL)
+      return -1;
+    cmd->seen = seen;
+    cmd->seen_size = n;
+  }
+  if (cmd->nr_seen == 0 && cmd->data_seen > 0) {
+    cmd->seen[0].offset = cmd->offset;
+    cmd->seen[0].length = cmd->data_seen;
+    cmd->nr_seen = 1;
+  }
+
+  for (i = cmd->nr_seen; i > 0 && cmd->seen[i-1].offset > offset; --i)
+    ;
+  if ((i > 0 &&
+       cmd->seen[i-1].offset + cmd->seen[i-1].length > offset) ||
+      (i < cmd->nr_seen && offset + length > cmd->seen[i].offset)) {
+    errno = EPROTO;
+    return -1;
+  }
+  memmove (&cmd->seen[i+1], &cmd->seen[i],
+           (cmd->nr_seen - i) * sizeof *seen);
+  cmd->seen[i].offset = offset;
+  cmd->seen[i].length = length;
+  cmd->nr_seen++;
+  cmd->data_seen += length;
+  return 0;
+}
+
+/* Remember a hole in the reply to nbd_aio_pread_sparse.  length
+ * bytes at offset (in the export) are a hole.  The pieces of a split
+ * request record their holes in the parent.
+ */
+static int
+add_hole (struct command *cmd, uint64_t offset, uint32_t length)
+{
+  struct read_hole *holes;
+  size_t n;
+
+  if (cmd->parent)
+    cmd = cmd->parent;
+  if (length == 0)
+    return 0;
+
+  if (cmd->nr_holes == cmd->holes_size) {
+    n = cmd->holes_size == 0 ? 8 : cmd->holes_size * 2;
+    holes = realloc (cmd->holes, n * sizeof *holes);
+    if (holes == NULL)
+      return -1;
+    cmd->holes = holes;
+    cmd->holes_size = n;
+  }
+  cmd->holes[cmd->nr_holes].offset = offset;
+  cmd->holes[cmd->nr_holes].length = length;
+  cmd->nr_holes++;
+  return 0;
+}
+
+/* Convert the payload of NBD_REPLY_TYPE_BLOCK_STATUS_EXT, received
+ * into h->bs_entries, to the context ID followed by pairs of 32 bit
+ * length and flags in host byte order, which is what
+ * NBD_REPLY_TYPE_BLOCK_STATUS gives after byte-swapping.  Extents
+ * longer than MAX_ENTRY_LENGTH become several entries.  Extents are
+ * clamped to the part of the command's range which they have not
+ * already covered, and descriptors after the range is covered are
+ * dropped, so that a server sending huge lengths cannot make the
+ * client allocate huge numbers of entries.  Returns the number of
+ * entries after the context ID, or -1 with errno set to EOVERFLOW if
+ * the flags do not fit in 32 bits, or ENOMEM.
+ */
+static ssize_t
+decode_block_status_ext (struct nbd_handle *h, const struct command *cmd,
+                         uint32_t length)
+{
+  const size_t hdrlen =
+    sizeof (struct nbd_structured_reply_block_status_ext_hdr);
+  size_t nr_descs =
+    (length - hdrlen) / sizeof (struct nbd_block_descriptor_ext);
+  struct nbd_block_descriptor_ext desc;
+  uint64_t len, flags, n, remaining = cmd->count;
+  size_t i, nr_entries = 0, start = hdrlen;
+  uint32_t *entries;
+
+  for (i = 0; i < nr_descs && remaining > 0; ++i) {
+    memcpy (&desc, (char *) h->bs_entries + hdrlen + i * sizeof desc,
+            sizeof desc);
+    len = be64toh (desc.length);
+    flags = be64toh (desc.status_flags);
+    if (flags > UINT32_MAX) {
+      errno = EOVERFLOW;
+      return -1;
+    }
+    if (len > remaining)
+      len = remaining;
+    remaining -= len;
+    n = len == 0 ? 1 : (len - 1) / MAX_ENTRY_LENGTH + 1;
+    nr_entries += 2 * n;
+  }
+  nr_descs = i;
+
+  /* The entries are written over the descriptors as they are read,
+   * which is safe unless long extents were split.  In that case move
+   * the descriptors up past the end of the entries first.
+   */
+  if (nr_entries > 2 * nr_descs) {
+    size_t size;
+
+    start = (1 + nr_entries) * sizeof *entries;
+    size = start + nr_descs * sizeof desc;
+    if (h->bs_entries_size < size) {
+      entries = realloc (h->bs_entries, size);
+      if (entries == NULL)
+        return -1;
+      h->bs_entries = entries;
+      h->bs_entries_size = size;
+    }
+    memmove ((char *) h->bs_entries + start,
+             (char *) h->bs_entries + hdrlen, nr_descs * sizeof desc);
+  }
+
+  entries = h->bs_entries;
+  entries[0] = be32toh (entries[0]);
+  entries++;
+  remaining = cmd->count;
+  for (i = 0; i < nr_descs; ++i) {
+    memcpy (&desc, (char *) h->bs_entries + start + i * sizeof desc,
+            sizeof desc);
+    len = be64toh (desc.length);
+    flags = be64toh (desc.status_flags);
+    if (len > remaining)
+      len = remaining;
+    remaining -= len;
+    do {
+      n = len > MAX_ENTRY_LENGTH ? MAX_ENTRY_LENGTH : len;
+      *entries++ = n;
+      *entries++ = flags;
+      len -= n;
+    } while (len > 0);
+  }
+  return nr_entries;
+}
+
 STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.START:
   /* We've only read the simple_reply.  The structured_reply is longer,
-   * so read the remaining part.
+   * so read the remaining part.  With extended headers the whole
+   * header was read already.
    */
   if (!h->structured_replies) {
     set_error (0, "server sent unexpected structured reply");
     SET_NEXT_STATE(%.DEAD);
     return 0;
   }
+  if (h->extended_headers) {
+    SET_NEXT_STATE (%CHECK);
+    return 0;
+  }
   h->rbuf = &h->sbuf;
   h->rbuf += sizeof h->sbuf.simple_reply;
   h->rlen = sizeof h->sbuf.sr.structured_reply;
@@ -75,12 +256,19 @@ STATE_MACHINE {
   struct command *cmd = h->reply_cmd;
   uint16_t flags, type;
   uint64_t cookie;
-  uint32_t length;
+  uint64_t length;
+  uint64_t max_reply;
 
+  /* The flags, type and handle are at the same offsets in both
+   * headers, only the length differs.
+   */
   flags = be16toh (h->sbuf.sr.structured_reply.flags);
   type = be16toh (h->sbuf.sr.structured_reply.type);
   cookie = be64toh (h->sbuf.sr.structured_reply.handle);
-  length = be32toh (h->sbuf.sr.structured_reply.length);
+  if (h->extended_headers)
+    length = be64toh (h->sbuf.extended_reply.length);
+  else
+    length = be32toh (h->sbuf.sr.structured_reply.length);
 
   assert (cmd);
   assert (cmd->cookie == cookie);
@@ -90,13 +278,18 @@ STATE_MACHINE {
    * size we were willing to send. The most likely culprit is a server
    * that replies with block status with way too many extents, but any
    * oversized reply is going to take long enough to resync that it is
-   * not worth keeping the connection alive.
+   * not worth keeping the connection alive.  The caller may have
+   * raised the limit on read requests with nbd_set_max_request_size.
    */
-  if (length > MAX_REQUEST_SIZE + sizeof h->sbuf.sr.payload.offset_data) {
+  max_reply = MAX_REQUEST_SIZE;
+  if (h->max_request_size > max_reply)
+    max_reply = h->max_request_size;
+  if (length > max_reply + sizeof h->sbuf.sr.payload.offset_data) {
     set_error (0, "invalid server reply length");
     SET_NEXT_STATE (%.DEAD);
     return 0;
   }
+  h->sr_length = length;
 
   if (NBD_REPLY_TYPE_IS_ERR (type)) {
     if (length < sizeof h->sbuf.sr.payload.error.error) {
@@ -165,8 +358,16 @@ STATE_MACHINE {
     SET_NEXT_STATE (%RECV_OFFSET_HOLE);
     return 0;
   }
-  else if (type == NBD_REPLY_TYPE_BLOCK_STATUS) {
-    if (cmd->type != NBD_CMD_BLOCK_STATUS) {
+  else if (type == NBD_REPLY_TYPE_BLOCK_STATUS ||
+           type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) {
+    /* With extended headers the server sends 64 bit extents, see
+     * decode_block_status_ext.
+     */
+    const bool ext = type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT;
+    const char *name = ext ? "NBD_REPLY_TYPE_BLOCK_STATUS_EXT"
+      : "NBD_REPLY_TYPE_BLOCK_STATUS";
+
+    if (cmd->type != NBD_CMD_BLOCK_STATUS || (ext && !h->extended_headers)) {
       SET_NEXT_STATE (%.DEAD);
       set_error (0, "invalid command for receiving block-status chunk, "
                  "cmd->type=%" PRIu16 ", "
@@ -175,25 +376,30 @@ STATE_MACHINE {
       return 0;
     }
     /* XXX We should be able to skip the bad reply in these two cases. */
-    if (length < 12 || ((length-4) & 7) != 0) {
+    if (ext ? length < 24 || ((length-8) & 15) != 0
+        : length < 12 || ((length-4) & 7) != 0) {
       SET_NEXT_STATE (%.DEAD);
-      set_error (0, "invalid length in NBD_REPLY_TYPE_BLOCK_STATUS");
+      set_error (0, "invalid length in %s", name);
       return 0;
     }
     if (CALLBACK_IS_NULL (cmd->cb.fn.extent)) {
       SET_NEXT_STATE (%.DEAD);
-      set_error (0, "not expecting NBD_REPLY_TYPE_BLOCK_STATUS here");
+      set_error (0, "not expecting %s here", name);
       return 0;
     }
     /* We read the context ID followed by all the entries into a
      * single array and deal with it at the end.
      */
-    free (h->bs_entries);
-    h->bs_entries = malloc (length);
-    if (h->bs_entries == NULL) {
-      SET_NEXT_STATE (%.DEAD);
-      set_error (errno, "malloc");
-      return 0;
+    if (h->bs_entries_size < length) {
+      uint32_t *bs_entries = realloc (h->bs_entries, length);
+
+      if (bs_entries == NULL) {
+        SET_NEXT_STATE (%.DEAD);
+        set_error (errno, "realloc");
+        return 0;
+      }
+      h->bs_entries = bs_entries;
+      h->bs_entries_size = length;
     }
     h->rbuf = h->bs_entries;
     h->rlen = length;
@@ -216,7 +422,7 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
+    length = h->sr_length;
     msglen = be16toh (h->sbuf.sr.payload.error.error.len);
     if (msglen > length - sizeof h->sbuf.sr.payload.error.error ||
         msglen > sizeof h->sbuf.sr.payload.error.msg) {
@@ -242,7 +448,7 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
+    length = h->sr_length;
     msglen = be16toh (h->sbuf.sr.payload.error.error.len);
     type = be16toh (h->sbuf.sr.structured_reply.type);
 
@@ -348,13 +554,19 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
+    length = h->sr_length;
     offset = be64toh (h->sbuf.sr.payload.offset_data.offset);
 
     assert (cmd); /* guaranteed by CHECK */
 
-    assert (cmd->data && cmd->type == NBD_CMD_READ);
-    cmd->data_seen = true;
+    /* See nbd_aio_pread_lend. */
+    if (cmd->data == NULL && CALLBACK_IS_NOT_NULL (cmd->cb.lend) &&
+        nbd_internal_lend_alloc (h, cmd) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    assert ((cmd->data || cmd->iov || cmd->has_fd) &&
+            cmd->type == NBD_CMD_READ);
 
     /* Length of the data following. */
     length -= 8;
@@ -364,12 +576,16 @@ STATE_MACHINE {
       SET_NEXT_STATE (%.DEAD);
       return 0;
     }
+    if (add_data_seen (cmd, offset, length) == -1 && cmd->error == 0) {
+      if (errno == EPROTO)
+        debug (h, "server sent overlapping chunks for a read");
+      cmd->error = errno;
+    }
     /* Now this is the byte offset in the read buffer. */
     offset -= cmd->offset;
 
     /* Set up to receive the data directly to the user buffer. */
-    h->rbuf = cmd->data + offset;
-    h->rlen = length;
+    set_read_payload (h, cmd, offset, length);
     SET_NEXT_STATE (%RECV_OFFSET_DATA_DATA);
   }
   return 0;
@@ -379,14 +595,14 @@ STATE_MACHINE {
   uint64_t offset;
   uint32_t length;
 
-  switch (recv_into_rbuf (h)) {
+  switch (recv_read_payload (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
   case 1:
     save_reply_state (h);
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
+    length = h->sr_length;
     offset = be64toh (h->sbuf.sr.payload.offset_data.offset);
 
     assert (cmd); /* guaranteed by CHECK */
@@ -421,14 +637,25 @@ STATE_MACHINE {
 
     assert (cmd); /* guaranteed by CHECK */
 
-    assert (cmd->data && cmd->type == NBD_CMD_READ);
-    cmd->data_seen = true;
+    /* See nbd_aio_pread_lend. */
+    if (cmd->data == NULL && CALLBACK_IS_NOT_NULL (cmd->cb.lend) &&
+        nbd_internal_lend_alloc (h, cmd) == -1) {
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
+    assert ((cmd->data || cmd->iov || cmd->has_fd) &&
+            cmd->type == NBD_CMD_READ);
 
     /* Is the data within bounds? */
     if (! structured_reply_in_bounds (offset, length, cmd)) {
       SET_NEXT_STATE (%.DEAD);
       return 0;
     }
+    if (add_data_seen (cmd, offset, length) == -1 && cmd->error == 0) {
+      if (errno == EPROTO)
+        debug (h, "server sent overlapping chunks for a read");
+      cmd->error = errno;
+    }
     /* Now this is the byte offset in the read buffer. */
     offset -= cmd->offset;
 
@@ -436,7 +663,22 @@ STATE_MACHINE {
      * 0-length replies are broken. Still, it's easy enough to support
      * them as an extension, and this works even when length == 0.
      */
-    memset (cmd->data + offset, 0, length);
+    if (is_sparse_read (cmd)) {
+      /* The buffer is left untouched for holes. */
+      if (add_hole (cmd, cmd->offset + offset, length) == -1 &&
+          cmd->error == 0)
+        cmd->error = errno;
+    }
+    else if (cmd->has_fd) {
+      int err = write_zeroes_to_fd (cmd->fd, cmd->fd_offset + offset, length);
+
+      if (err != 0 && cmd->error == 0)
+        cmd->error = err;
+    }
+    else if (cmd->iov)
+      nbd_internal_iov_zero (cmd->iov, cmd->iovcnt, offset, length);
+    else
+      memset (cmd->data + offset, 0, length);
     if (CALLBACK_IS_NOT_NULL (cmd->cb.fn.chunk)) {
       int error = cmd->error;
 
@@ -455,9 +697,10 @@ STATE_MACHINE {
  REPLY.STRUCTURED_REPLY.RECV_BS_ENTRIES:
   struct command *cmd = h->reply_cmd;
   uint32_t length;
-  size_t i;
+  uint16_t type;
   uint32_t context_id;
   struct meta_context *meta_context;
+  ssize_t nr_entries;
 
   switch (recv_into_rbuf (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
@@ -466,7 +709,8 @@ STATE_MACHINE {
     SET_NEXT_STATE (%.READY);
     return 0;
   case 0:
-    length = be32toh (h->sbuf.sr.structured_reply.length);
+    length = h->sr_length;
+    type = be16toh (h->sbuf.sr.structured_reply.type);
 
     assert (cmd); /* guaranteed by CHECK */
     assert (cmd->type == NBD_CMD_BLOCK_STATUS);
@@ -477,8 +721,26 @@ STATE_MACHINE {
     /* Need to byte-swap the entries returned, but apart from that we
      * don't validate them.
      */
-    for (i = 0; i < length/4; ++i)
-      h->bs_entries[i] = be32toh (h->bs_entries[i]);
+    if (type == NBD_REPLY_TYPE_BLOCK_STATUS_EXT) {
+      nr_entries = decode_block_status_ext (h, cmd, length);
+      if (nr_entries == -1 && errno != EOVERFLOW) {
+        SET_NEXT_STATE (%.DEAD);
+        set_error (errno, "realloc");
+        return 0;
+      }
+      if (nr_entries == -1) {
+        debug (h, "server sent block status flags which do not fit "
+               "in 32 bits");
+        if (cmd->error == 0)
+          cmd->error = EOVERFLOW;
+        SET_NEXT_STATE (%FINISH);
+        return 0;
+      }
+    }
+    else {
+      be32toh_array (h->bs_entries, length/4);
+      nr_entries = (length-4) / 4;
+    }
 
     /* Look up the context ID. */
     context_id = h->bs_entries[0];
@@ -492,9 +754,17 @@ STATE_MACHINE {
       /* Call the caller's extent function. */
       int error = cmd->error;
 
+      if (h->extent_cache && cmd->extent_cache_gen == h->extent_cache_gen)
+        nbd_internal_extent_cache_add (h, meta_context, cmd->offset,
+                                       &h->bs_entries[1], nr_entries);
+
+      if (cmd->coalesce)
+        nr_entries = nbd_internal_coalesce_extents (&h->bs_entries[1],
+                                                    nr_entries);
+
       if (CALL_CALLBACK (cmd->cb.fn.extent,
                          meta_context->name, cmd->offset,
-                         &h->bs_entries[1], (length-4) / 4,
+                         &h->bs_entries[1], nr_entries,
                          &error) == -1)
         if (cmd->error == 0)
           cmd->error = error ? error : EPROTO;
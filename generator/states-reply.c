@@ -62,24 +62,42 @@ STATE_MACHINE {
 
   /* We read all replies initially as if they are simple replies, but
    * check the magic in CHECK_SIMPLE_OR_STRUCTURED_REPLY below.
-   * This works because the structured_reply header is larger.
+   * This works because the structured_reply header is larger.  With
+   * extended headers every reply has the extended header, so all of
+   * it is read at once.
    */
   assert (h->reply_cmd == NULL);
   assert (h->rlen == 0);
 
+  /* The handshake is over, so start using the staging buffer. */
+  if (h->rstage == NULL && h->recv_buffer_size > 0) {
+    h->rstage = malloc (h->recv_buffer_size);
+    if (h->rstage == NULL) {
+      SET_NEXT_STATE (%.DEAD);
+      set_error (errno, "malloc");
+      return 0;
+    }
+    h->rstage_start = h->rstage_end = 0;
+  }
+
   h->rbuf = &h->sbuf;
-  h->rlen = sizeof h->sbuf.simple_reply;
+  if (h->extended_headers)
+    h->rlen = sizeof h->sbuf.extended_reply;
+  else
+    h->rlen = sizeof h->sbuf.simple_reply;
 
-  r = h->sock->ops->recv (h, h->sock, h->rbuf, h->rlen);
+  r = recv_from_socket (h, h->rbuf, h->rlen);
   if (r == -1) {
-    /* This should never happen because when we enter this state we
-     * should have notification that the socket is ready to read.
-     * However if for some reason it does happen, ignore it - we will
-     * reenter this same state again next time the socket is ready to
-     * read.
+    /* This can happen if the notification was not for a reply, for
+     * example POLLERR from zero-copy sends.  Go back to READY, which
+     * also resumes any command we were in the middle of sending, and
+     * wait for the socket to be ready to read again.
      */
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      h->rlen = 0;
+      SET_NEXT_STATE (%.READY);
       return 0;
+    }
 
     /* sock->ops->recv called set_error already. */
     SET_NEXT_STATE (%.DEAD);
@@ -113,7 +131,15 @@ STATE_MACHINE {
   uint64_t cookie;
 
   magic = be32toh (h->sbuf.simple_reply.magic);
-  if (magic == NBD_SIMPLE_REPLY_MAGIC) {
+  if (h->extended_headers) {
+    if (magic != NBD_EXTENDED_REPLY_MAGIC) {
+      SET_NEXT_STATE (%.DEAD);
+      set_error (0, "invalid reply magic, expecting an extended reply");
+      return 0;
+    }
+    SET_NEXT_STATE (%STRUCTURED_REPLY.START);
+  }
+  else if (magic == NBD_SIMPLE_REPLY_MAGIC) {
     SET_NEXT_STATE (%SIMPLE_REPLY.START);
   }
   else if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
@@ -125,16 +151,13 @@ STATE_MACHINE {
     return 0;
   }
 
-  /* NB: This works for both simple and structured replies because the
-   * handle (our cookie) is stored at the same offset.
+  /* NB: This works for simple, structured and extended replies
+   * because the handle (our cookie) is stored at the same offset.
    */
   cookie = be64toh (h->sbuf.simple_reply.handle);
   /* Find the command amongst the commands in flight. */
-  for (cmd = h->cmds_in_flight; cmd != NULL; cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
-  if (cmd == NULL) {
+  cmd = nbd_internal_cookie_table_lookup (h, cookie);
+  if (cmd == NULL || cmd->list != CMDS_IN_FLIGHT) {
     /* An unexpected structured reply could be skipped, since it
      * includes a length; similarly an unexpected simple reply can be
      * skipped if we assume it was not a read. However, it's more
@@ -146,65 +169,64 @@ STATE_MACHINE {
     return 0;
   }
   h->reply_cmd = cmd;
+  probe (reply, h->hname, cmd->cookie, cmd->type, cmd->offset, cmd->count);
+  if (!cmd->replied) {
+    cmd->replied = true;
+    command_event (h, cmd, LIBNBD_COMMAND_EVENT_REPLY);
+  }
   return 0;
 
  REPLY.FINISH_COMMAND:
-  struct command *prev_cmd, *cmd;
-  uint64_t cookie;
-  bool retire;
+  struct command *cmd;
 
-  /* NB: This works for both simple and structured replies because the
-   * handle (our cookie) is stored at the same offset.
-   */
-  cookie = be64toh (h->sbuf.simple_reply.handle);
-  /* Find the command amongst the commands in flight. */
-  for (cmd = h->cmds_in_flight, prev_cmd = NULL;
-       cmd != NULL;
-       prev_cmd = cmd, cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
+  /* CHECK_SIMPLE_OR_STRUCTURED_REPLY already found the command. */
+  cmd = h->reply_cmd;
   assert (cmd != NULL);
-  assert (h->reply_cmd == cmd);
+  assert (cmd->list == CMDS_IN_FLIGHT);
+  assert (cmd->cookie == be64toh (h->sbuf.simple_reply.handle));
   h->reply_cmd = NULL;
-  retire = cmd->type == NBD_CMD_DISC;
-
-  /* Notify the user */
-  if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
-    int error = cmd->error;
-    int r;
-
-    assert (cmd->type != NBD_CMD_DISC);
-    r = CALL_CALLBACK (cmd->cb.completion, &error);
-    switch (r) {
-    case -1:
-      if (error)
-        cmd->error = error;
-      break;
-    case 1:
-      retire = true;
-      break;
-    }
+
+  /* If the read buffer was not zeroed in advance, any part which the
+   * server did not send would be left uninitialized.
+   */
+  if (cmd->type == NBD_CMD_READ && !cmd->initialized &&
+      cmd->data_seen < cmd->count && cmd->error == 0) {
+    debug (h, "server did not send data covering the whole read buffer");
+    cmd->error = EIO;
+  }
+
+  /* If the payload was sent with MSG_ZEROCOPY, the kernel may not
+   * have released it yet even though the server has replied.
+   */
+  if (zerocopy_pending (h, cmd) && reap_zerocopy (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
   }
 
-  /* Move it to the end of the cmds_done list. */
-  if (prev_cmd != NULL)
-    prev_cmd->next = cmd->next;
+  /* Unlink it from the in-flight list, then notify the user, or wait
+   * for the kernel to release the payload.
+   */
+  if (cmd->prev != NULL)
+    cmd->prev->next = cmd->next;
   else
     h->cmds_in_flight = cmd->next;
-  cmd->next = NULL;
-  if (retire)
-    nbd_internal_retire_and_free_command (cmd);
+  if (cmd->next != NULL)
+    cmd->next->prev = cmd->prev;
+  nbd_internal_depth_reply (h, cmd);
+  if (zerocopy_pending (h, cmd)) {
+    debug (h, "waiting for the kernel to release a zero-copy write");
+    cmd->prev = NULL;
+    cmd->next = h->cmds_zerocopy;
+    if (cmd->next != NULL)
+      cmd->next->prev = cmd;
+    cmd->list = CMDS_ZEROCOPY;
+    h->cmds_zerocopy = cmd;
+  }
   else {
-    if (h->cmds_done_tail != NULL)
-      h->cmds_done_tail = h->cmds_done_tail->next = cmd;
-    else {
-      assert (h->cmds_done == NULL);
-      h->cmds_done = h->cmds_done_tail = cmd;
-    }
+    complete_command (h, cmd);
+    h->in_flight--;
+    assert (h->in_flight >= 0);
   }
-  h->in_flight--;
-  assert (h->in_flight >= 0);
 
   SET_NEXT_STATE (%.READY);
   return 0;
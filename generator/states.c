@@ -31,13 +31,70 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 #include "internal.h"
 
 /* Uncomment this to dump received protocol packets to stderr. */
 /*#define DUMP_PACKETS 1*/
 
+static ssize_t
+sock_recv (struct nbd_handle *h, void *buf, size_t len)
+{
+  ssize_t r = h->sock->ops->recv (h, h->sock, buf, len);
+
+  trace (h, TRACE_RECV, 0, 0, 0, len, r >= 0 ? r : -errno);
+  if (r > 0)
+    h->stats.bytes_received += r;
+  return r;
+}
+
+/* Receive up to len bytes from the socket, with the same return
+ * value as sock->ops->recv.  If the staging buffer is in use, data
+ * is served from it first.  When it is empty, short reads refill it
+ * with as much data as the server has sent, while reads at least as
+ * large as the staging buffer (such as big read payloads) bypass it
+ * and go directly into buf.
+ */
+static ssize_t
+recv_from_socket (struct nbd_handle *h, void *buf, size_t len)
+{
+  size_t avail;
+  ssize_t r;
+
+  if (h->rstage == NULL)
+    return sock_recv (h, buf, len);
+
+  avail = h->rstage_end - h->rstage_start;
+  if (avail == 0) {
+    /* The last refill took everything the server had sent, so save
+     * a system call which would only fail.  The state machine will
+     * go back to READY and wait for the socket to become readable.
+     */
+    if (h->recv_drained &&
+        !(h->sock->ops->pending && h->sock->ops->pending (h->sock))) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (len >= h->recv_buffer_size)
+      return sock_recv (h, buf, len);
+    r = sock_recv (h, h->rstage, h->recv_buffer_size);
+    if (r <= 0)
+      return r;
+    h->rstage_start = 0;
+    h->rstage_end = avail = r;
+    h->recv_drained = (size_t) r < h->recv_buffer_size;
+  }
+
+  if (len > avail)
+    len = avail;
+  memcpy (buf, &h->rstage[h->rstage_start], len);
+  h->rstage_start += len;
+  return len;
+}
+
 static int
 recv_into_rbuf (struct nbd_handle *h)
 {
@@ -61,7 +118,7 @@ recv_into_rbuf (struct nbd_handle *h)
     rlen = h->rlen > sizeof buf ? sizeof buf : h->rlen;
   }
 
-  r = h->sock->ops->recv (h, h->sock, rbuf, rlen);
+  r = recv_from_socket (h, rbuf, rlen);
   if (r == -1) {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
       return 1;                 /* more data */
@@ -89,16 +146,31 @@ static int
 send_from_wbuf (struct nbd_handle *h)
 {
   ssize_t r;
+  bool zerocopy = (h->wflags & MSG_ZEROCOPY) != 0;
 
   if (h->wlen == 0)
     goto next_state;
   r = h->sock->ops->send (h, h->sock, h->wbuf, h->wlen, h->wflags);
+  if (r == -1 && zerocopy && errno == ENOBUFS) {
+    /* The kernel limits how much memory can be pinned by zero-copy
+     * sends which have not been released yet, so copy this part.
+     */
+    zerocopy = false;
+    r = h->sock->ops->send (h, h->sock, h->wbuf, h->wlen,
+                            h->wflags & ~MSG_ZEROCOPY);
+  }
+  trace (h, TRACE_SEND, 0, 0, 0, h->wlen, r >= 0 ? r : -errno);
   if (r == -1) {
     if (errno == EAGAIN || errno == EWOULDBLOCK)
       return 1;                 /* more data */
     /* sock->ops->send called set_error already. */
     return -1;
   }
+  if (zerocopy) {
+    h->cmds_to_issue->zerocopy = true;
+    h->cmds_to_issue->zerocopy_seq = h->zerocopy_next++;
+  }
+  h->stats.bytes_sent += r;
   h->wbuf += r;
   h->wlen -= r;
   if (h->wlen == 0)
@@ -111,6 +183,846 @@ send_from_wbuf (struct nbd_handle *h)
   return 0;                     /* move to next state */
 }
 
+/* Maximum number of buffers passed to a single recv_iov or send_iov
+ * when receiving or sending a scattered payload.
+ */
+#define PAYLOAD_IOV_MAX 64
+
+/* Set up to receive length bytes of a read payload at offset in the
+ * command's buffer, in its buffers for nbd_aio_preadv, or in its file
+ * descriptor for nbd_aio_pread_to_fd.  Then call recv_read_payload.
+ */
+static void
+set_read_payload (struct nbd_handle *h, struct command *cmd,
+                  uint64_t offset, size_t length)
+{
+  h->rlen = length;
+  h->rbuf = NULL;
+  h->rfd = -1;
+  h->rvec = NULL;
+  if (cmd->has_fd) {
+    h->rfd = cmd->fd;
+    h->rfd_offset = cmd->fd_offset + offset;
+    h->rfd_copy = false;
+  }
+  else if (cmd->iov) {
+    h->rvec = cmd->iov;
+    h->rveccnt = cmd->iovcnt;
+    while (h->rveccnt > 0 && offset >= h->rvec->iov_len) {
+      offset -= h->rvec->iov_len;
+      h->rvec++;
+      h->rveccnt--;
+    }
+    h->rvec_skip = offset;
+  }
+  else
+    h->rbuf = (char *) cmd->data + offset;
+}
+
+/* Advance *vec, *cnt and *skip past n bytes of the buffers. */
+static void
+advance_vec (struct iovec **vec, int *cnt, size_t *skip, size_t n)
+{
+  size_t len;
+
+  while (n > 0) {
+    len = (*vec)->iov_len - *skip;
+    if (n < len) {
+      *skip += n;
+      return;
+    }
+    n -= len;
+    (*vec)++;
+    (*cnt)--;
+    *skip = 0;
+  }
+}
+
+/* Fill iov with up to PAYLOAD_IOV_MAX buffers covering at most len
+ * bytes from vec, skipping the first skip bytes.  Returns the number
+ * of buffers.
+ */
+static int
+fill_iov (struct iovec *iov, const struct iovec *vec, int cnt,
+          size_t skip, size_t len)
+{
+  int i;
+
+  for (i = 0; i < cnt && i < PAYLOAD_IOV_MAX && len > 0; ++i) {
+    iov[i].iov_base = (char *) vec[i].iov_base + skip;
+    iov[i].iov_len = vec[i].iov_len - skip;
+    if (iov[i].iov_len > len)
+      iov[i].iov_len = len;
+    len -= iov[i].iov_len;
+    skip = 0;
+  }
+  return i;
+}
+
+/* Receive a read payload scattered across the buffers from h->rvec.
+ * Large payloads are received directly into several buffers at once,
+ * while small ones go through the staging buffer like any other
+ * short read.
+ */
+static int
+recv_into_rvec (struct nbd_handle *h)
+{
+  struct iovec iov[PAYLOAD_IOV_MAX];
+  ssize_t r;
+  size_t len;
+  int n;
+
+  while (h->rlen > 0) {
+    assert (h->rveccnt > 0);
+    if (h->sock->ops->recv_iov && h->rlen >= h->recv_buffer_size &&
+        (h->rstage == NULL || h->rstage_start == h->rstage_end)) {
+      n = fill_iov (iov, h->rvec, h->rveccnt, h->rvec_skip, h->rlen);
+      r = h->sock->ops->recv_iov (h, h->sock, iov, n);
+      trace (h, TRACE_RECV, 0, 0, 0, h->rlen, r >= 0 ? r : -errno);
+      if (r > 0)
+        h->stats.bytes_received += r;
+    }
+    else {
+      len = h->rvec->iov_len - h->rvec_skip;
+      if (len > h->rlen)
+        len = h->rlen;
+      r = recv_from_socket (h, (char *) h->rvec->iov_base + h->rvec_skip,
+                            len);
+    }
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;               /* more data */
+      /* sock->ops called set_error already. */
+      return -1;
+    }
+    if (r == 0) {
+      set_error (0, "recv: server disconnected unexpectedly");
+      return -1;
+    }
+    h->rlen -= r;
+    advance_vec (&h->rvec, &h->rveccnt, &h->rvec_skip, r);
+  }
+  return 0;                     /* move to next state */
+}
+
+/* As recv_into_rbuf, but for a payload set up by set_read_payload.
+ * Data for a file descriptor is spliced from the socket if possible,
+ * otherwise copied through rfd_buf.  If writing to the file
+ * descriptor fails, the error is saved in the command and the rest
+ * of the payload is thrown away.
+ */
+static int
+recv_read_payload (struct nbd_handle *h)
+{
+  struct command *cmd = h->reply_cmd;
+  int write_err = 0;
+  ssize_t r, w;
+  size_t len, n;
+
+  if (h->rvec)
+    return recv_into_rvec (h);
+
+  while (h->rlen > 0) {
+    if (h->rfd == -1)
+      return recv_into_rbuf (h);
+
+    /* Anything already in the staging buffer has to be copied. */
+    if (h->sock->ops->splice_to && !h->rfd_copy &&
+        (h->rstage == NULL || h->rstage_start == h->rstage_end)) {
+      r = h->sock->ops->splice_to (h, h->sock, h->rfd, &h->rfd_offset,
+                                   h->rlen, &write_err);
+      if (r == -1 && errno == EOPNOTSUPP) {
+        debug (h, "cannot splice the read payload, copying it instead");
+        h->rfd_copy = true;
+        continue;
+      }
+      trace (h, TRACE_RECV, 0, 0, 0, h->rlen, r >= 0 ? r : -errno);
+      if (r > 0)
+        h->stats.bytes_received += r;
+    }
+    else {
+      if (h->rfd_buf == NULL) {
+        h->rfd_buf = malloc (FD_BUFFER_SIZE);
+        if (h->rfd_buf == NULL) {
+          set_error (errno, "malloc");
+          return -1;
+        }
+      }
+      len = h->rlen > FD_BUFFER_SIZE ? FD_BUFFER_SIZE : h->rlen;
+      r = recv_from_socket (h, h->rfd_buf, len);
+      for (n = 0; r > 0 && n < (size_t) r; n += w) {
+        w = pwrite (h->rfd, h->rfd_buf + n, r - n, h->rfd_offset);
+        if (w <= 0) {
+          write_err = w == -1 ? errno : ENOSPC;
+          break;
+        }
+        h->rfd_offset += w;
+      }
+    }
+
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;               /* more data */
+      /* sock->ops called set_error already. */
+      return -1;
+    }
+    if (r == 0) {
+      set_error (0, "recv: server disconnected unexpectedly");
+      return -1;
+    }
+    h->rlen -= r;
+    if (write_err != 0) {
+      debug (h, "write: %s: discarding the rest of the read payload",
+             strerror (write_err));
+      if (cmd->error == 0)
+        cmd->error = write_err;
+      h->rfd = -1;
+    }
+  }
+  return 0;                     /* move to next state */
+}
+
+/* Write length zero bytes at offset in a file descriptor, for a hole
+ * in the reply to nbd_aio_pread_to_fd.  Returns 0 or an errno.
+ */
+static int
+write_zeroes_to_fd (int fd, uint64_t offset, uint64_t length)
+{
+  static const char zero[4096];
+  struct iovec iov[64];
+  uint64_t n;
+  ssize_t r;
+  int i;
+
+  while (length > 0) {
+    for (i = 0, n = 0; i < 64 && n < length; ++i) {
+      iov[i].iov_base = (void *) zero;
+      iov[i].iov_len = length - n > sizeof zero ? sizeof zero : length - n;
+      n += iov[i].iov_len;
+    }
+    r = pwritev (fd, iov, i, offset);
+    if (r <= 0)
+      return r == -1 ? errno : ENOSPC;
+    offset += r;
+    length -= r;
+  }
+  return 0;
+}
+
+/* Return true if the write payload of cmd is not a single buffer,
+ * so it cannot be gathered into a vectored send with other commands.
+ */
+static bool
+separate_write_payload (struct command *cmd)
+{
+  return cmd->type == NBD_CMD_WRITE && (cmd->has_fd || cmd->iov != NULL);
+}
+
+/* The most writes which are coalesced into one request, see
+ * nbd_set_coalesce_writes.
+ */
+#define COALESCE_MAX PAYLOAD_IOV_MAX
+
+/* Return true if cmd, a queued command, is a write which can be
+ * coalesced with others.
+ */
+static bool
+can_coalesce (struct nbd_handle *h, const struct command *cmd)
+{
+  return cmd->type == NBD_CMD_WRITE && cmd->data != NULL &&
+    cmd->coalesced == NULL &&
+    (h->zerocopy_threshold == 0 || cmd->count < h->zerocopy_threshold);
+}
+
+/* Merge the first run of contiguous writes with the same flags near
+ * the head of cmds_to_issue into one request, whose payload is
+ * gathered from their buffers.  The writes hang off the new command,
+ * which completes them all when the server replies, see
+ * complete_command.  Only the commands which are about to be sent
+ * are looked at, so the rest can still be cancelled.
+ */
+static void
+coalesce_writes (struct nbd_handle *h)
+{
+  const uint32_t max = nbd_internal_max_request_size (h);
+  struct command *prev = NULL, *first, *last = NULL, *cmd, *c;
+  uint64_t count = 0;
+  int i, n;
+
+  for (first = h->cmds_to_issue, i = 0;
+       first != NULL && i < MAX_SEND_BATCH;
+       prev = first, first = first->next, ++i) {
+    if (!can_coalesce (h, first))
+      continue;
+    count = first->count;
+    n = 1;
+    for (last = first;
+         (c = last->next) != NULL && n < COALESCE_MAX &&
+           can_coalesce (h, c) &&
+           c->offset == last->offset + last->count &&
+           c->flags == first->flags && c->replay == first->replay &&
+           count + c->count <= max;
+         last = c) {
+      count += c->count;
+      n++;
+    }
+    if (n > 1)
+      break;
+  }
+  if (first == NULL || i == MAX_SEND_BATCH)
+    return;
+
+  cmd = nbd_internal_alloc_command (h);
+  if (cmd == NULL)
+    return;
+  cmd->iov = malloc (n * sizeof *cmd->iov);
+  if (cmd->iov == NULL) {
+    nbd_internal_free_command (h, cmd);
+    return;
+  }
+  for (c = first, i = 0; i < n; c = c->next, ++i) {
+    cmd->iov[i].iov_base = c->data;
+    cmd->iov[i].iov_len = c->count;
+    c->list = CMDS_COALESCED;
+  }
+  cmd->iovcnt = n;
+  cmd->type = NBD_CMD_WRITE;
+  cmd->flags = first->flags;
+  cmd->replay = first->replay;
+  cmd->cookie = h->unique++;
+  cmd->offset = first->offset;
+  cmd->count = count;
+  cmd->issued_us = nbd_internal_stats_now ();
+  if (nbd_internal_cookie_table_insert (h, cmd) == -1) {
+    for (c = first; c != last->next; c = c->next)
+      c->list = CMDS_TO_ISSUE;
+    free (cmd->iov);
+    nbd_internal_free_command (h, cmd);
+    return;
+  }
+
+  /* Put the new command in place of the run. */
+  cmd->next = last->next;
+  if (prev)
+    prev->next = cmd;
+  else
+    h->cmds_to_issue = cmd;
+  if (h->cmds_to_issue_tail == last)
+    h->cmds_to_issue_tail = cmd;
+  last->next = NULL;
+  cmd->coalesced = first;
+  h->in_flight -= n - 1;
+  debug (h, "coalesced %d writes into one request of %" PRIu64 " bytes",
+         n, count);
+}
+
+/* Set up to send the write payload of cmd, from its buffer, from its
+ * buffers for nbd_aio_pwritev, or from its file descriptor for
+ * nbd_aio_pwrite_from_fd.  Then call send_write_payload.
+ */
+static void
+set_write_payload (struct nbd_handle *h, struct command *cmd)
+{
+  h->wlen = cmd->count;
+  h->wbuf = NULL;
+  h->wfd = -1;
+  h->wvec = NULL;
+  if (cmd->has_fd) {
+    h->wfd = cmd->fd;
+    h->wfd_offset = cmd->fd_offset;
+    h->wfd_copy = false;
+    h->wfd_buf_start = h->wfd_buf_end = 0;
+  }
+  else if (cmd->iov) {
+    h->wvec = cmd->iov;
+    h->wveccnt = cmd->iovcnt;
+    h->wvec_skip = 0;
+  }
+  else
+    h->wbuf = cmd->data;
+}
+
+/* Send a write payload gathered from the buffers from h->wvec. */
+static int
+send_from_wvec (struct nbd_handle *h)
+{
+  struct iovec iov[PAYLOAD_IOV_MAX];
+  ssize_t r;
+  size_t len;
+  int n;
+
+  while (h->wlen > 0) {
+    assert (h->wveccnt > 0);
+    if (h->sock->ops->send_iov) {
+      n = fill_iov (iov, h->wvec, h->wveccnt, h->wvec_skip, h->wlen);
+      len = h->wlen;
+      r = h->sock->ops->send_iov (h, h->sock, iov, n, h->wflags);
+    }
+    else {
+      len = h->wvec->iov_len - h->wvec_skip;
+      r = h->sock->ops->send (h, h->sock,
+                              (char *) h->wvec->iov_base + h->wvec_skip,
+                              len, h->wflags);
+    }
+    trace (h, TRACE_SEND, 0, 0, 0, len, r >= 0 ? r : -errno);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;               /* more data */
+      /* sock->ops called set_error already. */
+      return -1;
+    }
+    h->stats.bytes_sent += r;
+    h->wlen -= r;
+    advance_vec (&h->wvec, &h->wveccnt, &h->wvec_skip, r);
+  }
+
+  h->wflags = 0;                /* reset this when moving to next state */
+  return 0;                     /* move to next state */
+}
+
+/* As send_from_wbuf, but for a payload set up by set_write_payload.
+ * Data from a file descriptor is sent with sendfile if possible,
+ * otherwise copied through wfd_buf.  h->wlen counts the bytes not
+ * yet sent, including any in wfd_buf.  The request has already been
+ * sent, so failing to read the payload is fatal to the connection.
+ */
+static int
+send_write_payload (struct nbd_handle *h)
+{
+  ssize_t r;
+  size_t len;
+
+  if (h->wvec)
+    return send_from_wvec (h);
+  if (h->wfd == -1)
+    return send_from_wbuf (h);
+
+  while (h->wlen > 0) {
+    if (h->sock->ops->send_file && !h->wfd_copy) {
+      r = h->sock->ops->send_file (h, h->sock, h->wfd, &h->wfd_offset,
+                                   h->wlen);
+      if (r == -1 && errno == EOPNOTSUPP) {
+        debug (h, "cannot use sendfile for the write payload, "
+               "copying it instead");
+        h->wfd_copy = true;
+        continue;
+      }
+      trace (h, TRACE_SEND, 0, 0, 0, h->wlen, r >= 0 ? r : -errno);
+      if (r == 0) {
+        set_error (EIO, "unexpected end of file reading the write payload");
+        return -1;
+      }
+    }
+    else {
+      if (h->wfd_buf_start == h->wfd_buf_end) {
+        if (h->wfd_buf == NULL) {
+          h->wfd_buf = malloc (FD_BUFFER_SIZE);
+          if (h->wfd_buf == NULL) {
+            set_error (errno, "malloc");
+            return -1;
+          }
+        }
+        len = h->wlen > FD_BUFFER_SIZE ? FD_BUFFER_SIZE : h->wlen;
+        r = pread (h->wfd, h->wfd_buf, len, h->wfd_offset);
+        if (r == -1) {
+          set_error (errno, "pread");
+          return -1;
+        }
+        if (r == 0) {
+          set_error (EIO, "unexpected end of file reading the write payload");
+          return -1;
+        }
+        h->wfd_offset += r;
+        h->wfd_buf_start = 0;
+        h->wfd_buf_end = r;
+      }
+      r = h->sock->ops->send (h, h->sock, h->wfd_buf + h->wfd_buf_start,
+                              h->wfd_buf_end - h->wfd_buf_start, h->wflags);
+      trace (h, TRACE_SEND, 0, 0, 0, h->wfd_buf_end - h->wfd_buf_start,
+             r >= 0 ? r : -errno);
+      if (r > 0)
+        h->wfd_buf_start += r;
+    }
+
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;               /* more data */
+      /* sock->ops called set_error already. */
+      return -1;
+    }
+    h->stats.bytes_sent += r;
+    h->wlen -= r;
+  }
+
+  h->wflags = 0;                /* reset this when moving to next state */
+  return 0;                     /* move to next state */
+}
+
+/* Move the command at the head of cmds_to_issue, which has been
+ * completely sent, to the in-flight list.
+ */
+static void
+finish_issued_command (struct nbd_handle *h)
+{
+  struct command *cmd = h->cmds_to_issue;
+
+  h->cmds_to_issue = cmd->next;
+  if (h->cmds_to_issue_tail == cmd)
+    h->cmds_to_issue_tail = NULL;
+  cmd->next = h->cmds_in_flight;
+  cmd->prev = NULL;
+  if (cmd->next)
+    cmd->next->prev = cmd;
+  else if (h->reply_timeout != -1)
+    /* See nbd_set_reply_timeout: the wait for a reply starts now. */
+    h->liveness_us = nbd_internal_stats_now ();
+  cmd->list = CMDS_IN_FLIGHT;
+  h->cmds_in_flight = cmd;
+  probe (issue, h->hname, cmd->cookie, cmd->type, cmd->offset, cmd->count);
+  command_event (h, cmd, LIBNBD_COMMAND_EVENT_SENT);
+  nbd_internal_depth_sent (h, cmd);
+  nbd_internal_elevator_sent (h, cmd);
+}
+
+/* As send_from_wbuf, but for the vectored send set up by
+ * ISSUE_COMMAND.START.  Each command except the last is moved to the
+ * in-flight list as soon as it has been completely sent, because the
+ * server may reply to it before the rest of the batch is sent.  The
+ * last command is left for ISSUE_COMMAND.FINISH.
+ */
+static int
+send_from_wiov (struct nbd_handle *h)
+{
+  ssize_t r;
+  struct iovec *iov;
+
+  if (h->wlen == 0)
+    goto next_state;
+  r = h->sock->ops->send_iov (h, h->sock, &h->wiov[h->wiov_next],
+                              h->wiov_cnt - h->wiov_next, h->wflags);
+  trace (h, TRACE_SEND, 0, 0, 0, h->wlen, r >= 0 ? r : -errno);
+  if (r == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 1;                 /* more data */
+    /* sock->ops->send_iov called set_error already. */
+    return -1;
+  }
+  h->stats.bytes_sent += r;
+  h->wlen -= r;
+  while (h->wiov_next < h->wiov_cnt &&
+         (size_t) r >= h->wiov[h->wiov_next].iov_len) {
+    r -= h->wiov[h->wiov_next].iov_len;
+    h->wiov_next++;
+  }
+  if (r > 0) {
+    iov = &h->wiov[h->wiov_next];
+    iov->iov_base = (char *) iov->iov_base + r;
+    iov->iov_len -= r;
+  }
+  while (h->wcmds_sent < h->wcmds - 1 &&
+         h->wiov_next >= h->wiov_cmd_end[h->wcmds_sent]) {
+    finish_issued_command (h);
+    h->wcmds_sent++;
+  }
+  if (h->wlen == 0)
+    goto next_state;
+  else
+    return 1;                   /* more data */
+
+ next_state:
+  h->wflags = 0;                /* reset this when moving to next state */
+  return 0;                     /* move to next state */
+}
+
+/* Return true if cmd is (a piece of) a read from nbd_aio_pread_sparse. */
+static bool
+is_sparse_read (const struct command *cmd)
+{
+  if (cmd->parent)
+    cmd = cmd->parent;
+  return cmd->type == NBD_CMD_READ && CALLBACK_IS_NOT_NULL (cmd->cb.sparse);
+}
+
+static int
+compare_holes (const void *p1, const void *p2)
+{
+  const struct read_hole *h1 = p1, *h2 = p2;
+
+  return h1->offset < h2->offset ? -1 : h1->offset > h2->offset;
+}
+
+/* Append an extent to the list being built by report_holes, merging
+ * it with the previous one if that has the same status.
+ */
+static void
+add_extent (uint32_t *entries, size_t *n, uint64_t length, uint32_t flags)
+{
+  if (*n > 0 && entries[*n - 1] == flags)
+    entries[*n - 2] += length;
+  else {
+    entries[(*n)++] = length;
+    entries[(*n)++] = flags;
+  }
+}
+
+/* When a sparse read has succeeded, describe the whole request to
+ * its extent callback as a list of data and hole extents, in the
+ * same form as base:allocation block status.  The holes arrived in
+ * any order, and a non-compliant server might send overlapping ones.
+ */
+static void
+report_holes (struct nbd_handle *h, struct command *cmd)
+{
+  const uint64_t end = cmd->offset + cmd->count;
+  const uint32_t hole = LIBNBD_STATE_HOLE | LIBNBD_STATE_ZERO;
+  uint64_t pos = cmd->offset, hole_end;
+  uint32_t *entries;
+  size_t i, n = 0;
+  int error = 0;
+
+  /* Each hole can be preceded by data, and there may be data at
+   * the end, each extent taking two entries.
+   */
+  entries = malloc ((2 * cmd->nr_holes + 1) * 2 * sizeof *entries);
+  if (entries == NULL) {
+    set_error (errno, "malloc");
+    cmd->error = errno;
+    return;
+  }
+  qsort (cmd->holes, cmd->nr_holes, sizeof cmd->holes[0], compare_holes);
+  for (i = 0; i < cmd->nr_holes; ++i) {
+    hole_end = cmd->holes[i].offset + cmd->holes[i].length;
+    if (hole_end <= pos)
+      continue;
+    if (cmd->holes[i].offset > pos) {
+      add_extent (entries, &n, cmd->holes[i].offset - pos, 0);
+      pos = cmd->holes[i].offset;
+    }
+    add_extent (entries, &n, hole_end - pos, hole);
+    pos = hole_end;
+  }
+  if (pos < end)
+    add_extent (entries, &n, end - pos, 0);
+
+  if (CALL_CALLBACK (cmd->cb.sparse, LIBNBD_CONTEXT_BASE_ALLOCATION,
+                     cmd->offset, entries, n, &error) == -1)
+    cmd->error = error ? error : EPROTO;
+  free (entries);
+}
+
+/* Forget the holes which a sparse read received from a connection
+ * which has died, since the command will be sent again.
+ */
+static void
+forget_holes (struct command *cmd)
+{
+  struct command *owner = cmd->parent ? cmd->parent : cmd;
+  const uint64_t end = cmd->offset + cmd->count;
+  size_t i, j;
+
+  for (i = j = 0; i < owner->nr_holes; ++i) {
+    if (owner->holes[i].offset >= cmd->offset &&
+        owner->holes[i].offset < end)
+      continue;
+    owner->holes[j++] = owner->holes[i];
+  }
+  owner->nr_holes = j;
+}
+
+/* Notify the user that a command has completed, and move it to the
+ * end of the cmds_done list, or retire it if the completion callback
+ * asked for that.  The caller must already have unlinked cmd from
+ * the list it was on.  A piece of a split request (see
+ * nbd_set_split_requests) is retired here and its result folded into
+ * the parent, which completes with its last piece.
+ */
+static void
+complete_command (struct nbd_handle *h, struct command *cmd)
+{
+  struct command *parent = cmd->parent, *c, *next;
+  bool retire;
+
+  /* See nbd_set_write_behind. */
+  if (cmd->write_behind || cmd->deferred_error)
+    nbd_internal_write_behind_complete (h, cmd);
+
+  /* A request made of coalesced writes completes each of them with
+   * its result, see coalesce_writes.
+   */
+  if (cmd->coalesced) {
+    for (c = cmd->coalesced; c != NULL; c = next) {
+      next = c->next;
+      if (c->error == 0)
+        c->error = cmd->error;
+      complete_command (h, c);
+    }
+    nbd_internal_retire_and_free_command (h, cmd);
+    return;
+  }
+
+  /* Reads waiting for this one get their part of its data, see
+   * nbd_set_dedupe_reads.  This must be done before the completion
+   * callback, which may free the buffer.
+   */
+  for (c = cmd->attached, cmd->attached = NULL; c != NULL; c = next) {
+    next = c->next;
+    if (c->error == 0)
+      c->error = cmd->error;
+    if (c->error == 0) {
+      memcpy (c->data, (char *) cmd->data + (c->offset - cmd->offset),
+              c->count);
+      c->data_seen = c->count;
+    }
+    complete_command (h, c);
+  }
+
+  if (h->extent_cache &&
+      (cmd->type == NBD_CMD_WRITE || cmd->type == NBD_CMD_TRIM ||
+       cmd->type == NBD_CMD_WRITE_ZEROES))
+    nbd_internal_extent_cache_invalidate (h, cmd->offset, cmd->count);
+  if (h->shared_cache &&
+      (cmd->type == NBD_CMD_WRITE || cmd->type == NBD_CMD_TRIM ||
+       cmd->type == NBD_CMD_WRITE_ZEROES))
+    nbd_internal_shared_cache_invalidate (h, cmd->offset, cmd->count);
+
+  if (parent) {
+    if (parent->error == 0)
+      parent->error = cmd->error;
+    parent->data_seen += cmd->data_seen;
+    nbd_internal_retire_and_free_command (h, cmd);
+    assert (parent->pieces > 0);
+    if (--parent->pieces > 0)
+      return;
+    cmd = parent;
+  }
+
+  if (cmd->error == 0 && is_sparse_read (cmd))
+    report_holes (h, cmd);
+  if (cmd->error == 0 && cmd->shared_cache)
+    nbd_internal_shared_cache_fill (h, cmd);
+  if (CALLBACK_IS_NOT_NULL (cmd->cb.lend))
+    nbd_internal_lend (h, cmd);
+
+  trace (h, TRACE_COMPLETE, cmd->type, cmd->cookie, cmd->offset, cmd->count,
+         cmd->error);
+  probe (complete, h->hname, cmd->cookie, cmd->type, cmd->offset, cmd->count,
+         cmd->error);
+  command_event (h, cmd, LIBNBD_COMMAND_EVENT_COMPLETED);
+  record_complete (h, cmd);
+  nbd_internal_stats_command_done (h, cmd);
+  if (cmd->type == NBD_CMD_READ || cmd->type == NBD_CMD_WRITE) {
+    assert (h->bytes_in_flight >= cmd->count);
+    h->bytes_in_flight -= cmd->count;
+  }
+  retire = cmd->type == NBD_CMD_DISC;
+
+  if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
+    int error = cmd->error;
+    int r;
+
+    assert (cmd->type != NBD_CMD_DISC);
+    r = CALL_CALLBACK (cmd->cb.completion, &error);
+    switch (r) {
+    case -1:
+      if (error)
+        cmd->error = error;
+      break;
+    case 1:
+      retire = true;
+      break;
+    }
+  }
+
+  cmd->next = NULL;
+  if (retire)
+    nbd_internal_retire_and_free_command (h, cmd);
+  else {
+    cmd->prev = h->cmds_done_tail;
+    cmd->list = CMDS_DONE;
+    if (h->cmds_done_tail != NULL)
+      h->cmds_done_tail = h->cmds_done_tail->next = cmd;
+    else {
+      assert (h->cmds_done == NULL);
+      h->cmds_done = h->cmds_done_tail = cmd;
+    }
+  }
+}
+
+/* Return true if the payload of the write cmd should be sent with
+ * MSG_ZEROCOPY, see nbd_set_zerocopy_threshold.  The socket is asked
+ * to enable zero-copy sends the first time one is wanted.
+ */
+static bool
+use_zerocopy (struct nbd_handle *h, struct command *cmd)
+{
+  if (cmd->type != NBD_CMD_WRITE || separate_write_payload (cmd) ||
+      h->zerocopy_threshold == 0 ||
+      cmd->count < h->zerocopy_threshold)
+    return false;
+
+  if (!h->zerocopy_tried) {
+    h->zerocopy_tried = true;
+    h->zerocopy_enabled =
+      h->sock->ops->enable_zerocopy &&
+      h->sock->ops->enable_zerocopy (h, h->sock);
+  }
+  return h->zerocopy_enabled;
+}
+
+/* Return true if the kernel may still be using the payload of cmd. */
+static bool
+zerocopy_pending (struct nbd_handle *h, struct command *cmd)
+{
+  return cmd->zerocopy &&
+    (int32_t) (cmd->zerocopy_seq - h->zerocopy_done) >= 0;
+}
+
+/* Read any notifications of released zero-copy sends, then complete
+ * the writes on cmds_zerocopy which no longer need their payload.
+ */
+static int
+reap_zerocopy (struct nbd_handle *h)
+{
+  struct command *cmd, *next;
+
+  if (h->zerocopy_done == h->zerocopy_next)
+    return 0;
+  if (h->sock->ops->reap_zerocopy (h, h->sock, &h->zerocopy_done) == -1)
+    return -1;
+
+  for (cmd = h->cmds_zerocopy; cmd != NULL; cmd = next) {
+    next = cmd->next;
+    if (zerocopy_pending (h, cmd))
+      continue;
+    if (cmd->prev != NULL)
+      cmd->prev->next = cmd->next;
+    else
+      h->cmds_zerocopy = cmd->next;
+    if (cmd->next != NULL)
+      cmd->next->prev = cmd->prev;
+    complete_command (h, cmd);
+    h->in_flight--;
+    assert (h->in_flight >= 0);
+  }
+  return 0;
+}
+
+/* Complete the writes waiting on cmds_zerocopy when the connection
+ * is closed.  The server has already replied to them, so they keep
+ * their result.
+ */
+static void
+finish_zerocopy_commands (struct nbd_handle *h)
+{
+  struct command *cmd, *next;
+
+  for (cmd = h->cmds_zerocopy, h->cmds_zerocopy = NULL; cmd != NULL;
+       cmd = next) {
+    next = cmd->next;
+    complete_command (h, cmd);
+  }
+}
+
 /* Forcefully fail any remaining in-flight commands in list */
 void abort_commands (struct nbd_handle *h,
                      struct command **list)
@@ -118,49 +1030,204 @@ void abort_commands (struct nbd_handle *h,
   struct command *next, *cmd;
 
   for (cmd = *list, *list = NULL; cmd != NULL; cmd = next) {
-    bool retire = cmd->type == NBD_CMD_DISC;
-
     next = cmd->next;
-    if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
-      int error = cmd->error ? cmd->error : ENOTCONN;
-      int r;
-
-      assert (cmd->type != NBD_CMD_DISC);
-      r = CALL_CALLBACK (cmd->cb.completion, &error);
-      switch (r) {
-      case -1:
-        if (error)
-          cmd->error = error;
-        break;
-      case 1:
-        retire = true;
-        break;
-      }
-    }
+    probe (abort, h->hname, cmd->cookie, cmd->type, cmd->offset, cmd->count);
     if (cmd->error == 0)
       cmd->error = ENOTCONN;
-    if (retire)
-      nbd_internal_retire_and_free_command (cmd);
-    else {
-      cmd->next = NULL;
-      if (h->cmds_done_tail)
-        h->cmds_done_tail->next = cmd;
-      else {
-        assert (h->cmds_done == NULL);
-        h->cmds_done = cmd;
-      }
-      h->cmds_done_tail = cmd;
+    complete_command (h, cmd);
+  }
+}
+
+/* Fail every command and close the socket, on the way to DEAD or
+ * CLOSED.
+ */
+static void
+close_connection (struct nbd_handle *h)
+{
+  abort_commands (h, &h->cmds_to_issue);
+  abort_commands (h, &h->cmds_in_flight);
+  finish_zerocopy_commands (h);
+  abort_commands (h, &h->wb_held);
+  h->wb_held_tail = NULL;
+  h->in_flight = 0;
+  nbd_internal_depth_reset (h);
+  nbd_internal_free_tcp_race (h);
+  nbd_internal_resolve_cancel (h);
+  if (h->sock)
+    nbd_internal_close_socket (h);
+}
+
+/* Return true if the connection which has just died should be
+ * established again, see nbd_set_reconnect.  Only connections made
+ * to an address can be, and not while the handle is shutting down.
+ */
+static bool
+can_reconnect (struct nbd_handle *h)
+{
+  return h->reconnect_tries < h->reconnect &&
+    h->protocol != NULL && !h->probe_only && !h->disconnect_request &&
+    h->argv == NULL && (h->hostname != NULL || h->connaddrlen > 0);
+}
+
+/* Return true if a command which was sent before the connection died
+ * may be sent again on the new connection.  Flushes are not, because
+ * the server may have lost writes which it had already replied to.
+ */
+static bool
+can_replay (struct command *cmd)
+{
+  switch (cmd->type) {
+  case NBD_CMD_READ:
+  case NBD_CMD_BLOCK_STATUS:
+  case NBD_CMD_CACHE:
+    return true;
+  case NBD_CMD_WRITE:
+  case NBD_CMD_TRIM:
+  case NBD_CMD_WRITE_ZEROES:
+    return cmd->replay;
+  default:
+    return false;
+  }
+}
+
+/* Close the dead connection and get ready to make a new one.  The
+ * commands in flight which can be replayed are moved back to the
+ * front of cmds_to_issue, in the order they were sent and keeping
+ * their cookies, and the others fail.  The commands which were never
+ * sent stay queued.  Anything learned in the handshake which the new
+ * one may not agree with is forgotten.
+ */
+static void
+prepare_reconnect (struct nbd_handle *h)
+{
+  struct command *cmd, *next;
+
+  /* cmds_in_flight has the most recently sent command first. */
+  for (cmd = h->cmds_in_flight, h->cmds_in_flight = NULL; cmd != NULL;
+       cmd = next) {
+    next = cmd->next;
+    if (!can_replay (cmd)) {
+      if (cmd->error == 0)
+        cmd->error = ENOTCONN;
+      complete_command (h, cmd);
+      continue;
     }
+    cmd->error = 0;
+    cmd->data_seen = 0;
+    cmd->nr_seen = 0;
+    if (is_sparse_read (cmd))
+      forget_holes (cmd);
+    cmd->list = CMDS_TO_ISSUE;
+    cmd->prev = NULL;
+    cmd->next = h->cmds_to_issue;
+    if (h->cmds_to_issue == NULL)
+      h->cmds_to_issue_tail = cmd;
+    h->cmds_to_issue = cmd;
+  }
+  finish_zerocopy_commands (h);
+  h->in_flight = 0;
+  nbd_internal_depth_reset (h);
+  for (cmd = h->cmds_to_issue; cmd != NULL; cmd = cmd->next) {
+    cmd->zerocopy = false;
+    h->in_flight++;
+  }
+
+  nbd_internal_free_tcp_race (h);
+  nbd_internal_resolve_cancel (h);
+  if (h->sock)
+    nbd_internal_close_socket (h);
+  free (h->pipeline_buf);
+  h->pipeline_buf = NULL;
+  h->wlen = 0;
+  h->wcmds = 0;
+  h->wfd_buf_start = h->wfd_buf_end = 0;
+  h->in_write_payload = false;
+  h->reply_cmd = NULL;
+  h->rstage_start = h->rstage_end = 0;
+  h->recv_drained = false;
+  h->zerocopy_tried = h->zerocopy_enabled = false;
+  h->zerocopy_next = h->zerocopy_done = 0;
+  h->nr_zerocopy_ranges = 0;
+
+  /* The server did not answer all of the pipelined options, so it
+   * may not cope with them, see nbd_set_pipeline_options.
+   */
+  if (h->pipelined != 0) {
+    debug (h, "handshake failed with pipelined options, "
+           "not pipelining them again");
+    h->pipeline_refused = true;
+    h->pipelined = 0;
   }
+  h->structured_replies = false;
+  h->extended_headers = false;
+  h->tls_negotiated = false;
+  h->shm_negotiated = false;
+  nbd_internal_free_meta_contexts (h);
+  nbd_internal_free_exports (h);
+
+  h->reconnecting = true;
+  h->reconnect_tries++;
+}
+
+/* Complete a command which nbd_aio_cancel has removed from
+ * cmds_to_issue.
+ */
+void
+nbd_internal_cancel_command (struct nbd_handle *h, struct command *cmd)
+{
+  h->in_flight--;
+  nbd_internal_detach_reads (h, cmd);
+  cmd->error = ECANCELED;
+  complete_command (h, cmd);
+}
+
+/* Complete a command which was never queued to be sent, because it
+ * was answered from data the library already holds, see
+ * lib/read-ahead.c.
+ */
+void
+nbd_internal_complete_unsent_command (struct nbd_handle *h,
+                                      struct command *cmd)
+{
+  complete_command (h, cmd);
+}
+
+/* Move to DEAD from outside the state machine, when a synchronous
+ * call gives up waiting for the server (see nbd_set_timeout).  The
+ * caller must have used set_error() first.
+ */
+void
+nbd_internal_abort_connection (struct nbd_handle *h)
+{
+  assert (nbd_get_error ());
+  close_connection (h);
+  set_next_state (h, STATE_DEAD);
+  if (h->pollers)
+    nbd_internal_wake_pollers (h);
 }
 
 STATE_MACHINE {
  READY:
-  if (h->cmds_to_issue)
+  /* This also drains the socket error queue, which would otherwise
+   * keep waking up poll with POLLERR.
+   */
+  if (reap_zerocopy (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  /* See nbd_set_write_behind. */
+  if (h->wb_held != NULL)
+    nbd_internal_write_behind_release (h);
+  /* Commands may be held back by nbd_set_adaptive_depth or
+   * nbd_set_rate_limit.
+   */
+  if (h->cmds_to_issue && nbd_internal_depth_slots (h) > 0 &&
+      nbd_internal_rate_delay (h, h->cmds_to_issue) == 0)
     SET_NEXT_STATE (%ISSUE_COMMAND.START);
   else {
     assert (h->sock);
-    if (h->sock->ops->pending && h->sock->ops->pending (h->sock))
+    if (h->rstage_start < h->rstage_end ||
+        (h->sock->ops->pending && h->sock->ops->pending (h->sock)))
       SET_NEXT_STATE (%REPLY.START);
   }
   return 0;
@@ -168,23 +1235,30 @@ STATE_MACHINE {
  DEAD:
   /* The caller should have used set_error() before reaching here */
   assert (nbd_get_error ());
-  abort_commands (h, &h->cmds_to_issue);
-  abort_commands (h, &h->cmds_in_flight);
-  h->in_flight = 0;
-  if (h->sock) {
-    h->sock->ops->close (h->sock);
-    h->sock = NULL;
+  if (h->reply_timed_out) {
+    /* The error is from the socket being shut down. */
+    h->reply_timed_out = false;
+    set_error (ETIMEDOUT, "no reply from the server for %d ms",
+               h->reply_timeout);
   }
+  if (h->trace)
+    nbd_internal_dump_trace (h);
+  if (can_reconnect (h)) {
+    debug (h, "reconnecting (attempt %" PRIu32 " of %" PRIu32 ") after: %s",
+           h->reconnect_tries + 1, h->reconnect, nbd_get_error ());
+    prepare_reconnect (h);
+    if (h->hostname != NULL)
+      SET_NEXT_STATE (%CONNECT_TCP.START);
+    else
+      SET_NEXT_STATE (%CONNECT.START);
+    return 0;
+  }
+  h->reconnecting = false;
+  close_connection (h);
   return -1;
 
  CLOSED:
-  abort_commands (h, &h->cmds_to_issue);
-  abort_commands (h, &h->cmds_in_flight);
-  h->in_flight = 0;
-  if (h->sock) {
-    h->sock->ops->close (h->sock);
-    h->sock = NULL;
-  }
+  close_connection (h);
   return 0;
 
 } /* END STATE MACHINE */
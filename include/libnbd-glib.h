@@ -0,0 +1,206 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Header-only GLib main loop integration, see libnbd-event-loops(3).
+ *
+ * Everything here is inline and calls the public API, so it adds
+ * nothing to the library ABI and libnbd does not depend on GLib.
+ *
+ * The source keeps the direction of the handle from the direction
+ * callback (see nbd_set_direction_callback(3)), so it only has to
+ * call into libnbd when the socket is ready or a timer is due.
+ */
+
+#ifndef LIBNBD_GLIB_H
+#define LIBNBD_GLIB_H
+
+#include <libnbd.h>
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct nbd_gsource {
+  GSource source;               /* The base type, must be first. */
+  struct nbd_handle *nbd;       /* Owned by the source. */
+  int fd;                       /* The fd added to the source, or -1. */
+  gpointer tag;
+  gint timer;                   /* From nbd_aio_get_timer in prepare. */
+
+  /* These are set by the direction callback, which is called in the
+   * thread which moved the handle on, so may be another thread.
+   */
+  gint dir;
+  gint changed;                 /* fd and events must be updated. */
+};
+
+static inline int
+nbd_gsource_direction_ (void *user_data, unsigned direction)
+{
+  struct nbd_gsource *s = (struct nbd_gsource *) user_data;
+  GMainContext *ctx;
+
+  g_atomic_int_set (&s->dir, direction);
+  g_atomic_int_set (&s->changed, 1);
+
+  /* The thread running the loop may be asleep waiting for the old
+   * direction.
+   */
+  ctx = g_source_get_context (&s->source);
+  if (ctx != NULL && !g_main_context_is_owner (ctx))
+    g_main_context_wakeup (ctx);
+  return 0;
+}
+
+static inline gboolean
+nbd_gsource_prepare_ (GSource *gs, gint *timeout)
+{
+  struct nbd_gsource *s = (struct nbd_gsource *) gs;
+  unsigned dir;
+  int fd, events;
+
+  if (g_atomic_int_compare_and_exchange (&s->changed, 1, 0)) {
+    /* The socket changes when connecting or reconnecting, which
+     * always changes the direction too.
+     */
+    fd = nbd_aio_get_fd (s->nbd);
+    if (fd != s->fd) {
+      if (s->tag != NULL)
+        g_source_remove_unix_fd (gs, s->tag);
+      s->tag = fd >= 0 ? g_source_add_unix_fd (gs, fd, (GIOCondition) 0)
+                       : NULL;
+      s->fd = fd;
+    }
+    if (s->tag != NULL) {
+      dir = g_atomic_int_get (&s->dir);
+      events = 0;
+      if ((dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+        events |= G_IO_IN;
+      if ((dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+        events |= G_IO_OUT;
+      g_source_modify_unix_fd (gs, s->tag, (GIOCondition) events);
+    }
+  }
+
+  s->timer = nbd_aio_get_timer (s->nbd);
+  *timeout = s->timer;
+  return s->timer == 0;
+}
+
+static inline gboolean
+nbd_gsource_check_ (GSource *gs)
+{
+  struct nbd_gsource *s = (struct nbd_gsource *) gs;
+
+  if (s->tag != NULL && g_source_query_unix_fd (gs, s->tag) != 0)
+    return TRUE;
+  return s->timer >= 0 && nbd_aio_get_timer (s->nbd) == 0;
+}
+
+static inline gboolean
+nbd_gsource_dispatch_ (GSource *gs, GSourceFunc callback, gpointer user_data)
+{
+  struct nbd_gsource *s = (struct nbd_gsource *) gs;
+  unsigned dir = g_atomic_int_get (&s->dir);
+  int revents = 0;
+
+  if (s->tag != NULL)
+    revents = g_source_query_unix_fd (gs, s->tag);
+
+  /* As in nbd_poll, only one notification is sent.  On a hangup or
+   * error, sending or receiving will find the problem and move the
+   * handle to the dead state, which the callback can check for.
+   */
+  if ((revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) != 0 &&
+      (dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+    nbd_aio_notify_read (s->nbd);
+  else if ((revents & (G_IO_OUT | G_IO_HUP | G_IO_ERR)) != 0 &&
+           (dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+    nbd_aio_notify_write (s->nbd);
+  if (s->timer >= 0)
+    nbd_aio_notify_timer (s->nbd);
+
+  /* Called once for all the commands which completed in this
+   * iteration, without the handle locked.
+   */
+  if (callback != NULL)
+    return callback (user_data);
+  return G_SOURCE_CONTINUE;
+}
+
+static inline void
+nbd_gsource_finalize_ (GSource *gs)
+{
+  struct nbd_gsource *s = (struct nbd_gsource *) gs;
+
+  nbd_close (s->nbd);
+}
+
+/* Create a source which drives the handle from a GLib main loop.
+ * The source owns the handle and closes it when it is finalized.
+ * The callback set with g_source_set_callback is called once each
+ * time the handle is driven, and can retire commands and issue new
+ * ones.  Returns NULL if the direction callback could not be set,
+ * with the error from libnbd.
+ */
+static inline GSource *
+nbd_gsource_new (struct nbd_handle *nbd)
+{
+  static GSourceFuncs funcs = {
+    nbd_gsource_prepare_,
+    nbd_gsource_check_,
+    nbd_gsource_dispatch_,
+    nbd_gsource_finalize_,
+    NULL, NULL
+  };
+  struct nbd_gsource *s;
+  nbd_direction_callback cb;
+
+  s = (struct nbd_gsource *) g_source_new (&funcs, sizeof *s);
+  s->nbd = NULL;
+  s->fd = -1;
+  s->tag = NULL;
+  s->timer = -1;
+  s->changed = 1;
+
+  cb.callback = nbd_gsource_direction_;
+  cb.user_data = s;
+  cb.free = NULL;
+  if (nbd_set_direction_callback (nbd, cb) == -1) {
+    g_source_unref (&s->source);
+    return NULL;
+  }
+  s->nbd = nbd;
+  s->dir = nbd_aio_get_direction (nbd);
+  g_source_set_name (&s->source, "libnbd");
+  return &s->source;
+}
+
+static inline struct nbd_handle *
+nbd_gsource_get_handle (GSource *gs)
+{
+  return ((struct nbd_gsource *) gs)->nbd;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBNBD_GLIB_H */
@@ -0,0 +1,264 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Header-only libuv integration, see libnbd-event-loops(3).
+ *
+ * Everything here is inline and calls the public API, so it adds
+ * nothing to the library ABI and libnbd does not depend on libuv.
+ *
+ * As with everything in libuv, the handle must only be used from the
+ * thread running the loop.  The direction callback (see
+ * nbd_set_direction_callback(3)) only marks the poll handle as out of
+ * date, and it is brought up to date in the prepare phase of the next
+ * iteration, since the socket of the handle may have changed and that
+ * cannot be asked for while the callback holds the handle lock.
+ */
+
+#ifndef LIBNBD_UV_H
+#define LIBNBD_UV_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <libnbd.h>
+
+#include <uv.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct nbd_uv;
+typedef void (*nbd_uv_cb) (struct nbd_uv *u);
+
+struct nbd_uv {
+  /* Free for use by the caller. */
+  void *data;
+
+  uv_loop_t *loop;
+  struct nbd_handle *nbd;       /* Owned by the adapter. */
+  uv_poll_t *poll;              /* Allocated for each socket, or NULL. */
+  int fd;
+  int events;                   /* Events poll was started for. */
+  uv_prepare_t prepare;
+  uv_check_t check;
+  uv_timer_t timer;
+  unsigned dir;                 /* Set by the direction callback. */
+  bool changed;                 /* poll must be updated. */
+  bool notified;                /* The handle was driven this iteration. */
+  nbd_uv_cb dispatch_cb;
+  nbd_uv_cb close_cb;
+  int closing;                  /* uv handles still to be closed. */
+};
+
+static inline int
+nbd_uv_direction_ (void *user_data, unsigned direction)
+{
+  struct nbd_uv *u = (struct nbd_uv *) user_data;
+
+  u->dir = direction;
+  u->changed = true;
+  return 0;
+}
+
+static inline void
+nbd_uv_poll_cb_ (uv_poll_t *poll, int status, int events)
+{
+  struct nbd_uv *u = (struct nbd_uv *) poll->data;
+
+  /* On an error, sending or receiving will find the problem and move
+   * the handle to the dead state.  As in nbd_poll, only one
+   * notification is sent.
+   */
+  if (status < 0)
+    events = UV_READABLE | UV_WRITABLE;
+  if ((events & UV_READABLE) != 0 && (u->dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+    nbd_aio_notify_read (u->nbd);
+  else if ((events & UV_WRITABLE) != 0 &&
+           (u->dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+    nbd_aio_notify_write (u->nbd);
+  u->notified = true;
+}
+
+static inline void
+nbd_uv_timer_cb_ (uv_timer_t *timer)
+{
+  struct nbd_uv *u = (struct nbd_uv *) timer->data;
+
+  nbd_aio_notify_timer (u->nbd);
+  u->notified = true;
+}
+
+static inline void
+nbd_uv_free_poll_ (uv_handle_t *handle)
+{
+  free (handle);
+}
+
+static inline void
+nbd_uv_prepare_cb_ (uv_prepare_t *prepare)
+{
+  struct nbd_uv *u = (struct nbd_uv *) prepare->data;
+  int fd, events, t;
+
+  if (u->changed) {
+    u->changed = false;
+
+    /* The socket changes when connecting or reconnecting, which
+     * always changes the direction too.  A uv_poll_t cannot be moved
+     * to another fd, so a new one is made.
+     */
+    fd = nbd_aio_get_fd (u->nbd);
+    if (fd != u->fd) {
+      if (u->poll != NULL)
+        uv_close ((uv_handle_t *) u->poll, nbd_uv_free_poll_);
+      u->poll = NULL;
+      u->fd = -1;
+      u->events = 0;
+      if (fd >= 0) {
+        u->poll = (uv_poll_t *) malloc (sizeof *u->poll);
+        if (u->poll != NULL && uv_poll_init (u->loop, u->poll, fd) != 0) {
+          free (u->poll);
+          u->poll = NULL;
+        }
+        if (u->poll != NULL) {
+          u->poll->data = u;
+          u->fd = fd;
+        }
+      }
+    }
+
+    if (u->poll != NULL) {
+      events = 0;
+      if ((u->dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+        events |= UV_READABLE;
+      if ((u->dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+        events |= UV_WRITABLE;
+      if (events != u->events) {
+        if (events != 0)
+          uv_poll_start (u->poll, events, nbd_uv_poll_cb_);
+        else
+          uv_poll_stop (u->poll);
+        u->events = events;
+      }
+    }
+  }
+
+  t = nbd_aio_get_timer (u->nbd);
+  if (t >= 0)
+    uv_timer_start (&u->timer, nbd_uv_timer_cb_, t, 0);
+  else
+    uv_timer_stop (&u->timer);
+}
+
+static inline void
+nbd_uv_check_cb_ (uv_check_t *check)
+{
+  struct nbd_uv *u = (struct nbd_uv *) check->data;
+
+  /* Called once for all the commands which completed in this
+   * iteration, without the handle locked.
+   */
+  if (u->notified) {
+    u->notified = false;
+    if (u->dispatch_cb != NULL)
+      u->dispatch_cb (u);
+  }
+}
+
+/* Drive the handle from the loop.  The adapter owns the handle and
+ * closes it in nbd_uv_close.  dispatch_cb, if not NULL, is called
+ * once in each iteration of the loop in which the handle was driven,
+ * after all the I/O callbacks, and can retire commands and issue new
+ * ones.  Returns -1 if the direction callback could not be set, with
+ * the error from libnbd.
+ */
+static inline int
+nbd_uv_init (uv_loop_t *loop, struct nbd_uv *u, struct nbd_handle *nbd,
+             nbd_uv_cb dispatch_cb)
+{
+  nbd_direction_callback cb;
+
+  cb.callback = nbd_uv_direction_;
+  cb.user_data = u;
+  cb.free = NULL;
+  if (nbd_set_direction_callback (nbd, cb) == -1)
+    return -1;
+
+  u->loop = loop;
+  u->nbd = nbd;
+  u->poll = NULL;
+  u->fd = -1;
+  u->events = 0;
+  u->dir = nbd_aio_get_direction (nbd);
+  u->changed = true;
+  u->notified = false;
+  u->dispatch_cb = dispatch_cb;
+  u->close_cb = NULL;
+  u->closing = 0;
+
+  /* Only the poll handle and a pending timer keep the loop alive. */
+  uv_prepare_init (loop, &u->prepare);
+  u->prepare.data = u;
+  uv_prepare_start (&u->prepare, nbd_uv_prepare_cb_);
+  uv_unref ((uv_handle_t *) &u->prepare);
+  uv_check_init (loop, &u->check);
+  u->check.data = u;
+  uv_check_start (&u->check, nbd_uv_check_cb_);
+  uv_unref ((uv_handle_t *) &u->check);
+  uv_timer_init (loop, &u->timer);
+  u->timer.data = u;
+  return 0;
+}
+
+static inline void
+nbd_uv_closed_ (uv_handle_t *handle)
+{
+  struct nbd_uv *u = (struct nbd_uv *) handle->data;
+
+  if (--u->closing == 0 && u->close_cb != NULL)
+    u->close_cb (u);
+}
+
+/* Stop driving the handle and close it.  close_cb, if not NULL, is
+ * called from the loop once the adapter is no longer in use and can
+ * be freed.
+ */
+static inline void
+nbd_uv_close (struct nbd_uv *u, nbd_uv_cb close_cb)
+{
+  u->close_cb = close_cb;
+  u->closing = 3;
+
+  /* Stop polling before nbd_close closes the socket. */
+  if (u->poll != NULL)
+    uv_close ((uv_handle_t *) u->poll, nbd_uv_free_poll_);
+  u->poll = NULL;
+  uv_close ((uv_handle_t *) &u->prepare, nbd_uv_closed_);
+  uv_close ((uv_handle_t *) &u->check, nbd_uv_closed_);
+  uv_close ((uv_handle_t *) &u->timer, nbd_uv_closed_);
+
+  nbd_close (u->nbd);
+  u->nbd = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBNBD_UV_H */
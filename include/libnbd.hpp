@@ -0,0 +1,594 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Header-only C++ layer over libnbd.h, see libnbd-cxx(3).
+ *
+ * Everything here is inline and calls the C API, so it adds nothing
+ * to the library ABI.  It needs C++17.  With C++20 the read and
+ * write calls also take std::span, and if the compiler supports
+ * coroutines the aio calls can be awaited.
+ *
+ * Nothing allocates memory per command: completion objects and
+ * awaiters are owned by the caller (or live in the coroutine frame)
+ * and are passed to libnbd as the user_data of the callback.
+ */
+
+#ifndef LIBNBD_HPP
+#define LIBNBD_HPP
+
+#if !defined (__cplusplus) || __cplusplus < 201703L
+#error "libnbd.hpp needs C++17 or later"
+#endif
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define LIBNBD_HPP_SPAN 1
+#endif
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>) && \
+  defined (__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#define LIBNBD_HPP_COROUTINES 1
+#endif
+
+#include <libnbd.h>
+
+namespace nbd {
+
+/* Thrown by every call which fails, with the message and errno of
+ * the error (see nbd_get_error(3) and nbd_get_errno(3)).
+ */
+class error : public std::runtime_error {
+public:
+  explicit error (const char *msg, int errnum)
+    : std::runtime_error (msg ? msg : "libnbd: unknown error"),
+      errnum_ (errnum) { }
+
+  /* The error from the last failing libnbd call in this thread. */
+  static error last ()
+  {
+    return error (nbd_get_error (), nbd_get_errno ());
+  }
+
+  /* The error a command completed with. */
+  static error from_errno (int errnum)
+  {
+    return error (std::strerror (errnum), errnum);
+  }
+
+  int errnum () const noexcept { return errnum_; }
+
+private:
+  int errnum_;
+};
+
+namespace detail {
+inline int64_t check (int64_t r)
+{
+  if (r == -1)
+    throw error::last ();
+  return r;
+}
+}
+
+/* A completion callback stored inline.  Pass it to one of the aio
+ * calls of class handle.  It must not be moved or destroyed until
+ * the command completes.  fn is called with the errno of the command
+ * (0 if it succeeded) with the lock on the handle held, so it must
+ * not call libnbd functions on the same handle.  The command is
+ * retired when fn returns.
+ */
+template <class F>
+class completion {
+public:
+  explicit completion (F fn) : fn_ (std::move (fn)) { }
+  completion (const completion &) = delete;
+  completion &operator= (const completion &) = delete;
+
+  nbd_completion_callback callback () noexcept
+  {
+    nbd_completion_callback cb;
+    cb.callback = call;
+    cb.user_data = this;
+    cb.free = nullptr;
+    return cb;
+  }
+
+private:
+  static int call (void *vp, int *error)
+  {
+    static_cast<completion *> (vp)->fn_ (*error);
+    return 1;
+  }
+
+  F fn_;
+};
+
+template <class F>
+completion<F> make_completion (F fn)
+{
+  return completion<F> (std::move (fn));
+}
+
+#ifdef LIBNBD_HPP_COROUTINES
+class scheduler;
+
+/* The part of an awaiter which schedulers see: the coroutine to
+ * resume and a link for the ready queue.
+ */
+struct awaiter_base {
+  std::coroutine_handle<> coro;
+  awaiter_base *next = nullptr;
+};
+
+/* Decides where coroutines waiting for commands are resumed.  post
+ * is called from the completion callback, with the lock on the
+ * handle held, and must only queue the awaiter; the coroutine must
+ * be resumed later (from the same thread, unless the scheduler does
+ * its own locking) by calling resume on it.
+ */
+class scheduler {
+public:
+  virtual ~scheduler () = default;
+  virtual void post (awaiter_base *a) noexcept = 0;
+
+  static void resume (awaiter_base *a) { a->coro.resume (); }
+};
+#endif
+
+/* A move-only owner of a struct nbd_handle.  Calls which fail throw
+ * nbd::error.  Use get() to call any part of the C API which is not
+ * wrapped here.
+ */
+class handle {
+public:
+  handle () : h_ (nbd_create ())
+  {
+    if (h_ == nullptr)
+      throw error::last ();
+  }
+
+  /* Take ownership of a handle from the C API. */
+  explicit handle (struct nbd_handle *h) noexcept : h_ (h) { }
+
+  handle (handle &&o) noexcept : h_ (std::exchange (o.h_, nullptr))
+#ifdef LIBNBD_HPP_COROUTINES
+    , sched_ (std::exchange (o.sched_, nullptr))
+#endif
+  { }
+
+  handle &operator= (handle &&o) noexcept
+  {
+    if (this != &o) {
+      if (h_)
+        nbd_close (h_);
+      h_ = std::exchange (o.h_, nullptr);
+#ifdef LIBNBD_HPP_COROUTINES
+      sched_ = std::exchange (o.sched_, nullptr);
+#endif
+    }
+    return *this;
+  }
+
+  handle (const handle &) = delete;
+  handle &operator= (const handle &) = delete;
+
+  ~handle ()
+  {
+    if (h_)
+      nbd_close (h_);
+  }
+
+  struct nbd_handle *get () const noexcept { return h_; }
+  struct nbd_handle *release () noexcept { return std::exchange (h_, nullptr); }
+  explicit operator bool () const noexcept { return h_ != nullptr; }
+
+  /* Connecting. */
+  void set_export_name (const std::string &name)
+  {
+    detail::check (nbd_set_export_name (h_, name.c_str ()));
+  }
+  void add_meta_context (const std::string &name)
+  {
+    detail::check (nbd_add_meta_context (h_, name.c_str ()));
+  }
+  void connect_uri (const std::string &uri)
+  {
+    detail::check (nbd_connect_uri (h_, uri.c_str ()));
+  }
+  void connect_unix (const std::string &path)
+  {
+    detail::check (nbd_connect_unix (h_, path.c_str ()));
+  }
+  void connect_tcp (const std::string &hostname, const std::string &port)
+  {
+    detail::check (nbd_connect_tcp (h_, hostname.c_str (), port.c_str ()));
+  }
+  void connect_command (const std::vector<std::string> &argv)
+  {
+    std::vector<char *> args;
+
+    args.reserve (argv.size () + 1);
+    for (const auto &arg : argv)
+      args.push_back (const_cast<char *> (arg.c_str ()));
+    args.push_back (nullptr);
+    detail::check (nbd_connect_command (h_, args.data ()));
+  }
+  void shutdown (uint32_t flags = 0)
+  {
+    detail::check (nbd_shutdown (h_, flags));
+  }
+
+  /* The export. */
+  uint64_t get_size () const { return detail::check (nbd_get_size (h_)); }
+  bool can_flush () const { return detail::check (nbd_can_flush (h_)); }
+  bool can_fua () const { return detail::check (nbd_can_fua (h_)); }
+  bool can_trim () const { return detail::check (nbd_can_trim (h_)); }
+  bool can_zero () const { return detail::check (nbd_can_zero (h_)); }
+  bool can_cache () const { return detail::check (nbd_can_cache (h_)); }
+  bool can_multi_conn () const
+  {
+    return detail::check (nbd_can_multi_conn (h_));
+  }
+  bool is_read_only () const
+  {
+    return detail::check (nbd_is_read_only (h_));
+  }
+
+  /* Synchronous commands. */
+  void pread (void *buf, size_t count, uint64_t offset, uint32_t flags = 0)
+  {
+    detail::check (nbd_pread (h_, buf, count, offset, flags));
+  }
+  void pwrite (const void *buf, size_t count, uint64_t offset,
+               uint32_t flags = 0)
+  {
+    detail::check (nbd_pwrite (h_, buf, count, offset, flags));
+  }
+  void flush (uint32_t flags = 0)
+  {
+    detail::check (nbd_flush (h_, flags));
+  }
+  void trim (uint64_t count, uint64_t offset, uint32_t flags = 0)
+  {
+    detail::check (nbd_trim (h_, count, offset, flags));
+  }
+  void zero (uint64_t count, uint64_t offset, uint32_t flags = 0)
+  {
+    detail::check (nbd_zero (h_, count, offset, flags));
+  }
+  void cache (uint64_t count, uint64_t offset, uint32_t flags = 0)
+  {
+    detail::check (nbd_cache (h_, count, offset, flags));
+  }
+
+#ifdef LIBNBD_HPP_SPAN
+  template <class T, size_t N>
+  void pread (std::span<T, N> buf, uint64_t offset, uint32_t flags = 0)
+  {
+    pread (buf.data (), buf.size_bytes (), offset, flags);
+  }
+  template <class T, size_t N>
+  void pwrite (std::span<T, N> buf, uint64_t offset, uint32_t flags = 0)
+  {
+    pwrite (buf.data (), buf.size_bytes (), offset, flags);
+  }
+#endif
+
+  /* Asynchronous commands, returning the cookie.  c must outlive the
+   * command, see class completion.
+   */
+  template <class F>
+  int64_t aio_pread (void *buf, size_t count, uint64_t offset,
+                     completion<F> &c, uint32_t flags = 0)
+  {
+    return detail::check (nbd_aio_pread (h_, buf, count, offset,
+                                         c.callback (), flags));
+  }
+  template <class F>
+  int64_t aio_pwrite (const void *buf, size_t count, uint64_t offset,
+                      completion<F> &c, uint32_t flags = 0)
+  {
+    return detail::check (nbd_aio_pwrite (h_, buf, count, offset,
+                                          c.callback (), flags));
+  }
+  template <class F>
+  int64_t aio_flush (completion<F> &c, uint32_t flags = 0)
+  {
+    return detail::check (nbd_aio_flush (h_, c.callback (), flags));
+  }
+  template <class F>
+  int64_t aio_trim (uint64_t count, uint64_t offset,
+                    completion<F> &c, uint32_t flags = 0)
+  {
+    return detail::check (nbd_aio_trim (h_, count, offset,
+                                        c.callback (), flags));
+  }
+  template <class F>
+  int64_t aio_zero (uint64_t count, uint64_t offset,
+                    completion<F> &c, uint32_t flags = 0)
+  {
+    return detail::check (nbd_aio_zero (h_, count, offset,
+                                        c.callback (), flags));
+  }
+
+#ifdef LIBNBD_HPP_SPAN
+  template <class T, size_t N, class F>
+  int64_t aio_pread (std::span<T, N> buf, uint64_t offset,
+                     completion<F> &c, uint32_t flags = 0)
+  {
+    return aio_pread (buf.data (), buf.size_bytes (), offset, c, flags);
+  }
+  template <class T, size_t N, class F>
+  int64_t aio_pwrite (std::span<T, N> buf, uint64_t offset,
+                      completion<F> &c, uint32_t flags = 0)
+  {
+    return aio_pwrite (buf.data (), buf.size_bytes (), offset, c, flags);
+  }
+#endif
+
+  /* Driving the handle without a reactor. */
+  int aio_in_flight () const
+  {
+    return detail::check (nbd_aio_in_flight (h_));
+  }
+  int poll (int timeout)
+  {
+    return detail::check (nbd_poll (h_, timeout));
+  }
+
+#ifdef LIBNBD_HPP_COROUTINES
+  /* Awaiting commands.  The coroutine is resumed through the
+   * scheduler of the handle (see class reactor), and co_await throws
+   * nbd::error if the command fails.
+   */
+  class awaiter : private awaiter_base {
+  public:
+    bool await_ready () const noexcept { return false; }
+
+    bool await_suspend (std::coroutine_handle<> coro)
+    {
+      nbd_completion_callback cb;
+      int64_t r = -1;
+
+      this->coro = coro;
+      cb.callback = complete;
+      cb.user_data = this;
+      cb.free = nullptr;
+      if (h_.sched_ == nullptr) {
+        errnum_ = EINVAL;
+        msg_ = "nbd::handle: awaiting a command needs a scheduler";
+        return false;
+      }
+      switch (op_) {
+      case READ:
+        r = nbd_aio_pread (h_.h_, buf_, count_, offset_, cb, flags_);
+        break;
+      case WRITE:
+        r = nbd_aio_pwrite (h_.h_, buf_, count_, offset_, cb, flags_);
+        break;
+      case FLUSH:
+        r = nbd_aio_flush (h_.h_, cb, flags_);
+        break;
+      case TRIM:
+        r = nbd_aio_trim (h_.h_, count_, offset_, cb, flags_);
+        break;
+      case ZERO:
+        r = nbd_aio_zero (h_.h_, count_, offset_, cb, flags_);
+        break;
+      }
+      if (r == -1) {
+        errnum_ = nbd_get_errno ();
+        msg_ = nbd_get_error ();
+        return false;
+      }
+      return true;
+    }
+
+    void await_resume () const
+    {
+      if (msg_)
+        throw error (msg_, errnum_);
+      if (errnum_)
+        throw error::from_errno (errnum_);
+    }
+
+  private:
+    friend class handle;
+    enum op { READ, WRITE, FLUSH, TRIM, ZERO };
+
+    awaiter (handle &h, op o, void *buf, uint64_t count, uint64_t offset,
+             uint32_t flags) noexcept
+      : h_ (h), op_ (o), buf_ (buf), count_ (count), offset_ (offset),
+        flags_ (flags) { }
+
+    static int complete (void *vp, int *error)
+    {
+      awaiter *a = static_cast<awaiter *> (vp);
+
+      a->errnum_ = *error;
+      a->h_.sched_->post (a);
+      return 1;
+    }
+
+    handle &h_;
+    op op_;
+    void *buf_;
+    uint64_t count_, offset_;
+    uint32_t flags_;
+    int errnum_ = 0;
+    const char *msg_ = nullptr;
+  };
+
+  void set_scheduler (scheduler *s) noexcept { sched_ = s; }
+  scheduler *get_scheduler () const noexcept { return sched_; }
+
+  awaiter async_pread (void *buf, size_t count, uint64_t offset,
+                       uint32_t flags = 0) noexcept
+  {
+    return awaiter (*this, awaiter::READ, buf, count, offset, flags);
+  }
+  awaiter async_pwrite (const void *buf, size_t count, uint64_t offset,
+                        uint32_t flags = 0) noexcept
+  {
+    return awaiter (*this, awaiter::WRITE, const_cast<void *> (buf),
+                    count, offset, flags);
+  }
+  awaiter async_flush (uint32_t flags = 0) noexcept
+  {
+    return awaiter (*this, awaiter::FLUSH, nullptr, 0, 0, flags);
+  }
+  awaiter async_trim (uint64_t count, uint64_t offset,
+                      uint32_t flags = 0) noexcept
+  {
+    return awaiter (*this, awaiter::TRIM, nullptr, count, offset, flags);
+  }
+  awaiter async_zero (uint64_t count, uint64_t offset,
+                      uint32_t flags = 0) noexcept
+  {
+    return awaiter (*this, awaiter::ZERO, nullptr, count, offset, flags);
+  }
+
+#ifdef LIBNBD_HPP_SPAN
+  template <class T, size_t N>
+  awaiter async_pread (std::span<T, N> buf, uint64_t offset,
+                       uint32_t flags = 0) noexcept
+  {
+    return async_pread (buf.data (), buf.size_bytes (), offset, flags);
+  }
+  template <class T, size_t N>
+  awaiter async_pwrite (std::span<T, N> buf, uint64_t offset,
+                        uint32_t flags = 0) noexcept
+  {
+    return async_pwrite (buf.data (), buf.size_bytes (), offset, flags);
+  }
+#endif
+#endif /* LIBNBD_HPP_COROUTINES */
+
+private:
+  struct nbd_handle *h_;
+#ifdef LIBNBD_HPP_COROUTINES
+  scheduler *sched_ = nullptr;
+#endif
+};
+
+#ifdef LIBNBD_HPP_COROUTINES
+/* A move-only owner of a struct nbd_reactor (see
+ * nbd_reactor_create(3)), which is also the scheduler of the
+ * handles added to it.  poll waits for the handles and then resumes
+ * the coroutines whose commands completed.  It is meant to be driven
+ * from one thread.
+ */
+class reactor : public scheduler {
+public:
+  reactor () : r_ (nbd_reactor_create ())
+  {
+    if (r_ == nullptr)
+      throw error::last ();
+  }
+  reactor (const reactor &) = delete;
+  reactor &operator= (const reactor &) = delete;
+
+  ~reactor ()
+  {
+    nbd_reactor_close (r_);
+  }
+
+  struct nbd_reactor *get () const noexcept { return r_; }
+
+  void add (handle &h)
+  {
+    detail::check (nbd_reactor_add (r_, h.get ()));
+    h.set_scheduler (this);
+  }
+  void remove (handle &h)
+  {
+    detail::check (nbd_reactor_remove (r_, h.get ()));
+    if (h.get_scheduler () == this)
+      h.set_scheduler (nullptr);
+  }
+
+  /* Wait as nbd_reactor_poll(3) does, then resume every coroutine
+   * whose command has completed, including ones completed by the
+   * coroutines being resumed.
+   */
+  int poll (int timeout)
+  {
+    int r = 0;
+
+    if (head_ == nullptr)
+      r = detail::check (nbd_reactor_poll (r_, timeout));
+    run_ready ();
+    return r;
+  }
+
+  void post (awaiter_base *a) noexcept override
+  {
+    a->next = nullptr;
+    if (tail_)
+      tail_->next = a;
+    else
+      head_ = a;
+    tail_ = a;
+  }
+
+private:
+  void run_ready ()
+  {
+    while (head_) {
+      awaiter_base *a = head_;
+
+      head_ = a->next;
+      if (head_ == nullptr)
+        tail_ = nullptr;
+      resume (a);
+    }
+  }
+
+  struct nbd_reactor *r_;
+  awaiter_base *head_ = nullptr, *tail_ = nullptr;
+};
+
+/* The return type of a coroutine which is started and runs on its
+ * own, like a thread.  An exception escaping from it terminates the
+ * program.
+ */
+struct detached {
+  struct promise_type {
+    detached get_return_object () noexcept { return {}; }
+    std::suspend_never initial_suspend () noexcept { return {}; }
+    std::suspend_never final_suspend () noexcept { return {}; }
+    void return_void () noexcept { }
+    void unhandled_exception () noexcept { std::terminate (); }
+  };
+};
+#endif /* LIBNBD_HPP_COROUTINES */
+
+} /* namespace nbd */
+
+#endif /* LIBNBD_HPP */
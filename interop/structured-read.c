@@ -16,7 +16,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-/* Test structured reply read callback. */
+/* Test structured reply read callback, and nbd_pread_sparse. */
 
 #include <config.h>
 
@@ -100,12 +100,49 @@ read_cb (void *opaque,
   return 0;
 }
 
+struct sparse_data {
+  bool df;         /* input: true if DF flag was passed to request */
+  bool fail;       /* input: true to return failure */
+  int calls;       /* output: number of calls */
+};
+
+static int
+sparse_cb (void *opaque, const char *metacontext, uint64_t offset,
+           uint32_t *entries, size_t nr_entries, int *error)
+{
+  struct sparse_data *data = opaque;
+
+  assert (!*error);
+  assert (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) == 0);
+  assert (offset == 2048);
+  data->calls++;
+
+  if (data->df) {
+    /* The server had to send everything as data. */
+    assert (nr_entries == 2);
+    assert (entries[0] == 1024 && entries[1] == 0);
+  }
+  else {
+    assert (nr_entries == 4);
+    assert (entries[0] == 512 &&
+            entries[1] == (LIBNBD_STATE_HOLE | LIBNBD_STATE_ZERO));
+    assert (entries[2] == 512 && entries[3] == 0);
+  }
+
+  if (data->fail) {
+    *error = EPROTO;
+    return -1;
+  }
+  return 0;
+}
+
 int
 main (int argc, char *argv[])
 {
   struct nbd_handle *nbd;
   int64_t exportsize;
   struct data data;
+  struct sparse_data sparse;
   char c;
 
   if (argc < 2) {
@@ -175,6 +212,42 @@ main (int argc, char *argv[])
   assert (nbd_get_errno () == EPROTO && nbd_aio_is_ready (nbd));
   assert (data.seen_data && data.seen_hole);
 
+  /* A sparse read leaves the hole in the buffer untouched. */
+  memset (rbuf, 2, sizeof rbuf);
+  sparse = (struct sparse_data) { .calls = 0 };
+  if (nbd_pread_sparse (nbd, rbuf, sizeof rbuf, 2048,
+                        (nbd_extent_callback) { .callback = sparse_cb, .user_data = &sparse },
+                        0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  assert (sparse.calls == 1);
+  assert (rbuf[0] == 2 && memcmp (rbuf, rbuf + 1, 511) == 0);
+  assert (rbuf[512] == 1 && memcmp (rbuf + 512, rbuf + 513, 511) == 0);
+
+  /* Repeat with DF flag. */
+  memset (rbuf, 2, sizeof rbuf);
+  sparse = (struct sparse_data) { .df = true, };
+  if (nbd_pread_sparse (nbd, rbuf, sizeof rbuf, 2048,
+                        (nbd_extent_callback) { .callback = sparse_cb, .user_data = &sparse },
+                        LIBNBD_CMD_FLAG_DF) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  assert (sparse.calls == 1);
+  assert (rbuf[0] == 0 && memcmp (rbuf, rbuf + 1, 511) == 0);
+
+  /* A failed callback fails the read. */
+  sparse = (struct sparse_data) { .fail = true, };
+  if (nbd_pread_sparse (nbd, rbuf, sizeof rbuf, 2048,
+                        (nbd_extent_callback) { .callback = sparse_cb, .user_data = &sparse },
+                        0) != -1) {
+    fprintf (stderr, "unexpected pread_sparse callback success\n");
+    exit (EXIT_FAILURE);
+  }
+  assert (nbd_get_errno () == EPROTO && nbd_aio_is_ready (nbd));
+  assert (sparse.calls == 1);
+
   if (nbd_pread (nbd, &c, 1, 0, 0) == -1) {
     fprintf (stderr, "%s\n", nbd_get_error ());
     exit (EXIT_FAILURE);
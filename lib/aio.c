@@ -23,22 +23,132 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "internal.h"
 
-/* Internal function which retires and frees a command. */
+/* Internal function which allocates a zeroed command, taking it from
+ * the handle's pool of retired commands if one is available.  On
+ * failure this returns NULL with errno set, but does not set the
+ * error, since coalesce_writes carries on without the command.
+ */
+struct command *
+nbd_internal_alloc_command (struct nbd_handle *h)
+{
+  struct command *cmd;
+
+  cmd = h->cmds_free;
+  if (cmd != NULL) {
+    h->cmds_free = cmd->next;
+    h->nr_cmds_free--;
+    assert (h->nr_cmds_free >= 0);
+    memset (cmd, 0, sizeof *cmd);
+    return cmd;
+  }
+
+  return calloc (1, sizeof *cmd);
+}
+
+/* Internal function which returns a command to the pool if there is
+ * room, otherwise frees it.  Anything the command points to must
+ * already have been freed.
+ */
 void
-nbd_internal_retire_and_free_command (struct command *cmd)
+nbd_internal_free_command (struct nbd_handle *h, struct command *cmd)
 {
+  if (h->nr_cmds_free < h->command_pool_size) {
+    cmd->next = h->cmds_free;
+    h->cmds_free = cmd;
+    h->nr_cmds_free++;
+  }
+  else
+    free (cmd);
+}
+
+/* Internal function which retires and frees a command.  The command
+ * structure is returned to the pool if there is room, otherwise it is
+ * freed.
+ */
+void
+nbd_internal_retire_and_free_command (struct nbd_handle *h,
+                                      struct command *cmd)
+{
+  if (cmd->parent == NULL)
+    command_event (h, cmd, LIBNBD_COMMAND_EVENT_RETIRED);
+
   /* Free the callbacks. */
   if (cmd->type == NBD_CMD_BLOCK_STATUS)
     FREE_CALLBACK (cmd->cb.fn.extent);
   if (cmd->type == NBD_CMD_READ)
     FREE_CALLBACK (cmd->cb.fn.chunk);
   FREE_CALLBACK (cmd->cb.completion);
+  FREE_CALLBACK (cmd->cb.sparse);
+  FREE_CALLBACK (cmd->cb.lend);
+  if (cmd->lent)
+    nbd_internal_lend_put (h, cmd);
+  free (cmd->iov);
+  free (cmd->holes);
+  free (cmd->seen);
 
-  free (cmd);
+  nbd_internal_cookie_table_remove (h, cmd);
+  nbd_internal_free_command (h, cmd);
+}
+
+/* Internal function which frees every command in the pool. */
+void
+nbd_internal_free_command_pool (struct nbd_handle *h)
+{
+  struct command *cmd, *cmd_next;
+
+  for (cmd = h->cmds_free; cmd != NULL; cmd = cmd_next) {
+    cmd_next = cmd->next;
+    free (cmd);
+  }
+  h->cmds_free = NULL;
+  h->nr_cmds_free = 0;
+}
+
+int
+nbd_unlocked_set_command_pool_size (struct nbd_handle *h, int size)
+{
+  struct command *cmd;
+
+  if (size < 0) {
+    set_error (EINVAL, "invalid command pool size: %d", size);
+    return -1;
+  }
+
+  h->command_pool_size = size;
+
+  /* Shrink the pool if it is now larger than requested. */
+  while (h->nr_cmds_free > size) {
+    cmd = h->cmds_free;
+    h->cmds_free = cmd->next;
+    h->nr_cmds_free--;
+    free (cmd);
+  }
+
+  /* Preallocate commands up to the requested size. */
+  while (h->nr_cmds_free < size) {
+    cmd = calloc (1, sizeof *cmd);
+    if (cmd == NULL) {
+      set_error (errno, "calloc");
+      return -1;
+    }
+    cmd->next = h->cmds_free;
+    h->cmds_free = cmd;
+    h->nr_cmds_free++;
+  }
+
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_command_pool_size (struct nbd_handle *h)
+{
+  return h->command_pool_size;
 }
 
 int
@@ -54,6 +164,7 @@ nbd_unlocked_aio_get_fd (struct nbd_handle *h)
 int
 nbd_unlocked_aio_notify_read (struct nbd_handle *h)
 {
+  h->recv_drained = false;
   return nbd_internal_run (h, notify_read);
 }
 
@@ -63,49 +174,93 @@ nbd_unlocked_aio_notify_write (struct nbd_handle *h)
   return nbd_internal_run (h, notify_write);
 }
 
-int
-nbd_unlocked_aio_command_completed (struct nbd_handle *h,
-                                    int64_t cookie)
+/* Unlink a command from the cmds_done list, retire it, and return
+ * the errno value which should be reported to the caller (0 means
+ * the command was successful).
+ */
+static uint32_t
+retire_done_command (struct nbd_handle *h, struct command *cmd)
 {
-  struct command *prev_cmd, *cmd;
-  uint16_t type;
   uint32_t error;
 
-  if (cookie < 1) {
-    set_error (EINVAL, "invalid aio cookie %" PRId64, cookie);
-    return -1;
-  }
-
-  /* Find the command amongst the completed commands. */
-  for (cmd = h->cmds_done, prev_cmd = NULL;
-       cmd != NULL;
-       prev_cmd = cmd, cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
-  if (!cmd)
-    return 0;
-
-  type = cmd->type;
-  error = cmd->error;
+  assert (cmd->list == CMDS_DONE);
   assert (cmd->type != NBD_CMD_DISC);
+  error = cmd->error;
   /* The spec states that a 0-length read request is unspecified; but
    * it is easy enough to treat it as successful as an extension.
    */
-  if (type == NBD_CMD_READ && !cmd->data_seen && cmd->count && !error)
+  if (cmd->type == NBD_CMD_READ && !cmd->data_seen && cmd->count && !error)
     error = EIO;
 
   /* Retire it from the list and free it. */
   if (h->cmds_done_tail == cmd) {
     assert (cmd->next == NULL);
-    h->cmds_done_tail = prev_cmd;
+    h->cmds_done_tail = cmd->prev;
   }
-  if (prev_cmd != NULL)
-    prev_cmd->next = cmd->next;
+  else
+    cmd->next->prev = cmd->prev;
+  if (cmd->prev != NULL)
+    cmd->prev->next = cmd->next;
   else
     h->cmds_done = cmd->next;
 
-  nbd_internal_retire_and_free_command (cmd);
+  nbd_internal_retire_and_free_command (h, cmd);
+  return error;
+}
+
+int
+nbd_unlocked_aio_begin_batch (struct nbd_handle *h)
+{
+  if (h->batching) {
+    set_error (EINVAL, "a batch has already been started");
+    return -1;
+  }
+
+  h->batching = true;
+  return 0;
+}
+
+int
+nbd_unlocked_aio_end_batch (struct nbd_handle *h)
+{
+  if (!h->batching) {
+    set_error (EINVAL, "no batch has been started");
+    return -1;
+  }
+
+  h->batching = false;
+
+  /* Send all the queued commands in one pass through the state
+   * machine.  As for single commands, the commands remain queued
+   * even if this fails, and the caller will learn that the handle is
+   * dead from subsequent calls.
+   */
+  if (h->cmds_to_issue != NULL &&
+      nbd_internal_is_state_ready (get_next_state (h)))
+    return nbd_internal_run (h, cmd_issue);
+  return 0;
+}
+
+int
+nbd_unlocked_aio_command_completed (struct nbd_handle *h,
+                                    int64_t cookie)
+{
+  struct command *cmd;
+  uint16_t type;
+  uint32_t error;
+
+  if (cookie < 1) {
+    set_error (EINVAL, "invalid aio cookie %" PRId64, cookie);
+    return -1;
+  }
+
+  /* Find the command amongst the completed commands. */
+  cmd = nbd_internal_cookie_table_lookup (h, cookie);
+  if (!cmd || cmd->list != CMDS_DONE)
+    return 0;
+
+  type = cmd->type;
+  error = retire_done_command (h, cmd);
 
   /* If the command was successful, return true. */
   if (error == 0)
@@ -117,15 +272,135 @@ nbd_unlocked_aio_command_completed (struct nbd_handle *h,
   return -1;
 }
 
+/* Return the number of commands at the head of cmds_to_issue which
+ * the state machine has started to send.
+ */
+int
+nbd_internal_nr_commands_being_sent (struct nbd_handle *h)
+{
+  if (h->wlen == 0)
+    return 0;
+  return h->wcmds ? h->wcmds - h->wcmds_sent : 1;
+}
+
+int
+nbd_unlocked_aio_cancel (struct nbd_handle *h, int64_t cookie)
+{
+  struct command *cmd, *c, **cp, *prev, *cancelled, **tail;
+  uint32_t found = 0;
+  int i, n;
+
+  cmd = cookie >= 1 ? nbd_internal_cookie_table_lookup (h, cookie) : NULL;
+  if (!cmd || cmd->parent || cmd->type == NBD_CMD_DISC) {
+    set_error (EINVAL, "invalid aio cookie %" PRId64, cookie);
+    return -1;
+  }
+
+  /* The command, or all the pieces of a split request, must still be
+   * waiting on cmds_to_issue behind anything being sent.
+   */
+  n = nbd_internal_nr_commands_being_sent (h);
+  for (c = h->cmds_to_issue, i = 0; c != NULL; c = c->next, ++i) {
+    if (c == cmd || c->parent == cmd) {
+      if (i < n)
+        break;
+      found++;
+    }
+  }
+  if (c != NULL || found != (cmd->list == CMDS_SPLIT ? cmd->pieces : 1)) {
+    set_error (EBUSY, "command has already been sent to the server");
+    return -1;
+  }
+
+  /* Unlink them all before completing any, since completing the last
+   * piece of a split request may free the parent.
+   */
+  cancelled = NULL;
+  tail = &cancelled;
+  for (cp = &h->cmds_to_issue, prev = NULL; (c = *cp) != NULL; ) {
+    if (c == cmd || c->parent == cmd) {
+      *cp = c->next;
+      if (h->cmds_to_issue_tail == c)
+        h->cmds_to_issue_tail = prev;
+      *tail = c;
+      tail = &c->next;
+    }
+    else {
+      prev = c;
+      cp = &c->next;
+    }
+  }
+  *tail = NULL;
+
+  debug (h, "cancelled command with cookie %" PRId64, cookie);
+  for (c = cancelled; c != NULL; c = cancelled) {
+    cancelled = c->next;
+    nbd_internal_cancel_command (h, c);
+  }
+
+  /* Commands held for a cancelled write-behind write may now be
+   * sent, see nbd_set_write_behind.
+   */
+  if (h->wb_held != NULL) {
+    nbd_internal_write_behind_release (h);
+    if (h->cmds_to_issue != NULL && !h->batching &&
+        nbd_internal_is_state_ready (get_next_state (h)) &&
+        nbd_internal_run (h, cmd_issue) == -1)
+      debug (h, "command queued, ignoring state machine failure");
+  }
+
+  /* Threads waiting in nbd_unlocked_poll for the command. */
+  if (h->pollers)
+    nbd_internal_wake_pollers (h);
+  return 0;
+}
+
+/* Retire up to max completed commands in completion order while
+ * holding the handle lock once, reporting each one through the
+ * completed callback.  The closure is only used for the duration of
+ * this call.
+ */
+int
+nbd_unlocked_aio_get_completions (struct nbd_handle *h, unsigned max,
+                                  nbd_completed_callback completed)
+{
+  struct command *cmd, *next;
+  int64_t cookie;
+  uint32_t error;
+  unsigned n = 0;
+
+  if (max > INT_MAX)
+    max = INT_MAX;
+
+  for (cmd = h->cmds_done; n < max && cmd != NULL; cmd = next) {
+    next = cmd->next;
+    /* Leave commands for the synchronous calls waiting for them. */
+    if (cmd->waited_for)
+      continue;
+    cookie = cmd->cookie;
+    error = retire_done_command (h, cmd);
+    n++;
+    CALL_CALLBACK (completed, cookie, error);
+  }
+
+  FREE_CALLBACK (completed);
+  return (int) n;
+}
+
 int64_t
 nbd_unlocked_aio_peek_command_completed (struct nbd_handle *h)
 {
-  if (h->cmds_done != NULL) {
-    assert (h->cmds_done->type != NBD_CMD_DISC);
-    return h->cmds_done->cookie;
+  struct command *cmd;
+
+  for (cmd = h->cmds_done; cmd != NULL; cmd = cmd->next) {
+    assert (cmd->type != NBD_CMD_DISC);
+    if (!cmd->waited_for)
+      return cmd->cookie;
   }
 
-  if (h->cmds_in_flight != NULL || h->cmds_to_issue != NULL) {
+  if (h->cmds_done != NULL ||
+      h->cmds_in_flight != NULL || h->cmds_to_issue != NULL ||
+      h->cmds_zerocopy != NULL) {
     set_error (0, "no in-flight command has completed yet");
     return 0;
   }
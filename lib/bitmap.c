@@ -0,0 +1,301 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Sets of byte ranges of an export, see nbd_bitmap_create(3).
+ *
+ * A bitmap is stored as a sorted array of the runs of set bytes.
+ * Runs never overlap or touch, since neighbouring runs are always
+ * merged, so the size depends only on how fragmented the set is and
+ * not on the size of the export or the granularity of the server's
+ * extents.  Block status replies arrive in order of offset, so the
+ * common case of adding a range is appending to or extending the last
+ * run.  Union and intersection merge the two arrays in one pass.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+
+struct nbd_bitmap *
+nbd_bitmap_create (void)
+{
+  struct nbd_bitmap *b;
+
+  nbd_internal_set_error_context ("nbd_bitmap_create");
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  return b;
+}
+
+void
+nbd_bitmap_close (struct nbd_bitmap *b)
+{
+  if (b == NULL)
+    return;
+
+  free (b->runs);
+  free (b);
+}
+
+/* Make room for at least n runs. */
+static int
+reserve (struct bitmap_run **runs, size_t *alloc, size_t n)
+{
+  struct bitmap_run *p;
+  size_t new_alloc;
+
+  if (n <= *alloc)
+    return 0;
+  new_alloc = *alloc == 0 ? 16 : *alloc;
+  while (new_alloc < n)
+    new_alloc *= 2;
+  p = realloc (*runs, new_alloc * sizeof p[0]);
+  if (p == NULL) {
+    set_error (errno, "realloc");
+    return -1;
+  }
+  *runs = p;
+  *alloc = new_alloc;
+  return 0;
+}
+
+/* Set [start, end).  end > start. */
+static int
+add_run (struct nbd_bitmap *b, uint64_t start, uint64_t end)
+{
+  struct bitmap_run *last;
+  size_t lo, hi, mid, i, j;
+
+  /* Appending or extending the last run. */
+  if (b->nr_runs > 0) {
+    last = &b->runs[b->nr_runs - 1];
+    if (last->start <= start && start <= last->end) {
+      if (end > last->end)
+        last->end = end;
+      return 0;
+    }
+  }
+  if (b->nr_runs == 0 || b->runs[b->nr_runs - 1].end < start) {
+    if (reserve (&b->runs, &b->runs_alloc, b->nr_runs + 1) == -1)
+      return -1;
+    b->runs[b->nr_runs].start = start;
+    b->runs[b->nr_runs].end = end;
+    b->nr_runs++;
+    return 0;
+  }
+
+  /* i is the first run which ends at or after start, and j the first
+   * run which starts after end.  Runs i to j-1 touch the new range.
+   */
+  lo = 0;
+  hi = b->nr_runs;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (b->runs[mid].end < start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  i = lo;
+  hi = b->nr_runs;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (b->runs[mid].start <= end)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  j = lo;
+
+  if (i == j) {
+    if (reserve (&b->runs, &b->runs_alloc, b->nr_runs + 1) == -1)
+      return -1;
+    memmove (&b->runs[i + 1], &b->runs[i],
+             (b->nr_runs - i) * sizeof b->runs[0]);
+    b->runs[i].start = start;
+    b->runs[i].end = end;
+    b->nr_runs++;
+    return 0;
+  }
+
+  if (start < b->runs[i].start)
+    b->runs[i].start = start;
+  b->runs[i].end = end > b->runs[j - 1].end ? end : b->runs[j - 1].end;
+  memmove (&b->runs[i + 1], &b->runs[j],
+           (b->nr_runs - j) * sizeof b->runs[0]);
+  b->nr_runs -= j - i - 1;
+  return 0;
+}
+
+int
+nbd_bitmap_add_range (struct nbd_bitmap *b, uint64_t offset, uint64_t length)
+{
+  nbd_internal_set_error_context ("nbd_bitmap_add_range");
+
+  if (length > UINT64_MAX - offset) {
+    set_error (EINVAL, "range is beyond the largest offset");
+    return -1;
+  }
+  if (length == 0)
+    return 0;
+  return add_run (b, offset, offset + length);
+}
+
+int
+nbd_bitmap_add_extents (struct nbd_bitmap *b, uint64_t offset,
+                        const uint32_t *entries, size_t nr_entries,
+                        uint32_t mask, uint32_t value)
+{
+  size_t i;
+  uint64_t length;
+
+  nbd_internal_set_error_context ("nbd_bitmap_add_extents");
+
+  if (nr_entries % 2 != 0) {
+    set_error (EINVAL, "the number of entries must be even");
+    return -1;
+  }
+  for (i = 0; i < nr_entries; i += 2) {
+    length = entries[i];
+    if (length > UINT64_MAX - offset) {
+      set_error (EINVAL, "extent is beyond the largest offset");
+      return -1;
+    }
+    if (length > 0 && (entries[i + 1] & mask) == value &&
+        add_run (b, offset, offset + length) == -1)
+      return -1;
+    offset += length;
+  }
+  return 0;
+}
+
+/* Replace the runs of b with the union or intersection of b and
+ * other.
+ */
+static int
+combine (struct nbd_bitmap *b, const struct nbd_bitmap *other, bool unite)
+{
+  struct bitmap_run *runs = NULL, *r;
+  size_t alloc = 0, nr = 0, i = 0, j = 0;
+  uint64_t start, end;
+
+  if (reserve (&runs, &alloc, b->nr_runs + other->nr_runs + 1) == -1)
+    return -1;
+
+  while (i < b->nr_runs || j < other->nr_runs) {
+    if (unite) {
+      /* Take the run which starts first, merging it with the last. */
+      if (j == other->nr_runs ||
+          (i < b->nr_runs && b->runs[i].start <= other->runs[j].start))
+        r = &b->runs[i++];
+      else
+        r = (struct bitmap_run *) &other->runs[j++];
+      if (nr > 0 && runs[nr - 1].end >= r->start) {
+        if (r->end > runs[nr - 1].end)
+          runs[nr - 1].end = r->end;
+      }
+      else
+        runs[nr++] = *r;
+    }
+    else {
+      if (i == b->nr_runs || j == other->nr_runs)
+        break;
+      start = b->runs[i].start > other->runs[j].start ?
+        b->runs[i].start : other->runs[j].start;
+      end = b->runs[i].end < other->runs[j].end ?
+        b->runs[i].end : other->runs[j].end;
+      if (start < end)
+        runs[nr++] = (struct bitmap_run) { .start = start, .end = end };
+      /* Move past whichever run ends first. */
+      if (b->runs[i].end < other->runs[j].end)
+        i++;
+      else
+        j++;
+    }
+  }
+
+  free (b->runs);
+  b->runs = runs;
+  b->runs_alloc = alloc;
+  b->nr_runs = nr;
+  return 0;
+}
+
+int
+nbd_bitmap_union (struct nbd_bitmap *b, const struct nbd_bitmap *other)
+{
+  nbd_internal_set_error_context ("nbd_bitmap_union");
+  return combine (b, other, true);
+}
+
+int
+nbd_bitmap_intersect (struct nbd_bitmap *b, const struct nbd_bitmap *other)
+{
+  nbd_internal_set_error_context ("nbd_bitmap_intersect");
+  return combine (b, other, false);
+}
+
+int
+nbd_bitmap_next (const struct nbd_bitmap *b, uint64_t offset,
+                 uint64_t *start, uint64_t *length)
+{
+  size_t lo = 0, hi = b->nr_runs, mid;
+
+  /* Find the first run which ends after offset. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (b->runs[mid].end <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == b->nr_runs)
+    return 0;
+
+  *start = b->runs[lo].start > offset ? b->runs[lo].start : offset;
+  *length = b->runs[lo].end - *start;
+  return 1;
+}
+
+uint64_t
+nbd_bitmap_get_bytes (const struct nbd_bitmap *b)
+{
+  uint64_t bytes = 0;
+  size_t i;
+
+  for (i = 0; i < b->nr_runs; ++i)
+    bytes += b->runs[i].end - b->runs[i].start;
+  return bytes;
+}
+
+uint64_t
+nbd_bitmap_get_nr_runs (const struct nbd_bitmap *b)
+{
+  return b->nr_runs;
+}
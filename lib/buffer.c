@@ -0,0 +1,264 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Buffers for command payloads, see nbd_buffer_alloc.
+ *
+ * Each buffer is a private anonymous mapping of whole pages, so that
+ * madvise and mbind only ever affect the buffer itself.  Buffers with
+ * LIBNBD_BUFFER_HUGE_PAGES are aligned to BUFFER_HUGE_PAGE_SIZE by
+ * mapping a larger area and unmapping the ends.
+ *
+ * Buffers in use are found from their address in a hash table.  A
+ * freed buffer is kept in the pool (up to BUFFER_POOL_SIZE bytes and
+ * BUFFER_POOL_MAX buffers) and handed out again by a later call with
+ * the same rounded size, flags and node, which saves the system calls
+ * and the page faults of a new mapping.  One lock protects both.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "internal.h"
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+struct buffer {
+  struct buffer *next;          /* Hash chain, or pool list. */
+  void *addr;
+  size_t len;                   /* Length of the mapping. */
+  uint32_t flags;
+  int numa_node;
+};
+
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer *buffers[BUFFER_BUCKETS];
+static struct buffer *pool;
+static size_t pool_bytes, pool_nr;
+
+static size_t
+hash (const void *addr)
+{
+  uintptr_t a = (uintptr_t) addr >> 12;
+
+  return (a ^ (a >> 10) ^ (a >> 20)) % BUFFER_BUCKETS;
+}
+
+static size_t
+mapping_len (size_t size, uint32_t flags)
+{
+  size_t align;
+
+  if (flags & (LIBNBD_BUFFER_HUGE_PAGES|LIBNBD_BUFFER_HUGETLB))
+    align = BUFFER_HUGE_PAGE_SIZE;
+  else
+    align = sysconf (_SC_PAGESIZE);
+  if (size == 0)
+    size = 1;
+  if (size > SIZE_MAX - align)
+    return 0;
+  return (size + align - 1) & ~(align - 1);
+}
+
+/* Map len bytes with the alignment required by flags. */
+static void *
+map_buffer (size_t len, uint32_t flags)
+{
+  void *p;
+  char *start, *end;
+  uintptr_t a;
+
+  if (flags & LIBNBD_BUFFER_HUGETLB) {
+#ifdef MAP_HUGETLB
+    p = mmap (NULL, len, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      set_error (errno, "mmap: MAP_HUGETLB");
+      return NULL;
+    }
+    return p;
+#else
+    set_error (ENOTSUP, "explicit huge pages are not supported");
+    return NULL;
+#endif
+  }
+
+  if (!(flags & LIBNBD_BUFFER_HUGE_PAGES)) {
+    p = mmap (NULL, len, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      set_error (errno, "mmap");
+      return NULL;
+    }
+    return p;
+  }
+
+  /* Over-allocate so that an aligned area of len bytes fits, then
+   * trim both ends.
+   */
+  p = mmap (NULL, len + BUFFER_HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    set_error (errno, "mmap");
+    return NULL;
+  }
+  a = ((uintptr_t) p + BUFFER_HUGE_PAGE_SIZE - 1) &
+    ~(uintptr_t) (BUFFER_HUGE_PAGE_SIZE - 1);
+  start = (char *) a;
+  end = start + len;
+  if (start > (char *) p)
+    munmap (p, start - (char *) p);
+  if ((char *) p + len + BUFFER_HUGE_PAGE_SIZE > end)
+    munmap (end, (char *) p + len + BUFFER_HUGE_PAGE_SIZE - end);
+#ifdef MADV_HUGEPAGE
+  /* Only advice: the kernel may not have transparent huge pages. */
+  madvise (start, len, MADV_HUGEPAGE);
+#endif
+  return start;
+}
+
+static int
+bind_buffer (void *addr, size_t len, int numa_node)
+{
+#ifdef SYS_mbind
+  unsigned long mask[(BUFFER_MAX_NUMA_NODE + 1) / (8 * sizeof (long))];
+
+  memset (mask, 0, sizeof mask);
+  mask[numa_node / (8 * sizeof (long))] |=
+    1UL << (numa_node % (8 * sizeof (long)));
+  if (syscall (SYS_mbind, addr, len, MPOL_BIND, mask,
+               (unsigned long) BUFFER_MAX_NUMA_NODE + 1, 0) == -1) {
+    set_error (errno, "mbind: node %d", numa_node);
+    return -1;
+  }
+  return 0;
+#else
+  set_error (ENOTSUP, "binding memory to a NUMA node is not supported");
+  return -1;
+#endif
+}
+
+void *
+nbd_buffer_alloc (size_t size, int numa_node, uint32_t flags)
+{
+  struct buffer *b, **bp;
+  size_t len;
+  size_t i;
+
+  nbd_internal_set_error_context ("nbd_buffer_alloc");
+
+  if ((flags & ~(LIBNBD_BUFFER_HUGE_PAGES|LIBNBD_BUFFER_HUGETLB)) != 0) {
+    set_error (EINVAL, "invalid flags: %" PRIu32, flags);
+    return NULL;
+  }
+  if (numa_node < -1 || numa_node > BUFFER_MAX_NUMA_NODE) {
+    set_error (EINVAL, "invalid NUMA node: %d", numa_node);
+    return NULL;
+  }
+  len = mapping_len (size, flags);
+  if (len == 0) {
+    set_error (ENOMEM, "buffer size is too large");
+    return NULL;
+  }
+
+  pthread_mutex_lock (&buffers_lock);
+  for (bp = &pool; *bp != NULL; bp = &(*bp)->next) {
+    b = *bp;
+    if (b->len == len && b->flags == flags && b->numa_node == numa_node) {
+      *bp = b->next;
+      pool_bytes -= len;
+      pool_nr--;
+      goto found;
+    }
+  }
+  pthread_mutex_unlock (&buffers_lock);
+
+  b = malloc (sizeof *b);
+  if (b == NULL) {
+    set_error (errno, "malloc");
+    return NULL;
+  }
+  b->addr = map_buffer (len, flags);
+  if (b->addr == NULL) {
+    free (b);
+    return NULL;
+  }
+  b->len = len;
+  b->flags = flags;
+  b->numa_node = numa_node;
+  if (numa_node >= 0 && bind_buffer (b->addr, len, numa_node) == -1) {
+    munmap (b->addr, len);
+    free (b);
+    return NULL;
+  }
+
+  pthread_mutex_lock (&buffers_lock);
+ found:
+  i = hash (b->addr);
+  b->next = buffers[i];
+  buffers[i] = b;
+  pthread_mutex_unlock (&buffers_lock);
+  return b->addr;
+}
+
+void
+nbd_buffer_free (void *buf)
+{
+  struct buffer *b, **bp;
+
+  if (buf == NULL)
+    return;
+
+  pthread_mutex_lock (&buffers_lock);
+  for (bp = &buffers[hash (buf)]; *bp != NULL; bp = &(*bp)->next)
+    if ((*bp)->addr == buf)
+      break;
+  b = *bp;
+  if (b == NULL) {
+    /* Not from nbd_buffer_alloc, or freed twice. */
+    pthread_mutex_unlock (&buffers_lock);
+    return;
+  }
+  *bp = b->next;
+
+  if (pool_nr < BUFFER_POOL_MAX && pool_bytes + b->len <= BUFFER_POOL_SIZE) {
+    b->next = pool;
+    pool = b;
+    pool_bytes += b->len;
+    pool_nr++;
+    b = NULL;
+  }
+  pthread_mutex_unlock (&buffers_lock);
+
+  if (b != NULL) {
+    munmap (b->addr, b->len);
+    free (b);
+  }
+}
@@ -43,6 +43,12 @@ error_unless_ready (struct nbd_handle *h)
   if (nbd_internal_is_state_ready (get_next_state (h)))
     return 0;
 
+  /* In probe mode a successful handshake ends by closing the
+   * connection, see nbd_set_probe_only.
+   */
+  if (h->probe_only && nbd_internal_is_state_closed (get_next_state (h)))
+    return 0;
+
   /* Why did it fail? */
   if (nbd_internal_is_state_closed (get_next_state (h))) {
     set_error (0, "connection is closed");
@@ -64,14 +70,43 @@ error_unless_ready (struct nbd_handle *h)
 int
 nbd_internal_wait_until_connected (struct nbd_handle *h)
 {
+  int64_t deadline = nbd_internal_deadline (h);
+  int timeout;
+
   while (nbd_internal_is_state_connecting (get_next_state (h))) {
-    if (nbd_unlocked_poll (h, -1) == -1)
+    timeout = nbd_internal_time_left (deadline);
+    if (timeout == 0) {
+      set_error (ETIMEDOUT, "connection timed out");
+      nbd_internal_abort_connection (h);
+      return -1;
+    }
+    if (nbd_unlocked_poll (h, timeout) == -1)
       return -1;
   }
 
   return error_unless_ready (h);
 }
 
+/* Close the connections being raced and the timer used to start
+ * them, see CONNECT_TCP.RACE_START.  The epoll file descriptor in
+ * h->sock is closed with the socket.
+ */
+void
+nbd_internal_free_tcp_race (struct nbd_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_race_fds; ++i)
+    close (h->race_fds[i]);
+  free (h->race_fds);
+  h->race_fds = NULL;
+  h->nr_race_fds = 0;
+  if (h->race_timerfd >= 0) {
+    close (h->race_timerfd);
+    h->race_timerfd = -1;
+  }
+}
+
 /* Connect to a Unix domain socket. */
 int
 nbd_unlocked_connect_unix (struct nbd_handle *h, const char *unixsocket)
@@ -0,0 +1,150 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Table of commands indexed by cookie.
+ *
+ * Every command is added to this table when it is created and removed
+ * when it is retired, so that the reply path and
+ * nbd_aio_command_completed can find a command from its cookie
+ * without walking cmds_in_flight or cmds_done.
+ *
+ * The table uses open addressing with linear probing.  Because
+ * cookies are allocated sequentially from h->unique, the commands
+ * alive at any one time are mostly a dense range of cookies, so
+ * simply masking the cookie spreads them evenly across the table.
+ * The table is kept at most half full, and deletion shifts later
+ * entries back so that no tombstones are needed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "internal.h"
+
+#define INITIAL_COOKIE_TABLE_SIZE 64
+
+static inline size_t
+cookie_slot (uint64_t cookie, size_t size)
+{
+  return cookie & (size - 1);
+}
+
+static int
+grow_table (struct nbd_handle *h)
+{
+  size_t i, j, new_size;
+  struct command **new_table;
+
+  new_size = h->cookie_table_size ? h->cookie_table_size * 2
+    : INITIAL_COOKIE_TABLE_SIZE;
+  new_table = calloc (new_size, sizeof (struct command *));
+  if (new_table == NULL)
+    return -1;
+
+  for (i = 0; i < h->cookie_table_size; ++i) {
+    struct command *cmd = h->cookie_table[i];
+
+    if (cmd == NULL)
+      continue;
+    for (j = cookie_slot (cmd->cookie, new_size);
+         new_table[j] != NULL;
+         j = (j + 1) & (new_size - 1))
+      ;
+    new_table[j] = cmd;
+  }
+
+  free (h->cookie_table);
+  h->cookie_table = new_table;
+  h->cookie_table_size = new_size;
+  return 0;
+}
+
+/* Like nbd_internal_alloc_command, this returns -1 with errno set
+ * on failure but does not set the error.
+ */
+int
+nbd_internal_cookie_table_insert (struct nbd_handle *h, struct command *cmd)
+{
+  size_t i;
+
+  if ((h->cookie_table_used + 1) * 2 > h->cookie_table_size &&
+      grow_table (h) == -1)
+    return -1;
+
+  for (i = cookie_slot (cmd->cookie, h->cookie_table_size);
+       h->cookie_table[i] != NULL;
+       i = (i + 1) & (h->cookie_table_size - 1))
+    assert (h->cookie_table[i]->cookie != cmd->cookie);
+  h->cookie_table[i] = cmd;
+  h->cookie_table_used++;
+  return 0;
+}
+
+struct command *
+nbd_internal_cookie_table_lookup (struct nbd_handle *h, uint64_t cookie)
+{
+  size_t i;
+
+  if (h->cookie_table_size == 0)
+    return NULL;
+
+  for (i = cookie_slot (cookie, h->cookie_table_size);
+       h->cookie_table[i] != NULL;
+       i = (i + 1) & (h->cookie_table_size - 1)) {
+    if (h->cookie_table[i]->cookie == cookie)
+      return h->cookie_table[i];
+  }
+  return NULL;
+}
+
+void
+nbd_internal_cookie_table_remove (struct nbd_handle *h, struct command *cmd)
+{
+  const size_t mask = h->cookie_table_size - 1;
+  size_t i, j, k;
+
+  if (h->cookie_table_size == 0)
+    return;
+
+  for (i = cookie_slot (cmd->cookie, h->cookie_table_size);
+       h->cookie_table[i] != cmd;
+       i = (i + 1) & mask) {
+    if (h->cookie_table[i] == NULL)
+      return;                   /* Not in the table. */
+  }
+
+  /* Shift back any following entries whose home slot is at or
+   * before the hole, so that lookups never stop early.
+   */
+  for (j = (i + 1) & mask; h->cookie_table[j] != NULL; j = (j + 1) & mask) {
+    k = cookie_slot (h->cookie_table[j]->cookie, h->cookie_table_size);
+    if ((j > i && (k <= i || k > j)) ||
+        (j < i && (k <= i && k > j))) {
+      h->cookie_table[i] = h->cookie_table[j];
+      i = j;
+    }
+  }
+  h->cookie_table[i] = NULL;
+  h->cookie_table_used--;
+}
@@ -0,0 +1,985 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Copying between exports and local files, see nbd_copy_create(3).
+ * Like lib/group.c this is written only in terms of the public API.
+ *
+ * The copy is driven from a single thread.  The source is described
+ * as a queue of extents, each either data or known to read as zero,
+ * which is filled ahead of the copy with block status commands (or
+ * SEEK_DATA and SEEK_HOLE for a local file).  Each request slot takes
+ * the next piece from the queue: data is read into the slot's buffer
+ * and then written, zero extents are zeroed on the destination
+ * without transferring any data.  Local files are read and written
+ * synchronously, so a copy between two files uses no NBD commands.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+#define DEFAULT_REQUESTS 64
+#define DEFAULT_REQUEST_SIZE (256 * 1024)
+
+/* Largest zero request, and largest block status request. */
+#define MAX_ZERO_SIZE (32 * 1024 * 1024)
+#define MAX_BLOCK_STATUS_SIZE (UINT64_C (1) << 30)
+
+/* Report an error from nbd_copy_run.  The calls made on the handles
+ * while copying change the error context, so it is set again here.
+ */
+#define copy_error(errnum, fs, ...)                             \
+  do {                                                          \
+    int errnum_ = (errnum);                                     \
+    nbd_internal_set_error_context ("nbd_copy_run");            \
+    set_error (errnum_, fs, ##__VA_ARGS__);                     \
+  } while (0)
+
+struct nbd_copy *
+nbd_copy_create (void)
+{
+  struct nbd_copy *c;
+
+  nbd_internal_set_error_context ("nbd_copy_create");
+
+  c = calloc (1, sizeof *c);
+  if (c == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  c->src_fd = c->dst_fd = -1;
+  c->requests = DEFAULT_REQUESTS;
+  c->request_size = DEFAULT_REQUEST_SIZE;
+  return c;
+}
+
+static void
+free_buffers (struct nbd_copy *c)
+{
+  unsigned i;
+
+  if (c->reqs) {
+    for (i = 0; i < c->requests; ++i)
+      free (c->reqs[i].buf);
+  }
+  free (c->reqs);
+  c->reqs = NULL;
+  free (c->zero_buf);
+  c->zero_buf = NULL;
+  free (c->extents);
+  c->extents = NULL;
+  c->nr_extents = c->extents_alloc = c->first_extent = 0;
+  free (c->fds);
+  c->fds = NULL;
+  free (c->fd_handles);
+  c->fd_handles = NULL;
+}
+
+void
+nbd_copy_close (struct nbd_copy *c)
+{
+  if (c == NULL)
+    return;
+
+  free_buffers (c);
+  free (c);
+}
+
+int
+nbd_copy_set_source (struct nbd_copy *c, struct nbd_group *g)
+{
+  c->src = g;
+  c->src_fd = -1;
+  return 0;
+}
+
+int
+nbd_copy_set_source_fd (struct nbd_copy *c, int fd)
+{
+  nbd_internal_set_error_context ("nbd_copy_set_source_fd");
+
+  if (fd < 0) {
+    set_error (EBADF, "invalid file descriptor: %d", fd);
+    return -1;
+  }
+  c->src = NULL;
+  c->src_fd = fd;
+  return 0;
+}
+
+int
+nbd_copy_set_destination (struct nbd_copy *c, struct nbd_group *g)
+{
+  c->dst = g;
+  c->dst_fd = -1;
+  return 0;
+}
+
+int
+nbd_copy_set_destination_fd (struct nbd_copy *c, int fd)
+{
+  nbd_internal_set_error_context ("nbd_copy_set_destination_fd");
+
+  if (fd < 0) {
+    set_error (EBADF, "invalid file descriptor: %d", fd);
+    return -1;
+  }
+  c->dst = NULL;
+  c->dst_fd = fd;
+  return 0;
+}
+
+int
+nbd_copy_set_requests (struct nbd_copy *c, unsigned requests)
+{
+  nbd_internal_set_error_context ("nbd_copy_set_requests");
+
+  if (requests < 1 || requests > 1024) {
+    set_error (EINVAL, "number of requests must be between 1 and 1024");
+    return -1;
+  }
+  c->requests = requests;
+  return 0;
+}
+
+int
+nbd_copy_set_request_size (struct nbd_copy *c, uint32_t request_size)
+{
+  nbd_internal_set_error_context ("nbd_copy_set_request_size");
+
+  if (request_size < 512 || request_size > MAX_REQUEST_SIZE) {
+    set_error (EINVAL, "request size must be between 512 and %d",
+               MAX_REQUEST_SIZE);
+    return -1;
+  }
+  c->request_size = request_size;
+  return 0;
+}
+
+int
+nbd_copy_set_destination_is_zero (struct nbd_copy *c, bool is_zero)
+{
+  c->destination_is_zero = is_zero;
+  return 0;
+}
+
+uint64_t
+nbd_copy_get_bytes_copied (struct nbd_copy *c)
+{
+  return c->bytes_copied;
+}
+
+uint64_t
+nbd_copy_get_bytes_zeroed (struct nbd_copy *c)
+{
+  return c->bytes_zeroed;
+}
+
+uint64_t
+nbd_copy_get_elapsed_ns (struct nbd_copy *c)
+{
+  return c->elapsed_ns;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* Append [offset, offset+length) to the extent queue, merging it with
+ * the last extent if that is the same type.
+ */
+static int
+append_extent (struct nbd_copy *c, uint64_t offset, uint64_t length,
+               bool zero)
+{
+  struct copy_extent *last, *p;
+  size_t n;
+
+  if (length == 0)
+    return 0;
+
+  if (c->nr_extents > c->first_extent) {
+    last = &c->extents[c->nr_extents - 1];
+    if (last->zero == zero && last->offset + last->length == offset) {
+      last->length += length;
+      return 0;
+    }
+  }
+
+  /* Reuse the space of extents which have already been used up. */
+  if (c->first_extent > 0 && c->nr_extents >= c->extents_alloc) {
+    memmove (c->extents, &c->extents[c->first_extent],
+             (c->nr_extents - c->first_extent) * sizeof c->extents[0]);
+    c->nr_extents -= c->first_extent;
+    c->first_extent = 0;
+  }
+
+  if (c->nr_extents >= c->extents_alloc) {
+    n = c->extents_alloc == 0 ? 64 : c->extents_alloc * 2;
+    p = realloc (c->extents, n * sizeof p[0]);
+    if (p == NULL)
+      return -1;
+    c->extents = p;
+    c->extents_alloc = n;
+  }
+  c->extents[c->nr_extents].offset = offset;
+  c->extents[c->nr_extents].length = length;
+  c->extents[c->nr_extents].zero = zero;
+  c->nr_extents++;
+  return 0;
+}
+
+static int
+extent_callback (void *user_data, const char *metacontext, uint64_t offset,
+                 uint32_t *entries, size_t nr_entries, int *error)
+{
+  struct nbd_copy *c = user_data;
+  size_t i;
+
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0)
+    return 0;
+
+  for (i = 0; i + 1 < nr_entries && offset < c->size; i += 2) {
+    uint64_t length = entries[i];
+
+    if (length > c->size - offset)
+      length = c->size - offset;
+    if (append_extent (c, offset, length,
+                       (entries[i + 1] & LIBNBD_STATE_ZERO) != 0) == -1) {
+      *error = errno;
+      return -1;
+    }
+    offset += length;
+  }
+  c->bs_end = offset;
+  return 0;
+}
+
+/* Start a block status command on the source for the next part of
+ * the export.
+ */
+static int
+start_block_status (struct nbd_copy *c)
+{
+  uint64_t count = c->size - c->extents_end;
+
+  if (count > MAX_BLOCK_STATUS_SIZE)
+    count = MAX_BLOCK_STATUS_SIZE;
+  c->bs_h = c->src->handles[0];
+  c->bs_end = c->extents_end;
+  c->bs_cookie =
+    nbd_aio_block_status (c->bs_h, count, c->extents_end,
+                          (nbd_extent_callback) {
+                            .callback = extent_callback,
+                            .user_data = c },
+                          NBD_NULL_COMPLETION, LIBNBD_CMD_FLAG_COALESCE);
+  if (c->bs_cookie == -1) {
+    c->bs_cookie = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/* Called when the block status command has completed successfully. */
+static int
+finish_block_status (struct nbd_copy *c)
+{
+  c->bs_cookie = 0;
+  if (c->bs_end <= c->extents_end) {
+    copy_error (EPROTO, "server did not return any extents at %" PRIu64,
+               c->extents_end);
+    return -1;
+  }
+  c->extents_end = c->bs_end;
+  return 0;
+}
+
+/* Find the next part of a local source file with SEEK_DATA and
+ * SEEK_HOLE.  If the file does not support them, the rest of it is
+ * treated as data.
+ */
+static int
+fd_extents (struct nbd_copy *c)
+{
+  uint64_t pos = c->extents_end, end = c->size;
+  bool zero = false;
+
+#ifdef SEEK_HOLE
+  if (c->can_extents) {
+    off_t r;
+
+    r = lseek (c->src_fd, pos, SEEK_DATA);
+    if (r == -1 && errno == ENXIO)
+      r = c->size;
+    if (r >= 0 && (uint64_t) r > pos) {
+      end = r;
+      zero = true;
+    }
+    else if (r >= 0) {
+      r = lseek (c->src_fd, pos, SEEK_HOLE);
+      if (r >= 0)
+        end = r;
+    }
+    if (r == -1)
+      c->can_extents = false;
+    if (end > c->size || end <= pos)
+      end = c->size;
+  }
+#endif
+
+  if (append_extent (c, pos, end - pos, zero) == -1) {
+    copy_error (errno, "realloc");
+    return -1;
+  }
+  c->extents_end = end;
+  return 0;
+}
+
+/* Get the next piece of the source to copy.  Returns 1 if there is a
+ * piece, 0 if the extents of the next part of the source are not
+ * known yet, or -1 on error.
+ */
+static int
+next_piece (struct nbd_copy *c, uint64_t *offset, uint32_t *count,
+            bool *zero)
+{
+  struct copy_extent *e;
+  uint64_t limit, end;
+
+  /* Keep block status ahead of the requests, so that we rarely have
+   * to wait for it.
+   */
+  if (c->src && c->can_extents && c->bs_cookie == 0 &&
+      c->extents_end < c->size &&
+      c->extents_end - c->offset <= (uint64_t) c->requests * c->request_size &&
+      start_block_status (c) == -1)
+    return -1;
+
+  if (c->first_extent == c->nr_extents) {
+    if (c->extents_end < c->size) {
+      if (c->src == NULL) {
+        if (fd_extents (c) == -1)
+          return -1;
+      }
+      else if (!c->can_extents) {
+        if (append_extent (c, c->extents_end, c->size - c->extents_end,
+                           false) == -1) {
+                copy_error (errno, "realloc");
+          return -1;
+        }
+        c->extents_end = c->size;
+      }
+    }
+    if (c->first_extent == c->nr_extents)
+      return 0;
+  }
+
+  e = &c->extents[c->first_extent];
+  limit = e->zero ? c->zero_size : c->request_size;
+  end = e->offset + e->length;
+  if (end - c->offset > limit)
+    end = c->offset + limit;
+
+  *offset = c->offset;
+  *count = end - c->offset;
+  *zero = e->zero;
+  c->offset = end;
+  if (end == e->offset + e->length)
+    c->first_extent++;
+  return 1;
+}
+
+static int
+pread_full (int fd, void *buf, size_t count, uint64_t offset)
+{
+  ssize_t r;
+
+  while (count > 0) {
+    r = pread (fd, buf, count, offset);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      copy_error (errno, "pread");
+      return -1;
+    }
+    if (r == 0) {
+      copy_error (EIO, "pread: unexpected end of file");
+      return -1;
+    }
+    buf = (char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+pwrite_full (int fd, const void *buf, size_t count, uint64_t offset)
+{
+  ssize_t r;
+
+  while (count > 0) {
+    r = pwrite (fd, buf, count, offset);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      copy_error (errno, "pwrite");
+      return -1;
+    }
+    buf = (const char *) buf + r;
+    count -= r;
+    offset += r;
+  }
+  return 0;
+}
+
+static int
+alloc_zero_buf (struct nbd_copy *c)
+{
+  if (c->zero_buf == NULL) {
+    c->zero_buf = calloc (1, c->request_size);
+    if (c->zero_buf == NULL) {
+      copy_error (errno, "calloc");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Zero part of a local destination file, punching a hole if
+ * possible and otherwise writing zeroes.
+ */
+static int
+fd_zero (struct nbd_copy *c, uint64_t offset, uint32_t count)
+{
+  uint32_t n;
+
+#if defined (FALLOC_FL_PUNCH_HOLE) && defined (FALLOC_FL_KEEP_SIZE)
+  if (c->can_punch_hole) {
+    if (fallocate (c->dst_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   offset, count) == 0)
+      return 0;
+    c->can_punch_hole = false;
+  }
+#endif
+
+  if (alloc_zero_buf (c) == -1)
+    return -1;
+  for (; count > 0; count -= n, offset += n) {
+    n = count < c->request_size ? count : c->request_size;
+    if (pwrite_full (c->dst_fd, c->zero_buf, n, offset) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static void
+finish_request (struct nbd_copy *c, struct copy_request *r)
+{
+  if (r->zero)
+    c->bytes_zeroed += r->count;
+  else
+    c->bytes_copied += r->count;
+  r->state = REQ_IDLE;
+  r->h = NULL;
+  r->cookie = 0;
+}
+
+/* Write a piece which has been read into the request buffer, or zero
+ * a piece with a write if the destination cannot zero.
+ */
+static int
+start_write (struct nbd_copy *c, struct copy_request *r, const void *buf)
+{
+  if (c->dst == NULL) {
+    if (pwrite_full (c->dst_fd, buf, r->count, r->offset) == -1)
+      return -1;
+    finish_request (c, r);
+    return 0;
+  }
+
+  r->h = nbd_group_select (c->dst, r->offset);
+  r->cookie = nbd_aio_pwrite (r->h, buf, r->count, r->offset,
+                              NBD_NULL_COMPLETION, 0);
+  if (r->cookie == -1)
+    return -1;
+  r->state = REQ_WRITE;
+  return 0;
+}
+
+static int
+start_zero (struct nbd_copy *c, struct copy_request *r)
+{
+  if (c->destination_is_zero) {
+    finish_request (c, r);
+    return 0;
+  }
+
+  if (c->dst == NULL) {
+    if (fd_zero (c, r->offset, r->count) == -1)
+      return -1;
+    finish_request (c, r);
+    return 0;
+  }
+
+  if (!c->can_zero) {
+    if (alloc_zero_buf (c) == -1)
+      return -1;
+    return start_write (c, r, c->zero_buf);
+  }
+
+  r->zero_flags = c->fast_zero ? LIBNBD_CMD_FLAG_FAST_ZERO : 0;
+  r->h = nbd_group_select (c->dst, r->offset);
+  r->cookie = nbd_aio_zero (r->h, r->count, r->offset,
+                            NBD_NULL_COMPLETION, r->zero_flags);
+  if (r->cookie == -1)
+    return -1;
+  r->state = REQ_ZERO;
+  return 0;
+}
+
+static int
+start_request (struct nbd_copy *c, struct copy_request *r)
+{
+  if (r->zero)
+    return start_zero (c, r);
+
+  if (c->src == NULL) {
+    if (pread_full (c->src_fd, r->buf, r->count, r->offset) == -1)
+      return -1;
+    return start_write (c, r, r->buf);
+  }
+
+  r->h = nbd_group_select (c->src, r->offset);
+  r->cookie = nbd_aio_pread (r->h, r->buf, r->count, r->offset,
+                             NBD_NULL_COMPLETION, 0);
+  if (r->cookie == -1)
+    return -1;
+  r->state = REQ_READ;
+  return 0;
+}
+
+/* Move a request on after its command has completed successfully. */
+static int
+request_completed (struct nbd_copy *c, struct copy_request *r)
+{
+  switch (r->state) {
+  case REQ_READ:
+    return start_write (c, r, r->buf);
+  case REQ_WRITE:
+  case REQ_ZERO:
+    finish_request (c, r);
+    return 0;
+  case REQ_IDLE:
+    break;
+  }
+  abort ();
+}
+
+/* Check every command in flight.  Returns -1 if one failed. */
+static int
+check_completions (struct nbd_copy *c)
+{
+  struct copy_request *r;
+  unsigned i;
+  int ret;
+
+  if (c->bs_cookie != 0) {
+    ret = nbd_aio_command_completed (c->bs_h, c->bs_cookie);
+    if (ret == -1) {
+      c->bs_cookie = 0;
+      return -1;
+    }
+    if (ret == 1 && finish_block_status (c) == -1)
+      return -1;
+  }
+
+  for (i = 0; i < c->requests; ++i) {
+    r = &c->reqs[i];
+    if (r->state == REQ_IDLE)
+      continue;
+    ret = nbd_aio_command_completed (r->h, r->cookie);
+    if (ret == 0)
+      continue;
+    if (ret == -1) {
+      /* If the destination cannot zero quickly after all, zero
+       * without the fast zero flag from now on.
+       */
+      if (r->state == REQ_ZERO &&
+          (r->zero_flags & LIBNBD_CMD_FLAG_FAST_ZERO) != 0 &&
+          nbd_get_errno () == ENOTSUP) {
+        c->fast_zero = false;
+        if (start_zero (c, r) == -1)
+          goto err;
+        continue;
+      }
+      goto err;
+    }
+    if (request_completed (c, r) == -1)
+      goto err;
+    continue;
+
+  err:
+    r->state = REQ_IDLE;
+    return -1;
+  }
+  return 0;
+}
+
+static bool
+in_flight (struct nbd_copy *c)
+{
+  unsigned i;
+
+  if (c->bs_cookie != 0)
+    return true;
+  for (i = 0; i < c->requests; ++i)
+    if (c->reqs[i].state != REQ_IDLE)
+      return true;
+  return false;
+}
+
+/* Set up the poll array for every source and destination handle. */
+static int
+alloc_fds (struct nbd_copy *c)
+{
+  size_t n = 0;
+  int i;
+
+  if (c->src)
+    n += c->src->nr_handles;
+  if (c->dst && c->dst != c->src)
+    n += c->dst->nr_handles;
+  if (n == 0)
+    return 0;
+
+  c->fds = calloc (n, sizeof c->fds[0]);
+  c->fd_handles = calloc (n, sizeof c->fd_handles[0]);
+  if (c->fds == NULL || c->fd_handles == NULL) {
+    copy_error (errno, "calloc");
+    return -1;
+  }
+  if (c->src) {
+    for (i = 0; i < c->src->nr_handles; ++i)
+      c->fd_handles[c->nr_fds++] = c->src->handles[i];
+  }
+  if (c->dst && c->dst != c->src) {
+    for (i = 0; i < c->dst->nr_handles; ++i)
+      c->fd_handles[c->nr_fds++] = c->dst->handles[i];
+  }
+  return 0;
+}
+
+/* Wait for activity on any source or destination handle, as in
+ * nbd_group_poll.
+ */
+static int
+copy_poll (struct nbd_copy *c)
+{
+  struct nbd_handle *h;
+  size_t i;
+  int r, t, timer = -1;
+  unsigned dir;
+
+  for (i = 0; i < c->nr_fds; ++i) {
+    h = c->fd_handles[i];
+    c->fds[i].revents = 0;
+    t = nbd_aio_get_timer (h);
+    if (t >= 0 && (timer == -1 || t < timer))
+      timer = t;
+    switch (nbd_aio_get_direction (h)) {
+    case LIBNBD_AIO_DIRECTION_READ:
+      c->fds[i].events = POLLIN;
+      break;
+    case LIBNBD_AIO_DIRECTION_WRITE:
+      c->fds[i].events = POLLOUT;
+      break;
+    case LIBNBD_AIO_DIRECTION_BOTH:
+      c->fds[i].events = POLLIN|POLLOUT;
+      break;
+    default:
+      c->fds[i].fd = -1;
+      c->fds[i].events = 0;
+      continue;
+    }
+    c->fds[i].fd = nbd_aio_get_fd (h);
+  }
+
+  do
+    r = poll (c->fds, c->nr_fds, timer);
+  while (r == -1 && errno == EINTR);
+  if (r == -1) {
+    copy_error (errno, "poll");
+    return -1;
+  }
+
+  /* See nbd_aio_get_timer. */
+  if (r == 0) {
+    for (i = 0; i < c->nr_fds; ++i) {
+      h = c->fd_handles[i];
+      if (nbd_aio_get_timer (h) == 0 && nbd_aio_notify_timer (h) == -1)
+        return -1;
+    }
+    return 0;
+  }
+
+  for (i = 0; i < c->nr_fds; ++i) {
+    h = c->fd_handles[i];
+    dir = nbd_aio_get_direction (h);
+    if ((c->fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+        (dir & LIBNBD_AIO_DIRECTION_READ) != 0) {
+      if (nbd_aio_notify_read (h) == -1)
+        return -1;
+    }
+    else if ((c->fds[i].revents &
+              (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+             (dir & LIBNBD_AIO_DIRECTION_WRITE) != 0) {
+      if (nbd_aio_notify_write (h) == -1)
+        return -1;
+    }
+    else if ((c->fds[i].revents & (POLLERR | POLLNVAL)) != 0) {
+      copy_error (ENOTCONN, "server closed socket unexpectedly");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Find the size of a local file or block device. */
+static int
+fd_size (int fd, uint64_t *size, bool *is_file)
+{
+  struct stat statbuf;
+  off_t r;
+
+  if (fstat (fd, &statbuf) == -1) {
+    copy_error (errno, "fstat");
+    return -1;
+  }
+  *is_file = S_ISREG (statbuf.st_mode);
+  if (*is_file) {
+    *size = statbuf.st_size;
+    return 0;
+  }
+  r = lseek (fd, 0, SEEK_END);
+  if (r == -1) {
+    copy_error (errno, "lseek");
+    return -1;
+  }
+  *size = r;
+  return 0;
+}
+
+/* Work out the size and capabilities of both sides of the copy. */
+static int
+prepare (struct nbd_copy *c)
+{
+  struct nbd_handle *h;
+  uint64_t dst_size;
+  int64_t r;
+  bool is_file;
+
+  if (c->src == NULL && c->src_fd == -1) {
+    copy_error (EINVAL, "the source has not been set");
+    return -1;
+  }
+  if (c->dst == NULL && c->dst_fd == -1) {
+    copy_error (EINVAL, "the destination has not been set");
+    return -1;
+  }
+
+  if (c->src) {
+    h = c->src->handles[0];
+    r = nbd_get_size (h);
+    if (r == -1)
+      return -1;
+    c->size = r;
+    c->can_extents =
+      nbd_can_meta_context (h, LIBNBD_CONTEXT_BASE_ALLOCATION) == 1;
+  }
+  else {
+    if (fd_size (c->src_fd, &c->size, &is_file) == -1)
+      return -1;
+    c->can_extents = is_file;
+  }
+
+  c->zero_size = MAX_ZERO_SIZE;
+  if (c->dst) {
+    h = c->dst->handles[0];
+    if (nbd_is_read_only (h) == 1) {
+        copy_error (EROFS, "the destination is read-only");
+      return -1;
+    }
+    r = nbd_get_size (h);
+    if (r == -1)
+      return -1;
+    dst_size = r;
+    c->can_zero = nbd_can_zero (h) == 1;
+    c->fast_zero = nbd_can_fast_zero (h) == 1;
+    if (!c->can_zero && !c->destination_is_zero)
+      c->zero_size = c->request_size;
+  }
+  else {
+    if (fd_size (c->dst_fd, &dst_size, &is_file) == -1)
+      return -1;
+    c->can_punch_hole = is_file;
+    /* Extend a local file which is too small.  If it was empty it
+     * now reads as zero.
+     */
+    if (is_file && dst_size < c->size) {
+      if (ftruncate (c->dst_fd, c->size) == -1) {
+        copy_error (errno, "ftruncate");
+        return -1;
+      }
+      if (dst_size == 0)
+        c->destination_is_zero = true;
+      dst_size = c->size;
+    }
+  }
+  if (dst_size < c->size) {
+    copy_error (ENOSPC, "the destination (%" PRIu64 " bytes) is smaller "
+               "than the source (%" PRIu64 " bytes)", dst_size, c->size);
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+nbd_copy_run (struct nbd_copy *c)
+{
+  struct copy_request *r;
+  const char *msg;
+  char *saved_msg;
+  uint64_t start;
+  unsigned i;
+  int err, ret = -1;
+  bool saved_is_zero = c->destination_is_zero;
+
+  nbd_internal_set_error_context ("nbd_copy_run");
+
+  free_buffers (c);
+  c->offset = c->extents_end = 0;
+  c->bs_cookie = 0;
+  c->nr_fds = 0;
+  c->bytes_copied = c->bytes_zeroed = c->elapsed_ns = 0;
+  start = now_ns ();
+
+  if (prepare (c) == -1)
+    goto out;
+
+  c->reqs = calloc (c->requests, sizeof c->reqs[0]);
+  if (c->reqs == NULL) {
+    copy_error (errno, "calloc");
+    goto out;
+  }
+  for (i = 0; i < c->requests; ++i) {
+    c->reqs[i].buf = malloc (c->request_size);
+    if (c->reqs[i].buf == NULL) {
+      copy_error (errno, "malloc");
+      goto out;
+    }
+  }
+  if (alloc_fds (c) == -1)
+    goto out;
+
+  for (;;) {
+    /* Start a request in every idle slot. */
+    for (i = 0; i < c->requests; ++i) {
+      r = &c->reqs[i];
+      if (r->state != REQ_IDLE)
+        continue;
+      switch (next_piece (c, &r->offset, &r->count, &r->zero)) {
+      case -1:
+        goto drain;
+      case 0:
+        goto wait;
+      }
+      if (start_request (c, r) == -1)
+        goto drain;
+    }
+
+  wait:
+    if (!in_flight (c)) {
+      if (c->offset >= c->size)
+        break;
+      continue;
+    }
+    if (copy_poll (c) == -1 || check_completions (c) == -1)
+      goto drain;
+  }
+
+  /* Make sure the data reaches permanent storage. */
+  if (c->dst) {
+    if (nbd_group_flush (c->dst, 0) == -1)
+      goto out;
+  }
+  else if (fsync (c->dst_fd) == -1 && errno != EINVAL) {
+    copy_error (errno, "fsync");
+    goto out;
+  }
+  ret = 0;
+  goto out;
+
+ drain:
+  /* Wait for the commands in flight to finish, as they use the
+   * request buffers, keeping the first error.
+   */
+  err = nbd_get_errno ();
+  msg = nbd_get_error ();
+  saved_msg = msg ? strdup (msg) : NULL;
+  while (in_flight (c)) {
+    for (i = 0; i < c->requests; ++i) {
+      r = &c->reqs[i];
+      if (r->state != REQ_IDLE &&
+          nbd_aio_command_completed (r->h, r->cookie) != 0)
+        r->state = REQ_IDLE;
+    }
+    if (c->bs_cookie != 0 &&
+        nbd_aio_command_completed (c->bs_h, c->bs_cookie) != 0)
+      c->bs_cookie = 0;
+    if (in_flight (c) && copy_poll (c) == -1)
+      break;
+  }
+  if (saved_msg)
+    nbd_internal_set_last_error (err, saved_msg);
+
+ out:
+  c->elapsed_ns = now_ns () - start;
+  c->destination_is_zero = saved_is_zero;
+  return ret;
+}
@@ -25,13 +25,34 @@
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_GNUTLS
 #include <gnutls/gnutls.h>
 #endif
 
+#ifdef HAVE_LINUX_TLS_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
+
 #include "internal.h"
 
+#if defined(HAVE_GNUTLS) && defined(HAVE_GNUTLS_RECORD_GET_STATE) && \
+  defined(HAVE_LINUX_TLS_H) && defined(TCP_ULP) && defined(SOL_TLS) && \
+  defined(TLS_GET_RECORD_TYPE) && defined(TLS_CIPHER_AES_GCM_256)
+#define USE_KTLS 1
+#endif
+
+/* Most data gathered into TLS records by one call to tls_send_iov.
+ * Buffers at least this large are sent by themselves, since corking
+ * copies them.
+ */
+#define MAX_CORK_SIZE (64 * 1024)
+
 int
 nbd_unlocked_set_tls (struct nbd_handle *h, int tls)
 {
@@ -92,6 +113,34 @@ nbd_unlocked_get_tls_verify_peer (struct nbd_handle *h)
   return h->tls_verify_peer;
 }
 
+int
+nbd_unlocked_set_tls_kernel_offload (struct nbd_handle *h, bool offload)
+{
+  h->tls_kernel_offload = offload;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_tls_kernel_offload (struct nbd_handle *h)
+{
+  return h->tls_kernel_offload;
+}
+
+int
+nbd_unlocked_set_tls_resumption (struct nbd_handle *h, bool resume)
+{
+  h->tls_resumption = resume;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_tls_resumption (struct nbd_handle *h)
+{
+  return h->tls_resumption;
+}
+
 int
 nbd_unlocked_set_tls_username (struct nbd_handle *h, const char *username)
 {
@@ -203,6 +252,56 @@ tls_send (struct nbd_handle *h,
   return r;
 }
 
+/* Send the requests and small write payloads gathered by
+ * ISSUE_COMMAND as full TLS records instead of a record each, which
+ * saves the framing and MAC of every record.  They are corked in
+ * GnuTLS and then flushed together.  If the socket does not take all
+ * of the records, the rest stay corked and this fails with EAGAIN.
+ * The caller then passes the same buffers again once the socket is
+ * writable (perhaps after reading replies in PAUSE_SEND_REQUEST), and
+ * only the flush is retried.
+ */
+static ssize_t
+tls_send_iov (struct nbd_handle *h, struct socket *sock,
+              const struct iovec *iov, int iovcnt, int flags)
+{
+  gnutls_session_t session = sock->u.tls.session;
+  size_t len = 0;
+  ssize_t r;
+  int i;
+
+  if (sock->u.tls.corked == 0) {
+    if (iovcnt == 1 || iov[0].iov_len >= MAX_CORK_SIZE)
+      return tls_send (h, sock, iov[0].iov_base, iov[0].iov_len, flags);
+
+    gnutls_record_cork (session);
+    for (i = 0; i < iovcnt && len + iov[i].iov_len <= MAX_CORK_SIZE; ++i) {
+      r = gnutls_record_send (session, iov[i].iov_base, iov[i].iov_len);
+      if (r < 0) {
+        set_error (0, "gnutls_record_send: %s", gnutls_strerror (r));
+        errno = EIO;
+        return -1;
+      }
+      len += r;
+    }
+    sock->u.tls.corked = len;
+  }
+
+  r = gnutls_record_uncork (session, 0);
+  if (r < 0) {
+    if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN) {
+      errno = EAGAIN;
+      return -1;
+    }
+    set_error (0, "gnutls_record_uncork: %s", gnutls_strerror (r));
+    errno = EIO;
+    return -1;
+  }
+  len = sock->u.tls.corked;
+  sock->u.tls.corked = 0;
+  return len;
+}
+
 static bool
 tls_pending (struct socket *sock)
 {
@@ -215,6 +314,9 @@ tls_get_fd (struct socket *sock)
   return sock->u.tls.oldsock->ops->get_fd (sock->u.tls.oldsock);
 }
 
+struct tls_creds;
+static void release_creds (struct tls_creds *c);
+
 /* XXX Calling gnutls_bye is possible, but it may send and receive
  * data over the wire which would require modifications to the state
  * machine.  So instead we abruptly drop the TLS session.
@@ -226,10 +328,7 @@ tls_close (struct socket *sock)
 
   r = sock->u.tls.oldsock->ops->close (sock->u.tls.oldsock);
   gnutls_deinit (sock->u.tls.session);
-  if (sock->u.tls.pskcreds)
-    gnutls_psk_free_client_credentials (sock->u.tls.pskcreds);
-  if (sock->u.tls.xcreds)
-    gnutls_certificate_free_credentials (sock->u.tls.xcreds);
+  release_creds (sock->u.tls.creds);
   free (sock);
   return r;
 }
@@ -237,11 +336,399 @@ tls_close (struct socket *sock)
 static struct socket_ops crypto_ops = {
   .recv = tls_recv,
   .send = tls_send,
+  .send_iov = tls_send_iov,
   .pending = tls_pending,
   .get_fd = tls_get_fd,
   .close = tls_close,
 };
 
+#ifdef USE_KTLS
+
+/* Socket ops used once the session has been handed to the kernel
+ * (see nbd_internal_crypto_kernel_offload).  Sending goes straight to
+ * the underlying socket.  Receiving must ask for the record type,
+ * because without that the kernel fails with EIO on any record which
+ * is not application data, even the server closing the session.
+ */
+static ssize_t
+ktls_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
+{
+  char control[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof control,
+  };
+  struct cmsghdr *cmsg;
+  unsigned char type;
+  ssize_t r;
+
+  r = recvmsg (sock->u.tls.oldsock->ops->get_fd (sock->u.tls.oldsock),
+               &msg, 0);
+  if (r == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      set_error (errno, "recvmsg");
+    return -1;
+  }
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_TLS ||
+      cmsg->cmsg_type != TLS_GET_RECORD_TYPE)
+    return r;
+  type = *CMSG_DATA (cmsg);
+  switch (type) {
+  case 23:                      /* application data */
+    return r;
+  case 21:                      /* alert */
+    /* A close_notify alert is the server ending the session. */
+    if (r == 2 && ((unsigned char *) buf)[1] == 0)
+      return 0;
+    break;
+  }
+  set_error (EIO, "unexpected TLS record of type %d on a kernel TLS session",
+             type);
+  return -1;
+}
+
+static ssize_t
+ktls_send (struct nbd_handle *h,
+           struct socket *sock, const void *buf, size_t len, int flags)
+{
+  struct socket *oldsock = sock->u.tls.oldsock;
+
+  return oldsock->ops->send (h, oldsock, buf, len, flags);
+}
+
+static ssize_t
+ktls_send_iov (struct nbd_handle *h, struct socket *sock,
+               const struct iovec *iov, int iovcnt, int flags)
+{
+  struct socket *oldsock = sock->u.tls.oldsock;
+
+  return oldsock->ops->send_iov (h, oldsock, iov, iovcnt, flags);
+}
+
+/* Zero-copy sends are left out, because the kernel does not support
+ * MSG_ZEROCOPY on TLS sockets.
+ */
+static struct socket_ops ktls_ops = {
+  .recv = ktls_recv,
+  .send = ktls_send,
+  .send_iov = ktls_send_iov,
+  .get_fd = tls_get_fd,
+  .close = tls_close,
+};
+
+/* Give the keys and sequence numbers of one direction of the session
+ * to the kernel.
+ */
+static int
+set_kernel_crypto_info (struct nbd_handle *h, gnutls_session_t session,
+                        int fd, bool read)
+{
+  const gnutls_protocol_t version = gnutls_protocol_get_version (session);
+  const gnutls_cipher_algorithm_t cipher = gnutls_cipher_get (session);
+  gnutls_datum_t mac_key, iv, cipher_key;
+  unsigned char seq[8];
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+  } ci;
+  socklen_t len;
+  int err;
+
+  err = gnutls_record_get_state (session, read, &mac_key, &iv, &cipher_key,
+                                 seq);
+  if (err < 0) {
+    set_error (0, "gnutls_record_get_state: %s", gnutls_strerror (err));
+    return -1;
+  }
+
+  /* The salt is the implicit part of the nonce.  With TLS 1.2 the
+   * explicit part starts as the sequence number, while with TLS 1.3
+   * it is the rest of the IV.
+   */
+#define SET_CRYPTO_INFO(ci, NAME)                                       \
+  do {                                                                  \
+    if (cipher_key.size != TLS_CIPHER_##NAME##_KEY_SIZE ||              \
+        iv.size != TLS_CIPHER_##NAME##_SALT_SIZE +                      \
+        (version == GNUTLS_TLS1_3 ? TLS_CIPHER_##NAME##_IV_SIZE : 0))   \
+      goto bad_size;                                                    \
+    (ci).info.cipher_type = TLS_CIPHER_##NAME;                          \
+    memcpy ((ci).salt, iv.data, TLS_CIPHER_##NAME##_SALT_SIZE);         \
+    if (version == GNUTLS_TLS1_3)                                       \
+      memcpy ((ci).iv, iv.data + TLS_CIPHER_##NAME##_SALT_SIZE,         \
+              TLS_CIPHER_##NAME##_IV_SIZE);                             \
+    else                                                                \
+      memcpy ((ci).iv, seq, TLS_CIPHER_##NAME##_IV_SIZE);               \
+    memcpy ((ci).key, cipher_key.data, TLS_CIPHER_##NAME##_KEY_SIZE);   \
+    memcpy ((ci).rec_seq, seq, TLS_CIPHER_##NAME##_REC_SEQ_SIZE);       \
+    len = sizeof (ci);                                                  \
+  } while (0)
+
+  memset (&ci, 0, sizeof ci);
+  if (cipher == GNUTLS_CIPHER_AES_128_GCM)
+    SET_CRYPTO_INFO (ci.aes_gcm_128, AES_GCM_128);
+  else
+    SET_CRYPTO_INFO (ci.aes_gcm_256, AES_GCM_256);
+  ci.info.version = version == GNUTLS_TLS1_3 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+#undef SET_CRYPTO_INFO
+
+  err = setsockopt (fd, SOL_TLS, read ? TLS_RX : TLS_TX, &ci, len);
+  explicit_bzero (&ci, sizeof ci);
+  if (err == -1) {
+    set_error (errno, "setsockopt: %s", read ? "TLS_RX" : "TLS_TX");
+    return -1;
+  }
+  return 0;
+
+ bad_size:
+  set_error (EINVAL, "unexpected key or IV size for kernel TLS");
+  return -1;
+}
+
+#endif /* USE_KTLS */
+
+/* Credentials are loaded once and shared by every handle in the
+ * process which uses the same files, since parsing certificates is a
+ * large part of the cost of connecting.  An entry is kept when no
+ * handle is using it, so that later connections can use it too, but
+ * it is only reused while the files it was loaded from are unchanged.
+ * Everything here is protected by cache_lock.
+ */
+#define MAX_CREDS_FILES 4
+
+struct file_id {
+  bool exists;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+struct tls_creds {
+  struct tls_creds *next;
+  unsigned refs;
+  char *key;                    /* Where the credentials came from. */
+  size_t nr_files;
+  char *files[MAX_CREDS_FILES];
+  struct file_id ids[MAX_CREDS_FILES];
+  gnutls_credentials_type_t type;
+  void *creds;                  /* really gnutls_*_credentials_t */
+};
+
+/* Saved sessions, see nbd_set_tls_resumption. */
+#define MAX_SAVED_SESSIONS 16
+
+struct saved_session {
+  struct saved_session *next;
+  char *key;                    /* Server and credentials. */
+  gnutls_datum_t data;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_creds *creds_cache;
+static struct saved_session *saved_sessions;
+
+static void
+get_file_id (const char *file, struct file_id *id)
+{
+  struct stat statbuf;
+
+  memset (id, 0, sizeof *id);
+  if (stat (file, &statbuf) == -1)
+    return;
+  id->exists = true;
+  id->dev = statbuf.st_dev;
+  id->ino = statbuf.st_ino;
+  id->size = statbuf.st_size;
+  id->mtime = statbuf.st_mtim;
+}
+
+static bool
+same_file_id (const struct file_id *a, const struct file_id *b)
+{
+  if (!a->exists || !b->exists)
+    return a->exists == b->exists;
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+    a->mtime.tv_sec == b->mtime.tv_sec &&
+    a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static void
+free_creds (struct tls_creds *c)
+{
+  size_t i;
+
+  if (c->type == GNUTLS_CRD_PSK)
+    gnutls_psk_free_client_credentials (c->creds);
+  else
+    gnutls_certificate_free_credentials (c->creds);
+  for (i = 0; i < c->nr_files; ++i)
+    free (c->files[i]);
+  free (c->key);
+  free (c);
+}
+
+/* Return a new reference to the cached credentials for key, or NULL
+ * if there are none or the files have changed.  ids are the current
+ * identities of the files, collected before loading anything.
+ */
+static struct tls_creds *
+find_creds (const char *key, const struct file_id *ids, size_t nr_files)
+{
+  struct tls_creds *c, **cp, *ret = NULL;
+  size_t i;
+
+  pthread_mutex_lock (&cache_lock);
+  for (cp = &creds_cache; (c = *cp) != NULL; ) {
+    if (strcmp (c->key, key) == 0 && c->nr_files == nr_files) {
+      for (i = 0; i < nr_files; ++i)
+        if (!same_file_id (&c->ids[i], &ids[i]))
+          break;
+      if (i == nr_files) {
+        c->refs++;
+        ret = c;
+        break;
+      }
+      /* Stale, so stop anyone else finding it. */
+      if (c->refs == 0) {
+        *cp = c->next;
+        free_creds (c);
+        continue;
+      }
+    }
+    cp = &c->next;
+  }
+  pthread_mutex_unlock (&cache_lock);
+  return ret;
+}
+
+/* Add newly loaded credentials to the cache and return a reference
+ * to them.  On error the credentials are freed.
+ */
+static struct tls_creds *
+add_creds (const char *key, char **files, const struct file_id *ids,
+           size_t nr_files, gnutls_credentials_type_t type, void *creds)
+{
+  struct tls_creds *c;
+  size_t i;
+
+  assert (nr_files <= MAX_CREDS_FILES);
+  c = calloc (1, sizeof *c);
+  if (c == NULL) {
+    set_error (errno, "calloc");
+    goto error;
+  }
+  c->type = type;
+  c->creds = creds;
+  c->key = strdup (key);
+  if (c->key == NULL) {
+    set_error (errno, "strdup");
+    goto error;
+  }
+  for (i = 0; i < nr_files; ++i) {
+    c->files[i] = strdup (files[i]);
+    if (c->files[i] == NULL) {
+      set_error (errno, "strdup");
+      goto error;
+    }
+    c->nr_files++;
+    c->ids[i] = ids[i];
+  }
+  c->refs = 1;
+
+  pthread_mutex_lock (&cache_lock);
+  c->next = creds_cache;
+  creds_cache = c;
+  pthread_mutex_unlock (&cache_lock);
+  return c;
+
+ error:
+  if (c)
+    free_creds (c);
+  else if (type == GNUTLS_CRD_PSK)
+    gnutls_psk_free_client_credentials (creds);
+  else
+    gnutls_certificate_free_credentials (creds);
+  return NULL;
+}
+
+static void
+release_creds (struct tls_creds *c)
+{
+  pthread_mutex_lock (&cache_lock);
+  assert (c->refs > 0);
+  c->refs--;
+  pthread_mutex_unlock (&cache_lock);
+}
+
+static void free_tls_cache (void) __attribute__((destructor));
+
+static void
+free_tls_cache (void)
+{
+  struct tls_creds *c;
+  struct saved_session *ss;
+
+  while ((c = creds_cache) != NULL) {
+    creds_cache = c->next;
+    free_creds (c);
+  }
+  while ((ss = saved_sessions) != NULL) {
+    saved_sessions = ss->next;
+    free (ss->key);
+    free (ss->data.data);
+    free (ss);
+  }
+}
+
+/* The key for saved sessions.  Sessions are only shared between
+ * handles which connect to the same server with the same credentials
+ * and the same nbd_set_tls_verify_peer setting, since resuming a
+ * session skips checking the server's certificate.
+ */
+static char *
+session_key (struct nbd_handle *h, struct tls_creds *c)
+{
+  char *key;
+
+  assert (h->hostname);
+  if (asprintf (&key, "%s:%s:%s:%d", h->hostname, h->port ? h->port : "",
+                c->key, h->tls_verify_peer) == -1)
+    return NULL;
+  return key;
+}
+
+/* Offer the server a session saved by an earlier connection. */
+static void
+resume_session (struct nbd_handle *h, gnutls_session_t session,
+                struct tls_creds *c)
+{
+  struct saved_session *ss;
+  char *key;
+  int err = 0;
+
+  key = session_key (h, c);
+  if (key == NULL)
+    return;
+  pthread_mutex_lock (&cache_lock);
+  for (ss = saved_sessions; ss != NULL; ss = ss->next) {
+    if (strcmp (ss->key, key) == 0) {
+      err = gnutls_session_set_data (session, ss->data.data, ss->data.size);
+      break;
+    }
+  }
+  pthread_mutex_unlock (&cache_lock);
+  free (key);
+  if (err < 0)
+    debug (h, "ignoring saved TLS session: gnutls_session_set_data: %s",
+           gnutls_strerror (err));
+}
+
 /* Look up the user's key in the PSK file. */
 static int
 lookup_key (const char *pskfile, const char *username,
@@ -296,14 +783,17 @@ lookup_key (const char *pskfile, const char *username,
   return -1;
 }
 
-static gnutls_psk_client_credentials_t
+static struct tls_creds *
 set_up_psk_credentials (struct nbd_handle *h, gnutls_session_t session)
 {
   int err;
   const char prio[] = TLS_PRIORITY ":" "+ECDHE-PSK:+DHE-PSK:+PSK";
   gnutls_datum_t key = { .data = NULL };
   char *username = NULL;
-  gnutls_psk_client_credentials_t ret = NULL;
+  char *ckey = NULL;
+  struct file_id id;
+  gnutls_psk_client_credentials_t pskcreds = NULL;
+  struct tls_creds *ret = NULL;
 
   err = gnutls_priority_set_direct (session, prio, NULL);
   if (err < 0) {
@@ -315,81 +805,113 @@ set_up_psk_credentials (struct nbd_handle *h, gnutls_session_t session)
   if (username == NULL)
     goto error;
 
-  if (lookup_key (h->tls_psk_file, username, &key) == -1)
-    goto error;
-
-  err = gnutls_psk_allocate_client_credentials (&ret);
-  if (err < 0) {
-    set_error (0, "gnutls_psk_allocate_client_credentials: %s",
-               gnutls_strerror (err));
+  if (asprintf (&ckey, "psk:%s:%s", h->tls_psk_file, username) == -1) {
+    set_error (errno, "asprintf");
     goto error;
   }
-  err = gnutls_psk_set_client_credentials (ret, username,
-                                           &key, GNUTLS_PSK_KEY_HEX);
-  if (err < 0) {
-    set_error (0, "gnutls_psk_set_client_credentials: %s",
-               gnutls_strerror (err));
-    goto error;
+  get_file_id (h->tls_psk_file, &id);
+  ret = find_creds (ckey, &id, 1);
+  if (ret == NULL) {
+    if (lookup_key (h->tls_psk_file, username, &key) == -1)
+      goto error;
+
+    err = gnutls_psk_allocate_client_credentials (&pskcreds);
+    if (err < 0) {
+      set_error (0, "gnutls_psk_allocate_client_credentials: %s",
+                 gnutls_strerror (err));
+      goto error;
+    }
+    err = gnutls_psk_set_client_credentials (pskcreds, username,
+                                             &key, GNUTLS_PSK_KEY_HEX);
+    if (err < 0) {
+      set_error (0, "gnutls_psk_set_client_credentials: %s",
+                 gnutls_strerror (err));
+      goto error;
+    }
+
+    ret = add_creds (ckey, &h->tls_psk_file, &id, 1, GNUTLS_CRD_PSK,
+                     pskcreds);
+    pskcreds = NULL;
+    if (ret == NULL)
+      goto error;
   }
 
-  err = gnutls_credentials_set (session, GNUTLS_CRD_PSK, ret);
+  err = gnutls_credentials_set (session, GNUTLS_CRD_PSK, ret->creds);
   if (err < 0) {
     set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
     goto error;
   }
 
   free (username);
+  free (ckey);
   free (key.data);
   return ret;
 
  error:
   free (username);
+  free (ckey);
   free (key.data);
+  if (pskcreds)
+    gnutls_psk_free_client_credentials (pskcreds);
   if (ret)
-    gnutls_psk_free_client_credentials (ret);
+    release_creds (ret);
   return NULL;
 }
 
+/* Load the certificates from path, or reuse them if another handle
+ * has already loaded the same files.  If there are no certificates
+ * in path this returns 0 and leaves *ret as NULL.
+ */
 static int
-load_certificates (const char *path, gnutls_certificate_credentials_t *ret)
+load_certificates (const char *path, struct tls_creds **ret)
 {
   int err;
-  char *cacert = NULL;
-  char *clientcert = NULL;
-  char *clientkey = NULL;
-  char *cacrl = NULL;
+  char *key = NULL;
+  char *files[MAX_CREDS_FILES] = { NULL };
+  struct file_id ids[MAX_CREDS_FILES];
+  const char *names[MAX_CREDS_FILES] = {
+    "ca-cert.pem", "client-cert.pem", "client-key.pem", "ca-crl.pem"
+  };
+  char *cacert, *clientcert, *clientkey, *cacrl;
+  gnutls_certificate_credentials_t xcreds = NULL;
+  size_t i;
 
-  if (asprintf (&cacert, "%s/ca-cert.pem", path) == -1) {
-    set_error (errno, "asprintf");
-    goto error;
+  *ret = NULL;
+  for (i = 0; i < MAX_CREDS_FILES; ++i) {
+    if (asprintf (&files[i], "%s/%s", path, names[i]) == -1) {
+      files[i] = NULL;
+      set_error (errno, "asprintf");
+      goto error;
+    }
   }
+  cacert = files[0];
+  clientcert = files[1];
+  clientkey = files[2];
+  cacrl = files[3];
+
   /* Only ca-cert.pem must be present. */
-  if (access (cacert, R_OK) == -1) {
-    free (cacert);
-    return 0;
-  }
+  if (access (cacert, R_OK) == -1)
+    goto out;
 
-  if (asprintf (&clientcert, "%s/client-cert.pem", path) == -1) {
-    set_error (errno, "asprintf");
-    goto error;
-  }
-  if (asprintf (&clientkey, "%s/client-key.pem", path) == -1) {
-    set_error (errno, "asprintf");
-    goto error;
-  }
-  if (asprintf (&cacrl, "%s/ca-crl.pem", path) == -1) {
+  if (asprintf (&key, "x509:%s", path) == -1) {
+    key = NULL;
     set_error (errno, "asprintf");
     goto error;
   }
+  for (i = 0; i < MAX_CREDS_FILES; ++i)
+    get_file_id (files[i], &ids[i]);
+  *ret = find_creds (key, ids, MAX_CREDS_FILES);
+  if (*ret)
+    goto out;
 
-  err = gnutls_certificate_allocate_credentials (ret);
+  err = gnutls_certificate_allocate_credentials (&xcreds);
   if (err < 0) {
     set_error (0, "gnutls_certificate_allocate_credentials: %s",
                gnutls_strerror (err));
     goto error;
   }
 
-  err = gnutls_certificate_set_x509_trust_file (*ret, cacert,
+  err = gnutls_certificate_set_x509_trust_file (xcreds, cacert,
                                                 GNUTLS_X509_FMT_PEM);
   if (err < 0) {
     set_error (0, "gnutls_certificate_set_x509_trust_file: %s: %s",
@@ -399,7 +921,7 @@ load_certificates (const char *path, gnutls_certificate_credentials_t *ret)
 
   /* Optional for client certification authentication. */
   if (access (clientcert, R_OK) == 0 && access (clientkey, R_OK) == 0) {
-    err = gnutls_certificate_set_x509_key_file (*ret, clientcert, clientkey,
+    err = gnutls_certificate_set_x509_key_file (xcreds, clientcert, clientkey,
                                                 GNUTLS_X509_FMT_PEM);
     if (err < 0) {
       set_error (0, "gnutls_certificate_set_x509_key_file: %s, %s: %s",
@@ -409,7 +931,7 @@ load_certificates (const char *path, gnutls_certificate_credentials_t *ret)
   }
 
   if (access (cacrl, R_OK) == 0) {
-    err = gnutls_certificate_set_x509_crl_file (*ret, cacrl,
+    err = gnutls_certificate_set_x509_crl_file (xcreds, cacrl,
                                                 GNUTLS_X509_FMT_PEM);
     if (err < 0) {
       set_error (0, "gnutls_certificate_set_x509_crl_file: %s: %s",
@@ -418,29 +940,33 @@ load_certificates (const char *path, gnutls_certificate_credentials_t *ret)
     }
   }
 
-  free (cacert);
-  free (clientcert);
-  free (clientkey);
-  free (cacrl);
+  *ret = add_creds (key, files, ids, MAX_CREDS_FILES,
+                    GNUTLS_CRD_CERTIFICATE, xcreds);
+  if (*ret == NULL)
+    goto error_freed;
+
+ out:
+  free (key);
+  for (i = 0; i < MAX_CREDS_FILES; ++i)
+    free (files[i]);
   return 0;
 
  error:
-  if (*ret)
-    gnutls_certificate_free_credentials (*ret);
-  *ret = NULL;
-  free (cacert);
-  free (clientcert);
-  free (clientkey);
-  free (cacrl);
+  if (xcreds)
+    gnutls_certificate_free_credentials (xcreds);
+ error_freed:
+  free (key);
+  for (i = 0; i < MAX_CREDS_FILES; ++i)
+    free (files[i]);
   return -1;
 }
 
-static gnutls_certificate_credentials_t
+static struct tls_creds *
 set_up_certificate_credentials (struct nbd_handle *h,
                                 gnutls_session_t session, bool *is_error)
 {
   int err;
-  gnutls_certificate_credentials_t ret = NULL;
+  struct tls_creds *ret = NULL;
   const char *home = getenv ("HOME");
   char *path = NULL;
 
@@ -497,7 +1023,7 @@ set_up_certificate_credentials (struct nbd_handle *h,
   debug (h, "ignoring nbd_set_tls_verify_peer, this requires GnuTLS >= 3.4.6");
 #endif
 
-  err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, ret);
+  err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, ret->creds);
   if (err < 0) {
     set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
     goto error;
@@ -507,17 +1033,19 @@ set_up_certificate_credentials (struct nbd_handle *h,
   return ret;
 
  error:
-  gnutls_certificate_free_credentials (ret);
+  if (ret)
+    release_creds (ret);
   free (path);
   *is_error = true;
   return NULL;
 }
 
-static gnutls_certificate_credentials_t
+static struct tls_creds *
 set_up_system_CA (struct nbd_handle *h, gnutls_session_t session)
 {
   int err;
-  gnutls_certificate_credentials_t ret = NULL;
+  gnutls_certificate_credentials_t xcreds = NULL;
+  struct tls_creds *ret;
 
   err = gnutls_priority_set_direct (session, TLS_PRIORITY, NULL);
   if (err < 0) {
@@ -525,25 +1053,32 @@ set_up_system_CA (struct nbd_handle *h, gnutls_session_t session)
     return NULL;
   }
 
-  err = gnutls_certificate_allocate_credentials (&ret);
-  if (err < 0) {
-    set_error (0, "gnutls_certificate_allocate_credentials: %s",
-               gnutls_strerror (err));
-    return NULL;
-  }
+  ret = find_creds ("system", NULL, 0);
+  if (ret == NULL) {
+    err = gnutls_certificate_allocate_credentials (&xcreds);
+    if (err < 0) {
+      set_error (0, "gnutls_certificate_allocate_credentials: %s",
+                 gnutls_strerror (err));
+      return NULL;
+    }
 
-  err = gnutls_certificate_set_x509_system_trust (ret);
-  if (err < 0) {
-    set_error (0, "gnutls_certificate_set_x509_system_trust: %s",
-               gnutls_strerror (err));
-    gnutls_certificate_free_credentials (ret);
-    return NULL;
+    err = gnutls_certificate_set_x509_system_trust (xcreds);
+    if (err < 0) {
+      set_error (0, "gnutls_certificate_set_x509_system_trust: %s",
+                 gnutls_strerror (err));
+      gnutls_certificate_free_credentials (xcreds);
+      return NULL;
+    }
+
+    ret = add_creds ("system", NULL, NULL, 0, GNUTLS_CRD_CERTIFICATE, xcreds);
+    if (ret == NULL)
+      return NULL;
   }
 
-  err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, ret);
+  err = gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, ret->creds);
   if (err < 0) {
     set_error (0, "gnutls_credentials_set: %s", gnutls_strerror (err));
-    gnutls_certificate_free_credentials (ret);
+    release_creds (ret);
     return NULL;
   }
 
@@ -562,8 +1097,7 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   int err;
   struct socket *sock;
   gnutls_session_t session;
-  gnutls_psk_client_credentials_t pskcreds = NULL;
-  gnutls_certificate_credentials_t xcreds = NULL;
+  struct tls_creds *creds;
 
   err = gnutls_init (&session, GNUTLS_CLIENT|GNUTLS_NONBLOCK);
   if (err < 0) {
@@ -583,8 +1117,8 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   }
 
   if (h->tls_psk_file) {
-    pskcreds = set_up_psk_credentials (h, session);
-    if (pskcreds == NULL) {
+    creds = set_up_psk_credentials (h, session);
+    if (creds == NULL) {
       gnutls_deinit (session);
       return NULL;
     }
@@ -592,12 +1126,12 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   else {
     bool is_error = false;
 
-    xcreds = set_up_certificate_credentials (h, session, &is_error);
-    if (xcreds == NULL) {
+    creds = set_up_certificate_credentials (h, session, &is_error);
+    if (creds == NULL) {
       if (!is_error) {
         /* Fallback case: use system CA. */
-        xcreds = set_up_system_CA (h, session);
-        if (xcreds == NULL)
+        creds = set_up_system_CA (h, session);
+        if (creds == NULL)
           is_error = true;
       }
     }
@@ -608,6 +1142,9 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
     }
   }
 
+  if (h->tls_resumption && h->hostname)
+    resume_session (h, session, creds);
+
   /* Wrap the underlying socket with GnuTLS. */
   gnutls_transport_set_int (session, oldsock->ops->get_fd (oldsock));
 
@@ -618,16 +1155,13 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   if (sock == NULL) {
     set_error (errno, "malloc");
     gnutls_deinit (session);
-    if (pskcreds)
-      gnutls_psk_free_client_credentials (pskcreds);
-    if (xcreds)
-      gnutls_certificate_free_credentials (xcreds);
+    release_creds (creds);
     return NULL;
   }
   sock->u.tls.session = session;
-  sock->u.tls.pskcreds = pskcreds;
-  sock->u.tls.xcreds = xcreds;
+  sock->u.tls.creds = creds;
   sock->u.tls.oldsock = oldsock;
+  sock->u.tls.corked = 0;
   sock->ops = &crypto_ops;
   return sock;
 }
@@ -669,6 +1203,129 @@ nbd_internal_crypto_handshake (struct nbd_handle *h)
   return -1;
 }
 
+/* Called at the end of the handshake if nbd_set_tls_resumption was
+ * used, to save the session for later handles.  Failing to save it
+ * is not an error.
+ */
+void
+nbd_internal_crypto_save_session (struct nbd_handle *h)
+{
+  gnutls_session_t session;
+  gnutls_datum_t data = { .data = NULL };
+  struct saved_session *ss, **ssp;
+  char *key;
+  size_t n;
+  int err;
+
+  if (h->hostname == NULL || h->sock->ops != &crypto_ops)
+    return;
+  session = h->sock->u.tls.session;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+  /* With TLS 1.3 there is nothing to resume unless the server sent a
+   * session ticket.
+   */
+  if (gnutls_protocol_get_version (session) == GNUTLS_TLS1_3 &&
+      (gnutls_session_get_flags (session) & GNUTLS_SFLAGS_SESSION_TICKET) == 0)
+    return;
+#endif
+
+  err = gnutls_session_get_data2 (session, &data);
+  if (err < 0) {
+    debug (h, "not saving TLS session: gnutls_session_get_data2: %s",
+           gnutls_strerror (err));
+    return;
+  }
+  key = session_key (h, h->sock->u.tls.creds);
+  ss = calloc (1, sizeof *ss);
+  if (key == NULL || ss == NULL || (ss->data.data = malloc (data.size)) == NULL)
+    goto out;
+  memcpy (ss->data.data, data.data, data.size);
+  ss->data.size = data.size;
+  ss->key = key;
+  key = NULL;
+
+  /* Replace any older session for the same server, and forget the
+   * oldest sessions if there are too many.
+   */
+  pthread_mutex_lock (&cache_lock);
+  for (ssp = &saved_sessions, n = 0; *ssp != NULL; ) {
+    struct saved_session *old = *ssp;
+
+    if (strcmp (old->key, ss->key) == 0 || n >= MAX_SAVED_SESSIONS - 1) {
+      *ssp = old->next;
+      free (old->key);
+      free (old->data.data);
+      free (old);
+    }
+    else {
+      ssp = &old->next;
+      n++;
+    }
+  }
+  ss->next = saved_sessions;
+  saved_sessions = ss;
+  pthread_mutex_unlock (&cache_lock);
+  debug (h, "saved TLS session for resumption");
+  ss = NULL;
+
+ out:
+  if (ss) {
+    free (ss->data.data);
+    free (ss);
+  }
+  free (key);
+  gnutls_free (data.data);
+}
+
+/* Called at the end of the handshake if nbd_set_tls_kernel_offload
+ * was used, to hand the TLS session over to the kernel if possible.
+ * By this time any messages which the server sends after the TLS
+ * handshake, such as TLS 1.3 session tickets, have been processed by
+ * GnuTLS, and the server is waiting for our first request.  Returns
+ * 0 if the session was handed over or GnuTLS can continue to be
+ * used, or -1 if the connection is no longer usable.
+ */
+int
+nbd_internal_crypto_kernel_offload (struct nbd_handle *h)
+{
+#ifdef USE_KTLS
+  struct socket *sock = h->sock;
+  gnutls_session_t session;
+  gnutls_protocol_t version;
+  gnutls_cipher_algorithm_t cipher;
+  int fd;
+
+  if (sock->ops != &crypto_ops)
+    return 0;
+  session = sock->u.tls.session;
+  version = gnutls_protocol_get_version (session);
+  cipher = gnutls_cipher_get (session);
+  if ((version != GNUTLS_TLS1_2 && version != GNUTLS_TLS1_3) ||
+      (cipher != GNUTLS_CIPHER_AES_128_GCM &&
+       cipher != GNUTLS_CIPHER_AES_256_GCM) ||
+      gnutls_record_check_pending (session) > 0) {
+    debug (h, "kernel TLS offload is not available for this session");
+    return 0;
+  }
+
+  /* Until the keys are set, the socket works as before. */
+  fd = tls_get_fd (sock);
+  if (setsockopt (fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    debug (h, "kernel TLS offload is not available: setsockopt: TCP_ULP: %s",
+           strerror (errno));
+    return 0;
+  }
+  if (set_kernel_crypto_info (h, session, fd, false) == -1 ||
+      set_kernel_crypto_info (h, session, fd, true) == -1)
+    return -1;
+
+  sock->ops = &ktls_ops;
+  debug (h, "TLS session handed over to the kernel");
+#endif
+  return 0;
+}
+
 /* The state machine calls this when TLS has definitely been enabled
  * on the connection (after the handshake), and we use it to print
  * useful debugging information.
@@ -691,6 +1348,8 @@ nbd_internal_crypto_debug_tls_enabled (struct nbd_handle *h)
            gnutls_mac_get_name (mac),
            8 * gnutls_mac_get_key_size (mac)
            );
+    if (gnutls_session_is_resumed (session))
+      debug (h, "TLS session was resumed");
   }
 }
 
@@ -724,4 +1383,19 @@ nbd_internal_crypto_debug_tls_enabled (struct nbd_handle *h)
   abort ();
 }
 
+/* These are called at the end of the handshake if the corresponding
+ * setting was used, whether or not TLS is in use, so there is
+ * nothing to do.
+ */
+int
+nbd_internal_crypto_kernel_offload (struct nbd_handle *h)
+{
+  return 0;
+}
+
+void
+nbd_internal_crypto_save_session (struct nbd_handle *h)
+{
+}
+
 #endif /* !HAVE_GNUTLS */
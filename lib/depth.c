@@ -0,0 +1,151 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Adaptive in-flight depth, see nbd_set_adaptive_depth.
+ *
+ * The state machine only sends a request while fewer than
+ * depth_limit requests are waiting for their replies, and otherwise
+ * leaves commands on cmds_to_issue until a reply arrives.
+ *
+ * depth_limit is adjusted once per round, which lasts until as many
+ * replies as the limit have arrived, by comparing the mean latency
+ * of the round (from sending the request to receiving its reply)
+ * with the lowest latency seen on the connection.  While the mean is
+ * no more than twice the lowest, the server is keeping up, and the
+ * limit grows: doubling each round at first, then by one.  Once the
+ * mean is higher, requests are queueing somewhere, so more of them
+ * in flight only adds latency, and the limit shrinks by a quarter.
+ * The lowest latency is raised a little each time, so that a path
+ * which has become slower is eventually accepted as the new normal.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "internal.h"
+
+/* Start a new round without forgetting what was learned. */
+static void
+new_round (struct nbd_handle *h)
+{
+  h->depth_samples = 0;
+  h->depth_round_us = 0;
+}
+
+int
+nbd_unlocked_set_adaptive_depth (struct nbd_handle *h, unsigned max_depth)
+{
+  h->adaptive_depth = max_depth;
+  h->depth_limit = max_depth < INITIAL_DEPTH ? max_depth : INITIAL_DEPTH;
+  h->depth_slow_start = true;
+  h->depth_min_us = 0;
+  new_round (h);
+
+  /* Send any commands which were held back by the old limit. */
+  if (h->cmds_to_issue != NULL && !h->batching &&
+      nbd_internal_is_state_ready (get_next_state (h)))
+    return nbd_internal_run (h, cmd_issue);
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_adaptive_depth (struct nbd_handle *h)
+{
+  return h->adaptive_depth;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_depth_limit (struct nbd_handle *h)
+{
+  return h->adaptive_depth ? h->depth_limit : 0;
+}
+
+/* Return the number of requests which may be sent now. */
+int
+nbd_internal_depth_slots (struct nbd_handle *h)
+{
+  if (h->adaptive_depth == 0)
+    return INT_MAX;
+  if (h->depth_sent >= h->depth_limit)
+    return 0;
+  return h->depth_limit - h->depth_sent;
+}
+
+/* Called when the request of cmd has been sent. */
+void
+nbd_internal_depth_sent (struct nbd_handle *h, struct command *cmd)
+{
+  h->depth_sent++;
+  if (h->adaptive_depth)
+    cmd->sent_us = nbd_internal_stats_now ();
+}
+
+/* Called when the reply to cmd has arrived. */
+void
+nbd_internal_depth_reply (struct nbd_handle *h, const struct command *cmd)
+{
+  uint64_t latency, mean;
+
+  if (h->depth_sent > 0)
+    h->depth_sent--;
+  if (h->adaptive_depth == 0 || cmd->sent_us == 0)
+    return;
+
+  latency = nbd_internal_stats_now () - cmd->sent_us;
+  if (latency == 0)
+    latency = 1;
+  if (h->depth_min_us == 0 || latency < h->depth_min_us)
+    h->depth_min_us = latency;
+  h->depth_round_us += latency;
+  if (++h->depth_samples < h->depth_limit)
+    return;
+
+  mean = h->depth_round_us / h->depth_samples;
+  if (mean <= 2 * h->depth_min_us) {
+    if (h->depth_slow_start)
+      h->depth_limit *= 2;
+    else
+      h->depth_limit++;
+    if (h->depth_limit > h->adaptive_depth)
+      h->depth_limit = h->adaptive_depth;
+  }
+  else {
+    h->depth_slow_start = false;
+    h->depth_limit -= h->depth_limit / 4;
+    h->depth_min_us += h->depth_min_us / 8;
+  }
+  new_round (h);
+}
+
+/* Called when the connection is closed, and no request is waiting
+ * for a reply any longer.  A new connection may take a different
+ * path, so its latency is learned again.
+ */
+void
+nbd_internal_depth_reset (struct nbd_handle *h)
+{
+  h->depth_sent = 0;
+  h->depth_min_us = 0;
+  new_round (h);
+}
@@ -34,12 +34,8 @@ nbd_unlocked_shutdown (struct nbd_handle *h, uint32_t flags)
     return -1;
   }
 
-  if (!h->disconnect_request &&
-      (nbd_internal_is_state_ready (get_next_state (h)) ||
-       nbd_internal_is_state_processing (get_next_state (h)))) {
-    if (nbd_unlocked_aio_disconnect (h, 0) == -1)
-      return -1;
-  }
+  if (nbd_unlocked_aio_shutdown (h, 0) == -1)
+    return -1;
 
   while (!nbd_internal_is_state_closed (get_next_state (h)) &&
          !nbd_internal_is_state_dead (get_next_state (h))) {
@@ -50,6 +46,21 @@ nbd_unlocked_shutdown (struct nbd_handle *h, uint32_t flags)
   return 0;
 }
 
+int
+nbd_unlocked_aio_shutdown (struct nbd_handle *h, uint32_t flags)
+{
+  if (flags != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if (!h->disconnect_request &&
+      (nbd_internal_is_state_ready (get_next_state (h)) ||
+       nbd_internal_is_state_processing (get_next_state (h))))
+    return nbd_unlocked_aio_disconnect (h, 0);
+  return 0;
+}
+
 int
 nbd_unlocked_aio_disconnect (struct nbd_handle *h, uint32_t flags)
 {
@@ -60,6 +71,12 @@ nbd_unlocked_aio_disconnect (struct nbd_handle *h, uint32_t flags)
     return -1;
   }
 
+  /* NBD_CMD_DISC must be the last command sent, so any batch in
+   * progress is ended first.
+   */
+  if (h->batching && nbd_unlocked_aio_end_batch (h) == -1)
+    return -1;
+
   id = nbd_internal_command_common (h, 0, NBD_CMD_DISC, 0, 0, NULL, NULL);
   if (id == -1)
     return -1;
@@ -0,0 +1,199 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Elevator ordering of queued commands, see nbd_set_elevator.
+ *
+ * Before a batch of requests is sent, the commands at the head of
+ * cmds_to_issue (up to elevator_window of them) are sorted C-LOOK
+ * style: first those at or after elevator_pos, which is where the
+ * last request sent ended, in increasing order of offset, then the
+ * rest, also in increasing order, starting again from the lowest
+ * offset.  The server therefore sees sweeps across the export in one
+ * direction instead of random seeks.
+ *
+ * Commands are never moved across a command which does not address
+ * a range of the export (such as a flush), a priority command, or a
+ * command which overlaps them when either is a write, so sorting
+ * does not change the result of any sequence of commands.  To bound
+ * how long a command can be passed over, once the oldest command in
+ * the window has waited for ELEVATOR_MAX_DELAY_US the sweep restarts
+ * from its offset.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "internal.h"
+
+int
+nbd_unlocked_set_elevator (struct nbd_handle *h, int mode)
+{
+  h->elevator = mode;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_elevator (struct nbd_handle *h)
+{
+  return h->elevator;
+}
+
+int
+nbd_unlocked_set_elevator_window (struct nbd_handle *h, unsigned window)
+{
+  if (window < 2 || window > MAX_ELEVATOR_WINDOW) {
+    set_error (EINVAL, "elevator window must be between 2 and %d",
+               MAX_ELEVATOR_WINDOW);
+    return -1;
+  }
+
+  h->elevator_window = window;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_elevator_window (struct nbd_handle *h)
+{
+  return h->elevator_window;
+}
+
+/* Return true if cmd addresses a range of the export. */
+static bool
+is_ranged (const struct command *cmd)
+{
+  switch (cmd->type) {
+  case NBD_CMD_READ:
+  case NBD_CMD_WRITE:
+  case NBD_CMD_TRIM:
+  case NBD_CMD_WRITE_ZEROES:
+  case NBD_CMD_CACHE:
+  case NBD_CMD_BLOCK_STATUS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool
+is_modifying (const struct command *cmd)
+{
+  return cmd->type == NBD_CMD_WRITE || cmd->type == NBD_CMD_TRIM ||
+    cmd->type == NBD_CMD_WRITE_ZEROES;
+}
+
+/* Return true if the order of a and b matters. */
+static bool
+conflicts (const struct command *a, const struct command *b)
+{
+  return (is_modifying (a) || is_modifying (b)) &&
+    a->offset < b->offset + b->count && b->offset < a->offset + a->count;
+}
+
+/* Return true if cmd should be sent before other. */
+static bool
+sorts_before (const struct command *cmd, const struct command *other,
+              uint64_t pos)
+{
+  bool ahead = cmd->offset >= pos, other_ahead = other->offset >= pos;
+
+  if (ahead != other_ahead)
+    return ahead;
+  return cmd->offset < other->offset;
+}
+
+/* Return true if the elevator applies to the connection. */
+static bool
+elevator_enabled (struct nbd_handle *h)
+{
+  switch (h->elevator) {
+  case LIBNBD_ELEVATOR_ON:
+    return true;
+  case LIBNBD_ELEVATOR_AUTO:
+    return nbd_unlocked_is_rotational (h) == 1;
+  default:
+    return false;
+  }
+}
+
+/* Sort the commands at the head of cmds_to_issue, which must not
+ * have started to be sent.
+ */
+void
+nbd_internal_elevator_sort (struct nbd_handle *h)
+{
+  struct command *window[MAX_ELEVATOR_WINDOW];
+  struct command *cmd, *rest, *oldest;
+  uint64_t pos = h->elevator_pos;
+  size_t n = 0, i, j;
+
+  if (!elevator_enabled (h))
+    return;
+
+  /* Gather the commands which may be sorted. */
+  for (cmd = h->cmds_to_issue; cmd != NULL && n < h->elevator_window;
+       cmd = cmd->next) {
+    if (!is_ranged (cmd) || cmd->priority)
+      break;
+    for (i = 0; i < n; ++i)
+      if (conflicts (window[i], cmd))
+        break;
+    if (i < n)
+      break;
+    window[n++] = cmd;
+  }
+  if (n < 2)
+    return;
+  rest = cmd;
+
+  oldest = window[0];
+  for (i = 1; i < n; ++i)
+    if (window[i]->issued_us < oldest->issued_us)
+      oldest = window[i];
+  if (nbd_internal_stats_now () - oldest->issued_us >= ELEVATOR_MAX_DELAY_US)
+    pos = oldest->offset;
+
+  /* The window is small, so an insertion sort is enough. */
+  for (i = 1; i < n; ++i) {
+    cmd = window[i];
+    for (j = i; j > 0 && sorts_before (cmd, window[j-1], pos); --j)
+      window[j] = window[j-1];
+    window[j] = cmd;
+  }
+
+  h->cmds_to_issue = window[0];
+  for (i = 0; i < n - 1; ++i)
+    window[i]->next = window[i+1];
+  window[n-1]->next = rest;
+  if (rest == NULL)
+    h->cmds_to_issue_tail = window[n-1];
+}
+
+/* Called when the request of cmd has been sent. */
+void
+nbd_internal_elevator_sent (struct nbd_handle *h, const struct command *cmd)
+{
+  if (is_ranged (cmd))
+    h->elevator_pos = cmd->offset + cmd->count;
+}
@@ -20,19 +20,56 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
 #include <errno.h>
 
 #include <pthread.h>
 
 #include "internal.h"
 
+/* Errors are often set and then ignored, for example when a caller
+ * polls nbd_aio_peek_command_completed until a command completes.  So
+ * set_error only records the pieces of the error, and the message
+ * returned by nbd_get_error is put together the first time it is
+ * asked for.  Messages without arguments are not even copied, and the
+ * buffers are kept and reused, so setting an error does not normally
+ * allocate memory.
+ */
 struct last_error {
-  const char *context;         /* Current function context. */
-  char *error;                 /* Error message string. */
   int errnum;                  /* errno value (0 if not available). */
+
+  /* Parts of the error.  context is the function context when the
+   * error was set.  The message is fs if that is non-NULL, otherwise
+   * it is formatted in msg.
+   */
+  const char *error_context;
+  const char *fs;
+  char *msg;
+  size_t msg_size;
+
+  /* Error message string, built by nbd_get_error or set directly by
+   * nbd_internal_set_last_error.  Only valid if error_valid is true.
+   */
+  char *error;
+  size_t error_size;
+  bool error_valid;
+  bool have_error;             /* Any error has been set. */
 };
 
-/* Thread-local storage of the last error. */
+/* The function context is set on entry to every API call, so it is
+ * kept in its own thread-local variable and costs one store (see
+ * nbd_internal_set_error_context in internal.h).  The rest of the
+ * last error is only allocated when the thread first sets an error.
+ * Thread-local variables cannot have destructors, so the pointer is
+ * also stored under errors_key just to free it when the thread
+ * exits.
+ */
+__thread const char *nbd_internal_error_context
+  __attribute__((tls_model ("initial-exec")));
+static __thread struct last_error *last_error_tls
+  __attribute__((tls_model ("initial-exec")));
 static pthread_key_t errors_key;
 
 static void free_errors_key (void *vp);
@@ -70,6 +107,9 @@ free_errors_key (void *vp)
 {
   struct last_error *last_error = vp;
 
+  if (last_error_tls == last_error)
+    last_error_tls = NULL;
+  free (last_error->msg);
   free (last_error->error);
   free (last_error);
 }
@@ -77,28 +117,92 @@ free_errors_key (void *vp)
 static struct last_error *
 allocate_last_error_on_demand (void)
 {
-  struct last_error *last_error = pthread_getspecific (errors_key);
+  struct last_error *last_error = last_error_tls;
 
   if (!last_error) {
     last_error = calloc (1, sizeof *last_error);
-    if (last_error)
+    if (last_error) {
+      last_error_tls = last_error;
       pthread_setspecific (errors_key, last_error);
+    }
   }
   return last_error;
 }
 
-/* Called on entry to any API function that can call an error function
- * (see generator "may_set_error") to reset the error context.  The
- * 'context' parameter is the name of the function.
+/* Format into *buf, growing it if necessary.  Returns -1 if there
+ * was not enough memory.
+ */
+static int
+format_into (char **buf, size_t *size, const char *fs, va_list args)
+{
+  va_list args2;
+  char *p;
+  int r;
+
+  va_copy (args2, args);
+  r = vsnprintf (*buf, *size, fs, args2);
+  va_end (args2);
+  if (r < 0)
+    return -1;
+  if ((size_t) r < *size)
+    return 0;
+
+  p = realloc (*buf, r + 1);
+  if (p == NULL)
+    return -1;
+  *buf = p;
+  *size = r + 1;
+  r = vsnprintf (*buf, *size, fs, args);
+  return r < 0 ? -1 : 0;
+}
+
+static int
+format_error (char **buf, size_t *size, const char *fs, ...)
+{
+  va_list args;
+  int r;
+
+  va_start (args, fs);
+  r = format_into (buf, size, fs, args);
+  va_end (args);
+  return r;
+}
+
+/* This is called by the set_error macro.  Note this preserves the
+ * value of errno.
  */
 void
-nbd_internal_set_error_context (const char *context)
+nbd_internal_set_error (int errnum, const char *fs, ...)
 {
   struct last_error *last_error = allocate_last_error_on_demand ();
+  int err = errno;
+  va_list args;
 
-  if (!last_error)
+  if (!last_error) {
+    /* At least we shouldn't lose the error. */
+    perror ("nbd_internal_set_error: calloc");
+    fprintf (stderr, "nbd_internal_set_error: lost error: %s (%d)\n",
+             fs, errnum);
+    errno = err;
     return;
-  last_error->context = context;
+  }
+
+  last_error->error_context = nbd_internal_error_context ? : "unknown";
+  last_error->errnum = errnum;
+  last_error->error_valid = false;
+  last_error->have_error = true;
+
+  if (strchr (fs, '%') == NULL)
+    last_error->fs = fs;
+  else {
+    last_error->fs = NULL;
+    va_start (args, fs);
+    if (format_into (&last_error->msg, &last_error->msg_size,
+                     fs, args) == -1)
+      last_error->fs = fs; /* Better than nothing. */
+    va_end (args);
+  }
+  errno = err;
 }
 
 void
@@ -111,36 +215,48 @@ nbd_internal_set_last_error (int errnum, char *error)
     perror ("nbd_internal_set_last_error: calloc");
     fprintf (stderr, "nbd_internal_set_last_error: lost error: %s (%d)\n",
              error, errnum);
+    free (error);
     return;
   }
 
   free (last_error->error);
   last_error->error = error;
+  last_error->error_size = strlen (error) + 1;
   last_error->errnum = errnum;
-}
-
-const char *
-nbd_internal_get_error_context (void)
-{
-  struct last_error *last_error = allocate_last_error_on_demand ();
-
-  return last_error ? last_error->context : NULL;
+  last_error->error_valid = true;
+  last_error->have_error = true;
 }
 
 const char *
 nbd_get_error (void)
 {
-  struct last_error *last_error = pthread_getspecific (errors_key);
+  struct last_error *last_error = last_error_tls;
+  const char *msg;
+  int r;
 
-  if (!last_error)
+  if (!last_error || !last_error->have_error)
+    return NULL;
+  if (last_error->error_valid)
+    return last_error->error;
+
+  msg = last_error->fs ? : last_error->msg;
+  if (last_error->errnum == 0)
+    r = format_error (&last_error->error, &last_error->error_size,
+                      "%s: %s", last_error->error_context, msg);
+  else
+    r = format_error (&last_error->error, &last_error->error_size,
+                      "%s: %s: %s", last_error->error_context, msg,
+                      strerror (last_error->errnum));
+  if (r == -1)
     return NULL;
+  last_error->error_valid = true;
   return last_error->error;
 }
 
 int
 nbd_get_errno (void)
 {
-  struct last_error *last_error = pthread_getspecific (errors_key);
+  struct last_error *last_error = last_error_tls;
 
   if (!last_error)
     return 0;
@@ -0,0 +1,361 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Extent cache, see nbd_set_extent_cache.
+ *
+ * Each meta context keeps the extents the server has told us about
+ * in an array sorted by offset, with no overlaps, so lookups are a
+ * binary search.  Neighbouring extents with the same flags are
+ * merged to keep the array short.
+ *
+ * Commands which change the data (write, trim and zero) remove their
+ * range from the cache both when they are issued and when they
+ * complete, and bump extent_cache_gen each time.  A block status
+ * reply is only added to the cache if extent_cache_gen has not
+ * changed since the block status command was issued.  This ensures
+ * that a reply is never cached if the server might have processed it
+ * before a write which overlaps it, while the cached data from
+ * before the write is removed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+
+/* Forget all the extents of a context if it has more than this. */
+#define MAX_CACHED_EXTENTS (1024 * 1024)
+
+struct cached_extent {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t flags;
+};
+
+int
+nbd_unlocked_set_extent_cache (struct nbd_handle *h, bool enable)
+{
+  struct meta_context *m;
+
+  if (!enable) {
+    for (m = h->meta_contexts; m != NULL; m = m->next)
+      nbd_internal_extent_cache_free (m);
+  }
+  h->extent_cache = enable;
+  h->extent_cache_gen++;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_extent_cache (struct nbd_handle *h)
+{
+  return h->extent_cache;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_extent_cache_hits (struct nbd_handle *h)
+{
+  return h->extent_cache_hits;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_extent_cache_misses (struct nbd_handle *h)
+{
+  return h->extent_cache_misses;
+}
+
+void
+nbd_internal_extent_cache_free (struct meta_context *m)
+{
+  free (m->extents);
+  m->extents = NULL;
+  m->nr_extents = m->extents_alloc = 0;
+}
+
+static inline uint64_t
+extent_end (const struct cached_extent *e)
+{
+  return e->offset + e->length;
+}
+
+/* Return the index of the first extent which ends after offset. */
+static size_t
+find_extent (const struct meta_context *m, uint64_t offset)
+{
+  size_t lo = 0, hi = m->nr_extents;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (extent_end (&m->extents[mid]) <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Make room for n extents at index i. */
+static int
+insert_space (struct meta_context *m, size_t i, size_t n)
+{
+  if (m->nr_extents + n > m->extents_alloc) {
+    size_t alloc = m->extents_alloc ? m->extents_alloc * 2 : 64;
+    struct cached_extent *p;
+
+    while (alloc < m->nr_extents + n)
+      alloc *= 2;
+    p = realloc (m->extents, alloc * sizeof *p);
+    if (p == NULL)
+      return -1;
+    m->extents = p;
+    m->extents_alloc = alloc;
+  }
+  memmove (&m->extents[i + n], &m->extents[i],
+           (m->nr_extents - i) * sizeof m->extents[0]);
+  m->nr_extents += n;
+  return 0;
+}
+
+static void
+delete_extents (struct meta_context *m, size_t i, size_t n)
+{
+  memmove (&m->extents[i], &m->extents[i + n],
+           (m->nr_extents - i - n) * sizeof m->extents[0]);
+  m->nr_extents -= n;
+}
+
+/* Remove [offset, end) from the cache of one context.  This can
+ * only fail if an extent has to be split and there is no memory, in
+ * which case the whole cache of the context is dropped.
+ */
+static void
+remove_range (struct meta_context *m, uint64_t offset, uint64_t end)
+{
+  struct cached_extent *e;
+  size_t i, j;
+
+  i = find_extent (m, offset);
+  if (i < m->nr_extents && m->extents[i].offset < offset) {
+    e = &m->extents[i];
+    if (extent_end (e) > end) {
+      /* Split the extent around the range. */
+      const struct cached_extent tail = {
+        .offset = end, .length = extent_end (e) - end, .flags = e->flags
+      };
+
+      if (insert_space (m, i + 1, 1) == -1) {
+        nbd_internal_extent_cache_free (m);
+        return;
+      }
+      m->extents[i].length = offset - m->extents[i].offset;
+      m->extents[i + 1] = tail;
+      return;
+    }
+    e->length = offset - e->offset;
+    i++;
+  }
+
+  for (j = i; j < m->nr_extents && extent_end (&m->extents[j]) <= end; ++j)
+    ;
+  if (j < m->nr_extents && m->extents[j].offset < end) {
+    e = &m->extents[j];
+    e->length = extent_end (e) - end;
+    e->offset = end;
+  }
+  delete_extents (m, i, j - i);
+}
+
+static void
+add_extent (struct meta_context *m, uint64_t offset, uint64_t length,
+            uint32_t flags)
+{
+  struct cached_extent *prev, *next;
+  size_t i;
+
+  remove_range (m, offset, offset + length);
+  i = find_extent (m, offset);
+
+  /* Merge with the neighbours if possible. */
+  prev = i > 0 ? &m->extents[i - 1] : NULL;
+  next = i < m->nr_extents ? &m->extents[i] : NULL;
+  if (prev && extent_end (prev) == offset && prev->flags == flags) {
+    prev->length += length;
+    if (next && next->offset == extent_end (prev) && next->flags == flags) {
+      prev->length += next->length;
+      delete_extents (m, i, 1);
+    }
+    return;
+  }
+  if (next && next->offset == offset + length && next->flags == flags) {
+    next->offset = offset;
+    next->length += length;
+    return;
+  }
+
+  if (m->nr_extents >= MAX_CACHED_EXTENTS ||
+      insert_space (m, i, 1) == -1) {
+    nbd_internal_extent_cache_free (m);
+    return;
+  }
+  m->extents[i].offset = offset;
+  m->extents[i].length = length;
+  m->extents[i].flags = flags;
+}
+
+/* Called when a command which changes [offset, offset+count) is
+ * issued or completes.
+ */
+void
+nbd_internal_extent_cache_invalidate (struct nbd_handle *h,
+                                      uint64_t offset, uint64_t count)
+{
+  struct meta_context *m;
+
+  h->extent_cache_gen++;
+  for (m = h->meta_contexts; m != NULL; m = m->next)
+    remove_range (m, offset, offset + count);
+}
+
+/* Called with the entries of a block status reply for context m
+ * which starts at offset.  The entries are already in host byte
+ * order.
+ */
+void
+nbd_internal_extent_cache_add (struct nbd_handle *h, struct meta_context *m,
+                               uint64_t offset, const uint32_t *entries,
+                               size_t nr_entries)
+{
+  size_t i;
+
+  for (i = 0; i + 1 < nr_entries; i += 2) {
+    if (entries[i] == 0 || offset + entries[i] < offset)
+      break;
+    add_extent (m, offset, entries[i], entries[i + 1]);
+    offset += entries[i];
+  }
+}
+
+/* Build the extent entries for [offset, offset+count) of context m
+ * in h->extent_cache_entries, returning the number of entries, or 0
+ * if the cache does not cover the whole range.
+ */
+static size_t
+lookup (struct nbd_handle *h, struct meta_context *m,
+        uint64_t offset, uint64_t count, bool req_one)
+{
+  const uint64_t end = offset + count;
+  uint64_t pos = offset;
+  size_t i, n = 0;
+
+  i = find_extent (m, offset);
+  while (pos < end) {
+    uint64_t len;
+
+    if (i >= m->nr_extents || m->extents[i].offset > pos)
+      return 0;
+    len = extent_end (&m->extents[i]) - pos;
+    if (req_one && len > count)
+      len = count;
+    if (len > MAX_ENTRY_LENGTH)
+      len = MAX_ENTRY_LENGTH;
+
+    if (n + 2 > h->extent_cache_entries_alloc) {
+      size_t alloc = h->extent_cache_entries_alloc ? : 64;
+      uint32_t *p;
+
+      while (alloc < n + 2)
+        alloc *= 2;
+      p = realloc (h->extent_cache_entries, alloc * sizeof *p);
+      if (p == NULL)
+        return 0;
+      h->extent_cache_entries = p;
+      h->extent_cache_entries_alloc = alloc;
+    }
+    h->extent_cache_entries[n++] = len;
+    h->extent_cache_entries[n++] = m->extents[i].flags;
+    if (req_one)
+      break;
+
+    pos += len;
+    if (pos == extent_end (&m->extents[i]))
+      i++;
+  }
+  return n;
+}
+
+/* Try to answer a block status request from the cache.  Returns 1
+ * if it was answered, after calling the extent callback for every
+ * context, 0 if the request must be sent to the server, or -1 if the
+ * extent callback failed.
+ */
+int
+nbd_internal_extent_cache_block_status (struct nbd_handle *h,
+                                        uint64_t count, uint64_t offset,
+                                        nbd_extent_callback *extent,
+                                        uint32_t flags)
+{
+  const bool req_one = (flags & LIBNBD_CMD_FLAG_REQ_ONE) != 0;
+  const bool coalesce = (flags & LIBNBD_CMD_FLAG_COALESCE) != 0;
+  struct meta_context *m;
+  int err = 0;
+  size_t n;
+
+  if (h->meta_contexts == NULL || count == 0 ||
+      (flags & ~(LIBNBD_CMD_FLAG_REQ_ONE | LIBNBD_CMD_FLAG_PRIORITY |
+                 LIBNBD_CMD_FLAG_COALESCE)) != 0 ||
+      offset + count < offset)
+    return 0;
+
+  for (m = h->meta_contexts; m != NULL; m = m->next) {
+    if (lookup (h, m, offset, count, req_one) == 0) {
+      h->extent_cache_misses++;
+      return 0;
+    }
+  }
+
+  /* As for a reply from the server, a failing callback fails the
+   * command but the remaining contexts are still passed to it.
+   */
+  h->extent_cache_hits++;
+  for (m = h->meta_contexts; m != NULL; m = m->next) {
+    int e = err;
+
+    n = lookup (h, m, offset, count, req_one);
+    if (coalesce)
+      n = nbd_internal_coalesce_extents (h->extent_cache_entries, n);
+    if (CALL_CALLBACK (*extent, m->name, offset,
+                       h->extent_cache_entries, n, &e) == -1 && err == 0)
+      err = e ? e : EPROTO;
+  }
+  FREE_CALLBACK (*extent);
+  if (err) {
+    set_error (err, "%s: command failed",
+               nbd_internal_name_of_nbd_cmd (NBD_CMD_BLOCK_STATUS));
+    return -1;
+  }
+  return 1;
+}
@@ -53,11 +53,79 @@ nbd_internal_set_size_and_flags (struct nbd_handle *h,
     eflags &= ~NBD_FLAG_SEND_FAST_ZERO;
   }
 
+  /* Calls such as nbd_get_size and nbd_can_flush read these without
+   * the lock, so they must not change when reconnecting.
+   */
+  if (h->reconnecting && exportsize != h->exportsize) {
+    set_error (EIO, "handshake: export size changed from %" PRIu64
+               " to %" PRIu64 " when reconnecting",
+               h->exportsize, exportsize);
+    return -1;
+  }
+  if (h->reconnecting && eflags != h->eflags) {
+    set_error (EIO, "handshake: export flags changed from 0x%" PRIx16
+               " to 0x%" PRIx16 " when reconnecting",
+               h->eflags, eflags);
+    return -1;
+  }
+
   h->exportsize = exportsize;
   h->eflags = eflags;
   return 0;
 }
 
+static bool
+is_power_of_2 (uint32_t v)
+{
+  return v && (v & (v - 1)) == 0;
+}
+
+/* Save the NBD_INFO_BLOCK_SIZE constraints, ignoring them if they
+ * break the rules in the NBD protocol.  When reconnecting they must
+ * be the same as before, as for the export size.
+ */
+int
+nbd_internal_set_block_size (struct nbd_handle *h, uint32_t minimum,
+                             uint32_t preferred, uint32_t maximum)
+{
+  debug (h, "server block size constraints: "
+         "minimum: %" PRIu32 " preferred: %" PRIu32 " maximum: %" PRIu32,
+         minimum, preferred, maximum);
+
+  if (!is_power_of_2 (minimum) || minimum > 64 * 1024 ||
+      !is_power_of_2 (preferred) || preferred < minimum ||
+      maximum < minimum ||
+      (maximum != UINT32_MAX && maximum % minimum != 0)) {
+    debug (h, "ignoring invalid block size constraints from server");
+    return 0;
+  }
+
+  if (h->reconnecting &&
+      (minimum != h->block_minimum || preferred != h->block_preferred ||
+       maximum != h->block_maximum)) {
+    set_error (EIO, "handshake: block size constraints changed "
+               "when reconnecting");
+    return -1;
+  }
+
+  h->block_minimum = minimum;
+  h->block_preferred = preferred;
+  h->block_maximum = maximum;
+  return 0;
+}
+
+/* The largest read or write request that may be issued, taking into
+ * account both the caller's limit and the server's maximum block
+ * size.
+ */
+uint32_t
+nbd_internal_max_request_size (struct nbd_handle *h)
+{
+  if (h->block_maximum && h->block_maximum < h->max_request_size)
+    return h->block_maximum;
+  return h->max_request_size;
+}
+
 static int
 get_flag (struct nbd_handle *h, uint16_t flag)
 {
@@ -143,6 +211,26 @@ nbd_unlocked_can_meta_context (struct nbd_handle *h, const char *name)
   return 0;
 }
 
+int64_t
+nbd_unlocked_get_block_size (struct nbd_handle *h, int type)
+{
+  if (h->eflags == 0) {
+    set_error (EINVAL, "server has not returned export flags, "
+               "you need to connect to the server first");
+    return -1;
+  }
+
+  switch (type) {
+  case LIBNBD_SIZE_MINIMUM:
+    return h->block_minimum;
+  case LIBNBD_SIZE_PREFERRED:
+    return h->block_preferred;
+  case LIBNBD_SIZE_MAXIMUM:
+    return h->block_maximum;
+  }
+  abort ();                     /* checked by the generator */
+}
+
 int64_t
 nbd_unlocked_get_size (struct nbd_handle *h)
 {
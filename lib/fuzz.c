@@ -0,0 +1,141 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* struct socket_ops for a phony server which sends the bytes of a
+ * buffer and throws away everything sent to it, used by the fuzzers
+ * in fuzzing/ so that each test case does not need a process and a
+ * real socket.
+ *
+ * Since all the data is there at once, the socket is always pending
+ * and the state machine never waits for it: once the buffer has been
+ * used up, recv returns end of file and the handle dies.  get_fd
+ * still returns a socket which is always readable and writable, in
+ * case anything polls it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "internal.h"
+
+static ssize_t
+fuzz_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
+{
+  if (len > sock->u.fuzz.size)
+    len = sock->u.fuzz.size;
+  memcpy (buf, sock->u.fuzz.data, len);
+  sock->u.fuzz.data += len;
+  sock->u.fuzz.size -= len;
+  return len;
+}
+
+static ssize_t
+fuzz_send (struct nbd_handle *h,
+           struct socket *sock, const void *buf, size_t len, int flags)
+{
+  return len;
+}
+
+static bool
+fuzz_pending (struct socket *sock)
+{
+  return true;
+}
+
+static int
+fuzz_get_fd (struct socket *sock)
+{
+  return sock->u.fuzz.fd[0];
+}
+
+static int
+fuzz_close (struct socket *sock)
+{
+  close (sock->u.fuzz.fd[0]);
+  close (sock->u.fuzz.fd[1]);
+  free (sock);
+  return 0;
+}
+
+static struct socket_ops fuzz_ops = {
+  .recv = fuzz_recv,
+  .send = fuzz_send,
+  .pending = fuzz_pending,
+  .get_fd = fuzz_get_fd,
+  .close = fuzz_close,
+};
+
+/* Connect the handle to a phony server which sends the size bytes at
+ * data, which must stay valid until the handle is closed.  This
+ * returns when the handshake has finished or failed, like
+ * nbd_connect_socket.
+ */
+int
+nbd_internal_fuzz_connect (struct nbd_handle *h,
+                           const void *data, size_t size)
+{
+  struct socket *sock;
+  int ret = -1;
+
+  nbd_internal_set_error_context ("nbd_internal_fuzz_connect");
+  pthread_mutex_lock (&h->lock);
+
+  if (!nbd_internal_is_state_created (get_next_state (h))) {
+    set_error (EINVAL, "the handle must be newly created");
+    goto out;
+  }
+
+  sock = malloc (sizeof *sock);
+  if (sock == NULL) {
+    set_error (errno, "malloc");
+    goto out;
+  }
+  if (socketpair (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0,
+                  sock->u.fuzz.fd) == -1) {
+    set_error (errno, "socketpair");
+    free (sock);
+    goto out;
+  }
+  /* Keep a byte waiting so that poll always finds the socket readable. */
+  if (write (sock->u.fuzz.fd[1], "", 1) != 1) {
+    set_error (errno, "write");
+    fuzz_close (sock);
+    goto out;
+  }
+  sock->u.fuzz.data = data;
+  sock->u.fuzz.size = size;
+  sock->ops = &fuzz_ops;
+  h->sock = sock;
+
+  if (nbd_internal_run (h, cmd_connect_socket) == 0)
+    ret = nbd_internal_wait_until_connected (h);
+
+ out:
+  nbd_internal_update_public_state (h);
+  pthread_mutex_unlock (&h->lock);
+  return ret;
+}
@@ -0,0 +1,800 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Groups of handles connected to the same export, see
+ * nbd_group_create(3).  These are implemented only in terms of the
+ * public API on the member handles, so each handle keeps its own
+ * lock and the group lock only protects the group's scratch space.
+ * The worker threads which a group may have are in lib/workers.c.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+/* Default size of the ranges of nbd_group_map, and how many block
+ * status commands it keeps in flight on each handle.
+ */
+#define DEFAULT_MAP_RANGE_SIZE (UINT64_C (1) << 30)
+#define MAP_REQUESTS_PER_HANDLE 4
+
+/* Create a group of new handles, or of handles with the same
+ * settings as template if it is not NULL.
+ */
+static struct nbd_group *
+group_create (struct nbd_handle *template, int nr_handles)
+{
+  struct nbd_group *g;
+  pthread_condattr_t attr;
+  int i;
+
+  if (nr_handles < 1) {
+    set_error (EINVAL, "number of handles must be at least 1");
+    return NULL;
+  }
+
+  g = calloc (1, sizeof *g);
+  if (g == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  pthread_mutex_init (&g->lock, NULL);
+  pthread_mutex_init (&g->workers_lock, NULL);
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&g->workers_cond, &attr);
+  pthread_condattr_destroy (&attr);
+  g->handles = calloc (nr_handles, sizeof g->handles[0]);
+  g->fds = calloc (nr_handles, sizeof g->fds[0]);
+  if (g->handles == NULL || g->fds == NULL) {
+    set_error (errno, "calloc");
+    goto err;
+  }
+  for (i = 0; i < nr_handles; ++i) {
+    if (template)
+      g->handles[i] = nbd_create_from (template);
+    else
+      g->handles[i] = nbd_create ();
+    if (g->handles[i] == NULL)
+      goto err;
+    g->nr_handles++;
+  }
+
+  return g;
+
+ err:
+  nbd_group_close (g);
+  return NULL;
+}
+
+struct nbd_group *
+nbd_group_create (int nr_handles)
+{
+  nbd_internal_set_error_context ("nbd_group_create");
+  return group_create (NULL, nr_handles);
+}
+
+struct nbd_group *
+nbd_group_create_from (struct nbd_handle *template, int nr_handles)
+{
+  nbd_internal_set_error_context ("nbd_group_create_from");
+  return group_create (template, nr_handles);
+}
+
+void
+nbd_group_close (struct nbd_group *g)
+{
+  int i;
+
+  if (g == NULL)
+    return;
+
+  nbd_group_stop_workers (g);
+  for (i = 0; i < g->nr_handles; ++i)
+    nbd_close (g->handles[i]);
+  free (g->handles);
+  free (g->fds);
+  pthread_cond_destroy (&g->workers_cond);
+  pthread_mutex_destroy (&g->workers_lock);
+  pthread_mutex_destroy (&g->lock);
+  free (g);
+}
+
+int
+nbd_group_get_nr_handles (struct nbd_group *g)
+{
+  return g->nr_handles;
+}
+
+struct nbd_handle *
+nbd_group_get_handle (struct nbd_group *g, int i)
+{
+  nbd_internal_set_error_context ("nbd_group_get_handle");
+
+  if (i < 0 || i >= g->nr_handles) {
+    set_error (EINVAL, "handle index %d out of range", i);
+    return NULL;
+  }
+  return g->handles[i];
+}
+
+/* Poll every handle in the group which has something to poll for,
+ * like nbd_poll(3) for a single handle.
+ */
+static int
+group_poll (struct nbd_group *g, int timeout)
+{
+  struct nbd_handle *h;
+  int i, nr_fds = 0, r = 0, t, timer = -1;
+  unsigned dir;
+
+  /* The workers are already polling the handles. */
+  if (g->nr_workers > 0)
+    return nbd_internal_group_wait_workers (g, timeout);
+
+  pthread_mutex_lock (&g->lock);
+
+  for (i = 0; i < g->nr_handles; ++i) {
+    h = g->handles[i];
+    g->fds[i].fd = -1;
+    g->fds[i].events = 0;
+    g->fds[i].revents = 0;
+    switch (nbd_aio_get_direction (h)) {
+    case LIBNBD_AIO_DIRECTION_READ:
+      g->fds[i].events = POLLIN;
+      break;
+    case LIBNBD_AIO_DIRECTION_WRITE:
+      g->fds[i].events = POLLOUT;
+      break;
+    case LIBNBD_AIO_DIRECTION_BOTH:
+      g->fds[i].events = POLLIN|POLLOUT;
+      break;
+    default:
+      continue;
+    }
+    g->fds[i].fd = nbd_aio_get_fd (h);
+    if (g->fds[i].fd >= 0)
+      nr_fds++;
+    t = nbd_aio_get_timer (h);
+    if (t >= 0 && (timer == -1 || t < timer))
+      timer = t;
+  }
+
+  nbd_internal_set_error_context ("nbd_group_poll");
+  if (nr_fds == 0) {
+    set_error (EINVAL, "nothing to poll for on any handle in the group");
+    r = -1;
+    goto out;
+  }
+
+  /* See nbd_aio_get_timer. */
+  if (timer >= 0 && (timeout < 0 || timer < timeout))
+    timeout = timer;
+  else
+    timer = -1;
+
+  r = poll (g->fds, g->nr_handles, timeout);
+  if (r == -1) {
+    set_error (errno, "poll");
+    goto out;
+  }
+  if (r == 0) {
+    if (timer == -1)
+      goto out;
+    r = 1;
+    for (i = 0; i < g->nr_handles && r == 1; ++i) {
+      if (nbd_aio_get_timer (g->handles[i]) == 0 &&
+          nbd_aio_notify_timer (g->handles[i]) == -1)
+        r = -1;
+    }
+    goto out;
+  }
+
+  /* See lib/poll.c for why only one notification is sent. */
+  r = 1;
+  for (i = 0; i < g->nr_handles; ++i) {
+    h = g->handles[i];
+    dir = nbd_aio_get_direction (h);
+    if ((g->fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+        (dir & LIBNBD_AIO_DIRECTION_READ) != 0) {
+      if (nbd_aio_notify_read (h) == -1)
+        r = -1;
+    }
+    else if ((g->fds[i].revents &
+              (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+             (dir & LIBNBD_AIO_DIRECTION_WRITE) != 0) {
+      if (nbd_aio_notify_write (h) == -1)
+        r = -1;
+    }
+    else if ((g->fds[i].revents & (POLLERR | POLLNVAL)) != 0) {
+      nbd_internal_set_error_context ("nbd_group_poll");
+      set_error (ENOTCONN, "server closed socket unexpectedly");
+      r = -1;
+    }
+    if (r == -1)
+      break;
+  }
+
+ out:
+  pthread_mutex_unlock (&g->lock);
+  return r;
+}
+
+int
+nbd_group_poll (struct nbd_group *g, int timeout)
+{
+  return group_poll (g, timeout);
+}
+
+/* After connecting, check that every handle sees the same export. */
+static int
+check_consistent (struct nbd_group *g)
+{
+  struct nbd_handle *h0 = g->handles[0], *h;
+  uint64_t size;
+  uint16_t eflags;
+  int i;
+
+  pthread_mutex_lock (&h0->lock);
+  size = h0->exportsize;
+  eflags = h0->eflags;
+  pthread_mutex_unlock (&h0->lock);
+
+  for (i = 1; i < g->nr_handles; ++i) {
+    bool ok;
+
+    h = g->handles[i];
+    pthread_mutex_lock (&h->lock);
+    ok = h->exportsize == size && h->eflags == eflags;
+    pthread_mutex_unlock (&h->lock);
+    if (!ok) {
+      set_error (0, "connection %d does not match connection 0: "
+                 "the server reported a different export size or flags", i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Change the number of handles in the group to the connections=N
+ * asked for by the URI (see nbd_set_uri_allow_settings).  The
+ * connected first handle is kept, and new handles copy its settings.
+ */
+static int
+resize_group (struct nbd_group *g, int nr_handles)
+{
+  struct nbd_handle **handles;
+  struct pollfd *fds;
+
+  if (g->workers != NULL) {
+    set_error (EBUSY, "cannot change the number of handles "
+               "while worker threads are running");
+    return -1;
+  }
+
+  while (g->nr_handles > nr_handles)
+    nbd_close (g->handles[--g->nr_handles]);
+
+  if (g->nr_handles < nr_handles) {
+    handles = realloc (g->handles, nr_handles * sizeof g->handles[0]);
+    if (handles == NULL) {
+      set_error (errno, "realloc");
+      return -1;
+    }
+    g->handles = handles;
+    fds = realloc (g->fds, nr_handles * sizeof g->fds[0]);
+    if (fds == NULL) {
+      set_error (errno, "realloc");
+      return -1;
+    }
+    g->fds = fds;
+    while (g->nr_handles < nr_handles) {
+      g->handles[g->nr_handles] = nbd_create_from (g->handles[0]);
+      if (g->handles[g->nr_handles] == NULL)
+        return -1;
+      g->nr_handles++;
+    }
+  }
+
+  return 0;
+}
+
+int
+nbd_group_connect_uri (struct nbd_group *g, const char *uri)
+{
+  bool connecting;
+  int i, n;
+
+  /* Connect the first handle synchronously, so we can check for
+   * multi-conn support before opening the other connections.
+   */
+  if (nbd_connect_uri (g->handles[0], uri) == -1)
+    return -1;
+
+  n = nbd_internal_uri_connections (g->handles[0]);
+  if (n > 0 && n != g->nr_handles) {
+    nbd_internal_set_error_context ("nbd_group_connect_uri");
+    debug (g->handles[0], "URI asks for %d connections", n);
+    if (resize_group (g, n) == -1)
+      return -1;
+  }
+
+  if (g->nr_handles > 1 && nbd_can_multi_conn (g->handles[0]) != 1) {
+    nbd_internal_set_error_context ("nbd_group_connect_uri");
+    set_error (ENOTSUP, "server does not support multiple connections, "
+               "use a group with only one handle");
+    return -1;
+  }
+
+  /* Connect the remaining handles in parallel. */
+  for (i = 1; i < g->nr_handles; ++i) {
+    if (nbd_aio_connect_uri (g->handles[i], uri) == -1)
+      return -1;
+  }
+  for (;;) {
+    connecting = false;
+    for (i = 1; i < g->nr_handles; ++i) {
+      if (nbd_aio_is_connecting (g->handles[i]))
+        connecting = true;
+      else if (!nbd_aio_is_ready (g->handles[i])) {
+        nbd_internal_set_error_context ("nbd_group_connect_uri");
+        set_error (ENOTCONN, "connection %d failed", i);
+        return -1;
+      }
+    }
+    if (!connecting)
+      break;
+    if (group_poll (g, -1) == -1)
+      return -1;
+  }
+
+  nbd_internal_set_error_context ("nbd_group_connect_uri");
+  return check_consistent (g);
+}
+
+int
+nbd_group_set_stripe_size (struct nbd_group *g, uint64_t stripe_size)
+{
+  g->stripe_size = stripe_size;
+  return 0;
+}
+
+uint64_t
+nbd_group_get_stripe_size (struct nbd_group *g)
+{
+  return g->stripe_size;
+}
+
+/* Each handle gets an equal share of the rate, rounded up so that a
+ * small rate does not become no limit at all.
+ */
+int
+nbd_group_set_rate_limit (struct nbd_group *g, int limit, uint64_t rate)
+{
+  uint64_t share = rate / g->nr_handles + (rate % g->nr_handles != 0);
+  int i;
+
+  for (i = 0; i < g->nr_handles; ++i) {
+    if (nbd_set_rate_limit (g->handles[i], limit, share) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* As for nbd_group_set_rate_limit, each handle gets an equal share. */
+int
+nbd_group_set_max_bytes_in_flight (struct nbd_group *g, uint64_t max,
+                                   bool wait)
+{
+  uint64_t share = max / g->nr_handles + (max % g->nr_handles != 0);
+  int i;
+
+  for (i = 0; i < g->nr_handles; ++i) {
+    if (nbd_set_max_bytes_in_flight (g->handles[i], share, wait) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+struct nbd_handle *
+nbd_group_select (struct nbd_group *g, uint64_t offset)
+{
+  unsigned start;
+  int i, j, best, in_flight, best_in_flight;
+
+  if (g->stripe_size > 0)
+    return g->handles[(offset / g->stripe_size) % g->nr_handles];
+
+  /* Pick the handle with the fewest commands in flight, starting at
+   * a different handle each time so that ties are spread out.
+   */
+  start = g->next++;
+  best = start % g->nr_handles;
+  best_in_flight = nbd_aio_in_flight (g->handles[best]);
+  for (i = 1; i < g->nr_handles && best_in_flight != 0; ++i) {
+    j = (start + i) % g->nr_handles;
+    in_flight = nbd_aio_in_flight (g->handles[j]);
+    if (in_flight >= 0 && (best_in_flight < 0 || in_flight < best_in_flight)) {
+      best = j;
+      best_in_flight = in_flight;
+    }
+  }
+  return g->handles[best];
+}
+
+/* Save a copy of the current thread's error, unless an earlier one
+ * was already saved, so it can be restored with
+ * nbd_internal_set_last_error after making other calls.
+ */
+static void
+save_error (bool *failed, int *err, char **msg)
+{
+  const char *s = nbd_get_error ();
+
+  if (*failed)
+    return;
+  *failed = true;
+  *err = nbd_get_errno ();
+  *msg = s ? strdup (s) : NULL;
+}
+
+int
+nbd_group_flush (struct nbd_group *g, uint32_t flags)
+{
+  int64_t *cookies;
+  int i, r, err = 0;
+  char *msg = NULL;
+  bool failed = false, waiting;
+
+  nbd_internal_set_error_context ("nbd_group_flush");
+  cookies = calloc (g->nr_handles, sizeof cookies[0]);
+  if (cookies == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+
+  /* Flushes are sent on every connection so that all writes which
+   * have completed on any connection are persistent.  The first
+   * failure is reported, but we still wait for every flush which was
+   * issued.
+   */
+  for (i = 0; i < g->nr_handles; ++i) {
+    if (nbd_can_flush (g->handles[i]) != 1)
+      continue;
+    cookies[i] = nbd_aio_flush (g->handles[i], NBD_NULL_COMPLETION, flags);
+    if (cookies[i] == -1) {
+      save_error (&failed, &err, &msg);
+      cookies[i] = 0;
+    }
+  }
+
+  for (;;) {
+    waiting = false;
+    for (i = 0; i < g->nr_handles; ++i) {
+      if (cookies[i] == 0)
+        continue;
+      r = nbd_aio_command_completed (g->handles[i], cookies[i]);
+      if (r == 0) {
+        waiting = true;
+        continue;
+      }
+      if (r == -1)
+        save_error (&failed, &err, &msg);
+      cookies[i] = 0;
+    }
+    if (!waiting)
+      break;
+    if (group_poll (g, -1) == -1) {
+      save_error (&failed, &err, &msg);
+      break;
+    }
+  }
+
+  free (cookies);
+  if (failed) {
+    if (msg)
+      nbd_internal_set_last_error (err, msg);
+    return -1;
+  }
+  return 0;
+}
+
+int
+nbd_group_shutdown (struct nbd_group *g, uint32_t flags)
+{
+  int i, r = 0;
+
+  for (i = 0; i < g->nr_handles; ++i) {
+    if (nbd_aio_is_ready (g->handles[i]) &&
+        nbd_shutdown (g->handles[i], flags) == -1)
+      r = -1;
+  }
+  return r;
+}
+
+/* nbd_group_map divides the export into ranges of range_size bytes.
+ * Each range collects its own extents, so replies can arrive in any
+ * order, and if the server describes only the start of a range the
+ * rest of it is asked for again.  The lists are joined at the end.
+ */
+struct map_range {
+  struct group_map *m;
+  uint64_t next, end;           /* What is left of the range. */
+  uint64_t issued;              /* next when the last command was issued. */
+  struct nbd_extent *extents;
+  size_t nr_extents, extents_alloc;
+  bool in_flight;
+};
+
+struct group_map {
+  char *metacontext;
+  struct map_range *ranges;
+  size_t nr_ranges;
+  size_t first;                 /* First range which is not finished. */
+  int in_flight;
+  int err;                      /* First error, or 0. */
+  uint64_t err_offset;
+};
+
+static int
+map_append (struct map_range *r, uint64_t offset, uint64_t length,
+            uint32_t flags)
+{
+  struct nbd_extent *last, *p;
+  size_t n;
+
+  if (r->nr_extents > 0) {
+    last = &r->extents[r->nr_extents - 1];
+    if (last->flags == flags && last->offset + last->length == offset) {
+      last->length += length;
+      return 0;
+    }
+  }
+  if (r->nr_extents >= r->extents_alloc) {
+    n = r->extents_alloc == 0 ? 16 : r->extents_alloc * 2;
+    p = realloc (r->extents, n * sizeof p[0]);
+    if (p == NULL)
+      return -1;
+    r->extents = p;
+    r->extents_alloc = n;
+  }
+  r->extents[r->nr_extents].offset = offset;
+  r->extents[r->nr_extents].length = length;
+  r->extents[r->nr_extents].flags = flags;
+  r->nr_extents++;
+  return 0;
+}
+
+static int
+map_extent_callback (void *user_data, const char *metacontext,
+                     uint64_t offset, uint32_t *entries, size_t nr_entries,
+                     int *error)
+{
+  struct map_range *r = user_data;
+  size_t i;
+
+  if (strcmp (metacontext, r->m->metacontext) != 0 || offset != r->next)
+    return 0;
+
+  for (i = 0; i + 1 < nr_entries && offset < r->end; i += 2) {
+    uint64_t length = entries[i];
+
+    if (length == 0)
+      break;
+    if (length > r->end - offset)
+      length = r->end - offset;
+    if (map_append (r, offset, length, entries[i + 1]) == -1) {
+      *error = errno;
+      return -1;
+    }
+    offset += length;
+  }
+  r->next = offset;
+  return 0;
+}
+
+static int
+map_completion_callback (void *user_data, int *error)
+{
+  struct map_range *r = user_data;
+  struct group_map *m = r->m;
+
+  r->in_flight = false;
+  m->in_flight--;
+  if (*error == 0 && r->next == r->issued)
+    *error = EPROTO;            /* Or we would ask again forever. */
+  if (*error != 0 && m->err == 0) {
+    m->err = *error;
+    m->err_offset = r->next;
+  }
+  return 1;
+}
+
+/* Issue a block status command for the next part of range r. */
+static int
+map_issue (struct nbd_group *g, struct map_range *r)
+{
+  struct nbd_handle *h = nbd_group_select (g, r->next);
+  int64_t cookie;
+
+  r->in_flight = true;
+  r->issued = r->next;
+  r->m->in_flight++;
+  cookie = nbd_aio_block_status (h, r->end - r->next, r->next,
+                                 (nbd_extent_callback) {
+                                   .callback = map_extent_callback,
+                                   .user_data = r },
+                                 (nbd_completion_callback) {
+                                   .callback = map_completion_callback,
+                                   .user_data = r },
+                                 LIBNBD_CMD_FLAG_COALESCE);
+  if (cookie == -1) {
+    r->in_flight = false;
+    r->m->in_flight--;
+    return -1;
+  }
+  return 0;
+}
+
+int64_t
+nbd_group_map (struct nbd_group *g, const char *metacontext,
+               uint64_t range_size, struct nbd_extent **extents)
+{
+  struct group_map *m;
+  struct map_range *r;
+  struct nbd_extent *p = NULL;
+  bool failed = false;
+  int err = 0;
+  char *msg = NULL;
+  int64_t size, nr = 0;
+  size_t i, j, next = 0;
+  int max_in_flight = g->nr_handles * MAP_REQUESTS_PER_HANDLE;
+
+  *extents = NULL;
+  nbd_internal_set_error_context ("nbd_group_map");
+  if (range_size == 0)
+    range_size = DEFAULT_MAP_RANGE_SIZE;
+  if (range_size > UINT32_MAX) {
+    set_error (EINVAL, "range size must be less than 4G");
+    return -1;
+  }
+  if (nbd_can_meta_context (g->handles[0], metacontext) != 1) {
+    nbd_internal_set_error_context ("nbd_group_map");
+    set_error (ENOTSUP, "the server did not agree to send %s", metacontext);
+    return -1;
+  }
+  size = nbd_get_size (g->handles[0]);
+  if (size == -1)
+    return -1;
+  if (size == 0)
+    return 0;
+
+  m = calloc (1, sizeof *m);
+  if (m == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  m->metacontext = strdup (metacontext);
+  m->nr_ranges = (size - 1) / range_size + 1;
+  m->ranges = calloc (m->nr_ranges, sizeof m->ranges[0]);
+  if (m->metacontext == NULL || m->ranges == NULL) {
+    set_error (errno, "calloc");
+    free (m->metacontext);
+    free (m->ranges);
+    free (m);
+    return -1;
+  }
+  for (i = 0; i < m->nr_ranges; ++i) {
+    m->ranges[i].m = m;
+    m->ranges[i].next = i * range_size;
+    m->ranges[i].end = i == m->nr_ranges - 1 ? size : (i + 1) * range_size;
+  }
+
+  /* Keep every handle busy with new ranges, or with the rest of
+   * ranges which came back short.  Once anything fails nothing more
+   * is issued, but we wait for what is in flight.
+   */
+  while (m->first < m->nr_ranges) {
+    while (m->first < m->nr_ranges && !m->ranges[m->first].in_flight &&
+           m->ranges[m->first].next == m->ranges[m->first].end)
+      m->first++;
+    if (m->first == m->nr_ranges || (failed && m->in_flight == 0))
+      break;
+
+    for (i = m->first;
+         !failed && m->err == 0 && m->in_flight < max_in_flight && i < next;
+         ++i) {
+      r = &m->ranges[i];
+      if (!r->in_flight && r->next < r->end && map_issue (g, r) == -1)
+        save_error (&failed, &err, &msg);
+    }
+    while (!failed && m->err == 0 && m->in_flight < max_in_flight &&
+           next < m->nr_ranges) {
+      if (map_issue (g, &m->ranges[next++]) == -1)
+        save_error (&failed, &err, &msg);
+    }
+    if (m->err != 0 && !failed) {
+      nbd_internal_set_error_context ("nbd_group_map");
+      set_error (m->err, "block status failed at offset %" PRIu64,
+                 m->err_offset);
+      save_error (&failed, &err, &msg);
+    }
+    if (m->in_flight == 0) {
+      if (failed)
+        break;
+      continue;
+    }
+    if (group_poll (g, -1) == -1) {
+      save_error (&failed, &err, &msg);
+      break;
+    }
+  }
+
+  if (!failed) {
+    /* Join the ranges, merging extents across their boundaries. */
+    for (i = 0; i < m->nr_ranges; ++i)
+      nr += m->ranges[i].nr_extents;
+    p = malloc (nr * sizeof p[0]);
+    if (p == NULL) {
+      nbd_internal_set_error_context ("nbd_group_map");
+      set_error (errno, "malloc");
+      save_error (&failed, &err, &msg);
+    }
+  }
+  if (!failed) {
+    nr = 0;
+    for (i = 0; i < m->nr_ranges; ++i) {
+      r = &m->ranges[i];
+      for (j = 0; j < r->nr_extents; ++j) {
+        if (nr > 0 && p[nr - 1].flags == r->extents[j].flags)
+          p[nr - 1].length += r->extents[j].length;
+        else
+          p[nr++] = r->extents[j];
+      }
+    }
+    *extents = p;
+  }
+
+  /* If polling failed, commands may still be in flight, and their
+   * callbacks would use the ranges, so they have to be leaked.
+   */
+  if (m->in_flight == 0) {
+    for (i = 0; i < m->nr_ranges; ++i)
+      free (m->ranges[i].extents);
+    free (m->ranges);
+    free (m->metacontext);
+    free (m);
+  }
+  if (failed) {
+    if (msg)
+      nbd_internal_set_last_error (err, msg);
+    return -1;
+  }
+  return nr;
+}
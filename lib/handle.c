@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
@@ -31,13 +33,24 @@
 #include "internal.h"
 
 static void
-free_cmd_list (struct command *list)
+free_cmd_list (struct nbd_handle *h, struct command *list)
 {
-  struct command *cmd, *cmd_next;
+  struct command *cmd, *cmd_next, *parent, *coalesced, *attached;
 
   for (cmd = list; cmd != NULL; cmd = cmd_next) {
     cmd_next = cmd->next;
-    nbd_internal_retire_and_free_command (cmd);
+    parent = cmd->parent;
+    coalesced = cmd->coalesced;
+    attached = cmd->attached;
+    nbd_internal_retire_and_free_command (h, cmd);
+    /* Coalesced writes and attached reads are on no list either. */
+    free_cmd_list (h, coalesced);
+    free_cmd_list (h, attached);
+    /* The parent of split requests is on no list, so free it with
+     * its last piece.
+     */
+    if (parent && --parent->pieces == 0)
+      nbd_internal_retire_and_free_command (h, parent);
   }
 }
 
@@ -64,10 +77,12 @@ nbd_create (void)
   h->unique = 1;
   h->tls_verify_peer = true;
   h->request_sr = true;
+  h->request_eh = true;
 
   h->uri_allow_transports = (uint32_t) -1;
   h->uri_allow_tls = LIBNBD_TLS_ALLOW;
   h->uri_allow_local_file = false;
+  h->uri_allow_settings = 0;
 
   h->gflags = (LIBNBD_HANDSHAKE_FLAG_FIXED_NEWSTYLE |
                LIBNBD_HANDSHAKE_FLAG_NO_ZEROES);
@@ -78,6 +93,25 @@ nbd_create (void)
   h->public_state = STATE_START;
   h->state = STATE_START;
   h->pid = -1;
+  h->wait_subprocess = true;
+  h->command_pool_size = DEFAULT_COMMAND_POOL_SIZE;
+  h->recv_buffer_size = DEFAULT_RECV_BUFFER_SIZE;
+  h->priority_weight = DEFAULT_PRIORITY_WEIGHT;
+  h->elevator_window = DEFAULT_ELEVATOR_WINDOW;
+  h->pread_initialize = true;
+  h->max_request_size = MAX_REQUEST_SIZE;
+  h->timeout = -1;
+  h->reply_timeout = -1;
+  h->race_timerfd = -1;
+  h->rfd = h->wfd = -1;
+  h->shm_fd = -1;
+  h->splice_pipe[0] = h->splice_pipe[1] = -1;
+  h->resolver_cache_ttl = 60;
+  h->socket_options[LIBNBD_SOCKET_OPTION_NODELAY] = 1;
+
+  s = getenv ("LIBNBD_TRACE");
+  if (s && nbd_unlocked_set_trace_size (h, strtoul (s, NULL, 10)) == -1)
+    goto error1;
 
   h->export_name = strdup ("");
   if (h->export_name == NULL) {
@@ -103,6 +137,7 @@ nbd_create (void)
  error1:
   if (h) {
     free (h->export_name);
+    free (h->trace);
     free (h->hname);
     free (h);
   }
@@ -112,8 +147,6 @@ nbd_create (void)
 void
 nbd_close (struct nbd_handle *h)
 {
-  struct meta_context *m, *m_next;
-
   nbd_internal_set_error_context ("nbd_close");
 
   if (h == NULL)
@@ -123,35 +156,55 @@ nbd_close (struct nbd_handle *h)
 
   /* Free user callbacks first. */
   nbd_unlocked_clear_debug_callback (h);
+  nbd_unlocked_clear_command_event_callback (h);
+  nbd_unlocked_clear_direction_callback (h);
 
   free (h->bs_entries);
-  for (m = h->meta_contexts; m != NULL; m = m_next) {
-    m_next = m->next;
-    free (m->name);
-    free (m);
-  }
-  free_cmd_list (h->cmds_to_issue);
-  free_cmd_list (h->cmds_in_flight);
-  free_cmd_list (h->cmds_done);
+  free (h->extent_cache_entries);
+  free (h->rstage);
+  free (h->trace);
+  nbd_unlocked_record_stop (h);
+  free (h->stats_snapshot);
+  nbd_internal_free_meta_contexts (h);
+  nbd_internal_free_exports (h);
+  free_cmd_list (h, h->cmds_to_issue);
+  free_cmd_list (h, h->cmds_in_flight);
+  free_cmd_list (h, h->cmds_done);
+  free_cmd_list (h, h->cmds_zerocopy);
+  free (h->zerocopy_ranges);
+  free_cmd_list (h, h->wb_held);
+  nbd_internal_write_behind_free (h);
+  nbd_internal_lend_free (h);
+  nbd_internal_read_ahead_free (h);
+  nbd_internal_free_command_pool (h);
+  free (h->cookie_table);
   nbd_internal_free_string_list (h->argv);
-  if (h->sa_sockpath) {
-    if (h->pid > 0)
-      kill (h->pid, SIGTERM);
-    unlink (h->sa_sockpath);
-    free (h->sa_sockpath);
-  }
-  if (h->sa_tmpdir) {
-    rmdir (h->sa_tmpdir);
-    free (h->sa_tmpdir);
-  }
+  if (h->sa_sockpath && h->pid > 0)
+    kill (h->pid, SIGTERM);
   free (h->hostname);
   free (h->port);
-  if (h->result)
-    freeaddrinfo (h->result);
+  nbd_internal_free_tcp_race (h);
+  nbd_internal_resolve_cancel (h);
+  free (h->addrs);
+  nbd_internal_free_addrinfo (h->result);
+  free (h->pipeline_buf);
+  free (h->rfd_buf);
+  free (h->wfd_buf);
+  free (h->probe_buf);
+  if (h->splice_pipe[0] >= 0) {
+    close (h->splice_pipe[0]);
+    close (h->splice_pipe[1]);
+  }
   if (h->sock)
     h->sock->ops->close (h->sock);
-  if (h->pid > 0)
-    waitpid (h->pid, NULL, 0);
+  nbd_internal_shm_discard (h);
+  if (h->pid > 0 && !h->wait_subprocess)
+    nbd_internal_reap (h->pid, h->sa_sockpath, h->sa_tmpdir);
+  else {
+    if (h->pid > 0)
+      waitpid (h->pid, NULL, 0);
+    nbd_internal_remove_socket_dir (h->sa_sockpath, h->sa_tmpdir);
+  }
 
   free (h->export_name);
   free (h->tls_certificates);
@@ -163,6 +216,151 @@ nbd_close (struct nbd_handle *h)
   free (h);
 }
 
+/* Copy a string setting, which may be NULL. */
+static int
+copy_setting (char **dst, const char *src)
+{
+  char *copy = NULL;
+
+  if (src) {
+    copy = strdup (src);
+    if (copy == NULL) {
+      set_error (errno, "strdup");
+      return -1;
+    }
+  }
+  free (*dst);
+  *dst = copy;
+  return 0;
+}
+
+/* Copy the settings of t to the new handle h, see nbd_create_from.
+ * t must be locked.  h is not visible to any other thread yet.
+ */
+static int
+copy_settings (struct nbd_handle *h, struct nbd_handle *t)
+{
+  assert (t->export_name != NULL);
+  if (copy_setting (&h->export_name, t->export_name) == -1 ||
+      copy_setting (&h->tls_certificates, t->tls_certificates) == -1 ||
+      copy_setting (&h->tls_username, t->tls_username) == -1 ||
+      copy_setting (&h->tls_psk_file, t->tls_psk_file) == -1)
+    return -1;
+  if (t->request_meta_contexts) {
+    h->request_meta_contexts =
+      nbd_internal_copy_string_list (t->request_meta_contexts);
+    if (h->request_meta_contexts == NULL) {
+      set_error (errno, "malloc");
+      return -1;
+    }
+  }
+
+  h->tls = t->tls;
+  h->tls_verify_peer = t->tls_verify_peer;
+  h->tls_kernel_offload = t->tls_kernel_offload;
+  h->tls_resumption = t->tls_resumption;
+  h->request_sr = t->request_sr;
+  h->request_eh = t->request_eh;
+  h->probe_only = t->probe_only;
+  h->list_exports = t->list_exports;
+  h->pipeline_options = t->pipeline_options;
+  h->tcp_family = t->tcp_family;
+  memcpy (h->socket_options, t->socket_options, sizeof h->socket_options);
+  h->uri_allow_transports = t->uri_allow_transports;
+  h->uri_allow_tls = t->uri_allow_tls;
+  h->uri_allow_local_file = t->uri_allow_local_file;
+  h->uri_allow_settings = t->uri_allow_settings;
+  h->pread_initialize = t->pread_initialize;
+  h->split_requests = t->split_requests;
+  h->zerocopy_threshold = t->zerocopy_threshold;
+  h->zero_detection = t->zero_detection;
+  h->coalesce_writes = t->coalesce_writes;
+  h->dedupe_reads = t->dedupe_reads;
+  h->priority_weight = t->priority_weight;
+  h->max_bytes_in_flight = t->max_bytes_in_flight;
+  h->wait_for_bytes_in_flight = t->wait_for_bytes_in_flight;
+  h->write_behind = t->write_behind;
+  h->elevator = t->elevator;
+  h->elevator_window = t->elevator_window;
+  h->read_ahead = t->read_ahead;
+  h->shared_cache = t->shared_cache;
+  h->adaptive_depth = t->adaptive_depth;
+  h->depth_limit = t->depth_limit;
+  h->depth_slow_start = true;
+  memcpy (h->rate, t->rate, sizeof h->rate);
+  h->rate_limited = t->rate_limited;
+  h->timeout = t->timeout;
+  h->reconnect = t->reconnect;
+  h->wait_subprocess = t->wait_subprocess;
+  h->reply_timeout = t->reply_timeout;
+  h->probe_interval = t->probe_interval;
+  h->gflags = t->gflags;
+  h->max_request_size = t->max_request_size;
+  h->recv_buffer_size = t->recv_buffer_size;
+  h->shm_size = t->shm_size;
+  h->extent_cache = t->extent_cache;
+  h->resolver_cache_ttl = t->resolver_cache_ttl;
+  h->debug = t->debug;
+
+  if (nbd_unlocked_set_command_pool_size (h, t->command_pool_size) == -1 ||
+      nbd_unlocked_set_trace_size (h, t->trace_size) == -1)
+    return -1;
+  return 0;
+}
+
+struct nbd_handle *
+nbd_create_from (struct nbd_handle *t)
+{
+  struct nbd_handle *h;
+  int r;
+
+  h = nbd_create ();
+  if (h == NULL)
+    return NULL;
+
+  nbd_internal_set_error_context ("nbd_create_from");
+  pthread_mutex_lock (&t->lock);
+  r = copy_settings (h, t);
+  pthread_mutex_unlock (&t->lock);
+  if (r == -1) {
+    nbd_close (h);
+    return NULL;
+  }
+
+  debug (h, "copied settings from %s", t->hname);
+  return h;
+}
+
+/* Free the negotiated meta contexts and their cached extents. */
+void
+nbd_internal_free_meta_contexts (struct nbd_handle *h)
+{
+  struct meta_context *m, *m_next;
+
+  for (m = h->meta_contexts; m != NULL; m = m_next) {
+    m_next = m->next;
+    free (m->name);
+    nbd_internal_extent_cache_free (m);
+    free (m);
+  }
+  h->meta_contexts = NULL;
+}
+
+/* Free the exports listed by the server, see nbd_set_list_exports. */
+void
+nbd_internal_free_exports (struct nbd_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_exports; ++i) {
+    free (h->exports[i].name);
+    free (h->exports[i].description);
+  }
+  free (h->exports);
+  h->exports = NULL;
+  h->nr_exports = 0;
+}
+
 int
 nbd_unlocked_set_handle_name (struct nbd_handle *h, const char *handle_name)
 {
@@ -280,6 +478,111 @@ nbd_unlocked_get_structured_replies_negotiated (struct nbd_handle *h)
   return h->structured_replies;
 }
 
+int
+nbd_unlocked_set_request_extended_headers (struct nbd_handle *h,
+                                           bool request)
+{
+  h->request_eh = request;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_request_extended_headers (struct nbd_handle *h)
+{
+  return h->request_eh;
+}
+
+int
+nbd_unlocked_get_extended_headers_negotiated (struct nbd_handle *h)
+{
+  return h->extended_headers;
+}
+
+int
+nbd_unlocked_set_probe_only (struct nbd_handle *h, bool probe)
+{
+  h->probe_only = probe;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_probe_only (struct nbd_handle *h)
+{
+  return h->probe_only;
+}
+
+int
+nbd_unlocked_set_list_exports (struct nbd_handle *h, bool list)
+{
+  h->list_exports = list;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_list_exports (struct nbd_handle *h)
+{
+  return h->list_exports;
+}
+
+int
+nbd_unlocked_set_pipeline_options (struct nbd_handle *h, bool pipeline)
+{
+  h->pipeline_options = pipeline;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_pipeline_options (struct nbd_handle *h)
+{
+  return h->pipeline_options;
+}
+
+int
+nbd_unlocked_get_nr_list_exports (struct nbd_handle *h)
+{
+  if (!h->list_exports) {
+    set_error (EINVAL, "list exports mode not selected on this handle");
+    return -1;
+  }
+  return (int) h->nr_exports;
+}
+
+static char *
+get_listed_export (struct nbd_handle *h, int i, bool description)
+{
+  char *s;
+
+  if (!h->list_exports) {
+    set_error (EINVAL, "list exports mode not selected on this handle");
+    return NULL;
+  }
+  if (i < 0 || i >= (int) h->nr_exports) {
+    set_error (EINVAL, "invalid index");
+    return NULL;
+  }
+
+  s = strdup (description ? h->exports[i].description : h->exports[i].name);
+  if (s == NULL)
+    set_error (errno, "strdup");
+  return s;
+}
+
+char *
+nbd_unlocked_get_list_export_name (struct nbd_handle *h, int i)
+{
+  return get_listed_export (h, i, false);
+}
+
+char *
+nbd_unlocked_get_list_export_description (struct nbd_handle *h, int i)
+{
+  return get_listed_export (h, i, true);
+}
+
 int
 nbd_unlocked_set_handshake_flags (struct nbd_handle *h,
                                   uint32_t flags)
@@ -296,6 +599,281 @@ nbd_unlocked_get_handshake_flags (struct nbd_handle *h)
   return h->gflags;
 }
 
+int
+nbd_unlocked_set_pread_initialize (struct nbd_handle *h, bool request)
+{
+  h->pread_initialize = request;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_pread_initialize (struct nbd_handle *h)
+{
+  return h->pread_initialize;
+}
+
+int
+nbd_unlocked_set_max_request_size (struct nbd_handle *h, uint64_t size)
+{
+  if (size == 0 || size > UINT32_MAX) {
+    set_error (ERANGE, "maximum request size must be between 1 and %" PRIu32,
+               UINT32_MAX);
+    return -1;
+  }
+
+  h->max_request_size = size;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_max_request_size (struct nbd_handle *h)
+{
+  return nbd_internal_max_request_size (h);
+}
+
+int
+nbd_unlocked_set_split_requests (struct nbd_handle *h, bool split)
+{
+  h->split_requests = split;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_split_requests (struct nbd_handle *h)
+{
+  return h->split_requests;
+}
+
+int
+nbd_unlocked_set_zerocopy_threshold (struct nbd_handle *h, uint64_t threshold)
+{
+  if (threshold > UINT32_MAX) {
+    set_error (ERANGE, "zero-copy threshold must be at most %" PRIu32,
+               UINT32_MAX);
+    return -1;
+  }
+
+  h->zerocopy_threshold = threshold;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_zerocopy_threshold (struct nbd_handle *h)
+{
+  return h->zerocopy_threshold;
+}
+
+int
+nbd_unlocked_set_zero_detection (struct nbd_handle *h, uint32_t block_size)
+{
+  if (block_size != 0 &&
+      (block_size < 512 || block_size > 32 * 1024 * 1024 ||
+       (block_size & (block_size - 1)) != 0)) {
+    set_error (EINVAL, "zero detection block size must be 0, or a power "
+               "of 2 between 512 and 32M");
+    return -1;
+  }
+
+  h->zero_detection = block_size;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_zero_detection (struct nbd_handle *h)
+{
+  return h->zero_detection;
+}
+
+int
+nbd_unlocked_set_coalesce_writes (struct nbd_handle *h, bool coalesce)
+{
+  h->coalesce_writes = coalesce;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_coalesce_writes (struct nbd_handle *h)
+{
+  return h->coalesce_writes;
+}
+
+int
+nbd_unlocked_set_dedupe_reads (struct nbd_handle *h, bool dedupe)
+{
+  h->dedupe_reads = dedupe;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_dedupe_reads (struct nbd_handle *h)
+{
+  return h->dedupe_reads;
+}
+
+int
+nbd_unlocked_set_priority_weight (struct nbd_handle *h, unsigned weight)
+{
+  h->priority_weight = weight;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_priority_weight (struct nbd_handle *h)
+{
+  return h->priority_weight;
+}
+
+int
+nbd_unlocked_set_max_bytes_in_flight (struct nbd_handle *h, uint64_t max,
+                                      bool wait)
+{
+  if (max > INT64_MAX) {
+    set_error (ERANGE, "maximum bytes in flight must be at most %" PRIi64,
+               INT64_MAX);
+    return -1;
+  }
+
+  h->max_bytes_in_flight = max;
+  h->wait_for_bytes_in_flight = wait;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_max_bytes_in_flight (struct nbd_handle *h)
+{
+  return h->max_bytes_in_flight;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_bytes_in_flight (struct nbd_handle *h)
+{
+  return h->bytes_in_flight;
+}
+
+int
+nbd_unlocked_set_timeout (struct nbd_handle *h, int timeout)
+{
+  /* With 0 every synchronous call would time out before polling. */
+  if (timeout < -1 || timeout == 0) {
+    set_error (EINVAL, "invalid timeout: %d", timeout);
+    return -1;
+  }
+
+  h->timeout = timeout;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_timeout (struct nbd_handle *h)
+{
+  return h->timeout;
+}
+
+int
+nbd_unlocked_set_reconnect (struct nbd_handle *h, unsigned attempts)
+{
+  h->reconnect = attempts;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+unsigned
+nbd_unlocked_get_reconnect (struct nbd_handle *h)
+{
+  return h->reconnect;
+}
+
+int
+nbd_unlocked_set_tcp_family (struct nbd_handle *h, int family)
+{
+  h->tcp_family = family;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_tcp_family (struct nbd_handle *h)
+{
+  return h->tcp_family;
+}
+
+int
+nbd_unlocked_set_socket_option (struct nbd_handle *h, int option, int value)
+{
+  if (value < 0) {
+    set_error (EINVAL, "invalid socket option value: %d", value);
+    return -1;
+  }
+
+  h->socket_options[option] = value;
+  return 0;
+}
+
+int
+nbd_unlocked_get_socket_option (struct nbd_handle *h, int option)
+{
+  return h->socket_options[option];
+}
+
+int
+nbd_unlocked_set_recv_buffer_size (struct nbd_handle *h, int size)
+{
+  if (size < 0) {
+    set_error (EINVAL, "invalid receive buffer size: %d", size);
+    return -1;
+  }
+
+  /* The buffer itself is allocated when the first reply is received. */
+  h->recv_buffer_size = size;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_recv_buffer_size (struct nbd_handle *h)
+{
+  return h->recv_buffer_size;
+}
+
+int
+nbd_unlocked_set_shared_memory_size (struct nbd_handle *h, uint64_t size)
+{
+  if (size != 0 &&
+      (size < MIN_SHM_RING_SIZE || size > MAX_SHM_RING_SIZE ||
+       (size & (size - 1)) != 0)) {
+    set_error (EINVAL, "shared memory size must be 0, or a power of 2 "
+               "between %d and %d", MIN_SHM_RING_SIZE, MAX_SHM_RING_SIZE);
+    return -1;
+  }
+
+  h->shm_size = size;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int64_t
+nbd_unlocked_get_shared_memory_size (struct nbd_handle *h)
+{
+  return h->shm_size;
+}
+
+int
+nbd_unlocked_get_shared_memory_negotiated (struct nbd_handle *h)
+{
+  return h->shm_negotiated;
+}
+
 const char *
 nbd_unlocked_get_package_name (struct nbd_handle *h)
 {
@@ -386,3 +964,10 @@ nbd_unlocked_set_uri_allow_local_file (struct nbd_handle *h, bool allow)
   h->uri_allow_local_file = allow;
   return 0;
 }
+
+int
+nbd_unlocked_set_uri_allow_settings (struct nbd_handle *h, uint32_t mask)
+{
+  h->uri_allow_settings = mask;
+  return 0;
+}
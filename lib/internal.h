@@ -30,6 +30,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <pthread.h>
 
@@ -57,14 +58,132 @@
 #define MSG_MORE 0
 #endif
 
-/* XXX This is the same as nbdkit, but probably it should be detected
- * from the server (NBD_INFO_BLOCK_SIZE) or made configurable.
+/* Likewise MSG_ZEROCOPY, see nbd_set_zerocopy_threshold. */
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0
+#endif
+
+/* Default limit on the size of read and write requests, the same as
+ * nbdkit.  This can be changed with nbd_set_max_request_size, and is
+ * further limited by any maximum block size sent by the server.
  */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Default number of retired command structures kept on each handle
+ * for reuse, see nbd_set_command_pool_size.
+ */
+#define DEFAULT_COMMAND_POOL_SIZE 64
+
+/* Maximum number of queued commands whose requests (and write
+ * payloads) are gathered into one vectored send.
+ */
+#define MAX_SEND_BATCH 16
+
+/* Default size of the receive staging buffer, see
+ * nbd_set_recv_buffer_size.
+ */
+#define DEFAULT_RECV_BUFFER_SIZE (64 * 1024)
+
+/* Smallest and largest rings for the shared memory transport, see
+ * nbd_set_shared_memory_size.
+ */
+#define MIN_SHM_RING_SIZE (64 * 1024)
+#define MAX_SHM_RING_SIZE (1024 * 1024 * 1024)
+
+/* Default number of times a queued command may be overtaken by
+ * commands with LIBNBD_CMD_FLAG_PRIORITY, see nbd_set_priority_weight.
+ */
+#define DEFAULT_PRIORITY_WEIGHT 16
+
+/* Limit on requests waiting for replies when a connection starts
+ * with adaptive depth, see lib/depth.c.
+ */
+#define INITIAL_DEPTH 8
+
+/* How long a rate limit may be exceeded for after a quiet time, see
+ * lib/rate-limit.c.
+ */
+#define RATE_BURST_US 100000
+
+/* Default and largest number of queued commands sorted by the
+ * elevator, and how long a command may wait before the elevator
+ * stops passing it over, see lib/elevator.c.
+ */
+#define DEFAULT_ELEVATOR_WINDOW 32
+#define MAX_ELEVATOR_WINDOW 256
+#define ELEVATOR_MAX_DELAY_US 100000
+
+/* Largest window of data read ahead of a sequential stream, and the
+ * smallest request used to read it, see lib/read-ahead.c.
+ */
+#define MAX_READ_AHEAD (64 * 1024 * 1024)
+#define READ_AHEAD_MIN_REQUEST (64 * 1024)
+
+/* Size of the blocks in the cache shared by all handles, its default
+ * size, and how it is divided up, see lib/shared-cache.c.
+ */
+#define SHARED_CACHE_BLOCK 4096
+#define DEFAULT_SHARED_CACHE_SIZE (64 * 1024 * 1024)
+#define SHARED_CACHE_SHARDS 16
+#define SHARED_CACHE_BUCKETS 1024
+
+/* Longest time nbd_group_poll waits for the workers of a group in
+ * one go, see lib/workers.c.
+ */
+#define GROUP_WORKERS_WAIT_MS 10
+
+/* Alignment of buffers using huge pages, the largest NUMA node a
+ * buffer can be bound to, and the limits on freed buffers kept for
+ * reuse, see lib/buffer.c.
+ */
+#define BUFFER_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define BUFFER_MAX_NUMA_NODE 1023
+#define BUFFER_POOL_SIZE (64 * 1024 * 1024)
+#define BUFFER_POOL_MAX 64
+#define BUFFER_BUCKETS 256
+
+/* Size of the buffers used to copy payloads to and from file
+ * descriptors when they cannot be spliced, see nbd_aio_pread_to_fd.
+ */
+#define FD_BUFFER_SIZE (256 * 1024)
+
+/* Largest length of an entry passed to an extent callback.  Longer
+ * extents, from the extent cache or from 64 bit block status replies,
+ * are passed as several entries.
+ */
+#define MAX_ENTRY_LENGTH (UINT32_C (1) << 31)
+
+/* Handshake options which were sent ahead of their turn, see
+ * nbd_set_pipeline_options.
+ */
+#define PIPELINED_STRUCTURED_REPLY 1
+#define PIPELINED_SET_META_CONTEXT 2
+#define PIPELINED_GO               4
+#define PIPELINED_EXTENDED_HEADERS 8
+
 struct meta_context;
 struct socket;
 struct command;
+struct prefetch;
+struct shared_cache_key;
+
+/* Statistics, see lib/stats.c.  errors[0] counts every failed
+ * command, and errors[e] those which failed with errno e.
+ */
+#define STATS_NR_CMDS (NBD_CMD_BLOCK_STATUS + 1)
+#define STATS_NR_ERRNOS 256
+#define STATS_NR_BUCKETS 32
+
+struct stats {
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t commands[STATS_NR_CMDS];
+  uint64_t errors[STATS_NR_ERRNOS];
+  uint64_t max_in_flight;
+  uint64_t latency[STATS_NR_CMDS][STATS_NR_BUCKETS];
+  uint64_t priority_commands;
+  uint64_t priority_latency[STATS_NR_BUCKETS];
+};
 
 struct nbd_handle {
   /* Unique name assigned to this handle for debug messages
@@ -75,6 +194,17 @@ struct nbd_handle {
   /* Lock protecting concurrent access to the handle. */
   pthread_mutex_t lock;
 
+  /* Threads blocked in nbd_unlocked_poll after releasing the lock,
+   * and sockets which were closed while any were blocked.  Those are
+   * really closed by the last thread to return, so that their file
+   * descriptors cannot be reused under the others.  See lib/poll.c.
+   */
+  struct poll_waiter *pollers;
+  struct socket *closed_socks;
+
+  /* If the handle is in a reactor, its entry, see lib/reactor.c. */
+  struct reactor_entry *reactor_entry;
+
   char *export_name;            /* Export name, never NULL. */
 
   /* TLS settings. */
@@ -83,15 +213,205 @@ struct nbd_handle {
   bool tls_verify_peer;         /* Verify the peer certificate. */
   char *tls_username;           /* Username, NULL = use current username */
   char *tls_psk_file;           /* PSK filename, NULL = no PSK */
+  bool tls_kernel_offload;      /* Try to use kTLS after handshake. */
+  bool tls_resumption;          /* Save and resume TLS sessions. */
 
   /* Desired metadata contexts. */
   bool request_sr;
+  bool request_eh;
   char **request_meta_contexts;
 
+  /* Only query the export and then abort the handshake, see
+   * nbd_set_probe_only.
+   */
+  bool probe_only;
+
+  /* Ask the server for its list of exports, see nbd_set_list_exports.
+   * The exports it sent are kept in exports.
+   */
+  bool list_exports;
+  struct listed_export *exports;
+  size_t nr_exports;
+
+  /* Send the handshake options together, see nbd_set_pipeline_options.
+   * pipelined has a bit for each option which was sent ahead and
+   * whose reply has not been read yet.  pipeline_refused is set when
+   * a handshake fails with replies outstanding.
+   */
+  bool pipeline_options;
+  bool pipeline_refused;
+  unsigned pipelined;            /* PIPELINED_* bits */
+  char *pipeline_buf;
+
+  /* Shared memory transport, see nbd_set_shared_memory_size and
+   * lib/shm.c.  shm_fd and shm_map hold the memory offered to the
+   * server until it replies.
+   */
+  uint32_t shm_size;
+  int shm_fd;
+  void *shm_map;
+  bool shm_negotiated;
+
+  /* Address family of TCP connections, see nbd_set_tcp_family. */
+  int tcp_family;
+
+  /* Options applied to new sockets, indexed by
+   * LIBNBD_SOCKET_OPTION_*, see nbd_set_socket_option.  0 means the
+   * option is not set.
+   */
+  int socket_options[LIBNBD_SOCKET_OPTION_USER_TIMEOUT + 1];
+
   /* Allowed in URIs, see lib/uri.c. */
   uint32_t uri_allow_transports;
   int uri_allow_tls;
   bool uri_allow_local_file;
+  uint32_t uri_allow_settings;
+
+  /* connections=N from the last URI, or 0, see nbd_group_connect_uri. */
+  int uri_connections;
+
+  /* Zero read buffers before issuing structured reads. */
+  bool pread_initialize;
+
+  /* Split large read and write requests, see nbd_set_split_requests. */
+  bool split_requests;
+
+  /* Send write payloads at least this large with MSG_ZEROCOPY, see
+   * nbd_set_zerocopy_threshold.  0 means never.
+   */
+  uint32_t zerocopy_threshold;
+
+  /* Send aligned blocks of zeroes in writes as NBD_CMD_WRITE_ZEROES,
+   * see nbd_set_zero_detection.  0 means off.
+   */
+  uint32_t zero_detection;
+
+  /* Merge contiguous queued writes, see nbd_set_coalesce_writes. */
+  bool coalesce_writes;
+
+  /* Attach reads to overlapping reads, see nbd_set_dedupe_reads.
+   * dedupe_gen is bumped by each command which may change the export,
+   * so that a read issued before the export changed is not shared.
+   */
+  bool dedupe_reads;
+  uint64_t dedupe_gen;
+
+  /* Number of times a queued command may be overtaken by commands
+   * with LIBNBD_CMD_FLAG_PRIORITY, see nbd_set_priority_weight.
+   */
+  uint32_t priority_weight;
+
+  /* Limit on the payload bytes of reads and writes which have been
+   * issued and not completed, see nbd_set_max_bytes_in_flight.
+   */
+  uint64_t max_bytes_in_flight;
+  uint64_t bytes_in_flight;
+  bool wait_for_bytes_in_flight;
+
+  /* Write-behind, see lib/write-behind.c.  wb_pending counts the
+   * write-behind writes queued to be sent and not yet completed,
+   * wb_error is the first error of one which has not been reported
+   * by a barrier yet, wb_held holds barriers (and what was issued
+   * after them) until wb_pending drops to 0, and wb_pool the free
+   * copy buffers.
+   */
+  bool write_behind;
+  uint32_t wb_pending;
+  uint32_t wb_error;
+  struct command *wb_held, *wb_held_tail;
+  struct wb_buffer *wb_pool;
+  uint32_t wb_pool_nr;
+
+  /* Buffers of nbd_aio_pread_lend, see lib/lend.c.  lend_pool holds
+   * the free buffers, and lent those kept by the caller.
+   */
+  struct lent_buffer *lend_pool;
+  uint32_t lend_pool_nr;
+  struct lent_buffer *lent;
+
+  /* Elevator ordering of queued commands, see lib/elevator.c.
+   * elevator is a LIBNBD_ELEVATOR_* mode, and elevator_pos is where
+   * the last request sent ended.
+   */
+  int elevator;
+  uint32_t elevator_window;
+  uint64_t elevator_pos;
+
+  /* Read ahead of sequential reads, see lib/read-ahead.c.  read_ahead
+   * is the largest window, or 0 if nothing is read ahead.  ra_next is
+   * where the stream would continue, ra_window is the current window
+   * and ra_end is where the data asked for so far ends, as of
+   * dedupe_gen ra_gen.  ra_pending
+   * holds the requests for data ahead which have not completed, and
+   * ra_pool the buffers of data ahead which have been read.
+   */
+  uint32_t read_ahead;
+  uint64_t ra_next;
+  uint64_t ra_window;
+  uint64_t ra_end;
+  uint64_t ra_gen;
+  struct prefetch *ra_pending;
+  struct prefetch *ra_pool;
+
+  /* Use the block cache shared by all handles, see
+   * nbd_set_shared_cache.  The key of the export is looked up when
+   * it is first needed.
+   */
+  bool shared_cache;
+  struct shared_cache_key *shared_cache_key;
+
+  /* Adaptive limit on requests waiting for replies, see lib/depth.c.
+   * adaptive_depth is the most allowed, or 0 if there is no limit.
+   * depth_sent counts the requests sent and not answered.
+   */
+  uint32_t adaptive_depth;
+  uint32_t depth_limit;
+  uint32_t depth_sent;
+  bool depth_slow_start;
+  uint32_t depth_samples;
+  uint64_t depth_round_us;
+  uint64_t depth_min_us;
+
+  /* Rate limits indexed by LIBNBD_RATE_*, see lib/rate-limit.c.
+   * rate_limited is true if any of them is set.
+   */
+  struct rate_bucket {
+    uint64_t rate;              /* Per second, or 0 if not limited. */
+    double tokens;
+    uint64_t last_us;
+  } rate[LIBNBD_RATE_WRITE_OPS + 1];
+  bool rate_limited;
+
+  /* Time limit in milliseconds for synchronous calls, see
+   * nbd_set_timeout.  -1 means none.
+   */
+  int timeout;
+
+  /* Reconnect when an established connection dies, see
+   * nbd_set_reconnect.  reconnect is the number of consecutive
+   * attempts allowed, and reconnect_tries counts those made since the
+   * connection was last established.  reconnecting is set from when
+   * the connection dies until the handshake has finished again.
+   */
+  uint32_t reconnect;
+  uint32_t reconnect_tries;
+  bool reconnecting;
+
+  /* Liveness checks, see nbd_set_reply_timeout and
+   * nbd_set_probe_interval, in milliseconds (-1 and 0 mean none).
+   * liveness_us is when the server was last seen to make progress,
+   * which is noticed by stats.bytes_received changing from
+   * liveness_bytes, or when it was last given something to reply to
+   * while idle.  reply_timed_out is set from when the connection is
+   * closed for not replying until the state machine reaches DEAD.
+   * probe_buf holds the reply to the probe read.
+   */
+  int reply_timeout;
+  int probe_interval;
+  uint64_t liveness_us;
+  uint64_t liveness_bytes;
+  bool reply_timed_out;
+  char *probe_buf;
 
   /* Global flags from the server. */
   uint16_t gflags;
@@ -100,10 +420,27 @@ struct nbd_handle {
    * These are *both* *only* valid if eflags != 0.  This is because
    * all servers should set NBD_FLAG_HAS_FLAGS, so eflags should
    * always be != 0, and we set both fields at the same time.
+   *
+   * These and the block size constraints below are not changed after
+   * the handshake, which finishes before public_state says that the
+   * handle is connected.  So calls which check public_state first,
+   * such as nbd_get_size, can read them without holding the lock.
+   * When reconnecting (see nbd_set_reconnect) the new handshake must
+   * agree with them, or the reconnection fails.
    */
   uint64_t exportsize;
   uint16_t eflags;
 
+  /* Block size constraints sent by the server in NBD_INFO_BLOCK_SIZE,
+   * or all 0 if the server did not send them.
+   */
+  uint32_t block_minimum;
+  uint32_t block_preferred;
+  uint32_t block_maximum;
+
+  /* Limit on read and write requests set by the caller. */
+  uint32_t max_request_size;
+
   /* Flags set by the state machine to tell what protocol and whether
    * TLS was negotiated.
    */
@@ -116,6 +453,38 @@ struct nbd_handle {
   bool debug;
   nbd_debug_callback debug_callback;
 
+  /* See nbd_set_command_event_callback. */
+  nbd_command_event_callback command_event_callback;
+
+  /* See nbd_set_direction_callback.  last_direction is the direction
+   * last passed to the callback.
+   */
+  nbd_direction_callback direction_callback;
+  unsigned last_direction;
+
+  /* See nbd_record_start.  record_seq is the number given to the
+   * last command submitted, and record_last_done the highest number
+   * of a command which has completed.  NULL if not recording.
+   */
+  FILE *record_fp;
+  uint64_t record_start_us;
+  uint32_t record_seq;
+  uint32_t record_last_done;
+
+  /* Trace ring buffer, see nbd_set_trace_size.  trace_next counts
+   * every record ever added, so the oldest record is overwritten by
+   * record trace_next % trace_size.  NULL if tracing is disabled.
+   */
+  struct trace_record *trace;
+  uint32_t trace_size;
+  uint64_t trace_next;
+
+  /* Statistics, and the copy of them taken by nbd_stats_snapshot
+   * (NULL until it is first called).
+   */
+  struct stats stats;
+  struct stats *stats_snapshot;
+
   /* State machine.
    *
    * The actual current state is ‘state’.  ‘public_state’ is updated
@@ -129,6 +498,7 @@ struct nbd_handle {
   enum state state;
 
   bool structured_replies;      /* If we negotiated NBD_OPT_STRUCTURED_REPLY */
+  bool extended_headers;        /* If we negotiated NBD_OPT_EXTENDED_HEADERS */
 
   /* Linked list of negotiated metadata contexts. */
   struct meta_context *meta_contexts;
@@ -143,11 +513,63 @@ struct nbd_handle {
   void *rbuf;
   size_t rlen;
 
+  /* Once replies are being received, small reads are served from
+   * this staging buffer, which is refilled with a single recv of up
+   * to recv_buffer_size bytes, so that several short replies can be
+   * parsed per system call.  The bytes between rstage_start and
+   * rstage_end have been received but not yet consumed.  rstage is
+   * NULL during the handshake and if recv_buffer_size is 0.
+   */
+  char *rstage;
+  size_t rstage_start, rstage_end;
+  size_t recv_buffer_size;
+
+  /* Set when a refill of the staging buffer was short, meaning the
+   * socket has been drained and the next recv would fail with EAGAIN.
+   * Cleared when the caller tells us the socket is readable again.
+   */
+  bool recv_drained;
+
   /* As above, but for writing using send_from_wbuf. */
   const void *wbuf;
   size_t wlen;
   int wflags;
 
+  /* Read payloads of nbd_aio_pread_to_fd are written to rfd at
+   * rfd_offset by recv_read_payload, and write payloads of
+   * nbd_aio_pwrite_from_fd are read from wfd at wfd_offset by
+   * send_write_payload.  Where the socket allows, the data does not
+   * pass through user space at all.  Otherwise, or if rfd_copy or
+   * wfd_copy is set because the file descriptor does not allow it,
+   * it is copied through rfd_buf or wfd_buf, which are allocated on
+   * first use.  The bytes of wfd_buf between wfd_buf_start and
+   * wfd_buf_end have been read but not yet sent.  splice_pipe is the
+   * pipe used by the socket's splice_to operation, or -1 until it is
+   * needed.
+   */
+  int rfd;
+  uint64_t rfd_offset;
+  bool rfd_copy;
+  char *rfd_buf;
+  int wfd;
+  uint64_t wfd_offset;
+  bool wfd_copy;
+  char *wfd_buf;
+  size_t wfd_buf_start, wfd_buf_end;
+  int splice_pipe[2];
+
+  /* Read payloads of nbd_aio_preadv are received into the buffers
+   * from rvec, which has rveccnt entries left, the first with
+   * rvec_skip bytes already filled.  Write payloads of
+   * nbd_aio_pwritev are sent from wvec in the same way.
+   */
+  struct iovec *rvec;
+  int rveccnt;
+  size_t rvec_skip;
+  struct iovec *wvec;
+  int wveccnt;
+  size_t wvec_skip;
+
   /* Static buffer used for short amounts of data, such as handshake
    * and commands.
    */
@@ -155,10 +577,19 @@ struct nbd_handle {
     struct nbd_old_handshake old_handshake;
     struct nbd_new_handshake new_handshake;
     struct nbd_new_option option;
+    struct {
+      struct nbd_new_option option;
+      struct nbd_shared_memory_option payload;
+    }  __attribute__((packed)) shm_option;
     struct {
       struct nbd_fixed_new_option_reply option_reply;
       union {
         struct nbd_fixed_new_option_reply_info_export export;
+        struct nbd_fixed_new_option_reply_info_block_size block_size;
+        struct {
+          struct nbd_fixed_new_option_reply_server server;
+          char str[NBD_MAX_STRING];
+        }  __attribute__((packed)) server;
         struct {
           struct nbd_fixed_new_option_reply_meta_context context;
           char str[NBD_MAX_STRING];
@@ -168,6 +599,7 @@ struct nbd_handle {
     }  __attribute__((packed)) or;
     struct nbd_export_name_option_reply export_name_reply;
     struct nbd_simple_reply simple_reply;
+    struct nbd_extended_reply extended_reply;
     struct {
       struct nbd_structured_reply structured_reply;
       union {
@@ -184,15 +616,38 @@ struct nbd_handle {
     uint32_t cflags;
     uint32_t len;
     uint16_t nrinfos;
+    uint16_t infos[2];          /* nrinfos followed by info requests */
     uint32_t nrqueries;
   } sbuf;
 
   /* Issuing a command must use a buffer separate from sbuf, for the
-   * case when we interrupt a request to service a reply.
+   * case when we interrupt a request to service a reply.  The
+   * extended form is used if extended headers were negotiated.  Both
+   * forms keep the handle (our cookie) at the same offset.
    */
-  struct nbd_request request;
+  union request_header {
+    struct nbd_request compact;
+    struct nbd_request_ext extended;
+  } request;
   bool in_write_payload;
 
+  /* When the socket supports vectored sends, ISSUE_COMMAND gathers
+   * up to MAX_SEND_BATCH queued commands into wiov and sends them
+   * together using send_from_wiov, with wlen counting the bytes not
+   * yet sent.  wiov_cmd_end[i] is the index in wiov just past the
+   * last element belonging to the i'th command.  wcmds is non-zero
+   * while such a send is in progress, and wcmds_sent counts the
+   * commands already moved to cmds_in_flight.  If wzerocopy is set,
+   * the payload of the last command was left out so that it can be
+   * sent on its own with MSG_ZEROCOPY.
+   */
+  union request_header wreqs[MAX_SEND_BATCH];
+  struct iovec wiov[2 * MAX_SEND_BATCH];
+  int wiov_cmd_end[MAX_SEND_BATCH];
+  int wiov_next, wiov_cnt;
+  int wcmds, wcmds_sent;
+  bool wzerocopy;
+
   /* When connecting, this stores the socket address. */
   struct sockaddr_storage connaddr;
   socklen_t connaddrlen;
@@ -200,10 +655,12 @@ struct nbd_handle {
   /* When connecting to a local command, this points to the argv.  A
    * local copy is taken to simplify callers.  The PID is the PID of
    * the subprocess so we can wait on it when the connection is
-   * closed.
+   * closed.  If wait_subprocess is false, nbd_close leaves the
+   * waiting to a background thread (see nbd_set_wait_subprocess).
    */
   char **argv;
   pid_t pid;
+  bool wait_subprocess;
 
   /* When using systemd socket activation, this directory and socket
    * must be deleted, and the pid above must be killed.
@@ -211,17 +668,49 @@ struct nbd_handle {
   char *sa_tmpdir;
   char *sa_sockpath;
 
-  /* When connecting to TCP ports, these fields are used. */
+  /* When connecting to TCP ports, these fields are used.  addrs
+   * holds the results from getaddrinfo in the order they are tried.
+   */
   char *hostname, *port;
   struct addrinfo hints;
   struct addrinfo *result, *rp;
+  struct addrinfo **addrs;
+  size_t nr_addrs, next_addr;
   int connect_errno;
 
+  /* The lookup of hostname in progress, see lib/resolve.c, and how
+   * old cached lookups may be, see nbd_set_resolver_cache_ttl.
+   */
+  struct resolver *resolver;
+  int resolver_cache_ttl;
+
+  /* When racing connections to several addresses, h->sock is an
+   * epoll file descriptor watching race_timerfd (which fires when
+   * the next attempt should start) and the sockets in race_fds.  See
+   * CONNECT_TCP.RACE_START.
+   */
+  int race_timerfd;
+  int *race_fds;
+  size_t nr_race_fds;
+
   /* When sending metadata contexts, this is used. */
   size_t querynum;
 
-  /* When receiving block status, this is used. */
+  /* When receiving block status, this is used.  It only grows, so
+   * that it is not allocated again for every chunk.
+   */
   uint32_t *bs_entries;
+  size_t bs_entries_size;       /* Allocated size in bytes. */
+
+  /* Extent cache, see nbd_set_extent_cache.  The extents are stored
+   * in the meta_contexts.  extent_cache_entries is used to return
+   * entries from the cache.
+   */
+  bool extent_cache;
+  uint64_t extent_cache_gen;
+  uint64_t extent_cache_hits, extent_cache_misses;
+  uint32_t *extent_cache_entries;
+  size_t extent_cache_entries_alloc;
 
   /* Commands which are waiting to be issued [meaning the request
    * packet is sent to the server].  This is used as a simple linked
@@ -234,38 +723,273 @@ struct nbd_handle {
 
   /* Commands which have been issued and are waiting for replies.
    * Order does not matter here, since the server can reply out-of-order.
+   * This list is doubly linked (through cmd->prev) so that a command
+   * can be unlinked in constant time when its reply arrives.
    */
   struct command *cmds_in_flight;
 
   /* Commands which have received replies, waiting for the main
    * program to acknowledge them.  Maintained as a queue, with new
    * replies at the back, in case a client uses peek to process
-   * replies in server order.
+   * replies in server order.  Also doubly linked.
    */
   struct command *cmds_done;
   struct command *cmds_done_tail;
 
-  /* length (cmds_to_issue) + length (cmds_in_flight). */
-  int in_flight;
+  /* Writes which have received replies, but whose payload was sent
+   * with MSG_ZEROCOPY and may still be in use by the kernel.  They
+   * are completed when the kernel releases their last zero-copy send.
+   * See lib/socket.c.  Doubly linked, in no particular order.
+   */
+  struct command *cmds_zerocopy;
+
+  /* Zero-copy sends on the current socket.  zerocopy_tried is set
+   * once we have asked the socket to enable them.  The kernel numbers
+   * each zero-copy send in sequence from 0, zerocopy_next is the
+   * number of the next send, and all sends before zerocopy_done have
+   * been released.
+   */
+  bool zerocopy_tried, zerocopy_enabled;
+  uint32_t zerocopy_next, zerocopy_done;
+  /* Released ranges which were reported before the sends preceding
+   * them, so are not yet contiguous with zerocopy_done.
+   */
+  struct zerocopy_range *zerocopy_ranges;
+  size_t nr_zerocopy_ranges, zerocopy_ranges_size;
+
+  /* All commands on the four lists above, indexed by cookie.  See
+   * lib/cookies.c.
+   */
+  struct command **cookie_table;
+  size_t cookie_table_size;     /* Number of slots, a power of 2. */
+  size_t cookie_table_used;     /* Number of slots in use. */
+
+  /* length (cmds_to_issue) + length (cmds_in_flight) +
+   * length (cmds_zerocopy).  This is only changed while holding the
+   * lock, but is atomic so that nbd_aio_in_flight can read it
+   * without the lock.
+   */
+  _Atomic int in_flight;
+
+  /* Retired commands kept for reuse, so that the steady state of
+   * issuing and retiring commands does not call malloc and free.
+   * This is a simple stack linked through cmd->next, holding at most
+   * command_pool_size entries.
+   */
+  struct command *cmds_free;
+  int nr_cmds_free;
+  int command_pool_size;
 
   /* Current command during a REPLY cycle */
   struct command *reply_cmd;
 
+  /* Payload length of the structured reply being received, taken from
+   * either the structured or the extended reply header.  The payload
+   * is received into sbuf.sr.payload in both cases, overwriting the
+   * end of an extended header.
+   */
+  uint32_t sr_length;
+
   bool disconnect_request;      /* True if we've queued NBD_CMD_DISC */
+
+  /* True between nbd_aio_begin_batch and nbd_aio_end_batch.  While
+   * set, new commands are queued on cmds_to_issue without kicking the
+   * state machine.
+   */
+  bool batching;
+};
+
+struct listed_export {
+  char *name;                   /* Export name. */
+  char *description;            /* Description, may be empty. */
 };
 
 struct meta_context {
   struct meta_context *next;    /* Linked list. */
   char *name;                   /* Name of meta context. */
   uint32_t context_id;          /* Context ID negotiated with the server. */
+
+  /* Cached extents, see lib/extent-cache.c. */
+  struct cached_extent *extents;
+  size_t nr_extents, extents_alloc;
+};
+
+/* A group of handles connected to the same export, see lib/group.c. */
+struct nbd_group {
+  pthread_mutex_t lock;         /* Protects fds during nbd_group_poll. */
+  int nr_handles;
+  struct nbd_handle **handles;
+  struct pollfd *fds;           /* Scratch space for nbd_group_poll. */
+  uint64_t stripe_size;         /* 0 = select the least busy handle. */
+  _Atomic unsigned next;        /* Where the next least busy search starts. */
+  int nr_workers;               /* See lib/workers.c. */
+  struct group_worker *workers;
+  pthread_mutex_t workers_lock; /* Protects workers_gen. */
+  pthread_cond_t workers_cond;  /* Signalled when workers_gen changes. */
+  uint64_t workers_gen;         /* Bumped by each round of a worker. */
+};
+
+/* A thread waiting on a handle in nbd_poll or a group worker, see
+ * lib/poll.c.
+ */
+struct poll_waiter {
+  struct poll_waiter *next;
+  int wakefd;                   /* Write end of the thread's wakeup. */
+  bool woken;
+};
+
+/* A copy between exports or local files, see lib/copy.c. */
+struct copy_extent {
+  uint64_t offset;
+  uint64_t length;
+  bool zero;                    /* Reads as zero. */
+};
+
+struct copy_request {
+  enum { REQ_IDLE, REQ_READ, REQ_WRITE, REQ_ZERO } state;
+  uint64_t offset;
+  uint32_t count;
+  bool zero;                    /* Zeroing rather than copying. */
+  uint32_t zero_flags;          /* Flags of the zero command. */
+  struct nbd_handle *h;         /* Handle and cookie of the command. */
+  int64_t cookie;
+  char *buf;                    /* request_size bytes. */
+};
+
+struct nbd_copy {
+  /* Settings.  Exactly one of the source group or fd is set, and the
+   * same for the destination.
+   */
+  struct nbd_group *src, *dst;
+  int src_fd, dst_fd;
+  unsigned requests;
+  uint32_t request_size;
+  bool destination_is_zero;
+
+  /* State of nbd_copy_run. */
+  uint64_t size;                /* Size of the source. */
+  uint64_t offset;              /* Start of the next piece to copy. */
+  uint32_t zero_size;           /* Largest zero request. */
+  bool can_extents;             /* Source can report holes. */
+  bool can_zero, fast_zero;     /* Destination can zero (quickly). */
+  bool can_punch_hole;          /* Destination file may punch holes. */
+  struct copy_extent *extents;  /* Queue of extents from offset. */
+  size_t first_extent, nr_extents, extents_alloc;
+  uint64_t extents_end;         /* End of the extents which are known. */
+  struct nbd_handle *bs_h;      /* Block status command in flight. */
+  int64_t bs_cookie;            /* 0 if there is none. */
+  uint64_t bs_end;              /* End of its extents received so far. */
+  struct copy_request *reqs;    /* requests slots. */
+  char *zero_buf;               /* request_size zero bytes, if needed. */
+  struct pollfd *fds;           /* Scratch space for polling. */
+  struct nbd_handle **fd_handles;
+  size_t nr_fds;
+
+  /* Statistics. */
+  uint64_t bytes_copied, bytes_zeroed, elapsed_ns;
+};
+
+/* A set of byte ranges, see lib/bitmap.c. */
+struct bitmap_run {
+  uint64_t start, end;          /* Set bytes are [start, end). */
+};
+
+struct nbd_bitmap {
+  struct bitmap_run *runs;      /* Sorted, never overlapping or touching. */
+  size_t nr_runs, runs_alloc;
+};
+
+/* A set of handles connected to identical exports, see
+ * lib/replicas.c.
+ */
+struct replica {
+  struct nbd_handle *h;
+  uint64_t latency_us;          /* Smoothed latency of its reads, 0 = none. */
+  unsigned in_flight;           /* Commands of the set in flight on it. */
+};
+
+struct nbd_replicas {
+  struct replica *replicas;
+  int nr_replicas;
+  struct pollfd *fds;           /* Scratch space for nbd_replicas_poll. */
+  unsigned hedge_percentile;    /* 0 = do not hedge reads. */
+  struct replica_read *reads;   /* Reads not yet completed. */
+  uint64_t nr_cmds;             /* Commands in flight, including losers. */
+  bool closed;                  /* Freed when the last command retires. */
+  uint64_t hedged_reads;
+};
+
+/* A main loop for many handles, see lib/reactor.c. */
+struct reactor_entry {
+  struct nbd_reactor *r;
+  struct nbd_handle *h;         /* NULL once removed. */
+  size_t index;                 /* Index in r->entries. */
+  int fd;                       /* fd registered in epoll set, or -1. */
+  uint32_t events;              /* Registered epoll events. */
+  int64_t timer;                /* Deadline of nbd_aio_get_timer, or -1. */
+  bool dirty;                   /* On r->dirty, protected by dirty_lock. */
+  struct reactor_entry *dirty_next;
+  struct reactor_entry *update_next; /* Used by nbd_reactor_poll. */
+};
+
+struct nbd_reactor {
+  pthread_mutex_t lock;         /* Protects everything below, except
+                                 * for the dirty list, but is not
+                                 * held while waiting in epoll_wait. */
+  int epfd;
+  int wakefd[2];                /* Pipe to wake epoll_wait. */
+  struct reactor_entry **entries;
+  size_t nr_entries, nr_alloc;
+  size_t nr_waiting;            /* Entries with events registered. */
+  size_t nr_timers;             /* Entries with a timer. */
+  unsigned polling;             /* Threads in nbd_reactor_poll. */
+  struct reactor_entry *removed; /* Freed when polling drops to 0. */
+
+  /* Entries whose handles may have changed direction or timer since
+   * the reactor last looked at them.  The handles add themselves
+   * while holding their own lock, so this has a lock of its own.
+   */
+  pthread_mutex_t dirty_lock;
+  struct reactor_entry *dirty;
+  unsigned sleeping;            /* Threads about to wait or waiting. */
 };
 
 struct socket_ops {
   ssize_t (*recv) (struct nbd_handle *h,
                    struct socket *sock, void *buf, size_t len);
+  /* Optional: if NULL, payloads scattered across several buffers
+   * are received one buffer at a time using recv.
+   */
+  ssize_t (*recv_iov) (struct nbd_handle *h, struct socket *sock,
+                       const struct iovec *iov, int iovcnt);
   ssize_t (*send) (struct nbd_handle *h,
                    struct socket *sock, const void *buf, size_t len, int flags);
+  /* Optional: if NULL, ISSUE_COMMAND sends each buffer using send. */
+  ssize_t (*send_iov) (struct nbd_handle *h, struct socket *sock,
+                       const struct iovec *iov, int iovcnt, int flags);
   bool (*pending) (struct socket *sock);
+  /* Optional: if NULL, zero-copy sends are not supported.
+   * enable_zerocopy returns true if the socket can use MSG_ZEROCOPY.
+   * reap_zerocopy reads the kernel's notifications of zero-copy sends
+   * which have been released, updating *done (see
+   * h->zerocopy_done).  It returns -1 on error.
+   */
+  bool (*enable_zerocopy) (struct nbd_handle *h, struct socket *sock);
+  int (*reap_zerocopy) (struct nbd_handle *h, struct socket *sock,
+                        uint32_t *done);
+  /* Optional: if NULL, payloads to and from file descriptors are
+   * copied through a buffer.  splice_to moves up to len bytes from
+   * the socket to fd at *offset, returning the number of bytes taken
+   * from the socket.  If writing to fd fails the bytes are discarded
+   * and *write_err is set.  send_file sends up to len bytes from fd
+   * at *offset.  Both advance *offset, and fail with EOPNOTSUPP
+   * (without calling set_error) if fd cannot be used this way.
+   */
+  ssize_t (*splice_to) (struct nbd_handle *h, struct socket *sock,
+                        int fd, uint64_t *offset, size_t len,
+                        int *write_err);
+  ssize_t (*send_file) (struct nbd_handle *h, struct socket *sock,
+                        int fd, uint64_t *offset, size_t len);
   int (*get_fd) (struct socket *sock);
   int (*close) (struct socket *sock);
 };
@@ -278,12 +1002,23 @@ struct socket {
        * headers from this file.
        */
       void *session;            /* really gnutls_session_t */
-      void *pskcreds;           /* really gnutls_psk_client_credentials_t */
-      void *xcreds;             /* really gnutls_certificate_credentials_t */
+      void *creds;              /* really struct tls_creds */
       struct socket *oldsock;
+      size_t corked;            /* Bytes corked and not yet flushed. */
     } tls;
+    struct {
+      void *map;                /* struct nbd_shm_header and the rings */
+      uint64_t ring_size;
+      struct socket *oldsock;   /* Unix socket, used as the doorbell */
+    } shm;
+    struct {
+      const char *data;         /* Bytes still to be received. */
+      size_t size;
+      int fd[2];                /* Always ready, see lib/fuzz.c */
+    } fuzz;
   } u;
   const struct socket_ops *ops;
+  struct socket *next_closed;   /* List of h->closed_socks. */
 };
 
 struct command_cb {
@@ -292,20 +1027,98 @@ struct command_cb {
     nbd_chunk_callback chunk;
   } fn;
   nbd_completion_callback completion;
+  nbd_extent_callback sparse; /* For nbd_aio_pread_sparse */
+  nbd_lend_callback lend; /* For nbd_aio_pread_lend */
 };
 
+/* A hole in the reply to nbd_aio_pread_sparse, or a range of a read
+ * covered by data or hole chunks.
+ */
+struct read_hole {
+  uint64_t offset;
+  uint64_t length;
+};
+
+/* Which list on the handle a command is currently linked into. */
+enum command_list {
+  CMDS_TO_ISSUE = 0,
+  CMDS_IN_FLIGHT,
+  CMDS_DONE,
+  CMDS_SPLIT, /* Split into pieces, see nbd_set_split_requests */
+  CMDS_ZEROCOPY,
+  CMDS_COALESCED, /* Merged into another write, see nbd_set_coalesce_writes */
+  CMDS_ATTACHED, /* Waiting for another read, see nbd_set_dedupe_reads */
+  CMDS_HELD, /* Waiting for write-behind writes, see nbd_set_write_behind */
+};
+
+/* Flag used inside the library for writes whose payload it has
+ * copied, see lib/write-behind.c.  Like LIBNBD_CMD_FLAG_REPLAY it is
+ * not sent to the server.
+ */
+#define CMD_FLAG_WRITE_BEHIND (UINT32_C (1) << 31)
+
 struct command {
   struct command *next;
+  struct command *prev; /* Not for cmds_to_issue */
+  enum command_list list;
   uint16_t flags;
   uint16_t type;
   uint64_t cookie;
   uint64_t offset;
-  uint32_t count;
+  uint64_t count; /* Only above 32 bits with extended headers */
   void *data; /* Buffer for read/write */
+  /* For nbd_aio_pread_to_fd and nbd_aio_pwrite_from_fd, the payload
+   * is received into or sent from fd at fd_offset instead of data.
+   */
+  bool has_fd;
+  int fd;
+  uint64_t fd_offset;
+  /* For nbd_aio_preadv and nbd_aio_pwritev, the payload is scattered
+   * across or gathered from these buffers instead of data.  The array
+   * is a copy owned by the command.
+   */
+  struct iovec *iov;
+  int iovcnt;
+  /* For nbd_aio_pread_sparse, the holes which the server has sent, in
+   * the order they arrived.  The pieces of a split request add theirs
+   * to the parent.
+   */
+  struct read_hole *holes;
+  size_t nr_holes, holes_size;
   struct command_cb cb;
   enum state state; /* State to resume with on next POLLIN */
-  bool data_seen; /* For read, true if at least one data chunk seen */
+  uint32_t data_seen; /* For read, bytes covered by data or hole chunks */
+  /* For read, if chunks arrived out of order into a buffer which was
+   * not zeroed, the ranges covered, sorted by offset.
+   */
+  struct read_hole *seen;
+  size_t nr_seen, seen_size;
+  bool initialized; /* For read, true if buffer was zeroed when issued */
   uint32_t error; /* Local errno value */
+  struct command *parent; /* If this is a piece of a split request */
+  struct command *coalesced; /* Writes merged into this one, linked by next */
+  struct command *attached; /* Reads waiting for its data, linked by next */
+  uint32_t pieces; /* For a split request, pieces not yet completed */
+  bool waited_for; /* If a synchronous call is waiting for this */
+  bool zerocopy; /* If the payload was sent with MSG_ZEROCOPY */
+  uint32_t zerocopy_seq; /* Sequence number of its last zero-copy send */
+  uint64_t extent_cache_gen; /* For block status, see lib/extent-cache.c */
+  uint64_t dedupe_gen; /* For read, see nbd_set_dedupe_reads */
+  bool replay; /* Write may be sent again after reconnecting */
+  bool priority; /* Issued with LIBNBD_CMD_FLAG_PRIORITY */
+  bool coalesce; /* Issued with LIBNBD_CMD_FLAG_COALESCE */
+  bool prefetch; /* Reads ahead of a stream, see lib/read-ahead.c */
+  bool shared_cache; /* For read, fill the shared cache when done */
+  uint64_t shared_cache_gen; /* See lib/shared-cache.c */
+  uint32_t overtaken; /* Priority commands queued ahead of it */
+  uint64_t issued_us; /* When it was issued, for statistics */
+  uint64_t sent_us; /* When its request was sent, see lib/depth.c */
+  bool replied; /* A reply header has been received */
+  uint32_t record_seq; /* See lib/record.c, 0 if not recorded */
+  uint32_t record_after; /* See lib/record.c */
+  bool write_behind; /* Payload copied, see lib/write-behind.c */
+  uint32_t deferred_error; /* Error of earlier write-behind writes */
+  struct lent_buffer *lent; /* For read, see lib/lend.c */
 };
 
 /* Test if a callback is "null" or not, and set it to null. */
@@ -326,15 +1139,32 @@ struct command {
   } while (0)
 
 /* aio.c */
-extern void nbd_internal_retire_and_free_command (struct command *);
+extern struct command *nbd_internal_alloc_command (struct nbd_handle *);
+extern void nbd_internal_free_command (struct nbd_handle *,
+                                       struct command *);
+extern void nbd_internal_retire_and_free_command (struct nbd_handle *,
+                                                  struct command *);
+extern void nbd_internal_free_command_pool (struct nbd_handle *);
+extern int nbd_internal_nr_commands_being_sent (struct nbd_handle *h);
 
 /* connect.c */
 extern int nbd_internal_wait_until_connected (struct nbd_handle *h);
+extern void nbd_internal_free_tcp_race (struct nbd_handle *h);
+
+/* cookies.c */
+extern int nbd_internal_cookie_table_insert (struct nbd_handle *h,
+                                             struct command *cmd);
+extern struct command *nbd_internal_cookie_table_lookup (struct nbd_handle *h,
+                                                         uint64_t cookie);
+extern void nbd_internal_cookie_table_remove (struct nbd_handle *h,
+                                              struct command *cmd);
 
 /* crypto.c */
 extern struct socket *nbd_internal_crypto_create_session (struct nbd_handle *, struct socket *oldsock);
 extern bool nbd_internal_crypto_is_reading (struct nbd_handle *);
 extern int nbd_internal_crypto_handshake (struct nbd_handle *);
+extern int nbd_internal_crypto_kernel_offload (struct nbd_handle *);
+extern void nbd_internal_crypto_save_session (struct nbd_handle *);
 extern void nbd_internal_crypto_debug_tls_enabled (struct nbd_handle *);
 
 /* debug.c */
@@ -346,47 +1176,188 @@ extern void nbd_internal_debug (struct nbd_handle *h, const char *fs, ...);
   } while (0)
 
 /* errors.c */
-extern void nbd_internal_set_error_context (const char *context);
-extern const char *nbd_internal_get_error_context (void);
+extern __thread const char *nbd_internal_error_context
+  __attribute__((tls_model ("initial-exec")));
+
+/* Called on entry to any API function that can call an error function
+ * (see generator "may_set_error") to reset the error context.  The
+ * 'context' parameter is the name of the function.
+ */
+static inline void
+nbd_internal_set_error_context (const char *context)
+{
+  nbd_internal_error_context = context;
+}
+
+static inline const char *
+nbd_internal_get_error_context (void)
+{
+  return nbd_internal_error_context;
+}
+
 extern void nbd_internal_set_last_error (int errnum, char *error);
-#define set_error(errnum, fs, ...)                                      \
-  do {                                                                  \
-    int _e = (errnum);                                                  \
-    const char *_context =                                              \
-      nbd_internal_get_error_context () ? : "unknown";                  \
-    char *_errp;                                                        \
-    int _r;                                                             \
-    if (_e == 0)                                                        \
-      _r = asprintf (&_errp, "%s: " fs, _context, ##__VA_ARGS__);       \
-    else                                                                \
-      _r = asprintf (&_errp, "%s: " fs ": %s",                          \
-                     _context, ##__VA_ARGS__, strerror (_e));           \
-    if (_r >= 0)                                                        \
-      nbd_internal_set_last_error (_e, _errp);                          \
-  } while (0)
+extern void nbd_internal_set_error (int errnum, const char *fs, ...)
+  __attribute__((__format__ (__printf__, 2, 3)));
+#define set_error(errnum, fs, ...)                      \
+  nbd_internal_set_error ((errnum), fs, ##__VA_ARGS__)
+
+/* extent-cache.c */
+extern void nbd_internal_extent_cache_free (struct meta_context *m);
+extern void nbd_internal_extent_cache_invalidate (struct nbd_handle *h,
+                                                  uint64_t offset,
+                                                  uint64_t count);
+extern void nbd_internal_extent_cache_add (struct nbd_handle *h,
+                                           struct meta_context *m,
+                                           uint64_t offset,
+                                           const uint32_t *entries,
+                                           size_t nr_entries);
+extern int nbd_internal_extent_cache_block_status (struct nbd_handle *h,
+                                                   uint64_t count,
+                                                   uint64_t offset,
+                                                   nbd_extent_callback *extent,
+                                                   uint32_t flags);
 
 /* flags.c */
 extern int nbd_internal_set_size_and_flags (struct nbd_handle *h,
                                             uint64_t exportsize,
                                             uint16_t eflags);
+extern int nbd_internal_set_block_size (struct nbd_handle *h,
+                                        uint32_t minimum,
+                                        uint32_t preferred,
+                                        uint32_t maximum);
+extern uint32_t nbd_internal_max_request_size (struct nbd_handle *h);
+
+/* fuzz.c */
+extern int nbd_internal_fuzz_connect (struct nbd_handle *h,
+                                      const void *data, size_t size);
 
-/* is-state.c */
-extern bool nbd_internal_is_state_created (enum state state);
+/* handle.c */
+extern void nbd_internal_free_meta_contexts (struct nbd_handle *h);
+extern void nbd_internal_free_exports (struct nbd_handle *h);
+
+/* is-state.c, and states-run.c for the groups of states.  These are
+ * called with the lock held by every call with permitted_states.
+ */
 extern bool nbd_internal_is_state_connecting (enum state state);
-extern bool nbd_internal_is_state_ready (enum state state);
 extern bool nbd_internal_is_state_processing (enum state state);
-extern bool nbd_internal_is_state_dead (enum state state);
-extern bool nbd_internal_is_state_closed (enum state state);
+
+static inline bool
+nbd_internal_is_state_created (enum state state)
+{
+  return state == STATE_START;
+}
+
+static inline bool
+nbd_internal_is_state_ready (enum state state)
+{
+  return state == STATE_READY;
+}
+
+static inline bool
+nbd_internal_is_state_dead (enum state state)
+{
+  return state == STATE_DEAD;
+}
+
+static inline bool
+nbd_internal_is_state_closed (enum state state)
+{
+  return state == STATE_CLOSED;
+}
+
+/* lend.c */
+extern int nbd_internal_lend_alloc (struct nbd_handle *h, struct command *cmd);
+extern void nbd_internal_lend (struct nbd_handle *h, struct command *cmd);
+extern void nbd_internal_lend_put (struct nbd_handle *h, struct command *cmd);
+extern void nbd_internal_lend_free (struct nbd_handle *h);
+
+/* liveness.c */
+extern int64_t nbd_internal_liveness_delay (struct nbd_handle *h);
+extern int nbd_internal_liveness_check (struct nbd_handle *h);
+
+/* poll.c */
+extern void nbd_internal_wake_pollers (struct nbd_handle *h);
+extern void nbd_internal_close_socket (struct nbd_handle *h);
+extern void nbd_internal_add_poller (struct nbd_handle *h,
+                                     struct poll_waiter *waiter, int wakefd);
+extern bool nbd_internal_remove_poller (struct nbd_handle *h,
+                                        struct poll_waiter *waiter);
+extern int nbd_internal_poll_notify (struct nbd_handle *h,
+                                     struct socket *sock, short revents);
+extern void nbd_internal_notify_direction (struct nbd_handle *h,
+                                           enum state state);
 
 /* protocol.c */
 extern int nbd_internal_errno_of_nbd_error (uint32_t error);
 extern const char *nbd_internal_name_of_nbd_cmd (uint16_t type);
 
+/* depth.c */
+extern int nbd_internal_depth_slots (struct nbd_handle *h);
+extern void nbd_internal_depth_sent (struct nbd_handle *h,
+                                     struct command *cmd);
+extern void nbd_internal_depth_reply (struct nbd_handle *h,
+                                      const struct command *cmd);
+extern void nbd_internal_depth_reset (struct nbd_handle *h);
+
+/* elevator.c */
+extern void nbd_internal_elevator_sort (struct nbd_handle *h);
+extern void nbd_internal_elevator_sent (struct nbd_handle *h,
+                                        const struct command *cmd);
+
+/* rate-limit.c */
+extern uint64_t nbd_internal_rate_delay (struct nbd_handle *h,
+                                         const struct command *cmd);
+extern bool nbd_internal_rate_admit (struct nbd_handle *h,
+                                     const struct command *cmd);
+
+/* reactor.c */
+extern void nbd_internal_reactor_mark_dirty (struct reactor_entry *e);
+
+/* reaper.c */
+extern void nbd_internal_remove_socket_dir (char *sockpath, char *tmpdir);
+extern void nbd_internal_reap (pid_t pid, char *sockpath, char *tmpdir);
+
+/* read-ahead.c */
+extern bool nbd_internal_read_ahead_serve (struct nbd_handle *h,
+                                           struct command *cmd);
+extern void nbd_internal_read_ahead (struct nbd_handle *h,
+                                     uint64_t offset, uint64_t count);
+extern void nbd_internal_read_ahead_free (struct nbd_handle *h);
+
+/* resolve.c */
+extern int nbd_internal_resolve_start (struct nbd_handle *h);
+extern int nbd_internal_resolve_finish (struct nbd_handle *h);
+extern void nbd_internal_resolve_cancel (struct nbd_handle *h);
+extern void nbd_internal_free_addrinfo (struct addrinfo *ai);
+
+/* record.c */
+extern void nbd_internal_record_submit (struct nbd_handle *h,
+                                        struct command *cmd);
+extern void nbd_internal_record_complete (struct nbd_handle *h,
+                                          const struct command *cmd);
+
 /* rw.c */
 extern int64_t nbd_internal_command_common (struct nbd_handle *h,
-                                            uint16_t flags, uint16_t type,
+                                            uint32_t flags, uint16_t type,
                                             uint64_t offset, uint64_t count,
                                             void *data, struct command_cb *cb);
+extern void nbd_internal_detach_reads (struct nbd_handle *h,
+                                       struct command *cmd);
+
+/* shared-cache.c */
+extern bool nbd_internal_shared_cache_serve (struct nbd_handle *h,
+                                             struct command *cmd);
+extern void nbd_internal_shared_cache_fill (struct nbd_handle *h,
+                                            struct command *cmd);
+extern void nbd_internal_shared_cache_invalidate (struct nbd_handle *h,
+                                                  uint64_t offset,
+                                                  uint64_t count);
+
+/* shm.c */
+extern bool nbd_internal_shm_prepare (struct nbd_handle *h);
+extern int nbd_internal_shm_send_fd (struct nbd_handle *h);
+extern int nbd_internal_shm_start (struct nbd_handle *h);
+extern void nbd_internal_shm_discard (struct nbd_handle *h);
 
 /* socket.c */
 struct socket *nbd_internal_socket_create (int fd);
@@ -397,11 +1368,109 @@ extern const char *nbd_internal_state_short_string (enum state state);
 extern enum state_group nbd_internal_state_group (enum state state);
 extern enum state_group nbd_internal_state_group_parent (enum state_group group);
 extern int nbd_internal_aio_get_direction (enum state state);
+extern void nbd_internal_cancel_command (struct nbd_handle *h,
+                                         struct command *cmd);
+extern void nbd_internal_complete_unsent_command (struct nbd_handle *h,
+                                                 struct command *cmd);
+extern void nbd_internal_abort_connection (struct nbd_handle *h);
 
 #define set_next_state(h,next_state) ((h)->state) = (next_state)
 #define get_next_state(h) ((h)->state)
 #define get_public_state(h) ((h)->public_state)
 
+/* Make the public state the same as the current state.  Call this
+ * before releasing the lock at the end of each call which may have
+ * run the state machine.
+ */
+static inline void
+nbd_internal_update_public_state (struct nbd_handle *h)
+{
+  const enum state state = get_next_state (h);
+
+  if (h->public_state != state) {
+    h->public_state = state;
+    if (unlikely (CALLBACK_IS_NOT_NULL (h->direction_callback)))
+      nbd_internal_notify_direction (h, state);
+  }
+  if (h->reactor_entry)
+    nbd_internal_reactor_mark_dirty (h->reactor_entry);
+}
+
+/* stats.c */
+extern uint64_t nbd_internal_stats_now (void);
+extern void nbd_internal_stats_command_done (struct nbd_handle *h,
+                                             const struct command *cmd);
+extern int64_t nbd_internal_stats_latency_percentile (struct nbd_handle *h,
+                                                      int type,
+                                                      unsigned percentile);
+
+/* trace.c */
+enum trace_type {
+  TRACE_STATE,                  /* code = new state */
+  TRACE_SUBMIT,                 /* code = command type */
+  TRACE_COMPLETE,               /* code = command type, result = error */
+  TRACE_RECV,                   /* result = bytes or -errno */
+  TRACE_SEND,                   /* result = bytes or -errno */
+};
+
+struct trace_record {
+  uint64_t time;                /* CLOCK_MONOTONIC, nanoseconds. */
+  uint64_t cookie;
+  uint64_t offset;
+  int64_t result;
+  uint64_t count;
+  uint16_t type;                /* enum trace_type */
+  uint16_t code;
+};
+
+extern void nbd_internal_trace (struct nbd_handle *h, enum trace_type type,
+                                uint16_t code, uint64_t cookie,
+                                uint64_t offset, uint64_t count,
+                                int64_t result);
+extern void nbd_internal_dump_trace (struct nbd_handle *h);
+extern void nbd_internal_command_event (struct nbd_handle *h,
+                                        const struct command *cmd,
+                                        unsigned event);
+#define trace(h, type, code, cookie, offset, count, result)             \
+  do {                                                                  \
+    if (unlikely ((h)->trace != NULL))                                  \
+      nbd_internal_trace ((h), (type), (code), (cookie), (offset),      \
+                          (count), (result));                           \
+  } while (0)
+
+#define command_event(h, cmd, event)                                    \
+  do {                                                                  \
+    if (unlikely (CALLBACK_IS_NOT_NULL ((h)->command_event_callback)))  \
+      nbd_internal_command_event ((h), (cmd), (event));                 \
+  } while (0)
+
+#define record_submit(h, cmd)                                           \
+  do {                                                                  \
+    if (unlikely ((h)->record_fp != NULL))                              \
+      nbd_internal_record_submit ((h), (cmd));                          \
+  } while (0)
+
+#define record_complete(h, cmd)                                         \
+  do {                                                                  \
+    if (unlikely ((cmd)->record_seq != 0))                              \
+      nbd_internal_record_complete ((h), (cmd));                        \
+  } while (0)
+
+/* Static probes (USDT) for SystemTap, bpftrace and perf, see
+ * "STATIC PROBES" in libnbd(3).  When nothing is attached each probe
+ * is a single no-op instruction, but the arguments are still
+ * evaluated, so they must be cheap.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define probe(name, ...) STAP_PROBEV (libnbd, name, ##__VA_ARGS__)
+#else
+#define probe(name, ...) do { } while (0)
+#endif
+
+/* uri.c */
+extern int nbd_internal_uri_connections (struct nbd_handle *h);
+
 /* utils.c */
 extern void nbd_internal_hexdump (const void *data, size_t len, FILE *fp);
 extern size_t nbd_internal_string_list_length (char **argv);
@@ -409,5 +1478,32 @@ extern char **nbd_internal_copy_string_list (char **argv);
 extern void nbd_internal_free_string_list (char **argv);
 extern const char *nbd_internal_fork_safe_itoa (long v, char *buf, size_t len);
 extern void nbd_internal_fork_safe_perror (const char *s);
+extern int64_t nbd_internal_deadline (struct nbd_handle *h);
+extern int nbd_internal_time_left (int64_t deadline);
+extern struct iovec *nbd_internal_iov_slice (const struct iovec *iov,
+                                             int iovcnt, uint64_t offset,
+                                             uint64_t count, int *nr);
+extern void nbd_internal_iov_zero (const struct iovec *iov, int iovcnt,
+                                   uint64_t offset, uint64_t length);
+extern size_t nbd_internal_coalesce_extents (uint32_t *entries,
+                                             size_t nr_entries);
+
+/* workers.c */
+extern int nbd_internal_group_wait_workers (struct nbd_group *g,
+                                            int timeout);
+
+/* write-behind.c */
+extern int64_t nbd_internal_write_behind (struct nbd_handle *h,
+                                          const void *buf, size_t count,
+                                          uint64_t offset,
+                                          nbd_completion_callback completion,
+                                          uint32_t flags);
+extern bool nbd_internal_write_behind_hold (struct nbd_handle *h,
+                                            struct command *first,
+                                            struct command *last);
+extern void nbd_internal_write_behind_release (struct nbd_handle *h);
+extern void nbd_internal_write_behind_complete (struct nbd_handle *h,
+                                                struct command *cmd);
+extern void nbd_internal_write_behind_free (struct nbd_handle *h);
 
 #endif /* LIBNBD_INTERNAL_H */
@@ -24,79 +24,10 @@
 
 #include "internal.h"
 
-/* Internal functions to test state or groups of states. */
-
-bool
-nbd_internal_is_state_created (enum state state)
-{
-  return state == STATE_START;
-}
-
-static int
-is_connecting_group (enum state_group group)
-{
-  switch (group) {
-  case GROUP_TOP:
-    return 0;
-  case GROUP_CONNECT:
-  case GROUP_CONNECT_TCP:
-  case GROUP_CONNECT_COMMAND:
-  case GROUP_MAGIC:
-  case GROUP_OLDSTYLE:
-  case GROUP_NEWSTYLE:
-    return 1;
-  default:
-    return is_connecting_group (nbd_internal_state_group_parent (group));
-  }
-}
-
-bool
-nbd_internal_is_state_connecting (enum state state)
-{
-  enum state_group group = nbd_internal_state_group (state);
-
-  return is_connecting_group (group);
-}
-
-bool
-nbd_internal_is_state_ready (enum state state)
-{
-  return state == STATE_READY;
-}
-
-static int
-is_processing_group (enum state_group group)
-{
-  switch (group) {
-  case GROUP_TOP:
-    return 0;
-  case GROUP_ISSUE_COMMAND:
-  case GROUP_REPLY:
-    return 1;
-  default:
-    return is_processing_group (nbd_internal_state_group_parent (group));
-  }
-}
-
-bool
-nbd_internal_is_state_processing (enum state state)
-{
-  enum state_group group = nbd_internal_state_group (state);
-
-  return is_processing_group (group);
-}
-
-bool
-nbd_internal_is_state_dead (enum state state)
-{
-  return state == STATE_DEAD;
-}
-
-bool
-nbd_internal_is_state_closed (enum state state)
-{
-  return state == STATE_CLOSED;
-}
+/* The internal functions to test the state are in internal.h, and
+ * nbd_internal_is_state_connecting and
+ * nbd_internal_is_state_processing are generated in states-run.c.
+ */
 
 /* The nbd_unlocked_aio_is_* and nbd_unlocked_aio_get_direction calls are
  * the public APIs for reading the state of the handle.
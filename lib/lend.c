@@ -0,0 +1,216 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Reads into buffers owned by the library, see nbd_aio_pread_lend.
+ *
+ * The command is issued without a buffer.  The state machine calls
+ * nbd_internal_lend_alloc when the first data of the reply arrives,
+ * which takes a struct lent_buffer from lend_pool (or allocates one),
+ * so the memory in use follows the replies being received rather
+ * than the reads in flight.  When the read completes the buffer is
+ * lent to the lend callback, and then goes straight back to
+ * lend_pool, unless the callback kept it, in which case it waits on
+ * lent until nbd_aio_release_buffer.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+
+/* The smallest size class of buffers, and the most free buffers kept
+ * on lend_pool and the largest size class kept there.
+ */
+#define LEND_MIN_SIZE 4096
+#define LEND_POOL_MAX 64
+#define LEND_POOL_MAX_SIZE (4 * 1024 * 1024)
+
+struct lent_buffer {
+  struct lent_buffer *next;     /* On lend_pool or lent */
+  int64_t cookie;               /* Of the read, while on lent */
+  size_t size;                  /* Size class, a power of 2 */
+  char data[];
+};
+
+int64_t
+nbd_unlocked_aio_pread_lend (struct nbd_handle *h,
+                             uint64_t count, uint64_t offset,
+                             nbd_lend_callback lend,
+                             nbd_completion_callback completion,
+                             uint32_t flags)
+{
+  struct command_cb cb = { .completion = completion, .lend = lend };
+
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  /* The pieces of a split read would each get a buffer of their own. */
+  if (count > nbd_internal_max_request_size (h)) {
+    set_error (ERANGE, "request too large: maximum request size is %"
+               PRIu32, nbd_internal_max_request_size (h));
+    return -1;
+  }
+
+  return nbd_internal_command_common (h, flags, NBD_CMD_READ, offset, count,
+                                      NULL, &cb);
+}
+
+static size_t
+size_class (size_t count)
+{
+  size_t size = LEND_MIN_SIZE;
+
+  while (size < count)
+    size *= 2;
+  return size;
+}
+
+static void
+put_buffer (struct nbd_handle *h, struct lent_buffer *b)
+{
+  if (h->lend_pool_nr < LEND_POOL_MAX && b->size <= LEND_POOL_MAX_SIZE) {
+    b->next = h->lend_pool;
+    h->lend_pool = b;
+    h->lend_pool_nr++;
+  }
+  else
+    free (b);
+}
+
+/* Give cmd its buffer, when the first data for it arrives. */
+int
+nbd_internal_lend_alloc (struct nbd_handle *h, struct command *cmd)
+{
+  const size_t size = size_class (cmd->count);
+  struct lent_buffer *b, **bp;
+
+  for (bp = &h->lend_pool; (b = *bp) != NULL; bp = &b->next) {
+    if (b->size == size) {
+      *bp = b->next;
+      h->lend_pool_nr--;
+      break;
+    }
+  }
+  if (b == NULL) {
+    b = malloc (sizeof *b + size);
+    if (b == NULL) {
+      set_error (errno, "malloc");
+      return -1;
+    }
+    b->size = size;
+  }
+
+  /* A pooled buffer holds the data of an earlier read, so it is
+   * zeroed as nbd_internal_command_common does for caller buffers.
+   */
+  if (h->structured_replies && h->pread_initialize) {
+    memset (b->data, 0, cmd->count);
+    cmd->initialized = true;
+  }
+  cmd->lent = b;
+  cmd->data = b->data;
+  return 0;
+}
+
+/* Called as cmd completes, before its completion callback. */
+void
+nbd_internal_lend (struct nbd_handle *h, struct command *cmd)
+{
+  struct lent_buffer *b;
+  int error = 0;
+  int r;
+
+  /* A read with no chunks, which is only possible for count 0. */
+  if (cmd->error == 0 && cmd->lent == NULL &&
+      nbd_internal_lend_alloc (h, cmd) == -1)
+    cmd->error = ENOMEM;
+
+  b = cmd->lent;
+  if (cmd->error == 0) {
+    r = CALL_CALLBACK (cmd->cb.lend, b->data, cmd->count, cmd->offset,
+                       &error);
+    if (r == -1)
+      cmd->error = error ? error : EPROTO;
+    else if (r == 1) {
+      b->cookie = cmd->cookie;
+      b->next = h->lent;
+      h->lent = b;
+      b = NULL;
+    }
+  }
+
+  if (b != NULL)
+    put_buffer (h, b);
+  cmd->lent = NULL;
+  cmd->data = NULL;
+}
+
+/* Called as cmd is retired, if it never completed. */
+void
+nbd_internal_lend_put (struct nbd_handle *h, struct command *cmd)
+{
+  put_buffer (h, cmd->lent);
+  cmd->lent = NULL;
+  cmd->data = NULL;
+}
+
+int
+nbd_unlocked_aio_release_buffer (struct nbd_handle *h, int64_t cookie)
+{
+  struct lent_buffer *b, **bp;
+
+  for (bp = &h->lent; (b = *bp) != NULL; bp = &b->next) {
+    if (b->cookie == cookie) {
+      *bp = b->next;
+      put_buffer (h, b);
+      return 0;
+    }
+  }
+
+  set_error (EINVAL, "no buffer is kept for cookie %" PRIi64, cookie);
+  return -1;
+}
+
+static void
+free_list (struct lent_buffer *b)
+{
+  struct lent_buffer *next;
+
+  for (; b != NULL; b = next) {
+    next = b->next;
+    free (b);
+  }
+}
+
+void
+nbd_internal_lend_free (struct nbd_handle *h)
+{
+  free_list (h->lend_pool);
+  free_list (h->lent);
+  h->lend_pool = h->lent = NULL;
+  h->lend_pool_nr = 0;
+}
@@ -0,0 +1,207 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Finding out that the server has gone away, see
+ * nbd_set_reply_timeout and nbd_set_probe_interval.
+ *
+ * A server which dies or is cut off without the connection being
+ * closed cleanly leaves the socket silent, and TCP may take many
+ * minutes to give up on it.  So while commands are waiting for
+ * replies, the connection is closed if nothing at all has been
+ * received for the reply timeout, and while it is idle a small read
+ * is sent every probe interval so that there is something to wait
+ * for.
+ *
+ * Like the rate limits, these are driven by the timer which the main
+ * loop gets from nbd_aio_get_timer.  Progress is noticed by looking
+ * at the count of bytes received each time the timer is fetched or
+ * expires, which costs nothing on the paths that receive data.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "internal.h"
+
+/* The size of the probe read, unless the server needs more. */
+#define PROBE_SIZE 512
+
+int
+nbd_unlocked_set_reply_timeout (struct nbd_handle *h, int timeout)
+{
+  if (timeout < -1 || timeout == 0) {
+    set_error (EINVAL, "invalid reply timeout: %d", timeout);
+    return -1;
+  }
+
+  h->reply_timeout = timeout;
+  h->liveness_us = nbd_internal_stats_now ();
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_reply_timeout (struct nbd_handle *h)
+{
+  return h->reply_timeout;
+}
+
+int
+nbd_unlocked_set_probe_interval (struct nbd_handle *h, int interval)
+{
+  if (interval < 0) {
+    set_error (EINVAL, "invalid probe interval: %d", interval);
+    return -1;
+  }
+
+  h->probe_interval = interval;
+  h->liveness_us = nbd_internal_stats_now ();
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_probe_interval (struct nbd_handle *h)
+{
+  return h->probe_interval;
+}
+
+/* Return true if the connection is idle, so that a probe may be
+ * sent.
+ */
+static bool
+is_idle (struct nbd_handle *h)
+{
+  return h->in_flight == 0 && h->cmds_to_issue == NULL && !h->batching &&
+    !h->disconnect_request &&
+    nbd_internal_is_state_ready (get_next_state (h));
+}
+
+/* Return how many microseconds until the connection should be
+ * checked, which may be 0, or -1 if there is nothing to check.
+ */
+int64_t
+nbd_internal_liveness_delay (struct nbd_handle *h)
+{
+  enum state state = get_next_state (h);
+  uint64_t now, limit;
+
+  if (h->reply_timeout == -1 && h->probe_interval == 0)
+    return -1;
+  if (!nbd_internal_is_state_ready (state) &&
+      !nbd_internal_is_state_processing (state))
+    return -1;
+
+  if (h->cmds_in_flight != NULL && h->reply_timeout != -1)
+    limit = (uint64_t) h->reply_timeout * 1000;
+  else if (h->probe_interval > 0 && is_idle (h))
+    limit = (uint64_t) h->probe_interval * 1000;
+  else
+    return -1;
+
+  now = nbd_internal_stats_now ();
+  if (h->stats.bytes_received != h->liveness_bytes) {
+    h->liveness_bytes = h->stats.bytes_received;
+    h->liveness_us = now;
+  }
+  if (now - h->liveness_us >= limit)
+    return 0;
+  return h->liveness_us + limit - now;
+}
+
+static int
+probe_done (void *user_data, int *error)
+{
+  return 1;
+}
+
+/* Send a read of the start of the export, which the server must
+ * reply to.  It is sent as a priority command so that it always
+ * goes to the server instead of being served by a cache.
+ */
+static int
+send_probe (struct nbd_handle *h)
+{
+  struct command_cb cb = {
+    .completion = { .callback = probe_done },
+  };
+  uint32_t len = PROBE_SIZE;
+
+  if (h->block_minimum > len)
+    len = h->block_minimum;
+  if (h->exportsize < len) {
+    /* There is nothing to read, but also nothing to be kept waiting. */
+    h->liveness_us = nbd_internal_stats_now ();
+    return 0;
+  }
+  if (h->probe_buf == NULL) {
+    h->probe_buf = malloc (len);
+    if (h->probe_buf == NULL) {
+      set_error (errno, "malloc");
+      return -1;
+    }
+  }
+
+  debug (h, "connection idle for %d ms, probing the server",
+         h->probe_interval);
+  if (nbd_internal_command_common (h, LIBNBD_CMD_FLAG_PRIORITY,
+                                   NBD_CMD_READ, 0, len,
+                                   h->probe_buf, &cb) == -1)
+    return -1;
+  return 0;
+}
+
+/* Called when the timer expires.  Either sends a probe, or closes
+ * the connection if the server has not replied for too long.  The
+ * socket is shut down and the state machine notified, so that it
+ * goes to DEAD in the usual way, which fails the commands in flight
+ * or reconnects (see nbd_set_reconnect).
+ */
+int
+nbd_internal_liveness_check (struct nbd_handle *h)
+{
+  struct command *cmd;
+  int dir;
+
+  if (nbd_internal_liveness_delay (h) != 0)
+    return 0;
+  if (h->cmds_in_flight == NULL)
+    return send_probe (h);
+
+  debug (h, "no reply from the server for %d ms, closing the connection",
+         h->reply_timeout);
+  for (cmd = h->cmds_in_flight; cmd != NULL; cmd = cmd->next) {
+    if (cmd->error == 0)
+      cmd->error = ETIMEDOUT;
+  }
+  h->reply_timed_out = true;
+  shutdown (h->sock->ops->get_fd (h->sock), SHUT_RDWR);
+
+  dir = nbd_internal_aio_get_direction (get_next_state (h));
+  if ((dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+    return nbd_unlocked_aio_notify_read (h);
+  if ((dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+    return nbd_unlocked_aio_notify_write (h);
+  return 0;
+}
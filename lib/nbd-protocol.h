@@ -78,6 +78,40 @@ struct nbd_new_option {
   /* option data follows */
 } NBD_ATTRIBUTE_PACKED;
 
+/* NBD_OPT_SHARED_MEMORY option data.  The memfd holding struct
+ * nbd_shm_header and the rings is passed with SCM_RIGHTS in the same
+ * message as the option.
+ */
+struct nbd_shared_memory_option {
+  uint64_t ring_size;         /* size of each ring */
+} NBD_ATTRIBUTE_PACKED;
+
+/* Start of the shared memory for NBD_OPT_SHARED_MEMORY, in host byte
+ * order.  The ring carrying data to the server starts at
+ * NBD_SHM_DATA_OFFSET and the ring carrying data to the client
+ * follows it.  head and tail count every byte ever written to and
+ * read from each ring.
+ */
+#define NBD_SHM_MAGIC UINT64_C(0x6c69626e62647368) /* "libnbdsh" */
+#define NBD_SHM_DATA_OFFSET 4096
+
+struct nbd_shm_ring {
+  uint64_t head;              /* advanced by the writer */
+  char pad1[56];
+  uint64_t tail;              /* advanced by the reader */
+  char pad2[56];
+};
+
+struct nbd_shm_header {
+  uint64_t magic;             /* NBD_SHM_MAGIC */
+  uint64_t ring_size;
+  uint32_t client_waiting;    /* client wants a doorbell */
+  uint32_t server_waiting;    /* server wants a doorbell */
+  char pad[40];
+  struct nbd_shm_ring to_server;
+  struct nbd_shm_ring to_client;
+};
+
 /* Newstyle handshake OPT_EXPORT_NAME reply message.
  * Modern clients use NBD_OPT_GO instead of this.
  */
@@ -124,6 +158,10 @@ struct nbd_fixed_new_option_reply {
 #define NBD_OPT_STRUCTURED_REPLY   8
 #define NBD_OPT_LIST_META_CONTEXT  9
 #define NBD_OPT_SET_META_CONTEXT   10
+#define NBD_OPT_EXTENDED_HEADERS   11
+
+/* libnbd extension, not part of the NBD protocol, see below. */
+#define NBD_OPT_SHARED_MEMORY      0x4c42534d /* "LBSM" */
 
 #define NBD_REP_ERR(val) (0x80000000 | (val))
 #define NBD_REP_IS_ERR(val) (!!((val) & 0x80000000))
@@ -141,6 +179,7 @@ struct nbd_fixed_new_option_reply {
 #define NBD_REP_ERR_SHUTDOWN         NBD_REP_ERR (7)
 #define NBD_REP_ERR_BLOCK_SIZE_REQD  NBD_REP_ERR (8)
 #define NBD_REP_ERR_TOO_BIG          NBD_REP_ERR (9)
+#define NBD_REP_ERR_EXT_HEADER_REQD  NBD_REP_ERR (10)
 
 #define NBD_INFO_EXPORT      0
 #define NBD_INFO_NAME        1
@@ -154,6 +193,20 @@ struct nbd_fixed_new_option_reply_info_export {
   uint16_t eflags;              /* per-export flags */
 } NBD_ATTRIBUTE_PACKED;
 
+/* NBD_INFO_BLOCK_SIZE reply (follows fixed_new_option_reply). */
+struct nbd_fixed_new_option_reply_info_block_size {
+  uint16_t info;                /* NBD_INFO_BLOCK_SIZE */
+  uint32_t minimum;             /* minimum block size */
+  uint32_t preferred;           /* preferred block size */
+  uint32_t maximum;             /* maximum block size */
+} NBD_ATTRIBUTE_PACKED;
+
+/* NBD_REP_SERVER reply (follows fixed_new_option_reply). */
+struct nbd_fixed_new_option_reply_server {
+  uint32_t export_name_len;     /* length of export name */
+  /* followed by a string export name and description */
+} NBD_ATTRIBUTE_PACKED;
+
 /* NBD_REP_META_CONTEXT reply (follows fixed_new_option_reply). */
 struct nbd_fixed_new_option_reply_meta_context {
   uint32_t context_id;          /* metadata context ID */
@@ -166,6 +219,18 @@ struct nbd_block_descriptor {
   uint32_t status_flags;        /* block type (hole etc) */
 } NBD_ATTRIBUTE_PACKED;
 
+/* NBD_REPLY_TYPE_BLOCK_STATUS_EXT block descriptor. */
+struct nbd_block_descriptor_ext {
+  uint64_t length;              /* length of block */
+  uint64_t status_flags;        /* block type (hole etc) */
+} NBD_ATTRIBUTE_PACKED;
+
+/* NBD_REPLY_TYPE_BLOCK_STATUS_EXT header (followed by descriptors). */
+struct nbd_structured_reply_block_status_ext_hdr {
+  uint32_t context_id;          /* metadata context ID */
+  uint32_t count;               /* number of descriptors that follow */
+} NBD_ATTRIBUTE_PACKED;
+
 /* Request (client -> server). */
 struct nbd_request {
   uint32_t magic;               /* NBD_REQUEST_MAGIC. */
@@ -176,6 +241,18 @@ struct nbd_request {
   uint32_t count;               /* Request length. */
 } NBD_ATTRIBUTE_PACKED;
 
+/* Extended request, used instead when NBD_OPT_EXTENDED_HEADERS has
+ * been negotiated.
+ */
+struct nbd_request_ext {
+  uint32_t magic;               /* NBD_EXTENDED_REQUEST_MAGIC. */
+  uint16_t flags;               /* Request flags. */
+  uint16_t type;                /* Request type. */
+  uint64_t handle;              /* Opaque handle. */
+  uint64_t offset;              /* Request offset. */
+  uint64_t count;               /* Request length. */
+} NBD_ATTRIBUTE_PACKED;
+
 /* Simple reply (server -> client). */
 struct nbd_simple_reply {
   uint32_t magic;               /* NBD_SIMPLE_REPLY_MAGIC. */
@@ -192,6 +269,18 @@ struct nbd_structured_reply {
   uint32_t length;              /* Length of payload which follows. */
 } NBD_ATTRIBUTE_PACKED;
 
+/* Extended reply (server -> client), the only kind of reply sent
+ * when NBD_OPT_EXTENDED_HEADERS has been negotiated.
+ */
+struct nbd_extended_reply {
+  uint32_t magic;               /* NBD_EXTENDED_REPLY_MAGIC. */
+  uint16_t flags;               /* NBD_REPLY_FLAG_* */
+  uint16_t type;                /* NBD_REPLY_TYPE_* */
+  uint64_t handle;              /* Opaque handle. */
+  uint64_t offset;              /* Offset of the request, or 0. */
+  uint64_t length;              /* Length of payload which follows. */
+} NBD_ATTRIBUTE_PACKED;
+
 struct nbd_structured_reply_offset_data {
   uint64_t offset;              /* offset */
   /* Followed by data. */
@@ -211,6 +300,8 @@ struct nbd_structured_reply_error {
 #define NBD_REQUEST_MAGIC           0x25609513
 #define NBD_SIMPLE_REPLY_MAGIC      0x67446698
 #define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+#define NBD_EXTENDED_REQUEST_MAGIC  0x21e41c71
+#define NBD_EXTENDED_REPLY_MAGIC    0x6e8a278c
 
 /* Structured reply flags. */
 #define NBD_REPLY_FLAG_DONE         (1<<0)
@@ -223,6 +314,7 @@ struct nbd_structured_reply_error {
 #define NBD_REPLY_TYPE_OFFSET_DATA  1
 #define NBD_REPLY_TYPE_OFFSET_HOLE  2
 #define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_BLOCK_STATUS_EXT 6
 #define NBD_REPLY_TYPE_ERROR        NBD_REPLY_TYPE_ERR (1)
 #define NBD_REPLY_TYPE_ERROR_OFFSET NBD_REPLY_TYPE_ERR (2)
 
@@ -0,0 +1,44 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef NBD_RECORD_H
+#define NBD_RECORD_H
+
+#include <stdint.h>
+
+/* Format of the files written by nbd_record_start and read by
+ * bench/replay.  The file starts with the 8 byte magic string,
+ * followed by one record for each command the caller submitted, in
+ * the order they completed.  Like the NBD protocol, all fields are
+ * big endian.
+ */
+#define NBD_RECORD_MAGIC "NBDREC01"
+
+struct nbd_record {
+  uint64_t time;         /* Submitted, microseconds since the start. */
+  uint64_t latency;      /* Microseconds from submission to completion. */
+  uint64_t offset;
+  uint64_t count;
+  uint32_t seq;          /* Commands are numbered from 1 as submitted. */
+  uint32_t after;        /* Last command completed when submitted, or 0. */
+  uint16_t type;         /* NBD_CMD_* */
+  uint16_t flags;        /* LIBNBD_CMD_FLAG_*, the low 16 bits */
+  uint32_t error;        /* errno, or 0 if it succeeded */
+} __attribute__((__packed__));
+
+#endif /* NBD_RECORD_H */
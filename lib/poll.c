@@ -21,17 +21,238 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <errno.h>
+#include <assert.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "internal.h"
 
+/* nbd_unlocked_poll releases the handle lock while it waits, so that
+ * other threads can issue commands or drive the state machine in the
+ * meantime.  Each thread has its own wakeup socket pair, and while
+ * waiting it is linked into h->pollers.  Whenever another thread runs
+ * the state machine it writes to the wakeup socket of every waiting
+ * thread (see nbd_internal_wake_pollers), so that they look at the
+ * handle again instead of waiting on a direction which is out of date
+ * or for a command which has already completed.
+ *
+ * The handle's socket may be closed by another thread while we wait
+ * on it, so closing is delayed until the last waiting thread returns
+ * (see nbd_internal_close_socket).  Otherwise the file descriptor
+ * could be reused by something else.
+ *
+ * The workers of a group (see lib/workers.c) wait in the same way on
+ * all of their handles at once.
+ */
+struct wakeup {
+  int fd[2];                    /* [0] is polled, [1] is written. */
+};
+
+static pthread_key_t wakeup_key;
+static bool wakeup_key_ok;
+
+static void free_wakeup (void *vp);
+
+static void wakeup_init (void) __attribute__((constructor));
+static void wakeup_free (void) __attribute__((destructor));
+
+static void
+wakeup_init (void)
+{
+  /* If this fails, nbd_unlocked_poll keeps the lock while waiting. */
+  wakeup_key_ok = pthread_key_create (&wakeup_key, free_wakeup) == 0;
+}
+
+static void
+wakeup_free (void)
+{
+  if (wakeup_key_ok)
+    pthread_key_delete (wakeup_key);
+}
+
+/* Called when a thread exits.  Note that vp != NULL. */
+static void
+free_wakeup (void *vp)
+{
+  struct wakeup *w = vp;
+
+  close (w->fd[0]);
+  close (w->fd[1]);
+  free (w);
+}
+
+/* Return this thread's wakeup, creating it on first use, or NULL if
+ * that is not possible.
+ */
+static struct wakeup *
+get_wakeup (void)
+{
+  struct wakeup *w;
+
+  if (!wakeup_key_ok)
+    return NULL;
+
+  w = pthread_getspecific (wakeup_key);
+  if (w)
+    return w;
+
+  w = malloc (sizeof *w);
+  if (w == NULL)
+    return NULL;
+  if (socketpair (AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0,
+                  w->fd) == -1) {
+    free (w);
+    return NULL;
+  }
+  if (pthread_setspecific (wakeup_key, w) != 0) {
+    free_wakeup (w);
+    return NULL;
+  }
+  return w;
+}
+
+/* Must be called with the lock held. */
+void
+nbd_internal_wake_pollers (struct nbd_handle *h)
+{
+  struct poll_waiter *waiter;
+  int err = errno;
+
+  for (waiter = h->pollers; waiter != NULL; waiter = waiter->next) {
+    if (!waiter->woken) {
+      /* If this fails with EAGAIN the thread will wake up anyway. */
+      if (write (waiter->wakefd, "", 1) == -1 && errno != EAGAIN)
+        debug (h, "wake up poll: write: %s", strerror (errno));
+      waiter->woken = true;
+    }
+  }
+  errno = err;
+}
+
+/* Close the handle's socket, or leave it for the last thread which
+ * is waiting on it to close.  Must be called with the lock held.
+ */
+void
+nbd_internal_close_socket (struct nbd_handle *h)
+{
+  assert (h->sock);
+
+  if (h->pollers) {
+    h->sock->next_closed = h->closed_socks;
+    h->closed_socks = h->sock;
+  }
+  else
+    h->sock->ops->close (h->sock);
+  h->sock = NULL;
+}
+
+/* Link waiter into the threads waiting on h, which are woken by
+ * writing to wakefd.  Must be called with the lock held.
+ */
+void
+nbd_internal_add_poller (struct nbd_handle *h, struct poll_waiter *waiter,
+                         int wakefd)
+{
+  waiter->wakefd = wakefd;
+  waiter->woken = false;
+  waiter->next = h->pollers;
+  h->pollers = waiter;
+
+  /* Other threads use the public state to check which calls are
+   * permitted, so it must be up to date before they can run.
+   */
+  nbd_internal_update_public_state (h);
+}
+
+/* Unlink waiter, and close the sockets which were left for the last
+ * waiting thread.  Returns true if the waiter was woken, in which case
+ * the caller must drain its wakeup.  Must be called with the lock held.
+ */
+bool
+nbd_internal_remove_poller (struct nbd_handle *h, struct poll_waiter *waiter)
+{
+  struct poll_waiter **wp;
+  struct socket *closed;
+
+  for (wp = &h->pollers; *wp != waiter; wp = &(*wp)->next)
+    ;
+  *wp = waiter->next;
+  if (h->pollers == NULL) {
+    while ((closed = h->closed_socks) != NULL) {
+      h->closed_socks = closed->next_closed;
+      closed->ops->close (closed);
+    }
+  }
+  return waiter->woken;
+}
+
+/* Move the state machine on after poll returned revents for the
+ * socket sock, which h had when poll started.  Must be called with
+ * the lock held.
+ */
+int
+nbd_internal_poll_notify (struct nbd_handle *h, struct socket *sock,
+                          short revents)
+{
+  unsigned dir;
+
+  /* While the lock was released another thread may have moved the
+   * state machine on or even replaced the socket, in which case what
+   * poll saw is no longer interesting and the caller should just look
+   * at the handle again.
+   */
+  if (h->sock != sock || revents == 0)
+    return 0;
+  dir = nbd_internal_aio_get_direction (get_next_state (h));
+
+  /* POLLIN and POLLOUT might both be set.  However we shouldn't call
+   * both nbd_aio_notify_read and nbd_aio_notify_write at this time
+   * since the first might change the handle state, making the second
+   * notification invalid.  Nothing bad happens by ignoring one of the
+   * notifications since if it's still valid it will be picked up by a
+   * subsequent poll.  Prefer notifying on read, since the reply is
+   * for a command older than what we are trying to write.
+   *
+   * On a hangup or error, also notify the state machine, since
+   * receiving or sending will then find the problem (such as a TCP
+   * keepalive or user timeout, see nbd_set_socket_option) and move
+   * the handle to the dead state, failing the commands in flight or
+   * reconnecting.  With zero-copy sends the kernel also sets POLLERR
+   * when it has released a payload (see nbd_set_zerocopy_threshold),
+   * which is handled by notifying on read.
+   */
+  if ((revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+      (dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+    return nbd_unlocked_aio_notify_read (h);
+  else if ((revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+           (dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+    return nbd_unlocked_aio_notify_write (h);
+  else if ((revents & (POLLERR | POLLNVAL)) != 0) {
+    set_error (ENOTCONN, "server closed socket unexpectedly");
+    return -1;
+  }
+  return 0;
+}
+
 /* A simple main loop implementation using poll(2). */
 int
 nbd_unlocked_poll (struct nbd_handle *h, int timeout)
 {
-  struct pollfd fds[1];
-  int r;
+  struct pollfd fds[2];
+  struct socket *sock;
+  struct wakeup *w;
+  struct poll_waiter waiter;
+  char buf[16];
+  int r, err, timer;
+
+  /* Commands queued during a batch are not sent until the batch
+   * ends, so waiting here could block forever.
+   */
+  if (h->batching && nbd_unlocked_aio_end_batch (h) == -1)
+    return -1;
 
   /* fd might be negative, and poll will ignore it. */
   fds[0].fd = nbd_unlocked_aio_get_fd (h);
@@ -51,40 +272,87 @@ nbd_unlocked_poll (struct nbd_handle *h, int timeout)
     return -1;
   }
   fds[0].revents = 0;
-  debug (h, "poll start: events=%x", fds[0].events);
+  sock = h->sock;
 
-  /* Note that it's not safe to release the handle lock here, as it
-   * would allow other threads to close file descriptors which we have
-   * passed to poll.
+  /* Commands held back by nbd_set_rate_limit are sent when the timer
+   * expires, since nothing will happen on the socket until then.
    */
-  r = poll (fds, 1, timeout);
+  timer = nbd_unlocked_aio_get_timer (h);
+  if (timer >= 0 && (timeout < 0 || timer <= timeout))
+    timeout = timer;
+  else
+    timer = -1;
+  debug (h, "poll start: events=%x", fds[0].events);
+
+  w = get_wakeup ();
+  if (w == NULL) {
+    /* Without a way to be woken up, we must keep the lock. */
+    r = poll (fds, 1, timeout);
+    err = errno;
+  }
+  else {
+    fds[1].fd = w->fd[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    nbd_internal_add_poller (h, &waiter, w->fd[1]);
+
+    pthread_mutex_unlock (&h->lock);
+    r = poll (fds, 2, timeout);
+    err = errno;
+    pthread_mutex_lock (&h->lock);
+
+    if (nbd_internal_remove_poller (h, &waiter)) {
+      while (read (w->fd[0], buf, sizeof buf) > 0)
+        ;
+    }
+  }
   debug (h, "poll end: r=%d revents=%x", r, fds[0].revents);
   if (r == -1) {
-    set_error (errno, "poll");
+    set_error (err, "poll");
     return -1;
   }
-  if (r == 0)
-    return 0;
-
-  /* POLLIN and POLLOUT might both be set.  However we shouldn't call
-   * both nbd_aio_notify_read and nbd_aio_notify_write at this time
-   * since the first might change the handle state, making the second
-   * notification invalid.  Nothing bad happens by ignoring one of the
-   * notifications since if it's still valid it will be picked up by a
-   * subsequent poll.  Prefer notifying on read, since the reply is
-   * for a command older than what we are trying to write.
-   */
-  r = 0;
-  if ((fds[0].revents & (POLLIN | POLLHUP)) != 0)
-    r = nbd_unlocked_aio_notify_read (h);
-  else if ((fds[0].revents & POLLOUT) != 0)
-    r = nbd_unlocked_aio_notify_write (h);
-  else if ((fds[0].revents & (POLLERR | POLLNVAL)) != 0) {
-    set_error (ENOTCONN, "server closed socket unexpectedly");
-    return -1;
+  if (r == 0) {
+    if (timer == -1)
+      return 0;
+    if (nbd_unlocked_aio_notify_timer (h) == -1)
+      return -1;
+    return 1;
   }
-  if (r == -1)
+
+  if (nbd_internal_poll_notify (h, sock, fds[0].revents) == -1)
     return -1;
 
   return 1;
 }
+
+int
+nbd_unlocked_clear_direction_callback (struct nbd_handle *h)
+{
+  FREE_CALLBACK (h->direction_callback);
+  return 0;
+}
+
+int
+nbd_unlocked_set_direction_callback (struct nbd_handle *h,
+                                     nbd_direction_callback cb)
+{
+  nbd_unlocked_clear_direction_callback (h);
+  h->direction_callback = cb;
+  h->last_direction = nbd_internal_aio_get_direction (get_next_state (h));
+  return 0;
+}
+
+/* Called by nbd_internal_update_public_state when the public state
+ * changes and there is a direction callback.  Many states have the
+ * same direction, so only call it if the direction has changed.
+ */
+void
+nbd_internal_notify_direction (struct nbd_handle *h, enum state state)
+{
+  const unsigned dir = nbd_internal_aio_get_direction (state);
+
+  if (dir != h->last_direction) {
+    h->last_direction = dir;
+    CALL_CALLBACK (h->direction_callback, dir);
+  }
+}
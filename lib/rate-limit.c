@@ -0,0 +1,222 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Rate limits, see nbd_set_rate_limit.
+ *
+ * Each limit is a token bucket which fills at the limited rate, up to
+ * RATE_BURST_US worth of tokens.  The command at the head of
+ * cmds_to_issue may be sent while every bucket it is charged to is
+ * not empty, and sending it takes its whole cost from the buckets
+ * even if that leaves them in debt.  This means that a command larger
+ * than the bucket is not held back forever, and that the debt it
+ * leaves holds back the commands after it for as long as the command
+ * should have taken.
+ *
+ * Commands which may not be sent yet stay on cmds_to_issue and the
+ * state machine stays in READY.  Nothing will happen on the socket
+ * when they may be sent, so the main loop has to use a timer, which
+ * is what nbd_aio_get_timer and nbd_aio_notify_timer are for.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "internal.h"
+
+/* Return the size of the bucket for rate. */
+static double
+burst (uint64_t rate)
+{
+  double r = (double) rate * RATE_BURST_US / 1000000;
+
+  return r < 1 ? 1 : r;
+}
+
+/* Add the tokens earned since the bucket was last looked at. */
+static void
+refill (struct rate_bucket *b, uint64_t now)
+{
+  if (now > b->last_us) {
+    b->tokens += (double) b->rate * (now - b->last_us) / 1000000;
+    if (b->tokens > burst (b->rate))
+      b->tokens = burst (b->rate);
+  }
+  b->last_us = now;
+}
+
+/* Find the buckets which sending cmd is charged to.  Only the
+ * payloads of reads and writes are counted in bytes.
+ */
+static void
+buckets_of_command (struct nbd_handle *h, const struct command *cmd,
+                    struct rate_bucket **ops, struct rate_bucket **bytes)
+{
+  *ops = *bytes = NULL;
+  switch (cmd->type) {
+  case NBD_CMD_READ:
+    *bytes = &h->rate[LIBNBD_RATE_READ_BYTES];
+    /* fallthrough */
+  case NBD_CMD_BLOCK_STATUS:
+  case NBD_CMD_CACHE:
+    *ops = &h->rate[LIBNBD_RATE_READ_OPS];
+    break;
+  case NBD_CMD_WRITE:
+    *bytes = &h->rate[LIBNBD_RATE_WRITE_BYTES];
+    /* fallthrough */
+  case NBD_CMD_TRIM:
+  case NBD_CMD_WRITE_ZEROES:
+  case NBD_CMD_FLUSH:
+    *ops = &h->rate[LIBNBD_RATE_WRITE_OPS];
+    break;
+  }
+}
+
+/* Return how many microseconds must pass before b is not empty. */
+static uint64_t
+bucket_delay (struct rate_bucket *b, uint64_t now)
+{
+  if (b == NULL || b->rate == 0)
+    return 0;
+  refill (b, now);
+  if (b->tokens >= 0)
+    return 0;
+  return (uint64_t) (-b->tokens * 1000000 / b->rate) + 1;
+}
+
+int
+nbd_unlocked_set_rate_limit (struct nbd_handle *h, int limit, uint64_t rate)
+{
+  struct rate_bucket *b = &h->rate[limit];
+  size_t i;
+
+  if (rate > INT64_MAX) {
+    set_error (EINVAL, "invalid rate limit: %" PRIu64, rate);
+    return -1;
+  }
+
+  b->rate = rate;
+  b->tokens = burst (rate);
+  b->last_us = nbd_internal_stats_now ();
+  h->rate_limited = false;
+  for (i = 0; i < sizeof h->rate / sizeof h->rate[0]; ++i)
+    h->rate_limited |= h->rate[i].rate != 0;
+
+  /* Send any commands which were held back by the old limit. */
+  if (h->cmds_to_issue != NULL && !h->batching &&
+      nbd_internal_is_state_ready (get_next_state (h)))
+    return nbd_internal_run (h, cmd_issue);
+  return 0;
+}
+
+int64_t
+nbd_unlocked_get_rate_limit (struct nbd_handle *h, int limit)
+{
+  return h->rate[limit].rate;
+}
+
+/* Return how many microseconds must pass before cmd may be sent. */
+uint64_t
+nbd_internal_rate_delay (struct nbd_handle *h, const struct command *cmd)
+{
+  struct rate_bucket *ops, *bytes;
+  uint64_t now, d1, d2;
+
+  if (!h->rate_limited)
+    return 0;
+  buckets_of_command (h, cmd, &ops, &bytes);
+  now = nbd_internal_stats_now ();
+  d1 = bucket_delay (ops, now);
+  d2 = bucket_delay (bytes, now);
+  return d1 > d2 ? d1 : d2;
+}
+
+/* If cmd may be sent now, take its cost from the buckets and return
+ * true.  Otherwise return false and leave the buckets alone.
+ */
+bool
+nbd_internal_rate_admit (struct nbd_handle *h, const struct command *cmd)
+{
+  struct rate_bucket *ops, *bytes;
+
+  if (!h->rate_limited)
+    return true;
+  if (nbd_internal_rate_delay (h, cmd) > 0)
+    return false;
+  buckets_of_command (h, cmd, &ops, &bytes);
+  if (ops && ops->rate)
+    ops->tokens -= 1;
+  if (bytes && bytes->rate)
+    bytes->tokens -= cmd->count;
+  return true;
+}
+
+/* Return how many microseconds until the command at the head of
+ * cmds_to_issue may be sent, or -1 if none is held back.
+ */
+static int64_t
+rate_timer (struct nbd_handle *h)
+{
+  uint64_t delay;
+
+  if (!h->rate_limited || h->cmds_to_issue == NULL || h->batching ||
+      !nbd_internal_is_state_ready (get_next_state (h)) ||
+      nbd_internal_depth_slots (h) == 0)
+    return -1;
+
+  delay = nbd_internal_rate_delay (h, h->cmds_to_issue);
+  return delay > INT64_MAX ? INT64_MAX : delay;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_aio_get_timer (struct nbd_handle *h)
+{
+  int64_t d1, d2;
+  uint64_t delay;
+
+  /* See also lib/liveness.c. */
+  d1 = rate_timer (h);
+  d2 = nbd_internal_liveness_delay (h);
+  if (d1 == -1 && d2 == -1)
+    return -1;
+  if (d1 == -1 || (d2 != -1 && d2 < d1))
+    d1 = d2;
+
+  delay = d1;
+  if (delay / 1000 >= INT_MAX)
+    return INT_MAX;
+  return (delay + 999) / 1000;
+}
+
+int
+nbd_unlocked_aio_notify_timer (struct nbd_handle *h)
+{
+  if (nbd_internal_liveness_check (h) == -1)
+    return -1;
+  if (h->cmds_to_issue != NULL && !h->batching &&
+      nbd_internal_is_state_ready (get_next_state (h)))
+    return nbd_internal_run (h, cmd_issue);
+  return 0;
+}
@@ -0,0 +1,537 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A main loop for many handles, see nbd_reactor_create(3).  This is
+ * built on epoll, so the cost of waiting does not grow with the
+ * number of idle handles.  Each handle marks its entry dirty at the
+ * end of every call which may have moved it on (see
+ * nbd_internal_update_public_state), and nbd_reactor_poll only looks
+ * again at the dirty entries, changing their interest masks with
+ * epoll_ctl when the direction they are waiting for has changed.  The
+ * reactor lock is released while waiting, and a handle which becomes
+ * dirty meanwhile wakes the waiting thread through a pipe.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "internal.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Maximum number of events returned by one epoll_wait. */
+#define REACTOR_MAX_EVENTS 64
+
+/* Return the time in milliseconds (as used by nbd_internal_time_left)
+ * ms milliseconds from now.
+ */
+static int64_t
+deadline_after (int ms)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C (1000) + ts.tv_nsec / 1000000 + ms;
+}
+
+struct nbd_reactor *
+nbd_reactor_create (void)
+{
+  struct nbd_reactor *r;
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+  nbd_internal_set_error_context ("nbd_reactor_create");
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  r->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (r->epfd == -1) {
+    set_error (errno, "epoll_create1");
+    free (r);
+    return NULL;
+  }
+  if (pipe2 (r->wakefd, O_CLOEXEC|O_NONBLOCK) == -1) {
+    set_error (errno, "pipe2");
+    close (r->epfd);
+    free (r);
+    return NULL;
+  }
+  /* The wakeup pipe is the only fd registered with a NULL pointer. */
+  if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, r->wakefd[0], &ev) == -1) {
+    set_error (errno, "epoll_ctl");
+    close (r->wakefd[0]);
+    close (r->wakefd[1]);
+    close (r->epfd);
+    free (r);
+    return NULL;
+  }
+  pthread_mutex_init (&r->lock, NULL);
+  pthread_mutex_init (&r->dirty_lock, NULL);
+  return r;
+}
+
+void
+nbd_reactor_close (struct nbd_reactor *r)
+{
+  struct reactor_entry *e;
+  size_t i;
+
+  if (r == NULL)
+    return;
+
+  for (i = 0; i < r->nr_entries; ++i) {
+    e = r->entries[i];
+    pthread_mutex_lock (&e->h->lock);
+    e->h->reactor_entry = NULL;
+    pthread_mutex_unlock (&e->h->lock);
+    free (e);
+  }
+  while ((e = r->removed) != NULL) {
+    r->removed = e->dirty_next;
+    free (e);
+  }
+  free (r->entries);
+  close (r->wakefd[0]);
+  close (r->wakefd[1]);
+  close (r->epfd);
+  pthread_mutex_destroy (&r->dirty_lock);
+  pthread_mutex_destroy (&r->lock);
+  free (r);
+}
+
+/* Called from nbd_internal_update_public_state with the handle lock
+ * held, at the end of each call which may have changed the direction
+ * the handle is waiting for or its timer.
+ */
+void
+nbd_internal_reactor_mark_dirty (struct reactor_entry *e)
+{
+  struct nbd_reactor *r = e->r;
+  bool wake = false;
+  ssize_t n;
+
+  if (__atomic_load_n (&e->dirty, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock (&r->dirty_lock);
+  if (!e->dirty) {
+    e->dirty = true;
+    e->dirty_next = r->dirty;
+    r->dirty = e;
+    wake = r->sleeping > 0;
+  }
+  pthread_mutex_unlock (&r->dirty_lock);
+
+  if (wake) {
+    n = write (r->wakefd[1], "", 1);
+    (void) n; /* If the pipe is full, the poller is being woken. */
+  }
+}
+
+/* Unlink e from the dirty list, if it is on it. */
+static void
+forget_dirty (struct nbd_reactor *r, struct reactor_entry *e)
+{
+  struct reactor_entry **ep;
+
+  pthread_mutex_lock (&r->dirty_lock);
+  if (e->dirty) {
+    for (ep = &r->dirty; *ep != e; ep = &(*ep)->dirty_next)
+      ;
+    *ep = e->dirty_next;
+    e->dirty = false;
+  }
+  pthread_mutex_unlock (&r->dirty_lock);
+}
+
+int
+nbd_reactor_add (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  struct reactor_entry *e, **entries;
+  size_t n;
+  int ret = -1;
+
+  nbd_internal_set_error_context ("nbd_reactor_add");
+  pthread_mutex_lock (&r->lock);
+
+  if (r->nr_entries >= r->nr_alloc) {
+    n = r->nr_alloc == 0 ? 16 : r->nr_alloc * 2;
+    entries = realloc (r->entries, n * sizeof entries[0]);
+    if (entries == NULL) {
+      set_error (errno, "realloc");
+      goto out;
+    }
+    r->entries = entries;
+    r->nr_alloc = n;
+  }
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL) {
+    set_error (errno, "calloc");
+    goto out;
+  }
+  e->r = r;
+  e->h = h;
+  e->fd = -1;
+  e->timer = -1;
+
+  pthread_mutex_lock (&h->lock);
+  if (h->reactor_entry) {
+    pthread_mutex_unlock (&h->lock);
+    set_error (EINVAL, "handle is already in a reactor");
+    free (e);
+    goto out;
+  }
+  h->reactor_entry = e;
+  nbd_internal_reactor_mark_dirty (e);
+  pthread_mutex_unlock (&h->lock);
+
+  e->index = r->nr_entries;
+  r->entries[r->nr_entries++] = e;
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock (&r->lock);
+  return ret;
+}
+
+int
+nbd_reactor_remove (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  struct reactor_entry *e;
+  int fd, ret = -1;
+
+  nbd_internal_set_error_context ("nbd_reactor_remove");
+  pthread_mutex_lock (&r->lock);
+
+  pthread_mutex_lock (&h->lock);
+  e = h->reactor_entry;
+  if (e == NULL || e->r != r) {
+    pthread_mutex_unlock (&h->lock);
+    set_error (EINVAL, "handle is not in the reactor");
+    goto out;
+  }
+  h->reactor_entry = NULL;
+  fd = h->sock ? h->sock->ops->get_fd (h->sock) : -1;
+  pthread_mutex_unlock (&h->lock);
+  forget_dirty (r, e);
+
+  /* Only remove the fd from the epoll set if it still belongs to the
+   * handle.  If the handle has closed its socket the kernel has
+   * already dropped it, and the fd number may since have been reused
+   * by another handle in the set.
+   */
+  if (e->fd >= 0 && fd == e->fd)
+    epoll_ctl (r->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+  if (e->fd >= 0 && e->events != 0)
+    r->nr_waiting--;
+  if (e->timer >= 0)
+    r->nr_timers--;
+
+  r->entries[e->index] = r->entries[--r->nr_entries];
+  r->entries[e->index]->index = e->index;
+
+  /* A thread waiting in epoll_wait may still get an event pointing to
+   * the entry, so it is only freed once no thread is polling.
+   */
+  e->h = NULL;
+  if (r->polling > 0) {
+    e->dirty_next = r->removed;
+    r->removed = e;
+  }
+  else
+    free (e);
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock (&r->lock);
+  return ret;
+}
+
+/* Bring the epoll registration and timer for one handle up to date.
+ * Called with the reactor lock held.
+ */
+static void
+update_entry (struct nbd_reactor *r, struct reactor_entry *e)
+{
+  struct nbd_handle *h = e->h;
+  struct epoll_event ev = { .events = 0, .data.ptr = e };
+  bool was_waiting = e->fd >= 0 && e->events != 0;
+  bool had_timer = e->timer >= 0;
+  int fd, t;
+
+  pthread_mutex_lock (&h->lock);
+  fd = h->sock ? h->sock->ops->get_fd (h->sock) : -1;
+  switch (nbd_internal_aio_get_direction (get_next_state (h))) {
+  case LIBNBD_AIO_DIRECTION_READ:
+    ev.events = EPOLLIN;
+    break;
+  case LIBNBD_AIO_DIRECTION_WRITE:
+    ev.events = EPOLLOUT;
+    break;
+  case LIBNBD_AIO_DIRECTION_BOTH:
+    ev.events = EPOLLIN|EPOLLOUT;
+    break;
+  }
+  t = nbd_unlocked_aio_get_timer (h);
+  pthread_mutex_unlock (&h->lock);
+
+  e->timer = t >= 0 ? deadline_after (t) : -1;
+
+  /* A different fd means the old socket was closed, which removed it
+   * from the epoll set.
+   */
+  if (fd != e->fd) {
+    e->fd = -1;
+    e->events = 0;
+    if (fd >= 0) {
+      if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+          (errno != EEXIST ||
+           epoll_ctl (r->epfd, EPOLL_CTL_MOD, fd, &ev) == -1))
+        debug (h, "reactor: epoll_ctl: %s", strerror (errno));
+      else {
+        e->fd = fd;
+        e->events = ev.events;
+      }
+    }
+  }
+  else if (fd >= 0 && ev.events != e->events) {
+    if (epoll_ctl (r->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+      debug (h, "reactor: epoll_ctl: %s", strerror (errno));
+    else
+      e->events = ev.events;
+  }
+
+  r->nr_waiting += (e->fd >= 0 && e->events != 0) - was_waiting;
+  r->nr_timers += (e->timer >= 0) - had_timer;
+}
+
+/* Update the dirty entries.  Returns with the dirty list empty and
+ * r->sleeping counting this thread, so that any handle becoming dirty
+ * from now on wakes the thread about to wait.
+ */
+static void
+update_dirty (struct nbd_reactor *r)
+{
+  struct reactor_entry *e, *list;
+
+  for (;;) {
+    pthread_mutex_lock (&r->dirty_lock);
+    if (r->dirty == NULL) {
+      r->sleeping++;
+      pthread_mutex_unlock (&r->dirty_lock);
+      return;
+    }
+    list = NULL;
+    while ((e = r->dirty) != NULL) {
+      r->dirty = e->dirty_next;
+      e->dirty = false;
+      e->update_next = list;
+      list = e;
+    }
+    pthread_mutex_unlock (&r->dirty_lock);
+
+    for (e = list; e != NULL; e = e->update_next)
+      update_entry (r, e);
+  }
+}
+
+/* Return the earliest timer deadline, or -1. */
+static int64_t
+first_timer (struct nbd_reactor *r)
+{
+  int64_t deadline = -1;
+  size_t i;
+
+  if (r->nr_timers == 0)
+    return -1;
+  for (i = 0; i < r->nr_entries; ++i) {
+    if (r->entries[i]->timer >= 0 &&
+        (deadline == -1 || r->entries[i]->timer < deadline))
+      deadline = r->entries[i]->timer;
+  }
+  return deadline;
+}
+
+int
+nbd_reactor_poll (struct nbd_reactor *r, int timeout)
+{
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  struct reactor_entry *e;
+  uint32_t revents;
+  int64_t deadline, timer;
+  size_t i;
+  int n, j, dir, t, notified = 0, ret = -1;
+  char buf[64];
+
+  nbd_internal_set_error_context ("nbd_reactor_poll");
+  pthread_mutex_lock (&r->lock);
+  r->polling++;
+  deadline = timeout >= 0 ? deadline_after (timeout) : -1;
+
+  do {
+    update_dirty (r);
+    if (r->nr_waiting == 0 && r->nr_timers == 0) {
+      pthread_mutex_lock (&r->dirty_lock);
+      r->sleeping--;
+      pthread_mutex_unlock (&r->dirty_lock);
+      set_error (EINVAL, "nothing to poll for on any handle in the reactor");
+      goto out;
+    }
+
+    /* See nbd_aio_get_timer. */
+    timer = first_timer (r);
+    t = nbd_internal_time_left (timer >= 0 &&
+                                (deadline == -1 || timer < deadline) ?
+                                timer : deadline);
+
+    pthread_mutex_unlock (&r->lock);
+    n = epoll_wait (r->epfd, events, REACTOR_MAX_EVENTS, t);
+    pthread_mutex_lock (&r->lock);
+
+    pthread_mutex_lock (&r->dirty_lock);
+    r->sleeping--;
+    pthread_mutex_unlock (&r->dirty_lock);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      set_error (errno, "epoll_wait");
+      goto out;
+    }
+
+    /* A failure on one handle moves it to the dead state and fails
+     * its commands, but must not stop the other handles from making
+     * progress, so errors from the notifications are not returned.
+     * As in lib/poll.c, only one notification is sent per handle.
+     */
+    for (j = 0; j < n; ++j) {
+      e = events[j].data.ptr;
+      revents = events[j].events;
+      if (e == NULL) {
+        while (read (r->wakefd[0], buf, sizeof buf) > 0)
+          ;
+        continue;
+      }
+      /* The entry may have been removed while we were waiting. */
+      if (e->h == NULL || e->fd < 0 || e->events == 0)
+        continue;
+      /* Another thread may have moved the handle on since we checked
+       * its direction.  On a hangup or error, sending or receiving
+       * will find the problem and move the handle to the dead state.
+       */
+      dir = nbd_aio_get_direction (e->h);
+      if ((revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0 &&
+          (dir & LIBNBD_AIO_DIRECTION_READ) != 0) {
+        nbd_aio_notify_read (e->h);
+        notified++;
+      }
+      else if ((revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0 &&
+               (dir & LIBNBD_AIO_DIRECTION_WRITE) != 0) {
+        nbd_aio_notify_write (e->h);
+        notified++;
+      }
+    }
+
+    /* Handles whose timers have expired count as events too. */
+    timer = first_timer (r);
+    if (timer >= 0 && nbd_internal_time_left (timer) == 0) {
+      for (i = 0; i < r->nr_entries; ++i) {
+        e = r->entries[i];
+        if (e->timer >= 0 && nbd_internal_time_left (e->timer) == 0 &&
+            nbd_aio_get_timer (e->h) == 0) {
+          nbd_aio_notify_timer (e->h);
+          notified++;
+        }
+      }
+    }
+
+    /* Being woken up to look at handles again is not an event, so
+     * wait again for the rest of the timeout.
+     */
+  } while (notified == 0 && nbd_internal_time_left (deadline) != 0);
+  ret = notified;
+
+ out:
+  if (--r->polling == 0) {
+    while ((e = r->removed) != NULL) {
+      r->removed = e->dirty_next;
+      free (e);
+    }
+  }
+  pthread_mutex_unlock (&r->lock);
+  return ret;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+struct nbd_reactor *
+nbd_reactor_create (void)
+{
+  nbd_internal_set_error_context ("nbd_reactor_create");
+  set_error (ENOTSUP, "reactors are not supported on this platform");
+  return NULL;
+}
+
+void
+nbd_reactor_close (struct nbd_reactor *r)
+{
+  /* nbd_reactor_create always fails, so r must be NULL. */
+}
+
+int
+nbd_reactor_add (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  abort ();
+}
+
+int
+nbd_reactor_remove (struct nbd_reactor *r, struct nbd_handle *h)
+{
+  abort ();
+}
+
+int
+nbd_reactor_poll (struct nbd_reactor *r, int timeout)
+{
+  abort ();
+}
+
+void
+nbd_internal_reactor_mark_dirty (struct reactor_entry *e)
+{
+  abort ();
+}
+
+#endif /* !HAVE_SYS_EPOLL_H */
@@ -0,0 +1,320 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Read ahead of sequential reads, see nbd_set_read_ahead.
+ *
+ * Each read made with nbd_aio_pread is passed to
+ * nbd_internal_read_ahead once it has been issued.  A read starting
+ * where the previous one ended (ra_next) continues the stream, and
+ * doubles the window, so that the data up to ra_window bytes past the
+ * end of the read is asked for.  ra_end is where the data asked for
+ * so far ends, so each read only asks for the data which the window
+ * has grown over.  Any other read ends the stream.
+ *
+ * If the server supports NBD_CMD_CACHE, cache requests are sent for
+ * the data ahead.  Otherwise the data is read into struct prefetch
+ * buffers owned by the library.  While such a read is in flight it is
+ * on ra_pending, and reads lying within it are attached to it as for
+ * nbd_set_dedupe_reads.  When it succeeds the buffer moves to
+ * ra_pool, and reads lying within a buffer on ra_pool are answered
+ * from it by nbd_internal_read_ahead_serve without being queued at
+ * all.  Buffers are dropped once the stream has gone past them, and
+ * are not used after a command which may change the export has been
+ * issued (see dedupe_gen).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+
+struct prefetch {
+  struct prefetch *next;        /* On ra_pending or ra_pool */
+  struct nbd_handle *h;
+  int64_t cookie;
+  uint64_t offset;
+  uint32_t count;
+  uint64_t dedupe_gen;          /* h->dedupe_gen when it was issued */
+  bool pooled;                  /* If it is on ra_pool */
+  char data[];                  /* Not used for cache requests */
+};
+
+/* Free the buffers on ra_pool for which drop returns true. */
+static void
+drop_pool (struct nbd_handle *h,
+           bool (*drop) (struct nbd_handle *h, const struct prefetch *pf))
+{
+  struct prefetch *pf, **pp;
+
+  for (pp = &h->ra_pool; (pf = *pp) != NULL; ) {
+    if (drop == NULL || drop (h, pf)) {
+      *pp = pf->next;
+      free (pf);
+    }
+    else
+      pp = &pf->next;
+  }
+}
+
+/* Return true if pf cannot be used to answer a read. */
+static bool
+is_stale (struct nbd_handle *h, const struct prefetch *pf)
+{
+  return pf->dedupe_gen != h->dedupe_gen;
+}
+
+/* Return true if pf holds no data at or after ra_next. */
+static bool
+is_consumed (struct nbd_handle *h, const struct prefetch *pf)
+{
+  return is_stale (h, pf) || pf->offset + pf->count <= h->ra_next;
+}
+
+/* Forget the stream: cancel the requests for data ahead which have
+ * not started to be sent and drop the buffers already read.
+ */
+static void
+end_stream (struct nbd_handle *h)
+{
+  struct prefetch *pf, *next;
+  struct command *cmd;
+
+  /* nbd_aio_cancel completes the command, which unlinks pf from
+   * ra_pending and frees it.  It fails for requests which have
+   * started to be sent, which are simply left to complete.
+   */
+  for (pf = h->ra_pending; pf != NULL; pf = next) {
+    next = pf->next;
+    cmd = nbd_internal_cookie_table_lookup (h, pf->cookie);
+    if (cmd != NULL && cmd->list == CMDS_TO_ISSUE)
+      nbd_unlocked_aio_cancel (h, pf->cookie);
+  }
+
+  drop_pool (h, NULL);
+  h->ra_window = 0;
+  h->ra_end = 0;
+}
+
+int
+nbd_unlocked_set_read_ahead (struct nbd_handle *h, unsigned window)
+{
+  if (window > MAX_READ_AHEAD) {
+    set_error (EINVAL, "read ahead window must be at most %d bytes",
+               MAX_READ_AHEAD);
+    return -1;
+  }
+
+  h->read_ahead = window;
+  if (window == 0)
+    end_stream (h);
+  else if (h->ra_window > window)
+    h->ra_window = window;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_read_ahead (struct nbd_handle *h)
+{
+  return h->read_ahead;
+}
+
+/* Completion callback of the requests for data ahead. */
+static int
+prefetch_done (void *user_data, int *error)
+{
+  struct prefetch *pf = user_data, **pp;
+  struct nbd_handle *h = pf->h;
+
+  for (pp = &h->ra_pending; *pp != NULL; pp = &(*pp)->next) {
+    if (*pp == pf) {
+      *pp = pf->next;
+      break;
+    }
+  }
+
+  /* Keep the data if it is still ahead of the stream. */
+  if (*error == 0 && pf->count > 0 && h->read_ahead != 0 &&
+      !is_stale (h, pf) &&
+      pf->offset + pf->count > h->ra_next && pf->offset < h->ra_end) {
+    pf->pooled = true;
+    pf->next = h->ra_pool;
+    h->ra_pool = pf;
+  }
+  return 1;
+}
+
+static void
+prefetch_free (void *user_data)
+{
+  struct prefetch *pf = user_data;
+
+  if (!pf->pooled)
+    free (pf);
+}
+
+/* Ask for count bytes at offset ahead of the stream. */
+static int
+prefetch (struct nbd_handle *h, bool cache, uint64_t offset, uint32_t count)
+{
+  struct prefetch *pf;
+  struct command_cb cb;
+  struct command *cmd;
+
+  pf = malloc (sizeof *pf + (cache ? 0 : count));
+  if (pf == NULL) {
+    set_error (errno, "malloc");
+    return -1;
+  }
+  pf->h = h;
+  pf->offset = offset;
+  pf->count = cache ? 0 : count;
+  pf->dedupe_gen = h->dedupe_gen;
+  pf->pooled = false;
+
+  cb = (struct command_cb) {
+    .completion = { .callback = prefetch_done, .user_data = pf,
+                    .free = prefetch_free },
+  };
+  pf->cookie = nbd_internal_command_common (h, 0,
+                                            cache ? NBD_CMD_CACHE
+                                            : NBD_CMD_READ,
+                                            offset, count,
+                                            cache ? NULL : pf->data, &cb);
+  if (pf->cookie == -1) {
+    free (pf);
+    return -1;
+  }
+
+  cmd = nbd_internal_cookie_table_lookup (h, pf->cookie);
+  if (cmd)
+    cmd->prefetch = true;
+  pf->next = h->ra_pending;
+  h->ra_pending = pf;
+  return 0;
+}
+
+/* Called when nbd_aio_pread has issued a read of count bytes at
+ * offset.
+ */
+void
+nbd_internal_read_ahead (struct nbd_handle *h, uint64_t offset, uint64_t count)
+{
+  const uint64_t end = offset + count;
+  uint64_t target, chunk, n;
+  int64_t size;
+  bool cache;
+
+  if (count == 0)
+    return;
+  if (offset != h->ra_next) {
+    if (h->ra_window > 0 || h->ra_pool != NULL)
+      end_stream (h);
+    h->ra_next = end;
+    return;
+  }
+  drop_pool (h, is_consumed);
+  h->ra_next = end;
+
+  h->ra_window = h->ra_window > 0 ? h->ra_window * 2 : count * 4;
+  if (h->ra_window > h->read_ahead)
+    h->ra_window = h->read_ahead;
+  /* Data asked for before the export changed has to be asked for
+   * again.
+   */
+  if (h->ra_end < end || h->ra_gen != h->dedupe_gen)
+    h->ra_end = end;
+  h->ra_gen = h->dedupe_gen;
+
+  size = nbd_unlocked_get_size (h);
+  if (size == -1)
+    return;
+  target = end + h->ra_window;
+  if (target > (uint64_t) size)
+    target = size;
+
+  /* Ask for data in pieces which are a multiple of the size of the
+   * reads, so that later reads of the same size each lie within one
+   * buffer, and wait until a whole piece can be asked for.
+   */
+  chunk = count;
+  if (chunk < READ_AHEAD_MIN_REQUEST)
+    chunk *= READ_AHEAD_MIN_REQUEST / chunk;
+  if (chunk > nbd_internal_max_request_size (h))
+    chunk = nbd_internal_max_request_size (h);
+  if (chunk > h->ra_window)
+    chunk = h->ra_window;
+  if (h->ra_end >= target ||
+      (target - h->ra_end < chunk && target < (uint64_t) size))
+    return;
+
+  cache = nbd_unlocked_can_cache (h) == 1;
+  if (cache) {
+    if (prefetch (h, true, h->ra_end, target - h->ra_end) == 0)
+      h->ra_end = target;
+    return;
+  }
+
+  while (h->ra_end < target) {
+    n = target - h->ra_end;
+    if (n > chunk)
+      n = chunk;
+    if (h->max_bytes_in_flight &&
+        h->bytes_in_flight + n > h->max_bytes_in_flight)
+      break;
+    if (prefetch (h, false, h->ra_end, n) == -1)
+      break;
+    h->ra_end += n;
+  }
+}
+
+/* If the read cmd lies within a buffer of data read ahead, copy the
+ * data into it, complete it and return true.
+ */
+bool
+nbd_internal_read_ahead_serve (struct nbd_handle *h, struct command *cmd)
+{
+  struct prefetch *pf;
+
+  drop_pool (h, is_stale);
+  for (pf = h->ra_pool; pf != NULL; pf = pf->next) {
+    if (pf->offset <= cmd->offset &&
+        cmd->offset + cmd->count <= pf->offset + pf->count) {
+      memcpy (cmd->data, pf->data + (cmd->offset - pf->offset), cmd->count);
+      cmd->data_seen = cmd->count;
+      nbd_internal_complete_unsent_command (h, cmd);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Called when the handle is closed.  The requests still in flight are
+ * freed with the other commands.
+ */
+void
+nbd_internal_read_ahead_free (struct nbd_handle *h)
+{
+  drop_pool (h, NULL);
+}
@@ -0,0 +1,212 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Waiting for subprocesses in the background, see
+ * nbd_set_wait_subprocess.
+ *
+ * nbd_close hands over the subprocess and the socket activation
+ * directory (if any) to a single thread shared by all handles, which
+ * is started the first time it is needed and then runs for as long
+ * as the process.  The thread checks all its subprocesses without
+ * blocking, and sleeps for longer and longer between checks while
+ * they are still running, so that one subprocess which takes a long
+ * time to exit does not hold up the others.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "internal.h"
+
+/* Limits of the time between checks, in milliseconds. */
+#define REAP_MIN_DELAY 1
+#define REAP_MAX_DELAY 200
+
+struct reap {
+  struct reap *next;
+  pid_t pid;
+  char *sockpath;               /* Socket activation socket, or NULL. */
+  char *tmpdir;                 /* Its directory, or NULL. */
+};
+
+static pthread_mutex_t reap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reap_cond = PTHREAD_COND_INITIALIZER;
+static struct reap *reap_list;
+static bool reaper_started;
+
+int
+nbd_unlocked_set_wait_subprocess (struct nbd_handle *h, bool wait)
+{
+  h->wait_subprocess = wait;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_wait_subprocess (struct nbd_handle *h)
+{
+  return h->wait_subprocess;
+}
+
+/* Remove the socket activation socket and its directory, and free
+ * the names.  Either may be NULL.
+ */
+void
+nbd_internal_remove_socket_dir (char *sockpath, char *tmpdir)
+{
+  if (sockpath) {
+    unlink (sockpath);
+    free (sockpath);
+  }
+  if (tmpdir) {
+    rmdir (tmpdir);
+    free (tmpdir);
+  }
+}
+
+/* Wait for pid without blocking.  Returns true if it has gone. */
+static bool
+reaped (pid_t pid)
+{
+  pid_t r;
+
+  do
+    r = waitpid (pid, NULL, WNOHANG);
+  while (r == -1 && errno == EINTR);
+
+  /* ECHILD means that someone else has waited for it. */
+  return r == pid || r == -1;
+}
+
+static void *
+reaper (void *arg)
+{
+  struct reap **rp, *r;
+  struct timespec ts;
+  long delay = REAP_MIN_DELAY;
+
+  pthread_mutex_lock (&reap_lock);
+  for (;;) {
+    while (reap_list == NULL) {
+      pthread_cond_wait (&reap_cond, &reap_lock);
+      delay = REAP_MIN_DELAY;
+    }
+
+    for (rp = &reap_list; (r = *rp) != NULL; ) {
+      if (reaped (r->pid)) {
+        *rp = r->next;
+        nbd_internal_remove_socket_dir (r->sockpath, r->tmpdir);
+        free (r);
+      }
+      else
+        rp = &r->next;
+    }
+    if (reap_list == NULL)
+      continue;
+
+    /* New subprocesses wake us up, and start again with short
+     * delays.
+     */
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += delay * 1000000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    if (pthread_cond_timedwait (&reap_cond, &reap_lock, &ts) == 0)
+      delay = REAP_MIN_DELAY;
+    else if (delay < REAP_MAX_DELAY)
+      delay *= 2;
+  }
+  /*NOTREACHED*/
+  return NULL;
+}
+
+/* Start the reaper thread with all signals blocked, so that signals
+ * for the process are never delivered to it.  Called with reap_lock
+ * held.
+ */
+static int
+start_reaper (void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+  sigset_t all, old;
+  int err;
+
+  if (reaper_started)
+    return 0;
+
+  err = pthread_attr_init (&attr);
+  if (err != 0)
+    return err;
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  err = pthread_create (&thread, &attr, reaper, NULL);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy (&attr);
+  if (err == 0)
+    reaper_started = true;
+  return err;
+}
+
+/* Wait for pid in the background, then remove the socket activation
+ * socket and directory.  This takes ownership of sockpath and tmpdir.
+ * If the background thread cannot be used, wait here instead.
+ */
+void
+nbd_internal_reap (pid_t pid, char *sockpath, char *tmpdir)
+{
+  struct reap *r;
+
+  if (reaped (pid)) {
+    nbd_internal_remove_socket_dir (sockpath, tmpdir);
+    return;
+  }
+
+  r = malloc (sizeof *r);
+  if (r != NULL) {
+    r->pid = pid;
+    r->sockpath = sockpath;
+    r->tmpdir = tmpdir;
+
+    pthread_mutex_lock (&reap_lock);
+    if (start_reaper () == 0) {
+      r->next = reap_list;
+      reap_list = r;
+      pthread_cond_signal (&reap_cond);
+      pthread_mutex_unlock (&reap_lock);
+      return;
+    }
+    pthread_mutex_unlock (&reap_lock);
+    free (r);
+  }
+
+  waitpid (pid, NULL, 0);
+  nbd_internal_remove_socket_dir (sockpath, tmpdir);
+}
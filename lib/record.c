@@ -0,0 +1,138 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Recording the commands submitted on a handle, so that the workload
+ * can be replayed later against another server (see bench/replay.c).
+ *
+ * Each command submitted by the caller is numbered when it is
+ * submitted, and remembers the number of the last command to
+ * complete before then, which is what it may have depended on.  A
+ * record is written to the file (see nbd-record.h) when it
+ * completes, through stdio so that it costs one copy into the
+ * buffer.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "internal.h"
+#include "byte-swapping.h"
+#include "nbd-record.h"
+
+int
+nbd_unlocked_record_start (struct nbd_handle *h, const char *filename)
+{
+  FILE *fp;
+
+  if (h->record_fp) {
+    set_error (EBUSY, "commands are already being recorded");
+    return -1;
+  }
+
+  fp = fopen (filename, "we");
+  if (fp == NULL) {
+    set_error (errno, "fopen: %s", filename);
+    return -1;
+  }
+  if (fwrite (NBD_RECORD_MAGIC, 8, 1, fp) != 1) {
+    set_error (errno, "fwrite: %s", filename);
+    fclose (fp);
+    return -1;
+  }
+
+  h->record_fp = fp;
+  h->record_start_us = nbd_internal_stats_now ();
+  h->record_seq = 0;
+  h->record_last_done = 0;
+  return 0;
+}
+
+int
+nbd_unlocked_record_stop (struct nbd_handle *h)
+{
+  FILE *fp = h->record_fp;
+
+  if (fp == NULL)
+    return 0;
+
+  h->record_fp = NULL;
+  if (ferror (fp)) {
+    set_error (EIO, "error writing the record file");
+    fclose (fp);
+    return -1;
+  }
+  if (fclose (fp) == EOF) {
+    set_error (errno, "fclose");
+    return -1;
+  }
+  return 0;
+}
+
+/* Called through the record_submit macro for each command the caller
+ * submits while recording.
+ */
+void
+nbd_internal_record_submit (struct nbd_handle *h, struct command *cmd)
+{
+  cmd->record_seq = ++h->record_seq;
+  cmd->record_after = h->record_last_done;
+}
+
+/* Called through the record_complete macro just before the caller
+ * is given the result of a command which was numbered by
+ * record_submit.  Reads ahead (see lib/read-ahead.c) and disconnect
+ * requests were not asked for by the caller, so they are not
+ * written.  Errors are reported by nbd_record_stop.
+ */
+void
+nbd_internal_record_complete (struct nbd_handle *h,
+                              const struct command *cmd)
+{
+  struct nbd_record rec;
+  uint64_t now;
+
+  if (h->record_fp == NULL || cmd->prefetch || cmd->type == NBD_CMD_DISC)
+    return;
+
+  /* If recording was restarted since the command was submitted then
+   * its number belongs to the old file.
+   */
+  if (cmd->issued_us < h->record_start_us)
+    return;
+
+  now = nbd_internal_stats_now ();
+  rec.time = htobe64 (cmd->issued_us - h->record_start_us);
+  rec.latency = htobe64 (now - cmd->issued_us);
+  rec.offset = htobe64 (cmd->offset);
+  rec.count = htobe64 (cmd->count);
+  rec.seq = htobe32 (cmd->record_seq);
+  rec.after = htobe32 (cmd->record_after);
+  rec.type = htobe16 (cmd->type);
+  rec.flags = htobe16 (cmd->flags & 0xffff);
+  rec.error = htobe32 (cmd->error);
+  /* Errors are sticky and are checked by nbd_record_stop. */
+  fwrite (&rec, sizeof rec, 1, h->record_fp);
+
+  if (cmd->record_seq > h->record_last_done)
+    h->record_last_done = cmd->record_seq;
+}
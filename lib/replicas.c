@@ -0,0 +1,614 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Reads from a set of handles connected to identical exports, see
+ * nbd_replicas_create(3).  Like lib/group.c this only uses the public
+ * API of the member handles.
+ *
+ * Each read of the set (struct replica_read) is issued as
+ * nbd_aio_pread_lend on one replica, and possibly a second one if it
+ * is hedged, with a struct replica_cmd for each command.  Whichever
+ * command lends its data first copies it to the caller's buffer, so
+ * a slow loser never writes there later.  Losers are cancelled if
+ * they have not been sent, but otherwise must wait for the server, so
+ * their replica_cmd is detached from the read and freed when the
+ * command retires, which may be after the set has been closed: the
+ * set itself is only freed once no commands are left.  The callbacks only record what happened.  The decisions
+ * (hedging, failing over, completing reads) are made by service after
+ * each poll, so that they never call into another handle from inside
+ * a callback.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "internal.h"
+
+/* The most replicas in a set, so that the replicas tried by a read
+ * fit in a bitmap.
+ */
+#define MAX_REPLICAS 64
+
+/* The delay before hedging a read on a replica which has not
+ * completed any reads yet, in microseconds.
+ */
+#define DEFAULT_HEDGE_DELAY 10000
+
+struct replica_cmd;
+
+struct replica_read {
+  struct replica_read *next;    /* On rs->reads */
+  void *buf;
+  size_t count;
+  uint64_t offset;
+  uint32_t flags;
+  nbd_completion_callback completion;
+  uint64_t tried;               /* Bitmap of replicas tried. */
+  struct replica_cmd *cmds[2];  /* Commands in flight for it. */
+  int nr_cmds;
+  uint64_t hedge_us;            /* When to hedge it, or 0. */
+  bool done;                    /* The data has been copied. */
+  int error;                    /* Last error, if not done. */
+};
+
+struct replica_cmd {
+  struct nbd_replicas *rs;
+  struct replica_read *r;       /* NULL once detached. */
+  int i;                        /* Replica it was issued on. */
+  int64_t cookie;
+  uint64_t issued_us;
+};
+
+struct nbd_replicas *
+nbd_replicas_create (void)
+{
+  struct nbd_replicas *rs;
+
+  nbd_internal_set_error_context ("nbd_replicas_create");
+
+  rs = calloc (1, sizeof *rs);
+  if (rs == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  return rs;
+}
+
+static void
+free_replicas (struct nbd_replicas *rs)
+{
+  free (rs->replicas);
+  free (rs->fds);
+  free (rs);
+}
+
+/* Detach the commands of a read and free it. */
+static void
+free_read (struct replica_read *r)
+{
+  int j;
+
+  for (j = 0; j < r->nr_cmds; ++j)
+    r->cmds[j]->r = NULL;
+  FREE_CALLBACK (r->completion);
+  free (r);
+}
+
+void
+nbd_replicas_close (struct nbd_replicas *rs)
+{
+  struct replica_read *r;
+
+  if (rs == NULL)
+    return;
+
+  while ((r = rs->reads) != NULL) {
+    rs->reads = r->next;
+    free_read (r);
+  }
+  rs->closed = true;
+  if (rs->nr_cmds == 0)
+    free_replicas (rs);
+}
+
+int
+nbd_replicas_add (struct nbd_replicas *rs, struct nbd_handle *h)
+{
+  struct replica *replicas;
+  struct pollfd *fds;
+  int i;
+
+  nbd_internal_set_error_context ("nbd_replicas_add");
+
+  for (i = 0; i < rs->nr_replicas; ++i) {
+    if (rs->replicas[i].h == h) {
+      set_error (EINVAL, "handle is already in the replica set");
+      return -1;
+    }
+  }
+  if (rs->nr_replicas >= MAX_REPLICAS) {
+    set_error (EINVAL, "a replica set can have at most %d handles",
+               MAX_REPLICAS);
+    return -1;
+  }
+
+  replicas = realloc (rs->replicas,
+                      (rs->nr_replicas + 1) * sizeof rs->replicas[0]);
+  if (replicas == NULL) {
+    set_error (errno, "realloc");
+    return -1;
+  }
+  rs->replicas = replicas;
+  fds = realloc (rs->fds, (rs->nr_replicas + 1) * sizeof rs->fds[0]);
+  if (fds == NULL) {
+    set_error (errno, "realloc");
+    return -1;
+  }
+  rs->fds = fds;
+
+  rs->replicas[rs->nr_replicas] = (struct replica) { .h = h };
+  rs->nr_replicas++;
+  return 0;
+}
+
+int
+nbd_replicas_get_nr_handles (struct nbd_replicas *rs)
+{
+  return rs->nr_replicas;
+}
+
+int
+nbd_replicas_set_hedge_percentile (struct nbd_replicas *rs,
+                                   unsigned percentile)
+{
+  nbd_internal_set_error_context ("nbd_replicas_set_hedge_percentile");
+
+  if (percentile > 100) {
+    set_error (ERANGE, "percentile out of range: %u", percentile);
+    return -1;
+  }
+  rs->hedge_percentile = percentile;
+  return 0;
+}
+
+unsigned
+nbd_replicas_get_hedge_percentile (struct nbd_replicas *rs)
+{
+  return rs->hedge_percentile;
+}
+
+uint64_t
+nbd_replicas_get_hedged_reads (struct nbd_replicas *rs)
+{
+  return rs->hedged_reads;
+}
+
+static int
+lend_callback (void *user_data, const void *buf, size_t count,
+               uint64_t offset, int *error)
+{
+  struct replica_cmd *rc = user_data;
+  struct replica_read *r = rc->r;
+
+  if (r != NULL && !r->done) {
+    memcpy (r->buf, buf, count);
+    r->done = true;
+  }
+  return 0;
+}
+
+static int
+completion_callback (void *user_data, int *error)
+{
+  struct replica_cmd *rc = user_data;
+  struct replica *replica = &rc->rs->replicas[rc->i];
+  uint64_t latency;
+
+  replica->in_flight--;
+  if (*error == 0) {
+    /* A moving average, which follows changes in a few reads. */
+    latency = nbd_internal_stats_now () - rc->issued_us;
+    if (replica->latency_us == 0)
+      replica->latency_us = latency ? latency : 1;
+    else
+      replica->latency_us = (replica->latency_us * 7 + latency) / 8;
+  }
+  else if (rc->r != NULL)
+    rc->r->error = *error;
+  return 1;
+}
+
+static void
+free_callback (void *user_data)
+{
+  struct replica_cmd *rc = user_data;
+  struct nbd_replicas *rs = rc->rs;
+  struct replica_read *r = rc->r;
+
+  if (r != NULL) {
+    if (r->cmds[0] == rc)
+      r->cmds[0] = r->cmds[1];
+    r->nr_cmds--;
+  }
+  free (rc);
+
+  rs->nr_cmds--;
+  if (rs->closed && rs->nr_cmds == 0)
+    free_replicas (rs);
+}
+
+/* Return true if the replica can take new commands. */
+static bool
+is_usable (struct nbd_handle *h)
+{
+  return nbd_aio_is_ready (h) == 1 || nbd_aio_is_processing (h) == 1;
+}
+
+/* Choose the replica which is expected to answer soonest, from those
+ * not yet tried by the read.  Replicas which have not been measured
+ * are tried first.  Returns -1 if there is none.
+ */
+static int
+choose (struct nbd_replicas *rs, uint64_t tried)
+{
+  struct replica *replica;
+  uint64_t cost, best_cost = 0;
+  int i, best = -1;
+
+  for (i = 0; i < rs->nr_replicas; ++i) {
+    replica = &rs->replicas[i];
+    if ((tried & (UINT64_C (1) << i)) != 0 || !is_usable (replica->h))
+      continue;
+    cost = replica->latency_us * (replica->in_flight + 1);
+    if (best == -1 || cost < best_cost) {
+      best = i;
+      best_cost = cost;
+    }
+  }
+  return best;
+}
+
+/* Return when a read issued now on replica i should be hedged. */
+static uint64_t
+hedge_time (struct nbd_replicas *rs, int i)
+{
+  int64_t delay = 0;
+  int j;
+
+  if (rs->hedge_percentile == 0 || rs->nr_replicas < 2)
+    return 0;
+
+  /* Use the percentile of the replica's own read latency, or of the
+   * fastest replica if it has not completed any reads yet.
+   */
+  delay = nbd_internal_stats_latency_percentile (rs->replicas[i].h,
+                                                 LIBNBD_CMD_READ,
+                                                 rs->hedge_percentile);
+  for (j = 0; delay == 0 && j < rs->nr_replicas; ++j) {
+    int64_t d = nbd_internal_stats_latency_percentile (rs->replicas[j].h,
+                                                       LIBNBD_CMD_READ,
+                                                       rs->hedge_percentile);
+    if (d > 0 && (delay == 0 || d < delay))
+      delay = d;
+  }
+  if (delay <= 0)
+    delay = DEFAULT_HEDGE_DELAY;
+  return nbd_internal_stats_now () + delay;
+}
+
+/* Issue the read on the best replica it has not tried.  Returns -1
+ * if it could not be issued anywhere, with the error in r->error and
+ * in the thread's error.
+ */
+static int
+issue (struct nbd_replicas *rs, struct replica_read *r)
+{
+  struct replica_cmd *rc;
+  int64_t cookie;
+  int i;
+
+  while ((i = choose (rs, r->tried)) >= 0) {
+    r->tried |= UINT64_C (1) << i;
+
+    rc = malloc (sizeof *rc);
+    if (rc == NULL) {
+      set_error (errno, "malloc");
+      r->error = errno;
+      return -1;
+    }
+    rc->rs = rs;
+    rc->r = r;
+    rc->i = i;
+    rc->issued_us = nbd_internal_stats_now ();
+    r->cmds[r->nr_cmds++] = rc;
+    rs->nr_cmds++;
+    rs->replicas[i].in_flight++;
+
+    cookie = nbd_aio_pread_lend (rs->replicas[i].h, r->count, r->offset,
+                                 (nbd_lend_callback) {
+                                   .callback = lend_callback,
+                                   .user_data = rc },
+                                 (nbd_completion_callback) {
+                                   .callback = completion_callback,
+                                   .user_data = rc,
+                                   .free = free_callback },
+                                 r->flags);
+    if (cookie >= 0) {
+      rc->cookie = cookie;
+      return 0;
+    }
+
+    /* The callbacks are not called if the command was not issued. */
+    r->error = nbd_get_errno ();
+    rs->replicas[i].in_flight--;
+    rs->nr_cmds--;
+    r->nr_cmds--;
+    free (rc);
+  }
+
+  if (r->error == 0) {
+    set_error (ENOTCONN, "no replica is connected");
+    r->error = ENOTCONN;
+  }
+  return -1;
+}
+
+static struct replica_read *
+start_read (struct nbd_replicas *rs, void *buf, size_t count,
+            uint64_t offset, nbd_completion_callback completion,
+            uint32_t flags)
+{
+  struct replica_read *r;
+
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return NULL;
+  }
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+  r->buf = buf;
+  r->count = count;
+  r->offset = offset;
+  r->flags = flags;
+
+  if (issue (rs, r) == -1) {
+    free (r);
+    return NULL;
+  }
+  r->hedge_us = hedge_time (rs, r->cmds[0]->i);
+  r->completion = completion;
+  r->next = rs->reads;
+  rs->reads = r;
+  return r;
+}
+
+int
+nbd_replicas_aio_pread (struct nbd_replicas *rs, void *buf, size_t count,
+                        uint64_t offset, nbd_completion_callback completion,
+                        uint32_t flags)
+{
+  nbd_internal_set_error_context ("nbd_replicas_aio_pread");
+
+  if (start_read (rs, buf, count, offset, completion, flags) == NULL)
+    return -1;
+  return 0;
+}
+
+/* Hedge, fail over and complete the reads, after the handles have
+ * been polled.
+ */
+static void
+service (struct nbd_replicas *rs)
+{
+  struct replica_read **rp, *r;
+  struct nbd_handle *loser_h[2];
+  int64_t loser_cookie[2];
+  uint64_t now = nbd_internal_stats_now ();
+  int error, j, nr_losers;
+
+  for (rp = &rs->reads; (r = *rp) != NULL; ) {
+    /* Every command for the read has failed, so fail over.  issue
+     * gives up once each replica has been tried.
+     */
+    if (!r->done && r->nr_cmds == 0 && issue (rs, r) == 0)
+      r->hedge_us = hedge_time (rs, r->cmds[0]->i);
+
+    if (r->done || r->nr_cmds == 0) {
+      *rp = r->next;
+      error = r->done ? 0 : r->error;
+      CALL_CALLBACK (r->completion, &error);
+
+      /* Cancel the losers which have not been sent yet.  Cancelling
+       * may retire and free their replica_cmd, so they are detached
+       * first.
+       */
+      nr_losers = r->nr_cmds;
+      for (j = 0; j < nr_losers; ++j) {
+        loser_h[j] = rs->replicas[r->cmds[j]->i].h;
+        loser_cookie[j] = r->cmds[j]->cookie;
+      }
+      free_read (r);
+      for (j = 0; j < nr_losers; ++j)
+        nbd_aio_cancel (loser_h[j], loser_cookie[j]);
+      continue;
+    }
+
+    if (r->hedge_us != 0 && now >= r->hedge_us && r->nr_cmds == 1) {
+      r->hedge_us = 0;
+      if (issue (rs, r) == 0)
+        rs->hedged_reads++;
+    }
+    rp = &r->next;
+  }
+}
+
+/* Return how many milliseconds until the next read should be hedged,
+ * or -1 if none.
+ */
+static int
+hedge_delay (struct nbd_replicas *rs)
+{
+  struct replica_read *r;
+  uint64_t now = nbd_internal_stats_now (), first = 0;
+
+  for (r = rs->reads; r != NULL; r = r->next) {
+    if (r->hedge_us != 0 && (first == 0 || r->hedge_us < first))
+      first = r->hedge_us;
+  }
+  if (first == 0)
+    return -1;
+  if (first <= now)
+    return 0;
+  return (first - now + 999) / 1000;
+}
+
+int
+nbd_replicas_poll (struct nbd_replicas *rs, int timeout)
+{
+  struct nbd_handle *h;
+  int i, nr_fds = 0, r, t, timer = -1;
+  unsigned dir;
+
+  nbd_internal_set_error_context ("nbd_replicas_poll");
+
+  for (i = 0; i < rs->nr_replicas; ++i) {
+    h = rs->replicas[i].h;
+    rs->fds[i].fd = -1;
+    rs->fds[i].events = 0;
+    rs->fds[i].revents = 0;
+    switch (nbd_aio_get_direction (h)) {
+    case LIBNBD_AIO_DIRECTION_READ:
+      rs->fds[i].events = POLLIN;
+      break;
+    case LIBNBD_AIO_DIRECTION_WRITE:
+      rs->fds[i].events = POLLOUT;
+      break;
+    case LIBNBD_AIO_DIRECTION_BOTH:
+      rs->fds[i].events = POLLIN|POLLOUT;
+      break;
+    default:
+      continue;
+    }
+    rs->fds[i].fd = nbd_aio_get_fd (h);
+    if (rs->fds[i].fd >= 0)
+      nr_fds++;
+    t = nbd_aio_get_timer (h);
+    if (t >= 0 && (timer == -1 || t < timer))
+      timer = t;
+  }
+  t = hedge_delay (rs);
+  if (t >= 0 && (timer == -1 || t < timer))
+    timer = t;
+
+  if (nr_fds == 0 && timer == -1) {
+    set_error (EINVAL, "nothing to poll for on any handle in the replica set");
+    return -1;
+  }
+
+  /* See nbd_aio_get_timer. */
+  if (timer >= 0 && (timeout < 0 || timer < timeout))
+    timeout = timer;
+  else
+    timer = -1;
+
+  r = poll (rs->fds, rs->nr_replicas, timeout);
+  if (r == -1) {
+    set_error (errno, "poll");
+    return -1;
+  }
+
+  /* As in lib/reactor.c, a failure on one handle moves it to the
+   * dead state and fails its commands, which service then retries
+   * on another replica, so errors from the notifications are not
+   * returned.
+   */
+  for (i = 0; i < rs->nr_replicas; ++i) {
+    h = rs->replicas[i].h;
+    if (rs->fds[i].fd < 0)
+      continue;
+    dir = nbd_aio_get_direction (h);
+    if ((rs->fds[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+        (dir & LIBNBD_AIO_DIRECTION_READ) != 0)
+      nbd_aio_notify_read (h);
+    else if ((rs->fds[i].revents &
+              (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) != 0 &&
+             (dir & LIBNBD_AIO_DIRECTION_WRITE) != 0)
+      nbd_aio_notify_write (h);
+    else if (timer >= 0 && nbd_aio_get_timer (h) == 0)
+      nbd_aio_notify_timer (h);
+  }
+
+  service (rs);
+  return r > 0 || timer >= 0;
+}
+
+static int
+pread_done (void *user_data, int *error)
+{
+  int *err = user_data;
+
+  *err = *error;
+  return 1;
+}
+
+int
+nbd_replicas_pread (struct nbd_replicas *rs, void *buf, size_t count,
+                    uint64_t offset, uint32_t flags)
+{
+  struct replica_read *r, **rp;
+  int err = -1;
+
+  nbd_internal_set_error_context ("nbd_replicas_pread");
+
+  r = start_read (rs, buf, count, offset,
+                  (nbd_completion_callback) { .callback = pread_done,
+                                              .user_data = &err },
+                  flags);
+  if (r == NULL)
+    return -1;
+
+  while (err == -1) {
+    if (nbd_replicas_poll (rs, -1) == -1) {
+      /* Forget the read, whose completion points to this frame. */
+      for (rp = &rs->reads; *rp != r; rp = &(*rp)->next)
+        ;
+      *rp = r->next;
+      free_read (r);
+      return -1;
+    }
+  }
+
+  if (err != 0) {
+    nbd_internal_set_error_context ("nbd_replicas_pread");
+    set_error (err, "read failed on every replica");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,420 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Resolving host names without blocking.
+ *
+ * getaddrinfo can block for a long time, and there is no portable
+ * way to call it asynchronously (getaddrinfo_a is glibc only and
+ * reports completion with a signal or a thread, not with a file
+ * descriptor).  So unless the host is a numeric address, or it is in
+ * the cache below, the lookup is done by a short-lived thread.  While
+ * the thread runs, h->sock is one end of a socketpair and the thread
+ * holds the other end, which it closes when it has finished.  That
+ * makes h->sock readable, so the state machine waits for the lookup
+ * in CONNECT_TCP.RESOLVING like it waits for any other event.
+ *
+ * If the handle gives up first, for example because it is closed,
+ * the thread finishes on its own, and whichever of the handle and
+ * the thread is last frees the lookup.
+ *
+ * Successful lookups are kept in a small cache shared by all the
+ * handles in the process, so that the connections of a group (or
+ * reconnections) do not need to look up the same host again.  Each
+ * handle decides how old the cached results which it uses may be,
+ * see nbd_set_resolver_cache_ttl.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+/* Most number of host names kept in the cache. */
+#define MAX_CACHE_ENTRIES 64
+
+struct resolver {
+  pthread_mutex_t lock;
+  unsigned refs;                /* The handle and the thread. */
+  bool done;
+  char *hostname, *port;
+  struct addrinfo hints;
+  struct addrinfo *result;      /* Copied with copy_addrinfo. */
+  int gai_error;                /* Return value of getaddrinfo. */
+  int saved_errno;              /* errno, if gai_error == EAI_SYSTEM. */
+  int wakefd;                   /* The thread's end of the socketpair. */
+};
+
+struct cache_entry {
+  struct cache_entry *next;
+  char *hostname, *port;
+  int family;
+  time_t resolved;              /* Monotonic clock, in seconds. */
+  struct addrinfo *result;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache;
+static size_t nr_cache_entries;
+
+/* Copy a list returned by getaddrinfo, so that it can be freed with
+ * nbd_internal_free_addrinfo and kept after freeaddrinfo.  The
+ * canonical names are not copied.
+ */
+static struct addrinfo *
+copy_addrinfo (const struct addrinfo *ai)
+{
+  struct addrinfo *ret = NULL, **next = &ret, *copy;
+
+  for (; ai != NULL; ai = ai->ai_next) {
+    copy = malloc (sizeof *copy + ai->ai_addrlen);
+    if (copy == NULL) {
+      nbd_internal_free_addrinfo (ret);
+      return NULL;
+    }
+    *copy = *ai;
+    copy->ai_addr = (struct sockaddr *) (copy + 1);
+    memcpy (copy->ai_addr, ai->ai_addr, ai->ai_addrlen);
+    copy->ai_canonname = NULL;
+    copy->ai_next = NULL;
+    *next = copy;
+    next = &copy->ai_next;
+  }
+  return ret;
+}
+
+void
+nbd_internal_free_addrinfo (struct addrinfo *ai)
+{
+  struct addrinfo *next;
+
+  for (; ai != NULL; ai = next) {
+    next = ai->ai_next;
+    free (ai);
+  }
+}
+
+static time_t
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* Return a copy of the cached result, or NULL. */
+static struct addrinfo *
+cache_lookup (struct nbd_handle *h)
+{
+  struct cache_entry *e;
+  struct addrinfo *ret = NULL;
+
+  if (h->resolver_cache_ttl == 0)
+    return NULL;
+
+  pthread_mutex_lock (&cache_lock);
+  for (e = cache; e != NULL; e = e->next) {
+    if (e->family == h->hints.ai_family &&
+        strcmp (e->hostname, h->hostname) == 0 &&
+        strcmp (e->port, h->port) == 0) {
+      if (now () - e->resolved < h->resolver_cache_ttl)
+        ret = copy_addrinfo (e->result);
+      break;
+    }
+  }
+  pthread_mutex_unlock (&cache_lock);
+  return ret;
+}
+
+static void
+free_cache_entry (struct cache_entry *e)
+{
+  free (e->hostname);
+  free (e->port);
+  nbd_internal_free_addrinfo (e->result);
+  free (e);
+}
+
+/* Cache a copy of result.  Failures are ignored. */
+static void
+cache_insert (const char *hostname, const char *port, int family,
+              const struct addrinfo *result)
+{
+  struct cache_entry *e, **ep, **oldest;
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL)
+    return;
+  e->hostname = strdup (hostname);
+  e->port = strdup (port);
+  e->family = family;
+  e->resolved = now ();
+  e->result = copy_addrinfo (result);
+  if (e->hostname == NULL || e->port == NULL || e->result == NULL) {
+    free_cache_entry (e);
+    return;
+  }
+
+  pthread_mutex_lock (&cache_lock);
+  /* Replace the old entry for this host, or the oldest entry if
+   * the cache is full.
+   */
+  oldest = NULL;
+  for (ep = &cache; *ep != NULL; ep = &(*ep)->next) {
+    if ((*ep)->family == family &&
+        strcmp ((*ep)->hostname, hostname) == 0 &&
+        strcmp ((*ep)->port, port) == 0)
+      break;
+    if (oldest == NULL || (*ep)->resolved <= (*oldest)->resolved)
+      oldest = ep;
+  }
+  if (*ep == NULL && nr_cache_entries >= MAX_CACHE_ENTRIES)
+    ep = oldest;
+  if (*ep != NULL) {
+    struct cache_entry *old = *ep;
+
+    *ep = old->next;
+    free_cache_entry (old);
+    nr_cache_entries--;
+  }
+  e->next = cache;
+  cache = e;
+  nr_cache_entries++;
+  pthread_mutex_unlock (&cache_lock);
+}
+
+static void
+release (struct resolver *r)
+{
+  bool last;
+
+  pthread_mutex_lock (&r->lock);
+  last = --r->refs == 0;
+  pthread_mutex_unlock (&r->lock);
+  if (!last)
+    return;
+
+  pthread_mutex_destroy (&r->lock);
+  free (r->hostname);
+  free (r->port);
+  nbd_internal_free_addrinfo (r->result);
+  if (r->wakefd >= 0)
+    close (r->wakefd);
+  free (r);
+}
+
+static void *
+resolver_thread (void *vp)
+{
+  struct resolver *r = vp;
+  struct addrinfo *result = NULL, *copy = NULL;
+  int err, saved_errno;
+
+  err = getaddrinfo (r->hostname, r->port, &r->hints, &result);
+  saved_errno = errno;
+  if (err == 0) {
+    copy = copy_addrinfo (result);
+    freeaddrinfo (result);
+    if (copy == NULL) {
+      err = EAI_SYSTEM;
+      saved_errno = ENOMEM;
+    }
+    else
+      cache_insert (r->hostname, r->port, r->hints.ai_family, copy);
+  }
+
+  pthread_mutex_lock (&r->lock);
+  r->result = copy;
+  r->gai_error = err;
+  r->saved_errno = saved_errno;
+  r->done = true;
+  /* This wakes up the handle. */
+  close (r->wakefd);
+  r->wakefd = -1;
+  pthread_mutex_unlock (&r->lock);
+
+  release (r);
+  return NULL;
+}
+
+/* Start looking up h->hostname and h->port with h->hints.  Either
+ * h->result is set straight away, or a thread is started and
+ * h->sock becomes readable when it has finished.  In both cases
+ * nbd_internal_resolve_finish should then be called.
+ */
+int
+nbd_internal_resolve_start (struct nbd_handle *h)
+{
+  struct addrinfo hints = h->hints, *result;
+  struct resolver *r;
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+  int sv[2], err;
+
+  assert (!h->sock);
+  assert (!h->resolver);
+  assert (!h->result);
+
+  /* Numeric addresses never block. */
+  hints.ai_flags |= AI_NUMERICHOST;
+  if (getaddrinfo (h->hostname, h->port, &hints, &result) == 0) {
+    h->result = copy_addrinfo (result);
+    freeaddrinfo (result);
+    if (h->result == NULL) {
+      set_error (errno, "malloc");
+      return -1;
+    }
+    return 0;
+  }
+
+  h->result = cache_lookup (h);
+  if (h->result) {
+    debug (h, "using cached addresses of %s:%s", h->hostname, h->port);
+    return 0;
+  }
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  pthread_mutex_init (&r->lock, NULL);
+  r->refs = 2;
+  r->hints = h->hints;
+  r->wakefd = -1;
+  r->hostname = strdup (h->hostname);
+  r->port = strdup (h->port);
+  if (r->hostname == NULL || r->port == NULL) {
+    set_error (errno, "strdup");
+    goto err;
+  }
+
+  if (socketpair (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) == -1) {
+    set_error (errno, "socketpair");
+    goto err;
+  }
+  r->wakefd = sv[1];
+  h->sock = nbd_internal_socket_create (sv[0]);
+  if (!h->sock) {
+    close (sv[0]);
+    goto err;
+  }
+
+  /* The thread should not handle any of the caller's signals. */
+  sigfillset (&all);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  err = pthread_create (&thread, &attr, resolver_thread, r);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy (&attr);
+  if (err != 0) {
+    set_error (err, "pthread_create");
+    nbd_internal_close_socket (h);
+    goto err;
+  }
+
+  h->resolver = r;
+  return 0;
+
+ err:
+  r->refs = 1;
+  release (r);
+  return -1;
+}
+
+/* Returns 1 if the addresses are in h->result, 0 if the lookup has
+ * not finished yet, or -1 if it failed.
+ */
+int
+nbd_internal_resolve_finish (struct nbd_handle *h)
+{
+  struct resolver *r = h->resolver;
+  int err;
+
+  if (r == NULL)
+    return 1;
+
+  pthread_mutex_lock (&r->lock);
+  if (!r->done) {
+    pthread_mutex_unlock (&r->lock);
+    return 0;
+  }
+  err = r->gai_error;
+  if (err == 0) {
+    h->result = r->result;
+    r->result = NULL;
+  }
+  else if (err == EAI_SYSTEM)
+    set_error (r->saved_errno, "getaddrinfo: %s:%s",
+               h->hostname, h->port);
+  else
+    set_error (0, "getaddrinfo: %s:%s: %s",
+               h->hostname, h->port, gai_strerror (err));
+  pthread_mutex_unlock (&r->lock);
+
+  nbd_internal_resolve_cancel (h);
+  return err == 0 ? 1 : -1;
+}
+
+/* Forget about the lookup in progress, if any.  The thread carries
+ * on until getaddrinfo returns.
+ */
+void
+nbd_internal_resolve_cancel (struct nbd_handle *h)
+{
+  if (h->resolver == NULL)
+    return;
+
+  if (h->sock)
+    nbd_internal_close_socket (h);
+  release (h->resolver);
+  h->resolver = NULL;
+}
+
+int
+nbd_unlocked_set_resolver_cache_ttl (struct nbd_handle *h, int seconds)
+{
+  if (seconds < 0) {
+    set_error (EINVAL, "resolver cache TTL must not be negative");
+    return -1;
+  }
+  h->resolver_cache_ttl = seconds;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_resolver_cache_ttl (struct nbd_handle *h)
+{
+  return h->resolver_cache_ttl;
+}
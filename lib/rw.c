@@ -26,19 +26,102 @@
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "internal.h"
+#include "iszero.h"
+
+/* Give up waiting for a synchronous command, see nbd_set_timeout.
+ * If any of the command has been sent, the server may still read or
+ * write the caller's buffer, so the connection must be closed.
+ */
+static int
+command_timed_out (struct nbd_handle *h, int64_t cookie)
+{
+  struct command *cmd;
+  const char *name;
+
+  cmd = nbd_internal_cookie_table_lookup (h, cookie);
+  assert (cmd);
+  name = nbd_internal_name_of_nbd_cmd (cmd->type);
+
+  if (nbd_unlocked_aio_cancel (h, cookie) == -1) {
+    set_error (ETIMEDOUT, "%s: command timed out", name);
+    nbd_internal_abort_connection (h);
+  }
+
+  /* Either way the command has now completed, so retire it. */
+  nbd_unlocked_aio_command_completed (h, cookie);
+  set_error (ETIMEDOUT, "%s: command timed out", name);
+  return -1;
+}
+
+/* Used by the synchronous calls before issuing a read or write with
+ * a payload of count bytes: if nbd_set_max_bytes_in_flight was called
+ * with wait true, wait until the payload fits within the limit.  A
+ * payload which is larger than the limit by itself fits once nothing
+ * else is in flight.  The command is issued after this returns, so
+ * the checks of nbd_internal_command_common see the state of the
+ * handle after waiting.  Inside a batch nothing is sent until
+ * nbd_aio_end_batch, so there is no point waiting and the command
+ * fails with EAGAIN instead.
+ */
+static int
+wait_for_bytes_in_flight (struct nbd_handle *h, uint64_t count)
+{
+  int64_t deadline;
+  int timeout;
+
+  if (!h->max_bytes_in_flight || !h->wait_for_bytes_in_flight ||
+      h->batching)
+    return 0;
+
+  deadline = nbd_internal_deadline (h);
+  while (h->bytes_in_flight > 0 &&
+         h->bytes_in_flight + count > h->max_bytes_in_flight) {
+    timeout = nbd_internal_time_left (deadline);
+    if (timeout == 0) {
+      set_error (ETIMEDOUT, "timed out waiting for bytes in flight");
+      return -1;
+    }
+    if (nbd_unlocked_poll (h, timeout) == -1)
+      return -1;
+  }
+  return 0;
+}
 
 static int
 wait_for_command (struct nbd_handle *h, int64_t cookie)
 {
-  int r;
+  struct command *cmd;
+  int64_t deadline = nbd_internal_deadline (h);
+  int r, timeout;
+
+  /* nbd_unlocked_poll releases the lock, so stop other threads from
+   * retiring the command with nbd_aio_get_completions.
+   */
+  cmd = nbd_internal_cookie_table_lookup (h, cookie);
+  if (cmd)
+    cmd->waited_for = true;
 
   while ((r = nbd_unlocked_aio_command_completed (h, cookie)) == 0) {
-    if (nbd_unlocked_poll (h, -1) == -1)
-      return -1;
+    timeout = nbd_internal_time_left (deadline);
+    if (timeout == 0) {
+      r = command_timed_out (h, cookie);
+      break;
+    }
+    if (nbd_unlocked_poll (h, timeout) == -1) {
+      r = -1;
+      break;
+    }
   }
 
+  /* If the command was not retired, nobody is waiting for it now. */
+  cmd = nbd_internal_cookie_table_lookup (h, cookie);
+  if (cmd)
+    cmd->waited_for = false;
+
   return r == -1 ? -1 : 0;
 }
 
@@ -49,6 +132,8 @@ nbd_unlocked_pread (struct nbd_handle *h, void *buf,
 {
   int64_t cookie;
 
+  if (wait_for_bytes_in_flight (h, count) == -1)
+    return -1;
   cookie = nbd_unlocked_aio_pread (h, buf, count, offset,
                                    NBD_NULL_COMPLETION, flags);
   if (cookie == -1)
@@ -66,6 +151,8 @@ nbd_unlocked_pread_structured (struct nbd_handle *h, void *buf,
 {
   int64_t cookie;
 
+  if (wait_for_bytes_in_flight (h, count) == -1)
+    return -1;
   cookie = nbd_unlocked_aio_pread_structured (h, buf, count, offset,
                                               chunk,
                                               NBD_NULL_COMPLETION,
@@ -76,15 +163,79 @@ nbd_unlocked_pread_structured (struct nbd_handle *h, void *buf,
   return wait_for_command (h, cookie);
 }
 
-/* Issue a write command and wait for the reply. */
+/* Issue a read command which reports holes and wait for the reply. */
+int
+nbd_unlocked_pread_sparse (struct nbd_handle *h, void *buf,
+                           size_t count, uint64_t offset,
+                           nbd_extent_callback extent,
+                           uint32_t flags)
+{
+  int64_t cookie;
+
+  if (wait_for_bytes_in_flight (h, count) == -1)
+    return -1;
+  cookie = nbd_unlocked_aio_pread_sparse (h, buf, count, offset,
+                                          extent,
+                                          NBD_NULL_COMPLETION,
+                                          flags);
+  if (cookie == -1)
+    return -1;
+
+  return wait_for_command (h, cookie);
+}
+
+static int64_t aio_pwrite (struct nbd_handle *h, const void *buf,
+                           size_t count, uint64_t offset,
+                           nbd_completion_callback completion,
+                           uint32_t flags, bool write_behind);
+
+/* Issue a write command and wait for the reply.  The caller's buffer
+ * is used even with nbd_set_write_behind, since we wait anyway.
+ */
 int
 nbd_unlocked_pwrite (struct nbd_handle *h, const void *buf,
                      size_t count, uint64_t offset, uint32_t flags)
 {
   int64_t cookie;
 
-  cookie = nbd_unlocked_aio_pwrite (h, buf, count, offset,
-                                    NBD_NULL_COMPLETION, flags);
+  if (wait_for_bytes_in_flight (h, count) == -1)
+    return -1;
+  cookie = aio_pwrite (h, buf, count, offset, NBD_NULL_COMPLETION, flags,
+                       false);
+  if (cookie == -1)
+    return -1;
+
+  return wait_for_command (h, cookie);
+}
+
+/* Issue a read command into a file descriptor and wait for the reply. */
+int
+nbd_unlocked_pread_to_fd (struct nbd_handle *h, int fd, uint64_t fd_offset,
+                          uint64_t count, uint64_t offset, uint32_t flags)
+{
+  int64_t cookie;
+
+  if (wait_for_bytes_in_flight (h, count) == -1)
+    return -1;
+  cookie = nbd_unlocked_aio_pread_to_fd (h, fd, fd_offset, count, offset,
+                                         NBD_NULL_COMPLETION, flags);
+  if (cookie == -1)
+    return -1;
+
+  return wait_for_command (h, cookie);
+}
+
+/* Issue a write command from a file descriptor and wait for the reply. */
+int
+nbd_unlocked_pwrite_from_fd (struct nbd_handle *h, int fd, uint64_t fd_offset,
+                             uint64_t count, uint64_t offset, uint32_t flags)
+{
+  int64_t cookie;
+
+  if (wait_for_bytes_in_flight (h, count) == -1)
+    return -1;
+  cookie = nbd_unlocked_aio_pwrite_from_fd (h, fd, fd_offset, count, offset,
+                                            NBD_NULL_COMPLETION, flags);
   if (cookie == -1)
     return -1;
 
@@ -158,6 +309,14 @@ nbd_unlocked_block_status (struct nbd_handle *h,
 {
   int64_t cookie;
 
+  if (h->extent_cache) {
+    switch (nbd_internal_extent_cache_block_status (h, count, offset,
+                                                    &extent, flags)) {
+    case -1: return -1;
+    case 1: return 0;
+    }
+  }
+
   cookie = nbd_unlocked_aio_block_status (h, count, offset, extent,
                                           NBD_NULL_COMPLETION, flags);
   if (cookie == -1)
@@ -166,13 +325,320 @@ nbd_unlocked_block_status (struct nbd_handle *h,
   return wait_for_command (h, cookie);
 }
 
-int64_t
-nbd_internal_command_common (struct nbd_handle *h,
-                             uint16_t flags, uint16_t type,
-                             uint64_t offset, uint64_t count,
-                             void *data, struct command_cb *cb)
+/* Insert a list of commands issued with LIBNBD_CMD_FLAG_PRIORITY
+ * into cmds_to_issue, after the commands which are being sent and
+ * the other priority commands, but ahead of the rest.  A command may
+ * only be overtaken priority_weight times, after which later
+ * commands queue behind it, so that it is not starved.
+ */
+static void
+queue_priority_commands (struct nbd_handle *h, struct command *first,
+                         struct command *last)
 {
-  struct command *cmd;
+  const int n = nbd_internal_nr_commands_being_sent (h);
+  struct command *cmd, *after = NULL;
+  int i;
+
+  for (cmd = h->cmds_to_issue, i = 0; cmd != NULL; cmd = cmd->next, ++i) {
+    if (i < n || cmd->priority || cmd->overtaken >= h->priority_weight)
+      after = cmd;
+  }
+  for (cmd = after ? after->next : h->cmds_to_issue; cmd != NULL;
+       cmd = cmd->next)
+    cmd->overtaken++;
+
+  if (after) {
+    last->next = after->next;
+    after->next = first;
+  }
+  else {
+    last->next = h->cmds_to_issue;
+    h->cmds_to_issue = first;
+  }
+  if (h->cmds_to_issue_tail == after)
+    h->cmds_to_issue_tail = last;
+}
+
+/* Add a list of commands to the end of the queue. Kick the state
+ * machine if there is no other command being processed, otherwise,
+ * it will be handled automatically on a future cycle around to READY.
+ * Beyond this point, we have to return a cookie to the user, since
+ * we are queuing the command, even if kicking the state machine
+ * detects a failure.  Not reporting a state machine failure here is
+ * okay - any caller of an async command will be calling more API to
+ * await results, and will eventually learn that the machine has
+ * moved on to DEAD at that time.
+ */
+static void
+queue_commands (struct nbd_handle *h, struct command *first,
+                struct command *last, int n)
+{
+  /* See nbd_set_write_behind. */
+  if ((first->write_behind || h->wb_pending > 0 || h->wb_held != NULL ||
+       h->wb_error != 0) &&
+      nbd_internal_write_behind_hold (h, first, last))
+    return;
+
+  h->in_flight += n;
+  if (h->in_flight > h->stats.max_in_flight)
+    h->stats.max_in_flight = h->in_flight;
+  if (h->cmds_to_issue != NULL && first->priority) {
+    assert (h->batching || h->reconnecting || h->adaptive_depth ||
+            h->rate_limited ||
+            nbd_internal_is_state_processing (get_next_state (h)));
+    queue_priority_commands (h, first, last);
+  }
+  else if (h->cmds_to_issue != NULL) {
+    assert (h->batching || h->reconnecting || h->adaptive_depth ||
+            h->rate_limited ||
+            nbd_internal_is_state_processing (get_next_state (h)));
+    h->cmds_to_issue_tail->next = first;
+    h->cmds_to_issue_tail = last;
+  }
+  else {
+    assert (h->cmds_to_issue_tail == NULL);
+    h->cmds_to_issue = first;
+    h->cmds_to_issue_tail = last;
+    /* During a batch the state machine is kicked by
+     * nbd_aio_end_batch instead.
+     */
+    if (!h->batching &&
+        nbd_internal_is_state_ready (get_next_state (h)) &&
+        nbd_internal_run (h, cmd_issue) == -1)
+      debug (h, "command queued, ignoring state machine failure");
+  }
+}
+
+/* The size of each piece when splitting a request, see
+ * nbd_set_split_requests.  Where possible this is a multiple of the
+ * server's preferred block size.
+ */
+static uint32_t
+split_size (struct nbd_handle *h)
+{
+  uint32_t size = nbd_internal_max_request_size (h);
+
+  if (h->block_preferred && size > h->block_preferred)
+    size -= size % h->block_preferred;
+  return size;
+}
+
+/* Return the length of the next piece of parent, starting at offset,
+ * and set *type to the command it is sent as.  If the request is too
+ * large to send whole, pieces which carry data end at multiples of
+ * the piece size.  If detect_zeroes is true
+ * (see nbd_set_zero_detection), the write is also broken where it
+ * changes between data and aligned blocks of zeroes, and runs of
+ * zero blocks are sent as NBD_CMD_WRITE_ZEROES.
+ */
+static uint32_t
+next_piece (struct nbd_handle *h, const struct command *parent,
+            bool detect_zeroes, uint64_t offset, uint16_t *type)
+{
+  const uint32_t size = split_size (h);
+  const uint64_t end = parent->offset + parent->count;
+  const uint32_t block = h->zero_detection;
+  const char *data = parent->data;
+  uint64_t max, pos, block_end;
+  bool zero = false, z;
+
+  max = end - offset;
+  if (parent->count > nbd_internal_max_request_size (h) &&
+      max > size - offset % size)
+    max = size - offset % size;
+  *type = parent->type;
+  if (!detect_zeroes)
+    return max;
+
+  for (pos = offset; pos < end; pos = block_end) {
+    block_end = pos - pos % block + block;
+    if (block_end > end)
+      block_end = end;
+    z = block_end - pos == block &&
+      is_zero (&data[pos - parent->offset], block);
+    if (pos == offset)
+      zero = z;
+    else if (z != zero)
+      break;
+    if (!zero && block_end - offset >= max) {
+      pos = offset + max;
+      break;
+    }
+  }
+
+  if (zero)
+    *type = NBD_CMD_WRITE_ZEROES;
+  return pos - offset;
+}
+
+/* Break a read or write request which is too large to send, or a
+ * write where zero detection found blocks of zeroes, into pieces
+ * which are queued in place of the user's command.  n and type
+ * describe the first piece, found by next_piece.  The user's command
+ * (the parent) is not sent, but completes when all of its pieces
+ * have, in complete_command in generator/states.c.
+ */
+static int
+split_command (struct nbd_handle *h, struct command *parent,
+               bool detect_zeroes, uint32_t n, uint16_t type)
+{
+  struct command *pieces = NULL, **tail = &pieces, *piece = NULL;
+  uint64_t offset = parent->offset;
+  uint32_t remaining = parent->count;
+
+  while (remaining > 0) {
+    if (offset > parent->offset)
+      n = next_piece (h, parent, detect_zeroes, offset, &type);
+
+
+    piece = nbd_internal_alloc_command (h);
+    if (piece == NULL) {
+      set_error (errno, "calloc");
+      goto err;
+    }
+    piece->flags = parent->flags;
+    if (type == NBD_CMD_WRITE)
+      piece->flags &= ~LIBNBD_CMD_FLAG_NO_HOLE;
+    piece->replay = parent->replay;
+    piece->write_behind = parent->write_behind;
+    piece->priority = parent->priority;
+    piece->type = type;
+    piece->cookie = h->unique++;
+    piece->offset = offset;
+    piece->count = n;
+    if (parent->data && type != NBD_CMD_WRITE_ZEROES)
+      piece->data = (char *) parent->data + (offset - parent->offset);
+    if (parent->iov) {
+      piece->iov = nbd_internal_iov_slice (parent->iov, parent->iovcnt,
+                                           offset - parent->offset, n,
+                                           &piece->iovcnt);
+      if (piece->iov == NULL) {
+        nbd_internal_free_command (h, piece);
+        goto err;
+      }
+    }
+    piece->has_fd = parent->has_fd;
+    piece->fd = parent->fd;
+    piece->fd_offset = parent->fd_offset + (offset - parent->offset);
+    piece->initialized = parent->initialized;
+    piece->parent = parent;
+    /* Pieces share the parent's chunk callback, but only the parent
+     * frees it.
+     */
+    if (parent->type == NBD_CMD_READ) {
+      piece->cb.fn.chunk = parent->cb.fn.chunk;
+      piece->cb.fn.chunk.free = NULL;
+    }
+    if (nbd_internal_cookie_table_insert (h, piece) == -1) {
+      set_error (errno, "calloc");
+      free (piece->iov);
+      nbd_internal_free_command (h, piece);
+      goto err;
+    }
+    *tail = piece;
+    tail = &piece->next;
+    parent->pieces++;
+
+    offset += n;
+    remaining -= n;
+  }
+
+  if (h->in_flight > INT_MAX - (int) parent->pieces) {
+    set_error (ENOMEM, "too many commands already in flight");
+    goto err;
+  }
+
+  debug (h, "splitting request into %" PRIu32 " pieces", parent->pieces);
+  parent->list = CMDS_SPLIT;
+  *tail = NULL;
+  queue_commands (h, pieces, piece, parent->pieces);
+  return 0;
+
+ err:
+  *tail = NULL;
+  while (pieces != NULL) {
+    piece = pieces;
+    pieces = piece->next;
+    nbd_internal_retire_and_free_command (h, piece);
+  }
+  parent->pieces = 0;
+  return -1;
+}
+
+/* Return a read on cmds_to_issue or cmds_in_flight whose buffer will
+ * hold the count bytes at offset when it succeeds, or NULL if there
+ * is none.  If prefetch_only is true, only reads ahead of a stream
+ * (see lib/read-ahead.c) are considered.  See nbd_set_dedupe_reads.
+ */
+static struct command *
+find_read (struct nbd_handle *h, uint64_t offset, uint64_t count,
+           bool prefetch_only)
+{
+  struct command *lists[] = { h->cmds_to_issue, h->cmds_in_flight };
+  struct command *cmd, *parent;
+  size_t i;
+
+  for (i = 0; i < sizeof lists / sizeof lists[0]; ++i) {
+    for (cmd = lists[i]; cmd != NULL; cmd = cmd->next) {
+      parent = cmd->parent ? cmd->parent : cmd;
+      if (cmd->type == NBD_CMD_READ && cmd->data != NULL &&
+          (!prefetch_only || cmd->prefetch) &&
+          CALLBACK_IS_NULL (parent->cb.sparse) &&
+          parent->dedupe_gen == h->dedupe_gen &&
+          cmd->offset <= offset &&
+          offset + count <= cmd->offset + cmd->count)
+        return cmd;
+    }
+  }
+  return NULL;
+}
+
+/* Send the reads which were waiting for cmd to the server, because
+ * cmd has been cancelled.
+ */
+void
+nbd_internal_detach_reads (struct nbd_handle *h, struct command *cmd)
+{
+  struct command *c, *last = NULL;
+  int n = 0;
+
+  for (c = cmd->attached; c != NULL; c = c->next) {
+    c->list = CMDS_TO_ISSUE;
+    last = c;
+    n++;
+  }
+  if (n > 0) {
+    debug (h, "sending %d reads which were waiting for a cancelled read", n);
+    queue_commands (h, cmd->attached, last, n);
+    cmd->attached = NULL;
+  }
+}
+
+/* Return the bytes counted by nbd_set_max_bytes_in_flight for cmd. */
+static uint64_t
+payload_bytes (const struct command *cmd)
+{
+  return cmd->type == NBD_CMD_READ || cmd->type == NBD_CMD_WRITE ?
+    cmd->count : 0;
+}
+
+/* As nbd_internal_command_common, but if iov is not NULL the payload
+ * of a read or write is scattered across or gathered from its
+ * buffers, and if fd is not -1 it is received into or sent from fd
+ * at fd_offset.
+ */
+static int64_t
+command_common (struct nbd_handle *h,
+                uint32_t flags, uint16_t type,
+                uint64_t offset, uint64_t count,
+                void *data, const struct iovec *iov, int iovcnt,
+                int fd, uint64_t fd_offset,
+                struct command_cb *cb)
+{
+  struct command *cmd, *holder;
+  bool split = false, detect_zeroes;
+  uint32_t n = 0;
+  uint16_t piece_type = type;
 
   if (h->disconnect_request) {
       set_error (EINVAL, "cannot request more commands after NBD_CMD_DISC");
@@ -182,45 +648,89 @@ nbd_internal_command_common (struct nbd_handle *h,
       set_error (ENOMEM, "too many commands already in flight");
       return -1;
   }
+  if (h->max_bytes_in_flight &&
+      (type == NBD_CMD_READ || type == NBD_CMD_WRITE) &&
+      h->bytes_in_flight > 0 &&
+      h->bytes_in_flight + count > h->max_bytes_in_flight) {
+    set_error (EAGAIN, "too many bytes in flight: %" PRIu64
+               " bytes of at most %" PRIu64,
+               h->bytes_in_flight, h->max_bytes_in_flight);
+    return -1;
+  }
 
   switch (type) {
-    /* Commands which send or receive data are limited to MAX_REQUEST_SIZE. */
+    /* Commands which send or receive data are limited to the maximum
+     * request size, see nbd_set_max_request_size, unless the caller
+     * asked for larger requests to be split.
+     */
   case NBD_CMD_READ:
   case NBD_CMD_WRITE:
-    if (count > MAX_REQUEST_SIZE) {
-      set_error (ERANGE, "request too large: maximum request size is %d",
-                 MAX_REQUEST_SIZE);
-      return -1;
+    if (count > nbd_internal_max_request_size (h)) {
+      if (h->split_requests && count <= UINT32_MAX)
+        split = true;
+      else {
+        set_error (ERANGE, "request too large: maximum request size is %"
+                   PRIu32, nbd_internal_max_request_size (h));
+        return -1;
+      }
     }
     break;
 
-    /* Other commands are currently limited by the 32 bit field in the
-     * command structure on the wire, but in future we hope to support
-     * 64 bit values here with a change to the NBD protocol which is
-     * being discussed upstream.
+    /* Other commands are limited by the 32 bit count in the request
+     * header, unless extended headers were negotiated, whose count is
+     * 64 bits.
      */
   default:
-    if (count > UINT32_MAX) {
-      set_error (ERANGE, "request too large: maximum request size is %" PRIu32,
-                 UINT32_MAX);
+    if (count > UINT32_MAX && !h->extended_headers) {
+      set_error (ERANGE, "request too large: maximum request size is %" PRIu32
+                 " without extended headers", UINT32_MAX);
       return -1;
     }
     break;
   }
 
-  cmd = calloc (1, sizeof *cmd);
+  cmd = nbd_internal_alloc_command (h);
   if (cmd == NULL) {
     set_error (errno, "calloc");
     return -1;
   }
-  cmd->flags = flags;
+  /* LIBNBD_CMD_FLAG_REPLAY, LIBNBD_CMD_FLAG_PRIORITY,
+   * LIBNBD_CMD_FLAG_COALESCE and CMD_FLAG_WRITE_BEHIND are not sent
+   * to the server.
+   */
+  cmd->flags = flags & ~(LIBNBD_CMD_FLAG_REPLAY | LIBNBD_CMD_FLAG_PRIORITY |
+                         LIBNBD_CMD_FLAG_COALESCE | CMD_FLAG_WRITE_BEHIND);
+  cmd->replay = (flags & LIBNBD_CMD_FLAG_REPLAY) != 0;
+  cmd->write_behind = (flags & CMD_FLAG_WRITE_BEHIND) != 0;
+  cmd->priority = (flags & LIBNBD_CMD_FLAG_PRIORITY) != 0;
+  cmd->coalesce = (flags & LIBNBD_CMD_FLAG_COALESCE) != 0;
   cmd->type = type;
   cmd->cookie = h->unique++;
   cmd->offset = offset;
   cmd->count = count;
   cmd->data = data;
+  if (iov) {
+    cmd->iov = nbd_internal_iov_slice (iov, iovcnt, 0, count, &cmd->iovcnt);
+    if (cmd->iov == NULL) {
+      nbd_internal_free_command (h, cmd);
+      return -1;
+    }
+  }
+  if (fd >= 0) {
+    cmd->has_fd = true;
+    cmd->fd = fd;
+    cmd->fd_offset = fd_offset;
+  }
   if (cb)
     cmd->cb = *cb;
+  cmd->issued_us = nbd_internal_stats_now ();
+
+  if (nbd_internal_cookie_table_insert (h, cmd) == -1) {
+    set_error (errno, "calloc");
+    free (cmd->iov);
+    nbd_internal_free_command (h, cmd);
+    return -1;
+  }
 
   /* If structured replies were negotiated then we trust the server to
    * send back sufficient data to cover the whole buffer.  It's tricky
@@ -228,37 +738,105 @@ nbd_internal_command_common (struct nbd_handle *h,
    * ahead of time which avoids any security problems.  I measured the
    * overhead of this and for non-TLS there is no measurable overhead
    * in the highly intensive loopback case.  For TLS we get a
-   * performance gain, go figure.
-   */
-  if (h->structured_replies && cmd->data && type == NBD_CMD_READ)
-    memset (cmd->data, 0, cmd->count);
-
-  /* Add the command to the end of the queue. Kick the state machine
-   * if there is no other command being processed, otherwise, it will
-   * be handled automatically on a future cycle around to READY.
-   * Beyond this point, we have to return a cookie to the user, since
-   * we are queuing the command, even if kicking the state machine
-   * detects a failure.  Not reporting a state machine failure here is
-   * okay - any caller of an async command will be calling more API to
-   * await results, and will eventually learn that the machine has
-   * moved on to DEAD at that time.
+   * performance gain, go figure.  With fast servers and large reads
+   * the extra pass over the buffer does show up, so the caller may
+   * turn this off, in which case REPLY.FINISH_COMMAND fails any read
+   * which the server's chunks did not completely cover.  The buffer
+   * of nbd_aio_pread_sparse is never zeroed, since holes must leave
+   * it untouched.
    */
-  h->in_flight++;
-  if (h->cmds_to_issue != NULL) {
-    assert (nbd_internal_is_state_processing (get_next_state (h)));
-    h->cmds_to_issue_tail = h->cmds_to_issue_tail->next = cmd;
+  if (h->structured_replies && type == NBD_CMD_READ &&
+      h->pread_initialize && (cmd->data || cmd->iov) &&
+      CALLBACK_IS_NULL (cmd->cb.sparse)) {
+    if (cmd->iov)
+      nbd_internal_iov_zero (cmd->iov, cmd->iovcnt, 0, cmd->count);
+    else
+      memset (cmd->data, 0, cmd->count);
+    cmd->initialized = true;
+  }
+
+  trace (h, TRACE_SUBMIT, type, cmd->cookie, offset, count, 0);
+  probe (submit, h->hname, cmd->cookie, type, offset, count);
+  command_event (h, cmd, LIBNBD_COMMAND_EVENT_QUEUED);
+  record_submit (h, cmd);
+
+  if (h->extent_cache) {
+    if (type == NBD_CMD_WRITE || type == NBD_CMD_TRIM ||
+        type == NBD_CMD_WRITE_ZEROES)
+      nbd_internal_extent_cache_invalidate (h, offset, count);
+    cmd->extent_cache_gen = h->extent_cache_gen;
+  }
+
+  /* Until the command completes, see nbd_set_max_bytes_in_flight. */
+  h->bytes_in_flight += payload_bytes (cmd);
+
+  /* See nbd_set_dedupe_reads. */
+  if (type == NBD_CMD_WRITE || type == NBD_CMD_TRIM ||
+      type == NBD_CMD_WRITE_ZEROES) {
+    h->dedupe_gen++;
+    if (h->shared_cache)
+      nbd_internal_shared_cache_invalidate (h, offset, count);
+  }
+  cmd->dedupe_gen = h->dedupe_gen;
+  if ((h->dedupe_reads || h->read_ahead || h->shared_cache) &&
+      type == NBD_CMD_READ && flags == 0 && data != NULL &&
+      CALLBACK_IS_NULL (cmd->cb.fn.chunk) &&
+      CALLBACK_IS_NULL (cmd->cb.sparse)) {
+    /* See nbd_set_shared_cache and nbd_set_read_ahead. */
+    if (h->shared_cache && nbd_internal_shared_cache_serve (h, cmd))
+      return cmd->cookie;
+    if (h->ra_pool != NULL && nbd_internal_read_ahead_serve (h, cmd))
+      return cmd->cookie;
+    holder = find_read (h, offset, count, !h->dedupe_reads);
+  }
+  else
+    holder = NULL;
+  if (holder != NULL) {
+    cmd->list = CMDS_ATTACHED;
+    cmd->next = holder->attached;
+    holder->attached = cmd;
+    return cmd->cookie;
+  }
+
+  /* See nbd_set_zero_detection. */
+  detect_zeroes = type == NBD_CMD_WRITE && data != NULL &&
+    h->zero_detection != 0 && count >= h->zero_detection &&
+    nbd_unlocked_can_zero (h) == 1;
+  if (split || detect_zeroes) {
+    n = next_piece (h, cmd, detect_zeroes, offset, &piece_type);
+    split = n < count || piece_type != type;
+  }
+  if (split) {
+    if (split_command (h, cmd, detect_zeroes, n, piece_type) == -1) {
+      h->bytes_in_flight -= payload_bytes (cmd);
+      nbd_internal_cookie_table_remove (h, cmd);
+      free (cmd->iov);
+      nbd_internal_free_command (h, cmd);
+      return -1;
+    }
   }
   else {
-    assert (h->cmds_to_issue_tail == NULL);
-    h->cmds_to_issue = h->cmds_to_issue_tail = cmd;
-    if (nbd_internal_is_state_ready (get_next_state (h)) &&
-        nbd_internal_run (h, cmd_issue) == -1)
-      debug (h, "command queued, ignoring state machine failure");
+    /* LIBNBD_CMD_FLAG_NO_HOLE only applies to the zero pieces of a
+     * write.
+     */
+    if (type == NBD_CMD_WRITE)
+      cmd->flags &= ~LIBNBD_CMD_FLAG_NO_HOLE;
+    queue_commands (h, cmd, cmd, 1);
   }
 
   return cmd->cookie;
 }
 
+int64_t
+nbd_internal_command_common (struct nbd_handle *h,
+                             uint32_t flags, uint16_t type,
+                             uint64_t offset, uint64_t count,
+                             void *data, struct command_cb *cb)
+{
+  return command_common (h, flags, type, offset, count, data, NULL, 0,
+                         -1, 0, cb);
+}
+
 int64_t
 nbd_unlocked_aio_pread (struct nbd_handle *h, void *buf,
                         size_t count, uint64_t offset,
@@ -266,18 +844,22 @@ nbd_unlocked_aio_pread (struct nbd_handle *h, void *buf,
                         uint32_t flags)
 {
   struct command_cb cb = { .completion = completion };
+  int64_t cookie;
 
   /* We could silently accept flag DF, but it really only makes sense
    * with callbacks, because otherwise there is no observable change
    * except that the server may fail where it would otherwise succeed.
    */
-  if (flags != 0) {
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
 
-  return nbd_internal_command_common (h, 0, NBD_CMD_READ, offset, count,
-                                      buf, &cb);
+  cookie = nbd_internal_command_common (h, flags, NBD_CMD_READ, offset, count,
+                                        buf, &cb);
+  if (cookie != -1 && h->read_ahead)
+    nbd_internal_read_ahead (h, offset, count);
+  return cookie;
 }
 
 int64_t
@@ -290,7 +872,7 @@ nbd_unlocked_aio_pread_structured (struct nbd_handle *h, void *buf,
   struct command_cb cb = { .fn.chunk = chunk,
                            .completion = completion };
 
-  if ((flags & ~LIBNBD_CMD_FLAG_DF) != 0) {
+  if ((flags & ~(LIBNBD_CMD_FLAG_DF | LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
@@ -305,20 +887,130 @@ nbd_unlocked_aio_pread_structured (struct nbd_handle *h, void *buf,
                                       buf, &cb);
 }
 
+int64_t
+nbd_unlocked_aio_pread_sparse (struct nbd_handle *h, void *buf,
+                               size_t count, uint64_t offset,
+                               nbd_extent_callback extent,
+                               nbd_completion_callback completion,
+                               uint32_t flags)
+{
+  struct command_cb cb = { .completion = completion,
+                           .sparse = extent };
+
+  if ((flags & ~(LIBNBD_CMD_FLAG_DF | LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if ((flags & LIBNBD_CMD_FLAG_DF) != 0 &&
+      nbd_unlocked_can_df (h) != 1) {
+    set_error (EINVAL, "server does not support the DF flag");
+    return -1;
+  }
+
+  return nbd_internal_command_common (h, flags, NBD_CMD_READ, offset, count,
+                                      buf, &cb);
+}
+
+static int64_t
+aio_pwrite (struct nbd_handle *h, const void *buf,
+            size_t count, uint64_t offset,
+            nbd_completion_callback completion,
+            uint32_t flags, bool write_behind)
+{
+  struct command_cb cb = { .completion = completion };
+
+  if (nbd_unlocked_is_read_only (h) == 1) {
+    set_error (EINVAL, "server does not support write operations");
+    return -1;
+  }
+
+  if ((flags & ~(LIBNBD_CMD_FLAG_FUA | LIBNBD_CMD_FLAG_REPLAY |
+                 LIBNBD_CMD_FLAG_NO_HOLE | LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if ((flags & LIBNBD_CMD_FLAG_FUA) != 0 &&
+      nbd_unlocked_can_fua (h) != 1) {
+    set_error (EINVAL, "server does not support the FUA flag");
+    return -1;
+  }
+
+  /* Writes with FUA are barriers, which use the caller's buffer. */
+  if (write_behind && (flags & LIBNBD_CMD_FLAG_FUA) == 0)
+    return nbd_internal_write_behind (h, buf, count, offset, completion,
+                                      flags);
+
+  return nbd_internal_command_common (h, flags, NBD_CMD_WRITE, offset, count,
+                                      (void *) buf, &cb);
+}
+
 int64_t
 nbd_unlocked_aio_pwrite (struct nbd_handle *h, const void *buf,
                          size_t count, uint64_t offset,
                          nbd_completion_callback completion,
                          uint32_t flags)
+{
+  return aio_pwrite (h, buf, count, offset, completion, flags,
+                     h->write_behind);
+}
+
+/* Check the local file range of nbd_aio_pread_to_fd and
+ * nbd_aio_pwrite_from_fd.
+ */
+static int
+check_fd_range (int fd, uint64_t fd_offset, uint64_t count)
+{
+  if (fd < 0) {
+    set_error (EBADF, "invalid file descriptor: %d", fd);
+    return -1;
+  }
+  if (fd_offset > INT64_MAX || count > INT64_MAX - fd_offset) {
+    set_error (EINVAL, "file offset out of range: %" PRIu64, fd_offset);
+    return -1;
+  }
+  return 0;
+}
+
+int64_t
+nbd_unlocked_aio_pread_to_fd (struct nbd_handle *h, int fd,
+                              uint64_t fd_offset, uint64_t count,
+                              uint64_t offset,
+                              nbd_completion_callback completion,
+                              uint32_t flags)
 {
   struct command_cb cb = { .completion = completion };
 
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if (check_fd_range (fd, fd_offset, count) == -1)
+    return -1;
+
+  return command_common (h, flags, NBD_CMD_READ, offset, count,
+                         NULL, NULL, 0, fd, fd_offset, &cb);
+}
+
+int64_t
+nbd_unlocked_aio_pwrite_from_fd (struct nbd_handle *h, int fd,
+                                 uint64_t fd_offset, uint64_t count,
+                                 uint64_t offset,
+                                 nbd_completion_callback completion,
+                                 uint32_t flags)
+{
+  struct command_cb cb = { .completion = completion };
+  struct stat statbuf;
+
   if (nbd_unlocked_is_read_only (h) == 1) {
     set_error (EINVAL, "server does not support write operations");
     return -1;
   }
 
-  if ((flags & ~LIBNBD_CMD_FLAG_FUA) != 0) {
+  if ((flags & ~(LIBNBD_CMD_FLAG_FUA | LIBNBD_CMD_FLAG_REPLAY |
+                 LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
@@ -329,8 +1021,27 @@ nbd_unlocked_aio_pwrite (struct nbd_handle *h, const void *buf,
     return -1;
   }
 
-  return nbd_internal_command_common (h, flags, NBD_CMD_WRITE, offset, count,
-                                      (void *) buf, &cb);
+  if (check_fd_range (fd, fd_offset, count) == -1)
+    return -1;
+
+  /* Once the request has been sent the payload must follow, so
+   * running out of data half way through would kill the connection.
+   * Catch the common case of a file which is too short here.
+   */
+  if (fstat (fd, &statbuf) == -1) {
+    set_error (errno, "fstat");
+    return -1;
+  }
+  if (S_ISREG (statbuf.st_mode) &&
+      fd_offset + count > (uint64_t) statbuf.st_size) {
+    set_error (EINVAL, "file is too short: size %" PRIi64
+               " is smaller than the end of the write %" PRIu64,
+               (int64_t) statbuf.st_size, fd_offset + count);
+    return -1;
+  }
+
+  return command_common (h, flags, NBD_CMD_WRITE, offset, count,
+                         NULL, NULL, 0, fd, fd_offset, &cb);
 }
 
 int64_t
@@ -345,12 +1056,12 @@ nbd_unlocked_aio_flush (struct nbd_handle *h,
     return -1;
   }
 
-  if (flags != 0) {
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
 
-  return nbd_internal_command_common (h, 0, NBD_CMD_FLUSH, 0, 0,
+  return nbd_internal_command_common (h, flags, NBD_CMD_FLUSH, 0, 0,
                                       NULL, &cb);
 }
 
@@ -367,7 +1078,8 @@ nbd_unlocked_aio_trim (struct nbd_handle *h,
     return -1;
   }
 
-  if ((flags & ~LIBNBD_CMD_FLAG_FUA) != 0) {
+  if ((flags & ~(LIBNBD_CMD_FLAG_FUA | LIBNBD_CMD_FLAG_REPLAY |
+                 LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
@@ -404,12 +1116,12 @@ nbd_unlocked_aio_cache (struct nbd_handle *h,
     return -1;
   }
 
-  if (flags != 0) {
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
 
-  return nbd_internal_command_common (h, 0, NBD_CMD_CACHE, offset, count,
+  return nbd_internal_command_common (h, flags, NBD_CMD_CACHE, offset, count,
                                       NULL, &cb);
 }
 
@@ -427,7 +1139,8 @@ nbd_unlocked_aio_zero (struct nbd_handle *h,
   }
 
   if ((flags & ~(LIBNBD_CMD_FLAG_FUA | LIBNBD_CMD_FLAG_NO_HOLE |
-                 LIBNBD_CMD_FLAG_FAST_ZERO)) != 0) {
+                 LIBNBD_CMD_FLAG_FAST_ZERO | LIBNBD_CMD_FLAG_REPLAY |
+                 LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
@@ -475,7 +1188,8 @@ nbd_unlocked_aio_block_status (struct nbd_handle *h,
     return -1;
   }
 
-  if ((flags & ~LIBNBD_CMD_FLAG_REQ_ONE) != 0) {
+  if ((flags & ~(LIBNBD_CMD_FLAG_REQ_ONE | LIBNBD_CMD_FLAG_PRIORITY |
+                 LIBNBD_CMD_FLAG_COALESCE)) != 0) {
     set_error (EINVAL, "invalid flag: %" PRIu32, flags);
     return -1;
   }
@@ -488,3 +1202,176 @@ nbd_unlocked_aio_block_status (struct nbd_handle *h,
   return nbd_internal_command_common (h, flags, NBD_CMD_BLOCK_STATUS, offset,
                                       count, NULL, &cb);
 }
+
+/* The scatter-gather calls below are only available from C, so they
+ * are written by hand instead of being generated.  They take the
+ * handle lock and check the state in the same way as the generated
+ * wrappers in lib/api.c.
+ */
+
+static int
+check_connected (struct nbd_handle *h)
+{
+  const enum state state = get_public_state (h);
+
+  if (!(nbd_internal_is_state_ready (state) ||
+        nbd_internal_is_state_processing (state) ||
+        (h->reconnecting && nbd_internal_is_state_connecting (state)))) {
+    set_error (nbd_internal_is_state_created (state) ? ENOTCONN : EINVAL,
+               "invalid state");
+    return -1;
+  }
+  return 0;
+}
+
+static void
+unlock_handle (struct nbd_handle *h)
+{
+  nbd_internal_update_public_state (h);
+  pthread_mutex_unlock (&h->lock);
+}
+
+/* Add up the lengths of the buffers in iov. */
+static int
+iov_count (const struct iovec *iov, int iovcnt, uint64_t *count)
+{
+  int i;
+
+  if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+    set_error (EINVAL, "invalid iovec array");
+    return -1;
+  }
+  *count = 0;
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > UINT64_MAX - *count) {
+      set_error (ERANGE, "request too large");
+      return -1;
+    }
+    *count += iov[i].iov_len;
+  }
+  return 0;
+}
+
+static int64_t
+aio_preadv (struct nbd_handle *h, const struct iovec *iov, int iovcnt,
+            uint64_t offset, nbd_completion_callback completion,
+            uint32_t flags)
+{
+  struct command_cb cb = { .completion = completion };
+  uint64_t count;
+
+  if (check_connected (h) == -1)
+    return -1;
+
+  if ((flags & ~LIBNBD_CMD_FLAG_PRIORITY) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if (iov_count (iov, iovcnt, &count) == -1)
+    return -1;
+
+  return command_common (h, flags, NBD_CMD_READ, offset, count,
+                         NULL, iov, iovcnt, -1, 0, &cb);
+}
+
+static int64_t
+aio_pwritev (struct nbd_handle *h, const struct iovec *iov, int iovcnt,
+             uint64_t offset, nbd_completion_callback completion,
+             uint32_t flags)
+{
+  struct command_cb cb = { .completion = completion };
+  uint64_t count;
+
+  if (check_connected (h) == -1)
+    return -1;
+
+  if (nbd_unlocked_is_read_only (h) == 1) {
+    set_error (EINVAL, "server does not support write operations");
+    return -1;
+  }
+
+  if ((flags & ~(LIBNBD_CMD_FLAG_FUA | LIBNBD_CMD_FLAG_REPLAY |
+                 LIBNBD_CMD_FLAG_PRIORITY)) != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if ((flags & LIBNBD_CMD_FLAG_FUA) != 0 &&
+      nbd_unlocked_can_fua (h) != 1) {
+    set_error (EINVAL, "server does not support the FUA flag");
+    return -1;
+  }
+
+  if (iov_count (iov, iovcnt, &count) == -1)
+    return -1;
+
+  return command_common (h, flags, NBD_CMD_WRITE, offset, count,
+                         NULL, iov, iovcnt, -1, 0, &cb);
+}
+
+int
+nbd_preadv (struct nbd_handle *h, const struct iovec *iov, int iovcnt,
+            uint64_t offset, uint32_t flags)
+{
+  int64_t cookie = -1;
+  uint64_t count;
+  int ret = -1;
+
+  nbd_internal_set_error_context ("nbd_preadv");
+  pthread_mutex_lock (&h->lock);
+  if (iov_count (iov, iovcnt, &count) == 0 &&
+      wait_for_bytes_in_flight (h, count) == 0)
+    cookie = aio_preadv (h, iov, iovcnt, offset, NBD_NULL_COMPLETION, flags);
+  if (cookie != -1)
+    ret = wait_for_command (h, cookie);
+  unlock_handle (h);
+  return ret;
+}
+
+int
+nbd_pwritev (struct nbd_handle *h, const struct iovec *iov, int iovcnt,
+             uint64_t offset, uint32_t flags)
+{
+  int64_t cookie = -1;
+  uint64_t count;
+  int ret = -1;
+
+  nbd_internal_set_error_context ("nbd_pwritev");
+  pthread_mutex_lock (&h->lock);
+  if (iov_count (iov, iovcnt, &count) == 0 &&
+      wait_for_bytes_in_flight (h, count) == 0)
+    cookie = aio_pwritev (h, iov, iovcnt, offset, NBD_NULL_COMPLETION, flags);
+  if (cookie != -1)
+    ret = wait_for_command (h, cookie);
+  unlock_handle (h);
+  return ret;
+}
+
+int64_t
+nbd_aio_preadv (struct nbd_handle *h, const struct iovec *iov, int iovcnt,
+                uint64_t offset, nbd_completion_callback completion,
+                uint32_t flags)
+{
+  int64_t ret;
+
+  nbd_internal_set_error_context ("nbd_aio_preadv");
+  pthread_mutex_lock (&h->lock);
+  ret = aio_preadv (h, iov, iovcnt, offset, completion, flags);
+  unlock_handle (h);
+  return ret;
+}
+
+int64_t
+nbd_aio_pwritev (struct nbd_handle *h, const struct iovec *iov, int iovcnt,
+                 uint64_t offset, nbd_completion_callback completion,
+                 uint32_t flags)
+{
+  int64_t ret;
+
+  nbd_internal_set_error_context ("nbd_aio_pwritev");
+  pthread_mutex_lock (&h->lock);
+  ret = aio_pwritev (h, iov, iovcnt, offset, completion, flags);
+  unlock_handle (h);
+  return ret;
+}
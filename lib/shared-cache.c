@@ -0,0 +1,471 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The block cache shared by all handles in the process, see
+ * nbd_set_shared_cache.
+ *
+ * Blocks of SHARED_CACHE_BLOCK bytes are keyed by the export they
+ * came from and their index in it.  An export is identified by a
+ * struct shared_cache_key, made from the server the handle connected
+ * to and the export name.  Keys are never freed, so a handle can keep
+ * a pointer to its key and blocks can be compared by key pointer.
+ *
+ * The blocks are spread over SHARED_CACHE_SHARDS shards by hash, each
+ * with its own lock, hash table and least recently used list, so that
+ * handles in different threads rarely wait for each other.  Each shard
+ * holds at most its part of the size set by nbd_shared_cache_set_size.
+ *
+ * A read may be answered from the cache when every block it touches
+ * is there.  A read which is sent to the server adds the whole blocks
+ * it covers when it succeeds, unless the export was changed (as far as
+ * this process knows) while it was in flight: every invalidation bumps
+ * the generation of the key, and a read records it when issued.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "internal.h"
+
+struct shared_cache_key {
+  struct shared_cache_key *next;
+  _Atomic uint64_t gen;         /* Bumped by each invalidation. */
+  char name[];                  /* Server and export name. */
+};
+
+struct cache_block {
+  struct cache_block *hnext;    /* Hash chain. */
+  struct cache_block *prev, *next; /* LRU list, most recent first. */
+  const struct shared_cache_key *key;
+  uint64_t index;               /* Offset / SHARED_CACHE_BLOCK. */
+  char data[SHARED_CACHE_BLOCK];
+};
+
+struct shard {
+  pthread_mutex_t lock;
+  struct cache_block *buckets[SHARED_CACHE_BUCKETS];
+  struct cache_block *lru, *lru_tail;
+  size_t nr_blocks;
+};
+
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static struct shard shards[SHARED_CACHE_SHARDS];
+static _Atomic size_t total_blocks; /* Sum of nr_blocks of every shard. */
+static _Atomic uint64_t cache_size = DEFAULT_SHARED_CACHE_SIZE;
+
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_cache_key *keys;
+
+static void
+init_shards (void)
+{
+  size_t i;
+
+  for (i = 0; i < SHARED_CACHE_SHARDS; ++i)
+    pthread_mutex_init (&shards[i].lock, NULL);
+}
+
+static uint64_t
+hash (const struct shared_cache_key *key, uint64_t index)
+{
+  uint64_t x = (uintptr_t) key ^ (index * UINT64_C (0x9e3779b97f4a7c15));
+
+  x ^= x >> 31;
+  x *= UINT64_C (0xbf58476d1ce4e5b9);
+  return x ^ (x >> 29);
+}
+
+static struct shard *
+shard_of (const struct shared_cache_key *key, uint64_t index)
+{
+  return &shards[hash (key, index) % SHARED_CACHE_SHARDS];
+}
+
+static struct cache_block **
+bucket_of (struct shard *s, const struct shared_cache_key *key,
+           uint64_t index)
+{
+  return &s->buckets[(hash (key, index) / SHARED_CACHE_SHARDS) %
+                     SHARED_CACHE_BUCKETS];
+}
+
+/* The most blocks one shard may hold. */
+static size_t
+shard_capacity (void)
+{
+  uint64_t blocks = cache_size / SHARED_CACHE_BLOCK;
+
+  return (blocks + SHARED_CACHE_SHARDS - 1) / SHARED_CACHE_SHARDS;
+}
+
+/* These must be called with the shard locked. */
+static struct cache_block *
+find_block (struct shard *s, const struct shared_cache_key *key,
+            uint64_t index)
+{
+  struct cache_block *b;
+
+  for (b = *bucket_of (s, key, index); b != NULL; b = b->hnext)
+    if (b->key == key && b->index == index)
+      return b;
+  return NULL;
+}
+
+static void
+lru_unlink (struct shard *s, struct cache_block *b)
+{
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    s->lru = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  else
+    s->lru_tail = b->prev;
+}
+
+static void
+lru_push (struct shard *s, struct cache_block *b)
+{
+  b->prev = NULL;
+  b->next = s->lru;
+  if (s->lru)
+    s->lru->prev = b;
+  else
+    s->lru_tail = b;
+  s->lru = b;
+}
+
+static void
+remove_block (struct shard *s, struct cache_block *b)
+{
+  struct cache_block **bp;
+
+  for (bp = bucket_of (s, b->key, b->index); *bp != b; bp = &(*bp)->hnext)
+    ;
+  *bp = b->hnext;
+  lru_unlink (s, b);
+  s->nr_blocks--;
+  total_blocks--;
+  free (b);
+}
+
+static void
+shrink_shard (struct shard *s, size_t capacity)
+{
+  while (s->nr_blocks > capacity)
+    remove_block (s, s->lru_tail);
+}
+
+/* Return a string identifying the server h is connected to, or NULL
+ * if it cannot be identified, such as when the caller passed in a
+ * connected socket.
+ */
+static char *
+server_identity (struct nbd_handle *h)
+{
+  char *ret = NULL;
+  size_t len, i, j;
+  const unsigned char *addr;
+
+  if (h->hostname) {
+    if (asprintf (&ret, "tcp:%s:%s", h->hostname,
+                  h->port ? h->port : "") == -1)
+      return NULL;
+  }
+  else if (h->argv) {
+    for (len = 8, i = 0; h->argv[i] != NULL; ++i)
+      len += strlen (h->argv[i]) + 1;
+    ret = malloc (len);
+    if (ret == NULL)
+      return NULL;
+    strcpy (ret, "command:");
+    for (i = 0; h->argv[i] != NULL; ++i) {
+      strcat (ret, h->argv[i]);
+      if (h->argv[i+1] != NULL)
+        strcat (ret, " ");
+    }
+  }
+  else if (h->connaddrlen > 0) {
+    addr = (const unsigned char *) &h->connaddr;
+    ret = malloc (5 + 2 * h->connaddrlen + 1);
+    if (ret == NULL)
+      return NULL;
+    strcpy (ret, "addr:");
+    for (i = 0, j = 5; i < h->connaddrlen; ++i, j += 2)
+      sprintf (&ret[j], "%02x", addr[i]);
+  }
+  return ret;
+}
+
+/* Return the key of the export h is connected to, or NULL if its
+ * blocks cannot be cached.
+ */
+static struct shared_cache_key *
+key_of (struct nbd_handle *h)
+{
+  struct shared_cache_key *key;
+  char *server;
+  size_t len;
+
+  if (h->shared_cache_key)
+    return h->shared_cache_key;
+
+  server = server_identity (h);
+  if (server == NULL)
+    return NULL;
+  len = strlen (server) + 1 + strlen (h->export_name) + 1;
+
+  pthread_mutex_lock (&keys_lock);
+  for (key = keys; key != NULL; key = key->next) {
+    if (strcmp (key->name, server) == 0 &&
+        strcmp (key->name + strlen (server) + 1, h->export_name) == 0)
+      break;
+  }
+  if (key == NULL) {
+    key = malloc (sizeof *key + len);
+    if (key != NULL) {
+      key->gen = 0;
+      strcpy (key->name, server);
+      strcpy (key->name + strlen (server) + 1, h->export_name);
+      key->next = keys;
+      keys = key;
+    }
+  }
+  pthread_mutex_unlock (&keys_lock);
+  free (server);
+
+  h->shared_cache_key = key;
+  return key;
+}
+
+/* Drop the blocks of key which overlap count bytes at offset. */
+static void
+invalidate (struct shared_cache_key *key, uint64_t offset, uint64_t count)
+{
+  uint64_t first, last, index;
+  struct cache_block *b, *next;
+  struct shard *s;
+  size_t i;
+
+  if (count == 0)
+    return;
+  /* This must happen before taking any shard lock, see
+   * nbd_internal_shared_cache_fill.
+   */
+  key->gen++;
+  first = offset / SHARED_CACHE_BLOCK;
+  last = (offset + count - 1) / SHARED_CACHE_BLOCK;
+
+  /* Look up each block if that is quicker than going through every
+   * block cached.
+   */
+  if (last - first < total_blocks) {
+    for (index = first; index <= last; ++index) {
+      s = shard_of (key, index);
+      pthread_mutex_lock (&s->lock);
+      b = find_block (s, key, index);
+      if (b)
+        remove_block (s, b);
+      pthread_mutex_unlock (&s->lock);
+    }
+    return;
+  }
+
+  for (i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+    s = &shards[i];
+    pthread_mutex_lock (&s->lock);
+    for (b = s->lru; b != NULL; b = next) {
+      next = b->next;
+      if (b->key == key && b->index >= first && b->index <= last)
+        remove_block (s, b);
+    }
+    pthread_mutex_unlock (&s->lock);
+  }
+}
+
+int
+nbd_unlocked_set_shared_cache (struct nbd_handle *h, bool enable)
+{
+  pthread_once (&shards_once, init_shards);
+  h->shared_cache = enable;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_shared_cache (struct nbd_handle *h)
+{
+  return h->shared_cache;
+}
+
+int
+nbd_unlocked_shared_cache_invalidate (struct nbd_handle *h,
+                                      uint64_t count, uint64_t offset)
+{
+  struct shared_cache_key *key;
+
+  pthread_once (&shards_once, init_shards);
+  key = key_of (h);
+  if (key)
+    invalidate (key, offset, count);
+  return 0;
+}
+
+int
+nbd_shared_cache_set_size (uint64_t size)
+{
+  size_t i, capacity;
+
+  pthread_once (&shards_once, init_shards);
+  cache_size = size;
+  capacity = shard_capacity ();
+  for (i = 0; i < SHARED_CACHE_SHARDS; ++i) {
+    pthread_mutex_lock (&shards[i].lock);
+    shrink_shard (&shards[i], capacity);
+    pthread_mutex_unlock (&shards[i].lock);
+  }
+  return 0;
+}
+
+uint64_t
+nbd_shared_cache_get_size (void)
+{
+  return cache_size;
+}
+
+/* Called for each read which may use the cache.  If every block it
+ * touches is cached, copy them into its buffer, complete it and
+ * return true.  Otherwise note that its data should be added to the
+ * cache when it succeeds.
+ */
+bool
+nbd_internal_shared_cache_serve (struct nbd_handle *h, struct command *cmd)
+{
+  struct shared_cache_key *key;
+  uint64_t offset, end, index, n, skip;
+  struct cache_block *b;
+  struct shard *s;
+
+  if (cmd->count == 0 || (key = key_of (h)) == NULL)
+    return false;
+  cmd->shared_cache = true;
+  cmd->shared_cache_gen = key->gen;
+  if (nbd_unlocked_is_read_only (h) != 1)
+    return false;
+
+  end = cmd->offset + cmd->count;
+  for (offset = cmd->offset; offset < end; offset += n) {
+    index = offset / SHARED_CACHE_BLOCK;
+    skip = offset % SHARED_CACHE_BLOCK;
+    n = SHARED_CACHE_BLOCK - skip;
+    if (n > end - offset)
+      n = end - offset;
+    s = shard_of (key, index);
+    pthread_mutex_lock (&s->lock);
+    b = find_block (s, key, index);
+    if (b) {
+      memcpy ((char *) cmd->data + (offset - cmd->offset), b->data + skip, n);
+      lru_unlink (s, b);
+      lru_push (s, b);
+    }
+    pthread_mutex_unlock (&s->lock);
+    if (b == NULL)
+      return false;
+  }
+
+  cmd->shared_cache = false;
+  cmd->data_seen = cmd->count;
+  nbd_internal_complete_unsent_command (h, cmd);
+  return true;
+}
+
+/* Called when a read noted by nbd_internal_shared_cache_serve has
+ * succeeded, to add the whole blocks in its buffer to the cache.
+ */
+void
+nbd_internal_shared_cache_fill (struct nbd_handle *h, struct command *cmd)
+{
+  struct shared_cache_key *key = h->shared_cache_key;
+  uint64_t index, last, capacity;
+  struct cache_block *b;
+  struct shard *s;
+
+  if (key == NULL || key->gen != cmd->shared_cache_gen)
+    return;
+  capacity = shard_capacity ();
+  if (capacity == 0 || cmd->count < SHARED_CACHE_BLOCK)
+    return;
+
+  index = (cmd->offset + SHARED_CACHE_BLOCK - 1) / SHARED_CACHE_BLOCK;
+  last = (cmd->offset + cmd->count) / SHARED_CACHE_BLOCK;
+  for (; index < last; ++index) {
+    s = shard_of (key, index);
+    pthread_mutex_lock (&s->lock);
+    /* A write may have been issued since the check above.  Because
+     * invalidate bumps the generation before taking the lock, either
+     * we see it here or it removes this block after we unlock.
+     */
+    if (key->gen != cmd->shared_cache_gen) {
+      pthread_mutex_unlock (&s->lock);
+      return;
+    }
+    b = find_block (s, key, index);
+    if (b)
+      lru_unlink (s, b);
+    else {
+      b = malloc (sizeof *b);
+      if (b == NULL) {
+        pthread_mutex_unlock (&s->lock);
+        return;
+      }
+      b->key = key;
+      b->index = index;
+      b->hnext = *bucket_of (s, key, index);
+      *bucket_of (s, key, index) = b;
+      s->nr_blocks++;
+      total_blocks++;
+    }
+    memcpy (b->data,
+            (char *) cmd->data + (index * SHARED_CACHE_BLOCK - cmd->offset),
+            SHARED_CACHE_BLOCK);
+    lru_push (s, b);
+    shrink_shard (s, capacity);
+    pthread_mutex_unlock (&s->lock);
+  }
+}
+
+/* Called when a command which changes count bytes at offset is
+ * issued, and again when it completes.
+ */
+void
+nbd_internal_shared_cache_invalidate (struct nbd_handle *h,
+                                      uint64_t offset, uint64_t count)
+{
+  struct shared_cache_key *key = key_of (h);
+
+  if (key)
+    invalidate (key, offset, count);
+}
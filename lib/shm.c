@@ -0,0 +1,431 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Shared memory transport for servers on the same machine, see
+ * nbd_set_shared_memory_size.
+ *
+ * The client creates a memfd holding struct nbd_shm_header and two
+ * rings (see lib/nbd-protocol.h), and offers it to the server with
+ * NBD_OPT_SHARED_MEMORY, passing the memfd with SCM_RIGHTS.  If the
+ * server replies NBD_REP_ACK, every later byte of the connection,
+ * starting with the next option, goes through the rings instead of
+ * the Unix socket.  A server which does not know the option replies
+ * with an error and the kernel closes the memfd it was passed.
+ *
+ * Each ring is a byte stream, so the state machine is unchanged and
+ * sees an ordinary socket.  The writer copies data in at head and
+ * then advances head, the reader copies data out at tail and then
+ * advances tail.  The Unix socket is kept as the doorbell: a side
+ * which finds nothing to read or no room to write sets its *_waiting
+ * flag and waits for the socket to become readable, and the other
+ * side sends a byte on the socket when it next moves head or tail
+ * and finds the flag set.  Using the socket for this rather than
+ * eventfds means that a server which exits is seen as a hangup, as
+ * with any other transport.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#include "internal.h"
+
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+#ifdef HAVE_MEMFD_CREATE
+
+static size_t
+map_size (uint64_t ring_size)
+{
+  return NBD_SHM_DATA_OFFSET + 2 * ring_size;
+}
+
+/* Read the doorbells which the server has sent.  Returns 0 if the
+ * server has closed the socket, else 1, or -1 on error.
+ */
+static int
+drain_doorbell (struct socket *sock)
+{
+  int fd = sock->u.shm.oldsock->ops->get_fd (sock->u.shm.oldsock);
+  char buf[64];
+  ssize_t r;
+
+  for (;;) {
+    r = recv (fd, buf, sizeof buf, MSG_DONTWAIT);
+    if (r == 0)
+      return 0;
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      if (errno == EINTR)
+        continue;
+      set_error (errno, "recv");
+      return -1;
+    }
+  }
+}
+
+/* Called after moving head or tail, in case the server is waiting
+ * for that.  If the socket is full the server has doorbells to read
+ * anyway, so a failed send does not matter.
+ */
+static void
+ring_server (struct socket *sock)
+{
+  struct nbd_shm_header *hdr = sock->u.shm.map;
+  int fd;
+  char c = 0;
+
+  if (__atomic_exchange_n (&hdr->server_waiting, 0, __ATOMIC_SEQ_CST)) {
+    fd = sock->u.shm.oldsock->ops->get_fd (sock->u.shm.oldsock);
+    if (send (fd, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+      /* ignored */
+    }
+  }
+}
+
+/* Return the number of bytes in ring, which the server must not be
+ * able to make larger than the ring.
+ */
+static int64_t
+ring_used (struct socket *sock, struct nbd_shm_ring *ring)
+{
+  uint64_t used;
+
+  used = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) -
+    __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+  if (used > sock->u.shm.ring_size) {
+    set_error (EPROTO, "server corrupted the shared memory ring");
+    return -1;
+  }
+  return used;
+}
+
+/* If there is nothing to read, ask for a doorbell before the state
+ * machine waits for the socket.
+ */
+static bool
+shm_pending (struct socket *sock)
+{
+  struct nbd_shm_header *hdr = sock->u.shm.map;
+  struct nbd_shm_ring *ring = &hdr->to_client;
+
+  if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) !=
+      __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST))
+    return true;
+  __atomic_store_n (&hdr->client_waiting, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) !=
+    __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+}
+
+static ssize_t
+shm_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
+{
+  struct nbd_shm_header *hdr = sock->u.shm.map;
+  struct nbd_shm_ring *ring = &hdr->to_client;
+  const uint64_t size = sock->u.shm.ring_size;
+  const char *data;
+  uint64_t tail, pos;
+  int64_t used;
+  size_t n;
+
+  used = ring_used (sock, ring);
+  if (used == 0) {
+    switch (drain_doorbell (sock)) {
+    case -1: return -1;
+    case 0:
+      /* The server may have written a last reply before exiting. */
+      used = ring_used (sock, ring);
+      if (used == 0)
+        return 0;
+      break;
+    default:
+      if (!shm_pending (sock)) {
+        errno = EAGAIN;
+        return -1;
+      }
+      used = ring_used (sock, ring);
+    }
+  }
+  if (used == -1)
+    return -1;
+
+  if (len > (uint64_t) used)
+    len = used;
+  data = (const char *) hdr + NBD_SHM_DATA_OFFSET + size;
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+  pos = tail & (size - 1);
+  n = MIN (len, size - pos);
+  memcpy (buf, data + pos, n);
+  memcpy ((char *) buf + n, data, len - n);
+  __atomic_store_n (&ring->tail, tail + len, __ATOMIC_SEQ_CST);
+  ring_server (sock);
+  return len;
+}
+
+/* Sending never returns EAGAIN just because the ring is full, since
+ * the socket is always writable so poll would not wait.  Instead,
+ * replies are read first if there are any (see
+ * ISSUE_COMMAND.SEND_REQUEST), and otherwise this waits for the
+ * server to make room.
+ */
+static ssize_t
+shm_send (struct nbd_handle *h, struct socket *sock,
+          const void *buf, size_t len, int flags)
+{
+  struct nbd_shm_header *hdr = sock->u.shm.map;
+  struct nbd_shm_ring *ring = &hdr->to_server;
+  const uint64_t size = sock->u.shm.ring_size;
+  int fd = sock->u.shm.oldsock->ops->get_fd (sock->u.shm.oldsock);
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  char *data;
+  uint64_t head, pos;
+  int64_t used;
+  size_t n;
+
+  for (;;) {
+    used = ring_used (sock, ring);
+    if (used == -1)
+      return -1;
+    if ((uint64_t) used < size)
+      break;
+    if (shm_pending (sock)) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (ring_used (sock, ring) < (int64_t) size)
+      continue;
+    if (poll (&pfd, 1, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      set_error (errno, "poll");
+      return -1;
+    }
+    switch (drain_doorbell (sock)) {
+    case -1: return -1;
+    case 0:
+      set_error (EPIPE, "server closed the shared memory connection");
+      return -1;
+    }
+  }
+
+  if (len > size - used)
+    len = size - used;
+  data = (char *) hdr + NBD_SHM_DATA_OFFSET;
+  head = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST);
+  pos = head & (size - 1);
+  n = MIN (len, size - pos);
+  memcpy (data + pos, buf, n);
+  memcpy (data, (const char *) buf + n, len - n);
+  __atomic_store_n (&ring->head, head + len, __ATOMIC_SEQ_CST);
+  ring_server (sock);
+  return len;
+}
+
+static int
+shm_get_fd (struct socket *sock)
+{
+  return sock->u.shm.oldsock->ops->get_fd (sock->u.shm.oldsock);
+}
+
+static int
+shm_close (struct socket *sock)
+{
+  int r;
+
+  r = sock->u.shm.oldsock->ops->close (sock->u.shm.oldsock);
+  munmap (sock->u.shm.map, map_size (sock->u.shm.ring_size));
+  free (sock);
+  return r;
+}
+
+static struct socket_ops shm_ops = {
+  .recv = shm_recv,
+  .send = shm_send,
+  .pending = shm_pending,
+  .get_fd = shm_get_fd,
+  .close = shm_close,
+};
+
+/* Create the shared memory to offer to the server.  Returns false if
+ * the transport cannot be used on this connection, which is not an
+ * error since the handshake just carries on over the socket.
+ */
+bool
+nbd_internal_shm_prepare (struct nbd_handle *h)
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen = sizeof ss;
+  struct nbd_shm_header *hdr;
+  void *map;
+
+  nbd_internal_shm_discard (h);
+
+  if (getsockname (h->sock->ops->get_fd (h->sock),
+                   (struct sockaddr *) &ss, &sslen) == -1 ||
+      ss.ss_family != AF_UNIX) {
+    debug (h, "shared memory transport needs a Unix domain socket");
+    return false;
+  }
+
+  h->shm_fd = memfd_create ("libnbd-shm", MFD_CLOEXEC);
+  if (h->shm_fd == -1) {
+    debug (h, "shared memory transport: memfd_create: %s", strerror (errno));
+    return false;
+  }
+  if (ftruncate (h->shm_fd, map_size (h->shm_size)) == -1) {
+    debug (h, "shared memory transport: ftruncate: %s", strerror (errno));
+    nbd_internal_shm_discard (h);
+    return false;
+  }
+  map = mmap (NULL, map_size (h->shm_size), PROT_READ | PROT_WRITE,
+              MAP_SHARED, h->shm_fd, 0);
+  if (map == MAP_FAILED) {
+    debug (h, "shared memory transport: mmap: %s", strerror (errno));
+    nbd_internal_shm_discard (h);
+    return false;
+  }
+  h->shm_map = map;
+
+  /* The rest of the memfd is already zero. */
+  hdr = map;
+  hdr->magic = NBD_SHM_MAGIC;
+  hdr->ring_size = h->shm_size;
+  return true;
+}
+
+/* Send the NBD_OPT_SHARED_MEMORY option in h->wbuf with the memfd
+ * attached.  Returns as send_from_wbuf, except that any remaining
+ * bytes are left for send_from_wbuf to send once the memfd has gone.
+ */
+int
+nbd_internal_shm_send_fd (struct nbd_handle *h)
+{
+  struct iovec iov = { .iov_base = (void *) h->wbuf, .iov_len = h->wlen };
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE (sizeof (int))];
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = control.buf, .msg_controllen = sizeof control.buf,
+  };
+  struct cmsghdr *cmsg;
+  ssize_t r;
+
+  memset (&control, 0, sizeof control);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &h->shm_fd, sizeof (int));
+
+  r = sendmsg (h->sock->ops->get_fd (h->sock), &msg, MSG_NOSIGNAL);
+  if (r == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 1;
+    set_error (errno, "sendmsg");
+    return -1;
+  }
+
+  /* The mapping stays after the memfd is closed. */
+  close (h->shm_fd);
+  h->shm_fd = -1;
+  h->stats.bytes_sent += r;
+  h->wbuf += r;
+  h->wlen -= r;
+  return h->wlen > 0;
+}
+
+/* The server agreed, so send and receive through the rings from now
+ * on.
+ */
+int
+nbd_internal_shm_start (struct nbd_handle *h)
+{
+  struct socket *sock;
+
+  sock = malloc (sizeof *sock);
+  if (sock == NULL) {
+    set_error (errno, "malloc");
+    return -1;
+  }
+  sock->u.shm.map = h->shm_map;
+  sock->u.shm.ring_size = h->shm_size;
+  sock->u.shm.oldsock = h->sock;
+  sock->ops = &shm_ops;
+  h->sock = sock;
+  h->shm_map = NULL;
+  h->shm_negotiated = true;
+  return 0;
+}
+
+/* Free the shared memory if it was not used. */
+void
+nbd_internal_shm_discard (struct nbd_handle *h)
+{
+  if (h->shm_fd >= 0) {
+    close (h->shm_fd);
+    h->shm_fd = -1;
+  }
+  if (h->shm_map) {
+    munmap (h->shm_map, map_size (h->shm_size));
+    h->shm_map = NULL;
+  }
+}
+
+#else /* !HAVE_MEMFD_CREATE */
+
+bool
+nbd_internal_shm_prepare (struct nbd_handle *h)
+{
+  debug (h, "shared memory transport is not supported on this platform");
+  return false;
+}
+
+int
+nbd_internal_shm_send_fd (struct nbd_handle *h)
+{
+  abort ();
+}
+
+int
+nbd_internal_shm_start (struct nbd_handle *h)
+{
+  abort ();
+}
+
+void
+nbd_internal_shm_discard (struct nbd_handle *h)
+{
+}
+
+#endif /* !HAVE_MEMFD_CREATE */
@@ -22,13 +22,46 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include "internal.h"
 
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && \
+  defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define USE_ZEROCOPY 1
+#endif
+
+#if defined(HAVE_SPLICE) && defined(HAVE_PIPE2) && defined(SPLICE_F_NONBLOCK)
+#define USE_SPLICE 1
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#define USE_SENDFILE 1
+#endif
+
+/* Size requested for the pipe used by socket_splice_to.  The kernel
+ * may refuse, in which case the default (usually 64K) is used.
+ */
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
 static ssize_t
 socket_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
 {
@@ -40,6 +73,22 @@ socket_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
   return r;
 }
 
+static ssize_t
+socket_recv_iov (struct nbd_handle *h, struct socket *sock,
+                 const struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg = {
+    .msg_iov = (struct iovec *) iov,
+    .msg_iovlen = iovcnt,
+  };
+  ssize_t r;
+
+  r = recvmsg (sock->u.fd, &msg, 0);
+  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    set_error (errno, "recvmsg");
+  return r;
+}
+
 static ssize_t
 socket_send (struct nbd_handle *h,
              struct socket *sock, const void *buf, size_t len, int flags)
@@ -52,11 +101,264 @@ socket_send (struct nbd_handle *h,
   flags |= MSG_NOSIGNAL;
 
   r = send (sock->u.fd, buf, len, flags);
-  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+  /* On ENOBUFS, a zero-copy send is retried by the caller without
+   * MSG_ZEROCOPY, so it is not an error.
+   */
+  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+      !(errno == ENOBUFS && (flags & MSG_ZEROCOPY) != 0))
     set_error (errno, "send");
   return r;
 }
 
+static ssize_t
+socket_send_iov (struct nbd_handle *h, struct socket *sock,
+                 const struct iovec *iov, int iovcnt, int flags)
+{
+  struct msghdr msg = {
+    .msg_iov = (struct iovec *) iov,
+    .msg_iovlen = iovcnt,
+  };
+  ssize_t r;
+
+  flags |= MSG_NOSIGNAL;
+
+  r = sendmsg (sock->u.fd, &msg, flags);
+  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    set_error (errno, "sendmsg");
+  return r;
+}
+
+#ifdef USE_ZEROCOPY
+static bool
+socket_enable_zerocopy (struct nbd_handle *h, struct socket *sock)
+{
+  int one = 1;
+
+  /* This fails with EOPNOTSUPP for anything except TCP sockets. */
+  if (setsockopt (sock->u.fd, SOL_SOCKET, SO_ZEROCOPY,
+                  &one, sizeof one) == -1) {
+    debug (h, "zero-copy sends are not available: setsockopt: SO_ZEROCOPY: "
+           "%s", strerror (errno));
+    return false;
+  }
+  return true;
+}
+
+struct zerocopy_range {
+  uint32_t lo, hi;
+};
+
+/* Record that zero-copy sends lo to hi (inclusive) were released.
+ * The kernel does not promise to report the ranges in order, so a
+ * range which starts after *done is kept in h->zerocopy_ranges until
+ * the sends before it have been released too.
+ */
+static int
+zerocopy_released (struct nbd_handle *h, uint32_t lo, uint32_t hi,
+                   uint32_t *done)
+{
+  struct zerocopy_range *ranges, *r;
+  bool merged;
+  size_t i, n;
+
+  if ((int32_t) (hi + 1 - *done) <= 0)
+    return 0;
+
+  if ((int32_t) (lo - *done) > 0) {
+    if (h->nr_zerocopy_ranges == h->zerocopy_ranges_size) {
+      n = h->zerocopy_ranges_size == 0 ? 8 : h->zerocopy_ranges_size * 2;
+      ranges = realloc (h->zerocopy_ranges, n * sizeof *ranges);
+      if (ranges == NULL) {
+        set_error (errno, "realloc");
+        return -1;
+      }
+      h->zerocopy_ranges = ranges;
+      h->zerocopy_ranges_size = n;
+    }
+    h->zerocopy_ranges[h->nr_zerocopy_ranges].lo = lo;
+    h->zerocopy_ranges[h->nr_zerocopy_ranges].hi = hi;
+    h->nr_zerocopy_ranges++;
+    return 0;
+  }
+
+  *done = hi + 1;
+  do {
+    merged = false;
+    for (i = 0; i < h->nr_zerocopy_ranges; ++i) {
+      r = &h->zerocopy_ranges[i];
+      if ((int32_t) (r->lo - *done) > 0)
+        continue;
+      if ((int32_t) (r->hi + 1 - *done) > 0)
+        *done = r->hi + 1;
+      *r = h->zerocopy_ranges[--h->nr_zerocopy_ranges];
+      merged = true;
+      break;
+    }
+  } while (merged);
+  return 0;
+}
+
+/* Released zero-copy sends are reported on the socket error queue,
+ * each message covering the range of sequence numbers from ee_info
+ * to ee_data.
+ */
+static int
+socket_reap_zerocopy (struct nbd_handle *h, struct socket *sock,
+                      uint32_t *done)
+{
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *serr;
+
+  for (;;) {
+    memset (&msg, 0, sizeof msg);
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    if (recvmsg (sock->u.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      set_error (errno, "recvmsg: MSG_ERRQUEUE");
+      return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+      serr = (struct sock_extended_err *) CMSG_DATA (cmsg);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      if (zerocopy_released (h, serr->ee_info, serr->ee_data, done) == -1)
+        return -1;
+    }
+  }
+}
+#endif /* USE_ZEROCOPY */
+
+#ifdef USE_SPLICE
+/* Copy len bytes left in the splice pipe to fd through a buffer, for
+ * when fd cannot be spliced to.  If writing fails, the rest of the
+ * bytes are thrown away so that the pipe is empty again.
+ */
+static void
+drain_splice_pipe (struct nbd_handle *h, int fd, uint64_t *offset,
+                   size_t len, int *write_err)
+{
+  char buf[BUFSIZ];
+  ssize_t r, w;
+  size_t n;
+
+  while (len > 0) {
+    r = read (h->splice_pipe[0], buf, len > sizeof buf ? sizeof buf : len);
+    if (r <= 0)
+      break;
+    len -= r;
+    for (n = 0; n < (size_t) r && *write_err == 0; n += w) {
+      w = pwrite (fd, buf + n, r - n, *offset);
+      if (w <= 0) {
+        *write_err = w == -1 ? errno : ENOSPC;
+        break;
+      }
+      *offset += w;
+    }
+  }
+}
+
+static ssize_t
+socket_splice_to (struct nbd_handle *h, struct socket *sock,
+                  int fd, uint64_t *offset, size_t len, int *write_err)
+{
+  ssize_t r, w;
+  size_t n;
+  loff_t off;
+
+  if (h->splice_pipe[0] == -1) {
+    if (pipe2 (h->splice_pipe, O_CLOEXEC|O_NONBLOCK) == -1) {
+      debug (h, "splice is not available: pipe2: %s", strerror (errno));
+      h->splice_pipe[0] = h->splice_pipe[1] = -1;
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    /* A bigger pipe means fewer system calls per payload. */
+    fcntl (h->splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+#endif
+  }
+
+  /* The pipe is always empty here, so this moves as much as the
+   * server has sent, up to the size of the pipe.
+   */
+  r = splice (sock->u.fd, NULL, h->splice_pipe[1], NULL, len,
+              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (r == -1) {
+    if (errno == EINVAL) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      set_error (errno, "splice");
+    return -1;
+  }
+
+  for (n = 0; n < (size_t) r; n += w) {
+    off = *offset;
+    w = splice (h->splice_pipe[0], NULL, fd, &off, r - n, SPLICE_F_MOVE);
+    if (w <= 0) {
+      /* For example fd was opened with O_APPEND, or is on a file
+       * system which does not support splice.
+       */
+      drain_splice_pipe (h, fd, offset, r - n, write_err);
+      break;
+    }
+    *offset = off;
+  }
+  return r;
+}
+#endif /* USE_SPLICE */
+
+#ifdef USE_SENDFILE
+static ssize_t
+socket_send_file (struct nbd_handle *h, struct socket *sock,
+                  int fd, uint64_t *offset, size_t len)
+{
+  static const struct timespec zero = { 0, 0 };
+  sigset_t sigpipe, old, pending;
+  bool was_pending;
+  off_t off = *offset;
+  ssize_t r;
+  int err;
+
+  /* Unlike send, sendfile has no MSG_NOSIGNAL.  So that we don't die
+   * from SIGPIPE, block it in this thread while sending, and take
+   * back any SIGPIPE which the send raised.
+   */
+  sigemptyset (&sigpipe);
+  sigaddset (&sigpipe, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &sigpipe, &old);
+  sigpending (&pending);
+  was_pending = sigismember (&pending, SIGPIPE);
+
+  r = sendfile (sock->u.fd, fd, &off, len);
+  err = errno;
+  if (r == -1 && err == EPIPE && !was_pending)
+    sigtimedwait (&sigpipe, NULL, &zero);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  errno = err;
+
+  if (r == -1) {
+    /* fd does not support mmap-like operations. */
+    if (errno == EINVAL || errno == ENOSYS) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      set_error (errno, "sendfile");
+    return -1;
+  }
+  *offset = off;
+  return r;
+}
+#endif /* USE_SENDFILE */
+
 static int
 socket_get_fd (struct socket *sock)
 {
@@ -74,7 +376,19 @@ socket_close (struct socket *sock)
 
 static struct socket_ops socket_ops = {
   .recv = socket_recv,
+  .recv_iov = socket_recv_iov,
   .send = socket_send,
+  .send_iov = socket_send_iov,
+#ifdef USE_ZEROCOPY
+  .enable_zerocopy = socket_enable_zerocopy,
+  .reap_zerocopy = socket_reap_zerocopy,
+#endif
+#ifdef USE_SPLICE
+  .splice_to = socket_splice_to,
+#endif
+#ifdef USE_SENDFILE
+  .send_file = socket_send_file,
+#endif
   .get_fd = socket_get_fd,
   .close = socket_close,
 };
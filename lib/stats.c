@@ -0,0 +1,252 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Statistics.
+ *
+ * The counters in h->stats are updated as the handle sends and
+ * receives data and completes commands, always with the handle lock
+ * held, so they need no locking of their own and cost only a few
+ * additions (and reading the monotonic clock once at each end of a
+ * command).  Callers see a copy of them taken by nbd_stats_snapshot,
+ * so that the values which they read together are consistent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "internal.h"
+
+/* Return the monotonic clock in microseconds. */
+uint64_t
+nbd_internal_stats_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000) + ts.tv_nsec / 1000;
+}
+
+/* Bucket i of the latency histograms counts commands which took
+ * from 2^i up to 2^(i+1) microseconds, except that bucket 0 starts
+ * at 0 and the last bucket has no upper limit.
+ */
+static unsigned
+latency_bucket (uint64_t us)
+{
+  unsigned i = 0;
+
+  while (us > 1 && i < STATS_NR_BUCKETS - 1) {
+    us >>= 1;
+    i++;
+  }
+  return i;
+}
+
+/* Called by complete_command for each command which the caller
+ * issued, just before it is given its result.
+ */
+void
+nbd_internal_stats_command_done (struct nbd_handle *h,
+                                 const struct command *cmd)
+{
+  uint64_t latency = nbd_internal_stats_now () - cmd->issued_us;
+
+  if (cmd->type < STATS_NR_CMDS) {
+    h->stats.commands[cmd->type]++;
+    h->stats.latency[cmd->type][latency_bucket (latency)]++;
+  }
+  if (cmd->priority) {
+    h->stats.priority_commands++;
+    h->stats.priority_latency[latency_bucket (latency)]++;
+  }
+  if (cmd->error) {
+    h->stats.errors[0]++;
+    if (cmd->error < STATS_NR_ERRNOS)
+      h->stats.errors[cmd->error]++;
+  }
+}
+
+int
+nbd_unlocked_stats_snapshot (struct nbd_handle *h)
+{
+  if (h->stats_snapshot == NULL) {
+    h->stats_snapshot = malloc (sizeof *h->stats_snapshot);
+    if (h->stats_snapshot == NULL) {
+      set_error (errno, "malloc");
+      return -1;
+    }
+  }
+  memcpy (h->stats_snapshot, &h->stats, sizeof h->stats);
+  return 0;
+}
+
+static const struct stats *
+get_snapshot (struct nbd_handle *h)
+{
+  if (h->stats_snapshot == NULL)
+    set_error (EINVAL, "nbd_stats_snapshot has not been called");
+  return h->stats_snapshot;
+}
+
+int64_t
+nbd_unlocked_get_stats_bytes_sent (struct nbd_handle *h)
+{
+  const struct stats *s = get_snapshot (h);
+
+  return s ? s->bytes_sent : -1;
+}
+
+int64_t
+nbd_unlocked_get_stats_bytes_received (struct nbd_handle *h)
+{
+  const struct stats *s = get_snapshot (h);
+
+  return s ? s->bytes_received : -1;
+}
+
+int64_t
+nbd_unlocked_get_stats_commands (struct nbd_handle *h, int type)
+{
+  const struct stats *s = get_snapshot (h);
+
+  return s ? s->commands[type] : -1;
+}
+
+int64_t
+nbd_unlocked_get_stats_errors (struct nbd_handle *h, int errnum)
+{
+  const struct stats *s = get_snapshot (h);
+
+  if (s == NULL)
+    return -1;
+  if (errnum < 0) {
+    set_error (EINVAL, "invalid errno: %d", errnum);
+    return -1;
+  }
+  return errnum < STATS_NR_ERRNOS ? s->errors[errnum] : 0;
+}
+
+int64_t
+nbd_unlocked_get_stats_max_in_flight (struct nbd_handle *h)
+{
+  const struct stats *s = get_snapshot (h);
+
+  return s ? s->max_in_flight : -1;
+}
+
+int64_t
+nbd_unlocked_get_stats_latency (struct nbd_handle *h, int type,
+                                unsigned bucket)
+{
+  const struct stats *s = get_snapshot (h);
+
+  if (s == NULL)
+    return -1;
+  if (bucket >= STATS_NR_BUCKETS) {
+    set_error (ERANGE, "latency bucket out of range, maximum is %d",
+               STATS_NR_BUCKETS - 1);
+    return -1;
+  }
+  return s->latency[type][bucket];
+}
+
+/* Return the upper limit of the bucket of the latency histogram
+ * which the percentile falls in, or 0 if the histogram is empty.
+ */
+static int64_t
+histogram_percentile (const uint64_t *histogram, unsigned percentile)
+{
+  uint64_t total = 0, seen = 0, want;
+  unsigned i;
+
+  for (i = 0; i < STATS_NR_BUCKETS; ++i)
+    total += histogram[i];
+  if (total == 0)
+    return 0;
+
+  /* The rank of the percentile, rounded up, but at least 1. */
+  want = (total * percentile + 99) / 100;
+  if (want == 0)
+    want = 1;
+  for (i = 0; i < STATS_NR_BUCKETS - 1; ++i) {
+    seen += histogram[i];
+    if (seen >= want)
+      break;
+  }
+  return INT64_C (1) << (i + 1);
+}
+
+int64_t
+nbd_unlocked_get_stats_latency_percentile (struct nbd_handle *h, int type,
+                                           unsigned percentile)
+{
+  const struct stats *s = get_snapshot (h);
+
+  if (s == NULL)
+    return -1;
+  if (percentile > 100) {
+    set_error (ERANGE, "percentile out of range: %u", percentile);
+    return -1;
+  }
+  return histogram_percentile (s->latency[type], percentile);
+}
+
+/* As nbd_get_stats_latency_percentile, but from the counters as they
+ * are now rather than the last snapshot, for lib/replicas.c which
+ * must not disturb the caller's snapshots.  Takes the handle lock.
+ */
+int64_t
+nbd_internal_stats_latency_percentile (struct nbd_handle *h, int type,
+                                       unsigned percentile)
+{
+  int64_t r;
+
+  pthread_mutex_lock (&h->lock);
+  r = histogram_percentile (h->stats.latency[type], percentile);
+  pthread_mutex_unlock (&h->lock);
+  return r;
+}
+
+int64_t
+nbd_unlocked_get_stats_priority_commands (struct nbd_handle *h)
+{
+  const struct stats *s = get_snapshot (h);
+
+  return s ? s->priority_commands : -1;
+}
+
+int64_t
+nbd_unlocked_get_stats_priority_latency_percentile (struct nbd_handle *h,
+                                                    unsigned percentile)
+{
+  const struct stats *s = get_snapshot (h);
+
+  if (s == NULL)
+    return -1;
+  if (percentile > 100) {
+    set_error (ERANGE, "percentile out of range: %u", percentile);
+    return -1;
+  }
+  return histogram_percentile (s->priority_latency, percentile);
+}
@@ -0,0 +1,212 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Trace ring buffer.
+ *
+ * Unlike debug messages, trace records are small fixed size structs
+ * which are copied into a ring buffer in the handle, and nothing is
+ * formatted until the buffer is dumped.  This is cheap enough to
+ * leave enabled in production, so that when a connection dies there
+ * is a record of what happened just before.
+ *
+ * Records are only added by code which holds the handle lock, so the
+ * ring buffer needs no locking of its own.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "internal.h"
+
+/* Each record is 40 bytes, so this is 40M. */
+#define MAX_TRACE_SIZE (1024 * 1024)
+
+int
+nbd_unlocked_set_trace_size (struct nbd_handle *h, unsigned size)
+{
+  struct trace_record *trace = NULL;
+
+  if (size > MAX_TRACE_SIZE) {
+    set_error (ERANGE, "trace size too large, maximum is %d records",
+               MAX_TRACE_SIZE);
+    return -1;
+  }
+  if (size > 0) {
+    trace = calloc (size, sizeof *trace);
+    if (trace == NULL) {
+      set_error (errno, "calloc");
+      return -1;
+    }
+  }
+
+  free (h->trace);
+  h->trace = trace;
+  h->trace_size = size;
+  h->trace_next = 0;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_trace_size (struct nbd_handle *h)
+{
+  return h->trace_size;
+}
+
+int
+nbd_unlocked_dump_trace (struct nbd_handle *h)
+{
+  nbd_internal_dump_trace (h);
+  return 0;
+}
+
+int
+nbd_unlocked_clear_command_event_callback (struct nbd_handle *h)
+{
+  FREE_CALLBACK (h->command_event_callback);
+  return 0;
+}
+
+int
+nbd_unlocked_set_command_event_callback (struct nbd_handle *h,
+                                         nbd_command_event_callback cb)
+{
+  nbd_unlocked_clear_command_event_callback (h);
+  h->command_event_callback = cb;
+  return 0;
+}
+
+/* Called through the command_event macro, which checks that there is
+ * a callback.  Pieces of a split request are reported under the
+ * cookie of the command the caller knows about.
+ */
+void
+nbd_internal_command_event (struct nbd_handle *h, const struct command *cmd,
+                            unsigned event)
+{
+  const struct command *owner = cmd->parent ? cmd->parent : cmd;
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  /* ignore return value */
+  CALL_CALLBACK (h->command_event_callback, owner->cookie, event,
+                 ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec);
+}
+
+/* Called through the trace macro, which checks that tracing is
+ * enabled.
+ */
+void
+nbd_internal_trace (struct nbd_handle *h, enum trace_type type,
+                    uint16_t code, uint64_t cookie,
+                    uint64_t offset, uint64_t count, int64_t result)
+{
+  struct trace_record *rec;
+  struct timespec ts;
+
+  rec = &h->trace[h->trace_next++ % h->trace_size];
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  rec->time = ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+  rec->cookie = cookie;
+  rec->offset = offset;
+  rec->result = result;
+  rec->count = count;
+  rec->type = type;
+  rec->code = code;
+}
+
+static void
+format_record (const struct trace_record *rec, uint64_t start,
+               char *buf, size_t len)
+{
+  const uint64_t t = rec->time - start;
+  int n;
+
+  n = snprintf (buf, len, "trace: +%" PRIu64 ".%06" PRIu64 " ",
+                t / 1000000000, t % 1000000000 / 1000);
+  if (n < 0 || (size_t) n >= len)
+    return;
+  buf += n;
+  len -= n;
+
+  switch ((enum trace_type) rec->type) {
+  case TRACE_STATE:
+    snprintf (buf, len, "state %s",
+              nbd_internal_state_short_string (rec->code));
+    break;
+  case TRACE_SUBMIT:
+    snprintf (buf, len, "submit %s cookie=%" PRIu64 " offset=%" PRIu64
+              " count=%" PRIu64,
+              nbd_internal_name_of_nbd_cmd (rec->code),
+              rec->cookie, rec->offset, rec->count);
+    break;
+  case TRACE_COMPLETE:
+    snprintf (buf, len, "complete %s cookie=%" PRIu64 " error=%s",
+              nbd_internal_name_of_nbd_cmd (rec->code), rec->cookie,
+              rec->result ? strerror (rec->result) : "none");
+    break;
+  case TRACE_RECV:
+  case TRACE_SEND:
+    if (rec->result >= 0)
+      snprintf (buf, len, "%s %" PRIi64 " bytes",
+                rec->type == TRACE_RECV ? "recv" : "send", rec->result);
+    else
+      snprintf (buf, len, "%s: %s",
+                rec->type == TRACE_RECV ? "recv" : "send",
+                strerror (-rec->result));
+    break;
+  default:
+    snprintf (buf, len, "unknown record type %d", rec->type);
+  }
+}
+
+/* Send the trace records, oldest first, to the same place as debug
+ * messages, whether or not debugging is enabled.  Note this
+ * preserves the value of errno.
+ */
+void
+nbd_internal_dump_trace (struct nbd_handle *h)
+{
+  const char *context = nbd_internal_get_error_context ();
+  uint64_t i, first;
+  char msg[256];
+  int err = errno;
+
+  if (h->trace == NULL || h->trace_next == 0)
+    return;
+
+  first = h->trace_next > h->trace_size ? h->trace_next - h->trace_size : 0;
+  for (i = first; i < h->trace_next; ++i) {
+    format_record (&h->trace[i % h->trace_size],
+                   h->trace[first % h->trace_size].time, msg, sizeof msg);
+    if (CALLBACK_IS_NOT_NULL (h->debug_callback))
+      /* ignore return value */
+      CALL_CALLBACK (h->debug_callback, context, msg);
+    else
+      fprintf (stderr, "libnbd: %s: %s: %s\n",
+               h->hname, context ? : "unknown", msg);
+  }
+  errno = err;
+}
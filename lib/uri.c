@@ -22,12 +22,31 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 
 #include "internal.h"
 
+/* Largest connections=N in a URI, see nbd_set_uri_allow_settings. */
+#define MAX_URI_CONNECTIONS 256
+
+/* Return the number of connections asked for by the last URI that h
+ * connected to, or 0 if it did not say.  Used by
+ * nbd_group_connect_uri.
+ */
+int
+nbd_internal_uri_connections (struct nbd_handle *h)
+{
+  int r;
+
+  pthread_mutex_lock (&h->lock);
+  r = h->uri_connections;
+  pthread_mutex_unlock (&h->lock);
+  return r;
+}
+
 #ifdef HAVE_LIBXML2
 
 #include <libxml/uri.h>
@@ -145,6 +164,127 @@ error:
   return -1;
 }
 
+/* Parse a number in a URI query, which must be no larger than max. */
+static int
+parse_uint (const char *name, const char *value, uint64_t max, uint64_t *r)
+{
+  char *end;
+
+  errno = 0;
+  if (*value < '0' || *value > '9')
+    goto bad;
+  *r = strtoull (value, &end, 10);
+  if (errno != 0 || *end != '\0' || *r > max)
+    goto bad;
+  return 0;
+
+ bad:
+  set_error (EINVAL, "invalid URI query %s=%s", name, value);
+  return -1;
+}
+
+static int
+parse_bool (const char *name, const char *value, bool *r)
+{
+  if (strcmp (value, "1") == 0 || strcmp (value, "true") == 0 ||
+      strcmp (value, "yes") == 0 || strcmp (value, "on") == 0)
+    *r = true;
+  else if (strcmp (value, "0") == 0 || strcmp (value, "false") == 0 ||
+           strcmp (value, "no") == 0 || strcmp (value, "off") == 0)
+    *r = false;
+  else {
+    set_error (EINVAL, "invalid URI query %s=%s", name, value);
+    return -1;
+  }
+  return 0;
+}
+
+/* Apply the performance settings in the queries, if they are
+ * allowed by nbd_set_uri_allow_settings.
+ */
+static int
+apply_settings (struct nbd_handle *h,
+                const struct uri_query *queries, int nqueries)
+{
+  const char *name, *value;
+  uint32_t flag;
+  uint64_t n;
+  bool b;
+  int i;
+
+  h->uri_connections = 0;
+
+  for (i = 0; i < nqueries; i++) {
+    name = queries[i].name;
+    value = queries[i].value;
+
+    if (strcmp (name, "connections") == 0)
+      flag = LIBNBD_ALLOW_SETTING_CONNECTIONS;
+    else if (strcmp (name, "max-request-size") == 0)
+      flag = LIBNBD_ALLOW_SETTING_REQUEST_SIZE;
+    else if (strcmp (name, "max-depth") == 0)
+      flag = LIBNBD_ALLOW_SETTING_DEPTH;
+    else if (strcmp (name, "sndbuf") == 0 || strcmp (name, "rcvbuf") == 0)
+      flag = LIBNBD_ALLOW_SETTING_SOCKET_BUFFERS;
+    else if (strcmp (name, "pread-initialize") == 0)
+      flag = LIBNBD_ALLOW_SETTING_PREAD_INITIALIZE;
+    else
+      continue;
+
+    if ((h->uri_allow_settings & flag) == 0) {
+      set_error (EPERM,
+                 "URI setting %s is not allowed, "
+                 "call nbd_set_uri_allow_settings to enable this", name);
+      return -1;
+    }
+
+    switch (flag) {
+    case LIBNBD_ALLOW_SETTING_CONNECTIONS:
+      if (parse_uint (name, value, MAX_URI_CONNECTIONS, &n) == -1)
+        return -1;
+      if (n == 0) {
+        set_error (EINVAL, "invalid URI query %s=%s", name, value);
+        return -1;
+      }
+      h->uri_connections = n;
+      break;
+
+    case LIBNBD_ALLOW_SETTING_REQUEST_SIZE:
+      if (parse_uint (name, value, UINT64_MAX, &n) == -1 ||
+          nbd_unlocked_set_max_request_size (h, n) == -1)
+        return -1;
+      break;
+
+    case LIBNBD_ALLOW_SETTING_DEPTH:
+      if (parse_uint (name, value, UINT_MAX, &n) == -1 ||
+          nbd_unlocked_set_adaptive_depth (h, n) == -1)
+        return -1;
+      break;
+
+    case LIBNBD_ALLOW_SETTING_SOCKET_BUFFERS:
+      if (parse_uint (name, value, INT_MAX, &n) == -1 ||
+          nbd_unlocked_set_socket_option (h,
+                                          strcmp (name, "sndbuf") == 0 ?
+                                          LIBNBD_SOCKET_OPTION_SNDBUF :
+                                          LIBNBD_SOCKET_OPTION_RCVBUF,
+                                          n) == -1)
+        return -1;
+      break;
+
+    case LIBNBD_ALLOW_SETTING_PREAD_INITIALIZE:
+      if (parse_bool (name, value, &b) == -1 ||
+          nbd_unlocked_set_pread_initialize (h, b) == -1)
+        return -1;
+      break;
+
+    default:
+      abort ();
+    }
+  }
+
+  return 0;
+}
+
 int
 nbd_unlocked_aio_connect_uri (struct nbd_handle *h, const char *raw_uri)
 {
@@ -269,6 +409,10 @@ nbd_unlocked_aio_connect_uri (struct nbd_handle *h, const char *raw_uri)
     }
   }
 
+  /* Performance settings. */
+  if (apply_settings (h, queries, nqueries) == -1)
+    goto cleanup;
+
   /* Username. */
   if (uri->user && nbd_unlocked_set_tls_username (h, uri->user) == -1)
     goto cleanup;
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
 
 #include "internal.h"
 
@@ -167,3 +168,117 @@ nbd_internal_fork_safe_perror (const char *s)
    */
   errno = err;
 }
+
+/* Return the time on the monotonic clock when a synchronous call
+ * which starts now must give up (see nbd_set_timeout), or -1 if it
+ * can wait forever.
+ */
+int64_t
+nbd_internal_deadline (struct nbd_handle *h)
+{
+  struct timespec ts;
+
+  if (h->timeout == -1)
+    return -1;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C (1000) + ts.tv_nsec / 1000000 + h->timeout;
+}
+
+/* Return the timeout to pass to nbd_unlocked_poll so that it does
+ * not wait beyond deadline, which is 0 once the deadline has passed.
+ */
+int
+nbd_internal_time_left (int64_t deadline)
+{
+  struct timespec ts;
+  int64_t now;
+
+  if (deadline == -1)
+    return -1;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec * INT64_C (1000) + ts.tv_nsec / 1000000;
+  return now < deadline ? deadline - now : 0;
+}
+
+/* Return a copy of the part of the buffers in iov which covers count
+ * bytes from offset, leaving out empty buffers, and set *nr to the
+ * number of buffers in the copy.  The caller must free the copy.
+ */
+struct iovec *
+nbd_internal_iov_slice (const struct iovec *iov, int iovcnt,
+                        uint64_t offset, uint64_t count, int *nr)
+{
+  struct iovec *ret;
+  size_t len;
+  int i, n = 0;
+
+  /* One more than needed, so that malloc is not asked for 0 bytes. */
+  ret = malloc ((iovcnt + 1) * sizeof *ret);
+  if (ret == NULL) {
+    set_error (errno, "malloc");
+    return NULL;
+  }
+
+  for (i = 0; i < iovcnt && count > 0; ++i) {
+    len = iov[i].iov_len;
+    if (offset >= len) {
+      offset -= len;
+      continue;
+    }
+    len -= offset;
+    if (len > count)
+      len = count;
+    ret[n].iov_base = (char *) iov[i].iov_base + offset;
+    ret[n].iov_len = len;
+    n++;
+    offset = 0;
+    count -= len;
+  }
+  *nr = n;
+  return ret;
+}
+
+/* Merge neighbouring block status extents which have the same flags,
+ * in place, as long as the merged length still fits in 32 bits.
+ * entries is nr_entries integers in the form passed to an extent
+ * callback, and the new number of integers is returned.
+ */
+size_t
+nbd_internal_coalesce_extents (uint32_t *entries, size_t nr_entries)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i + 1 < nr_entries; i += 2) {
+    if (n > 0 && entries[n-1] == entries[i+1] &&
+        entries[n-2] <= UINT32_MAX - entries[i]) {
+      entries[n-2] += entries[i];
+      continue;
+    }
+    entries[n++] = entries[i];
+    entries[n++] = entries[i+1];
+  }
+  return n;
+}
+
+/* Zero length bytes from offset in the buffers in iov. */
+void
+nbd_internal_iov_zero (const struct iovec *iov, int iovcnt,
+                       uint64_t offset, uint64_t length)
+{
+  size_t len;
+  int i;
+
+  for (i = 0; i < iovcnt && length > 0; ++i) {
+    len = iov[i].iov_len;
+    if (offset >= len) {
+      offset -= len;
+      continue;
+    }
+    len -= offset;
+    if (len > length)
+      len = length;
+    memset ((char *) iov[i].iov_base + offset, 0, len);
+    offset = 0;
+    length -= len;
+  }
+}
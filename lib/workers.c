@@ -0,0 +1,387 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Worker threads which drive the handles of a group, see
+ * nbd_group_start_workers.
+ *
+ * Handle i belongs to worker i % nr_workers.  A worker waits on all of
+ * its handles at once in the same way as nbd_poll waits on one: it is
+ * linked into the pollers of each handle while the handle locks are
+ * released, so commands issued by other threads wake it up (see
+ * lib/poll.c).  Completion callbacks therefore run in the worker of
+ * the handle, with the handle lock held, exactly as they would in a
+ * thread calling nbd_poll.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "internal.h"
+
+struct group_worker {
+  struct nbd_group *g;
+  pthread_t thread;
+  bool started;                 /* thread was created. */
+  _Atomic bool stop;
+  int wakefd[2];                /* [0] is polled, [1] is written. */
+  int nr_handles;
+  struct nbd_handle **handles;
+  struct poll_waiter *waiters;
+  struct socket **socks;        /* Socket of each handle when polled. */
+  struct pollfd *fds;           /* One per handle, then wakefd[0]. */
+};
+
+static void
+poll_events (struct nbd_handle *h, struct pollfd *fd)
+{
+  fd->fd = -1;
+  fd->events = 0;
+  fd->revents = 0;
+
+  /* Commands queued in a batch are sent when the batch ends. */
+  if (h->sock == NULL || h->batching)
+    return;
+
+  switch (nbd_internal_aio_get_direction (get_next_state (h))) {
+  case LIBNBD_AIO_DIRECTION_READ:
+    fd->events = POLLIN;
+    break;
+  case LIBNBD_AIO_DIRECTION_WRITE:
+    fd->events = POLLOUT;
+    break;
+  case LIBNBD_AIO_DIRECTION_BOTH:
+    fd->events = POLLIN|POLLOUT;
+    break;
+  default:
+    return;
+  }
+  fd->fd = h->sock->ops->get_fd (h->sock);
+}
+
+static void *
+worker_thread (void *vp)
+{
+  struct group_worker *w = vp;
+  struct nbd_handle *h;
+  char buf[16];
+  bool woken;
+  int i, timeout, timer;
+
+  while (!w->stop) {
+    timeout = -1;
+    for (i = 0; i < w->nr_handles; ++i) {
+      h = w->handles[i];
+      pthread_mutex_lock (&h->lock);
+      poll_events (h, &w->fds[i]);
+      w->socks[i] = h->sock;
+      timer = nbd_unlocked_aio_get_timer (h);
+      if (timer >= 0 && (timeout < 0 || timer < timeout))
+        timeout = timer;
+      nbd_internal_add_poller (h, &w->waiters[i], w->wakefd[1]);
+      pthread_mutex_unlock (&h->lock);
+    }
+    w->fds[w->nr_handles].revents = 0;
+
+    if (poll (w->fds, w->nr_handles + 1, timeout) == -1) {
+      for (i = 0; i <= w->nr_handles; ++i)
+        w->fds[i].revents = 0;
+      /* Not expected, but avoid spinning. */
+      if (errno != EINTR)
+        usleep (1000);
+    }
+
+    woken = false;
+    for (i = 0; i < w->nr_handles; ++i) {
+      h = w->handles[i];
+      pthread_mutex_lock (&h->lock);
+      if (nbd_internal_remove_poller (h, &w->waiters[i]))
+        woken = true;
+      if (nbd_internal_poll_notify (h, w->socks[i], w->fds[i].revents) == -1)
+        debug (h, "group worker: %s", nbd_get_error ());
+      else if (nbd_unlocked_aio_get_timer (h) == 0 &&
+               nbd_unlocked_aio_notify_timer (h) == -1)
+        debug (h, "group worker: %s", nbd_get_error ());
+      pthread_mutex_unlock (&h->lock);
+    }
+    if (woken || w->fds[w->nr_handles].revents != 0) {
+      while (read (w->wakefd[0], buf, sizeof buf) > 0)
+        ;
+    }
+
+    pthread_mutex_lock (&w->g->workers_lock);
+    w->g->workers_gen++;
+    pthread_cond_broadcast (&w->g->workers_cond);
+    pthread_mutex_unlock (&w->g->workers_lock);
+  }
+
+  return NULL;
+}
+
+/* Read the CPUs of NUMA node into set. */
+static int
+node_cpus (int node, cpu_set_t *set)
+{
+  char path[64], list[4096];
+  FILE *fp;
+  char *p, *end;
+  long first, last;
+
+  snprintf (path, sizeof path, "/sys/devices/system/node/node%d/cpulist",
+            node);
+  fp = fopen (path, "r");
+  if (fp == NULL) {
+    set_error (errno == ENOENT ? EINVAL : errno, "NUMA node %d: %s",
+               node, path);
+    return -1;
+  }
+  if (fgets (list, sizeof list, fp) == NULL) {
+    set_error (EINVAL, "NUMA node %d: could not read %s", node, path);
+    fclose (fp);
+    return -1;
+  }
+  fclose (fp);
+
+  /* The list looks like "0-3,8-11". */
+  for (p = list; *p != '\0' && *p != '\n'; p = end) {
+    if (*p == ',')
+      p++;
+    errno = 0;
+    first = strtol (p, &end, 10);
+    if (errno != 0 || end == p || first < 0)
+      break;
+    last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol (p, &end, 10);
+      if (errno != 0 || end == p || last < first)
+        break;
+    }
+    for (; first <= last && first < CPU_SETSIZE; ++first)
+      CPU_SET (first, set);
+  }
+  if (CPU_COUNT (set) == 0) {
+    set_error (EINVAL, "NUMA node %d has no CPUs", node);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+pin_worker (struct group_worker *w, int cpu, uint32_t flags)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  cpu_set_t set;
+  int r;
+
+  CPU_ZERO (&set);
+  if (flags & LIBNBD_WORKERS_NUMA_NODES) {
+    if (node_cpus (cpu, &set) == -1)
+      return -1;
+  }
+  else {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      set_error (EINVAL, "invalid CPU: %d", cpu);
+      return -1;
+    }
+    CPU_SET (cpu, &set);
+  }
+  r = pthread_setaffinity_np (w->thread, sizeof set, &set);
+  if (r != 0) {
+    set_error (r, "pthread_setaffinity_np: %s %d",
+               flags & LIBNBD_WORKERS_NUMA_NODES ? "NUMA node" : "CPU", cpu);
+    return -1;
+  }
+  return 0;
+#else
+  set_error (ENOTSUP, "setting the CPU affinity of threads is not supported");
+  return -1;
+#endif
+}
+
+static void
+stop_workers (struct nbd_group *g)
+{
+  struct group_worker *w;
+  int i;
+
+  for (i = 0; i < g->nr_workers; ++i) {
+    w = &g->workers[i];
+    if (w->started) {
+      w->stop = true;
+      /* If this fails with EAGAIN the worker will wake up anyway. */
+      while (write (w->wakefd[1], "", 1) == -1 && errno == EINTR)
+        ;
+      pthread_join (w->thread, NULL);
+    }
+  }
+  for (i = 0; i < g->nr_workers; ++i) {
+    w = &g->workers[i];
+    if (w->wakefd[0] >= 0) {
+      close (w->wakefd[0]);
+      close (w->wakefd[1]);
+    }
+    free (w->handles);
+    free (w->waiters);
+    free (w->socks);
+    free (w->fds);
+  }
+  free (g->workers);
+  g->workers = NULL;
+  g->nr_workers = 0;
+}
+
+/* nbd_group_poll while the group has workers.  This returns when a
+ * worker has been round its handles, which is when commands may have
+ * completed.  A round which ended just before we started waiting would
+ * be missed, so this never waits longer than GROUP_WORKERS_WAIT_MS
+ * before returning 1 to make the caller look at the handles again.
+ * It returns 0 if timeout ms pass without any worker finishing a round.
+ */
+int
+nbd_internal_group_wait_workers (struct nbd_group *g, int timeout)
+{
+  struct timespec ts;
+  uint64_t gen;
+  bool changed;
+  int wait, r = 0;
+
+  wait = timeout;
+  if (timeout < 0 || timeout > GROUP_WORKERS_WAIT_MS)
+    wait = GROUP_WORKERS_WAIT_MS;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += wait / 1000;
+  ts.tv_nsec += (wait % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock (&g->workers_lock);
+  gen = g->workers_gen;
+  while (gen == g->workers_gen && r == 0)
+    r = pthread_cond_timedwait (&g->workers_cond, &g->workers_lock, &ts);
+  changed = gen != g->workers_gen;
+  pthread_mutex_unlock (&g->workers_lock);
+
+  return changed || wait != timeout;
+}
+
+int
+nbd_group_start_workers (struct nbd_group *g, int nr_workers,
+                         const int *cpus, int nr_cpus, uint32_t flags)
+{
+  struct group_worker *w;
+  int i, n, r;
+
+  nbd_internal_set_error_context ("nbd_group_start_workers");
+
+  if (g->workers != NULL) {
+    set_error (EBUSY, "the group already has workers");
+    return -1;
+  }
+  if (nr_workers < 1 || nr_workers > g->nr_handles) {
+    set_error (EINVAL, "number of workers must be between 1 and the number "
+               "of handles (%d)", g->nr_handles);
+    return -1;
+  }
+  if ((flags & ~LIBNBD_WORKERS_NUMA_NODES) != 0) {
+    set_error (EINVAL, "invalid flags: %" PRIu32, flags);
+    return -1;
+  }
+  if (nr_cpus < 0 || (nr_cpus > 0 && cpus == NULL)) {
+    set_error (EINVAL, "invalid list of CPUs");
+    return -1;
+  }
+
+  g->workers = calloc (nr_workers, sizeof g->workers[0]);
+  if (g->workers == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+  g->nr_workers = nr_workers;
+  for (i = 0; i < nr_workers; ++i) {
+    w = &g->workers[i];
+    w->g = g;
+    w->wakefd[0] = w->wakefd[1] = -1;
+    n = w->nr_handles = (g->nr_handles - i + nr_workers - 1) / nr_workers;
+    w->handles = calloc (n, sizeof w->handles[0]);
+    w->waiters = calloc (n, sizeof w->waiters[0]);
+    w->socks = calloc (n, sizeof w->socks[0]);
+    w->fds = calloc (n + 1, sizeof w->fds[0]);
+    if (w->handles == NULL || w->waiters == NULL ||
+        w->socks == NULL || w->fds == NULL) {
+      set_error (errno, "calloc");
+      goto err;
+    }
+    if (socketpair (AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0,
+                    w->wakefd) == -1) {
+      set_error (errno, "socketpair");
+      w->wakefd[0] = w->wakefd[1] = -1;
+      goto err;
+    }
+    w->fds[n].fd = w->wakefd[0];
+    w->fds[n].events = POLLIN;
+  }
+  for (i = 0; i < g->nr_handles; ++i) {
+    w = &g->workers[i % nr_workers];
+    w->handles[i / nr_workers] = g->handles[i];
+  }
+
+  for (i = 0; i < nr_workers; ++i) {
+    w = &g->workers[i];
+    r = pthread_create (&w->thread, NULL, worker_thread, w);
+    if (r != 0) {
+      set_error (r, "pthread_create");
+      goto err;
+    }
+    w->started = true;
+    if (nr_cpus > 0 && pin_worker (w, cpus[i % nr_cpus], flags) == -1)
+      goto err;
+  }
+  return 0;
+
+ err:
+  stop_workers (g);
+  return -1;
+}
+
+int
+nbd_group_stop_workers (struct nbd_group *g)
+{
+  stop_workers (g);
+  return 0;
+}
+
+int
+nbd_group_get_nr_workers (struct nbd_group *g)
+{
+  return g->nr_workers;
+}
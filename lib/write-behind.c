@@ -0,0 +1,285 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Write-behind, see nbd_set_write_behind.
+ *
+ * nbd_aio_pwrite copies the payload into a struct wb_buffer owned by
+ * the library and issues the write with CMD_FLAG_WRITE_BEHIND, so the
+ * caller may reuse its buffer at once.  The command retires itself
+ * when it completes, and the buffer goes back to wb_pool for the next
+ * write of the same size class.
+ *
+ * The server is free to reorder commands in flight, and a flush only
+ * covers the writes which it has already replied to, so flushes and
+ * commands with LIBNBD_CMD_FLAG_FUA are barriers: while write-behind
+ * writes are pending they are held on wb_held (with anything
+ * write-behind issued after them) and are queued when the last of the
+ * writes before them completes.  The first error of a write-behind
+ * write is kept in wb_error, and is reported by the next barrier
+ * which is sent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "internal.h"
+
+/* The smallest size class of copy buffers, and the most free
+ * buffers kept on wb_pool and the largest size class kept there.
+ */
+#define WB_MIN_SIZE 4096
+#define WB_POOL_MAX 64
+#define WB_POOL_MAX_SIZE (1024 * 1024)
+
+struct wb_buffer {
+  struct wb_buffer *next;       /* On wb_pool */
+  struct nbd_handle *h;
+  size_t size;                  /* Size class, a power of 2 */
+  nbd_completion_callback completion; /* The caller's */
+  char data[];
+};
+
+int
+nbd_unlocked_set_write_behind (struct nbd_handle *h, bool enable)
+{
+  h->write_behind = enable;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_write_behind (struct nbd_handle *h)
+{
+  return h->write_behind;
+}
+
+static size_t
+size_class (size_t count)
+{
+  size_t size = WB_MIN_SIZE;
+
+  while (size < count)
+    size *= 2;
+  return size;
+}
+
+static struct wb_buffer *
+get_buffer (struct nbd_handle *h, size_t count)
+{
+  const size_t size = size_class (count);
+  struct wb_buffer *b, **bp;
+
+  for (bp = &h->wb_pool; (b = *bp) != NULL; bp = &b->next) {
+    if (b->size == size) {
+      *bp = b->next;
+      h->wb_pool_nr--;
+      return b;
+    }
+  }
+
+  b = malloc (sizeof *b + size);
+  if (b == NULL) {
+    set_error (errno, "malloc");
+    return NULL;
+  }
+  b->h = h;
+  b->size = size;
+  return b;
+}
+
+static void
+put_buffer (struct nbd_handle *h, struct wb_buffer *b)
+{
+  if (h->wb_pool_nr < WB_POOL_MAX && b->size <= WB_POOL_MAX_SIZE) {
+    b->next = h->wb_pool;
+    h->wb_pool = b;
+    h->wb_pool_nr++;
+  }
+  else
+    free (b);
+}
+
+static int
+write_done (void *user_data, int *error)
+{
+  struct wb_buffer *b = user_data;
+
+  CALL_CALLBACK (b->completion, error);
+  return 1;
+}
+
+static void
+write_free (void *user_data)
+{
+  struct wb_buffer *b = user_data;
+
+  FREE_CALLBACK (b->completion);
+  put_buffer (b->h, b);
+}
+
+/* Issue a write of a copy of buf. */
+int64_t
+nbd_internal_write_behind (struct nbd_handle *h,
+                           const void *buf, size_t count, uint64_t offset,
+                           nbd_completion_callback completion,
+                           uint32_t flags)
+{
+  struct command_cb cb;
+  struct wb_buffer *b;
+  int64_t cookie;
+
+  b = get_buffer (h, count);
+  if (b == NULL)
+    return -1;
+  memcpy (b->data, buf, count);
+  b->completion = completion;
+
+  cb = (struct command_cb) {
+    .completion = { .callback = write_done, .user_data = b,
+                    .free = write_free },
+  };
+  cookie = nbd_internal_command_common (h, flags | CMD_FLAG_WRITE_BEHIND,
+                                        NBD_CMD_WRITE, offset, count,
+                                        b->data, &cb);
+  if (cookie == -1)
+    put_buffer (h, b);
+  return cookie;
+}
+
+static bool
+is_barrier (const struct command *cmd)
+{
+  return cmd->type == NBD_CMD_FLUSH || (cmd->flags & LIBNBD_CMD_FLAG_FUA) != 0;
+}
+
+/* Account for cmd being queued to be sent. */
+static void
+queued (struct nbd_handle *h, struct command *cmd)
+{
+  if (cmd->write_behind)
+    h->wb_pending++;
+  else if (is_barrier (cmd) && h->wb_error != 0) {
+    cmd->deferred_error = h->wb_error;
+    h->wb_error = 0;
+  }
+}
+
+/* Called for the commands from first to last (linked by next) as
+ * they are queued.  Returns true if they have been held instead.
+ */
+bool
+nbd_internal_write_behind_hold (struct nbd_handle *h,
+                                struct command *first, struct command *last)
+{
+  struct command *cmd;
+  bool hold;
+
+  if (h->wb_held != NULL)
+    hold = first->write_behind || is_barrier (first);
+  else
+    hold = is_barrier (first) && h->wb_pending > 0;
+
+  for (cmd = first; ; cmd = cmd->next) {
+    if (hold)
+      cmd->list = CMDS_HELD;
+    else
+      queued (h, cmd);
+    if (cmd == last)
+      break;
+  }
+  if (!hold)
+    return false;
+
+  last->next = NULL;
+  if (h->wb_held_tail != NULL)
+    h->wb_held_tail->next = first;
+  else
+    h->wb_held = first;
+  h->wb_held_tail = last;
+  return true;
+}
+
+/* Queue the held commands which no longer have to wait.  This does
+ * not run the state machine, which sends them the next time it
+ * reaches READY.
+ */
+void
+nbd_internal_write_behind_release (struct nbd_handle *h)
+{
+  struct command *cmd;
+  int n = 0;
+
+  while ((cmd = h->wb_held) != NULL &&
+         (!is_barrier (cmd) || h->wb_pending == 0)) {
+    h->wb_held = cmd->next;
+    if (h->wb_held == NULL)
+      h->wb_held_tail = NULL;
+    cmd->next = NULL;
+    cmd->list = CMDS_TO_ISSUE;
+    queued (h, cmd);
+    if (h->cmds_to_issue_tail != NULL)
+      h->cmds_to_issue_tail->next = cmd;
+    else
+      h->cmds_to_issue = cmd;
+    h->cmds_to_issue_tail = cmd;
+    n++;
+  }
+
+  if (n > 0) {
+    debug (h, "sending %d commands held for write-behind writes", n);
+    h->in_flight += n;
+    if (h->in_flight > h->stats.max_in_flight)
+      h->stats.max_in_flight = h->in_flight;
+  }
+}
+
+/* Called as each command which is write-behind or reports the error
+ * of one completes.
+ */
+void
+nbd_internal_write_behind_complete (struct nbd_handle *h,
+                                    struct command *cmd)
+{
+  if (cmd->write_behind && cmd->list != CMDS_HELD) {
+    assert (h->wb_pending > 0);
+    h->wb_pending--;
+    if (cmd->error != 0 && h->wb_error == 0)
+      h->wb_error = cmd->error;
+  }
+  if (cmd->error == 0)
+    cmd->error = cmd->deferred_error;
+}
+
+void
+nbd_internal_write_behind_free (struct nbd_handle *h)
+{
+  struct wb_buffer *b, *next;
+
+  for (b = h->wb_pool, h->wb_pool = NULL; b != NULL; b = next) {
+    next = b->next;
+    free (b);
+  }
+  h->wb_pool_nr = 0;
+}
@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include <caml/alloc.h>
+#include <caml/bigarray.h>
 #include <caml/fail.h>
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
@@ -31,30 +32,10 @@
 
 #include "nbd-c.h"
 
-void
-nbd_internal_ocaml_buffer_finalize (value bv)
-{
-  struct nbd_buffer *b = NBD_buffer_val (bv);
-
-  free (b->data);
-}
-
-/* Allocate an NBD persistent buffer. */
-value
-nbd_internal_ocaml_buffer_alloc (value sizev)
-{
-  CAMLparam1 (sizev);
-  CAMLlocal1 (rv);
-  struct nbd_buffer b;
-
-  b.len = Int_val (sizev);
-  b.data = malloc (b.len);
-  if (b.data == NULL)
-    caml_raise_out_of_memory ();
-
-  rv = Val_nbd_buffer (b);
-  CAMLreturn (rv);
-}
+/* NBD.Buffer.t is a Bigarray of chars, so that its data is outside
+ * the OCaml heap.  These are the functions which have to be written
+ * in C.
+ */
 
 /* Copy an NBD persistent buffer to an OCaml bytes. */
 value
@@ -62,10 +43,10 @@ nbd_internal_ocaml_buffer_to_bytes (value bv)
 {
   CAMLparam1 (bv);
   CAMLlocal1 (rv);
-  struct nbd_buffer *b = NBD_buffer_val (bv);
+  size_t len = caml_ba_byte_size (Caml_ba_array_val (bv));
 
-  rv = caml_alloc_string (b->len);
-  memcpy (Bytes_val (rv), b->data, b->len);
+  rv = caml_alloc_string (len);
+  memcpy (Bytes_val (rv), Caml_ba_data_val (bv), len);
 
   CAMLreturn (rv);
 }
@@ -76,24 +57,11 @@ nbd_internal_ocaml_buffer_of_bytes (value bytesv)
 {
   CAMLparam1 (bytesv);
   CAMLlocal1 (rv);
-  struct nbd_buffer b;
+  size_t len = caml_string_length (bytesv);
 
-  b.len = caml_string_length (bytesv);
-  b.data = malloc (b.len);
-  if (b.data == NULL)
-    caml_raise_out_of_memory ();
-  memcpy (b.data, Bytes_val (bytesv), b.len);
+  rv = caml_ba_alloc_dims (CAML_BA_CHAR | CAML_BA_C_LAYOUT, 1, NULL,
+                           (intnat) len);
+  memcpy (Caml_ba_data_val (rv), Bytes_val (bytesv), len);
 
-  rv = Val_nbd_buffer (b);
   CAMLreturn (rv);
 }
-
-value
-nbd_internal_ocaml_buffer_size (value bv)
-{
-  CAMLparam1 (bv);
-  CAMLlocal1 (rv);
-  struct nbd_buffer *b = NBD_buffer_val (bv);
-
-  CAMLreturn (Val_int (b->len));
-}
@@ -58,11 +58,19 @@ value
 nbd_internal_ocaml_nbd_close (value hv)
 {
   CAMLparam1 (hv);
+  struct nbd_handle *h = NBD_val (hv);
 
-  nbd_internal_ocaml_handle_finalize (hv);
-
-  /* So we don't double-free in the finalizer. */
+  /* So we don't double-free in the finalizer, and other threads see
+   * the handle as closed.
+   */
   NBD_val (hv) = NULL;
 
+  /* Unlike the finalizer, this can let other threads run while the
+   * handle is closed, which may wait for the server subprocess.
+   */
+  nbd_internal_ocaml_release_runtime ();
+  nbd_close (h);
+  nbd_internal_ocaml_acquire_runtime ();
+
   CAMLreturn (Val_unit);
 }
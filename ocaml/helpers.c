@@ -22,7 +22,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <caml/alloc.h>
 #include <caml/callback.h>
@@ -30,6 +32,7 @@
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
 #include <caml/printexc.h>
+#include <caml/threads.h>
 
 #include <libnbd.h>
 
@@ -70,8 +73,9 @@ nbd_internal_ocaml_raise_closed (const char *func)
   CAMLnoreturn;
 }
 
-/* The caller should free the array, but NOT the strings, since the
- * strings point to OCaml strings.
+/* The strings are copied, since the OCaml strings may be moved by
+ * the GC while libnbd is called without the runtime lock.  Free the
+ * list with nbd_internal_ocaml_free_string_list.
  */
 char **
 nbd_internal_ocaml_string_list (value ssv)
@@ -89,13 +93,95 @@ nbd_internal_ocaml_string_list (value ssv)
   if (r == NULL) caml_raise_out_of_memory ();
 
   sv = ssv;
-  for (i = 0; sv != Val_emptylist; sv = Field (sv, 1), i++)
-    r[i] = String_val (Field (sv, 0));
+  for (i = 0; sv != Val_emptylist; sv = Field (sv, 1), i++) {
+    r[i] = strdup (String_val (Field (sv, 0)));
+    if (r[i] == NULL) {
+      nbd_internal_ocaml_free_string_list (r);
+      caml_raise_out_of_memory ();
+    }
+  }
 
   r[len] = NULL;
   CAMLreturnT (char **, r);
 }
 
+void
+nbd_internal_ocaml_free_string_list (char **argv)
+{
+  size_t i;
+
+  if (!argv)
+    return;
+
+  for (i = 0; argv[i] != NULL; ++i)
+    free (argv[i]);
+  free (argv);
+}
+
+/* Copy an OCaml string or bytes to the C heap, so that it can be
+ * used without the runtime lock.
+ */
+void *
+nbd_internal_ocaml_copy_bytes (value sv)
+{
+  size_t len = caml_string_length (sv);
+  void *r;
+
+  r = malloc (len > 0 ? len : 1);
+  if (r == NULL)
+    caml_raise_out_of_memory ();
+  memcpy (r, String_val (sv), len);
+  return r;
+}
+
+char *
+nbd_internal_ocaml_copy_string (value sv)
+{
+  char *r = strdup (String_val (sv));
+
+  if (r == NULL)
+    caml_raise_out_of_memory ();
+  return r;
+}
+
+/* The bindings release the runtime system while they are in libnbd,
+ * so that other threads can run OCaml code.  libnbd calls the
+ * callback wrappers and free_user_data both from inside the bindings
+ * and from nbd_close in the handle finalizer, which runs with the
+ * runtime held, so this per-thread flag records which case it is.
+ */
+static pthread_key_t released_key;
+static pthread_once_t released_key_once = PTHREAD_ONCE_INIT;
+
+static void
+create_released_key (void)
+{
+  if (pthread_key_create (&released_key, NULL) != 0)
+    abort ();
+}
+
+void
+nbd_internal_ocaml_release_runtime (void)
+{
+  pthread_once (&released_key_once, create_released_key);
+  pthread_setspecific (released_key, &released_key);
+  caml_release_runtime_system ();
+}
+
+void
+nbd_internal_ocaml_acquire_runtime (void)
+{
+  caml_acquire_runtime_system ();
+  pthread_setspecific (released_key, NULL);
+}
+
+bool
+nbd_internal_ocaml_runtime_released (void)
+{
+  pthread_once (&released_key_once, create_released_key);
+  return pthread_getspecific (released_key) != NULL;
+}
+
 value
 nbd_internal_ocaml_alloc_int32_array (uint32_t *a, size_t len)
 {
@@ -21,6 +21,7 @@
 #ifndef LIBNBD_NBD_C_H
 #define LIBNBD_NBD_C_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <caml/custom.h>
@@ -39,15 +40,21 @@
 #endif
 
 extern void nbd_internal_ocaml_handle_finalize (value);
-extern void nbd_internal_ocaml_buffer_finalize (value);
 
 extern void nbd_internal_ocaml_raise_error (void) Noreturn;
 extern void nbd_internal_ocaml_raise_closed (const char *func) Noreturn;
 
 extern char **nbd_internal_ocaml_string_list (value);
+extern void nbd_internal_ocaml_free_string_list (char **);
+extern void *nbd_internal_ocaml_copy_bytes (value);
+extern char *nbd_internal_ocaml_copy_string (value);
 extern value nbd_internal_ocaml_alloc_int32_array (uint32_t *, size_t);
 extern void nbd_internal_ocaml_exception_in_wrapper (const char *, value);
 
+extern void nbd_internal_ocaml_release_runtime (void);
+extern void nbd_internal_ocaml_acquire_runtime (void);
+extern bool nbd_internal_ocaml_runtime_released (void);
+
 /* Extract an NBD handle from an OCaml heap value. */
 #define NBD_val(v) (*((struct nbd_handle **)Data_custom_val(v)))
 
@@ -79,40 +86,4 @@ Val_nbd (struct nbd_handle *h)
   CAMLreturn (rv);
 }
 
-/* Persistent buffer for AIO. */
-struct nbd_buffer {
-  void *data;
-  size_t len;
-};
-
-/* Extract a persistent buffer from an OCaml heap value.  Note the
- * whole struct is stored in the custom, not a pointer.  This
- * returns a pointer to the struct .
- */
-#define NBD_buffer_val(v) ((struct nbd_buffer *)Data_custom_val(v))
-
-static struct custom_operations nbd_buffer_custom_operations = {
-  (char *) "nbd_buffer_custom_operations",
-  nbd_internal_ocaml_buffer_finalize,
-  custom_compare_default,
-  custom_hash_default,
-  custom_serialize_default,
-  custom_deserialize_default,
-  custom_compare_ext_default,
-};
-
-/* Embed an NBD persistent buffer in an OCaml heap value. */
-static inline value
-Val_nbd_buffer (struct nbd_buffer b)
-{
-  CAMLparam0 ();
-  CAMLlocal1 (rv);
-
-  rv = caml_alloc_custom_mem (&nbd_buffer_custom_operations,
-                              sizeof (struct nbd_buffer),
-                              sizeof b + b.len);
-  *NBD_buffer_val (rv) = b;
-  CAMLreturn (rv);
-}
-
 #endif /* LIBNBD_NBD_C_H */
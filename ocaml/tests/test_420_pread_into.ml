@@ -0,0 +1,55 @@
+(* libnbd OCaml test case
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *)
+
+open Printf
+
+(* NB: OCaml 4.08 has endian functions in the Bytes module which
+ * would make this loop much simpler.
+ *)
+let expected =
+  let b = Bytes.create 512 in
+  for i = 0 to 512/8-1 do
+    let i64 = ref (Int64.of_int (i*8)) in
+    for j = 0 to 7 do
+      let c = Int64.shift_right_logical !i64 56 in
+      let c = Int64.to_int c in
+      let c = Char.chr c in
+      Bytes.unsafe_set b (i*8+j) c;
+      i64 := Int64.shift_left !i64 8
+    done
+  done;
+  b
+
+let () =
+  let nbd = NBD.create () in
+  NBD.connect_command nbd
+                      ["nbdkit"; "-s"; "--exit-with-parent"; "-v";
+                       "pattern"; "size=512"];
+  let buf = NBD.Buffer.alloc 512 in
+  NBD.pread_into nbd buf 0_L;
+  assert (NBD.Buffer.to_bytes buf = expected);
+
+  (* Read into the second half of a buffer, through a sub-array
+   * which shares its data.
+   *)
+  Bigarray.Array1.fill buf '\000';
+  NBD.pread_into nbd (Bigarray.Array1.sub buf 256 256) 256_L;
+  let b = Bytes.make 256 '\000' in
+  assert (NBD.Buffer.to_bytes buf = Bytes.cat b (Bytes.sub expected 256 256))
+
+let () = Gc.compact ()
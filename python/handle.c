@@ -65,12 +65,16 @@ nbd_internal_py_close (PyObject *self, PyObject *args)
 {
   PyObject *py_h;
   struct nbd_handle *h;
+  struct py_gil py_gil;
 
   if (!PyArg_ParseTuple (args, (char *) "O:nbd_close", &py_h))
     return NULL;
   h = get_handle (py_h);
 
+  /* Closing may wait for the subprocess, and frees the callbacks. */
+  nbd_internal_py_release_gil (&py_gil, true);
   nbd_close (h);
+  nbd_internal_py_restore_gil (&py_gil);
 
   Py_INCREF (Py_None);
   return Py_None;
@@ -89,44 +93,43 @@ free_aio_buffer (PyObject *capsule)
 {
   struct py_aio_buffer *buf = PyCapsule_GetPointer (capsule, aio_buffer_name);
 
-  free (buf->data);
+  PyBuffer_Release (&buf->view);
   free (buf);
 }
 
-/* Allocate a persistent buffer used for nbd_aio_pread. */
+/* Make a buffer for nbd_aio_pread or nbd_aio_pwrite which points
+ * into any writable object supporting the buffer protocol, such as
+ * nbd.Buffer (a bytearray) or a memoryview, without copying it.  The
+ * object cannot be resized until the capsule is freed.
+ */
 PyObject *
-nbd_internal_py_alloc_aio_buffer (PyObject *self, PyObject *args)
+nbd_internal_py_aio_buffer_from_buffer (PyObject *self, PyObject *args)
 {
+  PyObject *obj;
   struct py_aio_buffer *buf;
   PyObject *ret;
 
+  if (!PyArg_ParseTuple (args,
+                         (char *) "O:nbd_internal_py_aio_buffer_from_buffer",
+                         &obj))
+    return NULL;
+
   buf = malloc (sizeof *buf);
   if (buf == NULL) {
     PyErr_NoMemory ();
     return NULL;
   }
 
-  if (!PyArg_ParseTuple (args, (char *) "n:nbd_internal_py_alloc_aio_buffer",
-                         &buf->len)) {
-    free (buf);
-    return NULL;
-  }
-
-  if (buf->len < 0) {
-    PyErr_SetString (PyExc_RuntimeError, "length < 0");
-    free (buf);
-    return NULL;
-  }
-  buf->data = malloc (buf->len);
-  if (buf->data == NULL) {
-    PyErr_NoMemory ();
+  if (PyObject_GetBuffer (obj, &buf->view, PyBUF_WRITABLE) == -1) {
     free (buf);
     return NULL;
   }
+  buf->data = buf->view.buf;
+  buf->len = buf->view.len;
 
   ret = PyCapsule_New (buf, aio_buffer_name, free_aio_buffer);
   if (ret == NULL) {
-    free (buf->data);
+    PyBuffer_Release (&buf->view);
     free (buf);
     return NULL;
   }
@@ -134,82 +137,109 @@ nbd_internal_py_alloc_aio_buffer (PyObject *self, PyObject *args)
   return ret;
 }
 
+/* nbd_pread into a writable object supporting the buffer protocol. */
 PyObject *
-nbd_internal_py_aio_buffer_from_bytearray (PyObject *self, PyObject *args)
+nbd_internal_py_pread_into (PyObject *self, PyObject *args)
 {
-  PyObject *obj;
-  Py_ssize_t len;
-  void *data;
-  struct py_aio_buffer *buf;
-  PyObject *ret;
-
-  if (!PyArg_ParseTuple (args,
-                         (char *) "O:nbd_internal_py_aio_buffer_from_bytearray",
-                         &obj))
-    return NULL;
+  PyObject *py_h;
+  struct nbd_handle *h;
+  Py_buffer buf;
+  unsigned long long offset; /* really uint64_t */
+  unsigned int flags; /* really uint32_t */
+  int ret;
+  struct py_gil py_gil;
 
-  data = PyByteArray_AsString (obj);
-  if (!data)
+  if (!PyArg_ParseTuple (args, (char *) "Ow*KI:nbd_pread_into",
+                         &py_h, &buf, &offset, &flags))
     return NULL;
-  len = PyByteArray_Size (obj);
+  h = get_handle (py_h);
 
-  buf = malloc (sizeof *buf);
-  if (buf == NULL) {
-    PyErr_NoMemory ();
+  nbd_internal_py_release_gil (&py_gil, false);
+  ret = nbd_pread (h, buf.buf, buf.len, offset, flags);
+  nbd_internal_py_restore_gil (&py_gil);
+  PyBuffer_Release (&buf);
+  if (ret == -1) {
+    raise_exception ();
     return NULL;
   }
 
-  buf->len = len;
-  buf->data = malloc (len);
-  if (buf->data == NULL) {
-    PyErr_NoMemory ();
-    free (buf);
-    return NULL;
-  }
-  memcpy (buf->data, data, len);
+  Py_INCREF (Py_None);
+  return Py_None;
+}
 
-  ret = PyCapsule_New (buf, aio_buffer_name, free_aio_buffer);
-  if (ret == NULL) {
-    free (buf->data);
-    free (buf);
-    return NULL;
-  }
+/* A buffer from nbd_buffer_alloc.  Python only sees it through the
+ * memoryview returned by nbd.buffer_alloc, which keeps it alive.
+ */
+struct py_allocated_buffer {
+  PyObject_HEAD
+  void *data;
+  Py_ssize_t len;
+};
 
-  return ret;
+static int
+allocated_buffer_getbuffer (PyObject *self, Py_buffer *view, int flags)
+{
+  struct py_allocated_buffer *buf = (struct py_allocated_buffer *) self;
+
+  return PyBuffer_FillInfo (view, self, buf->data, buf->len, 0, flags);
 }
 
-PyObject *
-nbd_internal_py_aio_buffer_to_bytearray (PyObject *self, PyObject *args)
+static void
+allocated_buffer_dealloc (PyObject *self)
 {
-  PyObject *obj;
-  struct py_aio_buffer *buf;
+  struct py_allocated_buffer *buf = (struct py_allocated_buffer *) self;
 
-  if (!PyArg_ParseTuple (args,
-                         (char *) "O:nbd_internal_py_aio_buffer_to_bytearray",
-                         &obj))
-    return NULL;
+  nbd_buffer_free (buf->data);
+  Py_TYPE (self)->tp_free (self);
+}
 
-  buf = nbd_internal_py_get_aio_buffer (obj);
-  if (buf == NULL)
-    return NULL;
+static PyBufferProcs allocated_buffer_as_buffer = {
+  .bf_getbuffer = allocated_buffer_getbuffer,
+};
 
-  return PyByteArray_FromStringAndSize (buf->data, buf->len);
-}
+static PyTypeObject allocated_buffer_type = {
+  PyVarObject_HEAD_INIT (NULL, 0)
+  .tp_name = "nbd.AllocatedBuffer",
+  .tp_basicsize = sizeof (struct py_allocated_buffer),
+  .tp_dealloc = allocated_buffer_dealloc,
+  .tp_as_buffer = &allocated_buffer_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+};
 
+/* nbd_buffer_alloc, returning a memoryview of the buffer. */
 PyObject *
-nbd_internal_py_aio_buffer_size (PyObject *self, PyObject *args)
+nbd_internal_py_buffer_alloc (PyObject *self, PyObject *args)
 {
-  PyObject *obj;
-  struct py_aio_buffer *buf;
+  Py_ssize_t size;
+  int numa_node;
+  unsigned int flags; /* really uint32_t */
+  struct py_allocated_buffer *buf;
+  PyObject *ret;
 
-  if (!PyArg_ParseTuple (args,
-                         (char *) "O:nbd_internal_py_aio_buffer_size",
-                         &obj))
+  if (!PyArg_ParseTuple (args, (char *) "niI:nbd_buffer_alloc",
+                         &size, &numa_node, &flags))
+    return NULL;
+  if (size < 0) {
+    PyErr_SetString (PyExc_ValueError, "buffer size must not be negative");
+    return NULL;
+  }
+
+  /* This does nothing after the first call. */
+  if (PyType_Ready (&allocated_buffer_type) == -1)
     return NULL;
 
-  buf = nbd_internal_py_get_aio_buffer (obj);
+  buf = PyObject_New (struct py_allocated_buffer, &allocated_buffer_type);
   if (buf == NULL)
     return NULL;
+  buf->len = size;
+  buf->data = nbd_buffer_alloc (size, numa_node, flags);
+  if (buf->data == NULL) {
+    raise_exception ();
+    Py_DECREF (buf);
+    return NULL;
+  }
 
-  return PyLong_FromSsize_t (buf->len);
+  ret = PyMemoryView_FromObject ((PyObject *) buf);
+  Py_DECREF (buf);
+  return ret;
 }
@@ -0,0 +1,152 @@
+# NBD client library in userspace
+# Copyright (C) 2013-2019 Red Hat Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+'''
+asyncio integration for libnbd
+
+import asyncio
+import nbd
+import nbdasyncio
+
+async def main ():
+    h = nbd.NBD ()
+    h.connect_uri ("nbd://localhost")
+    a = nbdasyncio.Handle (h)
+    buf = await a.pread (512, 0)
+
+asyncio.run (main ())
+
+The handle must be connected before it is wrapped.  Its socket is
+watched by the event loop with add_reader and add_writer, so any
+number of commands on any number of handles can be in flight at once
+from a single thread.  Read the libnbd(3) man page to find out how to
+use the AIO API underneath.
+'''
+
+import asyncio
+import os
+
+import nbd
+
+class Handle (object):
+    '''Drive an nbd.NBD handle from an asyncio event loop'''
+
+    def __init__ (self, h, loop=None):
+        '''wrap the connected handle h'''
+        if loop is None:
+            loop = asyncio.get_event_loop ()
+        self.h = h
+        self._loop = loop
+        self._fd = h.aio_get_fd ()
+        self._reading = False
+        self._writing = False
+        self._pending = set ()
+        self._update ()
+
+    def close (self):
+        '''stop watching the handle, without closing it'''
+        self._watch (False, False)
+
+    # Add or remove the reader and writer only when the direction
+    # libnbd is waiting for changes.
+    def _watch (self, reading, writing):
+        if reading != self._reading:
+            if reading:
+                self._loop.add_reader (self._fd, self._notify,
+                                       self.h.aio_notify_read)
+            else:
+                self._loop.remove_reader (self._fd)
+            self._reading = reading
+        if writing != self._writing:
+            if writing:
+                self._loop.add_writer (self._fd, self._notify,
+                                       self.h.aio_notify_write)
+            else:
+                self._loop.remove_writer (self._fd)
+            self._writing = writing
+
+    def _update (self):
+        dir = self.h.aio_get_direction ()
+        self._watch (bool (dir & nbd.AIO_DIRECTION_READ),
+                     bool (dir & nbd.AIO_DIRECTION_WRITE))
+
+    def _notify (self, notify):
+        try:
+            notify ()
+            self._update ()
+        except nbd.Error as e:
+            # The connection is dead, so nothing in flight can finish.
+            self._watch (False, False)
+            for fut in self._pending:
+                if not fut.done ():
+                    fut.set_exception (e)
+            self._pending.clear ()
+
+    # Issue a command with start (completion), and return a future
+    # which is done when the command completes.
+    def _submit (self, start):
+        fut = self._loop.create_future ()
+
+        def completion (err):
+            self._pending.discard (fut)
+            if not fut.done ():
+                if err.value != 0:
+                    fut.set_exception (nbd.Error (os.strerror (err.value),
+                                                  err.value))
+                else:
+                    fut.set_result (None)
+            # Auto-retire the command.
+            return 1
+
+        start (completion)
+        self._pending.add (fut)
+        self._update ()
+        return fut
+
+    async def pread (self, count, offset, flags=0):
+        '''read count bytes at offset, returning an nbd.Buffer'''
+        buf = nbd.Buffer (count)
+        await self._submit (lambda completion:
+                            self.h.aio_pread (buf, offset, completion,
+                                              flags))
+        return buf
+
+    async def pwrite (self, buf, offset, flags=0):
+        '''write the bytes-like object buf at offset'''
+        if not isinstance (buf, nbd.Buffer):
+            buf = nbd.Buffer.from_bytearray (buf)
+        await self._submit (lambda completion:
+                            self.h.aio_pwrite (buf, offset, completion,
+                                               flags))
+
+    async def block_status (self, count, offset, flags=0):
+        '''return a list of (metacontext, offset, entries) tuples'''
+        extents = []
+
+        def extent (metacontext, offset, entries, err):
+            extents.append ((metacontext, offset, entries))
+            return 0
+
+        await self._submit (lambda completion:
+                            self.h.aio_block_status (count, offset, extent,
+                                                     completion, flags))
+        return extents
+
+    async def flush (self, flags=0):
+        '''flush the export'''
+        await self._submit (lambda completion:
+                            self.h.aio_flush (completion, flags))
@@ -35,6 +35,17 @@ def shell():
     parser.add_argument ('--connect', dest='uri', help=argparse.SUPPRESS)
     parser.add_argument ('-c', '--command', action='append',
                          help="run a command")
+    parser.add_argument ('--stats', action='store_true',
+                         help="print statistics of the handle on exit")
+    parser.add_argument ('--bench', metavar='MODE',
+                         choices=['read', 'write', 'randread', 'randwrite'],
+                         help="measure the performance of the export")
+    parser.add_argument ('--bench-size', type=int, default=65536,
+                         metavar='BYTES', help="request size for --bench")
+    parser.add_argument ('--bench-depth', type=int, default=16,
+                         metavar='N', help="requests in flight for --bench")
+    parser.add_argument ('--bench-duration', type=float, default=10,
+                         metavar='SECONDS', help="how long to run --bench")
     parser.add_argument ('-V', '--version', action='version',
                          version=nbd.package_name + ' ' + nbd.__version__)
     args = parser.parse_args ()
@@ -62,9 +73,9 @@ help (nbd)                          # Display documentation
         h.connect_uri (args.uri)
     # If there are no -c or --command parameters, go interactive,
     # otherwise we run the commands and exit.
-    if not args.command:
+    if not args.command and not args.bench:
         code.interact (banner = banner, local = locals(), exitmsg = '')
-    else:
+    elif args.command:
         # https://stackoverflow.com/a/11754346
         d = dict (locals(), **globals())
         for c in args.command:
@@ -72,3 +83,45 @@ help (nbd)                          # Display documentation
                 exec (c, d, d)
             else:
                 exec (sys.stdin.read (), d, d)
+    if args.bench:
+        print_bench (args.bench,
+                     h.bench (args.bench, args.bench_size, args.bench_depth,
+                              args.bench_duration))
+    if args.stats:
+        print_stats (h)
+
+# Print the results of nbd.bench.
+def print_bench (mode, r):
+    secs = r['seconds'] or 1e-9
+    print ("%s: %d requests, %d errors in %.1fs: %.1f MB/s, %.0f IOPS, "
+           "mean latency %.0fus" %
+           (mode, r['requests'], r['errors'], r['seconds'],
+            r['bytes'] / secs / 1e6, r['requests'] / secs,
+            r['mean_latency_us']))
+
+# Print the statistics of handle h on stderr.
+def print_stats (h):
+    import sys
+
+    import nbd
+
+    types = [ ("read", nbd.CMD_READ), ("write", nbd.CMD_WRITE),
+              ("flush", nbd.CMD_FLUSH), ("trim", nbd.CMD_TRIM),
+              ("cache", nbd.CMD_CACHE), ("zero", nbd.CMD_WRITE_ZEROES),
+              ("block-status", nbd.CMD_BLOCK_STATUS) ]
+
+    h.stats_snapshot ()
+    print ("bytes sent: %d received: %d" %
+           (h.get_stats_bytes_sent (), h.get_stats_bytes_received ()),
+           file=sys.stderr)
+    print ("commands failed: %d most in flight: %d" %
+           (h.get_stats_errors (0), h.get_stats_max_in_flight ()),
+           file=sys.stderr)
+    for (name, t) in types:
+        n = h.get_stats_commands (t)
+        if n > 0:
+            print ("%s: %d commands, latency p50 <= %dus p99 <= %dus" %
+                   (name, n,
+                    h.get_stats_latency_percentile (t, 50),
+                    h.get_stats_latency_percentile (t, 99)),
+                   file=sys.stderr)
@@ -52,3 +52,21 @@ try:
     assert False
 except nbd.Error as ex:
     assert ex.errnum == errno.EPROTO
+
+# The buffer is a read-only view, which is released when the callback
+# returns.
+saved = []
+def g (buf2, offset, s, err):
+    assert isinstance (buf2, memoryview)
+    assert buf2.readonly
+    assert len (buf2) == 512
+    saved.append (buf2)
+
+buf = h.pread_structured (512, 0, g)
+assert buf == expected
+assert len (saved) == 1
+try:
+    saved[0].tobytes ()
+    assert False
+except ValueError:
+    pass
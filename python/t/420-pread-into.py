@@ -0,0 +1,46 @@
+# libnbd Python bindings
+# Copyright (C) 2010-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+import nbd
+
+h = nbd.NBD ()
+h.connect_command (["nbdkit", "-s", "--exit-with-parent", "-v",
+                    "pattern", "size=1024"])
+expected = h.pread (1024, 0)
+
+buf = bytearray (1024)
+h.pread_into (buf, 0)
+assert buf == expected
+
+# Read into the middle of a buffer through a memoryview.
+buf = bytearray (1024)
+h.pread_into (memoryview (buf)[512:], 512)
+assert buf == bytes (512) + expected[512:]
+
+# Read-only buffers are rejected.
+try:
+    h.pread_into (bytes (512), 0)
+    assert False
+except TypeError:
+    pass
+
+# An nbd.Buffer can be used in place.
+buf = nbd.Buffer (1024)
+cookie = h.aio_pread_into (memoryview (buf)[:512], 0)
+while not (h.aio_command_completed (cookie)):
+    h.poll (-1)
+assert buf == expected[:512] + bytes (512)
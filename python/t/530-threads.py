@@ -0,0 +1,68 @@
+# libnbd Python bindings
+# Copyright (C) 2010-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Several threads use their own handles at the same time, which only
+# works if the GIL is released while each of them is in libnbd.
+
+import struct
+import threading
+import nbd
+
+def expected (offset, count):
+    return b''.join ([struct.pack (">Q", i)
+                      for i in range (offset, offset + count, 8)])
+
+def worker (results, i):
+    h = nbd.NBD ()
+    h.connect_command (["nbdkit", "-s", "--exit-with-parent", "-v",
+                        "pattern", "size=1M"])
+
+    # aio_pread with completion callbacks dispatched by poll.
+    completed = []
+    bufs = []
+    for j in range (16):
+        buf = nbd.Buffer (4096)
+        offset = j * 4096
+        h.aio_pread (buf, offset,
+                     lambda err, buf=buf, offset=offset:
+                     completed.append ((buf, offset)) or 1)
+        bufs.append (buf)
+    while len (completed) < 16:
+        h.poll (-1)
+    for buf, offset in completed:
+        assert buf.to_bytearray () == expected (offset, 4096)
+
+    # Synchronous pread_structured, with a callback per chunk.
+    chunks = []
+    def f (buf, offset, status, err):
+        chunks.append ((buf, offset))
+    buf = h.pread_structured (65536, 65536 * i, f)
+    assert buf == expected (65536 * i, 65536)
+    for buf, offset in chunks:
+        assert buf == expected (offset, len (buf))
+
+    h.shutdown ()
+    results[i] = True
+
+results = [False] * 4
+threads = [threading.Thread (target=worker, args=(results, i))
+           for i in range (4)]
+for t in threads:
+    t.start ()
+for t in threads:
+    t.join ()
+assert results == [True] * 4
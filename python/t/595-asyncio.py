@@ -0,0 +1,71 @@
+# libnbd Python bindings
+# Copyright (C) 2010-2019 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+import asyncio
+import struct
+
+import nbd
+import nbdasyncio
+
+disk_size = 4 * 1024 * 1024
+bs = 65536
+
+def expected (offset, count):
+    return b''.join ([struct.pack (">Q", i)
+                      for i in range (offset, offset + count, 8)])
+
+src = nbd.NBD ()
+src.connect_command (["nbdkit", "-s", "--exit-with-parent", "-r",
+                      "pattern", "size=%d" % disk_size])
+dst = nbd.NBD ()
+dst.add_meta_context (nbd.CONTEXT_BASE_ALLOCATION)
+dst.connect_command (["nbdkit", "-s", "--exit-with-parent",
+                      "memory", "size=%d" % disk_size])
+
+async def copy_block (asrc, adst, offset):
+    buf = await asrc.pread (bs, offset)
+    await adst.pwrite (buf, offset)
+
+async def main ():
+    asrc = nbdasyncio.Handle (src)
+    adst = nbdasyncio.Handle (dst)
+
+    # Every block of the copy is in flight at once.
+    await asyncio.gather (*[copy_block (asrc, adst, offset)
+                            for offset in range (0, disk_size, bs)])
+    await adst.flush ()
+
+    buf = await adst.pread (bs, disk_size - bs)
+    assert buf == expected (disk_size - bs, bs)
+    await adst.pwrite (b'\0' * 512, 0)
+
+    extents = await adst.block_status (bs, 0)
+    assert len (extents) > 0
+    for metacontext, offset, entries in extents:
+        assert metacontext == nbd.CONTEXT_BASE_ALLOCATION
+        assert offset == 0
+        assert sum (entries[0::2]) <= bs
+
+    asrc.close ()
+    adst.close ()
+
+asyncio.run (main ())
+
+assert src.aio_in_flight () == 0
+assert dst.aio_in_flight () == 0
+for offset in range (512, disk_size, 1024 * 1024):
+    assert dst.pread (512, offset) == expected (offset, 512)
@@ -0,0 +1,396 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Benchmarks and bulk transfers for nbdsh.  These keep many commands
+ * in flight with the aio calls and run without the GIL, so that they
+ * measure the server and not the Python interpreter.
+ */
+
+#include <config.h>
+
+#define PY_SSIZE_T_CLEAN 1
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <libnbd.h>
+
+#include "methods.h"
+
+enum transfer_mode {
+  BENCH_READ,
+  BENCH_WRITE,
+  DOWNLOAD,                     /* export -> fd */
+  UPLOAD,                       /* fd -> export */
+};
+
+struct slot {
+  char *buf;
+  uint64_t offset;
+  uint32_t len;
+  uint64_t start_ns;
+  bool busy;                    /* Command in flight. */
+  bool done;                    /* Completed, not yet handled. */
+  int error;
+};
+
+struct transfer {
+  struct nbd_handle *h;
+  enum transfer_mode mode;
+  bool random;
+  int fd;
+  uint64_t size;                /* Bytes to transfer, or export size. */
+  uint32_t request_size;
+  unsigned depth;
+  uint64_t end_ns;              /* Benchmarks stop submitting then. */
+  uint64_t next_offset;
+  uint64_t rand_state;
+
+  /* Results. */
+  uint64_t requests, bytes, errors, latency_ns;
+
+  /* Set if the transfer failed, to raise nbd.Error (if libnbd
+   * failed) or OSError.
+   */
+  int err;
+  bool nbd_error;
+  char msg[256];
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* xorshift64*, good enough to spread random offsets. */
+static uint64_t
+next_random (struct transfer *t)
+{
+  t->rand_state ^= t->rand_state >> 12;
+  t->rand_state ^= t->rand_state << 25;
+  t->rand_state ^= t->rand_state >> 27;
+  return t->rand_state * UINT64_C (2685821657736338717);
+}
+
+static void
+set_error (struct transfer *t, int err, const char *what)
+{
+  if (t->err != 0)
+    return;
+  t->err = err;
+  t->nbd_error = what == NULL;
+  snprintf (t->msg, sizeof t->msg, "%s",
+            what ? what : nbd_get_error ());
+}
+
+static int
+slot_completed (void *vp, int *error)
+{
+  struct slot *s = vp;
+
+  s->done = true;
+  s->error = *error;
+  return 1;
+}
+
+/* Pick the next request for a free slot.  Returns false if there is
+ * nothing more to do.
+ */
+static bool
+next_request (struct transfer *t, struct slot *s)
+{
+  uint64_t blocks;
+
+  if (t->err != 0)
+    return false;
+
+  switch (t->mode) {
+  case BENCH_READ:
+  case BENCH_WRITE:
+    if (now_ns () >= t->end_ns)
+      return false;
+    s->len = t->request_size;
+    if (t->random) {
+      blocks = t->size / t->request_size;
+      s->offset = (next_random (t) % blocks) * t->request_size;
+    }
+    else {
+      if (t->next_offset + t->request_size > t->size)
+        t->next_offset = 0;
+      s->offset = t->next_offset;
+      t->next_offset += t->request_size;
+    }
+    return true;
+
+  case DOWNLOAD:
+  case UPLOAD:
+    if (t->next_offset >= t->size)
+      return false;
+    s->offset = t->next_offset;
+    s->len = t->request_size;
+    if (s->len > t->size - s->offset)
+      s->len = t->size - s->offset;
+    t->next_offset += s->len;
+    return true;
+  }
+  abort ();
+}
+
+static int
+submit (struct transfer *t, struct slot *s)
+{
+  nbd_completion_callback cb = { .callback = slot_completed, .user_data = s };
+  ssize_t r;
+  int64_t cookie;
+
+  if (t->mode == UPLOAD) {
+    r = pread (t->fd, s->buf, s->len, s->offset);
+    if (r != (ssize_t) s->len) {
+      set_error (t, r == -1 ? errno : EIO, "read");
+      return -1;
+    }
+  }
+
+  s->busy = true;
+  s->done = false;
+  s->start_ns = now_ns ();
+  if (t->mode == BENCH_READ || t->mode == DOWNLOAD)
+    cookie = nbd_aio_pread (t->h, s->buf, s->len, s->offset, cb, 0);
+  else
+    cookie = nbd_aio_pwrite (t->h, s->buf, s->len, s->offset, cb, 0);
+  if (cookie == -1) {
+    s->busy = false;
+    set_error (t, nbd_get_errno () ? nbd_get_errno () : EIO, NULL);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+finish (struct transfer *t, struct slot *s)
+{
+  ssize_t r;
+
+  s->busy = s->done = false;
+  t->requests++;
+  t->latency_ns += now_ns () - s->start_ns;
+  if (s->error != 0) {
+    t->errors++;
+    if (t->mode == DOWNLOAD || t->mode == UPLOAD)
+      set_error (t, s->error, t->mode == DOWNLOAD ? "NBD read" : "NBD write");
+    return;
+  }
+  t->bytes += s->len;
+
+  if (t->mode == DOWNLOAD && t->err == 0) {
+    r = pwrite (t->fd, s->buf, s->len, s->offset);
+    if (r != (ssize_t) s->len)
+      set_error (t, r == -1 ? errno : EIO, "write");
+  }
+}
+
+/* Run the transfer with the GIL released.  Commands which are in
+ * flight when something fails are waited for, since they use the
+ * buffers.  Returns -1 on error, with the error in t.
+ */
+static int
+run (struct transfer *t)
+{
+  struct slot *slots;
+  unsigned i, in_flight = 0;
+  int ret = -1;
+
+  slots = calloc (t->depth, sizeof *slots);
+  if (slots == NULL) {
+    set_error (t, errno, "calloc");
+    return -1;
+  }
+  for (i = 0; i < t->depth; ++i) {
+    slots[i].buf = malloc (t->request_size);
+    if (slots[i].buf == NULL) {
+      set_error (t, errno, "malloc");
+      goto out;
+    }
+    /* Data which the server cannot trivially compress or detect as
+     * zeroes.
+     */
+    if (t->mode == BENCH_WRITE)
+      memset (slots[i].buf, 0x55 + i, t->request_size);
+  }
+
+  for (;;) {
+    for (i = 0; i < t->depth; ++i) {
+      if (slots[i].done) {
+        finish (t, &slots[i]);
+        in_flight--;
+      }
+      if (!slots[i].busy && next_request (t, &slots[i])) {
+        if (submit (t, &slots[i]) == -1)
+          break;
+        in_flight++;
+      }
+    }
+    if (in_flight == 0)
+      break;
+    if (nbd_poll (t->h, -1) == -1) {
+      /* The handle is dead, so nothing is in flight any more. */
+      set_error (t, nbd_get_errno () ? nbd_get_errno () : EIO, NULL);
+      goto out;
+    }
+  }
+
+  if (t->err == 0)
+    ret = 0;
+
+ out:
+  for (i = 0; i < t->depth; ++i)
+    free (slots[i].buf);
+  free (slots);
+  return ret;
+}
+
+static PyObject *
+run_transfer (struct transfer *t)
+{
+  struct py_gil py_gil;
+  uint64_t elapsed;
+  int64_t size;
+  int r;
+
+  size = nbd_get_size (t->h);
+  if (size == -1) {
+    raise_exception ();
+    return NULL;
+  }
+  if (t->mode != UPLOAD)
+    t->size = size;
+  else if (t->size > (uint64_t) size) {
+    PyErr_SetString (PyExc_ValueError, "the file is larger than the export");
+    return NULL;
+  }
+  if (t->depth == 0 || t->request_size == 0 ||
+      ((t->mode == BENCH_READ || t->mode == BENCH_WRITE) &&
+       t->size < t->request_size)) {
+    PyErr_SetString (PyExc_ValueError,
+                     "depth and request size must be non-zero, and "
+                     "no larger than the export");
+    return NULL;
+  }
+  t->rand_state = now_ns () | 1;
+
+  nbd_internal_py_release_gil (&py_gil, false);
+  elapsed = now_ns ();
+  r = run (t);
+  elapsed = now_ns () - elapsed;
+  nbd_internal_py_restore_gil (&py_gil);
+
+  if (r == -1) {
+    if (t->nbd_error) {
+      PyObject *err = Py_BuildValue ("si", t->msg, t->err);
+
+      if (err != NULL) {
+        PyErr_SetObject (nbd_internal_py_Error, err);
+        Py_DECREF (err);
+      }
+    }
+    else {
+      errno = t->err;
+      PyErr_SetFromErrnoWithFilename (PyExc_OSError, t->msg);
+    }
+    return NULL;
+  }
+
+  return Py_BuildValue ("{s:K,s:K,s:K,s:d,s:d}",
+                        "requests", (unsigned long long) t->requests,
+                        "bytes", (unsigned long long) t->bytes,
+                        "errors", (unsigned long long) t->errors,
+                        "seconds", elapsed / 1e9,
+                        "mean_latency_us",
+                        t->requests ?
+                        t->latency_ns / 1e3 / t->requests : 0.0);
+}
+
+/* Run a read or write benchmark for a number of seconds. */
+PyObject *
+nbd_internal_py_bench (PyObject *self, PyObject *args)
+{
+  PyObject *py_h;
+  struct transfer t = { .fd = -1 };
+  int write, random;
+  double duration;
+
+  if (!PyArg_ParseTuple (args, (char *) "OppIId:nbd_bench",
+                         &py_h, &write, &random, &t.request_size,
+                         &t.depth, &duration))
+    return NULL;
+  if (duration < 0) {
+    PyErr_SetString (PyExc_ValueError, "duration must not be negative");
+    return NULL;
+  }
+  t.h = get_handle (py_h);
+  t.mode = write ? BENCH_WRITE : BENCH_READ;
+  t.random = random;
+  t.end_ns = now_ns () + (uint64_t) (duration * 1e9);
+  return run_transfer (&t);
+}
+
+/* Copy the whole export to fd, or fd to the start of the export. */
+static PyObject *
+copy_fd (PyObject *args, enum transfer_mode mode)
+{
+  PyObject *py_h;
+  struct transfer t = { .mode = mode };
+  struct stat statbuf;
+
+  if (!PyArg_ParseTuple (args, (char *) "OiII:nbd_copy_fd",
+                         &py_h, &t.fd, &t.request_size, &t.depth))
+    return NULL;
+  t.h = get_handle (py_h);
+  if (mode == UPLOAD) {
+    if (fstat (t.fd, &statbuf) == -1) {
+      PyErr_SetFromErrno (PyExc_OSError);
+      return NULL;
+    }
+    t.size = statbuf.st_size;
+  }
+  return run_transfer (&t);
+}
+
+PyObject *
+nbd_internal_py_download (PyObject *self, PyObject *args)
+{
+  return copy_fd (args, DOWNLOAD);
+}
+
+PyObject *
+nbd_internal_py_upload (PyObject *self, PyObject *args)
+{
+  return copy_fd (args, UPLOAD);
+}
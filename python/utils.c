@@ -25,7 +25,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <libnbd.h>
 
@@ -83,3 +86,75 @@ nbd_internal_py_free_string_list (char **argv)
     free (argv[i]);
   free (argv);
 }
+
+/* The GIL is released while libnbd is called, so other Python threads
+ * can run while this one waits for the server.  Each thread keeps a
+ * stack of the struct py_gil of the calls it is in, so that a
+ * callback made by libnbd can take the GIL back from the call which
+ * released it.  When the call batches callbacks, the GIL is kept
+ * until the call returns, so a call such as nbd.poll which completes
+ * many commands only takes the GIL once.
+ */
+static pthread_key_t gil_key;
+
+int
+nbd_internal_py_init_gil (void)
+{
+  int err;
+
+  err = pthread_key_create (&gil_key, NULL);
+  if (err != 0) {
+    errno = err;
+    PyErr_SetFromErrno (PyExc_OSError);
+    return -1;
+  }
+  return 0;
+}
+
+void
+nbd_internal_py_release_gil (struct py_gil *gil, bool batch)
+{
+  gil->batch = batch;
+  gil->prev = pthread_getspecific (gil_key);
+  pthread_setspecific (gil_key, gil);
+  gil->ts = PyEval_SaveThread ();
+}
+
+void
+nbd_internal_py_restore_gil (struct py_gil *gil)
+{
+  /* ts is NULL if a callback has already taken the GIL back. */
+  if (gil->ts != NULL)
+    PyEval_RestoreThread (gil->ts);
+  pthread_setspecific (gil_key, gil->prev);
+}
+
+void
+nbd_internal_py_callback_enter (struct py_callback_gil *cb)
+{
+  struct py_gil *gil = pthread_getspecific (gil_key);
+
+  if (gil != NULL && gil->ts != NULL) {
+    PyEval_RestoreThread (gil->ts);
+    gil->ts = NULL;
+    cb->gil = gil;
+  }
+  else {
+    /* Either this thread already holds the GIL, or the callback is
+     * not being called from inside a binding.
+     */
+    cb->gil = NULL;
+    cb->state = PyGILState_Ensure ();
+  }
+}
+
+void
+nbd_internal_py_callback_leave (struct py_callback_gil *cb)
+{
+  if (cb->gil != NULL) {
+    if (!cb->gil->batch)
+      cb->gil->ts = PyEval_SaveThread ();
+  }
+  else
+    PyGILState_Release (cb->state);
+}
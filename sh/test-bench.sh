@@ -0,0 +1,47 @@
+#!/usr/bin/env bash
+# nbd client library in userspace
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Test nbdsh --bench and the download and upload methods.
+
+. ../tests/functions.sh
+requires nbdkit --exit-with-parent --version
+requires nbdsh -c 'exit(not h.supports_uri())'
+
+in=test-bench.in
+out=test-bench.out
+cleanup_fn rm -f $in $out
+
+# A benchmark which is short but still completes some requests.
+output=$(nbdkit -U - memory size=1M --run 'nbdsh \
+    -u "nbd+unix://?socket=$unixsocket" \
+    --bench randwrite --bench-size 4096 --bench-depth 8 \
+    --bench-duration 0.5')
+echo "$output"
+case "$output" in
+    "randwrite: "*" requests, 0 errors in "*) ;;
+    *) echo "$0: unexpected output: $output"; exit 1 ;;
+esac
+
+# Upload a file which is not a multiple of the request size, then
+# download the whole export and compare.
+dd if=/dev/urandom of=$in bs=1000 count=300 2>/dev/null
+nbdkit -U - memory size=300000 --run 'nbdsh \
+    -u "nbd+unix://?socket=$unixsocket" \
+    -c "assert h.upload (\"'$in'\", 65536, 4)[\"bytes\"] == 300000" \
+    -c "assert h.download (\"'$out'\", 65536, 4)[\"errors\"] == 0"'
+cmp $in $out
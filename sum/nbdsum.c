@@ -0,0 +1,659 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Checksum or compare NBD exports.
+ *
+ * The export is divided into chunks, and each chunk is hashed with
+ * XXH64.  The checksum of the export is the XXH64 of the chunk hashes.
+ * The main thread keeps reads for many chunks in flight over all the
+ * connections of a group, and worker threads hash the chunks which
+ * have been read.  Chunks which the server says read as zeroes are
+ * not read at all.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "xxhash.h"
+
+#define MAX_CHUNK_SIZE (32 * 1024 * 1024)
+
+static int connections = 4;
+static unsigned requests = 32;
+static unsigned chunk_size = 1024 * 1024;
+static unsigned threads;
+static bool stats;
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_READING,                 /* Reads in flight. */
+  SLOT_HASHING,                 /* Queued for or being hashed by a worker. */
+};
+
+struct sum;
+
+struct slot {
+  struct sum *sum;
+  char *buf;
+  uint64_t chunk;
+  uint32_t len;
+  unsigned pending;             /* Reads of this chunk in flight. */
+  int error;
+  enum slot_state state;
+  struct slot *next;            /* In the hash queue. */
+};
+
+struct sum {
+  const char *uri;
+  struct nbd_group *g;
+  uint64_t size;
+  uint64_t nr_chunks;
+  uint64_t *digests;            /* One for each chunk. */
+
+  struct nbd_extent *extents;
+  size_t nr_extents;
+  size_t ext;                   /* First extent not wholly before next_chunk. */
+  uint64_t next_chunk;
+  unsigned in_flight;           /* Reads in flight. */
+
+  /* Hashes of a whole chunk and of the last chunk if it is shorter,
+   * when they are all zeroes.
+   */
+  uint64_t zero_digest, zero_tail_digest;
+
+  struct slot *slots;
+
+  /* Protects the slot states, the hash queue and quit. */
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;     /* Signalled when work is queued. */
+  pthread_cond_t free_cond;     /* Signalled when a slot is freed. */
+  struct slot *queue, **queue_tail;
+  bool quit;
+
+  uint64_t bytes_read, bytes_zero, elapsed_ns;
+};
+
+static void __attribute__((noreturn))
+usage (FILE *fp, int exitcode)
+{
+  fprintf (fp,
+"\n"
+"Checksum or compare NBD exports:\n"
+"\n"
+"    nbdsum [-C N|--connections=N] [-R N|--requests=N]\n"
+"           [--chunk-size=N] [--threads=N] [--stats]\n"
+"           URI [URI]\n"
+"\n"
+"With one URI the checksum of the export is printed.  With two the\n"
+"exports are compared, for example:\n"
+"\n"
+"    nbdsum nbd://example.com\n"
+"    nbdsum nbd://example.com nbd+unix:///?socket=/tmp/sock\n"
+"\n"
+"Please read the nbdsum(1) manual page for full usage.\n"
+"\n"
+);
+  exit (exitcode);
+}
+
+static void
+display_version (void)
+{
+  printf ("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+/* Connect a group to uri, using a single connection if the server
+ * does not support multi-conn.
+ */
+static struct nbd_group *
+connect_group (const char *uri)
+{
+  struct nbd_group *g;
+  int i, n = connections;
+
+ again:
+  g = nbd_group_create (n);
+  if (g == NULL) {
+    fprintf (stderr, "nbdsum: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  /* Ask which parts read as zeroes, so they can be skipped. */
+  for (i = 0; i < n; ++i) {
+    if (nbd_add_meta_context (nbd_group_get_handle (g, i),
+                              LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+      fprintf (stderr, "nbdsum: %s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_group_connect_uri (g, uri) == -1) {
+    if (n > 1 && nbd_get_errno () == ENOTSUP) {
+      nbd_group_close (g);
+      n = 1;
+      goto again;
+    }
+    fprintf (stderr, "nbdsum: %s: %s\n", uri, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return g;
+}
+
+static unsigned
+parse_unsigned (const char *option, const char *arg)
+{
+  unsigned long v;
+  char *end;
+
+  errno = 0;
+  v = strtoul (arg, &end, 0);
+  if (errno != 0 || end == arg || *end != '\0' || v > UINT_MAX) {
+    fprintf (stderr, "nbdsum: could not parse %s: %s\n", option, arg);
+    exit (EXIT_FAILURE);
+  }
+  return v;
+}
+
+/* Find the extents of the export.  If the server cannot tell us,
+ * the whole export is treated as data.
+ */
+static int
+map_export (struct sum *s)
+{
+  struct nbd_handle *h = nbd_group_get_handle (s->g, 0);
+  int64_t n;
+  int r;
+
+  r = nbd_can_meta_context (h, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  if (r == -1)
+    return -1;
+  if (r == 1 && s->size > 0) {
+    n = nbd_group_map (s->g, LIBNBD_CONTEXT_BASE_ALLOCATION, 0,
+                       &s->extents);
+    if (n == -1)
+      return -1;
+    s->nr_extents = n;
+    return 0;
+  }
+
+  s->extents = calloc (1, sizeof s->extents[0]);
+  if (s->extents == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  s->extents[0].length = s->size;
+  s->nr_extents = 1;
+  return 0;
+}
+
+static void *
+worker (void *vp)
+{
+  struct sum *s = vp;
+  struct slot *slot;
+  uint64_t digest;
+
+  pthread_mutex_lock (&s->lock);
+  for (;;) {
+    while (s->queue == NULL && !s->quit)
+      pthread_cond_wait (&s->work_cond, &s->lock);
+    if (s->queue == NULL)
+      break;
+    slot = s->queue;
+    s->queue = slot->next;
+    if (s->queue == NULL)
+      s->queue_tail = &s->queue;
+    pthread_mutex_unlock (&s->lock);
+
+    digest = xxh64 (slot->buf, slot->len, 0);
+
+    pthread_mutex_lock (&s->lock);
+    s->digests[slot->chunk] = digest;
+    slot->state = SLOT_FREE;
+    pthread_cond_signal (&s->free_cond);
+  }
+  pthread_mutex_unlock (&s->lock);
+  return NULL;
+}
+
+static int
+read_completed (void *vp, int *error)
+{
+  struct slot *slot = vp;
+
+  if (*error != 0 && slot->error == 0)
+    slot->error = *error;
+  slot->pending--;
+  slot->sum->in_flight--;
+  return 1;
+}
+
+static bool
+is_zero_extent (const struct nbd_extent *e)
+{
+  return (e->flags & LIBNBD_STATE_ZERO) != 0;
+}
+
+/* Start on the next chunk of the export.  If the whole chunk reads as
+ * zeroes its hash is known already and slot is not used.  Otherwise
+ * the parts of it which are data are read into slot and the rest is
+ * cleared.  Returns -1 on error.
+ */
+static int
+start_chunk (struct sum *s, struct slot *slot, bool *used)
+{
+  uint64_t chunk = s->next_chunk++;
+  uint64_t offset = chunk * chunk_size;
+  uint64_t end = offset + chunk_size;
+  uint64_t start, stop;
+  size_t i;
+  bool zero = true;
+  int64_t cookie;
+
+  if (end > s->size)
+    end = s->size;
+
+  while (s->ext < s->nr_extents &&
+         s->extents[s->ext].offset + s->extents[s->ext].length <= offset)
+    s->ext++;
+  for (i = s->ext; i < s->nr_extents && s->extents[i].offset < end; ++i) {
+    if (!is_zero_extent (&s->extents[i])) {
+      zero = false;
+      break;
+    }
+  }
+
+  *used = !zero;
+  if (zero) {
+    s->digests[chunk] =
+      end - offset == chunk_size ? s->zero_digest : s->zero_tail_digest;
+    s->bytes_zero += end - offset;
+    return 0;
+  }
+
+  slot->chunk = chunk;
+  slot->len = end - offset;
+  slot->pending = 0;
+  slot->error = 0;
+  slot->state = SLOT_READING;
+  for (i = s->ext; i < s->nr_extents && s->extents[i].offset < end; ++i) {
+    start = s->extents[i].offset > offset ? s->extents[i].offset : offset;
+    stop = s->extents[i].offset + s->extents[i].length;
+    if (stop > end)
+      stop = end;
+
+    if (is_zero_extent (&s->extents[i])) {
+      memset (slot->buf + (start - offset), 0, stop - start);
+      s->bytes_zero += stop - start;
+      continue;
+    }
+
+    cookie = nbd_aio_pread (nbd_group_select (s->g, start),
+                            slot->buf + (start - offset), stop - start, start,
+                            (nbd_completion_callback) {
+                              .callback = read_completed,
+                              .user_data = slot },
+                            0);
+    if (cookie == -1)
+      return -1;
+    slot->pending++;
+    s->in_flight++;
+    s->bytes_read += stop - start;
+  }
+  return 0;
+}
+
+/* Hash the whole export into s->digests.  Returns -1 on error, after
+ * printing it.
+ */
+static int
+run (struct sum *s)
+{
+  pthread_t *workers;
+  unsigned i, reading, hashing;
+  uint64_t start_ns = now_ns ();
+  struct slot *slot;
+  bool used = false, failed = false;
+  int err;
+
+  workers = calloc (threads, sizeof *workers);
+  s->slots = calloc (requests, sizeof s->slots[0]);
+  if (workers == NULL || s->slots == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < requests; ++i) {
+    s->slots[i].sum = s;
+    s->slots[i].buf = malloc (chunk_size);
+    if (s->slots[i].buf == NULL) {
+      perror ("malloc");
+      exit (EXIT_FAILURE);
+    }
+  }
+  s->queue = NULL;
+  s->queue_tail = &s->queue;
+  s->quit = false;
+  pthread_mutex_init (&s->lock, NULL);
+  pthread_cond_init (&s->work_cond, NULL);
+  pthread_cond_init (&s->free_cond, NULL);
+
+  for (i = 0; i < threads; ++i) {
+    err = pthread_create (&workers[i], NULL, worker, s);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  pthread_mutex_lock (&s->lock);
+  for (;;) {
+    /* Hand the chunks which have been read to the workers. */
+    reading = hashing = 0;
+    for (i = 0; i < requests; ++i) {
+      slot = &s->slots[i];
+      if (slot->state == SLOT_READING && slot->pending == 0) {
+        if (slot->error != 0) {
+          fprintf (stderr, "nbdsum: %s: read at offset %" PRIu64 ": %s\n",
+                   s->uri, slot->chunk * chunk_size, strerror (slot->error));
+          slot->state = SLOT_FREE;
+          s->next_chunk = s->nr_chunks; /* Wait for the rest, then fail. */
+          failed = true;
+          continue;
+        }
+        slot->state = SLOT_HASHING;
+        slot->next = NULL;
+        *s->queue_tail = slot;
+        s->queue_tail = &slot->next;
+        pthread_cond_signal (&s->work_cond);
+      }
+      if (slot->state == SLOT_READING)
+        reading++;
+      else if (slot->state == SLOT_HASHING)
+        hashing++;
+    }
+
+    /* Start reading more chunks into the free slots. */
+    for (i = 0; i < requests && s->next_chunk < s->nr_chunks; ++i) {
+      slot = &s->slots[i];
+      if (slot->state != SLOT_FREE)
+        continue;
+      do {
+        if (start_chunk (s, slot, &used) == -1) {
+          fprintf (stderr, "nbdsum: %s: %s\n", s->uri, nbd_get_error ());
+          slot->state = slot->pending > 0 ? SLOT_READING : SLOT_FREE;
+          s->next_chunk = s->nr_chunks;
+          failed = true;
+          break;
+        }
+      } while (!used && s->next_chunk < s->nr_chunks);
+      if (used)
+        reading++;
+    }
+
+    if (s->in_flight > 0) {
+      pthread_mutex_unlock (&s->lock);
+      if (nbd_group_poll (s->g, -1) == -1) {
+        fprintf (stderr, "nbdsum: %s: %s\n", s->uri, nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      pthread_mutex_lock (&s->lock);
+    }
+    else if (reading > 0)
+      continue;                 /* Reads completed during start_chunk. */
+    else if (hashing > 0)
+      pthread_cond_wait (&s->free_cond, &s->lock);
+    else
+      break;
+  }
+  s->quit = true;
+  pthread_cond_broadcast (&s->work_cond);
+  pthread_mutex_unlock (&s->lock);
+
+  for (i = 0; i < threads; ++i)
+    pthread_join (workers[i], NULL);
+  free (workers);
+  for (i = 0; i < requests; ++i)
+    free (s->slots[i].buf);
+  free (s->slots);
+  s->elapsed_ns = now_ns () - start_ns;
+  return failed ? -1 : 0;
+}
+
+static void
+sum_export (struct sum *s, const char *uri)
+{
+  int64_t size;
+  char *zeroes;
+  uint64_t tail;
+
+  memset (s, 0, sizeof *s);
+  s->uri = uri;
+  s->g = connect_group (uri);
+  size = nbd_get_size (nbd_group_get_handle (s->g, 0));
+  if (size == -1) {
+    fprintf (stderr, "nbdsum: %s: %s\n", uri, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  s->size = size;
+  if (map_export (s) == -1) {
+    fprintf (stderr, "nbdsum: %s: %s\n", uri, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  s->nr_chunks = (s->size + chunk_size - 1) / chunk_size;
+  s->digests = calloc (s->nr_chunks ? s->nr_chunks : 1, sizeof s->digests[0]);
+  zeroes = calloc (1, chunk_size);
+  if (s->digests == NULL || zeroes == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  tail = s->size % chunk_size;
+  s->zero_digest = xxh64 (zeroes, chunk_size, 0);
+  s->zero_tail_digest = xxh64 (zeroes, tail, 0);
+  free (zeroes);
+
+  if (run (s) == -1)
+    exit (EXIT_FAILURE);
+
+  nbd_group_shutdown (s->g, 0);
+  nbd_group_close (s->g);
+  s->g = NULL;
+  free (s->extents);
+}
+
+static uint64_t
+export_digest (const struct sum *s)
+{
+  uint64_t *le, i, digest;
+
+  le = malloc ((s->nr_chunks ? s->nr_chunks : 1) * sizeof le[0]);
+  if (le == NULL) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < s->nr_chunks; ++i)
+    le[i] = htole64 (s->digests[i]);
+  digest = xxh64 (le, s->nr_chunks * sizeof le[0], 0);
+  free (le);
+  return digest;
+}
+
+static void
+print_stats (const struct sum *s)
+{
+  double secs = s->elapsed_ns / 1e9;
+
+  fprintf (stderr, "%s: read %" PRIu64 " bytes and skipped %" PRIu64
+           " bytes of zeroes in %.3f seconds", s->uri, s->bytes_read,
+           s->bytes_zero, secs);
+  if (secs > 0)
+    fprintf (stderr, " (%.1f MB/s)", s->size / secs / 1e6);
+  fprintf (stderr, "\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum {
+    HELP_OPTION = CHAR_MAX + 1,
+    CHUNK_SIZE_OPTION,
+    STATS_OPTION,
+    THREADS_OPTION,
+  };
+  const char *short_options = "C:R:V";
+  const struct option long_options[] = {
+    { "chunk-size",          required_argument, NULL, CHUNK_SIZE_OPTION },
+    { "connections",         required_argument, NULL, 'C' },
+    { "help",                no_argument,       NULL, HELP_OPTION },
+    { "requests",            required_argument, NULL, 'R' },
+    { "stats",               no_argument,       NULL, STATS_OPTION },
+    { "threads",             required_argument, NULL, THREADS_OPTION },
+    { "version",             no_argument,       NULL, 'V' },
+    { NULL }
+  };
+  int c;
+  long n;
+  struct sum *sums;
+  int nr_uris, i;
+  uint64_t chunk, differ = 0, len;
+
+  for (;;) {
+    c = getopt_long (argc, argv, short_options, long_options, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case HELP_OPTION:
+      usage (stdout, EXIT_SUCCESS);
+
+    case CHUNK_SIZE_OPTION:
+      chunk_size = parse_unsigned ("chunk size", optarg);
+      if (chunk_size < 512 || chunk_size > MAX_CHUNK_SIZE) {
+        fprintf (stderr, "nbdsum: chunk size must be between 512 and %d\n",
+                 MAX_CHUNK_SIZE);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case 'C':
+      connections = parse_unsigned ("connections", optarg);
+      if (connections < 1) {
+        fprintf (stderr, "nbdsum: there must be at least 1 connection\n");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case 'R':
+      requests = parse_unsigned ("requests", optarg);
+      if (requests < 1) {
+        fprintf (stderr, "nbdsum: there must be at least 1 request\n");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case STATS_OPTION:
+      stats = true;
+      break;
+
+    case THREADS_OPTION:
+      threads = parse_unsigned ("threads", optarg);
+      if (threads < 1) {
+        fprintf (stderr, "nbdsum: there must be at least 1 thread\n");
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case 'V':
+      display_version ();
+      exit (EXIT_SUCCESS);
+
+    default:
+      usage (stderr, EXIT_FAILURE);
+    }
+  }
+
+  nr_uris = argc - optind;
+  if (nr_uris < 1 || nr_uris > 2)
+    usage (stderr, EXIT_FAILURE);
+
+  if (threads == 0) {
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+    threads = n > 0 ? n : 1;
+  }
+
+  sums = calloc (nr_uris, sizeof sums[0]);
+  if (sums == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_uris; ++i) {
+    sum_export (&sums[i], argv[optind+i]);
+    if (stats)
+      print_stats (&sums[i]);
+  }
+
+  if (nr_uris == 1) {
+    printf ("%016" PRIx64 "  %s\n", export_digest (&sums[0]), sums[0].uri);
+    free (sums[0].digests);
+    free (sums);
+    exit (EXIT_SUCCESS);
+  }
+
+  /* Compare the two exports chunk by chunk. */
+  if (sums[0].size != sums[1].size) {
+    printf ("%s and %s differ in size: %" PRIu64 " and %" PRIu64 "\n",
+            sums[0].uri, sums[1].uri, sums[0].size, sums[1].size);
+    exit (EXIT_FAILURE);
+  }
+  for (chunk = 0; chunk < sums[0].nr_chunks; ++chunk) {
+    if (sums[0].digests[chunk] != sums[1].digests[chunk]) {
+      len = sums[0].size - chunk * chunk_size;
+      if (len > chunk_size)
+        len = chunk_size;
+      printf ("%s and %s differ at offset %" PRIu64 " length %" PRIu64 "\n",
+              sums[0].uri, sums[1].uri, chunk * chunk_size, len);
+      differ++;
+    }
+  }
+  for (i = 0; i < nr_uris; ++i)
+    free (sums[i].digests);
+  free (sums);
+  exit (differ == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+# nbd client library in userspace
+# Copyright (C) 2019 Red Hat Inc.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Test nbdsum + nbdkit: checksum a sparse file with different
+# settings, and compare it with a copy which has been changed.
+
+. ../tests/functions.sh
+
+set -e
+set -x
+
+requires nbdkit --exit-with-parent --version
+requires nbdsh -c 'exit (not h.supports_uri ())'
+requires cmp --version
+requires dd --version
+requires truncate --version
+
+if ! test -r /dev/urandom; then
+    echo "$0: test skipped: /dev/urandom not readable"
+    exit 77
+fi
+
+data=test-nbdsum.data
+copy=test-nbdsum.copy
+sum1=test-nbdsum.sum1
+sum2=test-nbdsum.sum2
+out=test-nbdsum.out
+cleanup_fn rm -f $data $copy $sum1 $sum2 $out
+
+# Data at the start and the end, with a hole in the middle.
+rm -f $data $copy $sum1 $sum2 $out
+dd if=/dev/urandom of=$data bs=1M count=1
+truncate -s 9M $data
+dd if=/dev/urandom of=$data bs=1M count=1 seek=9 conv=notrunc
+
+# The checksum does not depend on how the export is read.
+nbdkit -U - --exit-with-parent file $data \
+       --run "$VG nbdsum --stats \$uri > $sum1 &&
+              $VG nbdsum -C 1 -R 1 --threads=1 \$uri > $sum2"
+cat $sum1
+cmp $sum1 $sum2
+
+# Identical exports compare equal.
+cp $data $copy
+nbdkit -U - --exit-with-parent file $data \
+       --run "export uri1=\$uri
+              nbdkit -U - --exit-with-parent file $copy \
+                     --run '$VG nbdsum \$uri1 \$uri > $out'"
+test ! -s $out
+
+# Change one byte in the hole and one in the data, and both are found.
+printf x | dd of=$copy bs=1 seek=$((5*1024*1024 + 100)) conv=notrunc
+printf x | dd of=$copy bs=1 seek=$((9*1024*1024 + 4096)) conv=notrunc
+if nbdkit -U - --exit-with-parent file $data \
+          --run "export uri1=\$uri
+                 nbdkit -U - --exit-with-parent file $copy \
+                        --run '$VG nbdsum \$uri1 \$uri > $out'"; then
+    echo "$0: nbdsum did not find the differences"
+    exit 1
+fi
+cat $out
+test "$(wc -l < $out)" -eq 2
+grep -q "differ at offset 5242880 length 1048576" $out
+grep -q "differ at offset 9437184 length 1048576" $out
@@ -0,0 +1,141 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* XXH64, the 64 bit hash from xxHash by Yann Collet, written from the
+ * specification at
+ * https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ *
+ * The four accumulators are independent of each other, so the
+ * compiler and CPU can work on them at the same time, and the whole
+ * thing runs at several GB/s on one core without any special
+ * instructions.
+ */
+
+#ifndef NBDSUM_XXHASH_H
+#define NBDSUM_XXHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "byte-swapping.h"
+
+#define XXH_PRIME64_1 UINT64_C (0x9E3779B185EBCA87)
+#define XXH_PRIME64_2 UINT64_C (0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3 UINT64_C (0x165667B19E3779F9)
+#define XXH_PRIME64_4 UINT64_C (0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5 UINT64_C (0x27D4EB2F165667C5)
+
+static inline uint64_t
+xxh_rotl64 (uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh_read64 (const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le64toh (v);
+}
+
+static inline uint32_t
+xxh_read32 (const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy (&v, p, sizeof v);
+  return le32toh (v);
+}
+
+static inline uint64_t
+xxh64_round (uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = xxh_rotl64 (acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge_round (uint64_t acc, uint64_t val)
+{
+  acc ^= xxh64_round (0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline uint64_t
+xxh64 (const void *buf, size_t len, uint64_t seed)
+{
+  const unsigned char *p = buf;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    const unsigned char *limit = end - 32;
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+
+    do {
+      v1 = xxh64_round (v1, xxh_read64 (p));
+      v2 = xxh64_round (v2, xxh_read64 (p + 8));
+      v3 = xxh64_round (v3, xxh_read64 (p + 16));
+      v4 = xxh64_round (v4, xxh_read64 (p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = xxh_rotl64 (v1, 1) + xxh_rotl64 (v2, 7) +
+      xxh_rotl64 (v3, 12) + xxh_rotl64 (v4, 18);
+    h = xxh64_merge_round (h, v1);
+    h = xxh64_merge_round (h, v2);
+    h = xxh64_merge_round (h, v3);
+    h = xxh64_merge_round (h, v4);
+  }
+  else
+    h = seed + XXH_PRIME64_5;
+
+  h += len;
+
+  while (end - p >= 8) {
+    h ^= xxh64_round (0, xxh_read64 (p));
+    h = xxh_rotl64 (h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    h ^= xxh_read32 (p) * XXH_PRIME64_1;
+    h = xxh_rotl64 (h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= *p * XXH_PRIME64_5;
+    h = xxh_rotl64 (h, 11) * XXH_PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+#endif /* NBDSUM_XXHASH_H */
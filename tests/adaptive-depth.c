@@ -0,0 +1,193 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that nbd_set_adaptive_depth holds back requests beyond the
+ * current limit, and sends them as replies arrive.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_READS 50
+/* Bytes sent on the wire for each read request. */
+#define REQUEST_SIZE 28
+
+static char buf[NR_READS][512];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+static int64_t
+bytes_sent (struct nbd_handle *nbd)
+{
+  int64_t r;
+
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (r = nbd_get_stats_bytes_sent (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+/* Issue NR_READS reads without waiting for any of them, and return
+ * the number of requests which were sent straight away.
+ */
+static int64_t
+issue_reads (struct nbd_handle *nbd)
+{
+  int64_t sent;
+  size_t i;
+
+  sent = bytes_sent (nbd);
+  completions = 0;
+  for (i = 0; i < NR_READS; ++i) {
+    if (nbd_aio_pread (nbd, buf[i], sizeof buf[i], i * sizeof buf[i],
+                       (nbd_completion_callback) { .callback = completion },
+                       0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  return (bytes_sent (nbd) - sent) / REQUEST_SIZE;
+}
+
+static void
+wait_all (const char *progname, struct nbd_handle *nbd)
+{
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (completions != NR_READS) {
+    fprintf (stderr, "%s: expected %d completions, got %u\n",
+             progname, NR_READS, completions);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=1M", NULL };
+  int64_t sent;
+  int i, limit;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_adaptive_depth (nbd) != 0 || nbd_get_depth_limit (nbd) != 0) {
+    fprintf (stderr, "%s: the depth should not be limited by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_adaptive_depth (nbd, 4) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_adaptive_depth (nbd) != 4 || nbd_get_depth_limit (nbd) != 4) {
+    fprintf (stderr, "%s: unexpected depth limit\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Only the first four requests are sent before any replies. */
+  sent = issue_reads (nbd);
+  if (sent != 4) {
+    fprintf (stderr, "%s: expected 4 requests to be sent, got %" PRIi64 "\n",
+             argv[0], sent);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_in_flight (nbd) != NR_READS) {
+    fprintf (stderr, "%s: all the reads should be in flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  wait_all (argv[0], nbd);
+  limit = nbd_get_depth_limit (nbd);
+  if (limit < 1 || limit > 4) {
+    fprintf (stderr, "%s: depth limit %d out of range\n", argv[0], limit);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Removing the limit sends the reads which were held back. */
+  if (nbd_set_adaptive_depth (nbd, 1) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  sent = bytes_sent (nbd);
+  if (issue_reads (nbd) != 1 ||
+      nbd_set_adaptive_depth (nbd, 0) == -1) {
+    fprintf (stderr, "%s: expected 1 request to be sent\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (bytes_sent (nbd) - sent != NR_READS * REQUEST_SIZE) {
+    fprintf (stderr, "%s: the held reads were not sent\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  wait_all (argv[0], nbd);
+
+  /* With a higher maximum, the limit moves but stays within it. */
+  if (nbd_set_adaptive_depth (nbd, 32) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < 20; ++i) {
+    issue_reads (nbd);
+    wait_all (argv[0], nbd);
+    limit = nbd_get_depth_limit (nbd);
+    if (limit < 1 || limit > 32) {
+      fprintf (stderr, "%s: depth limit %d out of range\n", argv[0], limit);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
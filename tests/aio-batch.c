@@ -0,0 +1,143 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test queuing commands with nbd_aio_begin_batch/nbd_aio_end_batch. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_COMMANDS 16
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[NR_COMMANDS][512], check[512];
+  size_t i;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Batches can only be started once connected. */
+  if (nbd_aio_begin_batch (nbd) != -1) {
+    fprintf (stderr, "%s: expected nbd_aio_begin_batch to fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Ending a batch which was not started is an error. */
+  if (nbd_aio_end_batch (nbd) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: expected nbd_aio_end_batch to fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_begin_batch (nbd) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: expected nested nbd_aio_begin_batch to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (buf[i], i + 1, sizeof buf[i]);
+    if (nbd_aio_pwrite (nbd, buf[i], sizeof buf[i], i * 512,
+                        NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Nothing has been sent yet, so the handle is still idle. */
+  if (nbd_aio_in_flight (nbd) != NR_COMMANDS) {
+    fprintf (stderr, "%s: unexpected number of commands in flight: %d\n",
+             argv[0], nbd_aio_in_flight (nbd));
+    exit (EXIT_FAILURE);
+  }
+  if (!nbd_aio_is_ready (nbd)) {
+    fprintf (stderr, "%s: handle is not ready during a batch: %s\n",
+             argv[0], nbd_connection_state (nbd));
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_peek_command_completed (nbd) > 0) {
+    if (nbd_aio_command_completed (nbd,
+                                   nbd_aio_peek_command_completed (nbd))
+        != 1) {
+      fprintf (stderr, "%s: %s\n", argv[0], nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* A synchronous command in the middle of a batch ends the batch,
+   * rather than waiting forever.
+   */
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_pread (nbd, check, sizeof check, i * 512, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (check, buf[i], sizeof check) != 0) {
+      fprintf (stderr, "%s: data mismatch at offset %zu\n", argv[0], i * 512);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_end_batch (nbd) != -1) {
+    fprintf (stderr, "%s: expected the batch to have ended\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,197 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test retiring completed commands in batches with
+ * nbd_aio_get_completions.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define NR_COMMANDS 32
+
+static int64_t cookies[NR_COMMANDS];
+static int seen[NR_COMMANDS];
+static unsigned nr_seen;
+static unsigned free_calls;
+
+static int
+completed (void *user_data, int64_t cookie, int error)
+{
+  size_t i;
+
+  if (error != 0) {
+    fprintf (stderr, "unexpected error for cookie %" PRIi64 ": %s\n",
+             cookie, strerror (error));
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (cookies[i] == cookie) {
+      if (seen[i]) {
+        fprintf (stderr, "cookie %" PRIi64 " retired twice\n", cookie);
+        exit (EXIT_FAILURE);
+      }
+      seen[i] = 1;
+      nr_seen++;
+      return 0;
+    }
+  }
+  fprintf (stderr, "unknown cookie %" PRIi64 "\n", cookie);
+  exit (EXIT_FAILURE);
+}
+
+static void
+free_completed (void *user_data)
+{
+  free_calls++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[NR_COMMANDS][512];
+  size_t i;
+  int r;
+  unsigned expected_free_calls = 0;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Nothing has been issued, so nothing can be retired. */
+  r = nbd_aio_get_completions (nbd, NR_COMMANDS,
+                               (nbd_completed_callback) {
+                                 .callback = completed,
+                                 .free = free_completed });
+  expected_free_calls++;
+  if (r != 0 || free_calls != expected_free_calls) {
+    fprintf (stderr, "%s: expected no completions, got %d\n", argv[0], r);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Issue a mix of writes and reads. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (buf[i], i, sizeof buf[i]);
+    if (i & 1)
+      cookies[i] = nbd_aio_pread (nbd, buf[i], sizeof buf[i], i * 512,
+                                  NBD_NULL_COMPLETION, 0);
+    else
+      cookies[i] = nbd_aio_pwrite (nbd, buf[i], sizeof buf[i], i * 512,
+                                   NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Wait until all commands have completed, but none are retired. */
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* max == 0 retires nothing. */
+  r = nbd_aio_get_completions (nbd, 0,
+                               (nbd_completed_callback) {
+                                 .callback = completed,
+                                 .free = free_completed });
+  expected_free_calls++;
+  if (r != 0 || nr_seen != 0) {
+    fprintf (stderr, "%s: max 0: expected no completions, got %d\n",
+             argv[0], r);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Retire a partial batch, then the rest. */
+  r = nbd_aio_get_completions (nbd, 10,
+                               (nbd_completed_callback) {
+                                 .callback = completed,
+                                 .free = free_completed });
+  expected_free_calls++;
+  if (r != 10 || nr_seen != 10) {
+    fprintf (stderr, "%s: expected 10 completions, got %d\n", argv[0], r);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_peek_command_completed (nbd) <= 0) {
+    fprintf (stderr, "%s: expected more completed commands\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  r = nbd_aio_get_completions (nbd, NR_COMMANDS,
+                               (nbd_completed_callback) {
+                                 .callback = completed,
+                                 .free = free_completed });
+  expected_free_calls++;
+  if (r != NR_COMMANDS - 10 || nr_seen != NR_COMMANDS) {
+    fprintf (stderr, "%s: expected %d completions, got %d\n",
+             argv[0], NR_COMMANDS - 10, r);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Everything has been retired. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 0) {
+      fprintf (stderr, "%s: cookie %" PRIi64 " was not retired\n",
+               argv[0], cookies[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (free_calls != expected_free_calls) {
+    fprintf (stderr, "%s: free callback called %u times, expected %u\n",
+             argv[0], free_calls, expected_free_calls);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The data written must read back. */
+  for (i = 0; i < NR_COMMANDS; i += 2) {
+    char check[512];
+
+    if (nbd_pread (nbd, check, sizeof check, i * 512, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (check, buf[i], sizeof check) != 0) {
+      fprintf (stderr, "%s: data mismatch at offset %zu\n", argv[0], i * 512);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -16,7 +16,15 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-/* Test an asynchronous random load. */
+/* Test an asynchronous random load.
+ *
+ * If extra parameters are given after buf-size, they are a list of
+ * queue depths (maximum commands in flight per connection).  The
+ * load is run once for each depth and the throughput and CPU time
+ * per request is printed, which can be used to check that the cost
+ * of each request does not grow with the number of requests in
+ * flight.
+ */
 
 #include <config.h>
 
@@ -45,7 +53,7 @@
 /* Number of threads and connections. */
 #define NR_MULTI_CONN 8
 
-/* Number of commands in flight per connection. */
+/* Default number of commands in flight per connection. */
 #define MAX_IN_FLIGHT 64
 
 /* Unix socket or uri. */
@@ -55,6 +63,7 @@ struct thread_status {
   size_t i;                     /* Thread index, 0 .. NR_MULTI_CONN-1 */
   time_t end_time;              /* Threads run until this end time. */
   size_t buf_size;              /* Size of requests. */
+  unsigned max_in_flight;       /* Queue depth for this run. */
   int status;                   /* Return status. */
   unsigned requests;            /* Total number of requests made. */
   unsigned most_in_flight;      /* Most requests seen in flight. */
@@ -69,57 +78,46 @@ static char *buf;
 
 static void *start_thread (void *arg);
 
-int
-main (int argc, char *argv[])
-{
-  pthread_t threads[NR_MULTI_CONN];
-  struct thread_status status[NR_MULTI_CONN];
-  size_t i;
-  time_t t;
-  int err;
+struct totals {
   unsigned requests, most_in_flight, errors;
   uint64_t bytes_sent, bytes_received;
-  size_t buf_size;
-
-  if (argc < 2 || argc > 3) {
-    fprintf (stderr, "%s socket [buf-size]\n", argv[0]);
-    exit (EXIT_FAILURE);
-  }
-  connection = argv[1];
-  if (argc == 3) {
-    char *end;
+  double cpu_time;              /* Process CPU time (seconds) used. */
+};
 
-    errno = 0;
-    buf_size = strtoul (argv[2], &end, 0);
-    if (errno || argv[2] == end || buf_size == 0 || buf_size >= EXPORTSIZE) {
-      fprintf (stderr, "invalid buf-size %s, must be positive integer < %d\n",
-               argv[2], EXPORTSIZE);
-      exit (EXIT_FAILURE);
-    }
-  }
-  else
-    buf_size = 64 * 1024;
+static double
+cpu_time (void)
+{
+  struct timespec ts;
 
-  buf = malloc (buf_size);
-  if (!buf) {
-    perror ("malloc");
+  if (clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts) == -1) {
+    perror ("clock_gettime");
     exit (EXIT_FAILURE);
   }
+  return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+/* Run the load for RUN_TIME seconds at the given queue depth. */
+static void
+run_load (size_t buf_size, unsigned max_in_flight, struct totals *totals)
+{
+  pthread_t threads[NR_MULTI_CONN];
+  struct thread_status status[NR_MULTI_CONN];
+  size_t i;
+  time_t t;
+  double start_cpu;
+  int err;
 
   /* Get the current time and the end time. */
   time (&t);
   t += RUN_TIME;
-
-  /* Initialize the buffer with random data. */
-  srand (t + getpid ());
-  for (i = 0; i < buf_size; ++i)
-    buf[i] = rand ();
+  start_cpu = cpu_time ();
 
   /* Start the worker threads, one per connection. */
   for (i = 0; i < NR_MULTI_CONN; ++i) {
     status[i].i = i;
     status[i].end_time = t;
     status[i].buf_size = buf_size;
+    status[i].max_in_flight = max_in_flight;
     status[i].status = 0;
     status[i].requests = 0;
     status[i].most_in_flight = 0;
@@ -133,10 +131,7 @@ main (int argc, char *argv[])
   }
 
   /* Wait for the threads to exit. */
-  errors = 0;
-  requests = 0;
-  most_in_flight = 0;
-  bytes_sent = bytes_received = 0;
+  memset (totals, 0, sizeof *totals);
   for (i = 0; i < NR_MULTI_CONN; ++i) {
     err = pthread_join (threads[i], NULL);
     if (err != 0) {
@@ -147,14 +142,55 @@ main (int argc, char *argv[])
     if (status[i].status != 0) {
       fprintf (stderr, "thread %zu failed with status %d\n",
                i, status[i].status);
-      errors++;
+      totals->errors++;
     }
-    requests += status[i].requests;
-    if (status[i].most_in_flight > most_in_flight)
-      most_in_flight = status[i].most_in_flight;
-    bytes_sent += status[i].bytes_sent;
-    bytes_received += status[i].bytes_received;
+    totals->requests += status[i].requests;
+    if (status[i].most_in_flight > totals->most_in_flight)
+      totals->most_in_flight = status[i].most_in_flight;
+    totals->bytes_sent += status[i].bytes_sent;
+    totals->bytes_received += status[i].bytes_received;
   }
+  totals->cpu_time = cpu_time () - start_cpu;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct totals totals;
+  size_t i;
+  int j;
+  unsigned errors;
+  size_t buf_size;
+
+  if (argc < 2) {
+    fprintf (stderr, "%s socket [buf-size [depth ...]]\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  connection = argv[1];
+  if (argc >= 3) {
+    char *end;
+
+    errno = 0;
+    buf_size = strtoul (argv[2], &end, 0);
+    if (errno || argv[2] == end || buf_size == 0 || buf_size >= EXPORTSIZE) {
+      fprintf (stderr, "invalid buf-size %s, must be positive integer < %d\n",
+               argv[2], EXPORTSIZE);
+      exit (EXIT_FAILURE);
+    }
+  }
+  else
+    buf_size = 64 * 1024;
+
+  buf = malloc (buf_size);
+  if (!buf) {
+    perror ("malloc");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Initialize the buffer with random data. */
+  srand (time (NULL) + getpid ());
+  for (i = 0; i < buf_size; ++i)
+    buf[i] = rand ();
 
   /* Print some stats. */
   printf ("TLS: %s\n",
@@ -165,18 +201,50 @@ main (int argc, char *argv[])
 #endif
           );
   printf ("multi-conn: %d\n", NR_MULTI_CONN);
-  printf ("max in flight permitted (per connection): %d\n", MAX_IN_FLIGHT);
 
-  printf ("bytes sent: %" PRIu64 " (%g Mbytes/s)\n",
-          bytes_sent, (double) bytes_sent / RUN_TIME / 1000000);
-  printf ("bytes received: %" PRIu64 " (%g Mbytes/s)\n",
-          bytes_received, (double) bytes_received / RUN_TIME / 1000000);
+  if (argc <= 3) {
+    run_load (buf_size, MAX_IN_FLIGHT, &totals);
+    errors = totals.errors;
+
+    printf ("max in flight permitted (per connection): %d\n", MAX_IN_FLIGHT);
 
-  printf ("I/O requests: %u (%g IOPS)\n",
-          requests, (double) requests / RUN_TIME);
+    printf ("bytes sent: %" PRIu64 " (%g Mbytes/s)\n",
+            totals.bytes_sent, (double) totals.bytes_sent / RUN_TIME / 1000000);
+    printf ("bytes received: %" PRIu64 " (%g Mbytes/s)\n",
+            totals.bytes_received,
+            (double) totals.bytes_received / RUN_TIME / 1000000);
 
-  printf ("max requests in flight: %u\n",
-          most_in_flight);
+    printf ("I/O requests: %u (%g IOPS)\n",
+            totals.requests, (double) totals.requests / RUN_TIME);
+
+    printf ("max requests in flight: %u\n",
+            totals.most_in_flight);
+  }
+  else {
+    /* Sweep over the queue depths given on the command line. */
+    errors = 0;
+    printf ("%8s %12s %16s\n", "depth", "IOPS", "CPU us/request");
+    for (j = 3; j < argc; ++j) {
+      char *end;
+      unsigned long depth;
+
+      errno = 0;
+      depth = strtoul (argv[j], &end, 0);
+      if (errno || argv[j] == end || depth == 0 || depth > 65536) {
+        fprintf (stderr, "invalid depth %s, must be in range 1..65536\n",
+                 argv[j]);
+        exit (EXIT_FAILURE);
+      }
+
+      run_load (buf_size, depth, &totals);
+      errors += totals.errors;
+
+      printf ("%8lu %12g %16g\n",
+              depth, (double) totals.requests / RUN_TIME,
+              totals.requests ?
+              totals.cpu_time * 1000000 / totals.requests : 0.);
+    }
+  }
 
   exit (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -188,10 +256,9 @@ start_thread (void *arg)
   struct thread_status *status = arg;
   size_t buf_size = status->buf_size;
   struct nbd_handle *nbd;
-  size_t i;
   uint64_t offset;
   int64_t cookie;
-  int64_t cookies[MAX_IN_FLIGHT] = { 0 };
+  unsigned max_in_flight = status->max_in_flight;
   unsigned dir;
   int r, cmd;
   time_t t;
@@ -256,7 +323,7 @@ start_thread (void *arg)
     }
 
     /* If we can issue another request, do so. */
-    while (!expired && nbd_aio_in_flight (nbd) < MAX_IN_FLIGHT) {
+    while (!expired && nbd_aio_in_flight (nbd) < max_in_flight) {
       offset = rand () % (EXPORTSIZE - buf_size);
       cmd = rand () & 1;
       if (cmd == 0) {
@@ -273,12 +340,6 @@ start_thread (void *arg)
         fprintf (stderr, "%s\n", nbd_get_error ());
         goto error;
       }
-      for (i = 0; i < MAX_IN_FLIGHT; i++) {
-        if (cookies[i] == 0) {
-          cookies[i] = cookie;
-          break;
-        }
-      }
       if (nbd_aio_in_flight (nbd)  > status->most_in_flight)
         status->most_in_flight = nbd_aio_in_flight (nbd);
     }
@@ -304,19 +365,18 @@ start_thread (void *arg)
              (fds[0].revents & POLLOUT) != 0)
       nbd_aio_notify_write (nbd);
 
-    /* If a command is ready to retire, retire it. */
-    for (i = 0; i < MAX_IN_FLIGHT; ++i) {
-      if (cookies[i] == 0)
-        continue;
-      r = nbd_aio_command_completed (nbd, cookies[i]);
+    /* Retire all commands which are ready to retire.  This uses peek
+     * instead of remembering the cookies, so that the cost of the
+     * test itself does not grow with the queue depth.
+     */
+    while ((cookie = nbd_aio_peek_command_completed (nbd)) > 0) {
+      r = nbd_aio_command_completed (nbd, cookie);
       if (r == -1) {
         fprintf (stderr, "%s\n", nbd_get_error ());
         goto error;
       }
-      if (r) {
-        cookies[i] = 0;
-        status->requests++;
-      }
+      assert (r == 1);
+      status->requests++;
     }
   }
 
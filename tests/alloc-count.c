@@ -0,0 +1,253 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Count the heap allocations made by a steady pipelined load.
+ *
+ * Once the handle has warmed up (its command pool, cookie table and
+ * reply buffers have reached their working size), issuing and
+ * completing reads, writes and block status commands should not
+ * allocate.  malloc, calloc and realloc are replaced in this program,
+ * which also replaces them for libnbd, to count the calls made while
+ * the load runs, and the test fails if there are more than
+ * ALLOC_BUDGET per 100 commands.  The time and the cycles taken per
+ * command are printed too, so that changes in the cost of the hot
+ * path show up in the test log:
+ *
+ *   commands,allocations,allocations_per_command,ns_per_command,
+ *   cycles_per_command
+ *
+ * Replacing malloc relies on glibc, so elsewhere the test is skipped.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <libnbd.h>
+
+#define EXPORTSIZE (64 * 1024 * 1024)
+#define BLOCK 4096
+#define DEPTH 64
+
+/* Rounds of DEPTH commands to warm up with, and to measure. */
+#define WARMUP_ROUNDS 100
+#define ROUNDS 2000
+
+/* Allocations allowed per 100 commands. */
+#define ALLOC_BUDGET 1
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static bool counting;
+static uint64_t allocations;
+
+static void
+count (void)
+{
+  if (__atomic_load_n (&counting, __ATOMIC_RELAXED))
+    __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc (size_t size)
+{
+  count ();
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  count ();
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  count ();
+  return __libc_realloc (ptr, size);
+}
+
+void
+free (void *ptr)
+{
+  __libc_free (ptr);
+}
+
+static char buf[DEPTH][BLOCK];
+static uint64_t completed;
+static bool can_extents;
+
+static int
+extent (void *user_data, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  return 0;
+}
+
+static int
+command_done (void *user_data, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "command failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completed++;
+  return 1;
+}
+
+static uint64_t
+cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc ();
+#else
+  return 0;
+#endif
+}
+
+/* Issue one round of reads, writes and block status commands spread
+ * over the export, and wait for them.
+ */
+static void
+run_round (struct nbd_handle *nbd, unsigned round)
+{
+  nbd_completion_callback done = { .callback = command_done };
+  uint64_t offset, target = completed + DEPTH;
+  unsigned i;
+  int64_t r;
+
+  for (i = 0; i < DEPTH; ++i) {
+    offset = ((uint64_t) (round * DEPTH + i) * 7919 * BLOCK) % EXPORTSIZE;
+    switch (i % 3) {
+    case 0:
+      r = nbd_aio_pread (nbd, buf[i], BLOCK, offset, done, 0);
+      break;
+    case 1:
+      r = nbd_aio_pwrite (nbd, buf[i], BLOCK, offset, done, 0);
+      break;
+    default:
+      if (can_extents)
+        r = nbd_aio_block_status (nbd, 16 * BLOCK, offset % (EXPORTSIZE / 2),
+                                  (nbd_extent_callback) { .callback = extent },
+                                  done, 0);
+      else
+        r = nbd_aio_pread (nbd, buf[i], BLOCK, offset, done, 0);
+    }
+    if (r == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  while (completed < target) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char size[32];
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "memory", size, NULL };
+  struct timespec start, end;
+  uint64_t start_cycles, nr_cycles, nr_commands;
+  unsigned i;
+
+  snprintf (size, sizeof size, "size=%d", EXPORTSIZE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  can_extents =
+    nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == 1;
+
+  for (i = 0; i < WARMUP_ROUNDS; ++i)
+    run_round (nbd, i);
+
+  completed = 0;
+  __atomic_store_n (&counting, true, __ATOMIC_RELAXED);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  start_cycles = cycles ();
+  for (i = 0; i < ROUNDS; ++i)
+    run_round (nbd, WARMUP_ROUNDS + i);
+  nr_commands = completed;
+  nr_cycles = cycles () - start_cycles;
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  __atomic_store_n (&counting, false, __ATOMIC_RELAXED);
+
+  printf ("commands,allocations,allocations_per_command,ns_per_command,"
+          "cycles_per_command\n");
+  printf ("%" PRIu64 ",%" PRIu64 ",%.4f,%.1f,%.1f\n",
+          nr_commands, allocations, (double) allocations / nr_commands,
+          ((end.tv_sec - start.tv_sec) * 1e9 +
+           (end.tv_nsec - start.tv_nsec)) / nr_commands,
+          (double) nr_cycles / nr_commands);
+  fflush (stdout);
+
+  if (allocations * 100 > nr_commands * ALLOC_BUDGET) {
+    fprintf (stderr, "%s: %" PRIu64 " allocations for %" PRIu64 " commands, "
+             "the budget is %d per 100 commands\n",
+             argv[0], allocations, nr_commands, ALLOC_BUDGET);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
+
+#else /* !__GLIBC__ */
+
+int
+main (int argc, char *argv[])
+{
+  fprintf (stderr, "%s: test skipped: malloc can only be replaced "
+           "with glibc\n", argv[0]);
+  exit (77);
+}
+
+#endif /* !__GLIBC__ */
@@ -0,0 +1,175 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test bitmaps of byte ranges. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <libnbd.h>
+
+static struct nbd_bitmap *
+create (void)
+{
+  struct nbd_bitmap *b;
+
+  b = nbd_bitmap_create ();
+  if (b == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return b;
+}
+
+static void
+add_range (struct nbd_bitmap *b, uint64_t offset, uint64_t length)
+{
+  if (nbd_bitmap_add_range (b, offset, length) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Check that the runs of b are exactly the nr pairs of start and
+ * length in expected.
+ */
+static void
+check (const char *what, const struct nbd_bitmap *b,
+       const uint64_t *expected, size_t nr)
+{
+  uint64_t offset = 0, start, length, bytes = 0;
+  size_t i;
+
+  for (i = 0; i < nr; ++i) {
+    if (nbd_bitmap_next (b, offset, &start, &length) != 1 ||
+        start != expected[2*i] || length != expected[2*i+1]) {
+      fprintf (stderr, "%s: run %zu is wrong\n", what, i);
+      exit (EXIT_FAILURE);
+    }
+    offset = start + length;
+    bytes += length;
+  }
+  if (nbd_bitmap_next (b, offset, &start, &length) != 0) {
+    fprintf (stderr, "%s: unexpected run at %" PRIu64 "\n", what, start);
+    exit (EXIT_FAILURE);
+  }
+  assert (nbd_bitmap_get_nr_runs (b) == nr);
+  assert (nbd_bitmap_get_bytes (b) == bytes);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_bitmap *a, *b;
+  uint64_t start, length;
+  /* Extents as reported for a dirty bitmap: 4K dirty, 4K clean,
+   * 8K dirty in two extents, 4K clean.
+   */
+  uint32_t dirty[] = { 4096, 1, 4096, 0, 4096, 1, 4096, 1, 4096, 0 };
+  /* And for base:allocation: 6K data, 6K hole, 8K data. */
+  uint32_t allocation[] = { 6144, 0,
+                            6144, LIBNBD_STATE_HOLE|LIBNBD_STATE_ZERO,
+                            8192, 0 };
+
+  a = create ();
+  check ("empty", a, NULL, 0);
+
+  /* Ranges added out of order and overlapping are merged. */
+  add_range (a, 100, 10);
+  add_range (a, 200, 10);
+  add_range (a, 0, 10);
+  add_range (a, 50, 10);
+  add_range (a, 0, 0);
+  check ("separate", a, (uint64_t []) { 0, 10, 50, 10, 100, 10, 200, 10 },
+         4);
+  add_range (a, 10, 40);
+  check ("touching", a, (uint64_t []) { 0, 60, 100, 10, 200, 10 }, 3);
+  add_range (a, 55, 150);
+  check ("overlapping", a, (uint64_t []) { 0, 210 }, 1);
+
+  /* nbd_bitmap_next starts from the offset given. */
+  assert (nbd_bitmap_next (a, 20, &start, &length) == 1);
+  assert (start == 20 && length == 190);
+  assert (nbd_bitmap_next (a, 210, &start, &length) == 0);
+
+  if (nbd_bitmap_add_range (a, UINT64_MAX, 2) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: overflowing range was not rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_bitmap_close (a);
+
+  /* Collecting extents. */
+  a = create ();
+  b = create ();
+  if (nbd_bitmap_add_extents (a, 4096, dirty, 10, 1, 1) == -1 ||
+      nbd_bitmap_add_extents (b, 4096, allocation, 6,
+                              LIBNBD_STATE_HOLE, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check ("dirty", a, (uint64_t []) { 4096, 4096, 12288, 8192 }, 2);
+  check ("allocated", b, (uint64_t []) { 4096, 6144, 16384, 8192 }, 2);
+  if (nbd_bitmap_add_extents (a, 0, dirty, 3, 1, 1) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: odd number of entries was not rejected\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Dirty and allocated. */
+  if (nbd_bitmap_intersect (a, b) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check ("intersection", a, (uint64_t []) { 4096, 4096, 16384, 4096 }, 2);
+
+  /* Dirty or allocated. */
+  add_range (a, 12288, 4096);
+  if (nbd_bitmap_union (a, b) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check ("union", a, (uint64_t []) { 4096, 6144, 12288, 12288 }, 2);
+  nbd_bitmap_close (b);
+
+  /* Combining with an empty bitmap. */
+  b = create ();
+  if (nbd_bitmap_union (a, b) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check ("union with empty", a, (uint64_t []) { 4096, 6144, 12288, 12288 },
+         2);
+  if (nbd_bitmap_intersect (a, b) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check ("intersection with empty", a, NULL, 0);
+
+  nbd_bitmap_close (a);
+  nbd_bitmap_close (b);
+  nbd_bitmap_close (NULL);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,125 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_buffer_alloc and nbd_buffer_free. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static void
+check_aligned (const char *progname, void *buf, uintptr_t align)
+{
+  if (buf == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if ((uintptr_t) buf & (align - 1)) {
+    fprintf (stderr, "%s: buffer %p is not aligned to %ju\n",
+             progname, buf, (uintmax_t) align);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "pattern", "size=1M", NULL };
+  uintptr_t page_size = sysconf (_SC_PAGESIZE);
+  char *buf, *buf2, *huge;
+  char expected[8];
+
+  /* Bad flags and nodes are rejected. */
+  if (nbd_buffer_alloc (4096, -1, 4) != NULL ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: invalid flags were not rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_buffer_alloc (4096, -2, 0) != NULL ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: invalid NUMA node was not rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_buffer_free (NULL);
+
+  buf = nbd_buffer_alloc (100000, -1, 0);
+  check_aligned (argv[0], buf, page_size);
+  memset (buf, 0, 100000);
+
+  /* A freed buffer is used again for the same size. */
+  nbd_buffer_free (buf);
+  buf2 = nbd_buffer_alloc (100000, -1, 0);
+  check_aligned (argv[0], buf2, page_size);
+  if (buf2 != buf) {
+    fprintf (stderr, "%s: freed buffer was not used again\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* But not for buffers with other flags. */
+  huge = nbd_buffer_alloc (100000, -1, LIBNBD_BUFFER_HUGE_PAGES);
+  check_aligned (argv[0], huge, HUGE_PAGE_SIZE);
+  if (huge == buf2) {
+    fprintf (stderr, "%s: buffer in use was handed out again\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Explicit huge pages and NUMA binding depend on the system. */
+  buf = nbd_buffer_alloc (4096, -1, LIBNBD_BUFFER_HUGETLB);
+  if (buf != NULL)
+    check_aligned (argv[0], buf, HUGE_PAGE_SIZE);
+  nbd_buffer_free (buf);
+  buf = nbd_buffer_alloc (4096, 0, 0);
+  if (buf != NULL)
+    check_aligned (argv[0], buf, page_size);
+  nbd_buffer_free (buf);
+
+  /* Read into the buffers. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1 ||
+      nbd_pread (nbd, buf2, 100000, 0, 0) == -1 ||
+      nbd_pread (nbd, huge, 100000, 65536, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  memcpy (expected, "\0\0\0\0\0\1\0\0", 8);
+  if (memcmp (buf2 + 65536, expected, 8) != 0 ||
+      memcmp (huge, expected, 8) != 0) {
+    fprintf (stderr, "%s: wrong data read\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  nbd_buffer_free (huge);
+  nbd_buffer_free (buf2);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,177 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_max_bytes_in_flight. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define MAX 8192
+
+static char buf[16384];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+static int64_t
+aio_pwrite (struct nbd_handle *nbd, size_t count)
+{
+  return nbd_aio_pwrite (nbd, buf, count, 0,
+                         (nbd_completion_callback) { .callback = completion },
+                         0);
+}
+
+static void
+wait_all (struct nbd_handle *nbd)
+{
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+check_bytes_in_flight (const char *progname, struct nbd_handle *nbd,
+                       int64_t expected)
+{
+  int64_t r = nbd_get_bytes_in_flight (nbd);
+
+  if (r != expected) {
+    fprintf (stderr, "%s: expected %" PRIi64 " bytes in flight, "
+             "got %" PRIi64 "\n", progname, expected, r);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=1M", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_max_bytes_in_flight (nbd) != 0) {
+    fprintf (stderr, "%s: bytes in flight should not be limited by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_max_bytes_in_flight (nbd, MAX, false) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_max_bytes_in_flight (nbd) != MAX) {
+    fprintf (stderr, "%s: unexpected limit\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Without waiting, a write over the limit fails with EAGAIN, while
+   * commands without a payload are not limited.
+   */
+  if (aio_pwrite (nbd, 4096) == -1 ||
+      aio_pwrite (nbd, 4096) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_bytes_in_flight (argv[0], nbd, MAX);
+  if (aio_pwrite (nbd, 512) != -1 || nbd_get_errno () != EAGAIN) {
+    fprintf (stderr, "%s: write over the limit should fail with EAGAIN\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_flush (nbd, NBD_NULL_COMPLETION, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (nbd);
+  check_bytes_in_flight (argv[0], nbd, 0);
+
+  /* A write larger than the limit is allowed by itself. */
+  if (aio_pwrite (nbd, sizeof buf) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (aio_pwrite (nbd, 512) != -1 || nbd_get_errno () != EAGAIN) {
+    fprintf (stderr, "%s: write after a large write should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  wait_all (nbd);
+
+  /* When waiting, the aio calls still fail with EAGAIN, but the
+   * synchronous calls wait for commands in flight to complete.
+   */
+  if (nbd_set_max_bytes_in_flight (nbd, MAX, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  completions = 0;
+  if (aio_pwrite (nbd, 3000) == -1 ||
+      aio_pwrite (nbd, 3000) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (aio_pwrite (nbd, 3000) != -1 || nbd_get_errno () != EAGAIN) {
+    fprintf (stderr, "%s: aio write over the limit should fail with "
+             "EAGAIN\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pwrite (nbd, buf, 3000, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (nbd);
+  if (completions != 2) {
+    fprintf (stderr, "%s: expected 2 completions, got %u\n",
+             argv[0], completions);
+    exit (EXIT_FAILURE);
+  }
+  check_bytes_in_flight (argv[0], nbd, 0);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
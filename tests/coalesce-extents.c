@@ -0,0 +1,124 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test block status with LIBNBD_CMD_FLAG_COALESCE. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE (1024 * 1024)
+#define WRITE_OFFSET (64 * 1024)
+#define WRITE_SIZE 4096
+
+/* What the last block status call returned. */
+static uint32_t last_entries[64];
+static size_t last_nr_entries;
+
+static int
+extent (void *user_data, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0)
+    return 0;
+  last_nr_entries = nr_entries;
+  memcpy (last_entries, entries,
+          (nr_entries < 64 ? nr_entries : 64) * sizeof entries[0]);
+  return 0;
+}
+
+/* The whole disk should come back as a hole, the data which was
+ * written, and another hole.
+ */
+static void
+check_coalesced (struct nbd_handle *nbd, const char *what)
+{
+  if (nbd_block_status (nbd, SIZE, 0,
+                        (nbd_extent_callback) { .callback = extent },
+                        LIBNBD_CMD_FLAG_COALESCE) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (last_nr_entries != 6 ||
+      last_entries[0] != WRITE_OFFSET ||
+      (last_entries[1] & LIBNBD_STATE_HOLE) == 0 ||
+      last_entries[2] != WRITE_SIZE ||
+      (last_entries[3] & LIBNBD_STATE_HOLE) != 0 ||
+      last_entries[4] != SIZE - WRITE_OFFSET - WRITE_SIZE ||
+      last_entries[5] != last_entries[1]) {
+    fprintf (stderr, "%s: extents were not coalesced, got %zu entries\n",
+             what, last_nr_entries);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[WRITE_SIZE];
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  memset (buf, 1, sizeof buf);
+  if (nbd_pwrite (nbd, buf, sizeof buf, WRITE_OFFSET, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* From the server. */
+  check_coalesced (nbd, "server");
+
+  /* And from the extent cache, after filling it. */
+  if (nbd_set_extent_cache (nbd, true) == -1 ||
+      nbd_block_status (nbd, SIZE, 0,
+                        (nbd_extent_callback) { .callback = extent },
+                        0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_coalesced (nbd, "cache");
+  if (nbd_get_extent_cache_hits (nbd) != 1) {
+    fprintf (stderr, "block status was not answered from the cache\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,192 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that contiguous queued writes are merged into one request by
+ * nbd_set_coalesce_writes.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_WRITES 32
+#define WRITE_SIZE 4096
+/* Bytes sent on the wire for each request, besides its payload. */
+#define REQUEST_SIZE 28
+
+static char buf[NR_WRITES + 1][WRITE_SIZE], check[WRITE_SIZE];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+static int64_t
+bytes_sent (struct nbd_handle *nbd)
+{
+  int64_t r;
+
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (r = nbd_get_stats_bytes_sent (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+/* Queue NR_WRITES contiguous writes and one elsewhere in a batch,
+ * and return the number of requests which were sent for them.
+ */
+static int64_t
+write_batch (const char *progname, struct nbd_handle *nbd, int seed)
+{
+  int64_t sent;
+  size_t i;
+
+  sent = bytes_sent (nbd);
+  completions = 0;
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i <= NR_WRITES; ++i) {
+    memset (buf[i], seed + i, WRITE_SIZE);
+    if (nbd_aio_pwrite (nbd, buf[i], WRITE_SIZE,
+                        i < NR_WRITES ? i * WRITE_SIZE : 1024 * 1024,
+                        (nbd_completion_callback) { .callback = completion },
+                        0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (completions != NR_WRITES + 1) {
+    fprintf (stderr, "%s: expected %d completions, got %u\n",
+             progname, NR_WRITES + 1, completions);
+    exit (EXIT_FAILURE);
+  }
+  sent = bytes_sent (nbd) - sent - (NR_WRITES + 1) * WRITE_SIZE;
+
+  for (i = 0; i <= NR_WRITES; ++i) {
+    if (nbd_pread (nbd, check, WRITE_SIZE,
+                   i < NR_WRITES ? i * WRITE_SIZE : 1024 * 1024, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (check, buf[i], WRITE_SIZE) != 0) {
+      fprintf (stderr, "%s: data mismatch in write %zu\n", progname, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  return sent / REQUEST_SIZE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=2M", NULL };
+  int64_t requests;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_coalesce_writes (nbd) != 0) {
+    fprintf (stderr, "%s: writes should not be coalesced by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  requests = write_batch (argv[0], nbd, 1);
+  if (requests != NR_WRITES + 1) {
+    fprintf (stderr, "%s: expected %d requests without coalescing, "
+             "got %" PRIi64 "\n", argv[0], NR_WRITES + 1, requests);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_coalesce_writes (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  requests = write_batch (argv[0], nbd, 2);
+  if (requests != 2) {
+    fprintf (stderr, "%s: expected 2 requests with coalescing, "
+             "got %" PRIi64 "\n", argv[0], requests);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Each write is still counted once. */
+  if (nbd_get_stats_commands (nbd, LIBNBD_CMD_WRITE) != 2 * (NR_WRITES + 1)) {
+    fprintf (stderr, "%s: unexpected number of writes in statistics\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Requests are not merged beyond the maximum request size. */
+  if (nbd_set_max_request_size (nbd, 4 * WRITE_SIZE) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  requests = write_batch (argv[0], nbd, 3);
+  if (requests != NR_WRITES / 4 + 1) {
+    fprintf (stderr, "%s: expected %d requests with a small maximum "
+             "request size, got %" PRIi64 "\n",
+             argv[0], NR_WRITES / 4 + 1, requests);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,153 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the command event callback. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static int64_t read_cookie;
+static unsigned nr_events;
+static unsigned events[8];
+static uint64_t last_time;
+static int freed;
+
+static int
+event_fn (void *user_data, int64_t cookie, unsigned event, uint64_t time)
+{
+  /* Events for the handshake and other commands are not expected. */
+  if (cookie != read_cookie) {
+    fprintf (stderr, "unexpected event %u for cookie %" PRIi64 "\n",
+             event, cookie);
+    exit (EXIT_FAILURE);
+  }
+  if (nr_events >= sizeof events / sizeof events[0]) {
+    fprintf (stderr, "too many events\n");
+    exit (EXIT_FAILURE);
+  }
+  if (time < last_time) {
+    fprintf (stderr, "event times went backwards\n");
+    exit (EXIT_FAILURE);
+  }
+  last_time = time;
+  events[nr_events++] = event;
+  return 0;
+}
+
+static void
+free_fn (void *user_data)
+{
+  freed++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[512];
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+  const unsigned expected[] = {
+    LIBNBD_COMMAND_EVENT_QUEUED, LIBNBD_COMMAND_EVENT_SENT,
+    LIBNBD_COMMAND_EVENT_REPLY, LIBNBD_COMMAND_EVENT_COMPLETED,
+    LIBNBD_COMMAND_EVENT_RETIRED,
+  };
+  unsigned i;
+  int r;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Cookies are handed out in order, so the read will get the next
+   * one.  A cookie of -1 makes any event an error until then.
+   */
+  read_cookie = -1;
+  if (nbd_set_command_event_callback (nbd,
+                                      (nbd_command_event_callback) {
+                                        .callback = event_fn,
+                                        .free = free_fn }) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  read_cookie = nbd_aio_pread (nbd, buf, sizeof buf, 0,
+                               NBD_NULL_COMPLETION, 0);
+  if (read_cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while ((r = nbd_aio_command_completed (nbd, read_cookie)) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nr_events != sizeof expected / sizeof expected[0]) {
+    fprintf (stderr, "%s: expected %zu events, got %u\n", argv[0],
+             sizeof expected / sizeof expected[0], nr_events);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nr_events; ++i) {
+    if (events[i] != expected[i]) {
+      fprintf (stderr, "%s: event %u was %u, expected %u\n",
+               argv[0], i, events[i], expected[i]);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Clearing the callback frees it, and no more events arrive. */
+  if (nbd_clear_command_event_callback (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (freed != 1) {
+    fprintf (stderr, "%s: callback was not freed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nr_events != sizeof expected / sizeof expected[0]) {
+    fprintf (stderr, "%s: events arrived after clearing the callback\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
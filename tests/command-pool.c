@@ -0,0 +1,72 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test setting and reading the command pool size. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <libnbd.h>
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Check the default. */
+  assert (nbd_get_command_pool_size (nbd) == 64);
+
+  /* Growing preallocates, shrinking frees. */
+  if (nbd_set_command_pool_size (nbd, 1000) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  assert (nbd_get_command_pool_size (nbd) == 1000);
+
+  if (nbd_set_command_pool_size (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  assert (nbd_get_command_pool_size (nbd) == 0);
+
+  /* Negative sizes are rejected. */
+  if (nbd_set_command_pool_size (nbd, -1) != -1) {
+    fprintf (stderr, "%s: expected failure setting negative pool size\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  assert (nbd_get_command_pool_size (nbd) == 0);
+
+  /* Leave some commands in the pool to check they are freed on close. */
+  if (nbd_set_command_pool_size (nbd, 16) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,121 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test choosing the address family of TCP connections. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define PIDFILE "connect-tcp-family.pid"
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int port;
+  char port_str[16];
+  pid_t pid;
+  size_t i;
+
+  unlink (PIDFILE);
+
+  /* Pick a port at random, hope it's free. */
+  srand (time (NULL) + getpid ());
+  port = 32768 + (rand () & 32767);
+
+  snprintf (port_str, sizeof port_str, "%d", port);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-p", port_str, "-P", PIDFILE,
+            "--exit-with-parent", "null", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  /* An IPv4 address has no IPv6 address, so this must fail. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_tcp_family (nbd) != LIBNBD_TCP_FAMILY_ANY) {
+    fprintf (stderr, "unexpected default address family\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_tcp_family (nbd, LIBNBD_TCP_FAMILY_IPV6) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_tcp (nbd, "127.0.0.1", port_str) != -1) {
+    fprintf (stderr, "connecting to an IPv4 address over IPv6 "
+             "should have failed\n");
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_tcp_family (nbd, 42) != -1) {
+    fprintf (stderr, "setting an invalid address family should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_tcp_family (nbd, LIBNBD_TCP_FAMILY_IPV4) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_tcp_family (nbd) != LIBNBD_TCP_FAMILY_IPV4) {
+    fprintf (stderr, "address family was not set\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_tcp (nbd, "localhost", port_str) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,208 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that host names are looked up without blocking, and that the
+ * addresses are cached.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define PIDFILE "connect-tcp-resolve.pid"
+
+static bool
+is_resolving (struct nbd_handle *nbd)
+{
+  return strncmp (nbd_connection_state (nbd), "CONNECT_TCP.RESOLVING",
+                  strlen ("CONNECT_TCP.RESOLVING")) == 0;
+}
+
+/* Start connecting, and check whether the host was being looked up. */
+static struct nbd_handle *
+start_connect (const char *hostname, const char *port, int ttl,
+               bool expect_resolving)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (ttl >= 0 && nbd_set_resolver_cache_ttl (nbd, ttl) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_connect_tcp (nbd, hostname, port) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (is_resolving (nbd) != expect_resolving) {
+    fprintf (stderr, "%s: unexpected state after nbd_aio_connect_tcp: %s\n",
+             hostname, nbd_connection_state (nbd));
+    exit (EXIT_FAILURE);
+  }
+  if (expect_resolving &&
+      nbd_aio_get_direction (nbd) != LIBNBD_AIO_DIRECTION_READ) {
+    fprintf (stderr, "%s: expected to wait for reading while resolving\n",
+             hostname);
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+/* Finish connecting, returning -1 if it fails. */
+static int
+finish_connect (struct nbd_handle *nbd)
+{
+  while (nbd_aio_is_connecting (nbd)) {
+    if (nbd_poll (nbd, -1) == -1)
+      return -1;
+  }
+  if (!nbd_aio_is_ready (nbd)) {
+    fprintf (stderr, "handle is not ready: %s\n", nbd_connection_state (nbd));
+    exit (EXIT_FAILURE);
+  }
+  return 0;
+}
+
+static void
+close_handle (struct nbd_handle *nbd)
+{
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int port;
+  char port_str[16];
+  pid_t pid;
+  size_t i;
+
+  /* Check the setting. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_resolver_cache_ttl (nbd) != 60) {
+    fprintf (stderr, "unexpected default resolver cache TTL\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_resolver_cache_ttl (nbd, -1) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "expected a negative TTL to fail with EINVAL\n");
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  unlink (PIDFILE);
+
+  /* Pick a port at random, hope it's free. */
+  srand (time (NULL) + getpid ());
+  port = 32768 + (rand () & 32767);
+
+  snprintf (port_str, sizeof port_str, "%d", port);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-p", port_str, "-P", PIDFILE,
+            "--exit-with-parent", "null", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  /* The first lookup of localhost happens in the background. */
+  nbd = start_connect ("localhost", port_str, -1, true);
+  if (finish_connect (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  close_handle (nbd);
+
+  /* Now it is cached. */
+  nbd = start_connect ("localhost", port_str, -1, false);
+  if (finish_connect (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  close_handle (nbd);
+
+  /* Unless the cache is not used. */
+  nbd = start_connect ("localhost", port_str, 0, true);
+  if (finish_connect (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  close_handle (nbd);
+
+  /* Numeric addresses are never looked up. */
+  nbd = start_connect ("127.0.0.1", port_str, 0, false);
+  if (finish_connect (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  close_handle (nbd);
+
+  /* A name which does not exist fails while connecting. */
+  nbd = start_connect ("nonexistent.invalid", port_str, -1, true);
+  if (finish_connect (nbd) != -1) {
+    fprintf (stderr, "expected nonexistent.invalid not to be found\n");
+    exit (EXIT_FAILURE);
+  }
+  if (strstr (nbd_get_error (), "getaddrinfo") == NULL) {
+    fprintf (stderr, "unexpected error: %s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* Closing the handle while the lookup is running must work. */
+  nbd = start_connect ("localhost", port_str, 0, true);
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -68,6 +69,14 @@ main (int argc, char *argv[])
   }
 #endif
 
+#if KTLS
+  /* Falls back to GnuTLS if the kernel cannot take the session. */
+  if (nbd_set_tls_kernel_offload (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+#endif
+
   /* Run nbdkit as a subprocess. */
   char *args[] = { "nbdkit", "-s", "--exit-with-parent",
                    "--tls=require", "--tls-verify-peer",
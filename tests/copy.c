@@ -0,0 +1,199 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_copy between two exports and a local file. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define SIZE (4 * 1024 * 1024)
+
+static char src_data[SIZE], buf[SIZE];
+
+static struct nbd_group *
+connect_memory (bool base_allocation)
+{
+  struct nbd_group *g;
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=4m", NULL };
+
+  g = nbd_group_create (1);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd = nbd_group_get_handle (g, 0);
+  if ((base_allocation &&
+       nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return g;
+}
+
+static void
+run (struct nbd_copy *c)
+{
+  if (nbd_copy_run (c) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_copy_get_bytes_copied (c) + nbd_copy_get_bytes_zeroed (c) != SIZE) {
+    fprintf (stderr, "copied %" PRIu64 " bytes and zeroed %" PRIu64
+             ", expected %d in total\n",
+             nbd_copy_get_bytes_copied (c), nbd_copy_get_bytes_zeroed (c),
+             SIZE);
+    exit (EXIT_FAILURE);
+  }
+  /* Most of the source is a hole. */
+  if (nbd_copy_get_bytes_zeroed (c) < SIZE / 2) {
+    fprintf (stderr, "only %" PRIu64 " bytes were zeroed\n",
+             nbd_copy_get_bytes_zeroed (c));
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+check_export (struct nbd_group *g, const char *what)
+{
+  if (nbd_pread (nbd_group_get_handle (g, 0), buf, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (buf, src_data, SIZE) != 0) {
+    fprintf (stderr, "%s: data is different from the source\n", what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Fill the destination with junk, so that zeroing matters. */
+static void
+fill_export (struct nbd_group *g)
+{
+  memset (buf, 0xff, SIZE);
+  if (nbd_pwrite (nbd_group_get_handle (g, 0), buf, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_group *src, *dst;
+  struct nbd_copy *c;
+  char tmpfile[] = "/tmp/copyXXXXXX";
+  int fd;
+
+  src = connect_memory (true);
+  dst = connect_memory (false);
+
+  /* Put some data in the source, leaving the rest as a hole. */
+  memset (&src_data[0], 'a', 4096);
+  memset (&src_data[1024 * 1024 + 512], 'b', 65536);
+  memset (&src_data[SIZE - 512], 'c', 512);
+  if (nbd_pwrite (nbd_group_get_handle (src, 0), &src_data[0], 4096, 0,
+                  0) == -1 ||
+      nbd_pwrite (nbd_group_get_handle (src, 0), &src_data[1024 * 1024 + 512],
+                  65536, 1024 * 1024 + 512, 0) == -1 ||
+      nbd_pwrite (nbd_group_get_handle (src, 0), &src_data[SIZE - 512],
+                  512, SIZE - 512, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  fill_export (dst);
+
+  c = nbd_copy_create ();
+  if (c == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_copy_run (c) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: copying without a source should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_copy_set_requests (c, 0) != -1 ||
+      nbd_copy_set_request_size (c, 1) != -1) {
+    fprintf (stderr, "%s: invalid settings should be rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_copy_set_requests (c, 4) == -1 ||
+      nbd_copy_set_request_size (c, 65536) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Export to export. */
+  nbd_copy_set_source (c, src);
+  nbd_copy_set_destination (c, dst);
+  run (c);
+  check_export (dst, "export to export");
+
+  /* Export to local file. */
+  fd = mkstemp (tmpfile);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  unlink (tmpfile);
+  if (nbd_copy_set_destination_fd (c, fd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  run (c);
+  if (pread (fd, buf, SIZE, 0) != SIZE) {
+    perror ("pread");
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (buf, src_data, SIZE) != 0) {
+    fprintf (stderr, "export to file: data is different from the source\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Local file to export. */
+  fill_export (dst);
+  if (nbd_copy_set_source_fd (c, fd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_copy_set_destination (c, dst);
+  if (nbd_copy_run (c) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_export (dst, "file to export");
+
+  nbd_copy_close (c);
+  close (fd);
+  nbd_group_shutdown (src, 0);
+  nbd_group_shutdown (dst, 0);
+  nbd_group_close (src);
+  nbd_group_close (dst);
+  exit (EXIT_SUCCESS);
+}
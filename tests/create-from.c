@@ -0,0 +1,150 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test copying the settings of a handle. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE 1048576
+#define XSTR(s) #s
+#define STR(s) XSTR(s)
+
+static void
+check_settings (const char *argv0, struct nbd_handle *nbd)
+{
+  char *s;
+
+  s = nbd_get_export_name (nbd);
+  if (s == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (strcmp (s, "name") != 0) {
+    fprintf (stderr, "%s: test failed: export name not copied: %s\n",
+             argv0, s);
+    exit (EXIT_FAILURE);
+  }
+  free (s);
+  if (nbd_get_tls (nbd) != LIBNBD_TLS_ALLOW ||
+      nbd_get_request_structured_replies (nbd) != 1 ||
+      nbd_get_pipeline_options (nbd) != 1 ||
+      nbd_get_max_request_size (nbd) != 65536 ||
+      nbd_get_timeout (nbd) != 10000 ||
+      nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_NODELAY) != 0 ||
+      nbd_get_command_pool_size (nbd) != 8) {
+    fprintf (stderr, "%s: test failed: settings not copied\n", argv0);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *template, *nbd;
+  struct nbd_group *g;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "memory", "size=" STR(SIZE), NULL };
+  char *name1, *name2;
+  int i;
+
+  template = nbd_create ();
+  if (template == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_export_name (template, "name") == -1 ||
+      nbd_set_tls (template, LIBNBD_TLS_ALLOW) == -1 ||
+      nbd_set_pipeline_options (template, true) == -1 ||
+      nbd_set_max_request_size (template, 65536) == -1 ||
+      nbd_set_timeout (template, 10000) == -1 ||
+      nbd_set_socket_option (template, LIBNBD_SOCKET_OPTION_NODELAY, 0) == -1 ||
+      nbd_set_command_pool_size (template, 8) == -1 ||
+      nbd_add_meta_context (template, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create_from (template);
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_settings (argv[0], nbd);
+
+  /* The handle name is not copied. */
+  name1 = nbd_get_handle_name (template);
+  name2 = nbd_get_handle_name (nbd);
+  if (name1 == NULL || name2 == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (strcmp (name1, name2) == 0) {
+    fprintf (stderr, "%s: test failed: handle name was copied\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  free (name1);
+  free (name2);
+
+  /* The copied meta context is negotiated.  nbdkit ignores the
+   * export name.
+   */
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) != 1) {
+    fprintf (stderr, "%s: test failed: "
+             "base:allocation was not negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* A connected handle can be a template too. */
+  nbd_close (template);
+  template = nbd_create_from (nbd);
+  if (template == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_is_created (template) != 1) {
+    fprintf (stderr, "%s: test failed: copy is not in created state\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_shutdown (nbd, 0);
+  nbd_close (nbd);
+
+  g = nbd_group_create_from (template, 3);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < nbd_group_get_nr_handles (g); ++i)
+    check_settings (argv[0], nbd_group_get_handle (g, i));
+  nbd_group_close (g);
+
+  nbd_close (template);
+  exit (EXIT_SUCCESS);
+}
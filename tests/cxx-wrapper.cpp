@@ -0,0 +1,186 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the C++ wrapper in libnbd.hpp. */
+
+#ifndef __cplusplus
+#error "this test should be compiled with a C++ compiler"
+#endif
+
+#include <config.h>
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <libnbd.hpp>
+
+using namespace std;
+
+#define NR_REQUESTS 16
+#define SIZE 4096
+
+static const vector<string> args =
+  { "nbdkit", "-s", "--exit-with-parent", "-v", "memory", "size=1M" };
+
+static void
+fail (const char *msg)
+{
+  cerr << "cxx-wrapper: test failed: " << msg << endl;
+  exit (EXIT_FAILURE);
+}
+
+static void
+test_sync (nbd::handle &h)
+{
+  char wbuf[SIZE], rbuf[SIZE];
+
+  memset (wbuf, 1, sizeof wbuf);
+  h.pwrite (wbuf, sizeof wbuf, 0);
+  h.pread (rbuf, sizeof rbuf, 0);
+  if (memcmp (wbuf, rbuf, sizeof wbuf) != 0)
+    fail ("data read back is different");
+
+  /* Errors are thrown. */
+  try {
+    h.pread (rbuf, sizeof rbuf, h.get_size ());
+    fail ("read beyond the end did not throw");
+  }
+  catch (const nbd::error &e) {
+    if (e.errnum () == 0)
+      fail ("error has no errno");
+  }
+}
+
+/* Keep NR_REQUESTS reads in flight using completions stored in the
+ * requests, with no allocation per request.
+ */
+struct request;
+
+struct request_done {
+  request *r;
+  void operator() (int error);
+};
+
+struct request {
+  char buf[SIZE];
+  int done = 0, error = 0;
+  nbd::completion<request_done> c { request_done { this } };
+};
+
+void
+request_done::operator() (int error)
+{
+  r->done++;
+  r->error = error;
+}
+
+static void
+test_completions (nbd::handle &h)
+{
+  static request requests[NR_REQUESTS];
+  size_t i;
+
+  for (i = 0; i < NR_REQUESTS; ++i)
+    h.aio_pread (requests[i].buf, SIZE, i * SIZE, requests[i].c);
+  while (h.aio_in_flight () > 0)
+    h.poll (-1);
+
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    if (requests[i].done != 1 || requests[i].error != 0)
+      fail ("completion was not called once");
+  }
+}
+
+#ifdef LIBNBD_HPP_COROUTINES
+static int coroutines_done;
+
+static nbd::detached
+copy_blocks (nbd::handle &h, unsigned n)
+{
+  char buf[SIZE];
+
+  memset (buf, n, sizeof buf);
+  co_await h.async_pwrite (buf, sizeof buf, n * SIZE);
+  memset (buf, 0, sizeof buf);
+#ifdef LIBNBD_HPP_SPAN
+  co_await h.async_pread (span (buf), n * SIZE);
+#else
+  co_await h.async_pread (buf, sizeof buf, n * SIZE);
+#endif
+  if (buf[0] != (char) n || buf[SIZE - 1] != (char) n)
+    fail ("coroutine read back different data");
+
+  try {
+    co_await h.async_pread (buf, sizeof buf, h.get_size ());
+    fail ("coroutine read beyond the end did not throw");
+  }
+  catch (const nbd::error &) { }
+
+  coroutines_done++;
+}
+
+static void
+test_coroutines (nbd::handle &h)
+{
+  unsigned i;
+
+  try {
+    nbd::reactor r;
+
+    r.add (h);
+    for (i = 0; i < NR_REQUESTS; ++i)
+      copy_blocks (h, i + 1);
+    while (coroutines_done < NR_REQUESTS)
+      r.poll (-1);
+    r.remove (h);
+  }
+  catch (const nbd::error &e) {
+    if (e.errnum () != ENOTSUP)
+      throw;
+    cerr << "cxx-wrapper: skipping coroutines: " << e.what () << endl;
+  }
+}
+#endif
+
+int
+main ()
+{
+  try {
+    nbd::handle h;
+
+    h.connect_command (args);
+    test_sync (h);
+    test_completions (h);
+#ifdef LIBNBD_HPP_COROUTINES
+    test_coroutines (h);
+#endif
+
+    /* Handles are move-only. */
+    nbd::handle h2 = move (h);
+    if (h || !h2)
+      fail ("handle was not moved");
+    h2.shutdown ();
+  }
+  catch (const nbd::error &e) {
+    cerr << e.what () << endl;
+    exit (EXIT_FAILURE);
+  }
+  exit (EXIT_SUCCESS);
+}
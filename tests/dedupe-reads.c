@@ -0,0 +1,238 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that reads lying within a read in flight are answered from it
+ * by nbd_set_dedupe_reads.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define SIZE (64 * 1024)
+#define NR_READS 8
+/* Bytes sent on the wire for each read request. */
+#define REQUEST_SIZE 28
+
+static char src[SIZE], big[SIZE], small[NR_READS][4096];
+static unsigned completions, cancellations;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error == ECANCELED) {
+    cancellations++;
+    return 1;
+  }
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+static int64_t
+bytes_sent (struct nbd_handle *nbd)
+{
+  int64_t r;
+
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (r = nbd_get_stats_bytes_sent (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+static int64_t
+aio_pread (struct nbd_handle *nbd, void *buf, size_t count, uint64_t offset)
+{
+  int64_t cookie;
+
+  cookie = nbd_aio_pread (nbd, buf, count, offset,
+                          (nbd_completion_callback) { .callback = completion },
+                          0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return cookie;
+}
+
+static void
+wait_all (struct nbd_handle *nbd)
+{
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+/* Read the whole of src, and some small pieces of it while that read
+ * is in flight, optionally writing elsewhere in between.  Returns the
+ * number of read requests which were sent.
+ */
+static int64_t
+read_batch (const char *progname, struct nbd_handle *nbd, bool write)
+{
+  int64_t sent;
+  size_t i;
+
+  memset (big, 0, SIZE);
+  memset (small, 0, sizeof small);
+  sent = bytes_sent (nbd);
+  completions = 0;
+  aio_pread (nbd, big, SIZE, 0);
+  if (write &&
+      nbd_aio_pwrite (nbd, src, 512, SIZE,
+                      (nbd_completion_callback) { .callback = completion },
+                      0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_READS; ++i)
+    aio_pread (nbd, small[i], 4096, i * 5000);
+  wait_all (nbd);
+  if (completions != NR_READS + 1 + write) {
+    fprintf (stderr, "%s: expected %d completions, got %u\n",
+             progname, NR_READS + 1 + write, completions);
+    exit (EXIT_FAILURE);
+  }
+  sent = bytes_sent (nbd) - sent - write * (REQUEST_SIZE + 512);
+
+  if (memcmp (big, src, SIZE) != 0) {
+    fprintf (stderr, "%s: data mismatch in large read\n", progname);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_READS; ++i) {
+    if (memcmp (small[i], &src[i * 5000], 4096) != 0) {
+      fprintf (stderr, "%s: data mismatch in read %zu\n", progname, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  return sent / REQUEST_SIZE;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=1M", NULL };
+  int64_t requests, cookie;
+  size_t i;
+
+  for (i = 0; i < SIZE; ++i)
+    src[i] = (i * 11) ^ (i >> 9);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_dedupe_reads (nbd) != 0) {
+    fprintf (stderr, "%s: reads should not be shared by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1 ||
+      nbd_pwrite (nbd, src, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  requests = read_batch (argv[0], nbd, false);
+  if (requests != NR_READS + 1) {
+    fprintf (stderr, "%s: expected %d requests without sharing, "
+             "got %" PRIi64 "\n", argv[0], NR_READS + 1, requests);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_dedupe_reads (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  requests = read_batch (argv[0], nbd, false);
+  if (requests != 1) {
+    fprintf (stderr, "%s: expected 1 request with sharing, "
+             "got %" PRIi64 "\n", argv[0], requests);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Reads issued after a write are not answered by earlier reads. */
+  requests = read_batch (argv[0], nbd, true);
+  if (requests != NR_READS + 1) {
+    fprintf (stderr, "%s: expected %d requests after a write, "
+             "got %" PRIi64 "\n", argv[0], NR_READS + 1, requests);
+    exit (EXIT_FAILURE);
+  }
+
+  /* If the large read is cancelled, the others are sent instead. */
+  memset (small, 0, sizeof small);
+  completions = 0;
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  cookie = aio_pread (nbd, big, SIZE, 0);
+  for (i = 0; i < NR_READS; ++i)
+    aio_pread (nbd, small[i], 4096, i * 5000);
+  if (nbd_aio_in_flight (nbd) != 1) {
+    fprintf (stderr, "%s: only one read should be queued\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_cancel (nbd, cookie) == -1 ||
+      nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  wait_all (nbd);
+  if (completions != NR_READS || cancellations != 1) {
+    fprintf (stderr, "%s: expected %d completions and 1 cancellation, "
+             "got %u and %u\n", argv[0], NR_READS, completions,
+             cancellations);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_READS; ++i) {
+    if (memcmp (small[i], &src[i * 5000], 4096) != 0) {
+      fprintf (stderr, "%s: data mismatch in read %zu after "
+               "cancellation\n", argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
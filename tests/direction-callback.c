@@ -0,0 +1,151 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the direction callback by driving the handle from a main loop
+ * which only knows the direction from the callback.  If a change was
+ * missed the loop would wait forever, so it times out instead.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+
+#include <libnbd.h>
+
+/* Large enough to fill the socket buffer, so that the handle has to
+ * wait to write.
+ */
+#define SIZE (4 * 1024 * 1024)
+
+static unsigned dir;
+static unsigned nr_calls;
+static int freed;
+
+static int
+direction_fn (void *user_data, unsigned direction)
+{
+  if (direction == dir) {
+    fprintf (stderr, "callback called without a change of direction\n");
+    exit (EXIT_FAILURE);
+  }
+  dir = direction;
+  nr_calls++;
+  return 0;
+}
+
+static void
+free_fn (void *user_data)
+{
+  freed++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  static char buf[SIZE];
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=8m", NULL };
+  struct pollfd fds[1];
+  int64_t cookie;
+  int r;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_direction_callback (nbd,
+                                  (nbd_direction_callback) {
+                                    .callback = direction_fn,
+                                    .free = free_fn }) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  dir = nbd_aio_get_direction (nbd);
+
+  memset (buf, 0x55, sizeof buf);
+  cookie = nbd_aio_pwrite (nbd, buf, sizeof buf, 0, NBD_NULL_COMPLETION, 0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while ((r = nbd_aio_command_completed (nbd, cookie)) == 0) {
+    fds[0].fd = nbd_aio_get_fd (nbd);
+    fds[0].events = 0;
+    if (dir & LIBNBD_AIO_DIRECTION_READ)
+      fds[0].events |= POLLIN;
+    if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+      fds[0].events |= POLLOUT;
+    fds[0].revents = 0;
+    switch (poll (fds, 1, 10000)) {
+    case -1:
+      perror ("poll");
+      exit (EXIT_FAILURE);
+    case 0:
+      fprintf (stderr, "%s: timed out, direction is out of date\n", argv[0]);
+      exit (EXIT_FAILURE);
+    }
+    if (dir != nbd_aio_get_direction (nbd)) {
+      fprintf (stderr, "%s: direction is out of date\n", argv[0]);
+      exit (EXIT_FAILURE);
+    }
+    if ((fds[0].revents & POLLIN) != 0)
+      r = nbd_aio_notify_read (nbd);
+    else if ((fds[0].revents & POLLOUT) != 0)
+      r = nbd_aio_notify_write (nbd);
+    else
+      r = 0;
+    if (r == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The write had to wait for the socket, then for the reply. */
+  if (nr_calls < 2) {
+    fprintf (stderr, "%s: callback was called %u times, expected at least 2\n",
+             argv[0], nr_calls);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_clear_direction_callback (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (freed != 1) {
+    fprintf (stderr, "%s: callback was not freed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
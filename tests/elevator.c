@@ -0,0 +1,177 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that nbd_set_elevator sorts queued commands by offset.  The
+ * server handles one request at a time, so the replies arrive in the
+ * order the requests were sent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define MAX_COMMANDS 16
+#define BLOCK 4096
+
+static char buf[BLOCK];
+static int order[MAX_COMMANDS];
+static int completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  order[completions++] = (intptr_t) user_data;
+  return 1;
+}
+
+/* Issue the commands described by cmds in one batch, each with its
+ * index as the user data, and check that they complete in the
+ * expected order.  Each command is 'R' for a read or 'W' for a write
+ * of one block, at the block in the matching entry of blocks.
+ */
+static void
+check_order (const char *progname, struct nbd_handle *nbd,
+             const char *cmds, const int *blocks, const int *expected)
+{
+  nbd_completion_callback cb;
+  int i, n = strlen (cmds);
+  int64_t r;
+
+  completions = 0;
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; ++i) {
+    cb = (nbd_completion_callback) { .callback = completion,
+                                     .user_data = (void *) (intptr_t) i };
+    if (cmds[i] == 'W')
+      r = nbd_aio_pwrite (nbd, buf, BLOCK, blocks[i] * BLOCK, cb, 0);
+    else
+      r = nbd_aio_pread (nbd, buf, BLOCK, blocks[i] * BLOCK, cb, 0);
+    if (r == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (completions != n ||
+      memcmp (order, expected, n * sizeof order[0]) != 0) {
+    fprintf (stderr, "%s: commands %s completed in the order", progname,
+             cmds);
+    for (i = 0; i < completions; ++i)
+      fprintf (stderr, " %d", order[i]);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-t", "1",
+                   "memory", "size=1M", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_elevator (nbd) != LIBNBD_ELEVATOR_OFF ||
+      nbd_get_elevator_window (nbd) != 32) {
+    fprintf (stderr, "%s: unexpected default elevator settings\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_elevator_window (nbd, 1) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: a window of 1 should be rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* By default, and when the export is not rotational, commands are
+   * sent in the order they were issued.
+   */
+  check_order (argv[0], nbd, "RRRR",
+               (const int []) { 6, 2, 9, 1 },
+               (const int []) { 0, 1, 2, 3 });
+  if (nbd_set_elevator (nbd, LIBNBD_ELEVATOR_AUTO) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_is_rotational (nbd) == 0)
+    check_order (argv[0], nbd, "RRRR",
+                 (const int []) { 6, 2, 9, 1 },
+                 (const int []) { 0, 1, 2, 3 });
+
+  /* Start the sweep at the beginning of the export. */
+  if (nbd_set_elevator (nbd, LIBNBD_ELEVATOR_ON) == -1 ||
+      nbd_pread (nbd, buf, 512, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_order (argv[0], nbd, "RRRRR",
+               (const int []) { 6, 2, 9, 1, 7 },
+               (const int []) { 3, 1, 0, 4, 2 });
+
+  /* The next sweep goes on from block 10 and then starts again. */
+  check_order (argv[0], nbd, "RRRR",
+               (const int []) { 3, 20, 0, 15 },
+               (const int []) { 3, 1, 2, 0 });
+
+  /* A write is not moved past a read of the same block, and nothing
+   * after it is sorted with the commands before it.
+   */
+  check_order (argv[0], nbd, "RRWR",
+               (const int []) { 8, 5, 8, 6 },
+               (const int []) { 1, 0, 2, 3 });
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -49,6 +49,14 @@ check (int experr, const char *prefix)
              progname, msg);
     exit (EXIT_FAILURE);
   }
+  /* The message is only built when it is first asked for, so check
+   * that asking again gives the same message.
+   */
+  if (strcmp (nbd_get_error (), msg) != 0) {
+    fprintf (stderr, "%s: test failed: error message changed: %s\n",
+             progname, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
   if (errnum != experr) {
     fprintf (stderr, "%s: test failed: "
              "expected errno = %d (%s), but got %d\n",
@@ -0,0 +1,162 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test requests of 4G and more with extended headers. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+/* Larger than 4G, so it can only be covered in one request with
+ * extended headers.
+ */
+#define SIZE "6G"
+#define SIZE_BYTES (UINT64_C (6) << 30)
+
+static char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=" SIZE, NULL };
+
+static uint64_t extents_length;
+
+static int
+extent (void *opaque, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  size_t i;
+
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0)
+    return 0;
+  for (i = 0; i < nr_entries; i += 2)
+    extents_length += entries[i];
+  return 0;
+}
+
+static struct nbd_handle *
+connect_export (bool request_eh, bool pipeline)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_request_extended_headers (nbd, request_eh) == -1 ||
+      nbd_set_pipeline_options (nbd, pipeline) == -1 ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void
+test_large_requests (const char *argv0, struct nbd_handle *nbd)
+{
+  int eh, r;
+
+  eh = nbd_get_extended_headers_negotiated (nbd);
+  if (eh == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (eh && nbd_get_structured_replies_negotiated (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: extended headers without "
+             "structured replies\n", argv0);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Without extended headers these requests are too large. */
+  r = nbd_zero (nbd, SIZE_BYTES, 0, 0);
+  if (!eh) {
+    if (r != -1 || nbd_get_errno () != ERANGE) {
+      fprintf (stderr, "%s: test failed: expected ERANGE from "
+               "large zero request\n", argv0);
+      exit (EXIT_FAILURE);
+    }
+    return;
+  }
+  if (r == -1 ||
+      nbd_trim (nbd, SIZE_BYTES, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The whole export is described by one request. */
+  extents_length = 0;
+  if (nbd_block_status (nbd, SIZE_BYTES, 0,
+                        (nbd_extent_callback) { .callback = extent },
+                        0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (extents_length < SIZE_BYTES) {
+    fprintf (stderr, "%s: test failed: block status covered %" PRIu64
+             " bytes, expected %" PRIu64 "\n",
+             argv0, extents_length, SIZE_BYTES);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_request_extended_headers (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: unexpected default flag\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* Extended headers are used if the server supports them. */
+  nbd = connect_export (true, false);
+  test_large_requests (argv[0], nbd);
+  nbd_close (nbd);
+
+  /* The same when the options are pipelined. */
+  nbd = connect_export (true, true);
+  test_large_requests (argv[0], nbd);
+  nbd_close (nbd);
+
+  /* Not requesting them gives the old limits. */
+  nbd = connect_export (false, false);
+  if (nbd_get_extended_headers_negotiated (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: "
+             "extended headers were negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  test_large_requests (argv[0], nbd);
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
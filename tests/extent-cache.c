@@ -0,0 +1,163 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the extent cache. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE (1024 * 1024)
+#define WRITE_OFFSET (64 * 1024)
+
+/* What the last block status call returned. */
+static uint64_t covered;        /* Bytes described, from the offset. */
+static uint32_t first_flags;    /* Flags of the first extent. */
+
+static int
+extent (void *user_data, const char *metacontext, uint64_t offset,
+        uint32_t *entries, size_t nr_entries, int *error)
+{
+  size_t i;
+
+  if (strcmp (metacontext, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0)
+    return 0;
+  covered = 0;
+  first_flags = entries[1];
+  for (i = 0; i < nr_entries; i += 2)
+    covered += entries[i];
+  return 0;
+}
+
+static void
+block_status (struct nbd_handle *nbd, uint64_t count, uint64_t offset,
+              uint32_t flags)
+{
+  if (nbd_block_status (nbd, count, offset,
+                        (nbd_extent_callback) { .callback = extent },
+                        flags) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (covered < count && !(flags & LIBNBD_CMD_FLAG_REQ_ONE)) {
+    fprintf (stderr, "block status at %" PRIu64 " only covered %" PRIu64
+             " bytes\n", offset, covered);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+check_counters (struct nbd_handle *nbd, int64_t hits, int64_t misses)
+{
+  if (nbd_get_extent_cache_hits (nbd) != hits ||
+      nbd_get_extent_cache_misses (nbd) != misses) {
+    fprintf (stderr, "expected %" PRIi64 " hits and %" PRIi64 " misses, "
+             "got %" PRIi64 " and %" PRIi64 "\n",
+             hits, misses, nbd_get_extent_cache_hits (nbd),
+             nbd_get_extent_cache_misses (nbd));
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[512];
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_extent_cache (nbd) != 0) {
+    fprintf (stderr, "extent cache should be disabled by default\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1 ||
+      nbd_set_extent_cache (nbd, true) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The first call goes to the server, the rest of the disk is
+   * answered from the cache.
+   */
+  block_status (nbd, SIZE, 0, 0);
+  check_counters (nbd, 0, 1);
+  block_status (nbd, SIZE, 0, 0);
+  check_counters (nbd, 1, 1);
+  block_status (nbd, 4096, WRITE_OFFSET, 0);
+  check_counters (nbd, 2, 1);
+  if ((first_flags & LIBNBD_STATE_HOLE) == 0) {
+    fprintf (stderr, "expected a hole before writing\n");
+    exit (EXIT_FAILURE);
+  }
+  block_status (nbd, SIZE - 512, 512, LIBNBD_CMD_FLAG_REQ_ONE);
+  check_counters (nbd, 3, 1);
+  if (covered == 0 || covered > SIZE - 512) {
+    fprintf (stderr, "unexpected length with REQ_ONE: %" PRIu64 "\n",
+             covered);
+    exit (EXIT_FAILURE);
+  }
+
+  /* A write removes its range from the cache, but leaves the rest. */
+  memset (buf, 1, sizeof buf);
+  if (nbd_pwrite (nbd, buf, sizeof buf, WRITE_OFFSET, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  block_status (nbd, 4096, 0, 0);
+  check_counters (nbd, 4, 1);
+  block_status (nbd, 4096, WRITE_OFFSET, 0);
+  check_counters (nbd, 4, 2);
+  if ((first_flags & LIBNBD_STATE_HOLE) != 0) {
+    fprintf (stderr, "expected data after writing\n");
+    exit (EXIT_FAILURE);
+  }
+  block_status (nbd, 4096, WRITE_OFFSET, 0);
+  check_counters (nbd, 5, 2);
+  if ((first_flags & LIBNBD_STATE_HOLE) != 0) {
+    fprintf (stderr, "expected data from the cache after writing\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Disabling the cache sends everything to the server. */
+  if (nbd_set_extent_cache (nbd, false) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  block_status (nbd, SIZE, 0, 0);
+  check_counters (nbd, 5, 2);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
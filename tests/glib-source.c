@@ -0,0 +1,145 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the GLib source in libnbd-glib.h: connect two handles and
+ * read from both using the same main loop.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libnbd-glib.h>
+
+#define NR_HANDLES 2
+#define NR_COMMANDS 32
+
+static const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                             "memory", "size=1m", NULL };
+
+struct conn {
+  GSource *source;
+  bool started;
+  unsigned retired;
+  char buf[NR_COMMANDS][512];
+};
+
+static struct conn conns[NR_HANDLES];
+static GMainLoop *loop;
+static unsigned nr_done;
+
+static int
+completed (void *user_data, int64_t cookie, int error)
+{
+  struct conn *c = user_data;
+
+  if (error != 0) {
+    fprintf (stderr, "glib-source: command failed\n");
+    exit (EXIT_FAILURE);
+  }
+  c->retired++;
+  return 0;
+}
+
+/* Called once each time the handle has been driven. */
+static gboolean
+dispatch (gpointer user_data)
+{
+  struct conn *c = user_data;
+  struct nbd_handle *nbd = nbd_gsource_get_handle (c->source);
+  size_t i;
+
+  if (nbd_aio_is_dead (nbd) || nbd_aio_is_closed (nbd)) {
+    fprintf (stderr, "glib-source: connection failed: %s\n",
+             nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (!c->started) {
+    if (!nbd_aio_is_ready (nbd))
+      return G_SOURCE_CONTINUE;
+    for (i = 0; i < NR_COMMANDS; ++i) {
+      if (nbd_aio_pread (nbd, c->buf[i], sizeof c->buf[i], i * 512,
+                         NBD_NULL_COMPLETION, 0) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+    c->started = true;
+  }
+
+  if (nbd_aio_get_completions (nbd, NR_COMMANDS,
+                               (nbd_completed_callback) {
+                                 .callback = completed,
+                                 .user_data = c }) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (c->retired == NR_COMMANDS) {
+    if (++nr_done == NR_HANDLES)
+      g_main_loop_quit (loop);
+    return G_SOURCE_REMOVE;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+timed_out (gpointer user_data)
+{
+  fprintf (stderr, "glib-source: test timed out\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  size_t i;
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd = nbd_create ();
+    if (nbd == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    conns[i].source = nbd_gsource_new (nbd);
+    if (conns[i].source == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    g_source_set_callback (conns[i].source, dispatch, &conns[i], NULL);
+    g_source_attach (conns[i].source, NULL);
+    if (nbd_aio_connect_command (nbd, (char **) cmd) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  g_timeout_add_seconds (60, timed_out, NULL);
+  g_main_loop_run (loop);
+
+  /* The sources were removed, and finalizing them closes the handles. */
+  for (i = 0; i < NR_HANDLES; ++i)
+    g_source_unref (conns[i].source);
+  g_main_loop_unref (loop);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,147 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_group_map. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_HANDLES 4
+#define SIZE (1024 * 1024)
+#define HOLE (LIBNBD_STATE_HOLE|LIBNBD_STATE_ZERO)
+
+static char buf[8192];
+
+/* The data written below, and the extents which should be found. */
+static const struct nbd_extent expected[] = {
+  { 0, 4096, 0 },
+  { 4096, 36864, HOLE },
+  { 40960, 8192, 0 },
+  { 49152, SIZE - 49152 - 4096, HOLE },
+  { SIZE - 4096, 4096, 0 },
+};
+#define NR_EXPECTED (sizeof expected / sizeof expected[0])
+
+static void
+check_map (struct nbd_group *g, uint64_t range_size, const char *argv0)
+{
+  struct nbd_extent *extents;
+  int64_t nr;
+  size_t i;
+
+  nr = nbd_group_map (g, LIBNBD_CONTEXT_BASE_ALLOCATION, range_size,
+                      &extents);
+  if (nr == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nr != NR_EXPECTED) {
+    fprintf (stderr, "%s: range size %" PRIu64 ": expected %zu extents, "
+             "got %" PRIi64 "\n", argv0, range_size, NR_EXPECTED, nr);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_EXPECTED; ++i) {
+    if (extents[i].offset != expected[i].offset ||
+        extents[i].length != expected[i].length ||
+        extents[i].flags != expected[i].flags) {
+      fprintf (stderr, "%s: range size %" PRIu64 ": extent %zu is "
+               "%" PRIu64 "+%" PRIu64 " flags %" PRIu32 "\n",
+               argv0, range_size, i, extents[i].offset, extents[i].length,
+               extents[i].flags);
+      exit (EXIT_FAILURE);
+    }
+  }
+  free (extents);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_group *g;
+  struct nbd_handle *nbd;
+  struct nbd_extent *extents;
+  char *uri;
+  int i;
+
+  if (argc != 2) {
+    fprintf (stderr, "%s socket\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (asprintf (&uri, "nbd+unix:///?socket=%s", argv[1]) == -1) {
+    perror ("asprintf");
+    exit (EXIT_FAILURE);
+  }
+
+  g = nbd_group_create (NR_HANDLES);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd = nbd_group_get_handle (g, i);
+    if (nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_group_connect_uri (g, uri) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_group_get_handle (g, 0);
+  memset (buf, 1, sizeof buf);
+  if (nbd_pwrite (nbd, buf, 4096, 0, 0) == -1 ||
+      nbd_pwrite (nbd, buf, 8192, 40960, 0) == -1 ||
+      nbd_pwrite (nbd, buf, 4096, SIZE - 4096, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Small ranges are spread over all the handles, and the extents
+   * crossing their boundaries must be merged.
+   */
+  check_map (g, 0, argv[0]);
+  check_map (g, 65536, argv[0]);
+  check_map (g, 12345, argv[0]);
+
+  if (nbd_group_map (g, LIBNBD_CONTEXT_BASE_ALLOCATION,
+                     UINT64_C (1) << 32, &extents) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: too large range size was not rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_map (g, "qemu:dirty-bitmap:none", 0, &extents) != -1 ||
+      nbd_get_errno () != ENOTSUP) {
+    fprintf (stderr, "%s: context not negotiated was not rejected\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_group_close (g);
+  free (uri);
+  exit (EXIT_SUCCESS);
+}
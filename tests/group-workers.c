@@ -0,0 +1,210 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that the workers started by nbd_group_start_workers drive the
+ * handles of a group without the program polling.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#define NR_HANDLES 4
+#define NR_WORKERS 2
+#define NR_COMMANDS 64
+#define BLOCK_SIZE 4096
+
+static char buf[NR_COMMANDS][BLOCK_SIZE];
+static _Atomic int completed;
+static _Atomic int callbacks_in_main;
+static pthread_t main_thread;
+
+static int
+callback (void *user_data, int *error)
+{
+  if (pthread_equal (pthread_self (), main_thread))
+    callbacks_in_main++;
+  if (*error == 0)
+    completed++;
+  return 1;
+}
+
+/* Issue one command per block and wait for their callbacks without
+ * calling any libnbd function.
+ */
+static void
+issue_and_wait (struct nbd_group *g, bool write, const char *argv0)
+{
+  struct nbd_handle *nbd;
+  int64_t cookie;
+  size_t i;
+  int tries;
+
+  completed = 0;
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    nbd = nbd_group_get_handle (g, i % NR_HANDLES);
+    if (write)
+      cookie = nbd_aio_pwrite (nbd, buf[i], BLOCK_SIZE, i * BLOCK_SIZE,
+                               (nbd_completion_callback) {
+                                 .callback = callback }, 0);
+    else
+      cookie = nbd_aio_pread (nbd, buf[i], BLOCK_SIZE, i * BLOCK_SIZE,
+                              (nbd_completion_callback) {
+                                .callback = callback }, 0);
+    if (cookie == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (tries = 0; completed < NR_COMMANDS; ++tries) {
+    if (tries == 10000) {
+      fprintf (stderr, "%s: only %d of %d commands completed\n",
+               argv0, completed, NR_COMMANDS);
+      exit (EXIT_FAILURE);
+    }
+    usleep (1000);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_group *g;
+  char *uri;
+  cpu_set_t set;
+  int cpus[1];
+  int node = 0;
+  size_t i, j;
+
+  if (argc != 2) {
+    fprintf (stderr, "%s socket\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (asprintf (&uri, "nbd+unix:///?socket=%s", argv[1]) == -1) {
+    perror ("asprintf");
+    exit (EXIT_FAILURE);
+  }
+  main_thread = pthread_self ();
+
+  g = nbd_group_create (NR_HANDLES);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_nr_workers (g) != 0) {
+    fprintf (stderr, "%s: a new group should have no workers\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_start_workers (g, 0, NULL, 0, 0) != -1 ||
+      nbd_get_errno () != EINVAL ||
+      nbd_group_start_workers (g, NR_HANDLES + 1, NULL, 0, 0) != -1 ||
+      nbd_get_errno () != EINVAL ||
+      nbd_group_start_workers (g, NR_WORKERS, NULL, 0, 2) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: invalid workers were not rejected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Pin the workers to a CPU this process may use.  Workers may be
+   * started before the handles are connected.
+   */
+  if (sched_getaffinity (0, sizeof set, &set) == -1) {
+    perror ("sched_getaffinity");
+    exit (EXIT_FAILURE);
+  }
+  for (cpus[0] = 0; !CPU_ISSET (cpus[0], &set); ++cpus[0])
+    ;
+  if (nbd_group_start_workers (g, NR_WORKERS, cpus, 1, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_nr_workers (g) != NR_WORKERS) {
+    fprintf (stderr, "%s: wrong number of workers\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_start_workers (g, NR_WORKERS, NULL, 0, 0) != -1 ||
+      nbd_get_errno () != EBUSY) {
+    fprintf (stderr, "%s: workers were started twice\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_connect_uri (g, uri) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_COMMANDS; ++i)
+    memset (buf[i], i + 1, BLOCK_SIZE);
+  issue_and_wait (g, true, argv[0]);
+  memset (buf, 0, sizeof buf);
+  issue_and_wait (g, false, argv[0]);
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    for (j = 0; j < BLOCK_SIZE; ++j) {
+      if (buf[i][j] != (char) (i + 1)) {
+        fprintf (stderr, "%s: data mismatch at offset %zu\n",
+                 argv[0], i * BLOCK_SIZE + j);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  if (callbacks_in_main != 0) {
+    fprintf (stderr, "%s: callbacks should run in the workers\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The handles can be used normally after the workers stop. */
+  if (nbd_group_stop_workers (g) == -1 ||
+      nbd_group_flush (g, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_nr_workers (g) != 0) {
+    fprintf (stderr, "%s: workers did not stop\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Workers can also be pinned to a NUMA node, if the system has
+   * them, and are stopped when the group is closed.
+   */
+  if (access ("/sys/devices/system/node/node0/cpulist", R_OK) == 0) {
+    if (nbd_group_start_workers (g, NR_HANDLES, &node, 1,
+                                 LIBNBD_WORKERS_NUMA_NODES) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    issue_and_wait (g, false, argv[0]);
+  }
+
+  if (nbd_group_shutdown (g, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_group_close (g);
+  free (uri);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,184 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test groups of handles, see nbd_group_create(3). */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define NR_HANDLES 4
+#define NR_COMMANDS 64
+#define STRIPE_SIZE 4096
+
+static char buf[NR_COMMANDS][STRIPE_SIZE];
+
+/* Issue one command per stripe using the group to pick the handle,
+ * then wait for them all.
+ */
+static void
+issue_and_wait (struct nbd_group *g, int write, const char *argv0)
+{
+  struct nbd_handle *nbd[NR_COMMANDS];
+  int64_t cookie[NR_COMMANDS];
+  size_t i, done;
+  int r;
+
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    nbd[i] = nbd_group_select (g, i * STRIPE_SIZE);
+    if (write)
+      cookie[i] = nbd_aio_pwrite (nbd[i], buf[i], STRIPE_SIZE,
+                                  i * STRIPE_SIZE, NBD_NULL_COMPLETION, 0);
+    else
+      cookie[i] = nbd_aio_pread (nbd[i], buf[i], STRIPE_SIZE,
+                                 i * STRIPE_SIZE, NBD_NULL_COMPLETION, 0);
+    if (cookie[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (done = 0; done < NR_COMMANDS; ) {
+    if (nbd_group_poll (g, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    for (i = 0; i < NR_COMMANDS; ++i) {
+      if (cookie[i] == 0)
+        continue;
+      r = nbd_aio_command_completed (nbd[i], cookie[i]);
+      if (r == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      if (r == 1) {
+        cookie[i] = 0;
+        done++;
+      }
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_group *g;
+  struct nbd_handle *nbd;
+  char *uri;
+  int i;
+  size_t j;
+
+  if (argc != 2) {
+    fprintf (stderr, "%s socket\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (asprintf (&uri, "nbd+unix:///?socket=%s", argv[1]) == -1) {
+    perror ("asprintf");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_group_create (0) != NULL) {
+    fprintf (stderr, "%s: expected empty group to fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  g = nbd_group_create (NR_HANDLES);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_nr_handles (g) != NR_HANDLES) {
+    fprintf (stderr, "%s: wrong number of handles\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_handle (g, NR_HANDLES) != NULL) {
+    fprintf (stderr, "%s: expected out of range handle to fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_connect_uri (g, uri) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd = nbd_group_get_handle (g, i);
+    if (nbd == NULL || !nbd_aio_is_ready (nbd)) {
+      fprintf (stderr, "%s: handle %d is not connected\n", argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Striping by offset puts each stripe on a predictable handle. */
+  if (nbd_group_set_stripe_size (g, STRIPE_SIZE) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_stripe_size (g) != STRIPE_SIZE) {
+    fprintf (stderr, "%s: wrong stripe size\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_HANDLES * 2; ++i) {
+    if (nbd_group_select (g, i * STRIPE_SIZE + 1) !=
+        nbd_group_get_handle (g, i % NR_HANDLES)) {
+      fprintf (stderr, "%s: stripe %d on wrong handle\n", argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (j = 0; j < NR_COMMANDS; ++j)
+    memset (buf[j], j + 1, STRIPE_SIZE);
+  issue_and_wait (g, 1, argv[0]);
+  if (nbd_group_flush (g, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Read it back choosing the least busy handle instead, so most
+   * stripes are read on a different connection from the write.
+   */
+  if (nbd_group_set_stripe_size (g, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 0, sizeof buf);
+  issue_and_wait (g, 0, argv[0]);
+  for (j = 0; j < NR_COMMANDS; ++j) {
+    size_t k;
+
+    for (k = 0; k < STRIPE_SIZE; ++k) {
+      if (buf[j][k] != (char) (j + 1)) {
+        fprintf (stderr, "%s: data mismatch at offset %zu\n",
+                 argv[0], j * STRIPE_SIZE + k);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  if (nbd_group_shutdown (g, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_group_close (g);
+  free (uri);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,124 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test block size constraints and nbd_set_max_request_size. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static char buf[8192];
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int64_t minimum, preferred, maximum;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_max_request_size (nbd) != 64 * 1024 * 1024) {
+    fprintf (stderr, "%s: unexpected default maximum request size %" PRIi64
+             "\n", argv[0], nbd_get_max_request_size (nbd));
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_max_request_size (nbd, 0) != -1 || nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "%s: expected nbd_set_max_request_size (0) to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Block sizes are not known until connected. */
+  if (nbd_get_block_size (nbd, LIBNBD_SIZE_MINIMUM) != -1) {
+    fprintf (stderr, "%s: expected nbd_get_block_size to fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The server may or may not advertise constraints, but if it does
+   * they must be consistent.
+   */
+  minimum = nbd_get_block_size (nbd, LIBNBD_SIZE_MINIMUM);
+  preferred = nbd_get_block_size (nbd, LIBNBD_SIZE_PREFERRED);
+  maximum = nbd_get_block_size (nbd, LIBNBD_SIZE_MAXIMUM);
+  printf ("block size: minimum=%" PRIi64 " preferred=%" PRIi64
+          " maximum=%" PRIi64 "\n", minimum, preferred, maximum);
+  if (minimum == -1 || preferred == -1 || maximum == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (minimum != 0 &&
+      (preferred < minimum || maximum < minimum ||
+       (minimum & (minimum - 1)) != 0)) {
+    fprintf (stderr, "%s: inconsistent block size constraints\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Lower the limit, and check it is enforced. */
+  if (nbd_set_max_request_size (nbd, 4096) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_max_request_size (nbd) != 4096) {
+    fprintf (stderr, "%s: unexpected maximum request size %" PRIi64 "\n",
+             argv[0], nbd_get_max_request_size (nbd));
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, 8192, 0, 0) != -1 || nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "%s: expected 8192 byte read to fail with ERANGE\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, 4096, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Raise it again. */
+  if (nbd_set_max_request_size (nbd, 8192) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, 8192, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,146 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test pipelining the handshake options. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE 1048576
+#define XSTR(s) #s
+#define STR(s) XSTR(s)
+
+static char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=" STR(SIZE), NULL };
+
+static struct nbd_handle *
+connect_pipelined (const char *argv0, bool request_sr, bool probe)
+{
+  struct nbd_handle *nbd;
+  int64_t r;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_pipeline_options (nbd, true) == -1 ||
+      nbd_set_request_structured_replies (nbd, request_sr) == -1 ||
+      nbd_set_probe_only (nbd, probe) == -1 ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_pipeline_options (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: pipeline options flag not set\n",
+             argv0);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if ((r = nbd_get_size (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (r != SIZE) {
+    fprintf (stderr, "%s: test failed: incorrect size, "
+             "actual %" PRIi64 ", expected %d\n",
+             argv0, r, SIZE);
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[512];
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_pipeline_options (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: unexpected default flag\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* All the options are pipelined. */
+  nbd = connect_pipelined (argv[0], true, false);
+  if (nbd_get_structured_replies_negotiated (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: "
+             "structured replies were not negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) != 1) {
+    fprintf (stderr, "%s: test failed: "
+             "base:allocation was not negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* Only NBD_OPT_GO is pipelined. */
+  nbd = connect_pipelined (argv[0], false, false);
+  if (nbd_get_structured_replies_negotiated (nbd) != 0 ||
+      nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) != 0) {
+    fprintf (stderr, "%s: test failed: "
+             "structured replies were negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* In probe mode NBD_OPT_INFO is pipelined instead. */
+  nbd = connect_pipelined (argv[0], true, true);
+  if (nbd_aio_is_closed (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: handle is not closed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
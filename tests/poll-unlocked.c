@@ -0,0 +1,165 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that a thread waiting in nbd_poll does not stop other threads
+ * from running commands on the same handle, and that it is woken up
+ * when they do.  Then run synchronous commands from several threads
+ * at once.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+/* How long the poll thread would block if it was not woken up. */
+#define POLL_TIMEOUT 5000 /* milliseconds */
+
+#define NR_THREADS 4
+#define NR_COMMANDS 200
+#define BUF_SIZE 4096
+
+static struct nbd_handle *nbd;
+
+static void *
+poll_thread (void *arg)
+{
+  int *r = arg;
+
+  *r = nbd_poll (nbd, POLL_TIMEOUT);
+  if (*r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static void *
+rw_thread (void *arg)
+{
+  uintptr_t n = (uintptr_t) arg;
+  char wbuf[BUF_SIZE], rbuf[BUF_SIZE];
+  uint64_t offset = n * BUF_SIZE;
+  size_t i;
+
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (wbuf, 'a' + (n + i) % 26, sizeof wbuf);
+    if (nbd_pwrite (nbd, wbuf, sizeof wbuf, offset, 0) == -1 ||
+        nbd_pread (nbd, rbuf, sizeof rbuf, offset, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf, wbuf, sizeof rbuf) != 0) {
+      fprintf (stderr, "thread %u: data read back was different\n",
+               (unsigned) n);
+      exit (EXIT_FAILURE);
+    }
+  }
+  return NULL;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t thread, threads[NR_THREADS];
+  char buf[512];
+  double start, elapsed;
+  int err, r = -1;
+  uintptr_t i;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Nothing is in flight, so this thread waits in poll until
+   * something else happens on the handle.
+   */
+  err = pthread_create (&thread, NULL, poll_thread, &r);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  usleep (200 * 1000);
+
+  start = now ();
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pthread_join (thread, NULL);
+  elapsed = now () - start;
+  if (elapsed > POLL_TIMEOUT / 1000.0 / 2) {
+    fprintf (stderr, "%s: command and poll took %g seconds\n",
+             argv[0], elapsed);
+    exit (EXIT_FAILURE);
+  }
+  if (r != 1) {
+    fprintf (stderr, "%s: expected the poll thread to be woken up\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_THREADS; ++i) {
+    err = pthread_create (&threads[i], NULL, rw_thread, (void *) i);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_THREADS; ++i)
+    pthread_join (threads[i], NULL);
+
+  if (nbd_aio_in_flight (nbd) != 0) {
+    fprintf (stderr, "%s: unexpected commands in flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
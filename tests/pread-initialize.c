@@ -0,0 +1,106 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test reading without pre-initializing the read buffer. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+
+#define BUFSIZE (128 * 1024)
+
+static char buf[BUFSIZE];
+
+static void
+check_pattern (const char *progname, uint64_t offset)
+{
+  size_t i;
+  uint64_t v;
+
+  for (i = 0; i < BUFSIZE; i += 8) {
+    memcpy (&v, &buf[i], sizeof v);
+    if (be64toh (v) != offset + i) {
+      fprintf (stderr, "%s: unexpected data at offset %" PRIu64 "\n",
+               progname, offset + i);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "pattern", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_pread_initialize (nbd) != 1) {
+    fprintf (stderr, "%s: pread_initialize should default to true\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Read with and without zeroing the buffer first.  In both cases
+   * every byte must be overwritten by the server's data.
+   */
+  memset (buf, 0xaa, sizeof buf);
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (argv[0], 0);
+
+  if (nbd_set_pread_initialize (nbd, false) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_pread_initialize (nbd) != 0) {
+    fprintf (stderr, "%s: pread_initialize should now be false\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 0xaa, sizeof buf);
+  if (nbd_pread (nbd, buf, sizeof buf, BUFSIZE, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (argv[0], BUFSIZE);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,158 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_aio_pread_lend and nbd_aio_release_buffer. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_READS 16
+#define BLOCK 4096
+
+static char buf[BLOCK];
+static int lent, done;
+static const void *kept;
+
+/* Check the data, and keep the buffer of the first block. */
+static int
+lend (void *user_data, const void *data, size_t count, uint64_t offset,
+      int *error)
+{
+  char expected[BLOCK];
+
+  memset (expected, offset / BLOCK + 1, sizeof expected);
+  if (count != BLOCK || memcmp (data, expected, count) != 0) {
+    fprintf (stderr, "unexpected data lent at offset %" PRIu64 "\n", offset);
+    exit (EXIT_FAILURE);
+  }
+  lent++;
+  if (offset == 0) {
+    kept = data;
+    return 1;
+  }
+  return 0;
+}
+
+static int
+read_done (void *user_data, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "read failed: %s\n", strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  done++;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+  int64_t cookies[NR_READS];
+  char expected[BLOCK];
+  int i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_READS; ++i) {
+    memset (buf, i + 1, sizeof buf);
+    if (nbd_pwrite (nbd, buf, sizeof buf, i * BLOCK, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < NR_READS; ++i) {
+    cookies[i] = nbd_aio_pread_lend (nbd, BLOCK, i * BLOCK,
+                                     (nbd_lend_callback) { .callback = lend },
+                                     (nbd_completion_callback) {
+                                       .callback = read_done },
+                                     0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (done < NR_READS) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (lent != NR_READS) {
+    fprintf (stderr, "%s: expected %d buffers to be lent, but got %d\n",
+             argv[0], NR_READS, lent);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The kept buffer is not reused by later reads. */
+  memset (expected, 1, sizeof expected);
+  if (memcmp (kept, expected, sizeof expected) != 0) {
+    fprintf (stderr, "%s: the kept buffer was overwritten\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Only the kept buffer can be given back, and only once. */
+  if (nbd_aio_release_buffer (nbd, cookies[1]) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: releasing a buffer which was not kept "
+             "should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_release_buffer (nbd, cookies[0]) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_release_buffer (nbd, cookies[0]) != -1) {
+    fprintf (stderr, "%s: releasing a buffer twice should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Reads larger than the maximum request size are not split. */
+  if (nbd_aio_pread_lend (nbd, 64 * 1024 * 1024, 0,
+                          (nbd_lend_callback) { .callback = lend },
+                          NBD_NULL_COMPLETION, 0) != -1 ||
+      nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "%s: a read larger than the maximum request size "
+             "should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
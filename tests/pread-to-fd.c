@@ -0,0 +1,245 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_pread_to_fd and nbd_pwrite_from_fd, including the paths
+ * which copy through a buffer when the file cannot be spliced.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#define SIZE (4 * 1024 * 1024)
+#define PIECE (256 * 1024)
+
+static char src[SIZE], zero[SIZE], buf[SIZE];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+static int
+temp_file (void)
+{
+  char tmp[] = "/tmp/pread-to-fd.XXXXXX";
+  int fd;
+
+  fd = mkstemp (tmp);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  unlink (tmp);
+  return fd;
+}
+
+static void
+check_file (const char *progname, int fd, uint64_t fd_offset,
+            const char *expected, size_t count)
+{
+  if (pread (fd, buf, count, fd_offset) != (ssize_t) count) {
+    fprintf (stderr, "%s: short read from file\n", progname);
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (buf, expected, count) != 0) {
+    fprintf (stderr, "%s: unexpected data in file at offset %" PRIu64 "\n",
+             progname, fd_offset);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+check_export (const char *progname, struct nbd_handle *nbd,
+              uint64_t offset, const char *expected, size_t count)
+{
+  if (nbd_pread (nbd, buf, count, offset, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (buf, expected, count) != 0) {
+    fprintf (stderr, "%s: unexpected data in export at offset %" PRIu64 "\n",
+             progname, offset);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=12M", NULL };
+  int in, out, fd;
+  size_t i;
+
+  for (i = 0; i < SIZE; ++i)
+    src[i] = (i * 7) ^ (i >> 12);
+  in = temp_file ();
+  if (pwrite (in, src, SIZE, 0) != SIZE) {
+    perror ("pwrite");
+    exit (EXIT_FAILURE);
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Upload the file, then read it back into a second file at a
+   * different offset.
+   */
+  if (nbd_pwrite_from_fd (nbd, in, 0, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_export (argv[0], nbd, 0, src, SIZE);
+
+  out = temp_file ();
+  if (nbd_pread_to_fd (nbd, out, 512, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_file (argv[0], out, 512, src, SIZE);
+
+  /* Issue several commands at once, mixing pieces of the file with
+   * ordinary reads and writes which share the same connection.
+   */
+  for (i = 0; i < SIZE / PIECE; ++i) {
+    if (nbd_aio_pwrite_from_fd (nbd, in, i * PIECE, PIECE,
+                                SIZE + (SIZE / PIECE - 1 - i) * PIECE,
+                                (nbd_completion_callback) {
+                                  .callback = completion },
+                                0) == -1 ||
+        nbd_aio_pwrite (nbd, &src[i * PIECE], 512, i * PIECE,
+                        (nbd_completion_callback) { .callback = completion },
+                        0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < SIZE / PIECE; ++i) {
+    if (nbd_aio_pread_to_fd (nbd, out, i * PIECE, PIECE,
+                             SIZE + (SIZE / PIECE - 1 - i) * PIECE,
+                             (nbd_completion_callback) {
+                               .callback = completion },
+                             0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (completions != 3 * SIZE / PIECE) {
+    fprintf (stderr, "%s: expected %d completions, got %u\n",
+             argv[0], 3 * SIZE / PIECE, completions);
+    exit (EXIT_FAILURE);
+  }
+  check_file (argv[0], out, 0, src, SIZE);
+
+  /* The end of the export has not been written, so the server may
+   * reply with a hole, which must overwrite the file with zeroes.
+   */
+  if (nbd_pread_to_fd (nbd, out, 0, SIZE, 2 * SIZE, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_file (argv[0], out, 0, zero, SIZE);
+
+  /* Files opened with O_APPEND cannot be spliced to, so the data is
+   * copied instead.
+   */
+  fd = temp_file ();
+  if (fcntl (fd, F_SETFL, O_APPEND) == -1) {
+    perror ("fcntl");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread_to_fd (nbd, fd, 0, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_file (argv[0], fd, 0, src, SIZE);
+  close (fd);
+
+  /* Writing to the file fails, but the connection is still usable. */
+  fd = open ("/dev/null", O_RDONLY);
+  if (fd == -1) {
+    perror ("/dev/null");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread_to_fd (nbd, fd, 0, SIZE, 0, 0) != -1 ||
+      nbd_get_errno () != EBADF) {
+    fprintf (stderr, "%s: reading into a read-only fd should fail "
+             "with EBADF\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  check_export (argv[0], nbd, 0, src, SIZE);
+
+  /* Writing more than the file holds is refused before anything is
+   * sent.
+   */
+  if (nbd_pwrite_from_fd (nbd, in, 512, SIZE, 0, 0) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: writing past the end of the file should fail "
+             "with EINVAL\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  close (in);
+  close (out);
+  exit (EXIT_SUCCESS);
+}
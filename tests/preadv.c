@@ -0,0 +1,205 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_preadv, nbd_pwritev and their asynchronous forms, with
+ * and without the receive staging buffer, and with requests which
+ * are split into pieces.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include <libnbd.h>
+
+#define SIZE (1024 * 1024)
+#define NR_IOV 300
+
+static char src[SIZE], dst[SIZE];
+static struct iovec iov[NR_IOV];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+/* Describe the first len bytes of buf with buffers of uneven sizes,
+ * some of them empty.  Returns the number of buffers.
+ */
+static int
+make_iov (char *buf, size_t len, unsigned seed)
+{
+  size_t n, i = 0;
+  int cnt = 0;
+
+  while (i < len) {
+    n = cnt == NR_IOV - 1 ? len - i : (seed * (cnt + 1) * 733) % 9000;
+    if (n > len - i)
+      n = len - i;
+    iov[cnt].iov_base = &buf[i];
+    iov[cnt].iov_len = n;
+    i += n;
+    cnt++;
+  }
+  return cnt;
+}
+
+static void
+check (const char *progname, const char *what, size_t len)
+{
+  if (memcmp (src, dst, len) != 0) {
+    fprintf (stderr, "%s: %s: data read back is different\n",
+             progname, what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+test_connection (const char *progname, int recv_buffer_size, bool split)
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=4M", NULL };
+  int cnt;
+  size_t i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_recv_buffer_size (nbd, recv_buffer_size) == -1 ||
+      (split && (nbd_set_split_requests (nbd, true) == -1 ||
+                 nbd_set_max_request_size (nbd, 64 * 1024) == -1))) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  iov[0].iov_base = src;
+  iov[0].iov_len = 512;
+  if (nbd_preadv (nbd, iov, 1, 0, 0) != -1 ||
+      nbd_get_errno () != ENOTCONN) {
+    fprintf (stderr, "%s: nbd_preadv before connecting should fail "
+             "with ENOTCONN\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Synchronous, with the buffers split differently for the write
+   * and the read.
+   */
+  cnt = make_iov (src, SIZE, 3);
+  if (nbd_pwritev (nbd, iov, cnt, 512, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  memset (dst, 0, SIZE);
+  cnt = make_iov (dst, SIZE, 5);
+  if (nbd_preadv (nbd, iov, cnt, 512, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check (progname, "nbd_preadv", SIZE);
+
+  /* Small reads and writes in flight together.  The iovec array is
+   * reused for each command as soon as it has been issued.
+   */
+  completions = 0;
+  for (i = 0; i < 64; ++i) {
+    cnt = make_iov (&src[i * 4096], 4096, i + 1);
+    if (nbd_aio_pwritev (nbd, iov, cnt, 2 * SIZE + i * 4096,
+                         (nbd_completion_callback) { .callback = completion },
+                         0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  memset (dst, 0, SIZE);
+  for (i = 0; i < 64; ++i) {
+    cnt = make_iov (&dst[i * 4096], 4096, i + 7);
+    if (nbd_aio_preadv (nbd, iov, cnt, 2 * SIZE + i * 4096,
+                        (nbd_completion_callback) { .callback = completion },
+                        0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (completions != 128) {
+    fprintf (stderr, "%s: expected 128 completions, got %u\n",
+             progname, completions);
+    exit (EXIT_FAILURE);
+  }
+  check (progname, "nbd_aio_preadv", 64 * 4096);
+
+  /* A negative number of buffers is refused. */
+  if (nbd_preadv (nbd, iov, -1, 0, 0) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: nbd_preadv with iovcnt -1 should fail "
+             "with EINVAL\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; ++i)
+    src[i] = (i * 13) ^ (i >> 10);
+
+  test_connection (argv[0], 64 * 1024, false);
+  test_connection (argv[0], 0, false);
+  test_connection (argv[0], 64 * 1024, true);
+  exit (EXIT_SUCCESS);
+}
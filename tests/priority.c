@@ -0,0 +1,174 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that commands issued with LIBNBD_CMD_FLAG_PRIORITY are sent
+ * ahead of the other queued commands, within the limit set by
+ * nbd_set_priority_weight.  The server handles one request at a time,
+ * so the replies arrive in the order the requests were sent.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define MAX_COMMANDS 16
+
+static char buf[4096];
+static int order[MAX_COMMANDS];
+static int completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  order[completions++] = (intptr_t) user_data;
+  return 1;
+}
+
+/* Issue the commands described by flags in one batch, each with its
+ * index as the user data, and check that they complete in the
+ * expected order.
+ */
+static void
+check_order (const char *progname, struct nbd_handle *nbd,
+             const char *flags, const int *expected)
+{
+  int i, n = strlen (flags);
+
+  completions = 0;
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; ++i) {
+    if (nbd_aio_pread (nbd, buf, 512, i * 512,
+                       (nbd_completion_callback) {
+                         .callback = completion,
+                         .user_data = (void *) (intptr_t) i },
+                       flags[i] == 'P' ? LIBNBD_CMD_FLAG_PRIORITY : 0)
+        == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (completions != n ||
+      memcmp (order, expected, n * sizeof order[0]) != 0) {
+    fprintf (stderr, "%s: commands %s completed in the order", progname,
+             flags);
+    for (i = 0; i < completions; ++i)
+      fprintf (stderr, " %d", order[i]);
+    fprintf (stderr, "\n");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-t", "1",
+                   "memory", "size=1M", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_priority_weight (nbd) != 16) {
+    fprintf (stderr, "%s: unexpected default priority weight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Priority commands go ahead of the others, in their own order. */
+  check_order (argv[0], nbd, "NNNNPNP",
+               (const int []) { 4, 6, 0, 1, 2, 3, 5 });
+
+  /* With a weight of 2, the third priority command cannot overtake
+   * the ordinary commands which are already queued.
+   */
+  if (nbd_set_priority_weight (nbd, 2) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_order (argv[0], nbd, "NNNPPPNP",
+               (const int []) { 3, 4, 0, 1, 2, 5, 7, 6 });
+
+  /* With a weight of 0, the flag has no effect. */
+  if (nbd_set_priority_weight (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_order (argv[0], nbd, "NNPN",
+               (const int []) { 0, 1, 2, 3 });
+
+  /* Synchronous commands accept the flag too. */
+  if (nbd_pread (nbd, buf, sizeof buf, 0, LIBNBD_CMD_FLAG_PRIORITY) == -1 ||
+      nbd_flush (nbd, LIBNBD_CMD_FLAG_PRIORITY) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_stats_snapshot (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_priority_commands (nbd) != 9) {
+    fprintf (stderr, "%s: expected 9 priority commands, got %" PRIi64 "\n",
+             argv[0], nbd_get_stats_priority_commands (nbd));
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_priority_latency_percentile (nbd, 99) <= 0) {
+    fprintf (stderr, "%s: no latency reported for priority commands\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
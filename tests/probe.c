@@ -0,0 +1,125 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test probe only and list exports modes. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define SIZE 1048576
+#define XSTR(s) #s
+#define STR(s) XSTR(s)
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                   "memory", "size=" STR(SIZE), NULL };
+  int64_t r;
+  int i, n;
+  char *name, *description;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_probe_only (nbd) != 0 || nbd_get_list_exports (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: unexpected default flags\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_probe_only (nbd, true) == -1 ||
+      nbd_set_list_exports (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The handshake should have been aborted after NBD_OPT_INFO. */
+  if (nbd_aio_is_closed (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: handle is not closed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* But the export information is still available. */
+  if ((r = nbd_get_size (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (r != SIZE) {
+    fprintf (stderr, "%s: test failed: incorrect size, "
+             "actual %" PRIi64 ", expected %d\n",
+             argv[0], r, SIZE);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_is_read_only (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: export is read-only\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_block_size (nbd, LIBNBD_SIZE_MAXIMUM) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* nbdkit lists the default export. */
+  n = nbd_get_nr_list_exports (nbd);
+  if (n == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (n < 1) {
+    fprintf (stderr, "%s: test failed: no exports listed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < n; ++i) {
+    name = nbd_get_list_export_name (nbd, i);
+    description = nbd_get_list_export_description (nbd, i);
+    if (name == NULL || description == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    printf ("export %d: \"%s\" (%s)\n", i, name, description);
+    free (name);
+    free (description);
+  }
+  if (nbd_get_list_export_name (nbd, n) != NULL) {
+    fprintf (stderr, "%s: test failed: "
+             "nbd_get_list_export_name did not fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* No commands can be issued. */
+  if (nbd_pread (nbd, (char [512]) { 0 }, 512, 0, 0) != -1) {
+    fprintf (stderr, "%s: test failed: nbd_pread did not fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,274 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that nbd_set_rate_limit holds back commands beyond the limit,
+ * and that nbd_poll sends them when the limit allows.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define NR_READS 10
+/* Bytes sent on the wire for each read request. */
+#define REQUEST_SIZE 28
+
+static char buf[NR_READS][512];
+static char wbuf[64 * 1024];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * INT64_C (1000) + ts.tv_nsec / 1000000;
+}
+
+static int64_t
+bytes_sent (struct nbd_handle *nbd)
+{
+  int64_t r;
+
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (r = nbd_get_stats_bytes_sent (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+static void
+set_rate_limit (struct nbd_handle *nbd, int limit, uint64_t rate)
+{
+  if (nbd_set_rate_limit (nbd, limit, rate) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Issue NR_READS reads without waiting for any of them, and return
+ * the number of requests which were sent straight away.
+ */
+static int64_t
+issue_reads (struct nbd_handle *nbd)
+{
+  int64_t sent;
+  size_t i;
+
+  sent = bytes_sent (nbd);
+  completions = 0;
+  for (i = 0; i < NR_READS; ++i) {
+    if (nbd_aio_pread (nbd, buf[i], sizeof buf[i], i * sizeof buf[i],
+                       (nbd_completion_callback) { .callback = completion },
+                       0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  return (bytes_sent (nbd) - sent) / REQUEST_SIZE;
+}
+
+static void
+wait_all (const char *progname, struct nbd_handle *nbd)
+{
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (completions != NR_READS) {
+    fprintf (stderr, "%s: expected %d completions, got %u\n",
+             progname, NR_READS, completions);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* The same as wait_all, but only poll without blocking, as a caller
+ * with its own main loop might.
+ */
+static void
+wait_all_nonblocking (const char *progname, struct nbd_handle *nbd)
+{
+  const struct timespec ts = { .tv_nsec = 10000000 };
+  int64_t start = now_ms ();
+
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (now_ms () - start > 5000) {
+      fprintf (stderr, "%s: held back reads were not sent by nbd_poll "
+               "with a timeout of 0\n", progname);
+      exit (EXIT_FAILURE);
+    }
+    nanosleep (&ts, NULL);
+  }
+  if (completions != NR_READS) {
+    fprintf (stderr, "%s: expected %d completions, got %u\n",
+             progname, NR_READS, completions);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=1M", NULL };
+  int64_t sent, start, elapsed;
+  int i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = LIBNBD_RATE_READ_BYTES; i <= LIBNBD_RATE_WRITE_OPS; ++i) {
+    if (nbd_get_rate_limit (nbd, i) != 0) {
+      fprintf (stderr, "%s: the rate should not be limited by default\n",
+               argv[0]);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_get_timer (nbd) != -1) {
+    fprintf (stderr, "%s: no timer should be needed by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* At 20 reads per second, three reads are sent at once (the bucket
+   * holds two and may go into debt for one more) and the rest are
+   * sent over the next 350ms.
+   */
+  set_rate_limit (nbd, LIBNBD_RATE_READ_OPS, 20);
+  if (nbd_get_rate_limit (nbd, LIBNBD_RATE_READ_OPS) != 20) {
+    fprintf (stderr, "%s: unexpected rate limit\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  start = now_ms ();
+  sent = issue_reads (nbd);
+  if (sent != 3) {
+    fprintf (stderr, "%s: expected 3 requests to be sent, got %" PRIi64 "\n",
+             argv[0], sent);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_get_timer (nbd) <= 0 || nbd_aio_get_timer (nbd) > 60) {
+    fprintf (stderr, "%s: unexpected timer %d\n", argv[0],
+             nbd_aio_get_timer (nbd));
+    exit (EXIT_FAILURE);
+  }
+  wait_all (argv[0], nbd);
+  elapsed = now_ms () - start;
+  if (elapsed < 300) {
+    fprintf (stderr, "%s: reads took %" PRIi64 "ms, expected at least "
+             "300ms\n", argv[0], elapsed);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_get_timer (nbd) != -1) {
+    fprintf (stderr, "%s: no timer should be needed when idle\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* nbd_poll with a timeout of 0 also sends the held reads once the
+   * timer has expired.
+   */
+  if (issue_reads (nbd) >= NR_READS) {
+    fprintf (stderr, "%s: some reads should be held back\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  wait_all_nonblocking (argv[0], nbd);
+
+  /* A limit on writes does not hold back reads. */
+  set_rate_limit (nbd, LIBNBD_RATE_READ_OPS, 0);
+  set_rate_limit (nbd, LIBNBD_RATE_WRITE_OPS, 1);
+  if (issue_reads (nbd) != NR_READS) {
+    fprintf (stderr, "%s: all the reads should be sent\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  wait_all (argv[0], nbd);
+  set_rate_limit (nbd, LIBNBD_RATE_WRITE_OPS, 0);
+
+  /* Removing the limit sends the reads which were held back. */
+  set_rate_limit (nbd, LIBNBD_RATE_READ_OPS, 1);
+  sent = bytes_sent (nbd);
+  if (issue_reads (nbd) != 2) {
+    fprintf (stderr, "%s: expected 2 requests to be sent\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  set_rate_limit (nbd, LIBNBD_RATE_READ_OPS, 0);
+  if (bytes_sent (nbd) - sent != NR_READS * REQUEST_SIZE) {
+    fprintf (stderr, "%s: the held reads were not sent\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  wait_all (argv[0], nbd);
+
+  /* At 1M per second, writing 320K with synchronous commands takes
+   * at least 150ms, since the bucket only holds 100K.
+   */
+  set_rate_limit (nbd, LIBNBD_RATE_WRITE_BYTES, 1000000);
+  start = now_ms ();
+  for (i = 0; i < 5; ++i) {
+    if (nbd_pwrite (nbd, wbuf, sizeof wbuf, i * sizeof wbuf, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  elapsed = now_ms () - start;
+  if (elapsed < 150) {
+    fprintf (stderr, "%s: writes took %" PRIi64 "ms, expected at least "
+             "150ms\n", argv[0], elapsed);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,182 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test driving several handles from one thread with a reactor. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_HANDLES 8
+#define NR_COMMANDS 16
+
+static struct nbd_handle *nbd[NR_HANDLES];
+static char buf[NR_HANDLES][NR_COMMANDS][512];
+static unsigned completed;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completed++;
+  return 1;
+}
+
+/* Issue NR_COMMANDS on every handle, then run the reactor until they
+ * have all completed.
+ */
+static void
+run_commands (struct nbd_reactor *r, int write)
+{
+  size_t i, j;
+  int64_t cookie;
+
+  completed = 0;
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_COMMANDS; ++j) {
+      nbd_completion_callback cb = { .callback = completion };
+
+      if (write)
+        cookie = nbd_aio_pwrite (nbd[i], buf[i][j], 512, j * 512, cb, 0);
+      else
+        cookie = nbd_aio_pread (nbd[i], buf[i][j], 512, j * 512, cb, 0);
+      if (cookie == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  while (completed < NR_HANDLES * NR_COMMANDS) {
+    if (nbd_reactor_poll (r, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_reactor *r;
+  size_t i, j;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  r = nbd_reactor_create ();
+  if (r == NULL) {
+    if (nbd_get_errno () == ENOTSUP) {
+      fprintf (stderr, "%s: test skipped: %s\n", argv[0], nbd_get_error ());
+      exit (77);
+    }
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Nothing to wait for in an empty reactor. */
+  if (nbd_reactor_poll (r, 0) != -1) {
+    fprintf (stderr, "%s: expected poll of empty reactor to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Connect the handles with the reactor, so that the handshakes proceed
+   * in parallel.
+   */
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd[i] = nbd_create ();
+    if (nbd[i] == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_reactor_add (r, nbd[i]) == -1 ||
+        nbd_aio_connect_command (nbd[i], (char **) cmd) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_reactor_add (r, nbd[0]) != -1) {
+    fprintf (stderr, "%s: expected adding a handle twice to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_HANDLES; ++i) {
+    while (nbd_aio_is_connecting (nbd[i])) {
+      if (nbd_reactor_poll (r, -1) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+    if (!nbd_aio_is_ready (nbd[i])) {
+      fprintf (stderr, "%s: handle %zu failed to connect\n", argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Each handle is connected to its own server, so fill each with a
+   * different pattern and check it reads back.
+   */
+  for (i = 0; i < NR_HANDLES; ++i)
+    for (j = 0; j < NR_COMMANDS; ++j)
+      memset (buf[i][j], i * NR_COMMANDS + j, 512);
+  run_commands (r, 1);
+  memset (buf, 0, sizeof buf);
+  run_commands (r, 0);
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_COMMANDS; ++j) {
+      char expected[512];
+
+      memset (expected, i * NR_COMMANDS + j, 512);
+      if (memcmp (buf[i][j], expected, 512) != 0) {
+        fprintf (stderr, "%s: data mismatch on handle %zu at offset %zu\n",
+                 argv[0], i, j * 512);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    if (nbd_reactor_remove (r, nbd[i]) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_shutdown (nbd[i], 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    nbd_close (nbd[i]);
+  }
+  if (nbd_reactor_remove (r, nbd[0]) != -1) {
+    fprintf (stderr, "%s: expected removing a closed handle to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_reactor_close (r);
+  exit (EXIT_SUCCESS);
+}
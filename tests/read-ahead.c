@@ -0,0 +1,234 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_read_ahead, both with cache requests and with data
+ * read into the library's own buffers.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define SIZE (1024 * 1024)
+#define BLOCK 4096
+#define WINDOW (128 * 1024)
+
+static char data[SIZE];
+static char buf[BLOCK];
+
+static void
+check_data (const char *progname, uint64_t offset)
+{
+  if (memcmp (buf, data + offset, BLOCK) != 0) {
+    fprintf (stderr, "%s: wrong data read at offset %" PRIu64 "\n",
+             progname, offset);
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+pread_block (const char *progname, struct nbd_handle *nbd, uint64_t offset)
+{
+  if (nbd_pread (nbd, buf, BLOCK, offset, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_data (progname, offset);
+}
+
+static void
+wait_all (struct nbd_handle *nbd)
+{
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+test (const char *progname, bool nocache)
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=1M", NULL, NULL, NULL };
+  int64_t cookie, reads;
+  uint64_t offset;
+  bool cache;
+  int i;
+
+  if (nocache) {
+    args[3] = "--filter=nocache";
+    args[4] = "memory";
+    args[5] = "size=1M";
+    args[6] = "cachemode=none";
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_read_ahead (nbd) != 0) {
+    fprintf (stderr, "%s: nothing should be read ahead by default\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_read_ahead (nbd, 128 * 1024 * 1024) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: a window over 64M should be rejected\n", progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, args) == -1 ||
+      nbd_pwrite (nbd, data, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  cache = nbd_can_cache (nbd) == 1;
+  if (nocache && cache) {
+    fprintf (stderr, "%s: unexpected nbd_can_cache\n", progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_read_ahead (nbd, WINDOW) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_read_ahead (nbd) != WINDOW) {
+    fprintf (stderr, "%s: unexpected window\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  /* One read does not start a stream, so only it is sent. */
+  pread_block (progname, nbd, 8 * BLOCK);
+  wait_all (nbd);
+
+  /* The read following on from it asks for the data ahead. */
+  cookie = nbd_aio_pread (nbd, buf, BLOCK, 9 * BLOCK,
+                          NBD_NULL_COMPLETION, 0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_in_flight (nbd) < 2) {
+    fprintf (stderr, "%s: nothing was read ahead of the stream\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_command_completed (nbd, cookie) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  check_data (progname, 9 * BLOCK);
+  wait_all (nbd);
+
+  /* Without cache requests, the reads after that are answered from
+   * the data read ahead.
+   */
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (reads = nbd_get_stats_commands (nbd, LIBNBD_CMD_READ)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (offset = 10 * BLOCK; offset < 64 * BLOCK; offset += BLOCK)
+    pread_block (progname, nbd, offset);
+
+  /* A write ahead of the stream is seen by the reads after it. */
+  memset (data + 66 * BLOCK, 0xff, BLOCK);
+  if (nbd_pwrite (nbd, data + 66 * BLOCK, BLOCK, 66 * BLOCK, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (; offset < 96 * BLOCK; offset += BLOCK)
+    pread_block (progname, nbd, offset);
+  wait_all (nbd);
+
+  if (!cache) {
+    int64_t sent;
+
+    if (nbd_stats_snapshot (nbd) == -1 ||
+        (sent = nbd_get_stats_commands (nbd, LIBNBD_CMD_READ)) == -1 ||
+        nbd_get_stats_commands (nbd, LIBNBD_CMD_CACHE) != 0) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    /* Every completed read is counted, both the 86 made here and
+     * the requests for data ahead, which were each large enough to
+     * answer several of them.
+     */
+    sent -= reads + 86;
+    if (sent <= 0 || sent >= 86) {
+      fprintf (stderr, "%s: unexpected %" PRIi64 " requests for data ahead\n",
+               progname, sent);
+      exit (EXIT_FAILURE);
+    }
+  }
+  else if (nbd_stats_snapshot (nbd) == -1 ||
+           nbd_get_stats_commands (nbd, LIBNBD_CMD_CACHE) <= 0) {
+    fprintf (stderr, "%s: no cache requests were sent\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Random reads end the stream and still see the right data. */
+  for (i = 0; i < 16; ++i)
+    pread_block (progname, nbd, ((i * 37) % 256) * BLOCK);
+
+  /* Turning read ahead off sends no more requests for it. */
+  if (nbd_set_read_ahead (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (offset = 0; offset < 4 * BLOCK; offset += BLOCK) {
+    pread_block (progname, nbd, offset);
+    if (nbd_aio_in_flight (nbd) != 0) {
+      fprintf (stderr, "%s: data is read ahead after turning it off\n",
+               progname);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; ++i)
+    data[i] = i * 7 + i / 256;
+
+  test (argv[0], false);
+  test (argv[0], true);
+  exit (EXIT_SUCCESS);
+}
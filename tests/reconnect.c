@@ -0,0 +1,203 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that commands in flight when the server goes away are
+ * replayed on a new connection, see nbd_set_reconnect.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <libnbd.h>
+
+#define SOCKET "reconnect.sock"
+#define PIDFILE "reconnect.pid"
+
+static const char *progname;
+static int trim_error = -1;
+
+/* Start nbdkit listening on SOCKET, and wait until it is ready.  A
+ * slow server delays every command by 10 seconds.
+ */
+static pid_t
+start_server (bool slow)
+{
+  const char *delay = slow ? "10" : "0";
+  char delay_read[32], delay_write[32], delay_trim[32];
+  pid_t pid;
+  size_t i;
+
+  snprintf (delay_read, sizeof delay_read, "delay-read=%s", delay);
+  snprintf (delay_write, sizeof delay_write, "delay-write=%s", delay);
+  snprintf (delay_trim, sizeof delay_trim, "delay-trim=%s", delay);
+
+  unlink (SOCKET);
+  unlink (PIDFILE);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-U", SOCKET, "-P", PIDFILE,
+            "--exit-with-parent", "--filter=delay", "memory", "size=1m",
+            delay_read, delay_write, delay_trim, NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+  return pid;
+}
+
+static int
+trim_callback (void *user_data, int *error)
+{
+  trim_error = *error;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  pid_t pid;
+  char rbuf[512], wbuf[512];
+  int64_t rcookie, wcookie;
+  int r;
+
+  progname = argv[0];
+
+  /* The first server is slow, so the commands are still in flight
+   * when it is killed.
+   */
+  pid = start_server (true);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_reconnect (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: reconnect is on by default\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_reconnect (nbd, 3) == -1 ||
+      nbd_connect_unix (nbd, SOCKET) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* A read and a replayable write are sent again, but a trim is not. */
+  memset (wbuf, 1, sizeof wbuf);
+  if ((rcookie = nbd_aio_pread (nbd, rbuf, sizeof rbuf, 0,
+                                NBD_NULL_COMPLETION, 0)) == -1 ||
+      (wcookie = nbd_aio_pwrite (nbd, wbuf, sizeof wbuf, 512,
+                                 NBD_NULL_COMPLETION,
+                                 LIBNBD_CMD_FLAG_REPLAY)) == -1 ||
+      nbd_aio_trim (nbd, 512, 1024,
+                    (nbd_completion_callback) { .callback = trim_callback },
+                    0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0 &&
+         (nbd_aio_get_direction (nbd) & LIBNBD_AIO_DIRECTION_WRITE) != 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Replace the server. */
+  if (kill (pid, SIGTERM) == -1) {
+    perror ("kill");
+    exit (EXIT_FAILURE);
+  }
+  waitpid (pid, NULL, 0);
+  pid = start_server (false);
+
+  /* The handle notices that the connection died, reconnects, and
+   * completes the read and write under their original cookies.
+   */
+  while ((r = nbd_aio_command_completed (nbd, rcookie)) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s: test failed: replayed read: %s\n",
+             progname, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while ((r = nbd_aio_command_completed (nbd, wcookie)) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s: test failed: replayed write: %s\n",
+             progname, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (trim_error != ENOTCONN) {
+    fprintf (stderr, "%s: test failed: trim did not fail with ENOTCONN\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The new connection can be used as normal. */
+  if (nbd_pread (nbd, rbuf, sizeof rbuf, 512, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, sizeof rbuf) != 0) {
+    fprintf (stderr, "%s: test failed: replayed write was lost\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+  unlink (SOCKET);
+  exit (EXIT_SUCCESS);
+}
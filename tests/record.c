@@ -0,0 +1,196 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test recording the commands submitted on a handle. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "nbd-record.h"
+
+#define NR_RECORDS 5
+
+static char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1M", NULL };
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char filename[] = "/tmp/libnbd-recordXXXXXX";
+  char buf[512], magic[8];
+  struct nbd_record recs[NR_RECORDS + 1], *rec;
+  int64_t cookie1, cookie2;
+  size_t i, n;
+  FILE *fp;
+  int fd;
+
+  fd = mkstemp (filename);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+
+  /* Commands before recording starts are not recorded. */
+  memset (buf, 0x55, sizeof buf);
+  if (nbd_pwrite (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+
+  if (nbd_record_start (nbd, filename) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+  if (nbd_record_start (nbd, filename) != -1 || nbd_get_errno () != EBUSY) {
+    fprintf (stderr, "%s: test failed: "
+             "recording was started twice\n", argv[0]);
+    goto fail;
+  }
+
+  /* Three commands one after another, then two in flight together. */
+  if (nbd_pwrite (nbd, buf, sizeof buf, 4096, LIBNBD_CMD_FLAG_FUA) == -1 ||
+      nbd_pread (nbd, buf, sizeof buf, 4096, 0) == -1 ||
+      nbd_flush (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+  cookie1 = nbd_aio_pread (nbd, buf, sizeof buf, 0,
+                           NBD_NULL_COMPLETION, 0);
+  cookie2 = nbd_aio_trim (nbd, 8192, 65536, NBD_NULL_COMPLETION, 0);
+  if (cookie1 == -1 || cookie2 == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      goto fail;
+    }
+  }
+  if (nbd_aio_command_completed (nbd, cookie1) != 1 ||
+      nbd_aio_command_completed (nbd, cookie2) != 1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+
+  if (nbd_record_stop (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+  /* This is not recorded. */
+  if (nbd_flush (nbd, 0) == -1 ||
+      nbd_record_stop (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    goto fail;
+  }
+  nbd_close (nbd);
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    perror (filename);
+    goto fail;
+  }
+  if (fread (magic, sizeof magic, 1, fp) != 1 ||
+      memcmp (magic, NBD_RECORD_MAGIC, sizeof magic) != 0) {
+    fprintf (stderr, "%s: test failed: bad magic\n", argv[0]);
+    goto fail;
+  }
+  n = fread (recs, sizeof recs[0], NR_RECORDS + 1, fp);
+  fclose (fp);
+  if (n != NR_RECORDS) {
+    fprintf (stderr, "%s: test failed: %zu records, expected %d\n",
+             argv[0], n, NR_RECORDS);
+    goto fail;
+  }
+
+  /* Records are in the order the commands completed, which is only
+   * known for the first three.
+   */
+  for (i = 0; i < NR_RECORDS; ++i) {
+    rec = &recs[i];
+    if (i < 3 && be32toh (rec->seq) != i + 1) {
+      fprintf (stderr, "%s: test failed: record %zu has seq %u\n",
+               argv[0], i, be32toh (rec->seq));
+      goto fail;
+    }
+    if (be32toh (rec->error) != 0) {
+      fprintf (stderr, "%s: test failed: record %zu has an error\n",
+               argv[0], i);
+      goto fail;
+    }
+  }
+  if (be16toh (recs[0].type) != LIBNBD_CMD_WRITE ||
+      be64toh (recs[0].offset) != 4096 ||
+      be64toh (recs[0].count) != sizeof buf ||
+      be16toh (recs[0].flags) != LIBNBD_CMD_FLAG_FUA ||
+      be32toh (recs[0].after) != 0 ||
+      be16toh (recs[1].type) != LIBNBD_CMD_READ ||
+      be32toh (recs[1].after) != 1 ||
+      be16toh (recs[2].type) != LIBNBD_CMD_FLUSH ||
+      be32toh (recs[2].after) != 2 ||
+      be64toh (recs[1].time) < be64toh (recs[0].time)) {
+    fprintf (stderr, "%s: test failed: "
+             "unexpected synchronous records\n", argv[0]);
+    goto fail;
+  }
+
+  /* The two commands in flight together both depended on the flush. */
+  for (i = 3; i < NR_RECORDS; ++i) {
+    rec = &recs[i];
+    if (be32toh (rec->after) != 3 ||
+        (be32toh (rec->seq) != 4 && be32toh (rec->seq) != 5) ||
+        be32toh (rec->seq) == be32toh (recs[7 - i].seq) ||
+        (be32toh (rec->seq) == 4 && (be16toh (rec->type) != LIBNBD_CMD_READ ||
+                                     be64toh (rec->offset) != 0)) ||
+        (be32toh (rec->seq) == 5 && (be16toh (rec->type) != LIBNBD_CMD_TRIM ||
+                                     be64toh (rec->count) != 8192 ||
+                                     be64toh (rec->offset) != 65536))) {
+      fprintf (stderr, "%s: test failed: "
+               "unexpected asynchronous records\n", argv[0]);
+      goto fail;
+    }
+  }
+
+  unlink (filename);
+  exit (EXIT_SUCCESS);
+
+ fail:
+  unlink (filename);
+  exit (EXIT_FAILURE);
+}
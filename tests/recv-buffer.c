@@ -0,0 +1,127 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test parsing replies through receive staging buffers of various
+ * sizes, including sizes smaller than a reply header.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+#define NR_COMMANDS 64
+#define BUFSIZE 1024
+
+static char wbuf[NR_COMMANDS][BUFSIZE], rbuf[NR_COMMANDS][BUFSIZE];
+
+static void
+test (const char *progname, int size)
+{
+  struct nbd_handle *nbd;
+  size_t i;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (size >= 0) {
+    if (nbd_set_recv_buffer_size (nbd, size) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_get_recv_buffer_size (nbd) != size) {
+      fprintf (stderr, "%s: unexpected receive buffer size %d\n",
+               progname, nbd_get_recv_buffer_size (nbd));
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_recv_buffer_size (nbd, 4096) != -1) {
+    fprintf (stderr, "%s: expected nbd_set_recv_buffer_size to fail "
+             "after connecting\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Issue many writes and then many reads, so that several replies
+   * are waiting to be parsed at once.
+   */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (wbuf[i], size + i, BUFSIZE);
+    if (nbd_aio_pwrite (nbd, wbuf[i], BUFSIZE, i * BUFSIZE,
+                        NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_pread (nbd, rbuf[i], BUFSIZE, i * BUFSIZE,
+                       NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_peek_command_completed (nbd) > 0) {
+    if (nbd_aio_command_completed (nbd,
+                                   nbd_aio_peek_command_completed (nbd))
+        != 1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (memcmp (wbuf[i], rbuf[i], BUFSIZE) != 0) {
+      fprintf (stderr, "%s: buffer size %d: data mismatch at offset %zu\n",
+               progname, size, i * BUFSIZE);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  test (argv[0], -1);           /* default */
+  test (argv[0], 0);            /* disabled */
+  test (argv[0], 7);
+  test (argv[0], 100);
+  test (argv[0], 1000000);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,165 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test hedging and failing over with nbd_replicas_create. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define BLOCK 4096
+
+static char buf[BLOCK];
+
+static struct nbd_handle *
+connect_server (const char **cmd)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_wait_subprocess (nbd, false) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static struct nbd_replicas *
+create_set (struct nbd_handle *a, struct nbd_handle *b)
+{
+  struct nbd_replicas *rs;
+
+  rs = nbd_replicas_create ();
+  if (rs == NULL ||
+      nbd_replicas_add (rs, a) == -1 ||
+      (b && nbd_replicas_add (rs, b) == -1)) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return rs;
+}
+
+/* nbdkit-pattern-plugin stores the big endian offset of each 8 byte
+ * word in it.
+ */
+static void
+check_pattern (const char *prog, uint64_t offset)
+{
+  unsigned i, j;
+  uint64_t v;
+
+  for (i = 0; i < sizeof buf; i += 8) {
+    v = 0;
+    for (j = 0; j < 8; ++j)
+      v = (v << 8) | (unsigned char) buf[i+j];
+    if (v != offset + i) {
+      fprintf (stderr, "%s: unexpected data at offset %u\n", prog, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *slow, *fast, *failing;
+  struct nbd_replicas *rs;
+  time_t start;
+  const char *cmd_slow[] = { "nbdkit", "-s", "--exit-with-parent",
+                             "--filter=delay", "pattern", "size=1m",
+                             "delay-read=10", NULL };
+  const char *cmd_fast[] = { "nbdkit", "-s", "--exit-with-parent",
+                             "pattern", "size=1m", NULL };
+  const char *cmd_failing[] = { "nbdkit", "-s", "--exit-with-parent",
+                                "--filter=error", "pattern", "size=1m",
+                                "error-pread=EIO", "error-pread-rate=100%",
+                                NULL };
+
+  slow = connect_server (cmd_slow);
+  fast = connect_server (cmd_fast);
+  failing = connect_server (cmd_failing);
+
+  /* The first read goes to the slow replica, since neither has been
+   * measured yet, and is hedged on the fast one.
+   */
+  rs = create_set (slow, fast);
+  if (nbd_replicas_get_hedge_percentile (rs) != 0 ||
+      nbd_replicas_set_hedge_percentile (rs, 101) != -1 ||
+      nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "%s: unexpected hedge percentile handling\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_replicas_add (rs, fast) != -1) {
+    fprintf (stderr, "%s: adding a handle twice should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_replicas_set_hedge_percentile (rs, 95) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  start = time (NULL);
+  if (nbd_replicas_pread (rs, buf, sizeof buf, BLOCK, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (time (NULL) - start >= 5) {
+    fprintf (stderr, "%s: the read waited for the slow replica\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (argv[0], BLOCK);
+  if (nbd_replicas_get_hedged_reads (rs) != 1) {
+    fprintf (stderr, "%s: expected the read to be hedged\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  /* The losing read is still in flight on the slow replica. */
+  nbd_replicas_close (rs);
+
+  /* Reads which fail are retried on another replica. */
+  rs = create_set (failing, fast);
+  memset (buf, 0, sizeof buf);
+  if (nbd_replicas_pread (rs, buf, sizeof buf, 2 * BLOCK, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_pattern (argv[0], 2 * BLOCK);
+  nbd_replicas_close (rs);
+
+  /* Until every replica has been tried. */
+  rs = create_set (failing, NULL);
+  if (nbd_replicas_pread (rs, buf, sizeof buf, 0, 0) != -1 ||
+      nbd_get_errno () != EIO) {
+    fprintf (stderr, "%s: expected the read to fail with EIO\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_replicas_close (rs);
+
+  nbd_close (slow);
+  nbd_close (fast);
+  nbd_close (failing);
+  exit (EXIT_SUCCESS);
+}
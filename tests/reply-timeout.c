@@ -0,0 +1,142 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_reply_timeout and nbd_set_probe_interval. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define TIMEOUT 500 /* milliseconds */
+
+static char buf[512];
+
+static int
+read_done (void *user_data, int *error)
+{
+  int *err = user_data;
+
+  *err = *error;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int err = -1, i;
+  int64_t reads = 0;
+  time_t start;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "--filter=delay", "memory", "size=1m",
+                        "delay-read=10", NULL };
+  const char *cmd_nodelay[] = { "nbdkit", "-s", "--exit-with-parent",
+                                "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_reply_timeout (nbd) != -1 ||
+      nbd_get_probe_interval (nbd) != 0) {
+    fprintf (stderr, "%s: unexpected defaults\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_reply_timeout (nbd, 0) != -1 ||
+      nbd_get_errno () != EINVAL ||
+      nbd_set_probe_interval (nbd, -1) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: setting invalid values should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* A read which the server does not answer fails with ETIMEDOUT
+   * long before the server would have replied.
+   */
+  if (nbd_set_reply_timeout (nbd, TIMEOUT) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  start = time (NULL);
+  if (nbd_aio_pread (nbd, buf, sizeof buf, 0,
+                     (nbd_completion_callback) { .callback = read_done,
+                                                 .user_data = &err },
+                     0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (err == -1) {
+    if (nbd_poll (nbd, -1) == -1)
+      break;
+  }
+  if (err != ETIMEDOUT) {
+    fprintf (stderr, "%s: expected the read to fail with ETIMEDOUT, "
+             "but got %d (%s)\n", argv[0], err, strerror (err));
+    exit (EXIT_FAILURE);
+  }
+  if (time (NULL) - start >= 5) {
+    fprintf (stderr, "%s: the read took too long to time out\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_is_dead (nbd) != 1) {
+    fprintf (stderr, "%s: expected the handle to be dead\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* An idle connection is probed. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_reply_timeout (nbd, 10000) == -1 ||
+      nbd_set_probe_interval (nbd, 100) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd_nodelay) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < 50; ++i) {
+    if (nbd_poll (nbd, 1000) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    reads = nbd_get_stats_commands (nbd, LIBNBD_CMD_READ);
+    if (reads >= 2)
+      break;
+  }
+  if (reads < 2) {
+    fprintf (stderr, "%s: expected the idle server to be probed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,222 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that a read which completes after another thread wrote to the
+ * same range does not leave the old data in the shared cache.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#define EXPORTSIZE (1024 * 1024)
+
+static char script[] = "/tmp/libnbd-shared-cache-race-scriptXXXXXX";
+static char data[] = "/tmp/libnbd-shared-cache-race-dataXXXXXX";
+static char dir[] = "/tmp/libnbd-shared-cache-race-dirXXXXXX";
+static char witness[64], started[64], writable[64];
+static int script_fd = -1, data_fd = -1;
+static bool have_dir;
+
+static char rbuf[65536], wbuf[65536];
+
+static void
+cleanup (void)
+{
+  if (script_fd != -1) {
+    if (script_fd >= 0)
+      close (script_fd);
+    unlink (script);
+  }
+  if (data_fd >= 0) {
+    close (data_fd);
+    unlink (data);
+  }
+  if (have_dir) {
+    unlink (witness);
+    unlink (started);
+    unlink (writable);
+    rmdir (dir);
+  }
+}
+
+/* Both handles run the same command, so they share a cache key, and
+ * the plugin keeps the export in a file so they see the same data.
+ * Reads are held back while the witness file exists, after taking the
+ * data they will return.
+ */
+static struct nbd_handle *
+connect_export (void)
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "sh",
+                        script, NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_shared_cache (nbd, true) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void *
+start_reader (void *arg)
+{
+  struct nbd_handle *nbd = arg;
+
+  if (nbd_pread (nbd, rbuf, sizeof rbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static void
+touch (const char *path)
+{
+  int fd = open (path, O_WRONLY|O_CREAT|O_CLOEXEC, 0600);
+
+  if (fd == -1 || close (fd) == -1) {
+    perror (path);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *r, *w;
+  pthread_t reader;
+  int err;
+
+  if (atexit (cleanup) != 0) {
+    perror ("atexit");
+    exit (EXIT_FAILURE);
+  }
+  if ((script_fd = mkstemp (script)) == -1 ||
+      (data_fd = mkstemp (data)) == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  if (mkdtemp (dir) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+  have_dir = true;
+  snprintf (witness, sizeof witness, "%s/witness", dir);
+  snprintf (started, sizeof started, "%s/started", dir);
+  snprintf (writable, sizeof writable, "%s/writable", dir);
+  if (ftruncate (data_fd, EXPORTSIZE) == -1) {
+    perror ("ftruncate");
+    exit (EXIT_FAILURE);
+  }
+
+  if (dprintf (script_fd, "case $1 in\n"
+               "  get_size) echo %d ;;\n"
+               "  can_write) test -e %s && exit 0; exit 3 ;;\n"
+               "  pread)\n"
+               "    dd if=%s of=$tmpdir/buf skip=$4 count=$3 \\\n"
+               "       iflag=skip_bytes,count_bytes status=none || exit 1\n"
+               "    touch %s\n"
+               "    while test -e %s; do sleep 1; done\n"
+               "    cat $tmpdir/buf ;;\n"
+               "  pwrite)\n"
+               "    dd of=%s seek=$4 oflag=seek_bytes conv=notrunc \\\n"
+               "       status=none ;;\n"
+               "  *) exit 2 ;;\n"
+               "esac\n",
+               EXPORTSIZE, writable, data, started, witness, data) < 0) {
+    perror ("dprintf");
+    exit (EXIT_FAILURE);
+  }
+  if (fchmod (script_fd, 0700) == -1) {
+    perror ("fchmod");
+    exit (EXIT_FAILURE);
+  }
+  if (close (script_fd) == -1) {  /* Unlinked later during atexit */
+    perror ("close");
+    exit (EXIT_FAILURE);
+  }
+  script_fd = -2;
+
+  /* Only the read only handle answers reads from the cache. */
+  r = connect_export ();
+  touch (writable);
+  w = connect_export ();
+  if (nbd_is_read_only (r) != 1 || nbd_is_read_only (w) != 0) {
+    fprintf (stderr, "%s: unexpected read only flags\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Hold back the reply to a read in one thread, write to the same
+   * range in this thread, then let the read complete.
+   */
+  touch (witness);
+  err = pthread_create (&reader, NULL, start_reader, r);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  while (access (started, F_OK) == -1)
+    usleep (10000);
+  memset (wbuf, 'x', sizeof wbuf);
+  if (nbd_pwrite (w, wbuf, sizeof wbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  unlink (witness);
+  err = pthread_join (reader, NULL);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_join");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The read returned the old data, which must not have been cached. */
+  if (nbd_pread (r, rbuf, sizeof rbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, sizeof rbuf) != 0) {
+    fprintf (stderr, "%s: stale data was read from the cache\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (w);
+  nbd_close (r);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,183 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that handles using nbd_set_shared_cache share the blocks they
+ * read.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static char buf[65536];
+
+static struct nbd_handle *
+connect_export (const char *plugin, bool readonly)
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-r",
+                   (char *) plugin, "size=1M", NULL };
+
+  if (!readonly) {
+    args[3] = args[4];
+    args[4] = args[5];
+    args[5] = NULL;
+  }
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_shared_cache (nbd, true) == -1 ||
+      nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+/* Read count bytes at offset and return how many bytes the server
+ * sent for it.
+ */
+static int64_t
+pread_received (struct nbd_handle *nbd, size_t count, uint64_t offset)
+{
+  int64_t before, after;
+
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (before = nbd_get_stats_bytes_received (nbd)) == -1 ||
+      nbd_pread (nbd, buf, count, offset, 0) == -1 ||
+      nbd_stats_snapshot (nbd) == -1 ||
+      (after = nbd_get_stats_bytes_received (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return after - before;
+}
+
+/* Check buf holds count bytes at offset of the pattern plugin. */
+static void
+check_pattern (const char *progname, size_t count, uint64_t offset)
+{
+  size_t i;
+  uint64_t pos;
+  unsigned char expected;
+
+  /* Each 8 byte word holds its offset in big endian. */
+  for (i = 0; i < count; ++i) {
+    pos = offset + i;
+    expected = (pos & ~UINT64_C (7)) >> (56 - 8 * (pos & 7));
+    if ((unsigned char) buf[i] != expected) {
+      fprintf (stderr, "%s: wrong data at offset %" PRIu64 "\n",
+               progname, pos);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+check_cached (const char *progname, struct nbd_handle *nbd,
+              size_t count, uint64_t offset, bool cached)
+{
+  int64_t r = pread_received (nbd, count, offset);
+
+  if ((r == 0) != cached) {
+    fprintf (stderr, "%s: read of %zu bytes at %" PRIu64 " should%s have "
+             "been answered from the cache\n", progname, count, offset,
+             cached ? "" : " not");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *a, *b, *w;
+
+  if (nbd_shared_cache_get_size () != 64 * 1024 * 1024) {
+    fprintf (stderr, "%s: unexpected default size\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  a = nbd_create ();
+  if (a == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_shared_cache (a) != false) {
+    fprintf (stderr, "%s: the cache should not be used by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (a);
+
+  /* Blocks read by one handle are not read again by another handle
+   * connected to the same export.
+   */
+  a = connect_export ("pattern", true);
+  b = connect_export ("pattern", true);
+  check_cached (argv[0], a, sizeof buf, 0, false);
+  check_pattern (argv[0], sizeof buf, 0);
+  check_cached (argv[0], b, sizeof buf, 0, true);
+  check_pattern (argv[0], sizeof buf, 0);
+  check_cached (argv[0], b, 100, 1000, true);
+  check_pattern (argv[0], 100, 1000);
+  check_cached (argv[0], b, 4096, sizeof buf, false);
+
+  /* Invalidated blocks are read again. */
+  if (nbd_shared_cache_invalidate (b, 1, 4096) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_cached (argv[0], a, 4096, 0, true);
+  check_cached (argv[0], a, 4096, 4096, false);
+  check_cached (argv[0], b, 4096, 4096, true);
+  check_pattern (argv[0], 4096, 4096);
+
+  /* A size of 0 empties the cache. */
+  if (nbd_shared_cache_set_size (0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_cached (argv[0], a, 4096, 0, false);
+  check_cached (argv[0], b, 4096, 0, false);
+  if (nbd_shared_cache_set_size (1024 * 1024) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_cached (argv[0], a, 4096, 0, false);
+  check_cached (argv[0], b, 4096, 0, true);
+
+  /* Reads on writable exports are always sent to the server. */
+  w = connect_export ("memory", false);
+  check_cached (argv[0], w, 4096, 0, false);
+  check_cached (argv[0], w, 4096, 0, false);
+
+  nbd_close (w);
+  nbd_close (b);
+  nbd_close (a);
+  exit (EXIT_SUCCESS);
+}
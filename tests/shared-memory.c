@@ -0,0 +1,100 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test offering the shared memory transport to a server which does
+ * not support it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static char *args[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1M", NULL };
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char wbuf[512], rbuf[512];
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_shared_memory_size (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: unexpected default size\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Sizes which are not a power of 2 or are out of range fail. */
+  if (nbd_set_shared_memory_size (nbd, 100000) != -1 ||
+      nbd_get_errno () != EINVAL ||
+      nbd_set_shared_memory_size (nbd, 4096) != -1 ||
+      nbd_get_errno () != EINVAL ||
+      nbd_set_shared_memory_size (nbd, UINT64_C (1) << 31) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: test failed: bad sizes were accepted\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_shared_memory_size (nbd, 1024 * 1024) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_shared_memory_size (nbd) != 1024 * 1024) {
+    fprintf (stderr, "%s: test failed: size was not set\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* nbdkit refuses the option, so the connection carries on over the
+   * socket.
+   */
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_shared_memory_negotiated (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: "
+             "shared memory transport was negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  memset (wbuf, 0x55, sizeof wbuf);
+  if (nbd_pwrite (nbd, wbuf, sizeof wbuf, 0, 0) == -1 ||
+      nbd_pread (nbd, rbuf, sizeof rbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (wbuf, rbuf, sizeof wbuf) != 0) {
+    fprintf (stderr, "%s: test failed: data read back is different\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
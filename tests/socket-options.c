@@ -0,0 +1,123 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test setting options of the socket used to connect. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <libnbd.h>
+
+#define SNDBUF 16384
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent", "null", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Check the defaults. */
+  if (nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_NODELAY) != 1 ||
+      nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_SNDBUF) != 0 ||
+      nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_BUSY_POLL) != 0) {
+    fprintf (stderr, "unexpected default socket options\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Invalid options and values are rejected. */
+  if (nbd_set_socket_option (nbd, 99, 1) != -1 ||
+      nbd_get_socket_option (nbd, 99) != -1) {
+    fprintf (stderr, "an invalid socket option should be rejected\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_socket_option (nbd, LIBNBD_SOCKET_OPTION_RCVBUF, -1) != -1) {
+    fprintf (stderr, "a negative socket option value should be rejected\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "unexpected errno: %d\n", nbd_get_errno ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_socket_option (nbd, LIBNBD_SOCKET_OPTION_SNDBUF,
+                             SNDBUF) == -1 ||
+      nbd_set_socket_option (nbd, LIBNBD_SOCKET_OPTION_PRIORITY, 1) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_SNDBUF) != SNDBUF) {
+    fprintf (stderr, "socket option was not set\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* The options cannot be changed once connected. */
+  if (nbd_set_socket_option (nbd, LIBNBD_SOCKET_OPTION_SNDBUF,
+                             SNDBUF) != -1) {
+    fprintf (stderr, "setting a socket option after connecting "
+             "should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef __linux__
+  {
+    /* Linux doubles the size which was asked for, but it is much
+     * smaller than the default.
+     */
+    int fd, sndbuf;
+    socklen_t len = sizeof sndbuf;
+
+    fd = nbd_aio_get_fd (nbd);
+    if (fd == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (getsockopt (fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1) {
+      perror ("getsockopt");
+      exit (EXIT_FAILURE);
+    }
+    if (sndbuf < SNDBUF || sndbuf > 4 * SNDBUF) {
+      fprintf (stderr, "SO_SNDBUF was not applied: %d\n", sndbuf);
+      exit (EXIT_FAILURE);
+    }
+  }
+#endif
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,160 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test splitting requests larger than the maximum request size. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define MAX_REQUEST 65536
+#define SIZE 300001
+#define OFFSET 1000
+
+static char wbuf[SIZE], rbuf[SIZE];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int64_t cookie;
+  size_t i;
+  int r;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_split_requests (nbd) != 0) {
+    fprintf (stderr, "%s: requests should not be split by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_max_request_size (nbd, MAX_REQUEST) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < SIZE; ++i)
+    wbuf[i] = i * 7 + 1;
+
+  /* Without splitting, large requests are rejected. */
+  if (nbd_pwrite (nbd, wbuf, SIZE, OFFSET, 0) != -1 ||
+      nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "%s: expected large write to fail with ERANGE\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_split_requests (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_split_requests (nbd) != 1) {
+    fprintf (stderr, "%s: split requests not enabled\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Synchronous split write and read. */
+  if (nbd_pwrite (nbd, wbuf, SIZE, OFFSET, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, rbuf, SIZE, OFFSET, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, SIZE) != 0) {
+    fprintf (stderr, "%s: data mismatch after synchronous read\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Asynchronous split read completes once with one cookie. */
+  memset (rbuf, 0, SIZE);
+  cookie = nbd_aio_pread (nbd, rbuf, SIZE, OFFSET,
+                          (nbd_completion_callback) { .callback = completion },
+                          0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while ((r = nbd_aio_command_completed (nbd, cookie)) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (completions != 1) {
+    fprintf (stderr, "%s: completion callback called %u times\n",
+             argv[0], completions);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_in_flight (nbd) != 0) {
+    fprintf (stderr, "%s: commands still in flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, SIZE) != 0) {
+    fprintf (stderr, "%s: data mismatch after asynchronous read\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* A failing piece fails the whole request. */
+  if (nbd_pread (nbd, rbuf, SIZE, 1024 * 1024 - SIZE / 2, 0) != -1) {
+    fprintf (stderr, "%s: expected read beyond end of disk to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
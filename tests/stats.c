@@ -0,0 +1,161 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the handle statistics. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static char buf[512];
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=1m", NULL };
+  int64_t n, sent, received, total;
+  unsigned i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Before the first snapshot the statistics cannot be read. */
+  if (nbd_get_stats_bytes_sent (nbd) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "reading statistics without a snapshot "
+             "should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 10; ++i) {
+    if (nbd_pwrite (nbd, buf, sizeof buf, i * sizeof buf, 0) == -1 ||
+        nbd_pread (nbd, buf, sizeof buf, i * sizeof buf, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  /* Reading beyond the end of the export fails. */
+  if (nbd_pread (nbd, buf, sizeof buf, 1024 * 1024, 0) != -1) {
+    fprintf (stderr, "reading beyond the end should fail\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_stats_snapshot (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  sent = nbd_get_stats_bytes_sent (nbd);
+  received = nbd_get_stats_bytes_received (nbd);
+  if (sent < 10 * sizeof buf || received < 10 * sizeof buf) {
+    fprintf (stderr, "unexpected byte counts: sent %" PRIi64
+             " received %" PRIi64 "\n", sent, received);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_stats_commands (nbd, LIBNBD_CMD_READ) != 11 ||
+      nbd_get_stats_commands (nbd, LIBNBD_CMD_WRITE) != 10 ||
+      nbd_get_stats_commands (nbd, LIBNBD_CMD_FLUSH) != 0) {
+    fprintf (stderr, "unexpected command counts\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_errors (nbd, 0) != 1 ||
+      nbd_get_stats_errors (nbd, EINVAL) != 1) {
+    fprintf (stderr, "unexpected error counts\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_max_in_flight (nbd) != 1) {
+    fprintf (stderr, "unexpected number of commands in flight\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The histogram counts every read, and the percentiles are
+   * powers of 2 which grow with the percentile.
+   */
+  total = 0;
+  for (i = 0; i < 32; ++i) {
+    n = nbd_get_stats_latency (nbd, LIBNBD_CMD_READ, i);
+    if (n == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    total += n;
+  }
+  if (total != 11) {
+    fprintf (stderr, "unexpected latency histogram total: %" PRIi64 "\n",
+             total);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_latency (nbd, LIBNBD_CMD_READ, 32) != -1) {
+    fprintf (stderr, "a latency bucket out of range should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  n = nbd_get_stats_latency_percentile (nbd, LIBNBD_CMD_READ, 50);
+  if (n < 2 || (n & (n - 1)) != 0 ||
+      nbd_get_stats_latency_percentile (nbd, LIBNBD_CMD_READ, 100) < n) {
+    fprintf (stderr, "unexpected latency percentile: %" PRIi64 "\n", n);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_latency_percentile (nbd, LIBNBD_CMD_FLUSH, 99) != 0) {
+    fprintf (stderr, "latency percentile with no commands should be 0\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The snapshot does not change until the next one is taken. */
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_commands (nbd, LIBNBD_CMD_READ) != 11 ||
+      nbd_get_stats_bytes_received (nbd) != received) {
+    fprintf (stderr, "the snapshot changed\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_stats_snapshot (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_stats_commands (nbd, LIBNBD_CMD_READ) != 12) {
+    fprintf (stderr, "the snapshot was not updated\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
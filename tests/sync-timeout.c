@@ -0,0 +1,213 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_timeout and nbd_aio_cancel. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <libnbd.h>
+
+#define TIMEOUT 500 /* milliseconds */
+
+static char buf[512];
+
+static void
+check (int experr, const char *prefix)
+{
+  const char *msg = nbd_get_error ();
+  int errnum = nbd_get_errno ();
+
+  fprintf (stderr, "error: \"%s\"\n", msg);
+  fprintf (stderr, "errno: %d (%s)\n", errnum, strerror (errnum));
+  if (strncmp (msg, prefix, strlen (prefix)) != 0) {
+    fprintf (stderr, "unexpected error prefix, expected \"%s\"\n", prefix);
+    exit (EXIT_FAILURE);
+  }
+  if (errnum != experr) {
+    fprintf (stderr, "unexpected errno, expected %d (%s)\n",
+             experr, strerror (experr));
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int sv[2];
+  int64_t cookie1, cookie2;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "--filter=delay", "memory", "size=1m",
+                        "delay-read=10", NULL };
+  const char *cmd_nodelay[] = { "nbdkit", "-s", "--exit-with-parent",
+                                "memory", "size=1m", NULL };
+
+  /* A connection to a server which never speaks times out. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_timeout (nbd) != -1) {
+    fprintf (stderr, "%s: expected no timeout by default\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_timeout (nbd, -2) != -1) {
+    fprintf (stderr, "%s: setting an invalid timeout should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (EINVAL, "nbd_set_timeout: ");
+  if (nbd_set_timeout (nbd, 0) != -1) {
+    fprintf (stderr, "%s: setting a timeout of 0 should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (EINVAL, "nbd_set_timeout: ");
+  if (nbd_get_timeout (nbd) != -1) {
+    fprintf (stderr, "%s: a rejected timeout should not be set\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_timeout (nbd, TIMEOUT) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror ("socketpair");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_socket (nbd, sv[0]) != -1) {
+    fprintf (stderr, "%s: connecting should have timed out\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (ETIMEDOUT, "nbd_connect_socket: ");
+  if (nbd_aio_is_dead (nbd) != 1) {
+    fprintf (stderr, "%s: expected the handle to be dead\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  close (sv[1]);
+
+  /* A read which the server is slow to answer times out. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_timeout (nbd, TIMEOUT) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) != -1) {
+    fprintf (stderr, "%s: read should have timed out\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (ETIMEDOUT, "nbd_pread: ");
+  /* The request was sent, so the connection had to be closed. */
+  if (nbd_aio_is_dead (nbd) != 1) {
+    fprintf (stderr, "%s: expected the handle to be dead\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* Commands queued during a batch can be cancelled. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd_nodelay) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  cookie1 = nbd_aio_pread (nbd, buf, sizeof buf, 0, NBD_NULL_COMPLETION, 0);
+  if (cookie1 == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  cookie2 = nbd_aio_pwrite (nbd, buf, sizeof buf, 0, NBD_NULL_COMPLETION, 0);
+  if (cookie2 == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_cancel (nbd, cookie2 + 1000) != -1) {
+    fprintf (stderr, "%s: cancelling an unknown cookie should fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (EINVAL, "nbd_aio_cancel: ");
+  if (nbd_aio_cancel (nbd, cookie2) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_in_flight (nbd) != 1) {
+    fprintf (stderr, "%s: expected one command in flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_command_completed (nbd, cookie2) != -1) {
+    fprintf (stderr, "%s: expected the cancelled command to fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (ECANCELED, "nbd_aio_command_completed: ");
+
+  /* Once sent, the read cannot be cancelled. */
+  if (nbd_aio_cancel (nbd, cookie1) != -1) {
+    fprintf (stderr, "%s: cancelling a sent command should fail\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  check (EBUSY, "nbd_aio_cancel: ");
+  while (nbd_aio_command_completed (nbd, cookie1) == 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* A timeout which does not expire has no effect. */
+  if (nbd_set_timeout (nbd, 60000) == -1 ||
+      nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,141 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the trace buffer. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define TRACE_SIZE 32
+
+static unsigned records, debug_messages;
+static bool seen_submit, seen_complete;
+
+static int
+debug_fn (void *user_data, const char *context, const char *msg)
+{
+  if (strncmp (msg, "trace: ", 7) != 0) {
+    debug_messages++;
+    return 0;
+  }
+  records++;
+  if (strstr (msg, "submit read cookie=") && strstr (msg, "count=512"))
+    seen_submit = true;
+  if (strstr (msg, "complete read cookie=") && strstr (msg, "error=none"))
+    seen_complete = true;
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char buf[512];
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  /* Debugging stays off, so only trace records should arrive. */
+  if (nbd_set_debug (nbd, false) == -1 ||
+      nbd_set_debug_callback (nbd,
+                              (nbd_debug_callback) { .callback = debug_fn })
+      == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_trace_size (nbd) != 0 && getenv ("LIBNBD_TRACE") == NULL) {
+    fprintf (stderr, "%s: tracing should be disabled by default\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_trace_size (nbd, 1 << 30) != -1 || nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "%s: setting an oversize trace buffer should fail\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_trace_size (nbd, TRACE_SIZE) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_trace_size (nbd) != TRACE_SIZE) {
+    fprintf (stderr, "%s: unexpected trace size\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Connecting makes many more transitions than fit in the buffer. */
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, sizeof buf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (records != 0) {
+    fprintf (stderr, "%s: trace was printed before it was dumped\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_dump_trace (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (records != TRACE_SIZE) {
+    fprintf (stderr, "%s: expected %d trace records, got %u\n",
+             argv[0], TRACE_SIZE, records);
+    exit (EXIT_FAILURE);
+  }
+  if (!seen_submit || !seen_complete) {
+    fprintf (stderr, "%s: the read command was not traced\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (debug_messages != 0) {
+    fprintf (stderr, "%s: unexpected debug messages\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Disabling tracing discards the records. */
+  records = 0;
+  if (nbd_set_trace_size (nbd, 0) == -1 || nbd_dump_trace (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (records != 0) {
+    fprintf (stderr, "%s: trace was printed after it was disabled\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,119 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that the export size, flags and number of commands in flight
+ * can be read while another thread is blocked in nbd_poll.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+/* How long the poll thread blocks.  The getters must return well
+ * before this.
+ */
+#define POLL_TIMEOUT 3000 /* milliseconds */
+
+static struct nbd_handle *nbd;
+
+static void *
+poll_thread (void *arg)
+{
+  if (nbd_poll (nbd, POLL_TIMEOUT) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t thread;
+  double start, elapsed;
+  int err;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Nothing is in flight, so this thread will sit in poll until it
+   * times out.
+   */
+  err = pthread_create (&thread, NULL, poll_thread, NULL);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  usleep (200 * 1000);
+
+  start = now ();
+  if (nbd_get_size (nbd) != 1024 * 1024) {
+    fprintf (stderr, "%s: unexpected export size\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_is_read_only (nbd) != 0 || nbd_can_flush (nbd) == -1 ||
+      nbd_can_trim (nbd) == -1 || nbd_can_multi_conn (nbd) == -1) {
+    fprintf (stderr, "%s: unexpected export flags\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_block_size (nbd, LIBNBD_SIZE_PREFERRED) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_in_flight (nbd) != 0) {
+    fprintf (stderr, "%s: unexpected commands in flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  elapsed = now () - start;
+  if (elapsed > POLL_TIMEOUT / 1000.0 / 2) {
+    fprintf (stderr, "%s: getters waited %g seconds for the poll thread\n",
+             argv[0], elapsed);
+    exit (EXIT_FAILURE);
+  }
+
+  pthread_join (thread, NULL);
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
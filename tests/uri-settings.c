@@ -0,0 +1,145 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test performance settings in NBD URIs, see
+ * nbd_set_uri_allow_settings(3).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+static const char *settings =
+  "&max-request-size=65536&max-depth=8&sndbuf=131072&rcvbuf=262144"
+  "&pread-initialize=no";
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  struct nbd_group *g;
+  char uri[512];
+  int i;
+
+  if (argc != 2) {
+    fprintf (stderr, "%s socket\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Settings are denied by default. */
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_supports_uri (nbd) != 1) {
+    fprintf (stderr, "skip: compiled without URI support\n");
+    exit (77);
+  }
+  snprintf (uri, sizeof uri, "nbd+unix:///?socket=%s&max-depth=8", argv[1]);
+  if (nbd_connect_uri (nbd, uri) != -1 || nbd_get_errno () != EPERM) {
+    fprintf (stderr, "%s: expected EPERM for a setting not allowed\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* Bad values are rejected. */
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_uri_allow_settings (nbd, LIBNBD_ALLOW_SETTING_DEPTH) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  snprintf (uri, sizeof uri, "nbd+unix:///?socket=%s&max-depth=-1", argv[1]);
+  if (nbd_connect_uri (nbd, uri) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: expected EINVAL for a bad value\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* All the settings are applied when allowed. */
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_uri_allow_settings (nbd,
+                                  LIBNBD_ALLOW_SETTING_REQUEST_SIZE |
+                                  LIBNBD_ALLOW_SETTING_DEPTH |
+                                  LIBNBD_ALLOW_SETTING_SOCKET_BUFFERS |
+                                  LIBNBD_ALLOW_SETTING_PREAD_INITIALIZE |
+                                  LIBNBD_ALLOW_SETTING_CONNECTIONS) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  snprintf (uri, sizeof uri, "nbd+unix:///?socket=%s%s", argv[1], settings);
+  if (nbd_connect_uri (nbd, uri) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_max_request_size (nbd) != 65536 ||
+      nbd_get_adaptive_depth (nbd) != 8 ||
+      nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_SNDBUF) != 131072 ||
+      nbd_get_socket_option (nbd, LIBNBD_SOCKET_OPTION_RCVBUF) != 262144 ||
+      nbd_get_pread_initialize (nbd) != 0) {
+    fprintf (stderr, "%s: settings from the URI were not applied\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The group gets the number of connections from the URI, and the
+   * new handles get the settings.
+   */
+  g = nbd_group_create_from (nbd, 1);
+  nbd_shutdown (nbd, 0);
+  nbd_close (nbd);
+  if (g == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  snprintf (uri, sizeof uri, "nbd+unix:///?socket=%s&connections=3%s",
+            argv[1], settings);
+  if (nbd_group_connect_uri (g, uri) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_group_get_nr_handles (g) != 3) {
+    fprintf (stderr, "%s: expected 3 handles, got %d\n",
+             argv[0], nbd_group_get_nr_handles (g));
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < 3; ++i) {
+    nbd = nbd_group_get_handle (g, i);
+    if (nbd == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_aio_is_ready (nbd) != 1 ||
+        nbd_get_adaptive_depth (nbd) != 8) {
+      fprintf (stderr, "%s: handle %d was not set up from the URI\n",
+               argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+  nbd_group_shutdown (g, 0);
+  nbd_group_close (g);
+
+  exit (EXIT_SUCCESS);
+}
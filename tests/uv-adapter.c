@@ -0,0 +1,147 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the libuv adapter in libnbd-uv.h: connect two handles and
+ * read from both using the same loop, then close them.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libnbd-uv.h>
+
+#define NR_HANDLES 2
+#define NR_COMMANDS 32
+
+static const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent", "-v",
+                             "memory", "size=1m", NULL };
+
+struct conn {
+  struct nbd_uv u;
+  bool started;
+  unsigned retired;
+  char buf[NR_COMMANDS][512];
+};
+
+static struct conn conns[NR_HANDLES];
+static uv_timer_t timeout;
+static unsigned nr_closed;
+
+static int
+completed (void *user_data, int64_t cookie, int error)
+{
+  struct conn *c = user_data;
+
+  if (error != 0) {
+    fprintf (stderr, "uv-adapter: command failed\n");
+    exit (EXIT_FAILURE);
+  }
+  c->retired++;
+  return 0;
+}
+
+static void
+closed (struct nbd_uv *u)
+{
+  if (++nr_closed == NR_HANDLES)
+    uv_close ((uv_handle_t *) &timeout, NULL);
+}
+
+/* Called once in each iteration in which the handle was driven. */
+static void
+dispatch (struct nbd_uv *u)
+{
+  struct conn *c = u->data;
+  size_t i;
+
+  if (nbd_aio_is_dead (u->nbd) || nbd_aio_is_closed (u->nbd)) {
+    fprintf (stderr, "uv-adapter: connection failed: %s\n",
+             nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (!c->started) {
+    if (!nbd_aio_is_ready (u->nbd))
+      return;
+    for (i = 0; i < NR_COMMANDS; ++i) {
+      if (nbd_aio_pread (u->nbd, c->buf[i], sizeof c->buf[i], i * 512,
+                         NBD_NULL_COMPLETION, 0) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+    c->started = true;
+  }
+
+  if (nbd_aio_get_completions (u->nbd, NR_COMMANDS,
+                               (nbd_completed_callback) {
+                                 .callback = completed,
+                                 .user_data = c }) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (c->retired == NR_COMMANDS)
+    nbd_uv_close (u, closed);
+}
+
+static void
+timed_out (uv_timer_t *timer)
+{
+  fprintf (stderr, "uv-adapter: test timed out\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  uv_loop_t *loop = uv_default_loop ();
+  struct nbd_handle *nbd;
+  size_t i;
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd = nbd_create ();
+    if (nbd == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_uv_init (loop, &conns[i].u, nbd, dispatch) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    conns[i].u.data = &conns[i];
+    if (nbd_aio_connect_command (nbd, (char **) cmd) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* The loop runs until the adapters and the timer are all closed. */
+  uv_timer_init (loop, &timeout);
+  uv_timer_start (&timeout, timed_out, 60000, 0);
+  uv_run (loop, UV_RUN_DEFAULT);
+
+  if (nr_closed != NR_HANDLES) {
+    fprintf (stderr, "uv-adapter: loop stopped early\n");
+    exit (EXIT_FAILURE);
+  }
+  uv_loop_close (loop);
+  exit (EXIT_SUCCESS);
+}
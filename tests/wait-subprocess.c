@@ -0,0 +1,95 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_aio_shutdown and nbd_set_wait_subprocess. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  time_t start;
+  /* The subprocess keeps running for a while after the server has
+   * gone.
+   */
+  const char *cmd[] = {
+    "sh", "-c",
+    "nbdkit -s --exit-with-parent memory size=1m; sleep 10",
+    NULL
+  };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_wait_subprocess (nbd) != 1) {
+    fprintf (stderr, "%s: expected nbd_close to wait by default\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Shutting down an unconnected handle does nothing. */
+  if (nbd_aio_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_set_wait_subprocess (nbd, false) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_aio_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  /* Calling it again is harmless. */
+  if (nbd_aio_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (!nbd_aio_is_closed (nbd) && !nbd_aio_is_dead (nbd)) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_is_closed (nbd) != 1) {
+    fprintf (stderr, "%s: expected the handle to be closed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  start = time (NULL);
+  nbd_close (nbd);
+  if (time (NULL) - start >= 5) {
+    fprintf (stderr, "%s: nbd_close waited for the subprocess\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,134 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_write_behind. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_WRITES 64
+#define BLOCK 4096
+
+static char buf[BLOCK];
+
+static struct nbd_handle *
+connect_server (const char **cmd)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_write_behind (nbd, true) == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+/* Issue the writes, reusing buf each time. */
+static void
+write_all (struct nbd_handle *nbd)
+{
+  int i;
+
+  for (i = 0; i < NR_WRITES; ++i) {
+    memset (buf, i + 1, sizeof buf);
+    if (nbd_aio_pwrite (nbd, buf, sizeof buf, i * BLOCK,
+                        NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  memset (buf, 0, sizeof buf);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+  const char *cmd_error[] = { "nbdkit", "-s", "--exit-with-parent",
+                              "--filter=error", "memory", "size=1m",
+                              "error-pwrite=EIO", "error-pwrite-rate=100%",
+                              NULL };
+  int i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_write_behind (nbd) != 0) {
+    fprintf (stderr, "%s: expected write-behind to be off by default\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  /* The writes get the data from when they were issued, and the
+   * flush waits for them.
+   */
+  nbd = connect_server (cmd);
+  write_all (nbd);
+  if (nbd_flush (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_WRITES; ++i) {
+    if (nbd_pread (nbd, buf, sizeof buf, i * BLOCK, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (buf[0] != i + 1 || buf[BLOCK-1] != i + 1) {
+      fprintf (stderr, "%s: block %d has the wrong data\n", argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_in_flight (nbd) != 0) {
+    fprintf (stderr, "%s: write-behind writes were not retired\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  nbd_shutdown (nbd, 0);
+  nbd_close (nbd);
+
+  /* Failed writes are reported by the next flush, and only once. */
+  nbd = connect_server (cmd_error);
+  write_all (nbd);
+  if (nbd_flush (nbd, 0) != -1 || nbd_get_errno () != EIO) {
+    fprintf (stderr, "%s: expected the flush to fail with EIO\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_flush (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_shutdown (nbd, 0);
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,188 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that blocks of zeroes in writes are sent as zero requests
+ * when nbd_set_zero_detection is used.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define SIZE (1024 * 1024)
+
+static char ones[SIZE], buf[SIZE], rbuf[SIZE];
+
+static int64_t
+bytes_sent (struct nbd_handle *nbd)
+{
+  int64_t r;
+
+  if (nbd_stats_snapshot (nbd) == -1 ||
+      (r = nbd_get_stats_bytes_sent (nbd)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+/* Fill the export with non-zero bytes, write buf at offset with zero
+ * detection on, and check that it reads back correctly and that
+ * fewer than max bytes were sent.
+ */
+static void
+test_write (struct nbd_handle *nbd, const char *what,
+            size_t count, uint64_t offset, uint32_t flags, int64_t max)
+{
+  int64_t sent;
+
+  if (nbd_set_zero_detection (nbd, 0) == -1 ||
+      nbd_pwrite (nbd, ones, SIZE, 0, 0) == -1 ||
+      nbd_pwrite (nbd, ones, SIZE, SIZE, 0) == -1 ||
+      nbd_pwrite (nbd, ones, SIZE, 2 * SIZE, 0) == -1 ||
+      nbd_set_zero_detection (nbd, 4096) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  sent = bytes_sent (nbd);
+  if (nbd_pwrite (nbd, buf, count, offset, flags) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  sent = bytes_sent (nbd) - sent;
+  if (sent >= max) {
+    fprintf (stderr, "%s: sent %" PRIi64 " bytes, expected fewer than %"
+             PRIi64 "\n", what, sent, max);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_pread (nbd, rbuf, count, offset, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, buf, count) != 0) {
+    fprintf (stderr, "%s: data read back is different\n", what);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, rbuf, 512, offset + count, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, ones, 512) != 0) {
+    fprintf (stderr, "%s: data after the write was changed\n", what);
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char *args[] = { "nbdkit", "-s", "--exit-with-parent",
+                   "memory", "size=4M", NULL };
+  int64_t sent;
+
+  memset (ones, 1, SIZE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_zero_detection (nbd) != 0) {
+    fprintf (stderr, "zero detection should be off by default\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_zero_detection (nbd, 256) != -1 ||
+      nbd_get_errno () != EINVAL ||
+      nbd_set_zero_detection (nbd, 4000) != -1 ||
+      nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "invalid block sizes should fail with EINVAL\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_command (nbd, args) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* A buffer of zeroes with a few bytes of data, in a block at the
+   * start, one in the middle and a partial block at the end.
+   */
+  buf[10] = 1;
+  buf[SIZE / 2 + 4095] = 2;
+  buf[SIZE - 100] = 3;
+  test_write (nbd, "aligned write", SIZE - 512, 0, 0, 64 * 1024);
+
+  /* The blocks are aligned within the export, so an unaligned write
+   * starts and ends with data.
+   */
+  test_write (nbd, "unaligned write", SIZE - 4096, 1000, 0, 64 * 1024);
+
+  /* All zeroes, with holes forbidden. */
+  memset (buf, 0, SIZE);
+  test_write (nbd, "zero write", SIZE, SIZE, LIBNBD_CMD_FLAG_NO_HOLE, 4096);
+
+  /* Data which is not zero is sent as it is. */
+  memset (buf, 4, SIZE);
+  test_write (nbd, "data write", SIZE, 0, 0, SIZE + 4096);
+
+  /* Without zero detection, the whole buffer is sent. */
+  memset (buf, 0, SIZE);
+  if (nbd_set_zero_detection (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  sent = bytes_sent (nbd);
+  if (nbd_pwrite (nbd, buf, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (bytes_sent (nbd) - sent < SIZE) {
+    fprintf (stderr, "write without zero detection sent too little\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* With split requests, long runs of data are still split but runs
+   * of zeroes are not.
+   */
+  if (nbd_set_max_request_size (nbd, 64 * 1024) == -1 ||
+      nbd_set_split_requests (nbd, true) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  memset (buf, 5, SIZE / 2);
+  test_write (nbd, "split write", SIZE, 512, 0, SIZE / 2 + 64 * 1024);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,183 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test zero-copy sends of large write payloads.  This uses TCP,
+ * since zero-copy sends are not supported on Unix domain sockets.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#define PIDFILE "zerocopy.pid"
+
+#define NR_WRITES 8
+#define WRITE_SIZE (1024 * 1024)
+#define THRESHOLD (256 * 1024)
+
+static char wbuf[NR_WRITES][WRITE_SIZE], rbuf[WRITE_SIZE];
+static char small[512];
+static unsigned completions;
+
+static int
+completion (void *user_data, int *error)
+{
+  if (*error != 0) {
+    fprintf (stderr, "unexpected error in completion callback: %s\n",
+             strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  completions++;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int port;
+  char port_str[16];
+  pid_t pid;
+  size_t i;
+
+  unlink (PIDFILE);
+
+  /* Pick a port at random, hope it's free. */
+  srand (time (NULL) + getpid ());
+  port = 32768 + (rand () & 32767);
+
+  snprintf (port_str, sizeof port_str, "%d", port);
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execlp ("nbdkit",
+            "nbdkit", "-f", "-p", port_str, "-P", PIDFILE,
+            "--exit-with-parent", "memory", "size=16M", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* Wait for nbdkit to start listening. */
+  for (i = 0; i < 60; ++i) {
+    if (access (PIDFILE, F_OK) == 0)
+      break;
+    sleep (1);
+  }
+  unlink (PIDFILE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_zerocopy_threshold (nbd) != 0) {
+    fprintf (stderr, "zero-copy sends should be disabled by default\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_zerocopy_threshold (nbd, UINT64_C (1) << 32) != -1 ||
+      nbd_get_errno () != ERANGE) {
+    fprintf (stderr, "setting an out of range threshold should fail\n");
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_zerocopy_threshold (nbd, THRESHOLD) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_zerocopy_threshold (nbd) != THRESHOLD) {
+    fprintf (stderr, "unexpected zero-copy threshold\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_connect_tcp (nbd, "localhost", port_str) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Issue several large writes at once, with small writes between
+   * them which are sent by copying.
+   */
+  for (i = 0; i < NR_WRITES; ++i) {
+    memset (wbuf[i], 'a' + i, WRITE_SIZE);
+    if (nbd_aio_pwrite (nbd, wbuf[i], WRITE_SIZE, i * WRITE_SIZE,
+                        (nbd_completion_callback) { .callback = completion },
+                        0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    memset (small, 'A' + i, sizeof small);
+    if (nbd_aio_pwrite (nbd, small, sizeof small,
+                        (NR_WRITES + i) * WRITE_SIZE,
+                        (nbd_completion_callback) { .callback = completion },
+                        0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (completions != 2 * NR_WRITES) {
+    fprintf (stderr, "expected %d completions, got %u\n",
+             2 * NR_WRITES, completions);
+    exit (EXIT_FAILURE);
+  }
+
+  /* A synchronous write must also wait for its payload. */
+  memset (wbuf[0], 'z', WRITE_SIZE);
+  if (nbd_pwrite (nbd, wbuf[0], WRITE_SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_WRITES; ++i) {
+    if (nbd_pread (nbd, rbuf, WRITE_SIZE, i * WRITE_SIZE, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf, wbuf[i], WRITE_SIZE) != 0) {
+      fprintf (stderr, "data written at offset %zu was not read back\n",
+               i * WRITE_SIZE);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}